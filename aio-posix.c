@@ -18,6 +18,8 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
@@ -27,6 +29,7 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     bool is_external;
@@ -38,12 +41,30 @@ struct AioHandler
 /* The fd number threashold to switch to epoll */
 #define EPOLL_ENABLE_THRESHOLD 64
 
+/* Give the GSource one GPollFD per handler again */
+static void aio_epoll_source_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (!ctx->epoll_source) {
+        return;
+    }
+    ctx->epoll_source = false;
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+}
+
 static void aio_epoll_disable(AioContext *ctx)
 {
     ctx->epoll_available = false;
     if (!ctx->epoll_enabled) {
         return;
     }
+    aio_epoll_source_disable(ctx);
     ctx->epoll_enabled = false;
     close(ctx->epollfd);
 }
@@ -164,12 +185,52 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
     return false;
 }
 
+void aio_fetch_events(AioContext *ctx)
+{
+    if (ctx->epoll_source && ctx->epoll_pfd.revents) {
+        ctx->epoll_pfd.revents = 0;
+        aio_epoll(ctx, &ctx->epoll_pfd, 1, 0);
+    }
+}
+
+void aio_context_enable_epoll_source(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (ctx->epoll_source || !ctx->epoll_available) {
+        return;
+    }
+    if (!ctx->epoll_enabled && !aio_epoll_try_enable(ctx)) {
+        aio_epoll_disable(ctx);
+        return;
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+        }
+    }
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN;
+    ctx->epoll_pfd.revents = 0;
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    ctx->epoll_source = true;
+}
+
 #else
 
 static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
 {
 }
 
+void aio_fetch_events(AioContext *ctx)
+{
+}
+
+void aio_context_enable_epoll_source(AioContext *ctx)
+{
+}
+
 static int aio_epoll(AioContext *ctx, GPollFD *pfds,
                      unsigned npfd, int64_t timeout)
 {
@@ -207,18 +268,26 @@ void aio_set_fd_handler(AioContext *ctx,
                         bool is_external,
                         IOHandler *io_read,
                         IOHandler *io_write,
+                        AioPollFn *io_poll,
                         void *opaque)
 {
     AioHandler *node;
     bool is_new = false;
     bool deleted = false;
+    int poll_disable_change = 0;
 
     node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
-    if (!io_read && !io_write) {
+    if (!io_read && !io_write && !io_poll) {
         if (node) {
-            g_source_remove_poll(&ctx->source, &node->pfd);
+            if (!ctx->epoll_source) {
+                g_source_remove_poll(&ctx->source, &node->pfd);
+            }
+            poll_disable_change = -!node->io_poll;
+
+            /* Makes aio_epoll_update drop the fd from the epoll set */
+            node->pfd.events = 0;
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -234,18 +303,23 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        poll_disable_change = !io_poll - (node && !node->io_poll);
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_new0(AioHandler, 1);
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+            /* In epoll source mode, aio_epoll_update does the job */
+            if (!ctx->epoll_source) {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
             is_new = true;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
         node->io_write = io_write;
+        node->io_poll = io_poll;
         node->opaque = opaque;
         node->is_external = is_external;
 
@@ -253,7 +327,11 @@ void aio_set_fd_handler(AioContext *ctx,
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
     }
 
-    aio_epoll_update(ctx, node, is_new);
+    ctx->poll_disable_cnt += poll_disable_change;
+
+    if (node) {
+        aio_epoll_update(ctx, node, is_new);
+    }
     aio_notify(ctx);
     if (deleted) {
         g_free(node);
@@ -263,10 +341,11 @@ void aio_set_fd_handler(AioContext *ctx,
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             bool is_external,
-                            EventNotifierHandler *io_read)
+                            EventNotifierHandler *io_read,
+                            AioPollFn *io_poll)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier),
-                       is_external, (IOHandler *)io_read, NULL, notifier);
+    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier), is_external,
+                       (IOHandler *)io_read, NULL, io_poll, notifier);
 }
 
 bool aio_prepare(AioContext *ctx)
@@ -295,10 +374,21 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
+static void aio_dispatch_fd_handler(AioContext *ctx, IOHandler *handler,
+                                    void *opaque)
+{
+    int64_t start = get_clock();
+
+    handler(opaque);
+    ctx->stats.fd_handler_calls++;
+    ctx->stats.fd_handler_ns += get_clock() - start;
+}
+
 bool aio_dispatch(AioContext *ctx)
 {
     AioHandler *node;
     bool progress = false;
+    int64_t start;
 
     /*
      * If there are callbacks left that have been queued, we need to call them.
@@ -327,7 +417,7 @@ bool aio_dispatch(AioContext *ctx)
             (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
             aio_node_check(ctx, node->is_external) &&
             node->io_read) {
-            node->io_read(node->opaque);
+            aio_dispatch_fd_handler(ctx, node->io_read, node->opaque);
 
             /* aio_notify() does not count as progress */
             if (node->opaque != &ctx->notifier) {
@@ -338,7 +428,7 @@ bool aio_dispatch(AioContext *ctx)
             (revents & (G_IO_OUT | G_IO_ERR)) &&
             aio_node_check(ctx, node->is_external) &&
             node->io_write) {
-            node->io_write(node->opaque);
+            aio_dispatch_fd_handler(ctx, node->io_write, node->opaque);
             progress = true;
         }
 
@@ -354,7 +444,9 @@ bool aio_dispatch(AioContext *ctx)
     }
 
     /* Run our timers */
+    start = get_clock();
     progress |= timerlistgroup_run_timers(&ctx->tlg);
+    ctx->stats.timer_ns += get_clock() - start;
 
     return progress;
 }
@@ -405,15 +497,125 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+
+        /* Caller handles freeing deleted nodes.  Don't do it here. */
+    }
+
+    return progress;
+}
+
+/* run_poll_handlers:
+ * @ctx: the AioContext
+ * @max_ns: maximum time to poll for, in nanoseconds
+ *
+ * Polls for a given time.
+ *
+ * Note that ctx->walking_handlers must be incremented by the caller, so
+ * that handlers removed by the io_poll callbacks are not freed under us.
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t start_time, end_time, now;
+
+    assert(ctx->notify_me);
+    assert(ctx->walking_handlers > 0);
+    assert(ctx->poll_disable_cnt == 0);
+
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    end_time = start_time + max_ns;
+
+    do {
+        progress = run_poll_handlers_once(ctx);
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    } while (!progress && now < end_time);
+
+    ctx->stats.poll_ns += now - start_time;
+    return progress;
+}
+
+/* try_poll_mode:
+ * @ctx: the AioContext
+ * @blocking: busy polling is only attempted when blocking is true
+ *
+ * ctx->poll_ns is the current adaptive polling time; polling never
+ * extends past the next timer deadline.
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool try_poll_mode(AioContext *ctx, bool blocking)
+{
+    if (blocking && ctx->poll_max_ns && ctx->poll_disable_cnt == 0) {
+        /* See qemu_soonest_timeout() uint64_t hack */
+        int64_t max_ns = MIN((uint64_t)aio_compute_timeout(ctx),
+                             (uint64_t)ctx->poll_ns);
+
+        if (max_ns) {
+            return run_poll_handlers(ctx, max_ns);
+        }
+    }
+
+    return false;
+}
+
+/* Adapt ctx->poll_ns to the time the last aio_poll() call had to wait.
+ * Blocking for less than poll_ns means polling would have caught the
+ * event; blocking for more than poll_max_ns means polling is a waste of
+ * CPU time for this workload.
+ */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns &&
+               block_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns) {
+            ctx->poll_ns *= grow;
+        } else {
+            ctx->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
-    int i, ret;
+    int i, ret = 0;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
+    int64_t idle_start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
+    ctx->stats.polls++;
 
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
@@ -430,43 +632,58 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
-    /* fill pollfds */
+    if (ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
 
-    if (!aio_epoll_enabled(ctx)) {
-        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-            if (!node->deleted && node->pfd.events
-                && aio_node_check(ctx, node->is_external)) {
-                add_pollfd(node);
+    if (try_poll_mode(ctx, blocking)) {
+        progress = true;
+    } else {
+        /* fill pollfds */
+
+        if (!aio_epoll_enabled(ctx)) {
+            QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+                if (!node->deleted && node->pfd.events
+                    && aio_node_check(ctx, node->is_external)) {
+                    add_pollfd(node);
+                }
             }
         }
-    }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+        timeout = blocking ? aio_compute_timeout(ctx) : 0;
 
-    /* wait until next event */
-    if (timeout) {
-        aio_context_release(ctx);
+        /* wait until next event */
+        if (timeout) {
+            aio_context_release(ctx);
+            idle_start = get_clock();
+        }
+        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+            AioHandler epoll_handler;
+
+            epoll_handler.pfd.fd = ctx->epollfd;
+            epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
+            npfd = 0;
+            add_pollfd(&epoll_handler);
+            ret = aio_epoll(ctx, pollfds, npfd, timeout);
+        } else  {
+            ret = qemu_poll_ns(pollfds, npfd, timeout);
+        }
+        if (timeout) {
+            ctx->stats.idle_ns += get_clock() - idle_start;
+            aio_context_acquire(ctx);
+        }
     }
-    if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
-        AioHandler epoll_handler;
 
-        epoll_handler.pfd.fd = ctx->epollfd;
-        epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
-        npfd = 0;
-        add_pollfd(&epoll_handler);
-        ret = aio_epoll(ctx, pollfds, npfd, timeout);
-    } else  {
-        ret = qemu_poll_ns(pollfds, npfd, timeout);
-    }
     if (blocking) {
         atomic_sub(&ctx->notify_me, 2);
     }
-    if (timeout) {
-        aio_context_acquire(ctx);
-    }
 
     aio_notify_accept(ctx);
 
+    if (ctx->poll_max_ns) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
         for (i = 0; i < npfd; i++) {
@@ -500,3 +717,17 @@ void aio_context_setup(AioContext *ctx)
     }
 #endif
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * poll_ns value is used briefly.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
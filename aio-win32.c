@@ -20,6 +20,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -38,6 +39,7 @@ void aio_set_fd_handler(AioContext *ctx,
                         bool is_external,
                         IOHandler *io_read,
                         IOHandler *io_write,
+                        AioPollFn *io_poll,
                         void *opaque)
 {
     /* fd is a SOCKET in our case */
@@ -103,7 +105,8 @@ void aio_set_fd_handler(AioContext *ctx,
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *e,
                             bool is_external,
-                            EventNotifierHandler *io_notify)
+                            EventNotifierHandler *io_notify,
+                            AioPollFn *io_poll)
 {
     AioHandler *node;
 
@@ -150,6 +153,14 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_fetch_events(AioContext *ctx)
+{
+}
+
+void aio_context_enable_epoll_source(AioContext *ctx)
+{
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
@@ -288,9 +299,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool progress, have_select_revents, first;
     int count;
     int timeout;
+    int64_t idle_start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
+    ctx->stats.polls++;
 
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
@@ -334,6 +347,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
             ? qemu_timeout_ns_to_ms(aio_compute_timeout(ctx)) : 0;
         if (timeout) {
             aio_context_release(ctx);
+            idle_start = get_clock();
         }
         ret = WaitForMultipleObjects(count, events, FALSE, timeout);
         if (blocking) {
@@ -341,6 +355,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
             atomic_sub(&ctx->notify_me, 2);
         }
         if (timeout) {
+            ctx->stats.idle_ns += get_clock() - idle_start;
             aio_context_acquire(ctx);
         }
 
@@ -374,3 +389,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
 void aio_context_setup(AioContext *ctx)
 {
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
@@ -30,20 +30,105 @@
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
 #include "block/raw-aio.h"
+#include "qapi-types.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/* QEMUBH::flags values */
+enum {
+    /* Already on a BHList, i.e. ctx->bh_list or a slice of aio_bh_poll */
+    BH_PENDING   = (1 << 0),
+
+    /* Invoke the callback */
+    BH_SCHEDULED = (1 << 1),
+
+    /* Delete without invoking callback */
+    BH_DELETED   = (1 << 2),
+
+    /* Delete after invoking callback */
+    BH_ONESHOT   = (1 << 3),
+
+    /* Schedule periodically when the event loop is idle */
+    BH_IDLE      = (1 << 4),
+};
+
 struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
-    bool idle;
-    bool deleted;
+    QSLIST_ENTRY(QEMUBH) next;
+    unsigned flags;
+
+    /* Statistics for x-debug-query-bhs, only written by aio_bh_call */
+    uint64_t calls;
+    uint64_t time_ns;
+
+    /* In ctx->all_bhs, protected by ctx->bh_lock; not for one-shot BHs */
+    QLIST_ENTRY(QEMUBH) all_next;
 };
 
+/* Called concurrently from any thread */
+static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+{
+    AioContext *ctx = bh->ctx;
+    unsigned old_flags;
+
+    /* The memory barrier implicit in atomic_fetch_or makes sure that:
+     * 1. idle & any writes needed by the callback are done before the
+     *    locations are read in the aio_bh_poll.
+     * 2. ctx is loaded before the callback has a chance to execute and bh
+     *    could be freed.
+     */
+    old_flags = atomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+    if (!(old_flags & BH_PENDING)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&ctx->bh_list, bh, next);
+    }
+
+    /* Idle BHs do not wake up the event loop; deleted ones can wait */
+    if ((new_flags & (BH_SCHEDULED | BH_IDLE)) == BH_SCHEDULED &&
+        !(old_flags & BH_SCHEDULED)) {
+        aio_notify(ctx);
+    }
+}
+
+/* Only called from aio_bh_poll() and aio_ctx_finalize() */
+static QEMUBH *aio_bh_dequeue(BHList *head, unsigned *flags)
+{
+    QEMUBH *bh = QSLIST_FIRST(head);
+
+    if (!bh) {
+        return NULL;
+    }
+
+    QSLIST_REMOVE_HEAD(head, next);
+
+    /* The atomic_fetch_and is paired with aio_bh_enqueue().  The implicit
+     * memory barrier ensures that the callback sees all writes done by the
+     * scheduling thread.  It also ensures that the scheduling thread sees
+     * the cleared flag before bh->cb has run, and thus will call aio_notify
+     * again if necessary.
+     */
+    *flags = atomic_fetch_and(&bh->flags,
+                              ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+    return bh;
+}
+
+static void aio_bh_free(QEMUBH *bh, unsigned flags)
+{
+    AioContext *ctx = bh->ctx;
+
+    if (flags & BH_ONESHOT) {
+        ctx->oneshot_bh_calls += bh->calls;
+        ctx->oneshot_bh_time_ns += bh->time_ns;
+    } else {
+        qemu_mutex_lock(&ctx->bh_lock);
+        QLIST_REMOVE(bh, all_next);
+        qemu_mutex_unlock(&ctx->bh_lock);
+    }
+    g_free(bh);
+}
+
 void aio_bh_schedule_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
@@ -53,14 +138,7 @@ void aio_bh_schedule_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
         .cb = cb,
         .opaque = opaque,
     };
-    qemu_mutex_lock(&ctx->bh_lock);
-    bh->next = ctx->first_bh;
-    bh->scheduled = 1;
-    bh->deleted = 1;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_mutex_unlock(&ctx->bh_lock);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_ONESHOT);
 }
 
 QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
@@ -73,64 +151,59 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
         .opaque = opaque,
     };
     qemu_mutex_lock(&ctx->bh_lock);
-    bh->next = ctx->first_bh;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
+    QLIST_INSERT_HEAD(&ctx->all_bhs, bh, all_next);
     qemu_mutex_unlock(&ctx->bh_lock);
     return bh;
 }
 
 void aio_bh_call(QEMUBH *bh)
 {
+    int64_t start = get_clock();
+    int64_t ns;
+
     bh->cb(bh->opaque);
+    ns = get_clock() - start;
+
+    /* A BH that deleted itself is only freed by the next aio_bh_poll */
+    bh->calls++;
+    bh->time_ns += ns;
+    bh->ctx->stats.bh_calls++;
+    bh->ctx->stats.bh_ns += ns;
 }
 
-/* Multiple occurrences of aio_bh_poll cannot be called concurrently */
+/* Multiple occurrences of aio_bh_poll cannot be called concurrently.
+ * Nested calls (e.g. aio_poll from a BH) continue with the slices of the
+ * outer calls.
+ */
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
-    int ret;
+    BHListSlice slice;
+    BHListSlice *s;
+    int ret = 0;
+
+    QSLIST_MOVE_ATOMIC(&slice.bh_list, &ctx->bh_list);
+    QSIMPLEQ_INSERT_TAIL(&ctx->bh_slice_list, &slice, next);
 
-    ctx->walking_bh++;
-
-    ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        /* Make sure that fetching bh happens before accessing its members */
-        smp_read_barrier_depends();
-        next = bh->next;
-        /* The atomic_xchg is paired with the one in qemu_bh_schedule.  The
-         * implicit memory barrier ensures that the callback sees all writes
-         * done by the scheduling thread.  It also ensures that the scheduling
-         * thread sees the zero before bh->cb has run, and thus will call
-         * aio_notify again if necessary.
-         */
-        if (atomic_xchg(&bh->scheduled, 0)) {
+    while ((s = QSIMPLEQ_FIRST(&ctx->bh_slice_list))) {
+        QEMUBH *bh;
+        unsigned flags;
+
+        bh = aio_bh_dequeue(&s->bh_list, &flags);
+        if (!bh) {
+            QSIMPLEQ_REMOVE_HEAD(&ctx->bh_slice_list, next);
+            continue;
+        }
+
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
             /* Idle BHs and the notify BH don't count as progress */
-            if (!bh->idle && bh != ctx->notify_dummy_bh) {
+            if (!(flags & BH_IDLE) && bh != ctx->notify_dummy_bh) {
                 ret = 1;
             }
-            bh->idle = 0;
             aio_bh_call(bh);
         }
-    }
-
-    ctx->walking_bh--;
-
-    /* remove deleted bhs */
-    if (!ctx->walking_bh) {
-        qemu_mutex_lock(&ctx->bh_lock);
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted && !bh->scheduled) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
+        if (flags & (BH_DELETED | BH_ONESHOT)) {
+            aio_bh_free(bh, flags);
         }
-        qemu_mutex_unlock(&ctx->bh_lock);
     }
 
     return ret;
@@ -138,28 +211,12 @@ int aio_bh_poll(AioContext *ctx)
 
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
-    bh->idle = 1;
-    /* Make sure that idle & any writes needed by the callback are done
-     * before the locations are read in the aio_bh_poll.
-     */
-    atomic_mb_set(&bh->scheduled, 1);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_IDLE);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    AioContext *ctx;
-
-    ctx = bh->ctx;
-    bh->idle = 0;
-    /* The memory barrier implicit in atomic_xchg makes sure that:
-     * 1. idle & any writes needed by the callback are done before the
-     *    locations are read in the aio_bh_poll.
-     * 2. ctx is loaded before scheduled is set and the callback has a chance
-     *    to execute.
-     */
-    if (atomic_xchg(&bh->scheduled, 1) == 0) {
-        aio_notify(ctx);
-    }
+    aio_bh_enqueue(bh, BH_SCHEDULED);
 }
 
 
@@ -167,7 +224,7 @@ void qemu_bh_schedule(QEMUBH *bh)
  */
 void qemu_bh_cancel(QEMUBH *bh)
 {
-    bh->scheduled = 0;
+    atomic_and(&bh->flags, ~BH_SCHEDULED);
 }
 
 /* This func is async.The bottom half will do the delete action at the finial
@@ -175,29 +232,100 @@ void qemu_bh_cancel(QEMUBH *bh)
  */
 void qemu_bh_delete(QEMUBH *bh)
 {
-    bh->scheduled = 0;
-    bh->deleted = 1;
+    aio_bh_enqueue(bh, BH_DELETED);
 }
 
-int64_t
-aio_compute_timeout(AioContext *ctx)
+/* Return 0 if a BH in @head must run now, 10 ms if only idle BHs are
+ * scheduled (they are polled at least that often), -1 otherwise.
+ */
+static int64_t aio_bh_list_timeout(BHList *head)
 {
-    int64_t deadline;
-    int timeout = -1;
+    int64_t timeout = -1;
     QEMUBH *bh;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (bh->scheduled) {
-            if (bh->idle) {
-                /* idle bottom halves will be polled at least
-                 * every 10ms */
-                timeout = 10000000;
-            } else {
-                /* non-idle bottom halves will be executed
-                 * immediately */
+    for (bh = atomic_rcu_read(&head->slh_first); bh;
+         bh = atomic_rcu_read(&bh->next.sle_next)) {
+        unsigned flags = atomic_read(&bh->flags);
+
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            if (!(flags & BH_IDLE)) {
                 return 0;
             }
+            timeout = 10000000;
+        }
+    }
+    return timeout;
+}
+
+/* Only BHs that were scheduled or deleted are on the lists, so this costs
+ * nothing for the BHs that are idle.
+ */
+static int64_t aio_bh_timeout(AioContext *ctx)
+{
+    int64_t timeout = aio_bh_list_timeout(&ctx->bh_list);
+    BHListSlice *s;
+
+    QSIMPLEQ_FOREACH(s, &ctx->bh_slice_list, next) {
+        if (timeout == 0) {
+            break;
         }
+        timeout = qemu_soonest_timeout(timeout,
+                                       aio_bh_list_timeout(&s->bh_list));
+    }
+    return timeout;
+}
+
+static BHInfo *aio_bh_info_append(BHInfoList ***prev, const char *name,
+                                  QEMUBH *bh)
+{
+    BHInfoList *entry = g_new0(BHInfoList, 1);
+    BHInfo *info = g_new0(BHInfo, 1);
+
+    info->context = g_strdup(name);
+    info->oneshot = !bh;
+    if (bh) {
+        info->has_callback = true;
+        info->callback = g_strdup_printf("%p", bh->cb);
+        info->has_opaque = true;
+        info->opaque = g_strdup_printf("%p", bh->opaque);
+        info->scheduled = atomic_read(&bh->flags) & BH_SCHEDULED;
+        info->calls = bh->calls;
+        info->time_ns = bh->time_ns;
+    }
+    entry->value = info;
+    **prev = entry;
+    *prev = &entry->next;
+    return info;
+}
+
+BHInfoList *aio_bh_get_info(AioContext *ctx, const char *name)
+{
+    BHInfoList *head = NULL, **prev = &head;
+    BHInfo *oneshot;
+    QEMUBH *bh;
+
+    qemu_mutex_lock(&ctx->bh_lock);
+    QLIST_FOREACH(bh, &ctx->all_bhs, all_next) {
+        aio_bh_info_append(&prev, name, bh);
+    }
+    qemu_mutex_unlock(&ctx->bh_lock);
+
+    /* All one-shot BHs are accounted together */
+    oneshot = aio_bh_info_append(&prev, name, NULL);
+    oneshot->calls = ctx->oneshot_bh_calls;
+    oneshot->time_ns = ctx->oneshot_bh_time_ns;
+    return head;
+}
+
+int64_t
+aio_compute_timeout(AioContext *ctx)
+{
+    int64_t deadline;
+    int64_t timeout;
+
+    timeout = aio_bh_timeout(ctx);
+    if (timeout == 0) {
+        return 0;
     }
 
     deadline = timerlistgroup_deadline_ns(&ctx->tlg);
@@ -229,15 +357,13 @@ static gboolean
 aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
 
     atomic_and(&ctx->notify_me, ~1);
     aio_notify_accept(ctx);
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (bh->scheduled) {
-            return true;
-        }
+    aio_fetch_events(ctx);
+    if (aio_bh_timeout(ctx) >= 0) {
+        return true;
     }
     return aio_pending(ctx) || (timerlistgroup_deadline_ns(&ctx->tlg) == 0);
 }
@@ -258,6 +384,8 @@ static void
 aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
+    QEMUBH *bh;
+    unsigned flags;
 
     qemu_bh_delete(ctx->notify_dummy_bh);
     thread_pool_free(ctx->thread_pool);
@@ -270,19 +398,25 @@ aio_ctx_finalize(GSource     *source)
     }
 #endif
 
-    qemu_mutex_lock(&ctx->bh_lock);
-    while (ctx->first_bh) {
-        QEMUBH *next = ctx->first_bh->next;
-
-        /* qemu_bh_delete() must have been called on BHs in this AioContext */
-        assert(ctx->first_bh->deleted);
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring) {
+        luring_detach_aio_context(ctx->linux_io_uring, ctx);
+        luring_cleanup(ctx->linux_io_uring);
+        ctx->linux_io_uring = NULL;
+    }
+#endif
 
-        g_free(ctx->first_bh);
-        ctx->first_bh = next;
+    assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
+    while ((bh = aio_bh_dequeue(&ctx->bh_list, &flags))) {
+        if (flags & (BH_DELETED | BH_ONESHOT)) {
+            aio_bh_free(bh, flags);
+        }
     }
-    qemu_mutex_unlock(&ctx->bh_lock);
 
-    aio_set_event_notifier(ctx, &ctx->notifier, false, NULL);
+    /* qemu_bh_delete() must have been called on BHs in this AioContext */
+    assert(QLIST_EMPTY(&ctx->all_bhs));
+
+    aio_set_event_notifier(ctx, &ctx->notifier, false, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
     rfifolock_destroy(&ctx->lock);
     qemu_mutex_destroy(&ctx->bh_lock);
@@ -310,6 +444,30 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
     return ctx->thread_pool;
 }
 
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, int64_t node,
+                                        Error **errp)
+{
+    if (min < 0 || max <= 0 || min > max || max > INT_MAX) {
+        error_setg(errp, "bad thread-pool-min/thread-pool-max values");
+        return;
+    }
+    if (node < -1 || node > INT_MAX) {
+        error_setg(errp, "bad thread-pool-node value");
+        return;
+    }
+    if (node >= 0 && !thread_pool_node_valid(node, errp)) {
+        return;
+    }
+
+    ctx->thread_pool_min = min;
+    ctx->thread_pool_max = max;
+    ctx->thread_pool_node = node;
+    if (ctx->thread_pool) {
+        thread_pool_update_params(ctx->thread_pool, ctx);
+    }
+}
+
 #ifdef CONFIG_LINUX_AIO
 LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 {
@@ -321,6 +479,19 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+LuringState *aio_get_linux_io_uring(AioContext *ctx)
+{
+    if (!ctx->linux_io_uring) {
+        ctx->linux_io_uring = luring_init();
+        if (ctx->linux_io_uring) {
+            luring_attach_aio_context(ctx->linux_io_uring, ctx);
+        }
+    }
+    return ctx->linux_io_uring;
+}
+#endif
+
 void aio_notify(AioContext *ctx)
 {
     /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
@@ -362,6 +533,15 @@ static void event_notifier_dummy_cb(EventNotifier *e)
 {
 }
 
+/* Returns true if aio_notify() was called (e.g. a BH was scheduled) */
+static bool event_notifier_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    return atomic_read(&ctx->notified);
+}
+
 AioContext *aio_context_new(Error **errp)
 {
     int ret;
@@ -379,12 +559,26 @@ AioContext *aio_context_new(Error **errp)
     aio_set_event_notifier(ctx, &ctx->notifier,
                            false,
                            (EventNotifierHandler *)
-                           event_notifier_dummy_cb);
+                           event_notifier_dummy_cb,
+                           event_notifier_poll);
 #ifdef CONFIG_LINUX_AIO
     ctx->linux_aio = NULL;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    ctx->linux_io_uring = NULL;
 #endif
     ctx->thread_pool = NULL;
+    ctx->poll_ns = 0;
+    ctx->poll_max_ns = 0;
+    ctx->poll_grow = 0;
+    ctx->poll_shrink = 0;
+    ctx->thread_pool_min = 0;
+    ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    ctx->thread_pool_node = -1;
     qemu_mutex_init(&ctx->bh_lock);
+    QSLIST_INIT(&ctx->bh_list);
+    QSIMPLEQ_INIT(&ctx->bh_slice_list);
+    QLIST_INIT(&ctx->all_bhs);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
@@ -2090,7 +2090,10 @@ int bdrv_reopen_multiple(BlockReopenQueue *bs_queue, Error **errp)
 
     assert(bs_queue != NULL);
 
-    bdrv_drain_all();
+    /* The queue already holds every node that is reopened */
+    QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        bdrv_drained_begin(bs_entry->state.bs);
+    }
 
     QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
         if (bdrv_reopen_prepare(&bs_entry->state, bs_queue, &local_err)) {
@@ -2116,6 +2119,7 @@ cleanup:
         } else if (ret) {
             QDECREF(bs_entry->state.explicit_options);
         }
+        bdrv_drained_end(bs_entry->state.bs);
         QDECREF(bs_entry->state.options);
         g_free(bs_entry);
     }
@@ -2315,9 +2319,6 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
-
     if (bs->drv) {
         BdrvChild *child, *next;
 
@@ -2356,6 +2357,11 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    /* Released only now so that the driver can store persistent bitmaps
+     * in its .bdrv_close() */
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -2637,6 +2643,40 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         bdrv_parent_cb_resize(bs);
         ++bs->write_gen;
     }
+    bdrv_block_status_cache_invalidate(bs, 0, INT64_MAX);
+    return ret;
+}
+
+/**
+ * Allocate @bytes bytes at @offset according to @prealloc, typically the
+ * area added by a previous bdrv_truncate()
+ */
+int bdrv_preallocate(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     PreallocMode prealloc, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv) {
+        error_setg(errp, "No medium inserted");
+        return -ENOMEDIUM;
+    }
+    if (prealloc == PREALLOC_MODE_OFF || bytes <= 0) {
+        return 0;
+    }
+    if (!drv->bdrv_preallocate) {
+        error_setg(errp, "Preallocation is not supported by '%s'",
+                   drv->format_name);
+        return -ENOTSUP;
+    }
+    if (bs->read_only) {
+        error_setg(errp, "Image is read-only");
+        return -EACCES;
+    }
+
+    ret = drv->bdrv_preallocate(bs, offset, bytes, prealloc, errp);
+    ++bs->write_gen;
+    bdrv_block_status_cache_invalidate(bs, 0, INT64_MAX);
     return ret;
 }
 
@@ -3045,6 +3085,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -3210,19 +3259,23 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
     if (!(bs->open_flags & BDRV_O_INACTIVE)) {
         return;
     }
-    bs->open_flags &= ~BDRV_O_INACTIVE;
 
-    if (bs->drv->bdrv_invalidate_cache) {
-        bs->drv->bdrv_invalidate_cache(bs, &local_err);
+    /* Children first: the driver may need to write to them while it
+     * reopens the image (e.g. qcow2 marking its dirty bitmaps in use) */
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_invalidate_cache(child->bs, &local_err);
         if (local_err) {
-            bs->open_flags |= BDRV_O_INACTIVE;
             error_propagate(errp, local_err);
             return;
         }
     }
 
-    QLIST_FOREACH(child, &bs->children, next) {
-        bdrv_invalidate_cache(child->bs, &local_err);
+    /* Another process may have written to the image meanwhile */
+    bdrv_block_status_cache_invalidate(bs, 0, INT64_MAX);
+
+    bs->open_flags &= ~BDRV_O_INACTIVE;
+    if (bs->drv->bdrv_invalidate_cache) {
+        bs->drv->bdrv_invalidate_cache(bs, &local_err);
         if (local_err) {
             bs->open_flags |= BDRV_O_INACTIVE;
             error_propagate(errp, local_err);
@@ -46,9 +46,14 @@ void block_acct_init(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, 0, NULL);
+    }
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +81,60 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+/* Replace the histogram for @type by an empty one with the given bin
+ * boundaries, or disable it if @nboundaries is 0.  Returns -EINVAL if the
+ * boundaries are not strictly increasing. */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                int nboundaries, const uint64_t *boundaries)
+{
+    BlockLatencyHistogram *hist;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    for (i = 1; i < nboundaries; i++) {
+        if (boundaries[i] <= boundaries[i - 1]) {
+            return -EINVAL;
+        }
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+    hist->nbins = 0;
+
+    if (nboundaries > 0) {
+        hist->nbins = nboundaries + 1;
+        hist->boundaries = g_memdup(boundaries,
+                                    nboundaries * sizeof(*boundaries));
+        hist->bins = g_new0(uint64_t, hist->nbins);
+    }
+    return 0;
+}
+
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    /* Find the first boundary greater than latency_ns */
+    int lo = 0, hi = hist->nbins - 1;
+
+    if (!hist->nbins) {
+        return;
+    }
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((uint64_t)latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -106,6 +165,8 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +190,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
@@ -26,6 +26,8 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_COPY_SIZE (1 << 20)
+#define BACKUP_MAX_POOL_BUFFERS 16
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct BackupBlockJob {
@@ -41,7 +43,14 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     unsigned long *done_bitmap;
     int64_t cluster_size;
+    /* Adjacent clusters are copied together, up to this many at a time */
+    int clusters_per_copy;
     bool compress;
+    /* Cleared once blk_co_copy_range() fails, then bounce buffers are used */
+    bool use_copy_range;
+    /* Bounce buffers of clusters_per_copy clusters, kept for reuse */
+    void *buffer_pool[BACKUP_MAX_POOL_BUFFERS];
+    int nb_pool_buffers;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
@@ -89,6 +98,93 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+static void *backup_get_buffer(BackupBlockJob *job)
+{
+    if (job->nb_pool_buffers > 0) {
+        return job->buffer_pool[--job->nb_pool_buffers];
+    }
+    return blk_blockalign(job->common.blk,
+                          job->clusters_per_copy * job->cluster_size);
+}
+
+static void backup_put_buffer(BackupBlockJob *job, void *buf)
+{
+    if (job->nb_pool_buffers < BACKUP_MAX_POOL_BUFFERS) {
+        job->buffer_pool[job->nb_pool_buffers++] = buf;
+    } else {
+        qemu_vfree(buf);
+    }
+}
+
+/* Copy @nb_sectors starting at cluster @start through a bounce buffer.
+ * Runs of zero clusters are written with write_zeroes, the rest of the
+ * clusters with as few writes as possible. */
+static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
+                                                      int64_t start,
+                                                      int nb_sectors,
+                                                      bool *error_is_read,
+                                                      bool is_write_notifier)
+{
+    BlockBackend *blk = job->common.blk;
+    int64_t offset = start * job->cluster_size;
+    int64_t bytes = (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    uint8_t *bounce_buffer;
+    int64_t pos, len;
+    bool zero;
+    int ret;
+
+    bounce_buffer = backup_get_buffer(job);
+    iov.iov_base = bounce_buffer;
+    iov.iov_len = bytes;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = blk_co_preadv(blk, offset, bytes, &qiov,
+                        is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        goto out;
+    }
+
+    for (pos = 0; pos < bytes; pos += len) {
+        len = MIN(job->cluster_size, bytes - pos);
+        zero = buffer_is_zero(bounce_buffer + pos, len);
+        while (pos + len < bytes && !job->compress) {
+            int64_t next = MIN(job->cluster_size, bytes - pos - len);
+            if (buffer_is_zero(bounce_buffer + pos + len, next) != zero) {
+                break;
+            }
+            len += next;
+        }
+
+        if (zero) {
+            ret = blk_co_pwrite_zeroes(job->target, offset + pos, len,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else {
+            iov.iov_base = bounce_buffer + pos;
+            iov.iov_len = len;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = blk_co_pwritev(job->target, offset + pos, len, &qiov,
+                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, start, ret);
+            if (error_is_read) {
+                *error_is_read = false;
+            }
+            goto out;
+        }
+    }
+
+out:
+    backup_put_buffer(job, bounce_buffer);
+    return ret;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -96,12 +192,10 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 {
     BlockBackend *blk = job->common.blk;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
-    void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
     int64_t start, end;
+    int nb_clusters;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
@@ -114,53 +208,49 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += nb_clusters) {
+        nb_clusters = 1;
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
             continue; /* already copied */
         }
 
+        /* Copy the following clusters too, unless they are done already */
+        while (start + nb_clusters < end &&
+               nb_clusters < job->clusters_per_copy &&
+               !test_bit(start + nb_clusters, job->done_bitmap)) {
+            nb_clusters++;
+        }
+
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
+        n = MIN(nb_clusters * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        ret = blk_co_preadv(blk, start * job->cluster_size,
-                            bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        ret = -ENOTSUP;
+        if (job->use_copy_range) {
+            ret = blk_co_copy_range(blk, start * job->cluster_size,
+                                    job->target, start * job->cluster_size,
+                                    n * BDRV_SECTOR_SIZE,
+                                    is_write_notifier ?
+                                    BDRV_REQ_NO_SERIALISING : 0);
+            if (ret < 0) {
+                /* Whatever went wrong, the bounce buffer path below finds
+                 * out again whether it was the source or the target */
+                trace_backup_do_cow_copy_range_fail(job, start, ret);
+                job->use_copy_range = false;
             }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = blk_co_pwritev(job->target, start * job->cluster_size,
-                                 bounce_qiov.size, &bounce_qiov,
-                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
         }
         if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            ret = backup_cow_with_bounce_buffer(job, start, n, error_is_read,
+                                                is_write_notifier);
+            if (ret < 0) {
+                goto out;
             }
-            goto out;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, nb_clusters);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -170,10 +260,6 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     }
 
 out:
-    if (bounce_buffer) {
-        qemu_vfree(bounce_buffer);
-    }
-
     cow_request_end(&cow_request);
 
     trace_backup_do_cow_return(job, sector_num, nb_sectors, ret);
@@ -338,6 +424,8 @@ static void backup_complete(BlockJob *job, void *opaque)
 
 static bool coroutine_fn yield_and_check(BackupBlockJob *job)
 {
+    int64_t delay_ns;
+
     if (block_job_is_cancelled(&job->common)) {
         return true;
     }
@@ -345,14 +433,14 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     /* we need to yield so that bdrv_drain_all() returns.
      * (without, VM does not reboot)
      */
+    delay_ns = block_job_sched_delay(&job->common,
+                                     job->sectors_read * BDRV_SECTOR_SIZE);
     if (job->common.speed) {
-        uint64_t delay_ns = ratelimit_calculate_delay(&job->limit,
-                                                      job->sectors_read);
-        job->sectors_read = 0;
-        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-    } else {
-        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
+        delay_ns = MAX(delay_ns, ratelimit_calculate_delay(&job->limit,
+                                                           job->sectors_read));
     }
+    job->sectors_read = 0;
+    block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
 
     if (block_job_is_cancelled(&job->common)) {
         return true;
@@ -430,6 +518,7 @@ static void coroutine_fn backup_run(void *opaque)
     BlockBackend *target = job->target;
     int64_t start, end;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int nb_clusters;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
@@ -453,8 +542,10 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
+        for (; start < end; start += nb_clusters) {
             bool error_is_read;
+
+            nb_clusters = 1;
             if (yield_and_check(job)) {
                 break;
             }
@@ -489,10 +580,13 @@ static void coroutine_fn backup_run(void *opaque)
                 if (alloced == 0) {
                     continue;
                 }
+            } else {
+                /* FULL sync mode we copy the whole drive. */
+                nb_clusters = MIN(job->clusters_per_copy, end - start);
             }
-            /* FULL sync mode we copy the whole drive. */
             ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
+                                nb_clusters * sectors_per_cluster,
+                                &error_is_read, false);
             if (ret < 0) {
                 /* Depending on error action, fail now or retry cluster */
                 BlockErrorAction action =
@@ -500,7 +594,7 @@ static void coroutine_fn backup_run(void *opaque)
                 if (action == BLOCK_ERROR_ACTION_REPORT) {
                     break;
                 } else {
-                    start--;
+                    nb_clusters = 0;
                     continue;
                 }
             }
@@ -513,6 +607,9 @@ static void coroutine_fn backup_run(void *opaque)
     qemu_co_rwlock_wrlock(&job->flush_rwlock);
     qemu_co_rwlock_unlock(&job->flush_rwlock);
     g_free(job->done_bitmap);
+    while (job->nb_pool_buffers > 0) {
+        qemu_vfree(job->buffer_pool[--job->nb_pool_buffers]);
+    }
 
     bdrv_op_unblock_all(blk_bs(target), job->common.blocker);
 
@@ -603,6 +700,7 @@ void backup_start(const char *job_id, BlockDriverState *bs,
 
     job->target = blk_new();
     blk_insert_bs(job->target, target);
+    block_job_add_backend(&job->common, job->target);
 
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
@@ -629,6 +727,11 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
 
+    /* Compressed clusters must be written one at a time */
+    job->clusters_per_copy = compress ? 1 :
+                             MAX(BACKUP_MAX_COPY_SIZE / job->cluster_size, 1);
+    job->use_copy_range = !compress;
+
     bdrv_op_block_all(target, job->common.blocker);
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run, job);
@@ -0,0 +1,311 @@
+/*
+ * Block request recorder
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "block/block_int.h"
+#include "block/blkrecord.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+
+typedef struct BDRVBlkrecordState {
+    char *trace_file;
+    FILE *trace;
+    int64_t start;
+} BDRVBlkrecordState;
+
+static QemuOptsList runtime_opts = {
+    .name = "blkrecord",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "trace",
+            .type = QEMU_OPT_STRING,
+            .help = "Path of the file the requests are recorded to",
+        },
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* Valid blkrecord filenames look like blkrecord:path/to/trace:path/to/image */
+static void blkrecord_parse_filename(const char *filename, QDict *options,
+                                     Error **errp)
+{
+    const char *c;
+
+    if (!strstart(filename, "blkrecord:", &filename)) {
+        /* There was no prefix; therefore, all options have to be already
+           present in the QDict (except for the filename) */
+        qdict_put(options, "x-image", qstring_from_str(filename));
+        return;
+    }
+
+    c = strchr(filename, ':');
+    if (c == NULL) {
+        error_setg(errp, "blkrecord requires a trace file and image path");
+        return;
+    }
+
+    qdict_put(options, "trace", qstring_from_substr(filename, 0,
+                                                    c - filename - 1));
+    qdict_put(options, "x-image", qstring_from_str(c + 1));
+}
+
+static int blkrecord_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVBlkrecordState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *trace;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    trace = qemu_opt_get(opts, "trace");
+    if (!trace) {
+        error_setg(errp, "blkrecord requires a trace file");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    bs->file = bdrv_open_child(qemu_opt_get(opts, "x-image"), options, "image",
+                               bs, &child_file, false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    s->trace = fopen(trace, "w");
+    if (!s->trace) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not open trace file '%s'", trace);
+        bdrv_unref_child(bs, bs->file);
+        goto out;
+    }
+    fprintf(s->trace, "%s\n", BLKRECORD_TRACE_HEADER);
+    s->trace_file = g_strdup(trace);
+    s->start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ret = 0;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void blkrecord_close(BlockDriverState *bs)
+{
+    BDRVBlkrecordState *s = bs->opaque;
+
+    fclose(s->trace);
+    g_free(s->trace_file);
+}
+
+static int64_t blkrecord_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int blkrecord_truncate(BlockDriverState *bs, int64_t offset)
+{
+    return bdrv_truncate(bs->file->bs, offset);
+}
+
+static void blkrecord_log(BlockDriverState *bs, int64_t start, char op,
+                          uint64_t offset, uint64_t bytes, int ret)
+{
+    BDRVBlkrecordState *s = bs->opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    fprintf(s->trace, "%" PRId64 " %" PRId64 " %c %" PRIu64 " %" PRIu64
+            " %d\n", start - s->start, now - start, op, offset, bytes, ret);
+}
+
+static int coroutine_fn blkrecord_co_preadv(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret = bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+
+    blkrecord_log(bs, start, BLKRECORD_OP_READ, offset, bytes, ret);
+    return ret;
+}
+
+static int coroutine_fn blkrecord_co_pwritev(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+    blkrecord_log(bs, start, BLKRECORD_OP_WRITE, offset, bytes, ret);
+    return ret;
+}
+
+static int coroutine_fn blkrecord_co_pwrite_zeroes(BlockDriverState *bs,
+    int64_t offset, int count, BdrvRequestFlags flags)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret = bdrv_co_pwrite_zeroes(bs->file, offset, count, flags);
+
+    blkrecord_log(bs, start, BLKRECORD_OP_WRITE_ZEROES, offset, count, ret);
+    return ret;
+}
+
+static int coroutine_fn blkrecord_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int count)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret = bdrv_co_pdiscard(bs->file->bs, offset, count);
+
+    blkrecord_log(bs, start, BLKRECORD_OP_DISCARD, offset, count, ret);
+    return ret;
+}
+
+static int coroutine_fn blkrecord_co_flush(BlockDriverState *bs)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret = bdrv_co_flush(bs->file->bs);
+
+    blkrecord_log(bs, start, BLKRECORD_OP_FLUSH, 0, 0, ret);
+    return ret;
+}
+
+static bool blkrecord_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                  BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static void blkrecord_refresh_filename(BlockDriverState *bs, QDict *options)
+{
+    BDRVBlkrecordState *s = bs->opaque;
+    QDict *opts;
+
+    if (bs->file->bs->exact_filename[0]) {
+        snprintf(bs->exact_filename, sizeof(bs->exact_filename),
+                 "blkrecord:%s:%s", s->trace_file,
+                 bs->file->bs->exact_filename);
+    }
+
+    if (!bs->file->bs->full_open_options) {
+        return;
+    }
+
+    opts = qdict_new();
+    qdict_put(opts, "driver", qstring_from_str("blkrecord"));
+    qdict_put(opts, "trace", qstring_from_str(s->trace_file));
+    QINCREF(bs->file->bs->full_open_options);
+    qdict_put_obj(opts, "image", QOBJECT(bs->file->bs->full_open_options));
+    bs->full_open_options = opts;
+}
+
+static int blkrecord_entry_cmp(const void *a, const void *b)
+{
+    const BlkrecordEntry *ea = a, *eb = b;
+
+    return ea->start < eb->start ? -1 : ea->start > eb->start;
+}
+
+BlkrecordEntry *blkrecord_load(const char *filename, size_t *nr_entries,
+                               Error **errp)
+{
+    GArray *entries;
+    char line[256];
+    int lineno = 0;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        error_setg_errno(errp, errno, "Could not open trace file '%s'",
+                         filename);
+        return NULL;
+    }
+
+    entries = g_array_new(false, false, sizeof(BlkrecordEntry));
+    while (fgets(line, sizeof(line), f)) {
+        BlkrecordEntry e;
+        int ret;
+
+        lineno++;
+        if (lineno == 1 && !strstart(line, BLKRECORD_TRACE_HEADER, NULL)) {
+            error_setg(errp, "'%s' is not a blkrecord trace", filename);
+            goto fail;
+        }
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%" SCNd64 " %" SCNd64 " %c %" SCNu64 " %" SCNu64
+                   " %d", &e.start, &e.latency, &e.op, &e.offset, &e.bytes,
+                   &ret) != 6 ||
+            e.start < 0 || !strchr("rwzdf", e.op) ||
+            e.bytes > INT_MAX) {
+            error_setg(errp, "%s:%d: invalid trace entry", filename, lineno);
+            goto fail;
+        }
+        g_array_append_val(entries, e);
+    }
+    if (ferror(f)) {
+        error_setg_errno(errp, errno, "Could not read trace file '%s'",
+                         filename);
+        goto fail;
+    }
+    fclose(f);
+
+    g_array_sort(entries, blkrecord_entry_cmp);
+    *nr_entries = entries->len;
+    return (BlkrecordEntry *)g_array_free(entries, false);
+
+fail:
+    fclose(f);
+    g_array_free(entries, true);
+    return NULL;
+}
+
+static BlockDriver bdrv_blkrecord = {
+    .format_name                      = "blkrecord",
+    .protocol_name                    = "blkrecord",
+    .instance_size                    = sizeof(BDRVBlkrecordState),
+
+    .bdrv_parse_filename              = blkrecord_parse_filename,
+    .bdrv_file_open                   = blkrecord_open,
+    .bdrv_close                       = blkrecord_close,
+    .bdrv_getlength                   = blkrecord_getlength,
+    .bdrv_truncate                    = blkrecord_truncate,
+    .bdrv_refresh_filename            = blkrecord_refresh_filename,
+
+    .bdrv_co_preadv                   = blkrecord_co_preadv,
+    .bdrv_co_pwritev                  = blkrecord_co_pwritev,
+    .bdrv_co_pwrite_zeroes            = blkrecord_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                 = blkrecord_co_pdiscard,
+    .bdrv_co_flush                    = blkrecord_co_flush,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = blkrecord_recurse_is_first_non_filter,
+};
+
+static void bdrv_blkrecord_init(void)
+{
+    bdrv_register(&bdrv_blkrecord);
+}
+
+block_init(bdrv_blkrecord_init);
@@ -15,6 +15,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/throttle-groups.h"
+#include "block/io-trace.h"
 #include "sysemu/blockdev.h"
 #include "sysemu/sysemu.h"
 #include "qapi-event.h"
@@ -87,6 +88,9 @@ static QTAILQ_HEAD(, BlockBackend) block_backends =
 static QTAILQ_HEAD(, BlockBackend) monitor_block_backends =
     QTAILQ_HEAD_INITIALIZER(monitor_block_backends);
 
+/* Bytes read or written by guest devices, wraps around */
+static unsigned long guest_bytes;
+
 static void blk_root_inherit_options(int *child_flags, QDict *child_options,
                                      int parent_flags, QDict *parent_options)
 {
@@ -588,6 +592,16 @@ static char *blk_get_attached_dev_id(BlockBackend *blk)
  *
  * @dev must not be null.
  */
+/*
+ * Return the number of bytes that devices attached to any BlockBackend have
+ * read or written so far.  The counter wraps around, so only the difference
+ * between two calls is meaningful.
+ */
+unsigned long blk_guest_bytes(void)
+{
+    return atomic_read(&guest_bytes);
+}
+
 BlockBackend *blk_by_dev(void *dev)
 {
     BlockBackend *blk = NULL;
@@ -611,7 +625,8 @@ void blk_set_dev_ops(BlockBackend *blk, const BlockDevOps *ops,
 {
     /* All drivers that use blk_set_dev_ops() are qdevified and we want to keep
      * it that way, so we can assume blk->dev is a DeviceState if blk->dev_ops
-     * is set. */
+     * is set and blk->dev is not NULL.  Block jobs set dev_ops on their
+     * backends without attaching a device. */
     assert(!blk->legacy_dev);
 
     blk->dev_ops = ops;
@@ -809,7 +824,15 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
 
     /* throttling disk I/O */
     if (blk->public.throttle_state) {
+        IOTrace *trace = io_trace_current();
+
+        io_trace_mark(trace, IO_TRACE_BLOCK);
         throttle_group_co_io_limits_intercept(blk, bytes, false);
+        io_trace_mark(trace, IO_TRACE_THROTTLE);
+    }
+
+    if (blk->dev) {
+        atomic_add(&guest_bytes, bytes);
     }
 
     return bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
@@ -830,13 +853,21 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
 
     /* throttling disk I/O */
     if (blk->public.throttle_state) {
+        IOTrace *trace = io_trace_current();
+
+        io_trace_mark(trace, IO_TRACE_BLOCK);
         throttle_group_co_io_limits_intercept(blk, bytes, true);
+        io_trace_mark(trace, IO_TRACE_THROTTLE);
     }
 
     if (!blk->enable_write_cache) {
         flags |= BDRV_REQ_FUA;
     }
 
+    if (blk->dev) {
+        atomic_add(&guest_bytes, bytes);
+    }
+
     return bdrv_co_pwritev(blk->root, offset, bytes, qiov, flags);
 }
 
@@ -995,6 +1026,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
+    qemu_coroutine_set_io_trace(co, io_trace_current());
     qemu_coroutine_enter(co);
 
     acb->has_returned = true;
@@ -1539,6 +1571,34 @@ int coroutine_fn blk_co_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                           flags | BDRV_REQ_ZERO_WRITE);
 }
 
+/*
+ * Copy @bytes from @blk_in to @blk_out without a bounce buffer.  Returns
+ * -ENOTSUP if this is not possible; the caller then has to read and write
+ * the data itself.  I/O throttling is not supported for such requests.
+ */
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (blk_in->public.throttle_state || blk_out->public.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    return bdrv_co_copy_range_from(blk_in->root, off_in,
+                                   blk_out->root, off_out, bytes, flags);
+}
+
 int blk_pwrite_compressed(BlockBackend *blk, int64_t offset, const void *buf,
                           int count)
 {
@@ -1723,6 +1783,10 @@ static void blk_root_drained_begin(BdrvChild *child)
     if (blk->public.io_limits_disabled++ == 0) {
         throttle_group_restart_blk(blk);
     }
+
+    if (blk->dev_ops && blk->dev_ops->drained_begin) {
+        blk->dev_ops->drained_begin(blk->dev_opaque);
+    }
 }
 
 static void blk_root_drained_end(BdrvChild *child)
@@ -1731,4 +1795,8 @@ static void blk_root_drained_end(BdrvChild *child)
 
     assert(blk->public.io_limits_disabled);
     --blk->public.io_limits_disabled;
+
+    if (blk->dev_ops && blk->dev_ops->drained_end) {
+        blk->dev_ops->drained_end(blk->dev_opaque);
+    }
 }
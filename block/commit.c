@@ -23,15 +23,21 @@
 
 enum {
     /*
-     * Size of data buffer for populating the image file.  This should be large
-     * enough to process multiple clusters in a single call, so that populating
-     * contiguous regions of the image is efficient.
+     * Default size of a copy request.  This should be large enough to process
+     * multiple clusters in a single call, so that populating contiguous
+     * regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+    COMMIT_MAX_CHUNK_SIZE = 16 * 1024 * 1024, /* in bytes */
+
+    COMMIT_DEFAULT_IN_FLIGHT = 4,
+    COMMIT_MAX_IN_FLIGHT = 64,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+typedef struct CommitOp CommitOp;
+
 typedef struct CommitBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -42,8 +48,27 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+
+    int max_in_flight;
+    int chunk_sectors;
+    int in_flight;
+    int failed;
+    bool waiting_for_io;
+    /* Copy requests in sector order.  Failed requests stay here until
+     * commit_run() has dealt with them. */
+    QTAILQ_HEAD(, CommitOp) ops;
+    /* Everything below this sector that is not in @ops has been copied */
+    int64_t scan_sector;
 } CommitBlockJob;
 
+struct CommitOp {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+    QTAILQ_ENTRY(CommitOp) next;
+};
+
 static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -72,6 +97,104 @@ static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
     return 0;
 }
 
+static void commit_update_progress(CommitBlockJob *s)
+{
+    CommitOp *op = QTAILQ_FIRST(&s->ops);
+
+    s->common.offset = (op ? op->sector_num : s->scan_sector) *
+                       BDRV_SECTOR_SIZE;
+}
+
+static void coroutine_fn commit_populate_entry(void *opaque)
+{
+    CommitOp *op = opaque;
+    CommitBlockJob *s = op->s;
+    void *buf = blk_blockalign(s->top, op->nb_sectors * BDRV_SECTOR_SIZE);
+
+    op->ret = commit_populate(s->top, s->base, op->sector_num,
+                              op->nb_sectors, buf);
+    qemu_vfree(buf);
+    trace_commit_populate_done(s, op->sector_num, op->nb_sectors, op->ret);
+
+    s->in_flight--;
+    if (op->ret < 0) {
+        s->failed++;
+    } else {
+        QTAILQ_REMOVE(&s->ops, op, next);
+        g_free(op);
+        commit_update_progress(s);
+    }
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
+static CommitOp *commit_add_op(CommitBlockJob *s, int64_t sector_num,
+                               int nb_sectors)
+{
+    CommitOp *op = g_new0(CommitOp, 1);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    QTAILQ_INSERT_TAIL(&s->ops, op, next);
+    return op;
+}
+
+static void commit_issue(CommitBlockJob *s, int64_t sector_num,
+                         int nb_sectors)
+{
+    CommitOp *op = commit_add_op(s, sector_num, nb_sectors);
+
+    s->in_flight++;
+    qemu_coroutine_enter(qemu_coroutine_create(commit_populate_entry, op));
+}
+
+static void commit_fail(CommitBlockJob *s, int64_t sector_num, int nb_sectors,
+                        int ret)
+{
+    CommitOp *op = commit_add_op(s, sector_num, nb_sectors);
+
+    op->ret = ret;
+    s->failed++;
+}
+
+static void coroutine_fn commit_wait_for_io(CommitBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn commit_drain(CommitBlockJob *s)
+{
+    while (s->in_flight > 0) {
+        commit_wait_for_io(s);
+    }
+}
+
+/* Forget about the failed requests once nothing is in flight, and return
+ * the error and the start of the first one */
+static int commit_reap_failed(CommitBlockJob *s, int64_t *sector_num)
+{
+    CommitOp *op, *next_op;
+    int ret = 0;
+
+    assert(!s->in_flight);
+    QTAILQ_FOREACH_SAFE(op, &s->ops, next, next_op) {
+        if (!ret) {
+            ret = op->ret;
+            *sector_num = op->sector_num;
+        }
+        QTAILQ_REMOVE(&s->ops, op, next);
+        g_free(op);
+    }
+    s->failed = 0;
+    return ret;
+}
+
 typedef struct {
     int ret;
 } CommitCompleteData;
@@ -111,12 +234,11 @@ static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
     CommitCompleteData *data;
-    int64_t sector_num, end;
+    int64_t sector_num, end, failed_sector;
     uint64_t delay_ns = 0;
+    int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf = NULL;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = blk_getlength(s->top);
@@ -139,51 +261,82 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    for (sector_num = 0;;) {
         bool copy;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
+        delay_ns = 0;
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
-        /* Copy if allocated above the base */
+
+        /* Errors are handled once all requests have settled, so that the
+         * job can restart from the first failed request */
+        while (s->in_flight && (s->in_flight >= s->max_in_flight ||
+                                s->failed || sector_num == end)) {
+            commit_wait_for_io(s);
+        }
+        if (s->failed) {
+            BlockErrorAction action;
+
+            ret = commit_reap_failed(s, &failed_sector);
+            action = block_job_error_action(&s->common, false, s->on_error,
+                                            -ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                error = ret;
+                break;
+            }
+            sector_num = s->scan_sector = failed_sector;
+            commit_update_progress(s);
+            continue;
+        }
+        if (sector_num == end) {
+            break;
+        }
+
+        /* Copy if allocated above the base, skip whole unallocated ranges
+         * in a single step */
         ret = bdrv_is_allocated_above(blk_bs(s->top), blk_bs(s->base),
                                       sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
+                                      MIN(end - sector_num,
+                                          BDRV_REQUEST_MAX_SECTORS),
                                       &n);
         copy = (ret == 1);
         trace_commit_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            ret = commit_populate(s->top, s->base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
-        }
         if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, false, s->on_error, -ret);
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                goto out;
-            } else {
-                n = 0;
-                continue;
+            /* Handled like a failed copy of the next chunk */
+            n = MIN(end - sector_num, s->chunk_sectors);
+            commit_fail(s, sector_num, n, ret);
+        } else if (copy) {
+            n = MIN(n, s->chunk_sectors);
+            commit_issue(s, sector_num, n);
+            delay_ns = block_job_sched_delay(&s->common, n * BDRV_SECTOR_SIZE);
+            if (s->common.speed) {
+                delay_ns = MAX(delay_ns,
+                               ratelimit_calculate_delay(&s->limit, n));
             }
         }
+
         /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        sector_num += n;
+        s->scan_sector = sector_num;
+        commit_update_progress(s);
+    }
 
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+    commit_drain(s);
+    if (s->failed) {
+        ret = commit_reap_failed(s, &failed_sector);
+        if (error == 0) {
+            error = ret;
         }
     }
-
-    ret = 0;
+    ret = error;
 
 out:
-    qemu_vfree(buf);
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -201,10 +354,61 @@ static void commit_set_speed(BlockJob *job, int64_t speed, Error **errp)
     ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
 }
 
+static void commit_set_pipeline(BlockJob *job,
+                                bool has_max_in_flight, int64_t max_in_flight,
+                                bool has_chunk_size, int64_t chunk_size,
+                                Error **errp)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common);
+
+    if (has_max_in_flight &&
+        (max_in_flight < 0 || max_in_flight > COMMIT_MAX_IN_FLIGHT)) {
+        error_setg(errp, "Parameter 'max-in-flight' must be between 0 and %d",
+                   COMMIT_MAX_IN_FLIGHT);
+        return;
+    }
+    if (has_chunk_size &&
+        (chunk_size < 0 || chunk_size > COMMIT_MAX_CHUNK_SIZE ||
+         !QEMU_IS_ALIGNED(chunk_size, BDRV_SECTOR_SIZE))) {
+        error_setg(errp, "Parameter 'chunk-size' must be a multiple of %d "
+                   "and not exceed %d", BDRV_SECTOR_SIZE,
+                   COMMIT_MAX_CHUNK_SIZE);
+        return;
+    }
+
+    if (has_max_in_flight) {
+        s->max_in_flight = max_in_flight ?: COMMIT_DEFAULT_IN_FLIGHT;
+    }
+    if (has_chunk_size) {
+        s->chunk_sectors = (chunk_size ?: COMMIT_BUFFER_SIZE) >>
+                           BDRV_SECTOR_BITS;
+    }
+}
+
+static void commit_query(BlockJob *job, BlockJobInfo *info)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common);
+
+    info->has_max_in_flight = true;
+    info->max_in_flight = s->max_in_flight;
+    info->has_chunk_size = true;
+    info->chunk_size = (int64_t)s->chunk_sectors * BDRV_SECTOR_SIZE;
+}
+
+static void coroutine_fn commit_pause(BlockJob *job)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common);
+
+    commit_drain(s);
+}
+
 static const BlockJobDriver commit_job_driver = {
     .instance_size = sizeof(CommitBlockJob),
     .job_type      = BLOCK_JOB_TYPE_COMMIT,
     .set_speed     = commit_set_speed,
+    .set_pipeline  = commit_set_pipeline,
+    .query         = commit_query,
+    .pause         = commit_pause,
 };
 
 void commit_start(const char *job_id, BlockDriverState *bs,
@@ -262,9 +466,11 @@ void commit_start(const char *job_id, BlockDriverState *bs,
 
     s->base = blk_new();
     blk_insert_bs(s->base, base);
+    block_job_add_backend(&s->common, s->base);
 
     s->top = blk_new();
     blk_insert_bs(s->top, top);
+    block_job_add_backend(&s->common, s->top);
 
     s->active = bs;
 
@@ -272,6 +478,9 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     s->orig_overlay_flags  = orig_overlay_flags;
 
     s->backing_file_str = g_strdup(backing_file_str);
+    s->max_in_flight = COMMIT_DEFAULT_IN_FLIGHT;
+    s->chunk_sectors = COMMIT_BUFFER_SIZE >> BDRV_SECTOR_BITS;
+    QTAILQ_INIT(&s->ops);
 
     s->on_error = on_error;
     s->common.co = qemu_coroutine_create(commit_run, s);
@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -35,6 +36,12 @@
 #define BLOCK_CRYPTO_OPT_LUKS_HASH_ALG "hash-alg"
 #define BLOCK_CRYPTO_OPT_LUKS_ITER_TIME "iter-time"
 
+/* Number of threads that may encrypt or decrypt parts of one request */
+#define BLOCK_CRYPTO_MAX_THREADS 8
+
+/* Don't bother with the thread pool for less data than this */
+#define BLOCK_CRYPTO_MIN_PARALLEL_BYTES (64 * 1024)
+
 typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
@@ -319,6 +326,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
+                                       BLOCK_CRYPTO_MAX_THREADS,
                                        errp);
 
     if (!crypto->block) {
@@ -393,7 +401,109 @@ static void block_crypto_close(BlockDriverState *bs)
 }
 
 
-#define BLOCK_CRYPTO_MAX_SECTORS 32
+#define BLOCK_CRYPTO_MAX_SECTORS 2048
+
+typedef struct BlockCryptoCoState {
+    Coroutine *co;
+    bool waiting;
+    int pending;
+    int ret;
+} BlockCryptoCoState;
+
+typedef struct BlockCryptoTask {
+    QCryptoBlock *block;
+    BlockCryptoCoState *state;
+    bool encrypt;
+    uint64_t sector_num;
+    uint8_t *buf;
+    size_t len;
+} BlockCryptoTask;
+
+static int block_crypto_task_func(void *opaque)
+{
+    BlockCryptoTask *task = opaque;
+
+    if (task->encrypt) {
+        return qcrypto_block_encrypt(task->block, task->sector_num,
+                                     task->buf, task->len, NULL);
+    } else {
+        return qcrypto_block_decrypt(task->block, task->sector_num,
+                                     task->buf, task->len, NULL);
+    }
+}
+
+static void block_crypto_task_cb(void *opaque, int ret)
+{
+    BlockCryptoTask *task = opaque;
+    BlockCryptoCoState *state = task->state;
+
+    if (ret < 0) {
+        state->ret = -EIO;
+    }
+    if (--state->pending == 0 && state->waiting) {
+        qemu_coroutine_enter(state->co);
+    }
+}
+
+/*
+ * Encrypt or decrypt @nr_sectors sectors in @buf.  Big buffers are split
+ * into sector-aligned parts that are processed in parallel by the thread
+ * pool, so that the coroutine does not spend its time in the cipher.
+ */
+static coroutine_fn int
+block_crypto_co_crypt(BlockDriverState *bs, bool encrypt, int64_t sector_num,
+                      uint8_t *buf, int nr_sectors)
+{
+    BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    BlockCryptoTask tasks[BLOCK_CRYPTO_MAX_THREADS];
+    BlockCryptoCoState state = {
+        .co = qemu_coroutine_self(),
+    };
+    int n_tasks, per_task, i;
+
+    n_tasks = MIN(nr_sectors * 512 / BLOCK_CRYPTO_MIN_PARALLEL_BYTES,
+                  BLOCK_CRYPTO_MAX_THREADS);
+    if (n_tasks <= 1) {
+        BlockCryptoTask task = {
+            .block = crypto->block,
+            .encrypt = encrypt,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = nr_sectors * 512,
+        };
+        return block_crypto_task_func(&task) < 0 ? -EIO : 0;
+    }
+
+    per_task = DIV_ROUND_UP(nr_sectors, n_tasks);
+    for (i = 0; i < n_tasks && nr_sectors; i++) {
+        int n = MIN(per_task, nr_sectors);
+
+        tasks[i] = (BlockCryptoTask) {
+            .block = crypto->block,
+            .state = &state,
+            .encrypt = encrypt,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = n * 512,
+        };
+        state.pending++;
+        thread_pool_submit_aio(pool, block_crypto_task_func, &tasks[i],
+                               block_crypto_task_cb, &tasks[i]);
+
+        sector_num += n;
+        buf += n * 512;
+        nr_sectors -= n;
+    }
+
+    while (state.pending) {
+        state.waiting = true;
+        qemu_coroutine_yield();
+        state.waiting = false;
+    }
+
+    return state.ret;
+}
 
 static coroutine_fn int
 block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -439,11 +549,9 @@ block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, false, sector_num,
+                                    cipher_data, cur_nr_sectors);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -500,11 +608,9 @@ block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
         qemu_iovec_to_buf(qiov, bytes_done,
                           cipher_data, cur_nr_sectors * 512);
 
-        if (qcrypto_block_encrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, true, sector_num,
+                                    cipher_data, cur_nr_sectors);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -72,9 +72,11 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
                    CURLPROTO_TFTP)
 
 #define CURL_NUM_STATES 8
+#define CURL_NUM_STATES_MAX 64
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_DEFAULT (256 * 1024)
+#define READ_AHEAD_MAX_DEFAULT (4 * 1024 * 1024)
 #define CURL_TIMEOUT_DEFAULT 5
 #define CURL_TIMEOUT_MAX 10000
 
@@ -91,6 +93,25 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 #define CURL_BLOCK_OPT_PASSWORD_SECRET "password-secret"
 #define CURL_BLOCK_OPT_PROXY_USERNAME "proxy-username"
 #define CURL_BLOCK_OPT_PROXY_PASSWORD_SECRET "proxy-password-secret"
+#define CURL_BLOCK_OPT_CONNECTIONS "connections"
+#define CURL_BLOCK_OPT_READAHEAD_MAX "readahead-max"
+#define CURL_BLOCK_OPT_CACHE_FILE "cache-file"
+
+/*
+ * The optional local cache is a sparse file laid out as a header, a bitmap
+ * with one bit per chunk of the image, and the image data at its own
+ * offset.  Only whole chunks (or the tail of the image) are cached.
+ */
+#define CURL_CACHE_MAGIC "QEMUHTC1"
+#define CURL_CACHE_CHUNK_SIZE (64 * 1024)
+#define CURL_CACHE_HEADER_SIZE 4096
+
+typedef struct CURLCacheHeader {
+    char magic[8];
+    uint64_t len;
+    uint32_t chunk_size;
+    char url_hash[68];
+} CURLCacheHeader;
 
 struct BDRVCURLState;
 
@@ -124,9 +145,18 @@ typedef struct BDRVCURLState {
     CURLM *multi;
     QEMUTimer timer;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
     size_t readahead_size;
+    size_t readahead_max;
+    size_t cur_readahead;
+    size_t seq_end;
+    int cache_fd;
+    uint8_t *cache_bitmap;
+    uint64_t cache_nr_chunks;
+    off_t cache_data_offset;
+    bool cache_dirty;
     bool sslverify;
     uint64_t timeout;
     char *cookie;
@@ -172,19 +202,19 @@ static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
     switch (action) {
         case CURL_POLL_IN:
             aio_set_fd_handler(s->aio_context, fd, false,
-                               curl_multi_read, NULL, state);
+                               curl_multi_read, NULL, NULL, state);
             break;
         case CURL_POLL_OUT:
             aio_set_fd_handler(s->aio_context, fd, false,
-                               NULL, curl_multi_do, state);
+                               NULL, curl_multi_do, NULL, state);
             break;
         case CURL_POLL_INOUT:
             aio_set_fd_handler(s->aio_context, fd, false,
-                               curl_multi_read, curl_multi_do, state);
+                               curl_multi_read, curl_multi_do, NULL, state);
             break;
         case CURL_POLL_REMOVE:
             aio_set_fd_handler(s->aio_context, fd, false,
-                               NULL, NULL, NULL);
+                               NULL, NULL, NULL, NULL);
             break;
     }
 
@@ -248,7 +278,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -296,6 +326,145 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+static bool curl_cache_has_chunk(BDRVCURLState *s, uint64_t chunk)
+{
+    return s->cache_bitmap[chunk / 8] & (1 << (chunk % 8));
+}
+
+/* Copy [start, start + len) from the local cache if all of it is there */
+static bool curl_cache_lookup(BDRVCURLState *s, size_t start, size_t len,
+                              QEMUIOVector *qiov)
+{
+    uint64_t chunk;
+    void *buf;
+    bool hit;
+
+    if (!s->cache_bitmap || !len) {
+        return false;
+    }
+    for (chunk = start / CURL_CACHE_CHUNK_SIZE;
+         chunk <= (start + len - 1) / CURL_CACHE_CHUNK_SIZE; chunk++) {
+        if (!curl_cache_has_chunk(s, chunk)) {
+            return false;
+        }
+    }
+
+    buf = g_malloc(len);
+    hit = pread(s->cache_fd, buf, len, s->cache_data_offset + start) == len;
+    if (hit) {
+        qemu_iovec_from_buf(qiov, 0, buf, len);
+    }
+    g_free(buf);
+    return hit;
+}
+
+/* Store the complete chunks of a finished transfer in the local cache */
+static void curl_cache_insert(BDRVCURLState *s, size_t start,
+                              const char *buf, size_t len)
+{
+    uint64_t chunk = DIV_ROUND_UP(start, CURL_CACHE_CHUNK_SIZE);
+    size_t end = start + len;
+
+    if (!s->cache_bitmap) {
+        return;
+    }
+    for (; chunk < s->cache_nr_chunks; chunk++) {
+        size_t chunk_start = chunk * CURL_CACHE_CHUNK_SIZE;
+        size_t chunk_len = MIN(CURL_CACHE_CHUNK_SIZE, s->len - chunk_start);
+
+        if (chunk_start + chunk_len > end) {
+            break;
+        }
+        if (curl_cache_has_chunk(s, chunk)) {
+            continue;
+        }
+        if (pwrite(s->cache_fd, buf + (chunk_start - start), chunk_len,
+                   s->cache_data_offset + chunk_start) != chunk_len) {
+            return;
+        }
+        s->cache_bitmap[chunk / 8] |= 1 << (chunk % 8);
+        s->cache_dirty = true;
+    }
+}
+
+static void curl_cache_header_init(BDRVCURLState *s, CURLCacheHeader *hdr)
+{
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, s->url, -1);
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, CURL_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->len = cpu_to_le64(s->len);
+    hdr->chunk_size = cpu_to_le32(CURL_CACHE_CHUNK_SIZE);
+    pstrcpy(hdr->url_hash, sizeof(hdr->url_hash), hash);
+    g_free(hash);
+}
+
+/*
+ * Open the local cache for the image, reusing its contents if it was
+ * created for the same URL and image size.
+ */
+static int curl_cache_open(BDRVCURLState *s, const char *filename,
+                           Error **errp)
+{
+    CURLCacheHeader hdr, old;
+    size_t bitmap_size;
+
+    s->cache_fd = qemu_open(filename, O_RDWR | O_CREAT, 0644);
+    if (s->cache_fd < 0) {
+        int ret = -errno;
+        error_setg_errno(errp, -ret, "Could not open cache file '%s'",
+                         filename);
+        return ret;
+    }
+
+    s->cache_nr_chunks = DIV_ROUND_UP(s->len, CURL_CACHE_CHUNK_SIZE);
+    bitmap_size = DIV_ROUND_UP(s->cache_nr_chunks, 8);
+    s->cache_data_offset = CURL_CACHE_HEADER_SIZE +
+                           ROUND_UP(bitmap_size, CURL_CACHE_HEADER_SIZE);
+    s->cache_bitmap = g_malloc0(bitmap_size);
+
+    curl_cache_header_init(s, &hdr);
+    if (pread(s->cache_fd, &old, sizeof(old), 0) == sizeof(old) &&
+        !memcmp(&old, &hdr, sizeof(hdr)) &&
+        pread(s->cache_fd, s->cache_bitmap, bitmap_size,
+              CURL_CACHE_HEADER_SIZE) == bitmap_size) {
+        return 0;
+    }
+
+    /* Different or no image: start over */
+    memset(s->cache_bitmap, 0, bitmap_size);
+    if (ftruncate(s->cache_fd, 0) < 0 ||
+        ftruncate(s->cache_fd, s->cache_data_offset + s->len) < 0 ||
+        pwrite(s->cache_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        error_setg_errno(errp, errno, "Could not initialize cache file '%s'",
+                         filename);
+        qemu_close(s->cache_fd);
+        g_free(s->cache_bitmap);
+        s->cache_bitmap = NULL;
+        return -EIO;
+    }
+    return 0;
+}
+
+static void curl_cache_close(BDRVCURLState *s)
+{
+    if (!s->cache_bitmap) {
+        return;
+    }
+    /* The bitmap must not claim data that is not on disk yet */
+    if (s->cache_dirty && qemu_fdatasync(s->cache_fd) == 0) {
+        size_t bitmap_size = DIV_ROUND_UP(s->cache_nr_chunks, 8);
+
+        if (pwrite(s->cache_fd, s->cache_bitmap, bitmap_size,
+                   CURL_CACHE_HEADER_SIZE) != bitmap_size) {
+            error_report("curl: could not update cache bitmap");
+        }
+    }
+    qemu_close(s->cache_fd);
+    g_free(s->cache_bitmap);
+    s->cache_bitmap = NULL;
+}
+
 static void curl_multi_check_completion(BDRVCURLState *s)
 {
     int msgs_in_queue;
@@ -316,7 +485,10 @@ static void curl_multi_check_completion(BDRVCURLState *s)
                               (char **)&state);
 
             /* ACBs for successful messages get completed in curl_read_cb */
-            if (msg->data.result != CURLE_OK) {
+            if (msg->data.result == CURLE_OK) {
+                curl_cache_insert(s, state->buf_start, state->orig_buf,
+                                  state->buf_off);
+            } else {
                 int i;
                 static int errcount = 100;
 
@@ -397,7 +569,7 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
     int i, j;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
+        for (i = 0; i < s->num_states; i++) {
             for (j=0; j<CURL_NUM_ACB; j++)
                 if (s->states[i].acb[j])
                     continue;
@@ -434,6 +606,13 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
         curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
         curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
         curl_easy_setopt(state->curl, CURLOPT_FAILONERROR, 1);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        /* Use HTTP/2 where the server offers it, so that the transfers
+         * share one connection */
+        curl_easy_setopt(state->curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(state->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
 
         if (s->username) {
             curl_easy_setopt(state->curl, CURLOPT_USERNAME, s->username);
@@ -489,7 +668,7 @@ static void curl_detach_aio_context(BlockDriverState *bs)
     BDRVCURLState *s = bs->opaque;
     int i;
 
-    for (i = 0; i < CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         if (s->states[i].in_use) {
             curl_clean_state(&s->states[i]);
         }
@@ -521,6 +700,9 @@ static void curl_attach_aio_context(BlockDriverState *bs,
     s->multi = curl_multi_init();
     s->aio_context = new_context;
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
 #ifdef NEED_CURL_TIMER_CALLBACK
     curl_multi_setopt(s->multi, CURLMOPT_TIMERDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
@@ -576,6 +758,21 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of secret used as password for HTTP proxy auth",
         },
+        {
+            .name = CURL_BLOCK_OPT_CONNECTIONS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of parallel transfers",
+        },
+        {
+            .name = CURL_BLOCK_OPT_READAHEAD_MAX,
+            .type = QEMU_OPT_SIZE,
+            .help = "Readahead size that sequential reads grow up to",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CACHE_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "Local file that keeps the data read from the server",
+        },
         { /* end of list */ }
     },
 };
@@ -590,8 +787,10 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     Error *local_err = NULL;
     const char *file;
     const char *cookie;
+    const char *cache_file;
     double d;
     const char *secretid;
+    uint64_t connections;
 
     static int inited = 0;
 
@@ -614,6 +813,21 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
                    s->readahead_size);
         goto out_noclean;
     }
+    s->readahead_max = qemu_opt_get_size(opts, CURL_BLOCK_OPT_READAHEAD_MAX,
+                                         READ_AHEAD_MAX_DEFAULT);
+    s->readahead_max = MAX(s->readahead_max, s->readahead_size);
+    s->readahead_max = ROUND_UP(s->readahead_max, SECTOR_SIZE);
+    s->cur_readahead = s->readahead_size;
+
+    connections = qemu_opt_get_number(opts, CURL_BLOCK_OPT_CONNECTIONS,
+                                      CURL_NUM_STATES);
+    if (connections < 1 || connections > CURL_NUM_STATES_MAX) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   CURL_NUM_STATES_MAX);
+        goto out_noclean;
+    }
+    s->num_states = connections;
+    s->states = g_new0(CURLState, s->num_states);
 
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_TIMEOUT_DEFAULT);
@@ -709,6 +923,11 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    cache_file = qemu_opt_get(opts, CURL_BLOCK_OPT_CACHE_FILE);
+    if (cache_file && s->len && curl_cache_open(s, cache_file, errp) < 0) {
+        goto out_noclean;
+    }
+
     curl_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
     qemu_opts_del(opts);
@@ -721,6 +940,7 @@ out:
 out_noclean:
     g_free(s->cookie);
     g_free(s->url);
+    g_free(s->states);
     qemu_opts_del(opts);
     return -EINVAL;
 }
@@ -739,11 +959,21 @@ static void curl_readv_bh_cb(void *p)
     BDRVCURLState *s = acb->common.bs->opaque;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
     size_t end;
+    bool sequential = start == s->seq_end;
+
+    s->seq_end = start + len;
+
+    if (curl_cache_lookup(s, start, len, acb->qiov)) {
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_unref(acb);
+        return;
+    }
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_unref(acb);
             // fall through
@@ -762,12 +992,19 @@ static void curl_readv_bh_cb(void *p)
     }
 
     acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    acb->end = len;
+
+    /* Grow the readahead while the guest keeps reading sequentially */
+    if (sequential) {
+        s->cur_readahead = MIN(s->cur_readahead * 2, s->readahead_max);
+    } else {
+        s->cur_readahead = s->readahead_size;
+    }
 
     state->buf_off = 0;
     g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
+    state->buf_len = acb->end + s->cur_readahead;
     end = MIN(start + state->buf_len, s->len) - 1;
     state->orig_buf = g_try_malloc(state->buf_len);
     if (state->buf_len && state->orig_buf == NULL) {
@@ -811,9 +1048,11 @@ static void curl_close(BlockDriverState *bs)
 
     DPRINTF("CURL: Close\n");
     curl_detach_aio_context(bs);
+    curl_cache_close(s);
 
     g_free(s->cookie);
     g_free(s->url);
+    g_free(s->states);
 }
 
 static int64_t curl_getlength(BlockDriverState *bs)
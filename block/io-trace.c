@@ -0,0 +1,97 @@
+/*
+ * Per-request I/O latency breakdown
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "block/io-trace.h"
+
+int io_trace_users;
+
+static const char *const io_trace_stage_names[IO_TRACE__MAX] = {
+    [IO_TRACE_POP]        = "pop",
+    [IO_TRACE_SETUP]      = "setup",
+    [IO_TRACE_BLOCK]      = "block",
+    [IO_TRACE_THROTTLE]   = "throttle",
+    [IO_TRACE_METADATA]   = "metadata",
+    [IO_TRACE_QUEUE]      = "queue",
+    [IO_TRACE_DEVICE]     = "device",
+    [IO_TRACE_COMPLETION] = "completion",
+    [IO_TRACE_NOTIFY]     = "notify",
+    [IO_TRACE_TOTAL]      = "total",
+};
+
+void io_trace_enable(void)
+{
+    atomic_inc(&io_trace_users);
+}
+
+void io_trace_disable(void)
+{
+    assert(atomic_read(&io_trace_users) > 0);
+    atomic_dec(&io_trace_users);
+}
+
+void io_trace_start(IOTrace *trace, int64_t start_ns)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->start_ns = trace->mark_ns = start_ns;
+}
+
+void io_trace_inherit(IOTrace *trace, const IOTrace *from)
+{
+    int i;
+
+    for (i = IO_TRACE_SETUP + 1; i < IO_TRACE_TOTAL; i++) {
+        trace->stage_ns[i] = from->stage_ns[i];
+    }
+    trace->mark_ns = from->mark_ns;
+}
+
+/* Bin i counts latencies below 2^i microseconds, the last one the rest */
+static int io_trace_bin(int64_t ns)
+{
+    int64_t us = ns / SCALE_US;
+
+    if (us <= 0) {
+        return 0;
+    }
+    return MIN(64 - clz64(us), IO_TRACE_NBINS - 1);
+}
+
+bool io_trace_account(IOTraceStats *stats, IOTrace *trace)
+{
+    int i;
+
+    trace->stage_ns[IO_TRACE_TOTAL] = trace->mark_ns - trace->start_ns;
+    for (i = 0; i < IO_TRACE__MAX; i++) {
+        stats->bins[i][io_trace_bin(trace->stage_ns[i])]++;
+    }
+    stats->requests++;
+
+    if (!stats->sample_every || ++stats->sample_count < stats->sample_every) {
+        return false;
+    }
+    stats->sample_count = 0;
+    return true;
+}
+
+void io_trace_stats_report(StatsCollector *c, const IOTraceStats *stats)
+{
+    uint64_t boundaries[IO_TRACE_NBINS - 1];
+    int i;
+
+    for (i = 0; i < IO_TRACE_NBINS - 1; i++) {
+        boundaries[i] = SCALE_US << i;
+    }
+    stats_add_counter(c, "requests", stats->requests);
+    for (i = 0; i < IO_TRACE__MAX; i++) {
+        stats_add_histogram(c, io_trace_stage_names[i], IO_TRACE_NBINS,
+                            boundaries, stats->bins[i]);
+    }
+}
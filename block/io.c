@@ -28,6 +28,7 @@
 #include "block/blockjob.h"
 #include "block/block_int.h"
 #include "qemu/cutils.h"
+#include "qemu/obj-pool.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 
@@ -246,6 +247,28 @@ void bdrv_drained_end(BlockDriverState *bs)
     aio_enable_external(bdrv_get_aio_context(bs));
 }
 
+void bdrv_subtree_drained_begin(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    /* Quiescing a child also quiesces its parents, bs included, so by the
+     * time bs itself is drained only the children's other users are left */
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_subtree_drained_begin(child->bs);
+    }
+    bdrv_drained_begin(bs);
+}
+
+void bdrv_subtree_drained_end(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    bdrv_drained_end(bs);
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_subtree_drained_end(child->bs);
+    }
+}
+
 /*
  * Wait for pending requests to complete on a single BlockDriverState subtree,
  * and suspend block driver's internal I/O until next request arrives.
@@ -275,6 +298,10 @@ void bdrv_drain(BlockDriverState *bs)
  *
  * This function does not flush data to disk, use bdrv_flush_all() for that
  * after calling this function.
+ *
+ * Every node and every block job is stopped until all of them are idle, so
+ * operations that only touch part of the graph should use a drained section
+ * on the affected nodes instead.
  */
 void bdrv_drain_all(void)
 {
@@ -361,7 +388,7 @@ void bdrv_drain_all(void)
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
     if (req->serialising) {
-        req->bs->serialising_in_flight--;
+        QLIST_REMOVE(req, serialising_list);
     }
 
     QLIST_REMOVE(req, list);
@@ -400,7 +427,8 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
                                - overlap_offset;
 
     if (!req->serialising) {
-        req->bs->serialising_in_flight++;
+        QLIST_INSERT_HEAD(&req->bs->serialising_requests, req,
+                          serialising_list);
         req->serialising = true;
     }
 
@@ -476,6 +504,26 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
     return true;
 }
 
+static bool tracked_request_must_wait(BdrvTrackedRequest *self,
+                                      BdrvTrackedRequest *req)
+{
+    if (!tracked_request_overlaps(req, self->overlap_offset,
+                                  self->overlap_bytes)) {
+        return false;
+    }
+
+    /* Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /* If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case). */
+    return !req->waiting_for;
+}
+
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
@@ -483,38 +531,37 @@ static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
     bool retry;
     bool waited = false;
 
-    if (!bs->serialising_in_flight) {
+    if (QLIST_EMPTY(&bs->serialising_requests)) {
         return false;
     }
 
     do {
         retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
+        if (self->serialising) {
+            /* A serialising request waits for every overlapping request */
+            QLIST_FOREACH(req, &bs->tracked_requests, list) {
+                if (req != self && tracked_request_must_wait(self, req)) {
+                    break;
+                }
             }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
+        } else {
+            /* Everything else only waits for serialising requests, which
+             * are usually few even at high queue depths.
+             */
+            QLIST_FOREACH(req, &bs->serialising_requests, serialising_list) {
+                if (tracked_request_must_wait(self, req)) {
                     break;
                 }
             }
         }
+
+        if (req) {
+            self->waiting_for = req;
+            qemu_co_queue_wait(&req->wait_queue);
+            self->waiting_for = NULL;
+            retry = true;
+            waited = true;
+        }
     } while (retry);
 
     return waited;
@@ -1048,8 +1095,8 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
 
             num = MIN(bytes_remaining, MIN(max_bytes, max_transfer));
             assert(num);
-            qemu_iovec_init(&local_qiov, qiov->niov);
-            qemu_iovec_concat(&local_qiov, qiov, bytes - bytes_remaining, num);
+            qemu_iovec_init_slice(&local_qiov, qiov, bytes - bytes_remaining,
+                                  num);
 
             ret = bdrv_driver_preadv(bs, offset + bytes - bytes_remaining,
                                      num, &local_qiov, 0);
@@ -1299,6 +1346,10 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    req->write_offset = offset;
+    req->write_bytes = bytes;
+    req->write_qiov = qiov;
+    req->write_flags = flags;
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1334,8 +1385,8 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
                  * need to flush on the last iteration */
                 local_flags &= ~BDRV_REQ_FUA;
             }
-            qemu_iovec_init(&local_qiov, qiov->niov);
-            qemu_iovec_concat(&local_qiov, qiov, bytes - bytes_remaining, num);
+            qemu_iovec_init_slice(&local_qiov, qiov, bytes - bytes_remaining,
+                                  num);
 
             ret = bdrv_driver_pwritev(bs, offset + bytes - bytes_remaining,
                                       num, &local_qiov, local_flags);
@@ -1350,6 +1401,8 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
 
     ++bs->write_gen;
     bdrv_set_dirty(bs, start_sector, end_sector - start_sector);
+    bdrv_block_status_cache_invalidate(bs, start_sector,
+                                       end_sector - start_sector);
 
     if (bs->wr_highest_offset < offset + bytes) {
         bs->wr_highest_offset = offset + bytes;
@@ -1617,6 +1670,111 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    int64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    int64_t dst_offset,
+                                                    int bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BdrvTrackedRequest req;
+    BlockDriverState *bs;
+    uint64_t align;
+    int ret;
+
+    if (!src || !src->bs || !src->bs->drv ||
+        !dst || !dst->bs || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    ret = bdrv_check_byte_request(src->bs, src_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_check_byte_request(dst->bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    } else if (dst->bs->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst->bs->open_flags & BDRV_O_INACTIVE));
+
+    /* There is no bounce buffer to fix up unaligned requests with */
+    align = MAX(src->bs->bl.request_alignment,
+                dst->bs->bl.request_alignment);
+    if (!QEMU_IS_ALIGNED(src_offset | dst_offset | bytes, align)) {
+        return -ENOTSUP;
+    }
+
+    bs = recurse_src ? src->bs : dst->bs;
+    if (recurse_src) {
+        if (!bs->drv->bdrv_co_copy_range_from) {
+            return -ENOTSUP;
+        }
+
+        tracked_request_begin(&req, bs, src_offset, bytes, BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+        ret = bs->drv->bdrv_co_copy_range_from(bs, src, src_offset,
+                                               dst, dst_offset, bytes, flags);
+    } else {
+        /* Write notifiers expect to see the data that is written */
+        if (!bs->drv->bdrv_co_copy_range_to ||
+            !QLIST_EMPTY(&bs->before_write_notifiers.notifiers)) {
+            return -ENOTSUP;
+        }
+
+        tracked_request_begin(&req, bs, dst_offset, bytes, BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+        ret = bs->drv->bdrv_co_copy_range_to(bs, src, src_offset,
+                                             dst, dst_offset, bytes, flags);
+
+        ++bs->write_gen;
+        bdrv_set_dirty(bs, dst_offset >> BDRV_SECTOR_BITS,
+                       DIV_ROUND_UP(dst_offset + bytes, BDRV_SECTOR_SIZE) -
+                       (dst_offset >> BDRV_SECTOR_BITS));
+        bdrv_block_status_cache_invalidate(bs, dst_offset >> BDRV_SECTOR_BITS,
+            DIV_ROUND_UP(dst_offset + bytes, BDRV_SECTOR_SIZE) -
+            (dst_offset >> BDRV_SECTOR_BITS));
+        if (ret >= 0 && bs->wr_highest_offset < dst_offset + bytes) {
+            bs->wr_highest_offset = dst_offset + bytes;
+        }
+    }
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+/*
+ * Called by format and filter drivers to pass a copy request on to the node
+ * that contains the source data.
+ */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
+                                         BdrvChild *dst, int64_t dst_offset,
+                                         int bytes, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset, bytes,
+                                  flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/*
+ * Called by the protocol driver of the source to pass a copy request on to
+ * the node that the data is written to.
+ */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, int64_t src_offset,
+                                       BdrvChild *dst, int64_t dst_offset,
+                                       int bytes, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset, bytes,
+                                flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
 /*
  * Flush ALL BDSes regardless of if they are reachable via a BlkBackend or not.
  */
@@ -1653,6 +1811,77 @@ typedef struct BdrvCoGetBlockStatusData {
     bool done;
 } BdrvCoGetBlockStatusData;
 
+/*
+ * Drop the cached block status of [sector_num, sector_num + nb_sectors),
+ * because it is about to be, or has been, written to.  Pass INT64_MAX as
+ * @nb_sectors to forget everything.
+ */
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int64_t nb_sectors)
+{
+    int i;
+
+    for (i = 0; i < BDRV_BLOCK_STATUS_CACHE_SIZE; i++) {
+        BdrvBlockStatusCacheEntry *entry = &bs->block_status_cache[i];
+
+        if (entry->nb_sectors &&
+            sector_num < entry->sector_num + entry->nb_sectors &&
+            entry->sector_num - sector_num < nb_sectors) {
+            entry->nb_sectors = 0;
+        }
+    }
+}
+
+static bool bdrv_block_status_cache_lookup(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           int nb_sectors, int *pnum,
+                                           BlockDriverState **file,
+                                           int64_t *ret)
+{
+    int i;
+
+    for (i = 0; i < BDRV_BLOCK_STATUS_CACHE_SIZE; i++) {
+        BdrvBlockStatusCacheEntry *entry = &bs->block_status_cache[i];
+        int64_t skip = sector_num - entry->sector_num;
+
+        if (entry->nb_sectors && skip >= 0 && skip < entry->nb_sectors) {
+            *pnum = MIN(nb_sectors, entry->nb_sectors - skip);
+            *file = entry->file;
+            *ret = entry->ret;
+            if (*ret & BDRV_BLOCK_OFFSET_VALID) {
+                *ret += skip << BDRV_SECTOR_BITS;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bdrv_block_status_cache_store(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          int nb_sectors, int64_t ret,
+                                          BlockDriverState *file)
+{
+    BdrvBlockStatusCacheEntry *entry;
+
+    /* Results that refer to another node describe that node's state */
+    if (ret & BDRV_BLOCK_RAW || nb_sectors == 0) {
+        return;
+    }
+
+    bdrv_block_status_cache_invalidate(bs, sector_num, nb_sectors);
+    entry = &bs->block_status_cache[bs->block_status_cache_next];
+    bs->block_status_cache_next = (bs->block_status_cache_next + 1) %
+                                  BDRV_BLOCK_STATUS_CACHE_SIZE;
+    *entry = (BdrvBlockStatusCacheEntry) {
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .ret        = ret,
+        .file       = file,
+    };
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -1705,11 +1934,21 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
     }
 
     *file = NULL;
-    ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum,
-                                            file);
-    if (ret < 0) {
-        *pnum = 0;
-        return ret;
+    if (!bs->drv->cache_block_status ||
+        !bdrv_block_status_cache_lookup(bs, sector_num, nb_sectors, pnum,
+                                        file, &ret)) {
+        unsigned int write_gen = bs->write_gen;
+
+        ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors,
+                                                pnum, file);
+        if (ret < 0) {
+            *pnum = 0;
+            return ret;
+        }
+        /* Don't cache the result if a write raced with the query */
+        if (bs->drv->cache_block_status && write_gen == bs->write_gen) {
+            bdrv_block_status_cache_store(bs, sector_num, *pnum, ret, *file);
+        }
     }
 
     if (ret & BDRV_BLOCK_RAW) {
@@ -2225,12 +2464,25 @@ BlockAIOCB *bdrv_aio_pdiscard(BlockDriverState *bs, int64_t offset, int count,
     return &acb->common;
 }
 
+/* AIOCBs are allocated once per request; recycle them by size class */
+static ObjPool aiocb_pools[] = {
+    OBJ_POOL_INITIALIZER(128, 64),
+    OBJ_POOL_INITIALIZER(256, 64),
+    OBJ_POOL_INITIALIZER(512, 64),
+};
+
 void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
                    BlockCompletionFunc *cb, void *opaque)
 {
     BlockAIOCB *acb;
+    int i;
 
-    acb = g_malloc(aiocb_info->aiocb_size);
+    for (i = 0; i < ARRAY_SIZE(aiocb_pools) - 1; i++) {
+        if (aiocb_info->aiocb_size <= aiocb_pools[i].size) {
+            break;
+        }
+    }
+    acb = obj_pool_alloc(&aiocb_pools[i], aiocb_info->aiocb_size);
     acb->aiocb_info = aiocb_info;
     acb->bs = bs;
     acb->cb = cb;
@@ -2250,7 +2502,7 @@ void qemu_aio_unref(void *p)
     BlockAIOCB *acb = p;
     assert(acb->refcnt > 0);
     if (--acb->refcnt == 0) {
-        g_free(acb);
+        obj_pool_free(acb);
     }
 }
 
@@ -2491,6 +2743,8 @@ out:
     ++bs->write_gen;
     bdrv_set_dirty(bs, req.offset >> BDRV_SECTOR_BITS,
                    req.bytes >> BDRV_SECTOR_BITS);
+    bdrv_block_status_cache_invalidate(bs, req.offset >> BDRV_SECTOR_BITS,
+                                       req.bytes >> BDRV_SECTOR_BITS);
     tracked_request_end(&req);
     return ret;
 }
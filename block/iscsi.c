@@ -33,6 +33,7 @@
 #include "qemu/error-report.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/cutils.h"
 #include "block/block_int.h"
 #include "block/scsi.h"
 #include "qemu/iov.h"
@@ -48,14 +49,29 @@
 #include <scsi/sg.h>
 #endif
 
+struct IscsiLun;
+
+/* One login to the target.  Every session has its own TCP connection. */
+typedef struct IscsiSession {
+    struct iscsi_context *iscsi;
+    struct IscsiLun *iscsilun;
+    int events;
+    unsigned int in_flight;
+} IscsiSession;
+
 typedef struct IscsiLun {
+    /* Session used for everything but reads and writes; same as sessions[0] */
     struct iscsi_context *iscsi;
+    IscsiSession *sessions;
+    int num_sessions;
+    int next_session;
+    /* True while libiscsi is dispatching completions from an fd handler */
+    bool in_service;
     AioContext *aio_context;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     QEMUTimer *event_timer;
     struct scsi_inquiry_logical_block_provisioning lbp;
@@ -120,6 +136,7 @@ typedef struct IscsiAIOCB {
 #define EVENT_INTERVAL 1000
 #define NOP_INTERVAL 5000
 #define MAX_NOP_FAILURES 3
+#define ISCSI_MAX_SESSIONS 16
 #define ISCSI_CMD_RETRIES ARRAY_SIZE(iscsi_retry_times)
 static const unsigned iscsi_retry_times[] = {8, 32, 128, 512, 2048, 8192, 32768};
 
@@ -297,8 +314,17 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
 
 out:
     if (iTask->co) {
-        aio_bh_schedule_oneshot(iTask->iscsilun->aio_context,
-                                 iscsi_co_generic_bh_cb, iTask);
+        if (iTask->iscsilun->in_service && !qemu_in_coroutine()) {
+            /* We come straight from iscsi_service() in the fd handler, so
+             * it is safe to re-enter the coroutine without a BH round trip.
+             * libiscsi allows freeing the task and queueing new commands
+             * from its callbacks. */
+            iTask->complete = 1;
+            qemu_coroutine_enter(iTask->co);
+        } else {
+            aio_bh_schedule_oneshot(iTask->iscsilun->aio_context,
+                                     iscsi_co_generic_bh_cb, iTask);
+        }
     } else {
         iTask->complete = 1;
     }
@@ -348,31 +374,66 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_session_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiLun *iscsilun = session->iscsilun;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev = iscsi_which_events(iscsi);
 
-    if (ev != iscsilun->events) {
+    if (ev != session->events) {
         aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsi),
                            false,
                            (ev & POLLIN) ? iscsi_process_read : NULL,
-                           (ev & POLLOUT) ? iscsi_process_write : NULL,
-                           iscsilun);
-        iscsilun->events = ev;
+                           (ev & POLLOUT) ? iscsi_process_write : NULL, NULL,
+                           session);
+        session->events = ev;
     }
 }
 
+static void
+iscsi_set_events(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_session_set_events(&iscsilun->sessions[i]);
+    }
+}
+
+/* Reads and writes go to the session with the fewest requests in flight,
+ * rotating between sessions that are equally busy. */
+static IscsiSession *iscsi_pick_session(IscsiLun *iscsilun)
+{
+    IscsiSession *best = NULL;
+    int i;
+
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[(iscsilun->next_session + i)
+                                                    % iscsilun->num_sessions];
+        if (!best || session->in_flight < best->in_flight) {
+            best = session;
+        }
+    }
+    iscsilun->next_session = (iscsilun->next_session + 1) %
+                             iscsilun->num_sessions;
+    return best;
+}
+
 static void iscsi_timed_check_events(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
     /* check for timed out requests */
-    iscsi_service(iscsilun->iscsi, 0);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_service(iscsilun->sessions[i].iscsi, 0);
+    }
 
     if (iscsilun->request_timed_out) {
         iscsilun->request_timed_out = false;
-        iscsi_reconnect(iscsilun->iscsi);
+        for (i = 0; i < iscsilun->num_sessions; i++) {
+            iscsi_reconnect(iscsilun->sessions[i].iscsi);
+        }
     }
 
     /* newer versions of libiscsi may return zero events. Ensure we are able
@@ -384,23 +445,27 @@ static void iscsi_timed_check_events(void *opaque)
 }
 
 static void
-iscsi_process_read(void *arg)
+iscsi_session_service(IscsiSession *session, int revents)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiLun *iscsilun = session->iscsilun;
+    bool in_service = iscsilun->in_service;
 
-    iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsilun->in_service = true;
+    iscsi_service(session->iscsi, revents);
+    iscsilun->in_service = in_service;
+    iscsi_session_set_events(session);
 }
 
 static void
-iscsi_process_write(void *arg)
+iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    iscsi_session_service(arg, POLLIN);
+}
 
-    iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+static void
+iscsi_process_write(void *arg)
+{
+    iscsi_session_service(arg, POLLOUT);
 }
 
 static int64_t sector_lun2qemu(int64_t sector, IscsiLun *iscsilun)
@@ -571,6 +636,7 @@ iscsi_co_writev_flags(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
                       QEMUIOVector *iov, int flags)
 {
     IscsiLun *iscsilun = bs->opaque;
+    IscsiSession *session;
     struct IscsiTask iTask;
     uint64_t lba;
     uint32_t num_sectors;
@@ -591,13 +657,14 @@ iscsi_co_writev_flags(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     num_sectors = sector_qemu2lun(nb_sectors, iscsilun);
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
+    session = iscsi_pick_session(iscsilun);
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write16_task(session->iscsi, iscsilun->lun, lba,
                                         NULL, num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_write10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write10_task(session->iscsi, iscsilun->lun, lba,
                                         NULL, num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
@@ -607,10 +674,12 @@ retry:
     }
     scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
                           iov->niov);
+    session->in_flight++;
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_session_set_events(session);
         qemu_coroutine_yield();
     }
+    session->in_flight--;
 
     if (iTask.task != NULL) {
         scsi_free_scsi_task(iTask.task);
@@ -740,6 +809,7 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
                                        QEMUIOVector *iov)
 {
     IscsiLun *iscsilun = bs->opaque;
+    IscsiSession *session;
     struct IscsiTask iTask;
     uint64_t lba;
     uint32_t num_sectors;
@@ -788,13 +858,14 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
+    session = iscsi_pick_session(iscsilun);
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read16_task(session->iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read10_task(session->iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size,
                                        0, 0, 0, 0, 0,
@@ -805,10 +876,12 @@ retry:
     }
     scsi_task_set_iov_in(iTask.task, (struct scsi_iovec *) iov->iov, iov->niov);
 
+    session->in_flight++;
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_session_set_events(session);
         qemu_coroutine_yield();
     }
+    session->in_flight--;
 
     if (iTask.task != NULL) {
         scsi_free_scsi_task(iTask.task);
@@ -1343,16 +1416,52 @@ static int parse_timeout(const char *target)
     return 0;
 }
 
+static int parse_sessions(const char *target, Error **errp)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+    const char *sessions;
+    unsigned long val;
+
+    list = qemu_find_opts("iscsi");
+    if (list) {
+        opts = qemu_opts_find(list, target);
+        if (!opts) {
+            opts = QTAILQ_FIRST(&list->head);
+        }
+        if (opts) {
+            sessions = qemu_opt_get(opts, "sessions");
+            if (sessions) {
+                if (qemu_strtoul(sessions, NULL, 10, &val) < 0 ||
+                    val < 1 || val > ISCSI_MAX_SESSIONS) {
+                    error_setg(errp, "iSCSI: sessions must be between 1 "
+                               "and %d", ISCSI_MAX_SESSIONS);
+                    return -1;
+                }
+                return val;
+            }
+        }
+    }
+
+    return 1;
+}
+
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) >= MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsilun->request_timed_out = true;
-    } else if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsi_get_nops_in_flight(iscsi) >= MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            iscsilun->request_timed_out = true;
+        } else if (iscsi_nop_out_async(iscsi, NULL, NULL, 0, NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
@@ -1484,10 +1593,15 @@ fail_with_err:
 static void iscsi_detach_aio_context(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
-    aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsilun->iscsi),
-                       false, NULL, NULL, NULL);
-    iscsilun->events = 0;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(session->iscsi),
+                           false, NULL, NULL, NULL, NULL);
+        session->events = 0;
+    }
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
@@ -1560,57 +1674,25 @@ out:
     }
 }
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
-                      Error **errp)
+/* Create a context for @iscsi_url and log into the target and LUN */
+static int iscsi_connect_session(struct iscsi_url *iscsi_url,
+                                 const char *initiator_name,
+                                 struct iscsi_context **piscsi, Error **errp)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_inquiry_supported_pages *inq_vpd;
-    char *initiator_name = NULL;
-    QemuOpts *opts;
+    struct iscsi_context *iscsi;
     Error *local_err = NULL;
-    const char *filename;
-    int i, ret = 0, timeout = 0;
-
-    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    filename = qemu_opt_get(opts, "filename");
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_setg(errp, "Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
+    int ret, timeout;
 
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_setg(errp, "iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
+        return -ENOMEM;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_setg(errp, "iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user[0] != '\0') {
@@ -1619,7 +1701,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         if (ret != 0) {
             error_setg(errp, "Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -1628,13 +1710,13 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_setg(errp, "iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -1644,7 +1726,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     /* timeout handling is broken in libiscsi before 1.15.0 */
@@ -1661,10 +1743,96 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    *piscsi = iscsi;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return ret;
+}
+
+static void iscsi_close_sessions(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsi == NULL) {
+            continue;
+        }
+        if (iscsi_is_logged_in(iscsi)) {
+            iscsi_logout_sync(iscsi);
+        }
+        iscsi_destroy_context(iscsi);
+    }
+    g_free(iscsilun->sessions);
+    iscsilun->sessions = NULL;
+    iscsilun->num_sessions = 0;
+    iscsilun->iscsi = NULL;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_inquiry_supported_pages *inq_vpd;
+    char *initiator_name = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    int i, ret = 0, num_sessions;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    filename = qemu_opt_get(opts, "filename");
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_setg(errp, "Failed to parse URL : %s", filename);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    num_sessions = parse_sessions(iscsi_url->target, errp);
+    if (num_sessions < 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    ret = iscsi_connect_session(iscsi_url, initiator_name, &iscsi, errp);
+    if (ret < 0) {
         goto out;
     }
 
     iscsilun->iscsi = iscsi;
+    iscsilun->sessions = g_new0(IscsiSession, num_sessions);
+    iscsilun->num_sessions = num_sessions;
+    for (i = 0; i < num_sessions; i++) {
+        iscsilun->sessions[i].iscsi = i ? NULL : iscsi;
+        iscsilun->sessions[i].iscsilun = iscsilun;
+    }
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun   = iscsi_url->lun;
     iscsilun->has_write_same = true;
@@ -1752,6 +1920,16 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     scsi_free_scsi_task(task);
     task = NULL;
 
+    /* MC/S is not available in libiscsi, so additional connections are
+     * separate logins to the same LUN.  They only carry reads and writes. */
+    for (i = 1; i < num_sessions; i++) {
+        ret = iscsi_connect_session(iscsi_url, initiator_name,
+                                    &iscsilun->sessions[i].iscsi, errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     iscsi_attach_aio_context(bs, iscsilun->aio_context);
 
     /* Guess the internal cluster (page) size of the iscsi target by the means
@@ -1777,7 +1955,9 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
+        if (iscsilun->sessions != NULL) {
+            iscsi_close_sessions(iscsilun);
+        } else if (iscsi != NULL) {
             if (iscsi_is_logged_in(iscsi)) {
                 iscsi_logout_sync(iscsi);
             }
@@ -1791,13 +1971,9 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
     iscsi_detach_aio_context(bs);
-    if (iscsi_is_logged_in(iscsi)) {
-        iscsi_logout_sync(iscsi);
-    }
-    iscsi_destroy_context(iscsi);
+    iscsi_close_sessions(iscsilun);
     g_free(iscsilun->zeroblock);
     iscsi_allocmap_free(iscsilun);
     memset(iscsilun, 0, sizeof(IscsiLun));
@@ -1938,9 +2114,7 @@ static int iscsi_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = 0;
 out:
-    if (iscsilun->iscsi != NULL) {
-        iscsi_destroy_context(iscsilun->iscsi);
-    }
+    iscsi_close_sessions(iscsilun);
     g_free(bs->opaque);
     bs->opaque = NULL;
     bdrv_unref(bs);
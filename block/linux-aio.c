@@ -15,6 +15,7 @@
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
 #include "qemu/coroutine.h"
+#include "block/io-trace.h"
 
 #include <libaio.h>
 
@@ -37,6 +38,7 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
+    IOTrace *trace;
     QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
@@ -77,6 +79,7 @@ static void qemu_laio_process_completion(struct qemu_laiocb *laiocb)
 {
     int ret;
 
+    io_trace_mark(laiocb->trace, IO_TRACE_DEVICE);
     ret = laiocb->ret;
     if (ret != -ECANCELED) {
         if (ret == laiocb->nbytes) {
@@ -255,6 +258,20 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LinuxAioState *s = container_of(e, LinuxAioState, e);
+    struct io_event *events;
+
+    if (!io_getevents_peek(s->ctx, &events)) {
+        return false;
+    }
+
+    qemu_laio_process_completions_and_submit(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -290,7 +307,7 @@ static void ioq_init(LaioQueue *io_q)
 
 static void ioq_submit(LinuxAioState *s)
 {
-    int ret, len;
+    int ret, len, i;
     struct qemu_laiocb *aiocb;
     struct iocb *iocbs[MAX_EVENTS];
     QSIMPLEQ_HEAD(, qemu_laiocb) completed;
@@ -323,6 +340,10 @@ static void ioq_submit(LinuxAioState *s)
 
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
+        for (i = 0; i < ret; i++) {
+            aiocb = container_of(iocbs[i], struct qemu_laiocb, iocb);
+            io_trace_mark(aiocb->trace, IO_TRACE_QUEUE);
+        }
         aiocb = container_of(iocbs[ret - 1], struct qemu_laiocb, iocb);
         QSIMPLEQ_SPLIT_AFTER(&s->io_q.pending, aiocb, next, &completed);
     } while (ret == len && !QSIMPLEQ_EMPTY(&s->io_q.pending));
@@ -400,8 +421,10 @@ int coroutine_fn laio_co_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
         .ret        = -EINPROGRESS,
         .is_read    = (type == QEMU_AIO_READ),
         .qiov       = qiov,
+        .trace      = io_trace_current(),
     };
 
+    io_trace_mark(laiocb.trace, IO_TRACE_BLOCK);
     ret = laio_do_submit(fd, &laiocb, offset, type);
     if (ret < 0) {
         return ret;
@@ -427,6 +450,7 @@ BlockAIOCB *laio_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
     laiocb->ret = -EINPROGRESS;
     laiocb->is_read = (type == QEMU_AIO_READ);
     laiocb->qiov = qiov;
+    laiocb->trace = NULL;
 
     ret = laio_do_submit(fd, laiocb, offset, type);
     if (ret < 0) {
@@ -439,7 +463,7 @@ BlockAIOCB *laio_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
 
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context)
 {
-    aio_set_event_notifier(old_context, &s->e, false, NULL);
+    aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
     qemu_bh_delete(s->completion_bh);
 }
 
@@ -448,7 +472,8 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context)
     s->aio_context = new_context;
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, false,
-                           qemu_laio_completion_cb);
+                           qemu_laio_completion_cb,
+                           qemu_laio_poll_cb);
 }
 
 LinuxAioState *laio_init(void)
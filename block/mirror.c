@@ -22,10 +22,11 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define DEFAULT_IN_FLIGHT 16
+#define MIRROR_MAX_IN_FLIGHT 64
 #define MAX_IO_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE \
-    (MAX_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
+    (DEFAULT_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -34,6 +35,8 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+typedef struct MirrorActiveOp MirrorActiveOp;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -69,6 +72,25 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Number of requests in flight and request size, adapted to the write
+     * latency of the target unless set with block-job-set-pipeline (a
+     * user value of 0 means adaptive), see mirror_adapt_pipeline() */
+    int max_in_flight;
+    int chunk_sectors;
+    int user_max_in_flight;
+    int user_chunk_sectors;
+    int64_t write_lat_avg_ns;
+    int64_t write_lat_base_ns;
+    int write_lat_samples;
+    uint64_t last_adapt_ns;
+
+    /* Write-blocking mode: guest writes are copied to the target from
+     * before_write, see mirror_before_write_notify() */
+    MirrorCopyMode copy_mode;
+    NotifierWithReturn before_write;
+    int active_in_flight;
+    QLIST_HEAD(, MirrorActiveOp) active_waiters;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -76,8 +98,25 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    /* When the write to the target was submitted, 0 for zero/discard */
+    int64_t start_ns;
 } MirrorOp;
 
+/* A guest write that is being copied to the target synchronously */
+struct MirrorActiveOp {
+    MirrorBlockJob *s;
+    BdrvTrackedRequest *req;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+
+    /* Set while waiting for overlapping operations to complete */
+    Coroutine *co;
+    QLIST_ENTRY(MirrorActiveOp) next;
+};
+
+static void mirror_wake_active_waiters(MirrorBlockJob *s);
+
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -123,15 +162,34 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     qemu_iovec_destroy(&op->qiov);
     g_free(op);
 
+    mirror_wake_active_waiters(s);
     if (s->waiting_for_io) {
         qemu_coroutine_enter(s->common.co);
     }
 }
 
+/* Account the latency of a copy, scaled to a MAX_IO_SECTORS request so that
+ * samples remain comparable as the request size changes */
+static void mirror_account_write(MirrorBlockJob *s, MirrorOp *op)
+{
+    int64_t lat_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns;
+
+    lat_ns = lat_ns * MAX_IO_SECTORS / op->nb_sectors;
+    if (s->write_lat_avg_ns == 0) {
+        s->write_lat_avg_ns = lat_ns;
+    } else {
+        s->write_lat_avg_ns = (s->write_lat_avg_ns * 7 + lat_ns) / 8;
+    }
+    s->write_lat_samples++;
+}
+
 static void mirror_write_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
+    if (ret >= 0 && op->start_ns) {
+        mirror_account_write(s, op);
+    }
     if (ret < 0) {
         BlockErrorAction action;
 
@@ -160,6 +218,7 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     blk_aio_pwritev(s->target, op->sector_num * BDRV_SECTOR_SIZE, &op->qiov,
                     0, mirror_write_complete, op);
 }
@@ -254,6 +313,9 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
      * 2) mirror_cow_align is used only when target cluster is larger. */
     assert(!(sector_num % sectors_per_chunk));
     nb_chunks = DIV_ROUND_UP(nb_sectors, sectors_per_chunk);
+    /* COW alignment may have extended the range beyond the chunks that
+     * the caller marked */
+    bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk, nb_chunks);
 
     while (s->buf_free_count < nb_chunks) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
@@ -265,6 +327,7 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    op->start_ns = 0;
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -327,8 +390,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
     int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
-                             MAX_IO_SECTORS);
+    int max_io_sectors = s->chunk_sectors;
 
     sector_num = hbitmap_iter_next(&s->hbi);
     if (sector_num < 0) {
@@ -338,14 +400,16 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(sector_num >= 0);
     }
 
+    block_job_pause_point(&s->common);
+
+    /* Nothing may yield between here and marking the chunks in flight,
+     * or a write-blocking guest write could start copying them meanwhile */
     first_chunk = sector_num / sectors_per_chunk;
     while (test_bit(first_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
         mirror_wait_for_io(s);
     }
 
-    block_job_pause_point(&s->common);
-
     /* Find the number of consective dirty chunks following the first dirty
      * one, and wait for in flight requests in them. */
     while (nb_chunks * sectors_per_chunk < (s->buf_size >> BDRV_SECTOR_BITS)) {
@@ -414,7 +478,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
             mirror_wait_for_io(s);
         }
@@ -445,13 +509,172 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(io_sectors);
         sector_num += io_sectors;
         nb_chunks -= DIV_ROUND_UP(io_sectors, sectors_per_chunk);
+        delay_ns = block_job_sched_delay(&s->common,
+                                         io_sectors_acct * BDRV_SECTOR_SIZE);
         if (s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, io_sectors_acct);
+            int64_t limit_ns = ratelimit_calculate_delay(&s->limit,
+                                                         io_sectors_acct);
+            delay_ns = MAX(delay_ns, limit_ns);
         }
     }
     return delay_ns;
 }
 
+/* Return true if an operation is in flight for any of the chunks touched
+ * by @op */
+static bool mirror_active_op_conflicts(MirrorActiveOp *op)
+{
+    MirrorBlockJob *s = op->s;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t start_chunk = op->sector_num / sectors_per_chunk;
+    int64_t end_chunk = DIV_ROUND_UP(op->sector_num + op->nb_sectors,
+                                     sectors_per_chunk);
+
+    return find_next_bit(s->in_flight_bitmap, end_chunk, start_chunk) <
+           end_chunk;
+}
+
+/* Restart the guest writes that no longer overlap an operation in flight */
+static void mirror_wake_active_waiters(MirrorBlockJob *s)
+{
+    MirrorActiveOp *op;
+    bool found;
+
+    /* Entering a waiter changes the in-flight bitmap and possibly the list
+     * of waiters, so look again from the start every time */
+    do {
+        found = false;
+        QLIST_FOREACH(op, &s->active_waiters, next) {
+            if (!mirror_active_op_conflicts(op)) {
+                found = true;
+                break;
+            }
+        }
+        if (found) {
+            Coroutine *co = op->co;
+
+            QLIST_REMOVE(op, next);
+            op->co = NULL;
+            qemu_coroutine_enter(co);
+        }
+    } while (found);
+}
+
+/* Runs once the guest request of @op has completed, and the source has
+ * thus been written and marked dirty */
+static void coroutine_fn mirror_active_write_done(void *opaque)
+{
+    MirrorActiveOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
+    int64_t start_sector, end_sector;
+
+    qemu_co_queue_wait(&op->req->wait_queue);
+
+    if (op->ret >= 0) {
+        /* The target already has the data, so chunks that were overwritten
+         * completely need not be copied again */
+        start_sector = QEMU_ALIGN_UP(op->sector_num, sectors_per_chunk);
+        end_sector = op->sector_num + op->nb_sectors;
+        if (end_sector != end) {
+            end_sector = QEMU_ALIGN_DOWN(end_sector, sectors_per_chunk);
+        }
+        if (end_sector > start_sector) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap, start_sector,
+                                    end_sector - start_sector);
+        }
+        s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    bitmap_clear(s->in_flight_bitmap, op->sector_num / sectors_per_chunk,
+                 DIV_ROUND_UP(op->sector_num + op->nb_sectors,
+                              sectors_per_chunk) -
+                 op->sector_num / sectors_per_chunk);
+    s->active_in_flight--;
+    g_free(op);
+
+    mirror_wake_active_waiters(s);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
+/* In write-blocking mode, copy the data of a guest write to the target
+ * before the write reaches the source.  The chunks concerned are marked in
+ * flight until the guest request completes, so that neither background
+ * copies nor other guest writes can reorder writes to the target.  */
+static int coroutine_fn mirror_before_write_notify(NotifierWithReturn *notifier,
+                                                    void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
+    MirrorActiveOp *op;
+    int ret;
+
+    if (req->type != BDRV_TRACKED_WRITE || s->ret < 0 ||
+        block_job_is_cancelled(&s->common)) {
+        /* The dirty bitmap takes care of it */
+        return 0;
+    }
+
+    assert(QEMU_IS_ALIGNED(req->write_offset | req->write_bytes,
+                           BDRV_SECTOR_SIZE));
+    if (req->write_offset >> BDRV_SECTOR_BITS >= end) {
+        return 0;
+    }
+
+    op = g_new0(MirrorActiveOp, 1);
+    op->s = s;
+    op->req = req;
+    op->sector_num = req->write_offset >> BDRV_SECTOR_BITS;
+    op->nb_sectors = MIN(req->write_bytes >> BDRV_SECTOR_BITS,
+                         end - op->sector_num);
+    s->active_in_flight++;
+
+    while (mirror_active_op_conflicts(op)) {
+        op->co = qemu_coroutine_self();
+        QLIST_INSERT_HEAD(&s->active_waiters, op, next);
+        qemu_coroutine_yield();
+        assert(op->co == NULL);
+    }
+    bitmap_set(s->in_flight_bitmap, op->sector_num / sectors_per_chunk,
+               DIV_ROUND_UP(op->sector_num + op->nb_sectors,
+                            sectors_per_chunk) -
+               op->sector_num / sectors_per_chunk);
+
+    trace_mirror_active_write(s, op->sector_num, op->nb_sectors);
+    if (req->write_flags & BDRV_REQ_ZERO_WRITE) {
+        ret = blk_co_pwrite_zeroes(s->target,
+                                   op->sector_num * BDRV_SECTOR_SIZE,
+                                   op->nb_sectors * BDRV_SECTOR_SIZE,
+                                   req->write_flags & BDRV_REQ_MAY_UNMAP);
+    } else {
+        QEMUIOVector qiov;
+
+        qemu_iovec_init_slice(&qiov, req->write_qiov, 0,
+                              op->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = blk_co_pwritev(s->target, op->sector_num * BDRV_SECTOR_SIZE,
+                             op->nb_sectors * BDRV_SECTOR_SIZE, &qiov, 0);
+        qemu_iovec_destroy(&qiov);
+    }
+
+    op->ret = ret;
+    if (ret < 0) {
+        /* The source write will mark the range dirty, so the background
+         * copy retries it; the guest write itself is not failed */
+        if (mirror_error_action(s, false, -ret) == BLOCK_ERROR_ACTION_REPORT &&
+            s->ret >= 0) {
+            s->ret = ret;
+        }
+    }
+
+    qemu_coroutine_enter(qemu_coroutine_create(mirror_active_write_done, op));
+    return 0;
+}
+
 static void mirror_free_init(MirrorBlockJob *s)
 {
     int granularity = s->granularity;
@@ -534,6 +757,78 @@ static void mirror_exit(BlockJob *job, void *opaque)
     bdrv_unref(src);
 }
 
+static int mirror_max_chunk_sectors(MirrorBlockJob *s)
+{
+    return MAX((s->buf_size >> BDRV_SECTOR_BITS) / DEFAULT_IN_FLIGHT,
+               MAX_IO_SECTORS);
+}
+
+static void mirror_pipeline_init(MirrorBlockJob *s)
+{
+    s->max_in_flight = s->user_max_in_flight ?: DEFAULT_IN_FLIGHT;
+    s->chunk_sectors = s->user_chunk_sectors ?: mirror_max_chunk_sectors(s);
+    s->last_adapt_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+/*
+ * Once per SLICE_TIME, adjust the number of requests in flight and their
+ * size to the write latency of the target (additive increase,
+ * multiplicative decrease).  The lowest average latency seen recently is
+ * taken as the latency of an idle target; when the average exceeds twice
+ * that, the target is congested and the pipeline is halved, first in
+ * depth and then in request size.  Otherwise the request size is restored
+ * first and the depth then grows by one request per slice.  The amount of
+ * data in flight is always bounded by buf_size.
+ */
+static void mirror_adapt_pipeline(MirrorBlockJob *s)
+{
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int buf_sectors = s->buf_size >> BDRV_SECTOR_BITS;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int max_chunk, max_depth;
+    bool adapt_depth, adapt_chunk;
+
+    if (now - s->last_adapt_ns < SLICE_TIME || s->write_lat_samples == 0) {
+        return;
+    }
+    s->last_adapt_ns = now;
+    s->write_lat_samples = 0;
+
+    /* Let the baseline drift upwards so that a single fast sample from
+     * long ago does not make the target look congested forever */
+    if (s->write_lat_base_ns == 0 ||
+        s->write_lat_avg_ns < s->write_lat_base_ns) {
+        s->write_lat_base_ns = s->write_lat_avg_ns;
+    } else {
+        s->write_lat_base_ns += s->write_lat_base_ns / 16;
+    }
+
+    adapt_depth = !s->user_max_in_flight;
+    adapt_chunk = !s->user_chunk_sectors;
+    max_chunk = mirror_max_chunk_sectors(s);
+
+    if (s->write_lat_avg_ns > 2 * s->write_lat_base_ns) {
+        if (adapt_depth && s->max_in_flight > 1) {
+            s->max_in_flight /= 2;
+        } else if (adapt_chunk && s->chunk_sectors > sectors_per_chunk) {
+            s->chunk_sectors = MAX(QEMU_ALIGN_DOWN(s->chunk_sectors / 2,
+                                                   sectors_per_chunk),
+                                   sectors_per_chunk);
+        }
+    } else if (adapt_chunk && s->chunk_sectors < max_chunk) {
+        s->chunk_sectors = MIN(s->chunk_sectors * 2, max_chunk);
+    } else if (adapt_depth) {
+        max_depth = MIN(MIRROR_MAX_IN_FLIGHT,
+                        MAX(buf_sectors / s->chunk_sectors, 1));
+        if (s->max_in_flight < max_depth) {
+            s->max_in_flight++;
+        }
+    }
+
+    trace_mirror_adapt_pipeline(s, s->max_in_flight, s->chunk_sectors,
+                                s->write_lat_avg_ns, s->write_lat_base_ns);
+}
+
 static void mirror_throttle(MirrorBlockJob *s)
 {
     int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
@@ -572,7 +867,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, -1);
                 mirror_wait_for_io(s);
                 continue;
@@ -670,6 +965,7 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
     mirror_free_init(s);
+    mirror_pipeline_init(s);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
@@ -679,6 +975,13 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    /* Only start now, because the target may have been zeroed by
+     * mirror_dirty_init() */
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        s->before_write.notify = mirror_before_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+    }
+
     bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
     for (;;) {
         uint64_t delay_ns = 0;
@@ -690,6 +993,8 @@ static void coroutine_fn mirror_run(void *opaque)
             goto immediate_exit;
         }
 
+        mirror_adapt_pipeline(s);
+
         block_job_pause_point(&s->common);
 
         cnt = bdrv_get_dirty_count(s->dirty_bitmap);
@@ -708,7 +1013,7 @@ static void coroutine_fn mirror_run(void *opaque)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 mirror_wait_for_io(s);
@@ -780,6 +1085,13 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->before_write.notify) {
+        notifier_with_return_remove(&s->before_write);
+    }
+    while (s->active_in_flight > 0) {
+        mirror_wait_for_io(s);
+    }
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -814,6 +1126,54 @@ static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
     ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
 }
 
+static void mirror_set_pipeline(BlockJob *job,
+                                bool has_max_in_flight, int64_t max_in_flight,
+                                bool has_chunk_size, int64_t chunk_size,
+                                Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (has_max_in_flight &&
+        (max_in_flight < 0 || max_in_flight > MIRROR_MAX_IN_FLIGHT)) {
+        error_setg(errp, "Parameter 'max-in-flight' must be between 0 and %d",
+                   MIRROR_MAX_IN_FLIGHT);
+        return;
+    }
+    if (has_chunk_size && chunk_size != 0 &&
+        (chunk_size < 0 || chunk_size > s->buf_size ||
+         !QEMU_IS_ALIGNED(chunk_size, s->granularity))) {
+        error_setg(errp, "Parameter 'chunk-size' must be a multiple of the "
+                   "granularity (%" PRId64 ") and not exceed the buffer size "
+                   "(%zu)", s->granularity, s->buf_size);
+        return;
+    }
+
+    if (has_max_in_flight) {
+        s->user_max_in_flight = max_in_flight;
+        if (max_in_flight) {
+            s->max_in_flight = max_in_flight;
+        }
+    }
+    if (has_chunk_size) {
+        s->user_chunk_sectors = chunk_size >> BDRV_SECTOR_BITS;
+        if (chunk_size) {
+            s->chunk_sectors = s->user_chunk_sectors;
+        }
+        /* Latencies measured with the old request size are not comparable */
+        s->write_lat_base_ns = 0;
+    }
+}
+
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_max_in_flight = true;
+    info->max_in_flight = s->max_in_flight;
+    info->has_chunk_size = true;
+    info->chunk_size = (int64_t)s->chunk_sectors * BDRV_SECTOR_SIZE;
+}
+
 static void mirror_complete(BlockJob *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
@@ -891,6 +1251,8 @@ static const BlockJobDriver mirror_job_driver = {
     .instance_size          = sizeof(MirrorBlockJob),
     .job_type               = BLOCK_JOB_TYPE_MIRROR,
     .set_speed              = mirror_set_speed,
+    .set_pipeline           = mirror_set_pipeline,
+    .query                  = mirror_query,
     .complete               = mirror_complete,
     .pause                  = mirror_pause,
     .attached_aio_context   = mirror_attached_aio_context,
@@ -900,6 +1262,8 @@ static const BlockJobDriver commit_active_job_driver = {
     .instance_size          = sizeof(MirrorBlockJob),
     .job_type               = BLOCK_JOB_TYPE_COMMIT,
     .set_speed              = mirror_set_speed,
+    .set_pipeline           = mirror_set_pipeline,
+    .query                  = mirror_query,
     .complete               = mirror_complete,
     .pause                  = mirror_pause,
     .attached_aio_context   = mirror_attached_aio_context,
@@ -912,7 +1276,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              BlockMirrorBackingMode backing_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
@@ -943,6 +1307,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
 
     s->target = blk_new();
     blk_insert_bs(s->target, target);
+    block_job_add_backend(&s->common, s->target);
 
     s->replaces = g_strdup(replaces);
     s->on_source_error = on_source_error;
@@ -953,6 +1318,8 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
+    QLIST_INIT(&s->active_waiters);
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -978,7 +1345,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -993,7 +1360,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(job_id, bs, target, replaces,
                      speed, granularity, buf_size, backing_mode,
-                     on_source_error, on_target_error, unmap, cb, opaque, errp,
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     cb, opaque, errp,
                      &mirror_job_driver, is_none_mode, base, false);
 }
 
@@ -1042,7 +1410,8 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
 
     mirror_start_job(job_id, bs, base, NULL, speed, 0, 0,
                      MIRROR_LEAVE_BACKING_CHAIN,
-                     on_error, on_error, false, cb, opaque, &local_err,
+                     on_error, on_error, false, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err,
                      &commit_active_job_driver, false, base, auto_complete);
     if (local_err) {
         error_propagate(errp, local_err);
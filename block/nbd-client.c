@@ -144,7 +144,7 @@ static int nbd_co_send_request(BlockDriverState *bs,
     aio_context = bdrv_get_aio_context(bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, NULL, bs);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -160,37 +160,210 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, NULL, bs);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
+static int nbd_co_read_payload(NbdClientSession *s, void *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    if (nbd_wr_syncv(s->ioc, &iov, 1, len, true) != len) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int nbd_co_drop_payload(NbdClientSession *s, size_t len)
+{
+    uint8_t buf[4096];
+    int ret = 0;
+
+    while (len > 0 && ret == 0) {
+        size_t chunk = MIN(len, sizeof(buf));
+
+        ret = nbd_co_read_payload(s, buf, chunk);
+        len -= chunk;
+    }
+    return ret;
+}
+
+/* Check that [@offset, @offset + @len) lies within the range of @request */
+static bool nbd_chunk_in_request(struct nbd_request *request,
+                                 uint64_t offset, uint32_t len)
+{
+    return offset >= request->from && len <= request->len &&
+           offset - request->from <= request->len - len;
+}
+
+/* Process the payload of the structured reply chunk in s->reply.  An error
+ * reported by the server is stored in @error; a negative return value means
+ * that the chunk is malformed and the connection cannot be used any more.
+ */
+static int nbd_co_receive_chunk(NbdClientSession *s,
+                                struct nbd_request *request,
+                                QEMUIOVector *qiov, NBDExtent *extent,
+                                int *error)
+{
+    struct nbd_reply *chunk = &s->reply;
+    uint32_t command = request->type & NBD_CMD_MASK_COMMAND;
+    uint8_t buf[8 + 4 + 2];
+    uint64_t offset;
+    uint32_t len;
+    int ret;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (chunk->length != 0 || !(chunk->flags & NBD_REPLY_FLAG_DONE)) {
+            return -EINVAL;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA: {
+        QEMUIOVector sub_qiov;
+        ssize_t rc;
+
+        if (command != NBD_CMD_READ || chunk->length < 8) {
+            return -EINVAL;
+        }
+        ret = nbd_co_read_payload(s, buf, 8);
+        if (ret < 0) {
+            return ret;
+        }
+        offset = ldq_be_p(buf);
+        len = chunk->length - 8;
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            return -EINVAL;
+        }
+
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset - request->from, len);
+        rc = nbd_wr_syncv(s->ioc, sub_qiov.iov, sub_qiov.niov, len, true);
+        qemu_iovec_destroy(&sub_qiov);
+        return rc == len ? 0 : -EIO;
+    }
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (command != NBD_CMD_READ || chunk->length != 8 + 4) {
+            return -EINVAL;
+        }
+        ret = nbd_co_read_payload(s, buf, 8 + 4);
+        if (ret < 0) {
+            return ret;
+        }
+        offset = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            return -EINVAL;
+        }
+        qemu_iovec_memset(qiov, offset - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (command != NBD_CMD_BLOCK_STATUS ||
+            chunk->length < 4 + sizeof(NBDExtent) ||
+            (chunk->length - 4) % sizeof(NBDExtent)) {
+            return -EINVAL;
+        }
+        ret = nbd_co_read_payload(s, buf, 4 + sizeof(NBDExtent));
+        if (ret < 0) {
+            return ret;
+        }
+        if (ldl_be_p(buf) != s->info.meta_base_allocation_id) {
+            return -EINVAL;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        if (extent->length == 0 ||
+            !nbd_chunk_in_request(request, request->from,
+                                  MIN(extent->length, request->len))) {
+            return -EINVAL;
+        }
+        /* We asked for a single extent; ignore any further ones */
+        return nbd_co_drop_payload(s, chunk->length - 4 - sizeof(NBDExtent));
+
+    default:
+        if (!nbd_reply_type_is_error(chunk->type)) {
+            return -EINVAL;
+        }
+        /* [ 0 ..  3]  error
+         * [ 4 ..  5]  message length
+         * ...         message (and an offset for NBD_REPLY_TYPE_ERROR_OFFSET)
+         */
+        if (chunk->length < 4 + 2) {
+            return -EINVAL;
+        }
+        ret = nbd_co_read_payload(s, buf, 4 + 2);
+        if (ret < 0) {
+            return ret;
+        }
+        if (lduw_be_p(buf + 4) > chunk->length - 4 - 2) {
+            return -EINVAL;
+        }
+        *error = nbd_errno_to_system_errno(ldl_be_p(buf));
+        if (*error == 0) {
+            /* A successful error chunk makes no sense */
+            *error = EINVAL;
+        }
+        logout("Server reported error %d for request %" PRIu64 "\n",
+               *error, request->handle);
+        return nbd_co_drop_payload(s, chunk->length - 4 - 2);
+    }
+}
+
 static void nbd_co_receive_reply(NbdClientSession *s,
                                  struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov,
+                                 NBDExtent *extent)
 {
     int ret;
+    int error = 0;
+
+    while (1) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
-                reply->error = EIO;
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+
+            /* Tell the read handler to read another header.  */
+            s->reply.handle = 0;
+            return;
+        }
+
+        /* A structured reply comes in chunks, with the error (if any)
+         * reported in one of them */
+        if (!s->info.structured_reply ||
+            nbd_co_receive_chunk(s, request, qiov, extent, &error) < 0) {
+            /* The stream is out of sync */
+            reply->error = EIO;
+            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            return;
         }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
+
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            reply->error = error;
+            return;
+        }
     }
 }
 
@@ -238,12 +411,69 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
+        nbd_co_receive_reply(client, &request, &reply, qiov, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
 }
 
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+        .from = sector_num << BDRV_SECTOR_BITS,
+        .len = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS) <<
+               BDRV_SECTOR_BITS,
+    };
+    struct nbd_reply reply;
+    NBDExtent extent = { 0 };
+    int64_t ret;
+
+    *file = bs;
+    ret = BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
+
+    if (!client->info.base_allocation) {
+        *pnum = nb_sectors;
+        return ret | BDRV_BLOCK_DATA;
+    }
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(bs, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(client, &request, &reply, NULL, &extent);
+        if (!reply.error && extent.length == 0) {
+            reply.error = EIO;
+        }
+    }
+    nbd_coroutine_end(client, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    ret = BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        /* Nothing can be said about a partial sector */
+        *pnum = 1;
+        return ret | BDRV_BLOCK_DATA;
+    }
+
+    *pnum = MIN(extent.length >> BDRV_SECTOR_BITS, nb_sectors);
+    if (!(extent.flags & NBD_STATE_ZERO)) {
+        /* An unallocated range whose contents are unknown is still data */
+        return ret | BDRV_BLOCK_DATA;
+    }
+    if (!(extent.flags & NBD_STATE_HOLE)) {
+        ret |= BDRV_BLOCK_DATA;
+    }
+    return ret | BDRV_BLOCK_ZERO;
+}
+
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
@@ -257,7 +487,7 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     ssize_t ret;
 
     if (flags & BDRV_REQ_FUA) {
-        assert(client->nbdflags & NBD_FLAG_SEND_FUA);
+        assert(client->info.flags & NBD_FLAG_SEND_FUA);
         request.type |= NBD_CMD_FLAG_FUA;
     }
 
@@ -268,7 +498,43 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
+    }
+    nbd_coroutine_end(client, &request);
+    return -reply.error;
+}
+
+int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                                int count, BdrvRequestFlags flags)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_WRITE_ZEROES,
+        .from = offset,
+        .len = count,
+    };
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    if (!(client->info.flags & NBD_FLAG_SEND_WRITE_ZEROES)) {
+        /* Let the block layer write a buffer of zeroes instead */
+        return -ENOTSUP;
+    }
+
+    if (flags & BDRV_REQ_FUA) {
+        assert(client->info.flags & NBD_FLAG_SEND_FUA);
+        request.type |= NBD_CMD_FLAG_FUA;
+    }
+    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+        request.type |= NBD_CMD_FLAG_NO_HOLE;
+    }
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(bs, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -281,7 +547,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     struct nbd_reply reply;
     ssize_t ret;
 
-    if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
+    if (!(client->info.flags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
@@ -293,7 +559,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -310,7 +576,7 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
     struct nbd_reply reply;
     ssize_t ret;
 
-    if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
+    if (!(client->info.flags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
 
@@ -319,7 +585,7 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -330,14 +596,14 @@ void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     aio_set_fd_handler(bdrv_get_aio_context(bs),
                        nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+                       false, NULL, NULL, NULL, NULL);
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
     aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+                       false, nbd_reply_ready, NULL, NULL, bs);
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -372,17 +638,22 @@ int nbd_client_init(BlockDriverState *bs,
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
+    client->info.structured_reply = true;
+    client->info.base_allocation = true;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
                                 tlscreds, hostname,
                                 &client->ioc,
-                                &client->size, errp);
+                                &client->info, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
-    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
+    if (client->info.flags & NBD_FLAG_SEND_FUA) {
         bs->supported_write_flags = BDRV_REQ_FUA;
+        bs->supported_zero_flags |= BDRV_REQ_FUA;
+    }
+    if (client->info.flags & NBD_FLAG_SEND_WRITE_ZEROES) {
+        bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
     }
 
     qemu_co_mutex_init(&client->send_mutex);
@@ -0,0 +1,1135 @@
+/*
+ * NVMe block driver based on vfio
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <linux/vfio.h>
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qint.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "qemu/vfio-helpers.h"
+#include "block/block_int.h"
+#include "block/nvme.h"
+#include "trace.h"
+
+/*
+ * The driver owns the controller: it is bound to vfio-pci on the host and
+ * driven from the AioContext of the BlockDriverState, with one admin and
+ * one I/O queue pair.  Completions are signalled through MSI-X vector 0
+ * on an EventNotifier, which also has a poll handler so that aio_poll()
+ * can busy wait on the completion queues instead of sleeping.
+ *
+ * Guest buffers are mapped into the IOMMU with temporary mappings for the
+ * duration of a request; buffers that do not satisfy the PRP alignment
+ * rules are bounced.
+ */
+
+#define NVME_BLOCK_OPT_DEVICE "device"
+#define NVME_BLOCK_OPT_NAMESPACE "namespace"
+
+#define NVME_SQ_ENTRY_BYTES 64
+#define NVME_CQ_ENTRY_BYTES 16
+#define NVME_QUEUE_SIZE 128
+#define NVME_NUM_REQS (NVME_QUEUE_SIZE - 1)
+
+/* The controller registers, followed by the doorbells at offset 0x1000 */
+#define NVME_DOORBELL_OFFSET 0x1000
+#define NVME_BAR_SIZE   (NVME_DOORBELL_OFFSET + 0x1000)
+
+/* Memory page size used by the controller (CC.MPS = 0) */
+#define NVME_PAGE_SIZE  4096
+
+typedef struct {
+    int32_t head, tail;
+    uint8_t *queue;
+    uint64_t iova;
+    volatile uint32_t *doorbell;
+} NVMeQueue;
+
+typedef struct {
+    BlockCompletionFunc *cb;
+    void *opaque;
+    int cid;
+    int free_req_next;          /* index in NVMeQueuePair.reqs, or -1 */
+    void *prp_list_page;
+    uint64_t prp_list_iova;
+} NVMeRequest;
+
+typedef struct {
+    int index;
+    int size;
+    uint8_t *prp_list_pages;
+    NVMeQueue sq, cq;
+    int cq_phase;
+    NVMeRequest reqs[NVME_NUM_REQS];
+    int free_req_head;
+    CoQueue free_req_queue;
+    int need_kick;
+    int inflight;
+    bool busy;
+} NVMeQueuePair;
+
+/* Queue 0 is the admin queue, queue 1 the I/O queue */
+#define INDEX_ADMIN 0
+#define INDEX_IO    1
+
+typedef struct {
+    QEMUVFIOState *vfio;
+    void *bar;
+    volatile NvmeBar *regs;
+    volatile uint32_t *doorbells;
+    uint32_t doorbell_scale;
+    uint32_t page_size;
+    int io_queue_size;
+
+    NVMeQueuePair *queues[INDEX_IO + 1];
+    int nr_queues;
+
+    EventNotifier irq_notifier;
+    bool plugged;
+
+    /* Requests that hold temporary DMA mappings */
+    int dma_map_count;
+    CoQueue dma_flush_queue;
+
+    uint32_t nsid;
+    uint64_t nsze;              /* namespace size, in blocks */
+    int blkshift;
+    uint64_t max_transfer;
+    bool write_cache_supported;
+    bool supports_write_zeroes;
+    bool supports_discard;
+} BDRVNVMeState;
+
+static QemuOptsList runtime_opts = {
+    .name = "nvme",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = NVME_BLOCK_OPT_DEVICE,
+            .type = QEMU_OPT_STRING,
+            .help = "NVMe PCI device address",
+        },
+        {
+            .name = NVME_BLOCK_OPT_NAMESPACE,
+            .type = QEMU_OPT_NUMBER,
+            .help = "NVMe namespace",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void nvme_init_queue(BDRVNVMeState *s, NVMeQueue *q, int nentries,
+                            int entry_bytes, Error **errp)
+{
+    size_t bytes = ROUND_UP(nentries * entry_bytes, getpagesize());
+
+    q->head = q->tail = 0;
+    q->queue = qemu_try_memalign(getpagesize(), bytes);
+    if (!q->queue) {
+        error_setg(errp, "Cannot allocate queue");
+        return;
+    }
+    memset(q->queue, 0, bytes);
+    if (qemu_vfio_dma_map(s->vfio, q->queue, bytes, false, &q->iova)) {
+        error_setg(errp, "Cannot map queue");
+        qemu_vfree(q->queue);
+        q->queue = NULL;
+    }
+}
+
+static void nvme_free_queue(BDRVNVMeState *s, NVMeQueue *q)
+{
+    if (q->queue) {
+        qemu_vfio_dma_unmap(s->vfio, q->queue);
+        qemu_vfree(q->queue);
+    }
+}
+
+static void nvme_free_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    if (q->prp_list_pages) {
+        qemu_vfio_dma_unmap(s->vfio, q->prp_list_pages);
+        qemu_vfree(q->prp_list_pages);
+    }
+    nvme_free_queue(s, &q->sq);
+    nvme_free_queue(s, &q->cq);
+    g_free(q);
+}
+
+static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s, int idx,
+                                             int size, Error **errp)
+{
+    NVMeQueuePair *q = g_new0(NVMeQueuePair, 1);
+    size_t prp_bytes = ROUND_UP(s->page_size * NVME_NUM_REQS, getpagesize());
+    uint64_t prp_list_iova;
+    Error *local_err = NULL;
+    int i;
+
+    q->index = idx;
+    q->size = size;
+    qemu_co_queue_init(&q->free_req_queue);
+
+    q->prp_list_pages = qemu_try_memalign(getpagesize(), prp_bytes);
+    if (!q->prp_list_pages) {
+        error_setg(errp, "Cannot allocate PRP lists");
+        goto fail;
+    }
+    memset(q->prp_list_pages, 0, prp_bytes);
+    if (qemu_vfio_dma_map(s->vfio, q->prp_list_pages, prp_bytes, false,
+                          &prp_list_iova)) {
+        error_setg(errp, "Cannot map PRP lists");
+        qemu_vfree(q->prp_list_pages);
+        q->prp_list_pages = NULL;
+        goto fail;
+    }
+
+    /* At most size - 1 commands can be outstanding on a queue */
+    q->free_req_head = -1;
+    for (i = MIN(NVME_NUM_REQS, size - 1) - 1; i >= 0; i--) {
+        NVMeRequest *req = &q->reqs[i];
+
+        req->cid = i + 1;
+        req->free_req_next = q->free_req_head;
+        q->free_req_head = i;
+        req->prp_list_page = q->prp_list_pages + i * s->page_size;
+        req->prp_list_iova = prp_list_iova + i * s->page_size;
+    }
+
+    nvme_init_queue(s, &q->sq, size, NVME_SQ_ENTRY_BYTES, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+    q->sq.doorbell = &s->doorbells[idx * 2 * s->doorbell_scale];
+
+    nvme_init_queue(s, &q->cq, size, NVME_CQ_ENTRY_BYTES, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+    q->cq.doorbell = &s->doorbells[(idx * 2 + 1) * s->doorbell_scale];
+
+    return q;
+
+fail:
+    nvme_free_queue_pair(s, q);
+    return NULL;
+}
+
+static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    if (s->plugged || !q->need_kick) {
+        return;
+    }
+    trace_nvme_kick(s, q->index);
+    /* The submission queue entries must be visible before the doorbell */
+    smp_wmb();
+    *q->sq.doorbell = cpu_to_le32(q->sq.tail);
+    q->need_kick = 0;
+}
+
+/* Return a free request, or NULL if there is none and the caller cannot
+ * wait for one.
+ */
+static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
+{
+    NVMeRequest *req;
+
+    while (q->free_req_head == -1) {
+        if (!qemu_in_coroutine()) {
+            return NULL;
+        }
+        qemu_co_queue_wait(&q->free_req_queue);
+    }
+    req = &q->reqs[q->free_req_head];
+    q->free_req_head = req->free_req_next;
+    req->free_req_next = -1;
+    return req;
+}
+
+static void nvme_put_free_req(NVMeQueuePair *q, NVMeRequest *req)
+{
+    req->free_req_next = q->free_req_head;
+    q->free_req_head = req - q->reqs;
+}
+
+static int nvme_translate_error(const NvmeCqe *c)
+{
+    uint16_t status = (le16_to_cpu(c->status) >> 1) & 0x7ff;
+
+    if (status) {
+        trace_nvme_error(le32_to_cpu(c->result), le16_to_cpu(c->sq_head),
+                         le16_to_cpu(c->sq_id), le16_to_cpu(c->cid), status);
+    }
+    switch (status) {
+    case NVME_SUCCESS:
+        return 0;
+    case NVME_INVALID_OPCODE:
+        return -ENOTSUP;
+    case NVME_INVALID_FIELD:
+    case NVME_LBA_RANGE:
+        return -EINVAL;
+    case NVME_CAP_EXCEEDED:
+        return -ENOSPC;
+    case NVME_WRITE_TO_RO:
+        return -EROFS;
+    default:
+        return -EIO;
+    }
+}
+
+static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    bool progress = false;
+    NVMeRequest *preq;
+    NVMeRequest req;
+    NvmeCqe *c;
+
+    trace_nvme_process_completion(s, q->index, q->inflight);
+    if (q->busy || s->plugged) {
+        return false;
+    }
+
+    q->busy = true;
+    while (q->inflight) {
+        uint16_t cid;
+
+        c = (NvmeCqe *)&q->cq.queue[q->cq.head * NVME_CQ_ENTRY_BYTES];
+        if ((le16_to_cpu(c->status) & 0x1) == q->cq_phase) {
+            break;
+        }
+        /* Read the rest of the entry only after its phase bit */
+        smp_rmb();
+        q->cq.head = (q->cq.head + 1) % q->size;
+        if (!q->cq.head) {
+            q->cq_phase = !q->cq_phase;
+        }
+        cid = le16_to_cpu(c->cid);
+        if (cid == 0 || cid > NVME_NUM_REQS || !q->reqs[cid - 1].cb) {
+            error_report("NVMe: unexpected CID %u in completion queue", cid);
+            continue;
+        }
+
+        preq = &q->reqs[cid - 1];
+        req = *preq;
+        preq->cb = NULL;
+        preq->opaque = NULL;
+        nvme_put_free_req(q, preq);
+        q->inflight--;
+        req.cb(req.opaque, nvme_translate_error(c));
+        progress = true;
+    }
+    if (progress) {
+        /* The entries must be consumed before the device may reuse them */
+        smp_mb();
+        *q->cq.doorbell = cpu_to_le32(q->cq.head);
+    }
+    q->busy = false;
+
+    /* Hand the request slots that were freed to waiting coroutines */
+    while (q->free_req_head != -1 && qemu_co_enter_next(&q->free_req_queue)) {
+        /* nothing */
+    }
+    return progress;
+}
+
+static void nvme_submit_command(BDRVNVMeState *s, NVMeQueuePair *q,
+                                NVMeRequest *req, NvmeCmd *cmd,
+                                BlockCompletionFunc cb, void *opaque)
+{
+    assert(!req->cb);
+    req->cb = cb;
+    req->opaque = opaque;
+    cmd->cid = cpu_to_le16(req->cid);
+
+    trace_nvme_submit_command(s, q->index, req->cid);
+    memcpy(&q->sq.queue[q->sq.tail * NVME_SQ_ENTRY_BYTES], cmd, sizeof(*cmd));
+    q->sq.tail = (q->sq.tail + 1) % q->size;
+    q->need_kick++;
+    q->inflight++;
+    nvme_kick(s, q);
+}
+
+static void nvme_cmd_sync_cb(void *opaque, int ret)
+{
+    int *pret = opaque;
+    *pret = ret;
+}
+
+/* Run an admin command outside coroutine context, e.g. during open */
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeRequest *req;
+    int ret = -EINPROGRESS;
+
+    req = nvme_get_free_req(q);
+    if (!req) {
+        return -EBUSY;
+    }
+    nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
+    while (ret == -EINPROGRESS) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+    return ret;
+}
+
+static bool nvme_poll_queues(BDRVNVMeState *s)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        NvmeCqe *c = (NvmeCqe *)&q->cq.queue[q->cq.head * NVME_CQ_ENTRY_BYTES];
+
+        /* Cheap check before taking over the queue */
+        if ((le16_to_cpu(c->status) & 0x1) == q->cq_phase) {
+            continue;
+        }
+        progress |= nvme_process_completion(s, q);
+    }
+    return progress;
+}
+
+static void nvme_handle_event(EventNotifier *n)
+{
+    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+
+    trace_nvme_handle_event(s);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queues(s);
+}
+
+static bool nvme_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
+
+    return nvme_poll_queues(s);
+}
+
+static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    size_t bytes = ROUND_UP(sizeof(NvmeIdCtrl), getpagesize());
+    NvmeIdCtrl *idctrl;
+    NvmeIdNs *idns;
+    NvmeLBAF *lbaf;
+    uint8_t *resp;
+    uint64_t iova;
+    uint16_t oncs;
+    bool ret = false;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .cdw10 = cpu_to_le32(0x1),
+    };
+
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdCtrl) != sizeof(NvmeIdNs));
+    resp = qemu_try_memalign(getpagesize(), bytes);
+    if (!resp) {
+        error_setg(errp, "Cannot allocate buffer for identify response");
+        return false;
+    }
+    idctrl = (NvmeIdCtrl *)resp;
+    idns = (NvmeIdNs *)resp;
+    if (qemu_vfio_dma_map(s->vfio, resp, bytes, false, &iova)) {
+        error_setg(errp, "Cannot map buffer for DMA");
+        qemu_vfree(resp);
+        return false;
+    }
+    cmd.prp1 = cpu_to_le64(iova);
+
+    memset(resp, 0, bytes);
+    if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to identify controller");
+        goto out;
+    }
+    if (le32_to_cpu(idctrl->nn) < namespace) {
+        error_setg(errp, "Invalid namespace %d", namespace);
+        goto out;
+    }
+    oncs = le16_to_cpu(idctrl->oncs);
+    s->write_cache_supported = idctrl->vwc & 0x1;
+    s->supports_write_zeroes = oncs & NVME_ONCS_WRITE_ZEROS;
+    s->supports_discard = oncs & NVME_ONCS_DSM;
+
+    /* A request must fit in the PRP list page of its NVMeRequest */
+    s->max_transfer = idctrl->mdts ? (1ULL << idctrl->mdts) * s->page_size : 0;
+    s->max_transfer = MIN_NON_ZERO(s->max_transfer,
+                                   s->page_size / sizeof(uint64_t) *
+                                   s->page_size);
+
+    memset(resp, 0, bytes);
+    cmd.cdw10 = 0;
+    cmd.nsid = cpu_to_le32(namespace);
+    if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to identify namespace");
+        goto out;
+    }
+
+    s->nsze = le64_to_cpu(idns->nsze);
+    lbaf = &idns->lbaf[NVME_ID_NS_FLBAS_INDEX(idns->flbas)];
+    if (lbaf->ms) {
+        error_setg(errp, "Namespaces with metadata are not supported");
+        goto out;
+    }
+    if (lbaf->ds < BDRV_SECTOR_BITS || lbaf->ds > ctz32(NVME_PAGE_SIZE)) {
+        error_setg(errp, "Namespace has unsupported block size (2^%d)",
+                   lbaf->ds);
+        goto out;
+    }
+    s->blkshift = lbaf->ds;
+    ret = true;
+
+out:
+    qemu_vfio_dma_unmap(s->vfio, resp);
+    qemu_vfree(resp);
+    return ret;
+}
+
+static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int n = s->nr_queues;
+    int size = s->io_queue_size;
+    NVMeQueuePair *q;
+    NvmeCmd cmd;
+
+    q = nvme_create_queue_pair(s, n, size, errp);
+    if (!q) {
+        return false;
+    }
+
+    /* Physically contiguous, interrupts enabled on vector 0 */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .prp1 = cpu_to_le64(q->cq.iova),
+        .cdw10 = cpu_to_le32(((size - 1) << 16) | n),
+        .cdw11 = cpu_to_le32(0x3),
+    };
+    if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to create completion queue %d", n);
+        goto fail;
+    }
+
+    /* Physically contiguous, completions go to CQ n */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .prp1 = cpu_to_le64(q->sq.iova),
+        .cdw10 = cpu_to_le32(((size - 1) << 16) | n),
+        .cdw11 = cpu_to_le32((n << 16) | 0x1),
+    };
+    if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
+        error_setg(errp, "Failed to create submission queue %d", n);
+        goto fail;
+    }
+
+    s->queues[n] = q;
+    s->nr_queues++;
+    return true;
+
+fail:
+    nvme_free_queue_pair(s, q);
+    return false;
+}
+
+/* Wait until CSTS.RDY is @ready, for at most @timeout_ms */
+static int nvme_wait_ready(BDRVNVMeState *s, bool ready, int64_t timeout_ms,
+                           Error **errp)
+{
+    int64_t deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + timeout_ms;
+
+    while ((le32_to_cpu(s->regs->csts) & NVME_CSTS_READY) != ready) {
+        if (le32_to_cpu(s->regs->csts) & NVME_CSTS_FAILED) {
+            error_setg(errp, "Controller fatal status");
+            return -EIO;
+        }
+        if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+            error_setg(errp, "Timeout while waiting for the controller to %s "
+                       "(%" PRId64 " ms)", ready ? "start" : "reset",
+                       timeout_ms);
+            return -ETIMEDOUT;
+        }
+        g_usleep(1000);
+    }
+    return 0;
+}
+
+static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
+                     Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int64_t timeout_ms;
+    uint64_t cap;
+    int ret;
+
+    s->nsid = namespace;
+    qemu_co_queue_init(&s->dma_flush_queue);
+
+    s->vfio = qemu_vfio_open_pci(device, errp);
+    if (!s->vfio) {
+        return -EINVAL;
+    }
+
+    s->bar = qemu_vfio_pci_map_bar(s->vfio, 0, 0, NVME_BAR_SIZE, errp);
+    if (!s->bar) {
+        return -EINVAL;
+    }
+    s->regs = s->bar;
+    s->doorbells = (uint32_t *)((uint8_t *)s->bar + NVME_DOORBELL_OFFSET);
+
+    /* Initialization sequence as described in the NVMe spec, section 7.6.1 */
+    cap = le64_to_cpu(s->regs->cap);
+    if (!(NVME_CAP_CSS(cap) & 1)) {
+        error_setg(errp, "Device doesn't support NVMe command set");
+        return -EINVAL;
+    }
+    if (NVME_CAP_MPSMIN(cap) > 0) {
+        error_setg(errp, "Device doesn't support 4 KiB memory pages");
+        return -EINVAL;
+    }
+    if (2 * (INDEX_IO + 1) * (4 << NVME_CAP_DSTRD(cap)) >
+        NVME_BAR_SIZE - NVME_DOORBELL_OFFSET) {
+        error_setg(errp, "Unsupported doorbell stride");
+        return -EINVAL;
+    }
+    s->page_size = NVME_PAGE_SIZE;
+    s->doorbell_scale = (4 << NVME_CAP_DSTRD(cap)) / sizeof(uint32_t);
+    s->io_queue_size = MIN(NVME_QUEUE_SIZE, NVME_CAP_MQES(cap) + 1);
+    timeout_ms = MIN(500 * NVME_CAP_TO(cap), 30000);
+
+    /* Reset the controller to get a clean state */
+    s->regs->cc = cpu_to_le32(le32_to_cpu(s->regs->cc) & ~CC_EN_MASK);
+    ret = nvme_wait_ready(s, false, timeout_ms, errp);
+    if (ret) {
+        return ret;
+    }
+
+    s->queues[INDEX_ADMIN] = nvme_create_queue_pair(s, INDEX_ADMIN,
+                                                    NVME_QUEUE_SIZE, errp);
+    if (!s->queues[INDEX_ADMIN]) {
+        return -EINVAL;
+    }
+    s->nr_queues = 1;
+    QEMU_BUILD_BUG_ON((NVME_QUEUE_SIZE - 1) & ~AQA_ASQS_MASK);
+    s->regs->aqa = cpu_to_le32(((NVME_QUEUE_SIZE - 1) << AQA_ACQS_SHIFT) |
+                               ((NVME_QUEUE_SIZE - 1) << AQA_ASQS_SHIFT));
+    s->regs->asq = cpu_to_le64(s->queues[INDEX_ADMIN]->sq.iova);
+    s->regs->acq = cpu_to_le64(s->queues[INDEX_ADMIN]->cq.iova);
+
+    s->regs->cc = cpu_to_le32((ctz32(NVME_CQ_ENTRY_BYTES) << CC_IOCQES_SHIFT) |
+                              (ctz32(NVME_SQ_ENTRY_BYTES) << CC_IOSQES_SHIFT) |
+                              CC_EN_MASK);
+    ret = nvme_wait_ready(s, true, timeout_ms, errp);
+    if (ret) {
+        return ret;
+    }
+
+    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
+                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret) {
+        return ret;
+    }
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+                           false, nvme_handle_event, nvme_poll_cb);
+
+    if (!nvme_identify(bs, namespace, errp)) {
+        return -EIO;
+    }
+    if (!nvme_add_io_queue(bs, errp)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* nvme://DDDD:BB:DD.F/NSID */
+static void nvme_parse_filename(const char *filename, QDict *options,
+                                Error **errp)
+{
+    const char *prefix = "nvme://";
+    const char *tmp, *slash;
+    unsigned long ns = 1;
+    char *device;
+
+    if (!strstart(filename, prefix, &tmp)) {
+        error_setg(errp, "NVMe filename must start with '%s'", prefix);
+        return;
+    }
+
+    slash = strchr(tmp, '/');
+    if (slash) {
+        if (qemu_strtoul(slash + 1, NULL, 10, &ns) || !ns) {
+            error_setg(errp, "Invalid namespace '%s', positive number "
+                       "expected", slash + 1);
+            return;
+        }
+        device = g_strndup(tmp, slash - tmp);
+    } else {
+        device = g_strdup(tmp);
+    }
+
+    qdict_put(options, NVME_BLOCK_OPT_DEVICE, qstring_from_str(device));
+    qdict_put(options, NVME_BLOCK_OPT_NAMESPACE, qint_from_int(ns));
+    g_free(device);
+}
+
+static void nvme_close(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    if (s->regs) {
+        /* Stop the controller before its queues go away */
+        s->regs->cc = cpu_to_le32(le32_to_cpu(s->regs->cc) & ~CC_EN_MASK);
+    }
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+                           false, NULL, NULL);
+    for (i = 0; i < s->nr_queues; i++) {
+        nvme_free_queue_pair(s, s->queues[i]);
+    }
+    s->nr_queues = 0;
+    event_notifier_cleanup(&s->irq_notifier);
+    if (s->vfio) {
+        qemu_vfio_pci_unmap_bar(s->vfio, 0, s->bar, 0, NVME_BAR_SIZE);
+        qemu_vfio_close(s->vfio);
+    }
+}
+
+static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    const char *device;
+    QemuOpts *opts;
+    int namespace;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &error_abort);
+    device = qemu_opt_get(opts, NVME_BLOCK_OPT_DEVICE);
+    if (!device) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_DEVICE "' option is required");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
+
+    ret = event_notifier_init(&s->irq_notifier, 0);
+    if (ret) {
+        error_setg_errno(errp, -ret, "Failed to init event notifier");
+        qemu_opts_del(opts);
+        return ret;
+    }
+
+    ret = nvme_init(bs, device, namespace, errp);
+    qemu_opts_del(opts);
+    if (ret) {
+        nvme_close(bs);
+        return ret;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_FUA;
+    bs->supported_zero_flags = BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP;
+    return 0;
+}
+
+static int64_t nvme_getlength(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    return s->nsze << s->blkshift;
+}
+
+static int nvme_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    bsz->log = bsz->phys = 1 << s->blkshift;
+    return 0;
+}
+
+/*
+ * Fill in the PRP entries of @cmd for @qiov, using temporary DMA mappings.
+ * Every iovec must start on an NVMe page and all but the last one must
+ * end on a page boundary.
+ *
+ * When the IOVA space runs out, all temporary mappings are dropped at once
+ * as soon as no request uses them any more; requests that need a mapping
+ * in the meantime wait on dma_flush_queue.
+ */
+static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
+                                          NVMeRequest *req, QEMUIOVector *qiov)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t *pagelist = req->prp_list_page;
+    size_t hpage = getpagesize();
+    int entries;
+    int i, j, r = 0;
+
+    assert(qiov->size);
+    s->dma_map_count++;
+retry:
+    entries = 0;
+    for (i = 0; i < qiov->niov; i++) {
+        uint8_t *base = qiov->iov[i].iov_base;
+        size_t len = qiov->iov[i].iov_len;
+        uint8_t *start = (uint8_t *)QEMU_ALIGN_DOWN((uintptr_t)base, hpage);
+        uint64_t iova;
+
+        r = qemu_vfio_dma_map(s->vfio, start,
+                              QEMU_ALIGN_UP(base + len - start, hpage),
+                              true, &iova);
+        if (r == -ENOMEM) {
+            if (s->dma_map_count > 1) {
+                trace_nvme_dma_flush_queue_wait(s);
+                s->dma_map_count--;
+                qemu_co_queue_wait(&s->dma_flush_queue);
+                s->dma_map_count++;
+            } else if (qemu_vfio_dma_reset_temporary(s->vfio)) {
+                break;
+            }
+            /* Our own earlier mappings are gone, too */
+            goto retry;
+        }
+        if (r) {
+            break;
+        }
+
+        iova += base - start;
+        for (j = 0; j < DIV_ROUND_UP(len, s->page_size); j++) {
+            assert(entries < s->page_size / sizeof(uint64_t));
+            pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
+        }
+    }
+    if (r) {
+        s->dma_map_count--;
+        return r;
+    }
+
+    /* PRP2 is either the second page or, when there are more, points to
+     * the rest of the list.
+     */
+    cmd->prp1 = pagelist[0];
+    switch (entries) {
+    case 1:
+        cmd->prp2 = 0;
+        break;
+    case 2:
+        cmd->prp2 = pagelist[1];
+        break;
+    default:
+        cmd->prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
+        break;
+    }
+    return 0;
+}
+
+static coroutine_fn void nvme_dma_done(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    if (--s->dma_map_count == 0 && !qemu_co_queue_empty(&s->dma_flush_queue)) {
+        qemu_vfio_dma_reset_temporary(s->vfio);
+        qemu_co_queue_restart_all(&s->dma_flush_queue);
+    }
+}
+
+typedef struct {
+    Coroutine *co;
+    int ret;
+} NVMeCoData;
+
+static void nvme_co_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+
+    data->ret = ret;
+    /* The coroutine may still be running if it unplugged the queue */
+    if (!qemu_coroutine_entered(data->co)) {
+        qemu_coroutine_enter(data->co);
+    }
+}
+
+/* Submit @cmd on the I/O queue, with @qiov as its data if not NULL */
+static coroutine_fn int nvme_co_submit(BlockDriverState *bs, NvmeCmd *cmd,
+                                       QEMUIOVector *qiov)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *ioq = s->queues[INDEX_IO];
+    NVMeRequest *req;
+    NVMeCoData data = {
+        .co = qemu_coroutine_self(),
+        .ret = -EINPROGRESS,
+    };
+    int r;
+
+    req = nvme_get_free_req(ioq);
+    if (qiov) {
+        r = nvme_cmd_map_qiov(bs, cmd, req, qiov);
+        if (r) {
+            nvme_put_free_req(ioq, req);
+            qemu_co_queue_next(&ioq->free_req_queue);
+            return r;
+        }
+    }
+
+    nvme_submit_command(s, ioq, req, cmd, nvme_co_cb, &data);
+    while (data.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+
+    if (qiov) {
+        nvme_dma_done(bs);
+    }
+    return data.ret;
+}
+
+static bool nvme_qiov_aligned(BlockDriverState *bs, const QEMUIOVector *qiov)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        if (!QEMU_PTR_IS_ALIGNED(qiov->iov[i].iov_base, s->page_size) ||
+            (i < qiov->niov - 1 &&
+             !QEMU_IS_ALIGNED(qiov->iov[i].iov_len, s->page_size))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static coroutine_fn int nvme_co_prw(BlockDriverState *bs, uint64_t offset,
+                                    uint64_t bytes, QEMUIOVector *qiov,
+                                    bool is_write, int flags)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t slba = offset >> s->blkshift;
+    uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xffff;
+    QEMUIOVector local_qiov;
+    uint8_t *buf = NULL;
+    int r;
+    NvmeCmd cmd = {
+        .opcode = is_write ? NVME_CMD_WRITE : NVME_CMD_READ,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32(slba & 0xffffffff),
+        .cdw11 = cpu_to_le32(slba >> 32),
+    };
+
+    if (flags & BDRV_REQ_FUA) {
+        cdw12 |= NVME_RW_FUA << 16;
+    }
+    cmd.cdw12 = cpu_to_le32(cdw12);
+
+    if (nvme_qiov_aligned(bs, qiov)) {
+        trace_nvme_prw(s, is_write, offset, bytes, flags, qiov->niov, false);
+        r = nvme_co_submit(bs, &cmd, qiov);
+    } else {
+        trace_nvme_prw(s, is_write, offset, bytes, flags, qiov->niov, true);
+        buf = qemu_try_memalign(s->page_size, bytes);
+        if (!buf) {
+            return -ENOMEM;
+        }
+        if (is_write) {
+            qemu_iovec_to_buf(qiov, 0, buf, bytes);
+        }
+        qemu_iovec_init(&local_qiov, 1);
+        qemu_iovec_add(&local_qiov, buf, bytes);
+        r = nvme_co_submit(bs, &cmd, &local_qiov);
+        qemu_iovec_destroy(&local_qiov);
+        if (!r && !is_write) {
+            qemu_iovec_from_buf(qiov, 0, buf, bytes);
+        }
+        qemu_vfree(buf);
+    }
+
+    trace_nvme_rw_done(s, is_write, offset, bytes, r);
+    return r;
+}
+
+static coroutine_fn int nvme_co_preadv(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes,
+                                       QEMUIOVector *qiov, int flags)
+{
+    return nvme_co_prw(bs, offset, bytes, qiov, false, flags);
+}
+
+static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov, int flags)
+{
+    return nvme_co_prw(bs, offset, bytes, qiov, true, flags);
+}
+
+static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_FLUSH,
+        .nsid = cpu_to_le32(s->nsid),
+    };
+
+    /* Without a volatile write cache, completed writes are already stable */
+    if (!s->write_cache_supported) {
+        return 0;
+    }
+    return nvme_co_submit(bs, &cmd, NULL);
+}
+
+static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
+                                              int64_t offset, int count,
+                                              BdrvRequestFlags flags)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t slba = offset >> s->blkshift;
+    uint32_t cdw12 = ((count >> s->blkshift) - 1) & 0xffff;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_WRITE_ZEROS,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32(slba & 0xffffffff),
+        .cdw11 = cpu_to_le32(slba >> 32),
+    };
+
+    if (!s->supports_write_zeroes) {
+        return -ENOTSUP;
+    }
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        cdw12 |= 1 << 25;       /* deallocate */
+    }
+    if (flags & BDRV_REQ_FUA) {
+        cdw12 |= NVME_RW_FUA << 16;
+    }
+    cmd.cdw12 = cpu_to_le32(cdw12);
+    return nvme_co_submit(bs, &cmd, NULL);
+}
+
+static coroutine_fn int nvme_co_pdiscard(BlockDriverState *bs,
+                                         int64_t offset, int count)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeDsmRange *range;
+    QEMUIOVector local_qiov;
+    int r;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_DSM,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32(0),        /* one range */
+        .cdw11 = cpu_to_le32(NVME_DSMGMT_AD),
+    };
+
+    if (!s->supports_discard) {
+        return -ENOTSUP;
+    }
+
+    range = qemu_try_memalign(s->page_size, sizeof(*range));
+    if (!range) {
+        return -ENOMEM;
+    }
+    range->cattr = 0;
+    range->nlb = cpu_to_le32(count >> s->blkshift);
+    range->slba = cpu_to_le64(offset >> s->blkshift);
+
+    qemu_iovec_init(&local_qiov, 1);
+    qemu_iovec_add(&local_qiov, range, sizeof(*range));
+    r = nvme_co_submit(bs, &cmd, &local_qiov);
+    qemu_iovec_destroy(&local_qiov);
+    qemu_vfree(range);
+    return r;
+}
+
+static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint32_t blksize = 1 << s->blkshift;
+
+    bs->bl.request_alignment = blksize;
+    bs->bl.min_mem_alignment = s->page_size;
+    bs->bl.opt_mem_alignment = s->page_size;
+    bs->bl.max_transfer = s->max_transfer;
+    bs->bl.max_pwrite_zeroes = 65536 * blksize;
+    bs->bl.pwrite_zeroes_alignment = blksize;
+    bs->bl.max_pdiscard = QEMU_ALIGN_DOWN(INT32_MAX, blksize);
+    bs->bl.pdiscard_alignment = blksize;
+}
+
+static void nvme_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+                           false, NULL, NULL);
+}
+
+static void nvme_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    aio_set_event_notifier(new_context, &s->irq_notifier,
+                           false, nvme_handle_event, nvme_poll_cb);
+}
+
+static void nvme_io_plug(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    assert(!s->plugged);
+    s->plugged = true;
+}
+
+static void nvme_io_unplug(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    assert(s->plugged);
+    s->plugged = false;
+    for (i = INDEX_IO; i < s->nr_queues; i++) {
+        nvme_kick(s, s->queues[i]);
+        nvme_process_completion(s, s->queues[i]);
+    }
+}
+
+static BlockDriver bdrv_nvme = {
+    .format_name              = "nvme",
+    .protocol_name            = "nvme",
+    .instance_size            = sizeof(BDRVNVMeState),
+
+    .bdrv_parse_filename      = nvme_parse_filename,
+    .bdrv_file_open           = nvme_file_open,
+    .bdrv_close               = nvme_close,
+    .bdrv_getlength           = nvme_getlength,
+    .bdrv_probe_blocksizes    = nvme_probe_blocksizes,
+
+    .bdrv_co_preadv           = nvme_co_preadv,
+    .bdrv_co_pwritev          = nvme_co_pwritev,
+    .bdrv_co_pwrite_zeroes    = nvme_co_pwrite_zeroes,
+    .bdrv_co_pdiscard         = nvme_co_pdiscard,
+    .bdrv_co_flush_to_disk    = nvme_co_flush,
+    .bdrv_refresh_limits      = nvme_refresh_limits,
+
+    .bdrv_detach_aio_context  = nvme_detach_aio_context,
+    .bdrv_attach_aio_context  = nvme_attach_aio_context,
+
+    .bdrv_io_plug             = nvme_io_plug,
+    .bdrv_io_unplug           = nvme_io_unplug,
+};
+
+static void bdrv_nvme_init(void)
+{
+    bdrv_register(&bdrv_nvme);
+}
+
+block_init(bdrv_nvme_init);
@@ -33,6 +33,8 @@
 #include "qapi/qmp/types.h"
 #include "sysemu/block-backend.h"
 #include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/stats.h"
 
 BlockDeviceInfo *bdrv_block_device_info(BlockBackend *blk,
                                         BlockDriverState *bs, Error **errp)
@@ -358,9 +360,42 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
 }
 
 static BlockStats *bdrv_query_stats(BlockBackend *blk,
-                                    const BlockDriverState *bs,
+                                    BlockDriverState *bs,
                                     bool query_backing);
 
+static uint64List *uint64_list(uint64_t *list, int size)
+{
+    int i;
+    uint64List *out_list = NULL;
+    uint64List **pout_list = &out_list;
+
+    for (i = 0; i < size; i++) {
+        uint64List *entry = g_new(uint64List, 1);
+        entry->value = list[i];
+        *pout_list = entry;
+        pout_list = &entry->next;
+    }
+
+    *pout_list = NULL;
+
+    return out_list;
+}
+
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+
+    if (!hist->nbins) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    info->boundaries = uint64_list(hist->boundaries, hist->nbins - 1);
+    info->bins = uint64_list(hist->bins, hist->nbins);
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -395,6 +430,33 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    if (blk_get_public(blk)->throttle_state) {
+        BlockBackendPublic *blkp = blk_get_public(blk);
+
+        ds->has_throttle_rd_operations = true;
+        ds->throttle_rd_operations = blkp->throttle_served[0];
+        ds->has_throttle_wr_operations = true;
+        ds->throttle_wr_operations = blkp->throttle_served[1];
+        ds->has_throttle_delayed_rd_operations = true;
+        ds->throttle_delayed_rd_operations = blkp->throttle_delayed[0];
+        ds->has_throttle_delayed_wr_operations = true;
+        ds->throttle_delayed_wr_operations = blkp->throttle_delayed[1];
+        ds->has_throttle_rd_wait_time_ns = true;
+        ds->throttle_rd_wait_time_ns = blkp->throttle_wait_ns[0];
+        ds->has_throttle_wr_wait_time_ns = true;
+        ds->throttle_wr_wait_time_ns = blkp->throttle_wait_ns[1];
+    }
+
+    ds->rd_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_READ]);
+    ds->has_rd_latency_histogram = !!ds->rd_latency_histogram;
+    ds->wr_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_WRITE]);
+    ds->has_wr_latency_histogram = !!ds->wr_latency_histogram;
+    ds->flush_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_FLUSH]);
+    ds->has_flush_latency_histogram = !!ds->flush_latency_histogram;
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -428,7 +490,7 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     }
 }
 
-static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
+static void bdrv_query_bds_stats(BlockStats *s, BlockDriverState *bs,
                                  bool query_backing)
 {
     if (bdrv_get_node_name(bs)[0]) {
@@ -438,6 +500,9 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
 
     s->stats->wr_highest_offset = bs->wr_highest_offset;
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(NULL, bs->file->bs, query_backing);
@@ -451,7 +516,7 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
 }
 
 static BlockStats *bdrv_query_stats(BlockBackend *blk,
-                                    const BlockDriverState *bs,
+                                    BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
@@ -535,6 +600,64 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
     return head;
 }
 
+static void bdrv_stats_provider(StatsCollector *c, void *opaque)
+{
+    static const char *const types[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ] = "rd",
+        [BLOCK_ACCT_WRITE] = "wr",
+        [BLOCK_ACCT_FLUSH] = "flush",
+    };
+    BlockBackend *blk = NULL;
+    char name[64];
+    int t;
+
+    while ((blk = blk_next(blk))) {
+        AioContext *ctx = blk_get_aio_context(blk);
+        BlockAcctStats *stats;
+
+        if (!stats_begin_instance(c, blk_name(blk))) {
+            continue;
+        }
+
+        aio_context_acquire(ctx);
+        stats = blk_get_stats(blk);
+        for (t = 0; t < BLOCK_MAX_IOTYPE; t++) {
+            BlockLatencyHistogram *hist = &stats->latency_histogram[t];
+
+            if (t != BLOCK_ACCT_FLUSH) {
+                snprintf(name, sizeof(name), "%s-bytes", types[t]);
+                stats_add_counter(c, name, stats->nr_bytes[t]);
+                snprintf(name, sizeof(name), "%s-merged", types[t]);
+                stats_add_counter(c, name, stats->merged[t]);
+            }
+            snprintf(name, sizeof(name), "%s-operations", types[t]);
+            stats_add_counter(c, name, stats->nr_ops[t]);
+            snprintf(name, sizeof(name), "failed-%s-operations", types[t]);
+            stats_add_counter(c, name, stats->failed_ops[t]);
+            snprintf(name, sizeof(name), "invalid-%s-operations", types[t]);
+            stats_add_counter(c, name, stats->invalid_ops[t]);
+            snprintf(name, sizeof(name), "%s-total-time-ns", types[t]);
+            stats_add_counter(c, name, stats->total_time_ns[t]);
+            if (hist->nbins) {
+                snprintf(name, sizeof(name), "%s-latency-histogram", types[t]);
+                stats_add_histogram(c, name, hist->nbins, hist->boundaries,
+                                    hist->bins);
+            }
+        }
+        if (stats->last_access_time_ns > 0) {
+            stats_add_gauge(c, "idle-time-ns", block_acct_idle_time_ns(stats));
+        }
+        aio_context_release(ctx);
+    }
+}
+
+static void bdrv_stats_init(void)
+{
+    stats_register_provider("block", bdrv_stats_provider, NULL);
+}
+
+block_init(bdrv_stats_init);
+
 #define NB_SUFFIXES 4
 
 static char *get_human_readable_size(char *buf, int buf_size, int64_t size)
@@ -121,6 +121,8 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     g_free(s->refcount_table);
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_ALL);
+    qcow2_free_map_reset(bs);
 }
 
 
@@ -270,6 +272,119 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
     return 0;
 }
 
+/*
+ * The free map remembers how many free clusters each refcount block
+ * describes, so that allocation can skip fully used blocks without loading
+ * them.  Blocks are counted the first time allocation reaches them, and
+ * update_refcount() keeps the counts in sync afterwards.
+ */
+
+/* Forget all counts, e.g. because the refcount structures were replaced */
+void qcow2_free_map_reset(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    g_free(s->refblock_free);
+    s->refblock_free = NULL;
+    s->refblock_free_size = 0;
+}
+
+static void free_map_forget(BDRVQcow2State *s, uint64_t table_index)
+{
+    if (table_index < s->refblock_free_size) {
+        s->refblock_free[table_index] = QCOW2_FREE_UNKNOWN;
+    }
+}
+
+static void free_map_adjust(BDRVQcow2State *s, uint64_t table_index,
+                            bool freed)
+{
+    uint32_t *nb_free;
+
+    if (table_index >= s->refblock_free_size) {
+        return;
+    }
+    nb_free = &s->refblock_free[table_index];
+    if (*nb_free == QCOW2_FREE_UNKNOWN) {
+        return;
+    } else if (freed) {
+        (*nb_free)++;
+    } else if (*nb_free > 0) {
+        (*nb_free)--;
+    } else {
+        /* Out of sync, count again when it is needed */
+        *nb_free = QCOW2_FREE_UNKNOWN;
+    }
+}
+
+/* Returns the number of free clusters described by a refcount block */
+static int64_t free_map_count(BlockDriverState *bs, uint64_t table_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refblock_offset, i;
+    void *refblock;
+    uint32_t nb_free = 0;
+    int ret;
+
+    if (table_index >= s->refcount_table_size) {
+        return s->refcount_block_size;
+    }
+    if (table_index >= s->refblock_free_size) {
+        s->refblock_free = g_renew(uint32_t, s->refblock_free,
+                                   s->refcount_table_size);
+        for (i = s->refblock_free_size; i < s->refcount_table_size; i++) {
+            s->refblock_free[i] = QCOW2_FREE_UNKNOWN;
+        }
+        s->refblock_free_size = s->refcount_table_size;
+    }
+    if (s->refblock_free[table_index] != QCOW2_FREE_UNKNOWN) {
+        return s->refblock_free[table_index];
+    }
+
+    /* Unallocated blocks are not cached: they are filled in once allocated.
+     * Unaligned ones are reported as corruption by qcow2_get_refcount(). */
+    refblock_offset = s->refcount_table[table_index] & REFT_OFFSET_MASK;
+    if (!refblock_offset || offset_into_cluster(s, refblock_offset)) {
+        return s->refcount_block_size;
+    }
+
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refblock_offset,
+                          &refblock);
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < s->refcount_block_size; i++) {
+        if (s->get_refcount(refblock, i) == 0) {
+            nb_free++;
+        }
+    }
+    qcow2_cache_put(bs, s->refcount_block_cache, &refblock);
+
+    /* Loading the block may have yielded */
+    if (table_index < s->refblock_free_size) {
+        s->refblock_free[table_index] = nb_free;
+    }
+    return nb_free;
+}
+
+/* Move free_cluster_index past refcount blocks without free clusters */
+static int free_map_skip_full(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    for (;;) {
+        uint64_t table_index = s->free_cluster_index >> s->refcount_block_bits;
+        int64_t nb_free = free_map_count(bs, table_index);
+
+        if (nb_free < 0) {
+            return nb_free;
+        } else if (nb_free > 0) {
+            return 0;
+        }
+        s->free_cluster_index = (table_index + 1) << s->refcount_block_bits;
+    }
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -439,6 +554,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
         }
 
         s->refcount_table[refcount_table_index] = new_block;
+        qcow2_metadata_index_invalidate(bs, QCOW2_OL_REFCOUNT_BLOCK);
+        free_map_forget(s, refcount_table_index);
 
         /* The new refcount block may be where the caller intended to put its
          * data, so let it restart the search. */
@@ -580,6 +697,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table = new_table;
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_REFCOUNT_BLOCK);
+    qcow2_free_map_reset(bs);
 
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
@@ -710,7 +829,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         cluster_offset += s->cluster_size)
     {
         int block_index;
-        uint64_t refcount;
+        uint64_t refcount, old_refcount;
         int64_t cluster_index = cluster_offset >> s->cluster_bits;
         int64_t table_index = cluster_index >> s->refcount_block_bits;
 
@@ -732,7 +851,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         /* we can update the count and save it */
         block_index = cluster_index & (s->refcount_block_size - 1);
 
-        refcount = s->get_refcount(refcount_block, block_index);
+        refcount = old_refcount = s->get_refcount(refcount_block, block_index);
         if (decrease ? (refcount - addend > refcount)
                      : (refcount + addend < refcount ||
                         refcount + addend > s->refcount_max))
@@ -749,6 +868,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        if ((refcount == 0) != (old_refcount == 0)) {
+            free_map_adjust(s, table_index, refcount == 0);
+        }
 
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
@@ -827,7 +949,15 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
     nb_clusters = size_to_clusters(s, size);
 retry:
     for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
+        uint64_t next_cluster_index;
+
+        if (i == 0) {
+            ret = free_map_skip_full(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        next_cluster_index = s->free_cluster_index++;
         ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
 
         if (ret < 0) {
@@ -1047,6 +1177,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
     int i, j, l1_modified = 0, nb_csectors;
+    unsigned slice, slice_size2, n_slices;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
@@ -1054,6 +1185,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -1095,20 +1228,22 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
+                    offset = get_l2_entry(s, l2_table, j);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
 
-                switch (qcow2_get_cluster_type(offset)) {
+                    switch (qcow2_get_cluster_type(offset)) {
                     case QCOW2_CLUSTER_COMPRESSED:
                         nb_csectors = ((offset >> s->csize_shift) &
                                        s->csize_mask) + 1;
@@ -1133,12 +1268,15 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                                                     "unaligned (L2 offset: %#"
                                                     PRIx64 ", L2 index: %#x)",
                                                     offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
+                                                    l2_offset,
+                                                    slice * s->l2_slice_size
+                                                    + j);
                             ret = -EIO;
                             goto fail;
                         }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                        cluster_index = (offset & L2E_OFFSET_MASK)
+                                        >> s->cluster_bits;
                         if (!cluster_index) {
                             /* unallocated */
                             refcount = 0;
@@ -1165,23 +1303,24 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
                     default:
                         abort();
-                }
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        set_l2_entry(s, l2_table, j, offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1309,11 +1448,10 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
  *
  * Modifies the number of errors in res.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                         BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t start, last, cluster_offset, k, refcount;
@@ -1372,12 +1510,12 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t *l2_table, l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * l2_entry_size(s);
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
@@ -1389,7 +1527,16 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, 0) ==
+            QCOW2_SUBCLUSTER_INVALID) {
+            fprintf(stderr, "ERROR invalid cluster entry in L2 table at "
+                    "offset %#" PRIx64 ", index %d: %#" PRIx64 " bitmap %#"
+                    PRIx64 "\n", l2_offset, i, l2_entry, l2_bitmap);
+            res->corruptions++;
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1406,8 +1553,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_entry & ~511, nb_csectors * 512);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, l2_entry & ~511,
+                                           nb_csectors * 512);
             if (ret < 0) {
                 goto fail;
             }
@@ -1445,8 +1593,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1498,8 +1647,8 @@ static int check_refcounts_l1(BlockDriverState *bs,
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                        l1_table_offset, l1_size2);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, refcount_table_size,
+                                   l1_table_offset, l1_size2);
     if (ret < 0) {
         goto fail;
     }
@@ -1528,8 +1677,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, l2_offset,
+                                           s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1611,7 +1761,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1620,7 +1770,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1640,9 +1790,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1744,14 +1894,15 @@ static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 res->corruptions_fixed++;
-                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                    offset, s->cluster_size);
+                ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                               nb_clusters, offset,
+                                               s->cluster_size);
                 if (ret < 0) {
                     return ret;
                 }
                 /* No need to check whether the refcount is now greater than 1:
                  * This area was just allocated and zeroed, so it can only be
-                 * exactly 1 after inc_refcounts() */
+                 * exactly 1 after qcow2_inc_refcounts_imrt() */
                 continue;
 
 resize_fail:
@@ -1766,8 +1917,8 @@ resize_fail:
         }
 
         if (offset != 0) {
-            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                           offset, s->cluster_size);
             if (ret < 0) {
                 return ret;
             }
@@ -1807,8 +1958,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        0, s->cluster_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters, 0,
+                                   s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -1829,20 +1980,36 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             return ret;
         }
     }
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->snapshots_offset, s->snapshots_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->snapshots_offset, s->snapshots_size);
     if (ret < 0) {
         return ret;
     }
 
     /* refcount data */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->refcount_table_offset,
-                        s->refcount_table_size * sizeof(uint64_t));
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->refcount_table_offset,
+                                   s->refcount_table_size * sizeof(uint64_t));
     if (ret < 0) {
         return ret;
     }
 
+    /* persistent dirty bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* dirty L2 log */
+    if (s->dirty_log_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->dirty_log_offset,
+                                       s->dirty_log_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -2171,6 +2338,8 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_REFCOUNT_BLOCK);
+    qcow2_free_map_reset(bs);
 
     return 0;
 
@@ -2305,9 +2474,341 @@ fail:
     return ret;
 }
 
+/*
+ * Gives the cluster at @offset a refcount of 1 if it has none on disk.
+ * Offsets that a valid image cannot contain are left to the full check.
+ */
+static int check_dirty_log_cluster(BlockDriverState *bs, BdrvCheckResult *res,
+                                   uint64_t offset, int64_t file_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refcount;
+    int ret;
+
+    if (offset_into_cluster(s, offset) || offset >= file_size) {
+        return -EINVAL;
+    }
+
+    ret = qcow2_get_refcount(bs, offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    }
+    if (refcount > 0) {
+        return 0;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, offset >> s->cluster_bits, 1,
+                                        false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+    res->corruptions_fixed++;
+    return 0;
+}
+
+/*
+ * Repairs a dirty image using the dirty L2 log instead of a full check.
+ *
+ * With lazy refcounts, the only inconsistency a crash can leave is that
+ * clusters linked into an L2 table still have a refcount of 0 on disk, and
+ * the log records all L2 tables that may contain such clusters.  Leaks are
+ * not looked for; they are harmless and a full check reclaims them.
+ *
+ * Returns 0 on success and -errno on failure, in which case the caller has
+ * to fall back to qcow2_check_refcounts().
+ */
+int qcow2_check_dirty_log(BlockDriverState *bs, BdrvCheckResult *res)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t l2_offset, l2_entry;
+    int64_t file_size, i, nb_entries;
+    int j, ret;
+
+    assert(s->dirty_log);
+
+    file_size = bdrv_getlength(bs->file->bs);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    ret = bdrv_pread(bs->file, s->dirty_log_offset, s->dirty_log,
+                     s->dirty_log_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (!l2_table) {
+        return -ENOMEM;
+    }
+
+    nb_entries = MIN(s->l1_size, s->dirty_log_size * 8);
+    for (i = 0; i < nb_entries; i++) {
+        if (!(s->dirty_log[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
+
+        l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+        if (!l2_offset) {
+            continue;
+        }
+
+        ret = check_dirty_log_cluster(bs, res, l2_offset, file_size);
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+
+        for (j = 0; j < s->l2_size; j++) {
+            l2_entry = get_l2_entry(s, l2_table, j);
+
+            /* Compressed clusters never have lazy refcounts */
+            if (qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_COMPRESSED ||
+                !(l2_entry & L2E_OFFSET_MASK)) {
+                continue;
+            }
+
+            ret = check_dirty_log_cluster(bs, res, l2_entry & L2E_OFFSET_MASK,
+                                          file_size);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(l2_table);
+    return ret;
+}
+
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
+/*
+ * L2 tables, refcount blocks and snapshot L1 tables are too many to walk on
+ * every metadata write, so their ranges are kept in two indexes sorted by
+ * start offset: one built from the in-memory active L1 and refcount tables,
+ * and one built from the snapshot list (reading the snapshot L1 tables if
+ * inactive L2 tables must be checked as well).  An index is rebuilt lazily
+ * after qcow2_metadata_index_invalidate().
+ */
+
+static void metadata_index_free(Qcow2MetadataIndex *idx)
+{
+    g_free(idx->ranges);
+    *idx = (Qcow2MetadataIndex) { .valid = false };
+}
+
+/*
+ * Drop the indexed ranges for the QCOW2_OL_* @types.  This must be called
+ * whenever an active L1 or refcount table entry starts pointing to a new
+ * cluster, and whenever the snapshot list changes.  Ranges from the active
+ * tables are checked against the table entry before they are reported, so
+ * entries that are cleared or freed don't need an invalidation.
+ */
+void qcow2_metadata_index_invalidate(BlockDriverState *bs, int types)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (types & (QCOW2_OL_ACTIVE_L2 | QCOW2_OL_REFCOUNT_BLOCK)) {
+        metadata_index_free(&s->ol_active);
+    }
+    if (types & QCOW2_OL_INACTIVE) {
+        metadata_index_free(&s->ol_snapshots);
+    }
+}
+
+static void metadata_index_add(Qcow2MetadataIndex *idx, uint64_t start,
+                               uint64_t size, int type, uint32_t index)
+{
+    idx->ranges[idx->nb_ranges++] = (Qcow2MetadataRange) {
+        .start  = start,
+        .end    = start + size,
+        .type   = type,
+        .index  = index,
+    };
+}
+
+static int metadata_range_cmp(const void *a, const void *b)
+{
+    const Qcow2MetadataRange *ra = a, *rb = b;
+
+    if (ra->start != rb->start) {
+        return ra->start < rb->start ? -1 : 1;
+    }
+    return 0;
+}
+
+static void metadata_index_finish(Qcow2MetadataIndex *idx, int types)
+{
+    uint64_t max_end = 0;
+    int i;
+
+    qsort(idx->ranges, idx->nb_ranges, sizeof(idx->ranges[0]),
+          metadata_range_cmp);
+    for (i = 0; i < idx->nb_ranges; i++) {
+        max_end = MAX(max_end, idx->ranges[i].end);
+        idx->ranges[i].max_end = max_end;
+    }
+    idx->types = types;
+    idx->valid = true;
+}
+
+static int metadata_index_build_active(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2MetadataIndex *idx = &s->ol_active;
+    size_t count = 0;
+    int i;
+
+    metadata_index_free(idx);
+    if (s->l1_table) {
+        count += s->l1_size;
+    }
+    if (s->refcount_table) {
+        count += s->refcount_table_size;
+    }
+    idx->ranges = g_try_new(Qcow2MetadataRange, count);
+    if (count && idx->ranges == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; s->l1_table && i < s->l1_size; i++) {
+        uint64_t l2_ofs = s->l1_table[i] & L1E_OFFSET_MASK;
+        if (l2_ofs) {
+            metadata_index_add(idx, l2_ofs, s->cluster_size,
+                               QCOW2_OL_ACTIVE_L2, i);
+        }
+    }
+    for (i = 0; s->refcount_table && i < s->refcount_table_size; i++) {
+        uint64_t rb_ofs = s->refcount_table[i] & REFT_OFFSET_MASK;
+        if (rb_ofs) {
+            metadata_index_add(idx, rb_ofs, s->cluster_size,
+                               QCOW2_OL_REFCOUNT_BLOCK, i);
+        }
+    }
+
+    metadata_index_finish(idx, QCOW2_OL_ACTIVE_L2 | QCOW2_OL_REFCOUNT_BLOCK);
+    return 0;
+}
+
+static int metadata_index_build_snapshots(BlockDriverState *bs, int types)
+{
+    BDRVQcow2State *s = bs->opaque;
+    /* Reading the L1 tables yields, so build the index on the side */
+    Qcow2MetadataIndex new_idx = { .valid = false }, *idx = &new_idx;
+    size_t count = 0;
+    int i, j, ret;
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        count++;
+        if (types & QCOW2_OL_INACTIVE_L2) {
+            count += s->snapshots[i].l1_size;
+        }
+    }
+    idx->ranges = g_try_new(Qcow2MetadataRange, count);
+    if (count && idx->ranges == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
+        uint32_t l1_sz  = s->snapshots[i].l1_size;
+        uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
+        uint64_t *l1;
+
+        if (l1_sz && (types & QCOW2_OL_INACTIVE_L1)) {
+            metadata_index_add(idx, l1_ofs, l1_sz2, QCOW2_OL_INACTIVE_L1, i);
+        }
+        if (!(types & QCOW2_OL_INACTIVE_L2) || !l1_sz) {
+            continue;
+        }
+
+        l1 = g_try_malloc(l1_sz2);
+        if (l1 == NULL) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
+        if (ret < 0) {
+            g_free(l1);
+            goto fail;
+        }
+        for (j = 0; j < l1_sz; j++) {
+            uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
+            if (l2_ofs) {
+                metadata_index_add(idx, l2_ofs, s->cluster_size,
+                                   QCOW2_OL_INACTIVE_L2, i);
+            }
+        }
+        g_free(l1);
+    }
+
+    metadata_index_finish(idx, types);
+    metadata_index_free(&s->ol_snapshots);
+    s->ol_snapshots = new_idx;
+    return 0;
+
+fail:
+    metadata_index_free(idx);
+    return ret;
+}
+
+/* Returns false if the table entry that @r was built from has changed */
+static bool metadata_range_current(BDRVQcow2State *s,
+                                   const Qcow2MetadataRange *r)
+{
+    switch (r->type) {
+    case QCOW2_OL_ACTIVE_L2:
+        return s->l1_table && r->index < s->l1_size &&
+               (s->l1_table[r->index] & L1E_OFFSET_MASK) == r->start;
+    case QCOW2_OL_REFCOUNT_BLOCK:
+        return s->refcount_table && r->index < s->refcount_table_size &&
+               (s->refcount_table[r->index] & REFT_OFFSET_MASK) == r->start;
+    default:
+        return r->index < s->nb_snapshots;
+    }
+}
+
+/*
+ * Returns the type of a range in @idx that is selected by @chk and
+ * overlaps with [@offset, @offset + @size), or 0 if there is none.
+ */
+static int metadata_index_find(BDRVQcow2State *s, Qcow2MetadataIndex *idx,
+                               int chk, int64_t offset, int64_t size)
+{
+    uint64_t end = offset + size;
+    int lo = 0, hi = idx->nb_ranges;
+    int i;
+
+    /* Find the first range that starts at or after the end of the request */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (idx->ranges[mid].start < end) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* All earlier ranges end at or before ranges[i].max_end */
+    for (i = lo - 1; i >= 0 && idx->ranges[i].max_end > offset; i--) {
+        Qcow2MetadataRange *r = &idx->ranges[i];
+
+        if ((r->type & chk) && r->end > offset &&
+            metadata_range_current(s, r)) {
+            return r->type;
+        }
+    }
+    return 0;
+}
+
 /*
  * Checks if the given offset into the image file is actually free to use by
  * looking for overlaps with important metadata sections (L1/L2 tables etc.),
@@ -2327,7 +2828,8 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
 {
     BDRVQcow2State *s = bs->opaque;
     int chk = s->overlap_check & ~ign;
-    int i, j;
+    int snapshot_types;
+    int ret;
 
     if (!size) {
         return 0;
@@ -2362,63 +2864,31 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
-    if ((chk & QCOW2_OL_INACTIVE_L1) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            if (s->snapshots[i].l1_size &&
-                overlaps_with(s->snapshots[i].l1_table_offset,
-                s->snapshots[i].l1_size * sizeof(uint64_t))) {
-                return QCOW2_OL_INACTIVE_L1;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_ACTIVE_L2) && s->l1_table) {
-        for (i = 0; i < s->l1_size; i++) {
-            if ((s->l1_table[i] & L1E_OFFSET_MASK) &&
-                overlaps_with(s->l1_table[i] & L1E_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_ACTIVE_L2;
+    if (chk & (QCOW2_OL_ACTIVE_L2 | QCOW2_OL_REFCOUNT_BLOCK)) {
+        if (!s->ol_active.valid) {
+            ret = metadata_index_build_active(bs);
+            if (ret < 0) {
+                return ret;
             }
         }
-    }
-
-    if ((chk & QCOW2_OL_REFCOUNT_BLOCK) && s->refcount_table) {
-        for (i = 0; i < s->refcount_table_size; i++) {
-            if ((s->refcount_table[i] & REFT_OFFSET_MASK) &&
-                overlaps_with(s->refcount_table[i] & REFT_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_REFCOUNT_BLOCK;
-            }
+        ret = metadata_index_find(s, &s->ol_active, chk, offset, size);
+        if (ret) {
+            return ret;
         }
     }
 
-    if ((chk & QCOW2_OL_INACTIVE_L2) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
-            uint32_t l1_sz  = s->snapshots[i].l1_size;
-            uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
-            uint64_t *l1 = g_try_malloc(l1_sz2);
-            int ret;
-
-            if (l1_sz2 && l1 == NULL) {
-                return -ENOMEM;
-            }
-
-            ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
+    snapshot_types = chk & QCOW2_OL_INACTIVE;
+    if (snapshot_types && s->snapshots) {
+        if (!s->ol_snapshots.valid ||
+            (snapshot_types & ~s->ol_snapshots.types)) {
+            ret = metadata_index_build_snapshots(bs, snapshot_types);
             if (ret < 0) {
-                g_free(l1);
                 return ret;
             }
-
-            for (j = 0; j < l1_sz; j++) {
-                uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
-                if (l2_ofs && overlaps_with(l2_ofs, s->cluster_size)) {
-                    g_free(l1);
-                    return QCOW2_OL_INACTIVE_L2;
-                }
-            }
-
-            g_free(l1);
+        }
+        ret = metadata_index_find(s, &s->ol_snapshots, chk, offset, size);
+        if (ret) {
+            return ret;
         }
     }
 
@@ -2871,6 +3341,8 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     /* Now update the rest of the in-memory information */
     old_reftable = s->refcount_table;
     s->refcount_table = new_reftable;
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_REFCOUNT_BLOCK);
+    qcow2_free_map_reset(bs);
 
     s->refcount_bits = 1 << refcount_order;
     s->refcount_max = UINT64_C(1) << (s->refcount_bits - 1);
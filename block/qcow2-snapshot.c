@@ -42,6 +42,7 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     g_free(s->snapshots);
     s->snapshots = NULL;
     s->nb_snapshots = 0;
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_INACTIVE);
 }
 
 int qcow2_read_snapshots(BlockDriverState *bs)
@@ -63,6 +64,7 @@ int qcow2_read_snapshots(BlockDriverState *bs)
 
     offset = s->snapshots_offset;
     s->snapshots = g_new0(QCowSnapshot, s->nb_snapshots);
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_INACTIVE);
 
     for(i = 0; i < s->nb_snapshots; i++) {
         /* Read statically sized part of the snapshot header */
@@ -363,6 +365,12 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -EEXIST;
     }
 
+    /* The dirty L2 log cannot describe the refcount changes below */
+    ret = qcow2_dirty_log_invalidate(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Populate sn with passed data */
     sn->id_str = g_strdup(sn_info->id_str);
     sn->name = g_strdup(sn_info->name);
@@ -427,12 +435,14 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     }
     s->snapshots = new_snapshot_list;
     s->snapshots[s->nb_snapshots++] = *sn;
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_INACTIVE);
 
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         g_free(s->snapshots);
         s->snapshots = old_snapshot_list;
         s->nb_snapshots--;
+        qcow2_metadata_index_invalidate(bs, QCOW2_OL_INACTIVE);
         goto fail;
     }
 
@@ -485,6 +495,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto fail;
     }
 
+    ret = qcow2_dirty_log_invalidate(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /*
      * Make sure that the current L1 table is big enough to contain the whole
      * L1 table of the snapshot. If the snapshot L1 table is smaller, the
@@ -556,6 +571,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_ACTIVE_L2);
 
     if (ret < 0) {
         goto fail;
@@ -603,11 +619,18 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
     }
     sn = s->snapshots[snapshot_index];
 
+    ret = qcow2_dirty_log_invalidate(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update qcow2 header");
+        return ret;
+    }
+
     /* Remove it from the snapshot list */
     memmove(s->snapshots + snapshot_index,
             s->snapshots + snapshot_index + 1,
             (s->nb_snapshots - snapshot_index - 1) * sizeof(sn));
     s->nb_snapshots--;
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_INACTIVE);
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
@@ -734,6 +757,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_ACTIVE_L2);
 
     return 0;
 }
@@ -25,7 +25,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -63,6 +62,8 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
+#define  QCOW2_EXT_MAGIC_DIRTY_LOG 0x6c2d1e9b
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -162,6 +163,131 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS: {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid extension "
+                           "size");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                error_report("Warning: a program lacking bitmap support "
+                             "modified this file, so all bitmaps are now "
+                             "considered inconsistent");
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Image has %" PRIu32 " bitmaps, exceeding the QEMU "
+                           "supported maximum of %d",
+                           bitmaps_ext.nb_bitmaps, QCOW2_MAX_BITMAPS);
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps == 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "found bitmaps extension with zero bitmaps");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_offset & (s->cluster_size - 1)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "invalid bitmap directory offset");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "bitmap directory size (%" PRIu64 ") exceeds "
+                           "the maximum supported size (%d)",
+                           bitmaps_ext.bitmap_directory_size,
+                           QCOW2_MAX_BITMAP_DIRECTORY_SIZE);
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_offset =
+                    bitmaps_ext.bitmap_directory_offset;
+            s->bitmap_directory_size =
+                    bitmaps_ext.bitmap_directory_size;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got bitmaps extension: "
+                   "offset=%" PRIu64 " nb_bitmaps=%" PRIu32 "\n",
+                   s->bitmap_directory_offset, s->nb_bitmaps);
+#endif
+            break;
+        }
+
+        case QCOW2_EXT_MAGIC_DIRTY_LOG: {
+            Qcow2DirtyLogHeaderExt log_ext;
+
+            if (ext.len != sizeof(log_ext)) {
+                error_setg(errp, "ERROR: dirty_log_ext: Invalid extension "
+                           "size");
+                return -EINVAL;
+            }
+
+            /* Without the autoclear bit, the log may not cover all changes
+             * and its clusters may even have been reused; drop it */
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG)) {
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &log_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: dirty_log_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            be64_to_cpus(&log_ext.log_offset);
+            be64_to_cpus(&log_ext.log_size);
+
+            if (!log_ext.log_offset ||
+                (log_ext.log_offset & (s->cluster_size - 1)) ||
+                !log_ext.log_size ||
+                (log_ext.log_size & (s->cluster_size - 1)) ||
+                log_ext.log_size > QCOW_MAX_L1_SIZE ||
+                log_ext.log_offset > INT64_MAX - log_ext.log_size) {
+                error_setg(errp, "ERROR: dirty_log_ext: "
+                           "Invalid dirty L2 log location");
+                return -EINVAL;
+            }
+
+            g_free(s->dirty_log);
+            s->dirty_log = g_try_malloc0(log_ext.log_size);
+            if (!s->dirty_log) {
+                error_setg(errp, "ERROR: dirty_log_ext: "
+                           "Could not allocate dirty L2 log");
+                return -ENOMEM;
+            }
+            s->dirty_log_offset = log_ext.log_offset;
+            s->dirty_log_size = log_ext.log_size;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -264,6 +390,174 @@ int qcow2_mark_dirty(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * Allocates the dirty L2 log if the image does not have one yet and marks it
+ * valid.  Must only be called while the image is clean.
+ */
+static int qcow2_dirty_log_init(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size;
+    int64_t offset;
+    int ret;
+
+    assert(!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY));
+
+    if (s->dirty_log_offset) {
+        if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG) {
+            return 0;
+        }
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_LOG;
+        return qcow2_update_header(bs);
+    }
+
+    /* One bit per L1 entry; if the L1 table grows beyond that, the log is
+     * invalidated and the next repair is a full check */
+    size = ROUND_UP(DIV_ROUND_UP(MAX(s->l1_size, 1), 8), s->cluster_size);
+    s->dirty_log = g_try_malloc0(size);
+    if (!s->dirty_log) {
+        return -ENOMEM;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        ret = offset;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size);
+    if (ret < 0) {
+        goto fail_free;
+    }
+
+    ret = bdrv_pwrite_zeroes(bs->file, offset, size, 0);
+    if (ret < 0) {
+        goto fail_free;
+    }
+
+    /* The header must not point to clusters that are still free on disk */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail_free;
+    }
+
+    s->dirty_log_offset = offset;
+    s->dirty_log_size = size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_LOG;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dirty_log_offset = 0;
+        s->dirty_log_size = 0;
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DIRTY_LOG;
+        goto fail_free;
+    }
+    return 0;
+
+fail_free:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+fail:
+    g_free(s->dirty_log);
+    s->dirty_log = NULL;
+    return ret;
+}
+
+/*
+ * Forgets about the dirty L2 log without freeing its clusters.  The caller
+ * updates the header.
+ */
+static void qcow2_dirty_log_forget(BDRVQcow2State *s)
+{
+    g_free(s->dirty_log);
+    s->dirty_log = NULL;
+    s->dirty_log_offset = 0;
+    s->dirty_log_size = 0;
+    s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DIRTY_LOG;
+}
+
+/*
+ * Makes the next repair of the image a full refcount check, for changes
+ * that the dirty L2 log cannot describe.  The log becomes valid again when
+ * the image is marked clean.
+ */
+int qcow2_dirty_log_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY) ||
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG)) {
+        return 0;
+    }
+
+    s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DIRTY_LOG;
+    ret = qcow2_update_header(bs);
+    if (ret >= 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        /* The header may still say that the log is valid */
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_LOG;
+        return ret;
+    }
+    return 0;
+}
+
+static int coroutine_fn qcow2_dirty_log_do_mark(BlockDriverState *bs,
+                                                uint64_t l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t byte = l1_index / 8;
+    uint8_t bit = 1 << (l1_index % 8);
+    uint64_t sector;
+    int ret;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY) ||
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG)) {
+        /* Either refcounts are accurate or a full check is needed anyway */
+        return 0;
+    }
+
+    if (byte >= s->dirty_log_size) {
+        return qcow2_dirty_log_invalidate(bs);
+    }
+    if (s->dirty_log[byte] & bit) {
+        return 0;
+    }
+
+    s->dirty_log[byte] |= bit;
+    sector = QEMU_ALIGN_DOWN(byte, BDRV_SECTOR_SIZE);
+    ret = bdrv_pwrite(bs->file, s->dirty_log_offset + sector,
+                      s->dirty_log + sector, BDRV_SECTOR_SIZE);
+    if (ret >= 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        s->dirty_log[byte] &= ~bit;
+        return qcow2_dirty_log_invalidate(bs);
+    }
+    return 0;
+}
+
+/*
+ * Records in the dirty L2 log that the L2 table of L1 entry @l1_index is
+ * about to reference clusters whose refcount is not yet on disk.  This must
+ * be called, and be stable, before the L2 table is changed.
+ *
+ * The bit is set in memory before the write and the flush, which both
+ * yield; concurrent callers wait for them instead of taking a bit that is
+ * not on disk yet as a sign that their L2 table is covered.
+ */
+int coroutine_fn qcow2_dirty_log_mark(BlockDriverState *bs, uint64_t l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->dirty_log_lock);
+    ret = qcow2_dirty_log_do_mark(bs, l1_index);
+    qemu_co_mutex_unlock(&s->dirty_log_lock);
+    return ret;
+}
+
 /*
  * Clears the dirty bit and flushes before if necessary.  Only call this
  * function when there are no pending requests, it does not guard against
@@ -283,6 +577,15 @@ static int qcow2_mark_clean(BlockDriverState *bs)
             return ret;
         }
 
+        /* Refcounts are accurate now, start a new dirty L2 log.  Leftover
+         * bits only make the next repair check more tables than needed. */
+        if (s->dirty_log_offset) {
+            bdrv_pwrite_zeroes(bs->file, s->dirty_log_offset,
+                               s->dirty_log_size, 0);
+            memset(s->dirty_log, 0, s->dirty_log_size);
+            s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_LOG;
+        }
+
         return qcow2_update_header(bs);
     }
     return 0;
@@ -451,6 +754,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -521,6 +829,7 @@ static void qcow2_attach_aio_context(BlockDriverState *bs,
 
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
                              uint64_t *l2_cache_size,
+                             uint64_t *l2_cache_entry_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -536,6 +845,17 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     *refcount_cache_size = qemu_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
 
+    *l2_cache_entry_size = qemu_opt_get_size(
+        opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE, s->cluster_size);
+    if (*l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        *l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(*l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two "
+                   "between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        return;
+    }
+
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
             error_setg(errp, QCOW2_OPT_CACHE_SIZE ", " QCOW2_OPT_L2_CACHE_SIZE
@@ -581,6 +901,7 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
@@ -596,7 +917,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -610,15 +931,15 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     }
 
     /* get L2 table/refcount block cache size from command line options */
-    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size,
-                     &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &l2_cache_entry_size,
+                     &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -656,8 +977,11 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -764,6 +1088,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -983,7 +1308,19 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s) && s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries require a cluster size of at "
+                   "least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1083,17 +1420,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file->bs, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    s->cluster_cache_offset = -1;
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -1142,9 +1468,19 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* The bitmaps extension is only valid together with its autoclear bit */
+    if (!s->nb_bitmaps) {
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (!s->dirty_log_offset) {
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DIRTY_LOG;
+    }
+
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        s->autoclear_features != header.autoclear_features)
+    {
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1154,15 +1490,51 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->dirty_log_lock);
+    qemu_co_queue_init(&s->compress_wait_queue);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
         BdrvCheckResult result = {0};
 
-        ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        /* With a valid dirty L2 log, only the L2 tables changed since the
+         * image was last clean need to be looked at */
+        ret = -EINVAL;
+        if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_LOG) {
+            ret = qcow2_check_dirty_log(bs, &result);
+            if (ret == 0) {
+                ret = qcow2_mark_clean(bs);
+            }
+        }
+
+        if (ret < 0) {
+            memset(&result, 0, sizeof(result));
+            ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not repair dirty image");
+                goto fail;
+            }
+        }
+    }
+
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
+        s->use_lazy_refcounts &&
+        !(s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        ret = qcow2_dirty_log_init(bs);
+        if (ret < 0) {
+            error_report("Warning: could not set up the dirty L2 log, "
+                         "crash recovery will check the whole image: %s",
+                         strerror(-ret));
+            ret = 0;
+        }
+    }
+
+    /* Load persistent dirty bitmaps; they are stored again on close */
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only) {
+        ret = qcow2_load_dirty_bitmaps(bs, &local_err);
         if (ret < 0) {
-            error_setg_errno(errp, -ret, "Could not repair dirty image");
+            error_propagate(errp, local_err);
             goto fail;
         }
     }
@@ -1178,6 +1550,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
  fail:
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    g_free(s->dirty_log);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
@@ -1190,8 +1563,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -1392,6 +1763,63 @@ int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
     return n1;
 }
 
+/*
+ * Reads @bytes bytes at @offset_in_cluster of the compressed cluster
+ * described by the L2 entry @l2_entry into @qiov.  Decompression runs in a
+ * worker thread, so this must be called without s->lock held; the buffers
+ * are private to the request so that several compressed clusters can be
+ * read and decompressed in parallel.
+ */
+static coroutine_fn int qcow2_co_preadv_compressed(BlockDriverState *bs,
+                                                   uint64_t l2_entry,
+                                                   int offset_in_cluster,
+                                                   unsigned int bytes,
+                                                   QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret, csize, nb_csectors, sector_offset;
+    uint64_t coffset;
+    uint8_t *buf, *out_buf;
+    struct iovec iov;
+    QEMUIOVector local_qiov;
+
+    coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = csize,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_preadv(bs->file, coffset, csize, &local_qiov, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, bytes);
+
+fail:
+    qemu_vfree(out_buf);
+    g_free(buf);
+
+    return ret;
+}
+
 static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                                         uint64_t bytes, QEMUIOVector *qiov,
                                         int flags)
@@ -1405,7 +1833,7 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    qemu_iovec_init(&hd_qiov, 0);
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1425,8 +1853,8 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
 
         offset_in_cluster = offset_into_cluster(s, offset);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
+        qemu_iovec_destroy(&hd_qiov);
+        qemu_iovec_init_slice(&hd_qiov, qiov, bytes_done, cur_bytes);
 
         switch (ret) {
         case QCOW2_CLUSTER_UNALLOCATED:
@@ -1438,8 +1866,7 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                 if (n1 > 0) {
                     QEMUIOVector local_qiov;
 
-                    qemu_iovec_init(&local_qiov, hd_qiov.niov);
-                    qemu_iovec_concat(&local_qiov, &hd_qiov, 0, n1);
+                    qemu_iovec_init_slice(&local_qiov, &hd_qiov, 0, n1);
 
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
                     qemu_co_mutex_unlock(&s->lock);
@@ -1464,15 +1891,14 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_co_preadv_compressed(bs, cluster_offset,
+                                             offset_in_cluster, cur_bytes,
+                                             &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                                s->cluster_cache + offset_in_cluster,
-                                cur_bytes);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1500,7 +1926,8 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                 }
 
                 assert(cur_bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-                qemu_iovec_reset(&hd_qiov);
+                qemu_iovec_destroy(&hd_qiov);
+                qemu_iovec_init(&hd_qiov, 1);
                 qemu_iovec_add(&hd_qiov, cluster_data, cur_bytes);
             }
 
@@ -1551,6 +1978,44 @@ fail:
     return ret;
 }
 
+/* Check if it's possible to merge a write request with the writing of
+ * the data from the COW regions */
+static bool merge_cow(uint64_t offset, unsigned bytes,
+                      QEMUIOVector *hd_qiov, QCowL2Meta *l2meta)
+{
+    QCowL2Meta *m;
+
+    for (m = l2meta; m != NULL; m = m->next) {
+        /* If both COW regions are empty then there's nothing to merge */
+        if (m->cow_start.nb_bytes == 0 && m->cow_end.nb_bytes == 0) {
+            continue;
+        }
+
+        /* The data (middle) region must be immediately after the
+         * start region */
+        if (m->offset + m->cow_start.offset + m->cow_start.nb_bytes != offset) {
+            continue;
+        }
+
+        /* The end region must be immediately after the data (middle)
+         * region */
+        if (m->offset + m->cow_end.offset != offset + bytes) {
+            continue;
+        }
+
+        /* Make sure that adding both COW regions to the QEMUIOVector
+         * does not exceed IOV_MAX */
+        if (hd_qiov->niov > IOV_MAX - 2) {
+            continue;
+        }
+
+        m->data_qiov = hd_qiov;
+        return true;
+    }
+
+    return false;
+}
+
 static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                          uint64_t bytes, QEMUIOVector *qiov,
                                          int flags)
@@ -1569,8 +2034,6 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (bytes != 0) {
@@ -1633,16 +2096,22 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
             goto fail;
         }
 
-        qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                cluster_offset + offset_in_cluster);
-        ret = bdrv_co_pwritev(bs->file,
-                              cluster_offset + offset_in_cluster,
-                              cur_bytes, &hd_qiov, 0);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0) {
-            goto fail;
+        /* If we need to do COW, check if it's possible to merge the
+         * writing of the guest data together with that of the COW regions.
+         * If it's not possible (or not necessary) then write the
+         * guest data now. */
+        if (!merge_cow(offset, cur_bytes, &hd_qiov, l2meta)) {
+            qemu_co_mutex_unlock(&s->lock);
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    cluster_offset + offset_in_cluster);
+            ret = bdrv_co_pwritev(bs->file,
+                                  cluster_offset + offset_in_cluster,
+                                  cur_bytes, &hd_qiov, 0);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         while (l2meta != NULL) {
@@ -1699,6 +2168,17 @@ static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
+    Error *local_err = NULL;
+
+    ret = qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_report_err(local_err);
+        error_report("Persistent bitmaps are lost for node '%s'",
+                     bdrv_get_device_or_node_name(bs));
+    } else {
+        bdrv_release_persistent_dirty_bitmaps(bs);
+    }
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
@@ -1741,12 +2221,11 @@ static void qcow2_close(BlockDriverState *bs)
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    g_free(s->dirty_log);
 
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1926,11 +2405,26 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DIRTY_LOG_BITNR,
+                .name = "dirty L2 log",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1942,6 +2436,40 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmap extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                    cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                    cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Dirty L2 log extension */
+    if (s->dirty_log_offset) {
+        Qcow2DirtyLogHeaderExt log_header = {
+            .log_offset = cpu_to_be64(s->dirty_log_offset),
+            .log_size   = cpu_to_be64(s->dirty_log_size),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_LOG,
+                             &log_header, sizeof(log_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -2011,18 +2539,13 @@ static int qcow2_change_backing_file(BlockDriverState *bs,
     return qcow2_update_header(bs);
 }
 
-static int preallocate(BlockDriverState *bs)
+static int preallocate(BlockDriverState *bs, uint64_t offset, uint64_t bytes)
 {
-    uint64_t bytes;
-    uint64_t offset;
     uint64_t host_offset = 0;
     unsigned int cur_bytes;
     int ret;
     QCowL2Meta *meta;
 
-    bytes = bdrv_getlength(bs);
-    offset = 0;
-
     while (bytes) {
         cur_bytes = MIN(bytes, INT_MAX);
         ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
@@ -2036,8 +2559,11 @@ static int preallocate(BlockDriverState *bs)
 
             ret = qcow2_alloc_cluster_link_l2(bs, meta);
             if (ret < 0) {
-                qcow2_free_any_clusters(bs, meta->alloc_offset,
-                                        meta->nb_clusters, QCOW2_DISCARD_NEVER);
+                if (!meta->keep_old_clusters) {
+                    qcow2_free_any_clusters(bs, meta->alloc_offset,
+                                            meta->nb_clusters,
+                                            QCOW2_DISCARD_NEVER);
+                }
                 return ret;
             }
 
@@ -2121,6 +2647,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         int refblock_bits, refblock_size;
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
+        /* L2 entry size in bytes */
+        size_t l2es = (flags & BLOCK_FLAG_EXTENDED_L2) ? L2E_SIZE_EXTENDED
+                                                       : L2E_SIZE_NORMAL;
 
         /* see qcow2_open() */
         refblock_bits = cluster_bits - (refcount_order - 3);
@@ -2131,11 +2660,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2es);
+        meta_size += nl2e * l2es;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2es / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -2214,6 +2743,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        header->incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
     if (ret < 0) {
@@ -2289,7 +2822,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     if (prealloc != PREALLOC_MODE_OFF) {
         BDRVQcow2State *s = blk_bs(blk)->opaque;
         qemu_co_mutex_lock(&s->lock);
-        ret = preallocate(blk_bs(blk));
+        ret = preallocate(blk_bs(blk), 0, blk_getlength(blk));
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not preallocate metadata");
@@ -2385,6 +2918,27 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTENDED_L2;
+    }
+
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 "
+                       "or greater)");
+            ret = -EINVAL;
+            goto finish;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto finish;
+        }
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2536,6 +3090,48 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+static int qcow2_preallocate(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes, PreallocMode prealloc,
+                             Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t old_file_size, new_file_size;
+    int ret;
+
+    if (bs->backing) {
+        error_setg(errp, "Backing file and preallocation cannot be used at "
+                   "the same time");
+        return -ENOTSUP;
+    }
+
+    old_file_size = bdrv_getlength(bs->file->bs);
+    if (old_file_size < 0) {
+        error_setg_errno(errp, -old_file_size, "Could not get file size");
+        return old_file_size;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = preallocate(bs, offset, bytes);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not preallocate metadata");
+        return ret;
+    }
+
+    if (prealloc == PREALLOC_MODE_METADATA) {
+        return 0;
+    }
+
+    /* The new clusters were appended to the file; allocate them there too */
+    new_file_size = bdrv_getlength(bs->file->bs);
+    if (new_file_size < 0) {
+        error_setg_errno(errp, -new_file_size, "Could not get file size");
+        return new_file_size;
+    }
+    return bdrv_preallocate(bs->file->bs, old_file_size,
+                            new_file_size - old_file_size, prealloc, errp);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
@@ -2545,8 +3141,8 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     QEMUIOVector hd_qiov;
     struct iovec iov;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
+    int ret;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
 
@@ -2572,38 +3168,18 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
 
     out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
         if (ret < 0) {
             goto fail;
         }
         goto success;
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     }
 
     qemu_co_mutex_lock(&s->lock);
@@ -2670,6 +3246,13 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    /* ...and so will be the dirty L2 log, whose clusters are dropped */
+    ret = qcow2_dirty_log_invalidate(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+    qcow2_dirty_log_forget(s);
+
     BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
@@ -2684,6 +3267,7 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail_broken_refcounts;
     }
     memset(s->l1_table, 0, l1_size2);
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_ACTIVE_L2);
 
     BLKDBG_EVENT(bs->file, BLKDBG_EMPTY_IMAGE_PREPARE);
 
@@ -2748,6 +3332,8 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail_broken_refcounts;
     }
     s->refcount_table[0] = 2 * s->cluster_size;
+    qcow2_metadata_index_invalidate(bs, QCOW2_OL_REFCOUNT_BLOCK);
+    qcow2_free_map_reset(bs);
 
     s->free_cluster_index = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
@@ -2772,6 +3358,11 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    /* Without a log, repairing the image just takes a full check */
+    if (s->use_lazy_refcounts) {
+        qcow2_dirty_log_init(bs);
+    }
+
     return 0;
 
 fail_broken_refcounts:
@@ -2797,13 +3388,14 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
-    if (s->qcow_version >= 3 && !s->snapshots &&
+    if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
-         * the dirty flag) and only as long as there are no snapshots (because
-         * it completely empties the image). Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one refcount
-         * block) have to fit inside one refcount block. */
+         * the dirty flag) and only as long as there are no snapshots or
+         * stored bitmaps (because it completely empties the image).
+         * Furthermore, the L1 table and three additional clusters (image
+         * header, refcount table, one refcount block) have to fit inside one
+         * refcount block. */
         return make_completely_empty(bs);
     }
 
@@ -2887,6 +3479,8 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -2897,6 +3491,24 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+    BlockStatsSpecificQcow2 *qcow2_stats = g_new0(BlockStatsSpecificQcow2, 1);
+
+    qcow2_stats->l2_cache = g_new0(Qcow2CacheStats, 1);
+    qcow2_stats->refcount_cache = g_new0(Qcow2CacheStats, 1);
+    qcow2_cache_get_stats(s->l2_table_cache, qcow2_stats->l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          qcow2_stats->refcount_cache);
+
+    stats->type = BLOCK_STATS_SPECIFIC_KIND_QCOW2;
+    stats->u.qcow2.data = qcow2_stats;
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2962,6 +3574,17 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        error_report("Cannot downgrade an image with extended L2 entries");
+        return -ENOTSUP;
+    }
+
+    if (s->nb_bitmaps) {
+        error_report("Cannot downgrade an image with persistent dirty "
+                     "bitmaps");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -2983,7 +3606,13 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
     /* if lazy refcounts have been used, they have already been fixed through
      * clearing the dirty flag */
 
-    /* clearing autoclear features is trivial */
+    /* clearing autoclear features is trivial; the dirty L2 log can go as
+     * well now that the image is clean */
+    if (s->dirty_log_offset) {
+        qcow2_free_clusters(bs, s->dirty_log_offset, s->dirty_log_size,
+                            QCOW2_DISCARD_NEVER);
+        qcow2_dirty_log_forget(s);
+    }
     s->autoclear_features = 0;
 
     ret = qcow2_expand_zero_clusters(bs, status_cb, cb_opaque);
@@ -3130,6 +3759,12 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                 error_report("Changing the cluster size is not supported");
                 return -ENOTSUP;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                  has_subclusters(s)) != has_subclusters(s)) {
+                error_report("Changing extended L2 entries is not supported");
+                return -ENOTSUP;
+            }
         } else if (!strcmp(desc->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             lazy_refcounts = qemu_opt_get_bool(opts, BLOCK_OPT_LAZY_REFCOUNTS,
                                                lazy_refcounts);
@@ -3213,6 +3848,10 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                 s->compatible_features &= ~QCOW2_COMPAT_LAZY_REFCOUNTS;
                 return ret;
             }
+            ret = qcow2_dirty_log_init(bs);
+            if (ret < 0) {
+                return ret;
+            }
             s->use_lazy_refcounts = true;
         } else {
             /* make image clean first */
@@ -3355,6 +3994,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables with 32 subclusters per cluster",
+            .def_value_str = "off"
+        },
         { /* end of list */ }
     }
 };
@@ -3381,6 +4026,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_pwrite_zeroes  = qcow2_co_pwrite_zeroes,
     .bdrv_co_pdiscard       = qcow2_co_pdiscard,
     .bdrv_truncate          = qcow2_truncate,
+    .bdrv_preallocate       = qcow2_preallocate,
     .bdrv_co_pwritev_compressed = qcow2_co_pwritev_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
@@ -3391,6 +4037,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -3408,6 +4055,8 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_detach_aio_context  = qcow2_detach_aio_context,
     .bdrv_attach_aio_context  = qcow2_attach_aio_context,
+
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
 };
 
 static void bdrv_qcow2_init(void)
@@ -27,12 +27,15 @@
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
 #include "qemu/log.h"
+#include "qemu/thread.h"
+#include "qemu/obj-pool.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "block/shared-cache.h"
 #include "qapi/util.h"
 #include "qapi/qmp/qstring.h"
 
@@ -56,6 +59,7 @@
 #ifdef __linux__
 #include <sys/ioctl.h>
 #include <sys/param.h>
+#include <sys/syscall.h>
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
@@ -144,8 +148,12 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
+    bool use_linux_io_uring:1;
     bool has_fallocate;
     bool needs_alignment;
+
+    /* Only for read-only nodes */
+    SharedCache *shared_cache;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -168,6 +176,9 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    /* Destination of QEMU_AIO_COPY_RANGE */
+    int aio_fd2;
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -393,6 +404,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
         },
+        {
+            .name = "shared-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the read cache shared with other processes "
+                    "(read-only images only)",
+        },
         { /* end of list */ }
     },
 };
@@ -405,6 +422,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     Error *local_err = NULL;
     const char *filename = NULL;
     BlockdevAioOptions aio, aio_default;
+    uint64_t shared_cache_size;
     int fd, ret;
     struct stat st;
 
@@ -435,6 +453,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
 
     s->open_flags = open_flags;
     raw_parse_flags(bdrv_flags, &s->open_flags);
@@ -467,6 +486,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifndef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
@@ -519,6 +547,18 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+    /* A writable image could change under the other users of the cache */
+    shared_cache_size = qemu_opt_get_size(opts, "shared-cache-size", 0);
+    if (shared_cache_size && !(bdrv_flags & BDRV_O_RDWR)) {
+        s->shared_cache = shared_cache_open(s->fd, shared_cache_size,
+                                            &local_err);
+        if (!s->shared_cache) {
+            error_propagate(errp, local_err);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     ret = 0;
 fail:
     if (filename && (bdrv_flags & BDRV_O_TEMPORARY)) {
@@ -628,6 +668,11 @@ static void raw_reopen_commit(BDRVReopenState *state)
     qemu_close(s->fd);
     s->fd = raw_s->fd;
 
+    if ((state->flags & BDRV_O_RDWR) && s->shared_cache) {
+        shared_cache_close(s->shared_cache);
+        s->shared_cache = NULL;
+    }
+
     g_free(state->opaque);
     state->opaque = NULL;
 }
@@ -1146,6 +1191,55 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifndef CONFIG_COPY_FILE_RANGE
+static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
+                             off_t *out_off, size_t len, unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, in_fd, in_off, out_fd,
+                   out_off, len, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+
+    while (bytes) {
+        ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
+                                      aiocb->aio_fd2, &out_off,
+                                      bytes, 0);
+        if (ret == 0) {
+            /* No progress, e.g. beyond the end of the source file; let
+             * the caller fall back to reading and writing the data */
+            return -ENOTSUP;
+        }
+        if (ret < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case ENOSYS:
+            case EXDEV:
+            case EINVAL:
+            case EBADF:
+            case EOPNOTSUPP:
+                /* Different file systems, or not a regular file */
+                return -ENOTSUP;
+            default:
+                return -errno;
+            }
+        }
+        bytes -= ret;
+    }
+    return 0;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -1186,21 +1280,33 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
         break;
     }
 
-    g_free(aiocb);
+    obj_pool_free(aiocb);
     return ret;
 }
 
+/* Allocated in the AioContext's thread, freed by the thread pool worker */
+static ObjPool raw_aio_data_pool =
+    OBJ_POOL_INITIALIZER(sizeof(RawPosixAIOData), 64);
+
+static RawPosixAIOData *raw_aio_data_new(void)
+{
+    return obj_pool_alloc(&raw_aio_data_pool, sizeof(RawPosixAIOData));
+}
+
 static int paio_submit_co(BlockDriverState *bs, int fd,
                           int64_t offset, QEMUIOVector *qiov,
                           int count, int type)
 {
-    RawPosixAIOData *acb = g_new(RawPosixAIOData, 1);
+    RawPosixAIOData *acb = raw_aio_data_new();
     ThreadPool *pool;
 
     acb->bs = bs;
@@ -1225,7 +1331,7 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t offset, QEMUIOVector *qiov, int count,
         BlockCompletionFunc *cb, void *opaque, int type)
 {
-    RawPosixAIOData *acb = g_new(RawPosixAIOData, 1);
+    RawPosixAIOData *acb = raw_aio_data_new();
     ThreadPool *pool;
 
     acb->bs = bs;
@@ -1272,13 +1378,84 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring handles buffered I/O too; fall back to the thread pool
+     * if the ring cannot be set up on this host.  */
+    if (s->use_linux_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            assert(qiov->size == bytes);
+            return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        }
+    }
+#endif
+
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
 }
 
+/* Larger reads are most likely streaming and would only thrash the cache */
+#define SHARED_CACHE_MAX_REQUEST (16 * SHARED_CACHE_CHUNK_SIZE)
+
+/*
+ * Serve a read from the shared cache.  Misses read the whole chunk from
+ * the file and insert it, so that other processes benefit as well.
+ */
+static int coroutine_fn raw_co_preadv_cached(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov)
+{
+    BDRVRawState *s = bs->opaque;
+    QEMUIOVector chunk_qiov;
+    struct iovec iov;
+    uint8_t *buf = NULL;
+    size_t qiov_offset = 0;
+    int ret = 0;
+
+    while (qiov_offset < bytes) {
+        uint64_t chunk = QEMU_ALIGN_DOWN(offset, SHARED_CACHE_CHUNK_SIZE);
+        size_t n = MIN(bytes - qiov_offset,
+                       chunk + SHARED_CACHE_CHUNK_SIZE - offset);
+
+        if (!shared_cache_lookup(s->shared_cache, offset, qiov,
+                                 qiov_offset, n)) {
+            if (!buf) {
+                buf = qemu_try_blockalign(bs, SHARED_CACHE_CHUNK_SIZE);
+                if (!buf) {
+                    ret = -ENOMEM;
+                    break;
+                }
+            }
+            /* Reads beyond the end of the file return zeroes */
+            iov = (struct iovec) {
+                .iov_base = buf,
+                .iov_len = SHARED_CACHE_CHUNK_SIZE,
+            };
+            qemu_iovec_init_external(&chunk_qiov, &iov, 1);
+            ret = raw_co_prw(bs, chunk, SHARED_CACHE_CHUNK_SIZE, &chunk_qiov,
+                             QEMU_AIO_READ);
+            if (ret < 0) {
+                break;
+            }
+            shared_cache_insert(s->shared_cache, chunk, buf);
+            qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - chunk), n);
+        }
+        offset += n;
+        qiov_offset += n;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
 static int coroutine_fn raw_co_preadv(BlockDriverState *bs, uint64_t offset,
                                       uint64_t bytes, QEMUIOVector *qiov,
                                       int flags)
 {
+    BDRVRawState *s = bs->opaque;
+
+    if (s->shared_cache && bytes <= SHARED_CACHE_MAX_REQUEST) {
+        return raw_co_preadv_cached(bs, offset, bytes, qiov);
+    }
     return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_READ);
 }
 
@@ -1290,43 +1467,128 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
     return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               BdrvChild *src,
+                                               int64_t src_offset,
+                                               BdrvChild *dst,
+                                               int64_t dst_offset,
+                                               int bytes,
+                                               BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                 bytes, flags);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BdrvChild *src,
+                                             int64_t src_offset,
+                                             BdrvChild *dst,
+                                             int64_t dst_offset,
+                                             int bytes,
+                                             BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+
+    assert(dst->bs == bs);
+    if (src->bs->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+    src_s = src->bs->opaque;
+
+    if (fd_open(src->bs) < 0 || fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    acb = raw_aio_data_new();
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_offset;
+    acb->aio_fd2 = s->fd;
+    acb->aio_offset2 = dst_offset;
+    acb->aio_nbytes = bytes;
+
+    trace_paio_submit_co(dst_offset, bytes, QEMU_AIO_COPY_RANGE);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            luring_io_unplug(bs, aio);
+        }
+    }
+#endif
 }
 
-static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
-        BlockCompletionFunc *cb, void *opaque)
+static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+    int ret;
 
-    if (fd_open(bs) < 0)
-        return NULL;
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+#ifdef CONFIG_LINUX_IO_URING
+    /* The ring can do the fdatasync as well */
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        }
+    }
+#endif
+
+    return paio_submit_co(bs, s->fd, 0, NULL, 0, QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    if (s->shared_cache) {
+        shared_cache_close(s->shared_cache);
+        s->shared_cache = NULL;
+    }
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1537,6 +1799,156 @@ static int64_t raw_get_allocated_file_size(BlockDriverState *bs)
     return (int64_t)st.st_blocks * 512;
 }
 
+/* Full preallocation splits the range between several writer threads;
+ * each one covers at least RAW_PREALLOC_SLICE bytes. */
+#define RAW_PREALLOC_THREADS    8
+#define RAW_PREALLOC_SLICE      (64 * 1024 * 1024)
+#define RAW_PREALLOC_CHUNK      (1024 * 1024)
+
+typedef struct RawPreallocJob {
+    QemuThread thread;
+    int fd;
+    const void *buf;
+    int64_t offset;
+    int64_t end;
+    int ret;
+} RawPreallocJob;
+
+static void *raw_prealloc_thread(void *opaque)
+{
+    RawPreallocJob *job = opaque;
+    int64_t offset = job->offset;
+
+    while (offset < job->end) {
+        ssize_t n = pwrite(job->fd, job->buf,
+                           MIN(job->end - offset, RAW_PREALLOC_CHUNK), offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            job->ret = -errno;
+            break;
+        }
+        offset += n;
+    }
+    return NULL;
+}
+
+/* Write zeroes to @bytes bytes at @offset so that the space is really
+ * allocated, even on thinly provisioned storage. */
+static int raw_zero_fill(int fd, int64_t offset, int64_t bytes, Error **errp)
+{
+    RawPreallocJob *jobs;
+    void *buf;
+    int64_t slice;
+    int i, nr_jobs, ret = 0;
+
+#ifdef BLKZEROOUT
+    struct stat st;
+
+    /* The kernel offloads this to WRITE SAME when the device supports it */
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        uint64_t range[2] = { offset, bytes };
+
+        do {
+            if (ioctl(fd, BLKZEROOUT, range) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+        if (translate_err(-errno) != -ENOTSUP) {
+            ret = -errno;
+            error_setg_errno(errp, -ret, "Could not zero the device");
+            return ret;
+        }
+    }
+#endif
+
+#ifdef CONFIG_FALLOCATE
+    /* Reserving the whole range first lets the filesystem pick large
+     * extents even though several threads write to it at the same time.
+     * Failure is harmless, the writes below allocate the space anyway. */
+    do_fallocate(fd, 0, offset, bytes);
+#endif
+
+    nr_jobs = MIN(RAW_PREALLOC_THREADS,
+                  MAX(1, DIV_ROUND_UP(bytes, RAW_PREALLOC_SLICE)));
+    slice = ROUND_UP(DIV_ROUND_UP(bytes, nr_jobs), RAW_PREALLOC_CHUNK);
+
+    buf = qemu_memalign(getpagesize(), RAW_PREALLOC_CHUNK);
+    memset(buf, 0, RAW_PREALLOC_CHUNK);
+    jobs = g_new0(RawPreallocJob, nr_jobs);
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i].fd = fd;
+        jobs[i].buf = buf;
+        jobs[i].offset = offset + MIN(bytes, i * slice);
+        jobs[i].end = offset + MIN(bytes, (i + 1) * slice);
+        qemu_thread_create(&jobs[i].thread, "raw-prealloc",
+                           raw_prealloc_thread, &jobs[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nr_jobs; i++) {
+        qemu_thread_join(&jobs[i].thread);
+        if (jobs[i].ret < 0 && ret == 0) {
+            ret = jobs[i].ret;
+        }
+    }
+    g_free(jobs);
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write to the new file");
+        return ret;
+    }
+    if (fsync(fd) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not flush new file to disk");
+    }
+    return ret;
+}
+
+static int raw_preallocate_fd(int fd, int64_t offset, int64_t bytes,
+                              PreallocMode prealloc, Error **errp)
+{
+    int ret = 0;
+
+    switch (prealloc) {
+#ifdef CONFIG_POSIX_FALLOCATE
+    case PREALLOC_MODE_FALLOC:
+        /* posix_fallocate() doesn't set errno. */
+        ret = -posix_fallocate(fd, offset, bytes);
+        if (ret != 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not preallocate data for the new file");
+        }
+        break;
+#endif
+    case PREALLOC_MODE_FULL:
+        ret = raw_zero_fill(fd, offset, bytes, errp);
+        break;
+    case PREALLOC_MODE_OFF:
+        break;
+    default:
+        ret = -ENOTSUP;
+        error_setg(errp, "Unsupported preallocation mode: %s",
+                   PreallocMode_lookup[prealloc]);
+        break;
+    }
+    return ret;
+}
+
+static int raw_preallocate(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, PreallocMode prealloc, Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->open_flags & O_DIRECT) {
+        error_setg(errp, "Preallocation is not supported with "
+                   "cache.direct=on");
+        return -ENOTSUP;
+    }
+    return raw_preallocate_fd(s->fd, offset, bytes, prealloc, errp);
+}
+
 static int raw_create(const char *filename, QemuOpts *opts, Error **errp)
 {
     int fd;
@@ -1593,52 +2005,7 @@ static int raw_create(const char *filename, QemuOpts *opts, Error **errp)
         goto out_close;
     }
 
-    switch (prealloc) {
-#ifdef CONFIG_POSIX_FALLOCATE
-    case PREALLOC_MODE_FALLOC:
-        /* posix_fallocate() doesn't set errno. */
-        result = -posix_fallocate(fd, 0, total_size);
-        if (result != 0) {
-            error_setg_errno(errp, -result,
-                             "Could not preallocate data for the new file");
-        }
-        break;
-#endif
-    case PREALLOC_MODE_FULL:
-    {
-        int64_t num = 0, left = total_size;
-        buf = g_malloc0(65536);
-
-        while (left > 0) {
-            num = MIN(left, 65536);
-            result = write(fd, buf, num);
-            if (result < 0) {
-                result = -errno;
-                error_setg_errno(errp, -result,
-                                 "Could not write to the new file");
-                break;
-            }
-            left -= result;
-        }
-        if (result >= 0) {
-            result = fsync(fd);
-            if (result < 0) {
-                result = -errno;
-                error_setg_errno(errp, -result,
-                                 "Could not flush new file to disk");
-            }
-        }
-        g_free(buf);
-        break;
-    }
-    case PREALLOC_MODE_OFF:
-        break;
-    default:
-        result = -EINVAL;
-        error_setg(errp, "Unsupported preallocation mode: %s",
-                   PreallocMode_lookup[prealloc]);
-        break;
-    }
+    result = raw_preallocate_fd(fd, 0, total_size, prealloc, errp);
 
 out_close:
     if (qemu_close(fd) != 0 && result == 0) {
@@ -1869,17 +2236,21 @@ BlockDriver bdrv_file = {
     .bdrv_create = raw_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
+    .cache_block_status = true,
     .bdrv_co_pwrite_zeroes = raw_co_pwrite_zeroes,
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_aio_pdiscard = raw_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
 
     .bdrv_truncate = raw_truncate,
+    .bdrv_preallocate = raw_preallocate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
     .bdrv_get_allocated_file_size
@@ -2191,7 +2562,7 @@ static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
-    acb = g_new(RawPosixAIOData, 1);
+    acb = raw_aio_data_new();
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = s->fd;
@@ -2254,6 +2625,9 @@ static int hdev_create(const char *filename, QemuOpts *opts,
     struct stat stat_buf;
     int64_t total_size = 0;
     bool has_prefix;
+    PreallocMode prealloc;
+    char *buf;
+    Error *local_err = NULL;
 
     /* This function is used by both protocol block drivers and therefore either
      * of these prefixes may be given.
@@ -2274,6 +2648,20 @@ static int hdev_create(const char *filename, QemuOpts *opts,
     /* Read out options */
     total_size = ROUND_UP(qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0),
                           BDRV_SECTOR_SIZE);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
+    prealloc = qapi_enum_parse(PreallocMode_lookup, buf,
+                               PREALLOC_MODE__MAX, PREALLOC_MODE_OFF,
+                               &local_err);
+    g_free(buf);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -EINVAL;
+    }
+    if (prealloc != PREALLOC_MODE_OFF && prealloc != PREALLOC_MODE_FULL) {
+        error_setg(errp, "Unsupported preallocation mode for devices: %s",
+                   PreallocMode_lookup[prealloc]);
+        return -ENOTSUP;
+    }
 
     fd = qemu_open(filename, O_WRONLY | O_BINARY);
     if (fd < 0) {
@@ -2292,6 +2680,8 @@ static int hdev_create(const char *filename, QemuOpts *opts,
     } else if (lseek(fd, 0, SEEK_END) < total_size) {
         error_setg(errp, "Device is too small");
         ret = -ENOSPC;
+    } else if (prealloc == PREALLOC_MODE_FULL) {
+        ret = raw_preallocate_fd(fd, 0, total_size, prealloc, errp);
     }
 
     qemu_close(fd);
@@ -2316,13 +2706,14 @@ static BlockDriver bdrv_host_device = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_aio_pdiscard   = hdev_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
+    .bdrv_preallocate   = raw_preallocate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_info = raw_get_info,
     .bdrv_get_allocated_file_size
@@ -2438,7 +2829,7 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
@@ -2568,7 +2959,7 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
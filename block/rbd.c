@@ -46,6 +46,12 @@
  * leading "\".
  */
 
+/*
+ * LIBRBD_SUPPORTS_IOVEC (rbd_aio_readv/writev) and
+ * LIBRBD_SUPPORTS_WRITE_ZEROES (rbd_aio_write_zeroes) are defined by
+ * librbd.h itself when available.
+ */
+
 /* rbd_aio_discard added in 0.1.2 */
 #if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 2)
 #define LIBRBD_SUPPORTS_DISCARD
@@ -66,7 +72,8 @@ typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
     RBD_AIO_DISCARD,
-    RBD_AIO_FLUSH
+    RBD_AIO_FLUSH,
+    RBD_AIO_WRITE_ZEROES
 } RBDAIOCmd;
 
 typedef struct RBDAIOCB {
@@ -411,6 +418,16 @@ static int qemu_rbd_create(const char *filename, QemuOpts *opts, Error **errp)
  * This aio completion is being called from rbd_finish_bh() and runs in qemu
  * BH context.
  */
+/* Clear the part of a read buffer that librbd did not fill */
+static void qemu_rbd_zero_read(RADOSCB *rcb, int64_t from)
+{
+    if (rcb->buf) {
+        memset(rcb->buf + from, 0, rcb->size - from);
+    } else {
+        qemu_iovec_memset(rcb->acb->qiov, from, 0, rcb->size - from);
+    }
+}
+
 static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
     RBDAIOCB *acb = rcb->acb;
@@ -427,11 +444,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_zero_read(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_zero_read(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -442,7 +459,7 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     g_free(rcb);
 
-    if (acb->cmd == RBD_AIO_READ) {
+    if (acb->cmd == RBD_AIO_READ && acb->bounce) {
         qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
     }
     qemu_vfree(acb->bounce);
@@ -570,6 +587,9 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     bs->read_only = (s->snap != NULL);
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+#endif
 
     qemu_opts_del(opts);
     return 0;
@@ -645,6 +665,18 @@ static int rbd_aio_flush_wrapper(rbd_image_t image,
 #endif
 }
 
+static int rbd_aio_write_zeroes_wrapper(rbd_image_t image,
+                                        uint64_t off,
+                                        uint64_t len,
+                                        rbd_completion_t comp)
+{
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    return rbd_aio_write_zeroes(image, off, len, comp, 0, 0);
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
                                  int64_t off,
                                  QEMUIOVector *qiov,
@@ -665,19 +697,21 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->cmd = cmd;
     acb->qiov = qiov;
     assert(!qiov || qiov->size == size);
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
+    acb->bounce = NULL;
+#ifndef LIBRBD_SUPPORTS_IOVEC
+    /* Without the iovec API, librbd needs one linear buffer */
+    if (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE) {
         acb->bounce = qemu_try_blockalign(bs, qiov->size);
         if (acb->bounce == NULL) {
             goto failed;
         }
     }
+#endif
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (cmd == RBD_AIO_WRITE && acb->bounce) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -695,10 +729,18 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_write(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_read(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
@@ -706,6 +748,9 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     case RBD_AIO_FLUSH:
         r = rbd_aio_flush_wrapper(s->image, c);
         break;
+    case RBD_AIO_WRITE_ZEROES:
+        r = rbd_aio_write_zeroes_wrapper(s->image, off, size, c);
+        break;
     default:
         r = -EINVAL;
     }
@@ -937,6 +982,130 @@ static BlockAIOCB *qemu_rbd_aio_pdiscard(BlockDriverState *bs,
 }
 #endif
 
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+typedef struct RBDCoData {
+    Coroutine *co;
+    int ret;
+} RBDCoData;
+
+static void qemu_rbd_co_cb(void *opaque, int ret)
+{
+    RBDCoData *data = opaque;
+
+    data->ret = ret;
+    qemu_coroutine_enter(data->co);
+}
+
+static int coroutine_fn qemu_rbd_co_pwrite_zeroes(BlockDriverState *bs,
+                                                  int64_t offset, int count,
+                                                  BdrvRequestFlags flags)
+{
+    RBDCoData data = {
+        .co = qemu_coroutine_self(),
+    };
+
+    /* rbd_aio_write_zeroes() deallocates, which is only allowed with
+     * MAY_UNMAP; otherwise let the block layer write a zero buffer */
+    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+        return -ENOTSUP;
+    }
+
+    if (!rbd_start_aio(bs, offset, NULL, count, qemu_rbd_co_cb, &data,
+                       RBD_AIO_WRITE_ZEROES)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+    return data.ret;
+}
+#endif
+
+#ifdef RBD_FEATURE_FAST_DIFF
+/* Returned by the callback to stop rbd_diff_iterate2() early */
+#define QEMU_RBD_EXIT_DIFF_ITERATE2 -9000
+
+typedef struct RBDDiffIterateReq {
+    uint64_t offset;
+    uint64_t bytes;
+    bool exists;
+} RBDDiffIterateReq;
+
+/* Find the length of the extent at @req->offset with the same status */
+static int qemu_rbd_diff_iterate_cb(uint64_t offset, size_t len,
+                                    int exists, void *opaque)
+{
+    RBDDiffIterateReq *req = opaque;
+
+    if (!exists) {
+        /* Only reported for diffs against a snapshot */
+        return 0;
+    }
+    if (!req->exists) {
+        if (offset > req->offset) {
+            /* Started in a hole that ends here */
+            req->bytes = offset - req->offset;
+            return QEMU_RBD_EXIT_DIFF_ITERATE2;
+        }
+        req->exists = true;
+        req->bytes = offset + len - req->offset;
+        return 0;
+    }
+    if (offset > req->offset + req->bytes) {
+        /* Allocated extent followed by a hole */
+        return QEMU_RBD_EXIT_DIFF_ITERATE2;
+    }
+    req->bytes = offset + len - req->offset;
+    return 0;
+}
+
+static int64_t coroutine_fn qemu_rbd_co_get_block_status(
+    BlockDriverState *bs, int64_t sector_num, int nb_sectors, int *pnum,
+    BlockDriverState **file)
+{
+    BDRVRBDState *s = bs->opaque;
+    int64_t status = BDRV_BLOCK_OFFSET_VALID |
+                     (sector_num << BDRV_SECTOR_BITS);
+    uint64_t offset = sector_num << BDRV_SECTOR_BITS;
+    uint64_t bytes = (uint64_t)nb_sectors << BDRV_SECTOR_BITS;
+    RBDDiffIterateReq req = {
+        .offset = offset,
+    };
+    uint64_t features, flags;
+    int r;
+
+    *pnum = nb_sectors;
+    *file = bs;
+
+    /* Without a valid object map each query would read every object */
+    r = rbd_get_features(s->image, &features);
+    if (r < 0 || !(features & RBD_FEATURE_FAST_DIFF)) {
+        return status | BDRV_BLOCK_DATA;
+    }
+    r = rbd_get_flags(s->image, &flags);
+    if (r < 0 || (flags & RBD_FLAG_FAST_DIFF_INVALID)) {
+        return status | BDRV_BLOCK_DATA;
+    }
+
+    /* Include the parent, so that clones report what they read */
+    r = rbd_diff_iterate2(s->image, NULL, offset, bytes, true, true,
+                          qemu_rbd_diff_iterate_cb, &req);
+    if (r < 0 && r != QEMU_RBD_EXIT_DIFF_ITERATE2) {
+        return status | BDRV_BLOCK_DATA;
+    }
+
+    if (!req.exists) {
+        if (!req.bytes) {
+            /* No allocated extent at all */
+            req.bytes = bytes;
+        }
+        status |= BDRV_BLOCK_ZERO;
+    } else {
+        status |= BDRV_BLOCK_DATA;
+    }
+    *pnum = MIN(DIV_ROUND_UP(req.bytes, BDRV_SECTOR_SIZE), nb_sectors);
+    return status;
+}
+#endif
+
 #ifdef LIBRBD_SUPPORTS_INVALIDATE
 static void qemu_rbd_invalidate_cache(BlockDriverState *bs,
                                       Error **errp)
@@ -998,6 +1167,12 @@ static BlockDriver bdrv_rbd = {
 #ifdef LIBRBD_SUPPORTS_DISCARD
     .bdrv_aio_pdiscard      = qemu_rbd_aio_pdiscard,
 #endif
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    .bdrv_co_pwrite_zeroes  = qemu_rbd_co_pwrite_zeroes,
+#endif
+#ifdef RBD_FEATURE_FAST_DIFF
+    .bdrv_co_get_block_status = qemu_rbd_co_get_block_status,
+#endif
 
     .bdrv_snapshot_create   = qemu_rbd_snap_create,
     .bdrv_snapshot_delete   = qemu_rbd_snap_remove,
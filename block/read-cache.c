@@ -0,0 +1,537 @@
+/*
+ * Read cache filter: keeps data read from a slow node in a fast local node
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The "file" child is the slow origin (typically a remote image or backing
+ * chain), the "cache-file" child a local scratch image.  The cache node is
+ * divided into slots of cluster-size bytes; a hash table maps cluster
+ * numbers of the origin to slots, and slots are evicted in LRU order.
+ *
+ * The mapping only lives in memory, so the cache starts cold every time
+ * the node is opened.  Writes go to the origin and invalidate the clusters
+ * they touch.  When prefetching is enabled, sequential read streams cause
+ * the clusters following them to be fetched in the background.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "qapi/qmp/qbool.h"
+#include "trace.h"
+
+#define READ_CACHE_OPT_CACHE_SIZE   "cache-size"
+#define READ_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+#define READ_CACHE_OPT_PREFETCH     "prefetch"
+
+#define READ_CACHE_CLUSTER_SIZE_DEFAULT (64 * 1024)
+#define READ_CACHE_PREFETCH_MAX 1024
+
+typedef struct ReadCacheSlot {
+    int64_t cluster;            /* -1 if the slot is free */
+    int readers;
+    bool filling;
+    bool stale;                 /* invalidated while in use */
+    CoQueue waiters;            /* readers waiting for the fill */
+    QTAILQ_ENTRY(ReadCacheSlot) lru;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache;
+    uint64_t cluster_size;
+    uint32_t nr_slots;
+    ReadCacheSlot *slots;
+    GHashTable *map;
+    /* Least recently used first; free slots are kept at the head */
+    QTAILQ_HEAD(, ReadCacheSlot) lru;
+
+    int prefetch;
+    bool prefetching;
+    bool prefetch_paused;
+    uint64_t seq_offset;
+    int64_t prefetch_end;
+} BDRVReadCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Bytes of the cache node to use (default: all of it)",
+        },
+        {
+            .name = READ_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache in bytes",
+        },
+        {
+            .name = READ_CACHE_OPT_PREFETCH,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Clusters to prefetch ahead of sequential reads",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* The cache is scratch space that is written even if the node is read-only */
+static void read_cache_inherit_options(int *child_flags, QDict *child_options,
+                                       int parent_flags, QDict *parent_options)
+{
+    child_file.inherit_options(child_flags, child_options,
+                               parent_flags, parent_options);
+    qdict_put(child_options, BDRV_OPT_READ_ONLY, qbool_from_bool(false));
+    *child_flags |= BDRV_O_RDWR;
+}
+
+static BdrvChildRole child_read_cache = {
+    .inherit_options = read_cache_inherit_options,
+};
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int64_t cache_len;
+    uint64_t cache_size;
+    uint32_t i;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
+                               false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs,
+                               &child_read_cache, false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->cluster_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CLUSTER_SIZE,
+                                        READ_CACHE_CLUSTER_SIZE_DEFAULT);
+    if (s->cluster_size < BDRV_SECTOR_SIZE || s->cluster_size > INT_MAX ||
+        !is_power_of_2(s->cluster_size)) {
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %d", BDRV_SECTOR_SIZE, 1 << 30);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_len = bdrv_getlength(s->cache->bs);
+    if (cache_len < 0) {
+        error_setg_errno(errp, -cache_len, "Could not get cache size");
+        ret = cache_len;
+        goto fail;
+    }
+    cache_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CACHE_SIZE,
+                                   cache_len);
+    if (cache_size > cache_len || cache_size < s->cluster_size ||
+        cache_size / s->cluster_size > UINT32_MAX) {
+        error_setg(errp, "Cache size must be between one cluster and the "
+                   "size of the cache node (%" PRId64 " bytes)", cache_len);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->prefetch = qemu_opt_get_number(opts, READ_CACHE_OPT_PREFETCH, 0);
+    if (s->prefetch < 0 || s->prefetch > READ_CACHE_PREFETCH_MAX) {
+        error_setg(errp, "prefetch must be between 0 and %d",
+                   READ_CACHE_PREFETCH_MAX);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->nr_slots = cache_size / s->cluster_size;
+    s->slots = g_new0(ReadCacheSlot, s->nr_slots);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    for (i = 0; i < s->nr_slots; i++) {
+        s->slots[i].cluster = -1;
+        qemu_co_queue_init(&s->slots[i].waiters);
+        QTAILQ_INSERT_TAIL(&s->lru, &s->slots[i], lru);
+    }
+    s->prefetch_end = -1;
+
+    ret = 0;
+    goto out;
+
+fail:
+    if (s->cache) {
+        bdrv_unref_child(bs, s->cache);
+    }
+    bdrv_unref_child(bs, bs->file);
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    bdrv_unref_child(bs, s->cache);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                       ReadCacheSlot *slot)
+{
+    return (uint64_t)(slot - s->slots) * s->cluster_size;
+}
+
+static void read_cache_free_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    slot->cluster = -1;
+    slot->stale = false;
+    QTAILQ_REMOVE(&s->lru, slot, lru);
+    QTAILQ_INSERT_HEAD(&s->lru, slot, lru);
+}
+
+/* Drop a slot from the map; it is freed once nobody uses it any more */
+static void read_cache_drop_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (!slot->stale) {
+        g_hash_table_remove(s->map, &slot->cluster);
+        slot->stale = true;
+    }
+    if (!slot->readers && !slot->filling) {
+        read_cache_free_slot(s, slot);
+    }
+}
+
+static ReadCacheSlot *read_cache_alloc_slot(BDRVReadCacheState *s,
+                                            int64_t cluster)
+{
+    ReadCacheSlot *slot;
+
+    QTAILQ_FOREACH(slot, &s->lru, lru) {
+        if (!slot->readers && !slot->filling && !slot->stale) {
+            break;
+        }
+    }
+    if (!slot) {
+        return NULL;
+    }
+
+    if (slot->cluster >= 0) {
+        trace_read_cache_evict(s, slot->cluster);
+        g_hash_table_remove(s->map, &slot->cluster);
+    }
+    slot->cluster = cluster;
+    slot->filling = true;
+    g_hash_table_insert(s->map, &slot->cluster, slot);
+    QTAILQ_REMOVE(&s->lru, slot, lru);
+    QTAILQ_INSERT_TAIL(&s->lru, slot, lru);
+    return slot;
+}
+
+static void read_cache_invalidate(BDRVReadCacheState *s, uint64_t offset,
+                                  uint64_t bytes)
+{
+    int64_t cluster, last;
+
+    if (!bytes) {
+        return;
+    }
+    last = (offset + bytes - 1) / s->cluster_size;
+    for (cluster = offset / s->cluster_size; cluster <= last; cluster++) {
+        ReadCacheSlot *slot = g_hash_table_lookup(s->map, &cluster);
+
+        if (slot) {
+            read_cache_drop_slot(s, slot);
+        }
+    }
+}
+
+/*
+ * Read @bytes at @cluster_offset of @cluster into @qiov at @qiov_offset,
+ * going through the cache.  @qiov may be NULL to only fill the cache.
+ */
+static int coroutine_fn read_cache_co_read_cluster(BlockDriverState *bs,
+                                                   int64_t cluster,
+                                                   uint64_t cluster_offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start = cluster * s->cluster_size;
+    int64_t len = bdrv_getlength(bs->file->bs);
+    QEMUIOVector local_qiov;
+    ReadCacheSlot *slot;
+    struct iovec iov;
+    bool cache_failed = false;
+    int ret;
+
+    if (len < 0) {
+        return len;
+    }
+    len = MIN(len - start, s->cluster_size);
+
+    qemu_iovec_init(&local_qiov, qiov ? qiov->niov : 1);
+    if (qiov) {
+        qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+    }
+
+retry:
+    slot = g_hash_table_lookup(s->map, &cluster);
+    if (slot && slot->filling) {
+        qemu_co_queue_wait(&slot->waiters);
+        goto retry;
+    }
+
+    if (slot) {
+        trace_read_cache_hit(s, cluster);
+        QTAILQ_REMOVE(&s->lru, slot, lru);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, lru);
+        ret = 0;
+        if (qiov) {
+            slot->readers++;
+            ret = bdrv_co_preadv(s->cache,
+                                 read_cache_slot_offset(s, slot) +
+                                 cluster_offset, bytes, &local_qiov, 0);
+            slot->readers--;
+            if (ret < 0) {
+                read_cache_drop_slot(s, slot);
+            } else if (slot->stale && !slot->readers) {
+                read_cache_free_slot(s, slot);
+            }
+        }
+        goto out;
+    }
+
+    trace_read_cache_miss(s, cluster);
+    /* Only whole clusters are cached; the tail of the image is not */
+    slot = len == s->cluster_size ? read_cache_alloc_slot(s, cluster) : NULL;
+    if (!slot) {
+        ret = qiov ? bdrv_co_preadv(bs->file, start + cluster_offset, bytes,
+                                    &local_qiov, 0) : 0;
+        goto out;
+    }
+
+    iov.iov_len = s->cluster_size;
+    iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
+    if (!iov.iov_base) {
+        ret = -ENOMEM;
+        goto fill_done;
+    }
+    qemu_iovec_reset(&local_qiov);
+    qemu_iovec_add(&local_qiov, iov.iov_base, iov.iov_len);
+
+    ret = bdrv_co_preadv(bs->file, start, iov.iov_len, &local_qiov, 0);
+    if (ret >= 0) {
+        if (qiov) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                (uint8_t *)iov.iov_base + cluster_offset,
+                                bytes);
+        }
+        /* A failed cache write only costs the slot, not the read */
+        cache_failed = bdrv_co_pwritev(s->cache,
+                                       read_cache_slot_offset(s, slot),
+                                       iov.iov_len, &local_qiov, 0) < 0;
+    }
+    qemu_vfree(iov.iov_base);
+
+fill_done:
+    slot->filling = false;
+    if (ret < 0 || cache_failed || slot->stale) {
+        read_cache_drop_slot(s, slot);
+    }
+    qemu_co_queue_restart_all(&slot->waiters);
+
+out:
+    qemu_iovec_destroy(&local_qiov);
+    return ret < 0 ? ret : 0;
+}
+
+static void coroutine_fn read_cache_co_prefetch(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t len = bdrv_getlength(bs->file->bs);
+    int64_t nr_clusters = DIV_ROUND_UP(MAX(len, 0), s->cluster_size);
+    int64_t cluster;
+
+    for (cluster = s->prefetch_end - s->prefetch;
+         cluster < MIN(s->prefetch_end, nr_clusters) && !s->prefetch_paused;
+         cluster++) {
+        if (cluster >= 0 && !g_hash_table_lookup(s->map, &cluster)) {
+            read_cache_co_read_cluster(bs, cluster, 0, 0, NULL, 0);
+        }
+    }
+    s->prefetching = false;
+}
+
+/* Prefetch the clusters after a sequential stream of reads */
+static void read_cache_maybe_prefetch(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    bool sequential = offset == s->seq_offset;
+    int64_t next;
+
+    s->seq_offset = offset + bytes;
+    s->prefetch_paused = false;
+    if (!s->prefetch || !sequential || s->prefetching) {
+        return;
+    }
+
+    next = DIV_ROUND_UP(offset + bytes, s->cluster_size);
+    if (next + s->prefetch <= s->prefetch_end) {
+        return;
+    }
+    s->prefetch_end = next + s->prefetch;
+    s->prefetching = true;
+    qemu_coroutine_enter(qemu_coroutine_create(read_cache_co_prefetch, bs));
+}
+
+static int coroutine_fn read_cache_co_preadv(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t done = 0;
+    int ret = 0;
+
+    while (done < bytes) {
+        uint64_t pos = offset + done;
+        uint64_t cluster_offset = pos % s->cluster_size;
+        uint64_t n = MIN(bytes - done, s->cluster_size - cluster_offset);
+
+        ret = read_cache_co_read_cluster(bs, pos / s->cluster_size,
+                                         cluster_offset, n, qiov, done);
+        if (ret < 0) {
+            return ret;
+        }
+        done += n;
+    }
+
+    read_cache_maybe_prefetch(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    /* Before, so that nobody reads old data from the cache meanwhile, and
+     * after, in case a read of the origin raced with the write */
+    read_cache_invalidate(s, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    read_cache_invalidate(s, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+    int64_t offset, int count, BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_invalidate(s, offset, count);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, count, flags);
+    read_cache_invalidate(s, offset, count);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int count)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_invalidate(s, offset, count);
+    ret = bdrv_co_pdiscard(bs->file->bs, offset, count);
+    read_cache_invalidate(s, offset, count);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_flush(BlockDriverState *bs)
+{
+    /* The cache node holds nothing that is not in the origin */
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static void read_cache_drain(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    s->prefetch_paused = true;
+}
+
+static int read_cache_truncate(BlockDriverState *bs, int64_t offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t len = bdrv_getlength(bs->file->bs);
+
+    if (len > offset) {
+        read_cache_invalidate(s, offset, len - offset);
+    }
+    return bdrv_truncate(bs->file->bs, offset);
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                      = "read-cache",
+    .instance_size                    = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                        = read_cache_open,
+    .bdrv_close                       = read_cache_close,
+    .bdrv_getlength                   = read_cache_getlength,
+    .bdrv_truncate                    = read_cache_truncate,
+
+    .bdrv_co_preadv                   = read_cache_co_preadv,
+    .bdrv_co_pwritev                  = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes            = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                 = read_cache_co_pdiscard,
+    .bdrv_co_flush                    = read_cache_co_flush,
+    .bdrv_drain                       = read_cache_drain,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = read_cache_recurse_is_first_non_filter,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    child_read_cache.drained_begin = child_file.drained_begin;
+    child_read_cache.drained_end = child_file.drained_end;
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -0,0 +1,316 @@
+/*
+ * Read cache for immutable images, shared between QEMU processes
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "block/shared-cache.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC "QEMUSHC1"
+
+/* Number of times to retry when another process replaces the segment */
+#define SHARED_CACHE_OPEN_RETRIES 3
+
+/* Identity of the image; the segment is only valid for a matching key */
+typedef struct SharedCacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+} SharedCacheKey;
+
+typedef struct SharedCacheHeader {
+    char magic[8];
+    SharedCacheKey key;
+    uint32_t chunk_size;
+    uint32_t nr_slots;
+} SharedCacheHeader;
+
+/*
+ * @seq is odd while the slot is being written.  @tag is the chunk index
+ * plus one, so that a zeroed slot is empty.
+ */
+typedef struct SharedCacheSlot {
+    uint32_t seq;
+    uint32_t tag;
+} SharedCacheSlot;
+
+struct SharedCache {
+    void *map;
+    size_t map_size;
+    uint32_t nr_slots;
+    SharedCacheSlot *slots;
+    uint8_t *data;
+};
+
+static size_t shared_cache_data_offset(uint32_t nr_slots)
+{
+    return ROUND_UP(sizeof(SharedCacheHeader) +
+                    nr_slots * sizeof(SharedCacheSlot), getpagesize());
+}
+
+static size_t shared_cache_map_size(uint32_t nr_slots)
+{
+    return shared_cache_data_offset(nr_slots) +
+           (size_t)nr_slots * SHARED_CACHE_CHUNK_SIZE;
+}
+
+static char *shared_cache_path(const SharedCacheKey *key)
+{
+    const char *dir = "/dev/shm";
+
+    if (access(dir, W_OK)) {
+        dir = g_get_tmp_dir();
+    }
+    return g_strdup_printf("%s/qemu-shared-cache-%" PRIx64 "-%" PRIx64,
+                           dir, key->dev, key->ino);
+}
+
+static int shared_cache_lock(int fd, short type)
+{
+    struct flock fl = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = 0,
+        .l_len = 0,
+    };
+
+    while (fcntl(fd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map the segment open at @cfd, initializing it if it is empty.  Returns 0
+ * on success, -ESTALE if the segment belongs to a different version of the
+ * image and must be replaced, or another negative errno value.
+ */
+static int shared_cache_attach(SharedCache *c, int cfd,
+                               const SharedCacheKey *key, uint32_t nr_slots)
+{
+    SharedCacheHeader *hdr;
+    struct stat st;
+    bool init;
+
+    if (fstat(cfd, &st) < 0) {
+        return -errno;
+    }
+
+    init = st.st_size == 0;
+    if (init) {
+        c->map_size = shared_cache_map_size(nr_slots);
+        if (ftruncate(cfd, c->map_size) < 0) {
+            return -errno;
+        }
+    } else if (st.st_size < sizeof(SharedCacheHeader)) {
+        return -ESTALE;
+    } else {
+        c->map_size = st.st_size;
+    }
+
+    c->map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  cfd, 0);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        return -errno;
+    }
+    hdr = c->map;
+
+    if (init) {
+        memcpy(hdr->magic, SHARED_CACHE_MAGIC, sizeof(hdr->magic));
+        hdr->key = *key;
+        hdr->chunk_size = SHARED_CACHE_CHUNK_SIZE;
+        hdr->nr_slots = nr_slots;
+    } else if (memcmp(hdr->magic, SHARED_CACHE_MAGIC, sizeof(hdr->magic)) ||
+               memcmp(&hdr->key, key, sizeof(*key)) ||
+               hdr->chunk_size != SHARED_CACHE_CHUNK_SIZE ||
+               !hdr->nr_slots ||
+               shared_cache_map_size(hdr->nr_slots) != c->map_size) {
+        return -ESTALE;
+    }
+
+    c->nr_slots = hdr->nr_slots;
+    c->slots = (SharedCacheSlot *)(hdr + 1);
+    c->data = (uint8_t *)c->map + shared_cache_data_offset(c->nr_slots);
+    return 0;
+}
+
+SharedCache *shared_cache_open(int fd, uint64_t cache_size, Error **errp)
+{
+    SharedCache *c;
+    SharedCacheKey key;
+    struct stat st, seg_st, path_st;
+    uint32_t nr_slots;
+    char *path;
+    int cfd = -1;
+    int i, ret;
+
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not stat image for shared cache");
+        return NULL;
+    }
+    if (cache_size < SHARED_CACHE_CHUNK_SIZE ||
+        cache_size / SHARED_CACHE_CHUNK_SIZE > UINT32_MAX ||
+        cache_size > SIZE_MAX / 2) {
+        error_setg(errp, "Invalid shared cache size %" PRIu64, cache_size);
+        return NULL;
+    }
+    nr_slots = cache_size / SHARED_CACHE_CHUNK_SIZE;
+
+    memset(&key, 0, sizeof(key));
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime_sec = st.st_mtim.tv_sec;
+    key.mtime_nsec = st.st_mtim.tv_nsec;
+
+    c = g_new0(SharedCache, 1);
+    path = shared_cache_path(&key);
+    ret = -ESTALE;
+    for (i = 0; i < SHARED_CACHE_OPEN_RETRIES && ret == -ESTALE; i++) {
+        if (c->map) {
+            munmap(c->map, c->map_size);
+            c->map = NULL;
+        }
+        if (cfd >= 0) {
+            qemu_close(cfd);
+        }
+
+        cfd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+        if (cfd < 0) {
+            ret = -errno;
+            break;
+        }
+        ret = shared_cache_lock(cfd, F_WRLCK);
+        if (ret < 0) {
+            break;
+        }
+
+        /* Somebody may have replaced the segment before we got the lock */
+        if (fstat(cfd, &seg_st) < 0 || stat(path, &path_st) < 0 ||
+            seg_st.st_dev != path_st.st_dev ||
+            seg_st.st_ino != path_st.st_ino) {
+            ret = -ESTALE;
+            continue;
+        }
+
+        ret = shared_cache_attach(c, cfd, &key, nr_slots);
+        if (ret == -ESTALE) {
+            /* Left over from an older version of the image */
+            unlink(path);
+        }
+    }
+
+    if (cfd >= 0) {
+        /* The mapping stays valid after closing (and unlocking) the file */
+        qemu_close(cfd);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not set up shared cache '%s'",
+                         path);
+        if (c->map) {
+            munmap(c->map, c->map_size);
+        }
+        g_free(c);
+        c = NULL;
+    } else {
+        trace_shared_cache_open(c, path, c->nr_slots);
+    }
+    g_free(path);
+    return c;
+}
+
+void shared_cache_close(SharedCache *c)
+{
+    munmap(c->map, c->map_size);
+    g_free(c);
+}
+
+static SharedCacheSlot *shared_cache_slot(SharedCache *c, uint64_t chunk,
+                                          uint8_t **data)
+{
+    uint32_t index = chunk % c->nr_slots;
+
+    *data = c->data + (size_t)index * SHARED_CACHE_CHUNK_SIZE;
+    return &c->slots[index];
+}
+
+bool shared_cache_lookup(SharedCache *c, uint64_t offset, QEMUIOVector *qiov,
+                         size_t qiov_offset, size_t bytes)
+{
+    uint64_t chunk = offset / SHARED_CACHE_CHUNK_SIZE;
+    size_t chunk_offset = offset % SHARED_CACHE_CHUNK_SIZE;
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    uint32_t seq;
+
+    assert(chunk_offset + bytes <= SHARED_CACHE_CHUNK_SIZE);
+    if (chunk >= UINT32_MAX) {
+        return false;
+    }
+    slot = shared_cache_slot(c, chunk, &data);
+
+    seq = atomic_read(&slot->seq);
+    if (seq & 1) {
+        goto miss;
+    }
+    /* Read the tag and the data only after the sequence counter */
+    smp_rmb();
+    if (atomic_read(&slot->tag) != chunk + 1) {
+        goto miss;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, data + chunk_offset, bytes);
+    /* ... and check that no writer came in while we were copying */
+    smp_rmb();
+    if (atomic_read(&slot->seq) != seq) {
+        goto miss;
+    }
+
+    trace_shared_cache_hit(c, offset, bytes);
+    return true;
+
+miss:
+    trace_shared_cache_miss(c, offset, bytes);
+    return false;
+}
+
+void shared_cache_insert(SharedCache *c, uint64_t offset, const void *buf)
+{
+    uint64_t chunk = offset / SHARED_CACHE_CHUNK_SIZE;
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    uint32_t seq;
+
+    assert(QEMU_IS_ALIGNED(offset, SHARED_CACHE_CHUNK_SIZE));
+    if (chunk >= UINT32_MAX) {
+        return;
+    }
+    slot = shared_cache_slot(c, chunk, &data);
+
+    /*
+     * Skip the insertion if another process is filling the slot.  A
+     * process that dies in the middle leaves the slot odd forever, which
+     * only costs that one slot.
+     */
+    seq = atomic_read(&slot->seq);
+    if ((seq & 1) || atomic_cmpxchg(&slot->seq, seq, seq + 1) != seq) {
+        return;
+    }
+    atomic_set(&slot->tag, chunk + 1);
+    memcpy(data, buf, SHARED_CACHE_CHUNK_SIZE);
+    /* The data must be visible before the slot looks stable again */
+    smp_wmb();
+    atomic_set(&slot->seq, seq + 2);
+}
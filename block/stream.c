@@ -22,38 +22,157 @@
 
 enum {
     /*
-     * Size of data buffer for populating the image file.  This should be large
-     * enough to process multiple clusters in a single call, so that populating
-     * contiguous regions of the image is efficient.
+     * Default size of a copy request.  This should be large enough to process
+     * multiple clusters in a single call, so that populating contiguous
+     * regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+    STREAM_MAX_CHUNK_SIZE = 16 * 1024 * 1024, /* in bytes */
+
+    STREAM_DEFAULT_IN_FLIGHT = 4,
+    STREAM_MAX_IN_FLIGHT = 64,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+typedef struct StreamOp StreamOp;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+
+    int max_in_flight;
+    int chunk_sectors;
+    int in_flight;
+    int failed;
+    bool waiting_for_io;
+    /* Copy requests in sector order.  Failed requests stay here until
+     * stream_run() has dealt with them. */
+    QTAILQ_HEAD(, StreamOp) ops;
+    /* Everything below this sector that is not in @ops has been copied */
+    int64_t scan_sector;
 } StreamBlockJob;
 
+struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+    QTAILQ_ENTRY(StreamOp) next;
+};
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
-                                        int64_t sector_num, int nb_sectors,
-                                        void *buf)
+                                        int64_t sector_num, int nb_sectors)
 {
     struct iovec iov = {
-        .iov_base = buf,
         .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
     };
     QEMUIOVector qiov;
+    int ret;
 
+    iov.iov_base = blk_blockalign(blk, iov.iov_len);
     qemu_iovec_init_external(&qiov, &iov, 1);
 
     /* Copy-on-read the unallocated clusters */
-    return blk_co_preadv(blk, sector_num * BDRV_SECTOR_SIZE, qiov.size, &qiov,
-                         BDRV_REQ_COPY_ON_READ);
+    ret = blk_co_preadv(blk, sector_num * BDRV_SECTOR_SIZE, qiov.size, &qiov,
+                        BDRV_REQ_COPY_ON_READ);
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+static void stream_update_progress(StreamBlockJob *s)
+{
+    StreamOp *op = QTAILQ_FIRST(&s->ops);
+
+    s->common.offset = (op ? op->sector_num : s->scan_sector) *
+                       BDRV_SECTOR_SIZE;
+}
+
+static void coroutine_fn stream_populate_entry(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+
+    op->ret = stream_populate(s->common.blk, op->sector_num, op->nb_sectors);
+    trace_stream_populate_done(s, op->sector_num, op->nb_sectors, op->ret);
+
+    s->in_flight--;
+    if (op->ret < 0) {
+        s->failed++;
+    } else {
+        QTAILQ_REMOVE(&s->ops, op, next);
+        g_free(op);
+        stream_update_progress(s);
+    }
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
+static void stream_issue(StreamBlockJob *s, int64_t sector_num,
+                         int nb_sectors)
+{
+    StreamOp *op = g_new0(StreamOp, 1);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    QTAILQ_INSERT_TAIL(&s->ops, op, next);
+    s->in_flight++;
+
+    qemu_coroutine_enter(qemu_coroutine_create(stream_populate_entry, op));
+}
+
+static void stream_fail(StreamBlockJob *s, int64_t sector_num, int nb_sectors,
+                        int ret)
+{
+    StreamOp *op = g_new0(StreamOp, 1);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->ret = ret;
+    QTAILQ_INSERT_TAIL(&s->ops, op, next);
+    s->failed++;
+}
+
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn stream_drain(StreamBlockJob *s)
+{
+    while (s->in_flight > 0) {
+        stream_wait_for_io(s);
+    }
+}
+
+/* Forget about the failed requests once nothing is in flight, and return
+ * the error and the start of the first one */
+static int stream_reap_failed(StreamBlockJob *s, int64_t *sector_num)
+{
+    StreamOp *op, *next_op;
+    int ret = 0;
+
+    assert(!s->in_flight);
+    QTAILQ_FOREACH_SAFE(op, &s->ops, next, next_op) {
+        if (!ret) {
+            ret = op->ret;
+            *sector_num = op->sector_num;
+        }
+        QTAILQ_REMOVE(&s->ops, op, next);
+        g_free(op);
+    }
+    s->failed = 0;
+    return ret;
 }
 
 typedef struct {
@@ -94,12 +213,12 @@ static void coroutine_fn stream_run(void *opaque)
     BlockDriverState *bs = blk_bs(blk);
     BlockDriverState *base = s->base;
     int64_t sector_num = 0;
+    int64_t failed_sector;
     int64_t end = -1;
     uint64_t delay_ns = 0;
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     if (!bs->backing) {
         goto out;
@@ -112,7 +231,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -123,21 +241,52 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    for (;;) {
         bool copy;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
+        delay_ns = 0;
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
+        /* Errors are handled once all requests have settled, so that a
+         * stopped job can restart from the first failed request */
+        while (s->in_flight && (s->in_flight >= s->max_in_flight ||
+                                s->failed || sector_num == end)) {
+            stream_wait_for_io(s);
+        }
+        if (s->failed) {
+            BlockErrorAction action;
+
+            ret = stream_reap_failed(s, &failed_sector);
+            action = block_job_error_action(&s->common, s->on_error, true,
+                                            -ret);
+            if (action == BLOCK_ERROR_ACTION_STOP) {
+                sector_num = s->scan_sector = failed_sector;
+                stream_update_progress(s);
+                continue;
+            }
+            if (error == 0) {
+                error = ret;
+            }
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                break;
+            }
+        }
+        if (sector_num == end) {
+            break;
+        }
+
         copy = false;
 
+        /* Skip whole ranges that need no copying in a single step */
         ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+                                MIN(end - sector_num,
+                                    BDRV_REQUEST_MAX_SECTORS), &n);
         if (ret == 1) {
             /* Allocated in the top, no need to copy.  */
         } else if (ret >= 0) {
@@ -154,29 +303,31 @@ static void coroutine_fn stream_run(void *opaque)
             copy = (ret == 1);
         }
         trace_stream_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            ret = stream_populate(blk, sector_num, n, buf);
-        }
         if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                break;
+            /* Handled like a failed copy of the next chunk */
+            n = MIN(end - sector_num, s->chunk_sectors);
+            stream_fail(s, sector_num, n, ret);
+        } else if (copy) {
+            n = MIN(n, s->chunk_sectors);
+            stream_issue(s, sector_num, n);
+            delay_ns = block_job_sched_delay(&s->common, n * BDRV_SECTOR_SIZE);
+            if (s->common.speed) {
+                delay_ns = MAX(delay_ns,
+                               ratelimit_calculate_delay(&s->limit, n));
             }
         }
-        ret = 0;
 
         /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        sector_num += n;
+        s->scan_sector = sector_num;
+        stream_update_progress(s);
+    }
+
+    stream_drain(s);
+    if (s->failed) {
+        ret = stream_reap_failed(s, &failed_sector);
+        if (error == 0) {
+            error = ret;
         }
     }
 
@@ -187,8 +338,6 @@ static void coroutine_fn stream_run(void *opaque)
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
 out:
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
@@ -208,10 +357,61 @@ static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
     ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
 }
 
+static void stream_set_pipeline(BlockJob *job,
+                                bool has_max_in_flight, int64_t max_in_flight,
+                                bool has_chunk_size, int64_t chunk_size,
+                                Error **errp)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+
+    if (has_max_in_flight &&
+        (max_in_flight < 0 || max_in_flight > STREAM_MAX_IN_FLIGHT)) {
+        error_setg(errp, "Parameter 'max-in-flight' must be between 0 and %d",
+                   STREAM_MAX_IN_FLIGHT);
+        return;
+    }
+    if (has_chunk_size &&
+        (chunk_size < 0 || chunk_size > STREAM_MAX_CHUNK_SIZE ||
+         !QEMU_IS_ALIGNED(chunk_size, BDRV_SECTOR_SIZE))) {
+        error_setg(errp, "Parameter 'chunk-size' must be a multiple of %d "
+                   "and not exceed %d", BDRV_SECTOR_SIZE,
+                   STREAM_MAX_CHUNK_SIZE);
+        return;
+    }
+
+    if (has_max_in_flight) {
+        s->max_in_flight = max_in_flight ?: STREAM_DEFAULT_IN_FLIGHT;
+    }
+    if (has_chunk_size) {
+        s->chunk_sectors = (chunk_size ?: STREAM_BUFFER_SIZE) >>
+                           BDRV_SECTOR_BITS;
+    }
+}
+
+static void stream_query(BlockJob *job, BlockJobInfo *info)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+
+    info->has_max_in_flight = true;
+    info->max_in_flight = s->max_in_flight;
+    info->has_chunk_size = true;
+    info->chunk_size = (int64_t)s->chunk_sectors * BDRV_SECTOR_SIZE;
+}
+
+static void coroutine_fn stream_pause(BlockJob *job)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+
+    stream_drain(s);
+}
+
 static const BlockJobDriver stream_job_driver = {
     .instance_size = sizeof(StreamBlockJob),
     .job_type      = BLOCK_JOB_TYPE_STREAM,
     .set_speed     = stream_set_speed,
+    .set_pipeline  = stream_set_pipeline,
+    .query         = stream_query,
+    .pause         = stream_pause,
 };
 
 void stream_start(const char *job_id, BlockDriverState *bs,
@@ -229,6 +429,9 @@ void stream_start(const char *job_id, BlockDriverState *bs,
 
     s->base = base;
     s->backing_file_str = g_strdup(backing_file_str);
+    s->max_in_flight = STREAM_DEFAULT_IN_FLIGHT;
+    s->chunk_sectors = STREAM_BUFFER_SIZE >> BDRV_SECTOR_BITS;
+    QTAILQ_INIT(&s->ops);
 
     s->on_error = on_error;
     s->common.co = qemu_coroutine_create(stream_run, s);
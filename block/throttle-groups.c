@@ -56,17 +56,34 @@
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
+    unsigned nb_members;
     BlockBackend *tokens[2];
     bool any_timer_armed[2];
+    unsigned config_gen; /* Bumped whenever ts is reconfigured */
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
+/* In groups with at least THROTTLE_GROUP_BATCH_MIN_MEMBERS members, a
+ * BlockBackend that gets through the group also accounts the next
+ * THROTTLE_GROUP_BATCH - 1 requests of the same size, and keeps them as
+ * local credit.  The credit lets its following requests through without
+ * taking the group lock, which is heavily contended in large groups.
+ *
+ * Credit is only used while no request of the same type is waiting in
+ * the group, so it never runs ahead of the round robin.  Whatever is left
+ * of it is given back to the group at the next slow path and when the
+ * BlockBackend leaves the group, so every request is accounted exactly
+ * once.  A reconfiguration resets the buckets and invalidates all credit.
+ * Smaller groups keep exact per-request accounting. */
+#define THROTTLE_GROUP_BATCH_MIN_MEMBERS 8
+#define THROTTLE_GROUP_BATCH 4
+
 static QemuMutex throttle_groups_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -188,7 +205,8 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
 
     /* get next bs round in round robin style */
     token = throttle_group_next_blk(token);
-    while (token != start && !blkp->pending_reqs[is_write]) {
+    while (token != start &&
+           !blk_get_public(token)->pending_reqs[is_write]) {
         token = throttle_group_next_blk(token);
     }
 
@@ -196,7 +214,7 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
      * then decide the token is the current bs because chances are
      * the current bs get the current request queued.
      */
-    if (token == start && !blkp->pending_reqs[is_write]) {
+    if (token == start && !blk_get_public(token)->pending_reqs[is_write]) {
         token = blk;
     }
 
@@ -280,6 +298,109 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
     }
 }
 
+/* Let an I/O request through with local credit from an earlier batch.
+ *
+ * This runs without tg->lock.  The credit fields and pending_reqs are only
+ * changed by this BlockBackend's own requests, and the fields of the group
+ * are only used as a hint: the slow path rechecks them under the lock.
+ *
+ * @blk:       the current BlockBackend
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the request was let through
+ */
+static bool throttle_group_use_credit(BlockBackend *blk, unsigned int bytes,
+                                      bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    double units;
+
+    if (blkp->throttle_credit_gen != atomic_read(&tg->config_gen)) {
+        /* The buckets were reset, so there is nothing to give back */
+        blkp->throttle_credit_bytes[is_write] = 0;
+        blkp->throttle_credit_units[is_write] = 0;
+        return false;
+    }
+
+    /* Requests that are waiting get their turn first */
+    if (blkp->pending_reqs[is_write] ||
+        atomic_read(&tg->any_timer_armed[is_write])) {
+        return false;
+    }
+
+    units = throttle_op_units(blkp->throttle_credit_op_size, bytes);
+    if (blkp->throttle_credit_bytes[is_write] < bytes ||
+        blkp->throttle_credit_units[is_write] < units) {
+        return false;
+    }
+
+    blkp->throttle_credit_bytes[is_write] -= bytes;
+    blkp->throttle_credit_units[is_write] -= units;
+    return true;
+}
+
+/* Give the unused local credit of a BlockBackend back to its group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @blk:       the current BlockBackend
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_refund_credit(BlockBackend *blk, bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    if (blkp->throttle_credit_gen == tg->config_gen) {
+        throttle_unaccount(blkp->throttle_state, is_write,
+                           blkp->throttle_credit_bytes[is_write],
+                           blkp->throttle_credit_units[is_write]);
+    }
+    blkp->throttle_credit_bytes[is_write] = 0;
+    blkp->throttle_credit_units[is_write] = 0;
+}
+
+/* Account the requests that follow the current one in advance and keep
+ * them as local credit, see THROTTLE_GROUP_BATCH.
+ *
+ * This assumes that tg->lock is held and that the BlockBackend has no
+ * credit left for this type of operation.
+ *
+ * @blk:       the current BlockBackend
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_grant_credit(BlockBackend *blk, unsigned int bytes,
+                                        bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleState *ts = blkp->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    int i;
+
+    if (tg->nb_members < THROTTLE_GROUP_BATCH_MIN_MEMBERS ||
+        blkp->io_limits_disabled) {
+        return;
+    }
+
+    /* Credit of the other type was accounted under the old settings */
+    if (blkp->throttle_credit_gen != tg->config_gen) {
+        blkp->throttle_credit_bytes[!is_write] = 0;
+        blkp->throttle_credit_units[!is_write] = 0;
+    }
+
+    for (i = 1; i < THROTTLE_GROUP_BATCH; i++) {
+        throttle_account(ts, is_write, bytes);
+    }
+    blkp->throttle_credit_gen = tg->config_gen;
+    blkp->throttle_credit_op_size = ts->cfg.op_size;
+    blkp->throttle_credit_bytes[is_write] =
+        (uint64_t)bytes * (THROTTLE_GROUP_BATCH - 1);
+    blkp->throttle_credit_units[is_write] =
+        throttle_op_units(ts->cfg.op_size, bytes) * (THROTTLE_GROUP_BATCH - 1);
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -297,23 +418,41 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    if (throttle_group_use_credit(blk, bytes, is_write)) {
+        blkp->throttle_served[is_write]++;
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* Credit that did not cover this request goes back to the group */
+    throttle_group_refund_credit(blk, is_write);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(blk, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || blkp->pending_reqs[is_write]) {
+        int clock_type = blkp->throttle_timers.clock_type;
+        int64_t start_ns = qemu_clock_get_ns(clock_type);
+
         blkp->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&blkp->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
         blkp->pending_reqs[is_write]--;
+
+        blkp->throttle_delayed[is_write]++;
+        blkp->throttle_wait_ns[is_write] +=
+            qemu_clock_get_ns(clock_type) - start_ns;
     }
+    blkp->throttle_served[is_write]++;
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
+    throttle_group_grant_credit(blk, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -355,6 +494,7 @@ void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg)
         tg->any_timer_armed[1] = false;
     }
     throttle_config(ts, tt, cfg);
+    atomic_inc(&tg->config_gen);
     qemu_mutex_unlock(&tg->lock);
 
     qemu_co_enter_next(&blkp->throttled_reqs[0]);
@@ -449,6 +589,7 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
     }
 
     QLIST_INSERT_HEAD(&tg->head, blkp, round_robin);
+    tg->nb_members++;
 
     throttle_timers_init(&blkp->throttle_timers,
                          blk_get_aio_context(blk),
@@ -482,6 +623,7 @@ void throttle_group_unregister_blk(BlockBackend *blk)
 
     qemu_mutex_lock(&tg->lock);
     for (i = 0; i < 2; i++) {
+        throttle_group_refund_credit(blk, i);
         if (tg->tokens[i] == blk) {
             BlockBackend *token = throttle_group_next_blk(blk);
             /* Take care of the case where this is the last blk in the group */
@@ -494,6 +636,7 @@ void throttle_group_unregister_blk(BlockBackend *blk)
 
     /* remove the current blk from the list */
     QLIST_REMOVE(blkp, round_robin);
+    tg->nb_members--;
     throttle_timers_destroy(&blkp->throttle_timers);
     qemu_mutex_unlock(&tg->lock);
 
@@ -369,6 +369,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
+            } else if (!strcmp(aio, "io_uring")) {
+                /* no flag, blockdev_init() passes it to the protocol layer */
             } else {
                error_setg(errp, "invalid aio option");
                return;
@@ -511,6 +513,11 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    buf = qemu_opt_get(opts, "aio");
+    if (buf && !strcmp(buf, "io_uring")) {
+        qdict_set_default_str(bs_opts, "file.aio", buf);
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             error_printf("Supported formats:");
@@ -1667,7 +1674,7 @@ static void external_snapshot_prepare(BlkActionState *common,
     /* Acquire AioContext now so any threads operating on old_bs stop */
     state->aio_context = bdrv_get_aio_context(state->old_bs);
     aio_context_acquire(state->aio_context);
-    bdrv_drained_begin(state->old_bs);
+    bdrv_subtree_drained_begin(state->old_bs);
 
     if (!bdrv_is_inserted(state->old_bs)) {
         error_setg(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
@@ -1799,7 +1806,7 @@ static void external_snapshot_clean(BlkActionState *common)
     ExternalSnapshotState *state =
                              DO_UPCAST(ExternalSnapshotState, common, common);
     if (state->aio_context) {
-        bdrv_drained_end(state->old_bs);
+        bdrv_subtree_drained_end(state->old_bs);
         aio_context_release(state->aio_context);
     }
 }
@@ -1961,6 +1968,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2005,6 +2013,7 @@ static void block_dirty_bitmap_clear_prepare(BlkActionState *common,
     if (!state->bitmap) {
         return;
     }
+    bdrv_drained_begin(state->bs);
 
     if (bdrv_dirty_bitmap_frozen(state->bitmap)) {
         error_setg(errp, "Cannot modify a frozen bitmap");
@@ -2039,6 +2048,9 @@ static void block_dirty_bitmap_clear_clean(BlkActionState *common)
     BlockDirtyBitmapState *state = DO_UPCAST(BlockDirtyBitmapState,
                                              common, common);
 
+    if (state->bitmap) {
+        bdrv_drained_end(state->bs);
+    }
     if (state->aio_context) {
         aio_context_release(state->aio_context);
     }
@@ -2150,8 +2162,10 @@ void qmp_transaction(TransactionActionList *dev_list,
         block_job_txn = block_job_txn_new();
     }
 
-    /* drain all i/o before any operations */
-    bdrv_drain_all();
+    /* Each action drains the nodes it touches in .prepare() and keeps them
+     * quiesced until .clean(), so the whole group still sees a single point
+     * in time while unrelated devices keep running.
+     */
 
     /* We don't do anything in this loop that commits us to the operations */
     while (NULL != dev_entry) {
@@ -2585,6 +2599,86 @@ fail:
     bdrv_unref(medium_bs);
 }
 
+static int block_latency_histogram_set_list(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            uint64List *list)
+{
+    uint64List *entry;
+    uint64_t *boundaries;
+    int n = 0, ret;
+
+    for (entry = list; entry; entry = entry->next) {
+        n++;
+    }
+
+    boundaries = g_new(uint64_t, n);
+    n = 0;
+    for (entry = list; entry; entry = entry->next) {
+        boundaries[n++] = entry->value;
+    }
+
+    ret = block_latency_histogram_set(stats, type, n, boundaries);
+    g_free(boundaries);
+    return ret;
+}
+
+void qmp_block_latency_histogram_set(bool has_device, const char *device,
+                                     bool has_id, const char *id,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    uint64List *lists[BLOCK_MAX_IOTYPE] = { NULL };
+    bool has_lists[BLOCK_MAX_IOTYPE] = { false };
+    int i;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        has_lists[i] = has_boundaries;
+        lists[i] = boundaries;
+    }
+    if (has_boundaries_read) {
+        has_lists[BLOCK_ACCT_READ] = true;
+        lists[BLOCK_ACCT_READ] = boundaries_read;
+    }
+    if (has_boundaries_write) {
+        has_lists[BLOCK_ACCT_WRITE] = true;
+        lists[BLOCK_ACCT_WRITE] = boundaries_write;
+    }
+    if (has_boundaries_flush) {
+        has_lists[BLOCK_ACCT_FLUSH] = true;
+        lists[BLOCK_ACCT_FLUSH] = boundaries_flush;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (has_lists[i] &&
+            block_latency_histogram_set_list(stats, i, lists[i]) < 0) {
+            error_setg(errp, "Histogram boundaries must be strictly "
+                       "increasing");
+            break;
+        }
+    }
+
+    aio_context_release(aio_context);
+}
+
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
 {
@@ -2688,10 +2782,12 @@ out:
 
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2717,7 +2813,20 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp))
+    {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap != NULL) {
+        bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2878,9 +2987,10 @@ void qmp_block_resize(bool has_device, const char *device,
     }
 
     /* complete all in-flight operations before resizing the device */
-    bdrv_drain_all();
-
+    bdrv_drained_begin(bs);
     ret = bdrv_truncate(bs, size);
+    bdrv_drained_end(bs);
+
     switch (ret) {
     case 0:
         break;
@@ -3307,6 +3417,8 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_on_target_error,
                                    BlockdevOnError on_target_error,
                                    bool has_unmap, bool unmap,
+                                   bool has_copy_mode,
+                                   MirrorCopyMode copy_mode,
                                    Error **errp)
 {
 
@@ -3328,6 +3440,9 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3357,7 +3472,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     mirror_start(job_id, bs, target,
                  has_replaces ? replaces : NULL,
                  speed, granularity, buf_size, sync, backing_mode,
-                 on_source_error, on_target_error, unmap,
+                 on_source_error, on_target_error, unmap, copy_mode,
                  block_job_cb, bs, errp);
 }
 
@@ -3496,6 +3611,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_on_source_error, arg->on_source_error,
                            arg->has_on_target_error, arg->on_target_error,
                            arg->has_unmap, arg->unmap,
+                           arg->has_copy_mode, arg->copy_mode,
                            &local_err);
     bdrv_unref(target_bs);
     error_propagate(errp, local_err);
@@ -3514,6 +3630,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3545,6 +3662,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            true, true,
+                           has_copy_mode, copy_mode,
                            &local_err);
     error_propagate(errp, local_err);
 
@@ -3588,6 +3706,77 @@ void qmp_block_job_set_speed(const char *device, int64_t speed, Error **errp)
     aio_context_release(aio_context);
 }
 
+void qmp_block_job_set_pipeline(const char *device,
+                                bool has_max_in_flight, int64_t max_in_flight,
+                                bool has_chunk_size, int64_t chunk_size,
+                                Error **errp)
+{
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context, errp);
+
+    if (!job) {
+        return;
+    }
+
+    block_job_set_pipeline(job, has_max_in_flight, max_in_flight,
+                           has_chunk_size, chunk_size, errp);
+    aio_context_release(aio_context);
+}
+
+void qmp_block_job_set_priority(const char *device, int64_t priority,
+                                Error **errp)
+{
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context, errp);
+
+    if (!job) {
+        return;
+    }
+
+    block_job_set_priority(job, priority, errp);
+    aio_context_release(aio_context);
+}
+
+void qmp_block_job_set_scheduler(bool has_bandwidth, int64_t bandwidth,
+                                 bool has_iops, int64_t iops,
+                                 bool has_guest_reserve, int64_t guest_reserve,
+                                 Error **errp)
+{
+    BlockJobSchedulerInfo *info = block_job_sched_query();
+
+    if (!has_bandwidth) {
+        bandwidth = info->bandwidth;
+    }
+    if (!has_iops) {
+        iops = info->iops;
+    }
+    if (!has_guest_reserve) {
+        guest_reserve = info->guest_reserve;
+    }
+    qapi_free_BlockJobSchedulerInfo(info);
+
+    if (bandwidth < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER, "bandwidth");
+        return;
+    }
+    if (iops < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER, "iops");
+        return;
+    }
+    if (guest_reserve < 0 || guest_reserve > 100) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "guest-reserve",
+                   "a percentage between 0 and 100");
+        return;
+    }
+
+    block_job_sched_configure(bandwidth, iops, guest_reserve);
+}
+
+BlockJobSchedulerInfo *qmp_query_block_job_scheduler(Error **errp)
+{
+    return block_job_sched_query();
+}
+
 void qmp_block_job_cancel(const char *device,
                           bool has_force, bool force, Error **errp)
 {
@@ -36,8 +36,15 @@
 #include "qemu/id.h"
 #include "qmp-commands.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
 #include "qapi-event.h"
 
+/* The budget is split again every period, among the jobs that copied data
+ * in the previous one; within a period it is enforced in slices.
+ */
+#define SCHED_PERIOD_NS 1000000000LL
+#define SCHED_SLICE_NS  100000000LL
+
 /* Transactional group of block jobs */
 struct BlockJobTxn {
 
@@ -53,6 +60,37 @@ struct BlockJobTxn {
 
 static QLIST_HEAD(, BlockJob) block_jobs = QLIST_HEAD_INITIALIZER(block_jobs);
 
+/* Host-wide budget shared by all jobs.  Jobs can run in any AioContext,
+ * so everything but @enabled is protected by @lock.
+ */
+static struct {
+    QemuMutex lock;
+    bool enabled;
+
+    int64_t bandwidth;
+    int64_t iops;
+    int64_t guest_reserve;
+
+    /* What is left of @bandwidth after the guest reservation */
+    int64_t job_bandwidth;
+
+    uint64_t period;
+    int64_t period_start;
+    /* blk_guest_bytes() at @period_start */
+    unsigned long guest_bytes;
+
+    /* Sum of the priorities of the jobs that copied data in the previous
+     * period and so far in the current one
+     */
+    uint64_t prev_weight;
+    uint64_t cur_weight;
+} sched;
+
+static void __attribute__((constructor)) block_job_sched_init(void)
+{
+    qemu_mutex_init(&sched.lock);
+}
+
 BlockJob *block_job_next(BlockJob *job)
 {
     if (!job) {
@@ -117,6 +155,32 @@ static void block_job_detach_aio_context(void *opaque)
     block_job_unref(job);
 }
 
+static void block_job_drained_begin(void *opaque)
+{
+    BlockJob *job = opaque;
+
+    /* The job stops at its next pause point; until then the drain waits
+     * for the requests it has in flight */
+    block_job_pause(job);
+}
+
+static void block_job_drained_end(void *opaque)
+{
+    BlockJob *job = opaque;
+
+    block_job_resume(job);
+}
+
+static const BlockDevOps block_job_dev_ops = {
+    .drained_begin = block_job_drained_begin,
+    .drained_end = block_job_drained_end,
+};
+
+void block_job_add_backend(BlockJob *job, BlockBackend *blk)
+{
+    blk_set_dev_ops(blk, &block_job_dev_ops, job);
+}
+
 void *block_job_create(const char *job_id, const BlockJobDriver *driver,
                        BlockDriverState *bs, int64_t speed,
                        BlockCompletionFunc *cb, void *opaque, Error **errp)
@@ -164,10 +228,12 @@ void *block_job_create(const char *job_id, const BlockJobDriver *driver,
     job->opaque        = opaque;
     job->busy          = true;
     job->refcnt        = 1;
+    job->priority      = BLOCK_JOB_DEFAULT_PRIORITY;
     bs->job = job;
 
     QLIST_INSERT_HEAD(&block_jobs, job, job_list);
 
+    block_job_add_backend(job, blk);
     blk_add_aio_context_notifier(blk, block_job_attached_aio_context,
                                  block_job_detach_aio_context, job);
 
@@ -319,6 +385,136 @@ void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp)
     job->speed = speed;
 }
 
+void block_job_set_priority(BlockJob *job, int64_t priority, Error **errp)
+{
+    if (priority < BLOCK_JOB_MIN_PRIORITY ||
+        priority > BLOCK_JOB_MAX_PRIORITY) {
+        error_setg(errp, "Priority must be between %d and %d",
+                   BLOCK_JOB_MIN_PRIORITY, BLOCK_JOB_MAX_PRIORITY);
+        return;
+    }
+    job->priority = priority;
+}
+
+static void block_job_sched_new_period_locked(int64_t now)
+{
+    sched.guest_bytes = blk_guest_bytes();
+    sched.period_start = now;
+    sched.period++;
+}
+
+static void block_job_sched_refresh_locked(int64_t now)
+{
+    int64_t elapsed = now - sched.period_start;
+    int64_t guest_rate, reserved;
+
+    if (elapsed < SCHED_PERIOD_NS) {
+        return;
+    }
+
+    /* Guest I/O up to the reservation comes out of the jobs' budget, guest
+     * I/O beyond it has to compete with them.
+     */
+    guest_rate = (double)(blk_guest_bytes() - sched.guest_bytes) *
+                 NANOSECONDS_PER_SECOND / elapsed;
+    reserved = MIN(guest_rate, sched.bandwidth / 100 * sched.guest_reserve);
+    sched.job_bandwidth = sched.bandwidth - reserved;
+
+    /* Jobs that are paused or idle drop out of the split */
+    sched.prev_weight = elapsed < 2 * SCHED_PERIOD_NS ? sched.cur_weight : 0;
+    sched.cur_weight = 0;
+    block_job_sched_new_period_locked(now);
+}
+
+void block_job_sched_configure(int64_t bandwidth, int64_t iops,
+                               int64_t guest_reserve)
+{
+    BlockJob *job;
+    uint64_t weight = 0;
+
+    /* Until the jobs report in, assume that all of them are copying */
+    QLIST_FOREACH(job, &block_jobs, job_list) {
+        if (!job->pause_count && !job->completed) {
+            weight += job->priority;
+        }
+    }
+
+    qemu_mutex_lock(&sched.lock);
+    sched.bandwidth = bandwidth;
+    sched.iops = iops;
+    sched.guest_reserve = guest_reserve;
+    sched.job_bandwidth = bandwidth;
+    sched.prev_weight = weight;
+    sched.cur_weight = 0;
+    block_job_sched_new_period_locked(qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    atomic_set(&sched.enabled, bandwidth || iops);
+    qemu_mutex_unlock(&sched.lock);
+}
+
+BlockJobSchedulerInfo *block_job_sched_query(void)
+{
+    BlockJobSchedulerInfo *info = g_new0(BlockJobSchedulerInfo, 1);
+
+    qemu_mutex_lock(&sched.lock);
+    info->bandwidth     = sched.bandwidth;
+    info->iops          = sched.iops;
+    info->guest_reserve = sched.guest_reserve;
+    info->job_bandwidth = sched.job_bandwidth;
+    qemu_mutex_unlock(&sched.lock);
+    return info;
+}
+
+int64_t block_job_sched_delay(BlockJob *job, uint64_t n)
+{
+    int64_t bandwidth, iops;
+    int64_t delay_ns = 0;
+    bool limited;
+    double share;
+
+    if (!atomic_read(&sched.enabled)) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&sched.lock);
+    block_job_sched_refresh_locked(qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    if (job->sched_period != sched.period) {
+        job->sched_period = sched.period;
+        sched.cur_weight += job->priority;
+    }
+    share = (double)job->priority / MAX(sched.prev_weight, sched.cur_weight);
+    limited = sched.bandwidth != 0;
+    bandwidth = sched.job_bandwidth;
+    iops = sched.iops;
+    qemu_mutex_unlock(&sched.lock);
+
+    /* The rate limits are private to the job, only the shares are global */
+    if (limited && bandwidth) {
+        ratelimit_set_speed(&job->sched_bw, bandwidth * share, SCHED_SLICE_NS);
+        delay_ns = ratelimit_calculate_delay(&job->sched_bw, n);
+    } else if (limited) {
+        /* The guest takes all of the bandwidth, check again later */
+        delay_ns = SCHED_SLICE_NS;
+    }
+    if (iops && n) {
+        ratelimit_set_speed(&job->sched_ops, iops * share, SCHED_PERIOD_NS);
+        delay_ns = MAX(delay_ns, ratelimit_calculate_delay(&job->sched_ops, 1));
+    }
+    return delay_ns;
+}
+
+void block_job_set_pipeline(BlockJob *job,
+                            bool has_max_in_flight, int64_t max_in_flight,
+                            bool has_chunk_size, int64_t chunk_size,
+                            Error **errp)
+{
+    if (!job->driver->set_pipeline) {
+        error_setg(errp, QERR_UNSUPPORTED);
+        return;
+    }
+    job->driver->set_pipeline(job, has_max_in_flight, max_in_flight,
+                              has_chunk_size, chunk_size, errp);
+}
+
 void block_job_complete(BlockJob *job, Error **errp)
 {
     if (job->pause_count || job->cancelled || !job->driver->complete) {
@@ -504,8 +700,12 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->paused    = job->pause_count > 0;
     info->offset    = job->offset;
     info->speed     = job->speed;
+    info->priority  = job->priority;
     info->io_status = job->iostatus;
     info->ready     = job->ready;
+    if (job->driver->query) {
+        job->driver->query(job, info);
+    }
     return info;
 }
 
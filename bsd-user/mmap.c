@@ -48,10 +48,12 @@ void mmap_fork_start(void)
     if (mmap_lock_count)
         abort();
     pthread_mutex_lock(&mmap_mutex);
+    page_fork_start();
 }
 
 void mmap_fork_end(int child)
 {
+    page_fork_end(child);
     if (child)
         pthread_mutex_init(&mmap_mutex, NULL);
     else
@@ -0,0 +1,203 @@
+/*
+ * Lock-free single-producer single-consumer rings in ivshmem memory
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+
+#include "ivshmem-ring.h"
+
+QEMU_BUILD_BUG_ON(sizeof(IvshmemRingHeader) != 192);
+QEMU_BUILD_BUG_ON(sizeof(IvshmemRingSlot) != 8);
+
+size_t ivshmem_ring_size(uint32_t nslots, uint32_t slot_size)
+{
+    return sizeof(IvshmemRingHeader) + (size_t)nslots * slot_size;
+}
+
+static bool ivshmem_ring_valid(size_t size, uint32_t nslots,
+                               uint32_t slot_size)
+{
+    return nslots && is_power_of_2(nslots) &&
+        slot_size > sizeof(IvshmemRingSlot) && !(slot_size & 7) &&
+        ivshmem_ring_size(nslots, slot_size) <= size;
+}
+
+static void ivshmem_ring_init(IvshmemRing *ring, void *mem, uint32_t nslots,
+                              uint32_t slot_size)
+{
+    ring->hdr = mem;
+    ring->slots = (uint8_t *)mem + sizeof(IvshmemRingHeader);
+    ring->nslots = nslots;
+    ring->slot_size = slot_size;
+    ring->prod_idx = atomic_read(&ring->hdr->prod_idx);
+    ring->cons_idx = atomic_read(&ring->hdr->cons_idx);
+}
+
+int ivshmem_ring_format(IvshmemRing *ring, void *mem, size_t size,
+                        uint32_t nslots, uint32_t slot_size)
+{
+    IvshmemRingHeader *hdr = mem;
+
+    if (((uintptr_t)mem & 63) || !ivshmem_ring_valid(size, nslots,
+                                                      slot_size)) {
+        return -EINVAL;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = IVSHMEM_RING_VERSION;
+    hdr->nslots = nslots;
+    hdr->slot_size = slot_size;
+    /* The magic comes last, a peer may be polling for it */
+    smp_wmb();
+    atomic_set(&hdr->magic, IVSHMEM_RING_MAGIC);
+
+    ivshmem_ring_init(ring, mem, nslots, slot_size);
+    return 0;
+}
+
+int ivshmem_ring_attach(IvshmemRing *ring, void *mem, size_t size)
+{
+    IvshmemRingHeader *hdr = mem;
+    uint32_t nslots, slot_size;
+
+    if (size < sizeof(*hdr) ||
+        atomic_read(&hdr->magic) != IVSHMEM_RING_MAGIC) {
+        return -EINVAL;
+    }
+    /* Pairs with smp_wmb() in ivshmem_ring_format() */
+    smp_rmb();
+    nslots = atomic_read(&hdr->nslots);
+    slot_size = atomic_read(&hdr->slot_size);
+    if (atomic_read(&hdr->version) != IVSHMEM_RING_VERSION ||
+        !ivshmem_ring_valid(size, nslots, slot_size)) {
+        return -EINVAL;
+    }
+
+    ivshmem_ring_init(ring, mem, nslots, slot_size);
+    return 0;
+}
+
+static IvshmemRingSlot *ivshmem_ring_slot(IvshmemRing *ring, uint32_t idx)
+{
+    return (IvshmemRingSlot *)(ring->slots +
+                               (idx & (ring->nslots - 1)) * ring->slot_size);
+}
+
+void *ivshmem_ring_reserve(IvshmemRing *ring)
+{
+    uint32_t cons_idx = atomic_read(&ring->hdr->cons_idx);
+
+    if (ring->prod_idx - cons_idx >= ring->nslots) {
+        return NULL;
+    }
+    /* Do not overwrite the slot before the consumer is done with it */
+    smp_mb();
+    return ivshmem_ring_slot(ring, ring->prod_idx) + 1;
+}
+
+void ivshmem_ring_commit(IvshmemRing *ring, uint32_t len)
+{
+    IvshmemRingSlot *slot = ivshmem_ring_slot(ring, ring->prod_idx);
+
+    assert(len <= ivshmem_ring_max_len(ring));
+    slot->len = len;
+    slot->reserved = 0;
+    ring->prod_idx++;
+}
+
+bool ivshmem_ring_flush_produced(IvshmemRing *ring)
+{
+    IvshmemRingHeader *hdr = ring->hdr;
+
+    if (atomic_read(&hdr->prod_idx) == ring->prod_idx) {
+        return false;
+    }
+
+    /* Publish the messages before the index */
+    smp_wmb();
+    atomic_set(&hdr->prod_idx, ring->prod_idx);
+
+    /* Pairs with the barrier in ivshmem_ring_wait_produced() */
+    smp_mb();
+    if (atomic_read(&hdr->cons_wait)) {
+        atomic_set(&hdr->cons_wait, 0);
+        return true;
+    }
+    return false;
+}
+
+bool ivshmem_ring_wait_consumed(IvshmemRing *ring)
+{
+    IvshmemRingHeader *hdr = ring->hdr;
+
+    atomic_set(&hdr->prod_wait, 1);
+    /* Pairs with the last barrier in ivshmem_ring_flush_consumed() */
+    smp_mb();
+    if (ring->prod_idx - atomic_read(&hdr->cons_idx) < ring->nslots) {
+        atomic_set(&hdr->prod_wait, 0);
+        return false;
+    }
+    return true;
+}
+
+const void *ivshmem_ring_peek(IvshmemRing *ring, uint32_t *len)
+{
+    IvshmemRingSlot *slot;
+
+    if (atomic_read(&ring->hdr->prod_idx) == ring->cons_idx) {
+        return NULL;
+    }
+    /* Read the index before the message */
+    smp_rmb();
+
+    slot = ivshmem_ring_slot(ring, ring->cons_idx);
+    *len = MIN(atomic_read(&slot->len), ivshmem_ring_max_len(ring));
+    return slot + 1;
+}
+
+void ivshmem_ring_consume(IvshmemRing *ring)
+{
+    ring->cons_idx++;
+}
+
+bool ivshmem_ring_flush_consumed(IvshmemRing *ring)
+{
+    IvshmemRingHeader *hdr = ring->hdr;
+
+    if (atomic_read(&hdr->cons_idx) == ring->cons_idx) {
+        return false;
+    }
+
+    /* Finish reading the messages before the producer reuses the slots */
+    smp_mb();
+    atomic_set(&hdr->cons_idx, ring->cons_idx);
+
+    /* Pairs with the barrier in ivshmem_ring_wait_consumed() */
+    smp_mb();
+    if (atomic_read(&hdr->prod_wait)) {
+        atomic_set(&hdr->prod_wait, 0);
+        return true;
+    }
+    return false;
+}
+
+bool ivshmem_ring_wait_produced(IvshmemRing *ring)
+{
+    IvshmemRingHeader *hdr = ring->hdr;
+
+    atomic_set(&hdr->cons_wait, 1);
+    /* Pairs with the last barrier in ivshmem_ring_flush_produced() */
+    smp_mb();
+    if (atomic_read(&hdr->prod_idx) != ring->cons_idx) {
+        atomic_set(&hdr->cons_wait, 0);
+        return false;
+    }
+    return true;
+}
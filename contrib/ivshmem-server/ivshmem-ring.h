@@ -0,0 +1,197 @@
+/*
+ * Lock-free single-producer single-consumer rings in ivshmem memory
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef IVSHMEM_RING_H
+#define IVSHMEM_RING_H
+
+/**
+ * Helpers for the ring format described in docs/specs/ivshmem-spec.txt.
+ *
+ * A ring carries messages in one direction between two peers sharing an
+ * ivshmem region: guests, or host processes that map the memory created
+ * by ivshmem-server.  Messages are written and read in place, and the
+ * peers only ring the doorbell when the other side announced that it is
+ * going to sleep.
+ *
+ * The producer fills any number of slots with ivshmem_ring_reserve() and
+ * ivshmem_ring_commit(), then makes them visible with
+ * ivshmem_ring_flush_produced().  The consumer symmetrically uses
+ * ivshmem_ring_peek(), ivshmem_ring_consume() and
+ * ivshmem_ring_flush_consumed().  The flush functions return true when
+ * the peer must be notified, e.g. with ivshmem_client_notify().
+ */
+
+#define IVSHMEM_RING_MAGIC   0x49565247  /* "IVRG" */
+#define IVSHMEM_RING_VERSION 1
+
+/**
+ * Header of a ring in shared memory
+ *
+ * The fields written by the producer and by the consumer live in
+ * different cache lines.
+ */
+typedef struct IvshmemRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;            /**< number of slots, a power of 2 */
+    uint32_t slot_size;         /**< bytes per slot, including its header */
+    uint8_t pad0[48];
+    uint32_t prod_idx;          /**< free-running, written by the producer */
+    uint32_t prod_wait;         /**< producer waits for free slots */
+    uint8_t pad1[56];
+    uint32_t cons_idx;          /**< free-running, written by the consumer */
+    uint32_t cons_wait;         /**< consumer waits for messages */
+    uint8_t pad2[56];
+} IvshmemRingHeader;
+
+/**
+ * Header of each slot, followed by the message
+ */
+typedef struct IvshmemRingSlot {
+    uint32_t len;               /**< length of the message */
+    uint32_t reserved;          /**< must be zero */
+} IvshmemRingSlot;
+
+/**
+ * Local view of a ring
+ *
+ * Each peer keeps its own copy of the index it owns, so that several
+ * slots can be produced or consumed before the peer sees them.
+ */
+typedef struct IvshmemRing {
+    IvshmemRingHeader *hdr;
+    uint8_t *slots;
+    uint32_t nslots;
+    uint32_t slot_size;
+    uint32_t prod_idx;          /**< next slot to produce */
+    uint32_t cons_idx;          /**< next slot to consume */
+} IvshmemRing;
+
+/**
+ * Return the amount of shared memory taken by a ring
+ *
+ * @nslots:    number of slots
+ * @slot_size: size of each slot
+ */
+size_t ivshmem_ring_size(uint32_t nslots, uint32_t slot_size);
+
+/**
+ * Initialize a ring in shared memory
+ *
+ * A single peer formats the ring, before the other one attaches to it.
+ *
+ * @ring:      the ring to initialize
+ * @mem:       the shared memory, aligned to 64 bytes
+ * @size:      the size of @mem
+ * @nslots:    number of slots, a power of 2
+ * @slot_size: size of each slot, a multiple of 8 larger than the
+ *             slot header
+ *
+ * Returns: 0 on success, -EINVAL if the parameters are invalid
+ */
+int ivshmem_ring_format(IvshmemRing *ring, void *mem, size_t size,
+                        uint32_t nslots, uint32_t slot_size);
+
+/**
+ * Attach to a ring formatted by the peer
+ *
+ * @ring:      the ring to initialize
+ * @mem:       the shared memory holding the ring
+ * @size:      the size of @mem
+ *
+ * Returns: 0 on success, -EINVAL if @mem does not hold a valid ring
+ */
+int ivshmem_ring_attach(IvshmemRing *ring, void *mem, size_t size);
+
+/**
+ * Return the maximum length of a message
+ *
+ * @ring:      the ring
+ */
+static inline uint32_t ivshmem_ring_max_len(IvshmemRing *ring)
+{
+    return ring->slot_size - sizeof(IvshmemRingSlot);
+}
+
+/**
+ * Get the buffer of the next free slot (producer)
+ *
+ * @ring:      the ring
+ *
+ * Returns: a buffer of ivshmem_ring_max_len() bytes, or NULL if the
+ * ring is full
+ */
+void *ivshmem_ring_reserve(IvshmemRing *ring);
+
+/**
+ * Queue the message written in the reserved slot (producer)
+ *
+ * @ring:      the ring
+ * @len:       the length of the message
+ */
+void ivshmem_ring_commit(IvshmemRing *ring, uint32_t len);
+
+/**
+ * Make the committed messages visible to the consumer (producer)
+ *
+ * @ring:      the ring
+ *
+ * Returns: true if the consumer waits and must be notified
+ */
+bool ivshmem_ring_flush_produced(IvshmemRing *ring);
+
+/**
+ * Announce that the producer is going to wait for free slots (producer)
+ *
+ * @ring:      the ring
+ *
+ * Returns: false if slots were freed in the meantime and the producer
+ * must not go to sleep
+ */
+bool ivshmem_ring_wait_consumed(IvshmemRing *ring);
+
+/**
+ * Get the next message (consumer)
+ *
+ * @ring:      the ring
+ * @len:       filled with the length of the message
+ *
+ * Returns: the message, or NULL if the ring is empty.  The message stays
+ * valid until ivshmem_ring_consume().
+ */
+const void *ivshmem_ring_peek(IvshmemRing *ring, uint32_t *len);
+
+/**
+ * Drop the message returned by ivshmem_ring_peek() (consumer)
+ *
+ * @ring:      the ring
+ */
+void ivshmem_ring_consume(IvshmemRing *ring);
+
+/**
+ * Hand the consumed slots back to the producer (consumer)
+ *
+ * @ring:      the ring
+ *
+ * Returns: true if the producer waits and must be notified
+ */
+bool ivshmem_ring_flush_consumed(IvshmemRing *ring);
+
+/**
+ * Announce that the consumer is going to wait for messages (consumer)
+ *
+ * @ring:      the ring
+ *
+ * Returns: false if messages arrived in the meantime and the consumer
+ * must not go to sleep
+ */
+bool ivshmem_ring_wait_produced(IvshmemRing *ring);
+
+#endif /* IVSHMEM_RING_H */
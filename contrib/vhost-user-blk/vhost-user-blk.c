@@ -0,0 +1,919 @@
+/*
+ * vhost-user-blk sample backend
+ *
+ * Serves a raw image file or a block device to the vhost-user-blk
+ * device of one QEMU process.  Every virtqueue is processed from the
+ * same event loop, with synchronous preadv/pwritev calls.
+ *
+ * The backend survives the loss of its QEMU connection: in server mode
+ * it waits for the next connection on its socket, in client mode it
+ * connects again once a second.  QEMU then replays the whole setup and
+ * the rings resume from their used index.
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/iov.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/vhost.h>
+
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+/* Based on hw/virtio/vhost-user.c */
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+enum VhostUserProtocolFeature {
+    VHOST_USER_PROTOCOL_F_MQ = 0,
+    VHOST_USER_PROTOCOL_F_CONFIG = 9,
+};
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_SEND_RARP = 19,
+    VHOST_USER_GET_CONFIG = 24,
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserLog {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} VhostUserLog;
+
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+#define VHOST_USER_CONFIG_HDR_SIZE offsetof(VhostUserConfig, region)
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+        VhostUserLog log;
+        VhostUserConfig config;
+    } payload;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num;
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload.u64)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+#define VUB_MAX_QUEUES      8
+#define VUB_SECTOR_BITS     9
+#define VUB_SEG_MAX         126
+/* Room for the request header, the segments and the status byte */
+#define VUB_MAX_IOV         (VUB_SEG_MAX + 2)
+
+typedef struct VubVirtq {
+    int call_fd;
+    int kick_fd;
+    uint32_t size;
+    uint16_t last_avail_index;
+    uint16_t last_used_index;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    bool enable;
+} VubVirtq;
+
+typedef struct VubDevRegion {
+    /* Guest Physical address. */
+    uint64_t gpa;
+    /* Memory region size. */
+    uint64_t size;
+    /* QEMU virtual address (userspace). */
+    uint64_t qva;
+    /* Starting offset in our mmaped space. */
+    uint64_t mmap_offset;
+    /* Start address of mmaped space. */
+    uint64_t mmap_addr;
+} VubDevRegion;
+
+typedef struct VubDev {
+    const char *sock_path;
+    bool client;
+    int listen_fd;
+    int conn_fd;
+
+    int blk_fd;
+    uint64_t capacity;
+    bool readonly;
+    int num_queues;
+    uint64_t features;
+
+    uint32_t nregions;
+    VubDevRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    VubVirtq vq[VUB_MAX_QUEUES];
+} VubDev;
+
+static bool verbose;
+
+#define DPRINT(...) \
+    do { \
+        if (verbose) { \
+            printf(__VA_ARGS__); \
+        } \
+    } while (0)
+
+static void vub_die(const char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+/* Translate guest physical address to our virtual address */
+static void *gpa_to_va(VubDev *dev, uint64_t guest_addr, uint64_t len)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubDevRegion *r = &dev->regions[i];
+
+        if (guest_addr >= r->gpa && len <= r->size &&
+            guest_addr - r->gpa <= r->size - len) {
+            return (void *)(uintptr_t)(guest_addr - r->gpa + r->mmap_addr +
+                                       r->mmap_offset);
+        }
+    }
+
+    return NULL;
+}
+
+/* Translate QEMU virtual address to our virtual address */
+static void *qva_to_va(VubDev *dev, uint64_t qemu_addr)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubDevRegion *r = &dev->regions[i];
+
+        if (qemu_addr >= r->qva && qemu_addr < r->qva + r->size) {
+            return (void *)(uintptr_t)(qemu_addr - r->qva + r->mmap_addr +
+                                       r->mmap_offset);
+        }
+    }
+
+    return NULL;
+}
+
+static void vub_notify(VubVirtq *vq)
+{
+    if (vq->call_fd != -1 &&
+        !(atomic_read(&vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT)) {
+        eventfd_write(vq->call_fd, 1);
+    }
+}
+
+/*
+ * Split a descriptor chain in the buffers read and written by the device.
+ * Returns the number of descriptors or -1 if the chain is malformed.
+ */
+static int vub_map_chain(VubDev *dev, VubVirtq *vq, uint16_t head,
+                         struct iovec *out, unsigned *out_num,
+                         struct iovec *in, unsigned *in_num)
+{
+    unsigned i = head, n = 0;
+
+    *out_num = *in_num = 0;
+    for (;;) {
+        struct vring_desc *d;
+        struct iovec *iov;
+
+        if (i >= vq->size || ++n > vq->size) {
+            return -1;
+        }
+        d = &vq->desc[i];
+
+        if (d->flags & VRING_DESC_F_WRITE) {
+            if (*in_num == VUB_MAX_IOV) {
+                return -1;
+            }
+            iov = &in[(*in_num)++];
+        } else {
+            /* Readable descriptors come first */
+            if (*in_num || *out_num == VUB_MAX_IOV) {
+                return -1;
+            }
+            iov = &out[(*out_num)++];
+        }
+
+        iov->iov_base = gpa_to_va(dev, d->addr, d->len);
+        iov->iov_len = d->len;
+        if (!iov->iov_base) {
+            return -1;
+        }
+
+        if (!(d->flags & VRING_DESC_F_NEXT)) {
+            return n;
+        }
+        i = d->next;
+    }
+}
+
+/* Execute one request, returns the number of bytes written to the guest */
+static uint32_t vub_process_req(VubDev *dev, VubVirtq *vq, uint16_t head)
+{
+    struct iovec out[VUB_MAX_IOV], in[VUB_MAX_IOV];
+    struct iovec *data = out;
+    unsigned out_num, in_num;
+    struct virtio_blk_outhdr hdr;
+    uint8_t *status;
+    uint32_t len = 0;
+    ssize_t ret;
+
+    if (vub_map_chain(dev, vq, head, out, &out_num, in, &in_num) < 0 ||
+        !in_num || !in[in_num - 1].iov_len ||
+        iov_to_buf(out, out_num, 0, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        fprintf(stderr, "Dropping malformed request on vq %td\n",
+                vq - dev->vq);
+        return 0;
+    }
+
+    status = (uint8_t *)in[in_num - 1].iov_base + in[in_num - 1].iov_len - 1;
+    iov_discard_front(&data, &out_num, sizeof(hdr));
+    iov_discard_back(in, &in_num, 1);
+
+    switch (hdr.type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+        ret = preadv(dev->blk_fd, in, in_num, hdr.sector << VUB_SECTOR_BITS);
+        if (ret >= 0) {
+            len = ret;
+            *status = VIRTIO_BLK_S_OK;
+        } else {
+            *status = VIRTIO_BLK_S_IOERR;
+        }
+        break;
+    case VIRTIO_BLK_T_OUT:
+        if (dev->readonly) {
+            *status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        ret = pwritev(dev->blk_fd, data, out_num,
+                      hdr.sector << VUB_SECTOR_BITS);
+        *status = ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        *status = fdatasync(dev->blk_fd) ? VIRTIO_BLK_S_IOERR :
+                                           VIRTIO_BLK_S_OK;
+        break;
+    case VIRTIO_BLK_T_GET_ID: {
+        char id[VIRTIO_BLK_ID_BYTES] = "vhost_user_blk";
+
+        len = iov_from_buf(in, in_num, 0, id, sizeof(id));
+        *status = VIRTIO_BLK_S_OK;
+        break;
+    }
+    default:
+        *status = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+
+    return len + 1;
+}
+
+static void vub_process_vq(VubDev *dev, VubVirtq *vq)
+{
+    bool progress = false;
+
+    if (!vq->enable || !vq->avail || !vq->size) {
+        return;
+    }
+
+    while (vq->last_avail_index != atomic_read(&vq->avail->idx)) {
+        struct vring_used_elem *elem;
+        uint16_t head;
+
+        /* Read the ring entry after the index */
+        smp_rmb();
+        head = vq->avail->ring[vq->last_avail_index % vq->size];
+        elem = &vq->used->ring[vq->last_used_index % vq->size];
+        elem->id = head;
+        elem->len = vub_process_req(dev, vq, head);
+        vq->last_avail_index++;
+        vq->last_used_index++;
+
+        /* Publish the used element before the index */
+        smp_wmb();
+        atomic_set(&vq->used->idx, vq->last_used_index);
+        progress = true;
+    }
+
+    if (progress) {
+        /* Read the flags after updating the used index */
+        smp_mb();
+        vub_notify(vq);
+    }
+}
+
+static void vub_stop_vq(VubVirtq *vq)
+{
+    if (vq->call_fd != -1) {
+        close(vq->call_fd);
+        vq->call_fd = -1;
+    }
+    if (vq->kick_fd != -1) {
+        close(vq->kick_fd);
+        vq->kick_fd = -1;
+    }
+}
+
+static void vub_reset_vq(VubVirtq *vq)
+{
+    vub_stop_vq(vq);
+    *vq = (VubVirtq) {
+        .call_fd = -1,
+        .kick_fd = -1,
+        .enable = true,
+    };
+}
+
+static void vub_unmap_regions(VubDev *dev)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubDevRegion *r = &dev->regions[i];
+
+        munmap((void *)(uintptr_t)r->mmap_addr, r->size + r->mmap_offset);
+    }
+    dev->nregions = 0;
+}
+
+static int vub_get_features_exec(VubDev *dev, VhostUserMsg *vmsg)
+{
+    vmsg->payload.u64 = (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+                        (1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+                        (1ULL << VIRTIO_BLK_F_FLUSH) |
+                        (1ULL << VIRTIO_F_VERSION_1) |
+                        (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+    if (dev->num_queues > 1) {
+        vmsg->payload.u64 |= 1ULL << VIRTIO_BLK_F_MQ;
+    }
+    if (dev->readonly) {
+        vmsg->payload.u64 |= 1ULL << VIRTIO_BLK_F_RO;
+    }
+    vmsg->size = sizeof(vmsg->payload.u64);
+
+    /* Reply */
+    return 1;
+}
+
+static int vub_set_mem_table_exec(VubDev *dev, VhostUserMsg *vmsg)
+{
+    VhostUserMemory *memory = &vmsg->payload.memory;
+    int i;
+
+    vub_unmap_regions(dev);
+    if (memory->nregions > VHOST_MEMORY_MAX_NREGIONS ||
+        memory->nregions != vmsg->fd_num) {
+        fprintf(stderr, "Invalid memory table\n");
+        return -1;
+    }
+
+    for (i = 0; i < memory->nregions; i++) {
+        VhostUserMemoryRegion *msg_region = &memory->regions[i];
+        VubDevRegion *dev_region = &dev->regions[i];
+        void *mmap_addr;
+
+        /* The mapping has to start at a page boundary, so leave the
+         * offset in front of the region mapped too.
+         */
+        mmap_addr = mmap(0, msg_region->memory_size + msg_region->mmap_offset,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, vmsg->fds[i], 0);
+        close(vmsg->fds[i]);
+        if (mmap_addr == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+
+        dev_region->gpa = msg_region->guest_phys_addr;
+        dev_region->size = msg_region->memory_size;
+        dev_region->qva = msg_region->userspace_addr;
+        dev_region->mmap_offset = msg_region->mmap_offset;
+        dev_region->mmap_addr = (uint64_t)(uintptr_t)mmap_addr;
+        dev->nregions++;
+    }
+
+    return 0;
+}
+
+static int vub_set_vring_addr_exec(VubDev *dev, VubVirtq *vq,
+                                   VhostUserMsg *vmsg)
+{
+    struct vhost_vring_addr *vra = &vmsg->payload.addr;
+
+    vq->desc = qva_to_va(dev, vra->desc_user_addr);
+    vq->used = qva_to_va(dev, vra->used_user_addr);
+    vq->avail = qva_to_va(dev, vra->avail_user_addr);
+    if (!vq->desc || !vq->used || !vq->avail) {
+        fprintf(stderr, "Invalid vring address\n");
+        vq->desc = NULL;
+        vq->used = NULL;
+        vq->avail = NULL;
+        return -1;
+    }
+
+    /* Requests are completed in order, everything before used->idx is done */
+    vq->last_used_index = atomic_read(&vq->used->idx);
+    if (vq->last_avail_index != vq->last_used_index) {
+        DPRINT("Resuming vq %td from used index %d\n", vq - dev->vq,
+               vq->last_used_index);
+        vq->last_avail_index = vq->last_used_index;
+    }
+
+    return 0;
+}
+
+static int vub_get_vring_base_exec(VubDev *dev, VubVirtq *vq,
+                                   VhostUserMsg *vmsg)
+{
+    /* Nothing is in flight, the ring can be stopped right away */
+    vmsg->payload.state.num = vq->last_avail_index;
+    vmsg->size = sizeof(vmsg->payload.state);
+    vub_stop_vq(vq);
+
+    /* Reply */
+    return 1;
+}
+
+static int vub_set_vring_fd_exec(VubDev *dev, VhostUserMsg *vmsg, bool kick)
+{
+    int index = vmsg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+    VubVirtq *vq;
+    int *fd;
+
+    if (index >= dev->num_queues) {
+        fprintf(stderr, "Invalid vq index %d\n", index);
+        return -1;
+    }
+    vq = &dev->vq[index];
+    fd = kick ? &vq->kick_fd : &vq->call_fd;
+
+    if (*fd != -1) {
+        close(*fd);
+    }
+    *fd = -1;
+    if (!(vmsg->payload.u64 & VHOST_USER_VRING_NOFD_MASK)) {
+        if (vmsg->fd_num != 1) {
+            return -1;
+        }
+        *fd = vmsg->fds[0];
+    }
+
+    /* Requests may have been queued before the kick fd was known */
+    if (kick) {
+        vub_process_vq(dev, vq);
+    }
+    return 0;
+}
+
+static int vub_get_config_exec(VubDev *dev, VhostUserMsg *vmsg)
+{
+    VhostUserConfig *config = &vmsg->payload.config;
+    struct virtio_blk_config blkcfg = {
+        .capacity = dev->capacity,
+        .seg_max = VUB_SEG_MAX,
+        .blk_size = 1 << VUB_SECTOR_BITS,
+        .num_queues = dev->num_queues,
+    };
+
+    if (config->offset > sizeof(blkcfg) ||
+        config->size > VHOST_USER_MAX_CONFIG_SIZE) {
+        return -1;
+    }
+
+    memset(config->region, 0, config->size);
+    memcpy(config->region, (uint8_t *)&blkcfg + config->offset,
+           MIN(config->size, sizeof(blkcfg) - config->offset));
+    vmsg->size = VHOST_USER_CONFIG_HDR_SIZE + config->size;
+
+    /* Reply */
+    return 1;
+}
+
+/* Returns 1 to send a reply, 0 for none and -1 to drop the connection */
+static int vub_execute_request(VubDev *dev, VhostUserMsg *vmsg)
+{
+    VubVirtq *vq = NULL;
+
+    DPRINT("Request %d, flags 0x%x, size %d, %d fds\n", vmsg->request,
+           vmsg->flags, vmsg->size, vmsg->fd_num);
+
+    switch (vmsg->request) {
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_ADDR:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ENABLE:
+        if (vmsg->payload.state.index >= dev->num_queues) {
+            fprintf(stderr, "Invalid vq index %u\n",
+                    vmsg->payload.state.index);
+            return -1;
+        }
+        vq = &dev->vq[vmsg->payload.state.index];
+        break;
+    default:
+        break;
+    }
+
+    switch (vmsg->request) {
+    case VHOST_USER_GET_FEATURES:
+        return vub_get_features_exec(dev, vmsg);
+    case VHOST_USER_SET_FEATURES:
+        dev->features = vmsg->payload.u64;
+        return 0;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        vmsg->payload.u64 = (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                            (1ULL << VHOST_USER_PROTOCOL_F_CONFIG);
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return 1;
+    case VHOST_USER_GET_QUEUE_NUM:
+        vmsg->payload.u64 = dev->num_queues;
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return 1;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        return 0;
+    case VHOST_USER_SET_MEM_TABLE:
+        return vub_set_mem_table_exec(dev, vmsg);
+    case VHOST_USER_SET_VRING_NUM:
+        vq->size = vmsg->payload.state.num;
+        return 0;
+    case VHOST_USER_SET_VRING_ADDR:
+        return vub_set_vring_addr_exec(dev, vq, vmsg);
+    case VHOST_USER_SET_VRING_BASE:
+        vq->last_avail_index = vmsg->payload.state.num;
+        return 0;
+    case VHOST_USER_GET_VRING_BASE:
+        return vub_get_vring_base_exec(dev, vq, vmsg);
+    case VHOST_USER_SET_VRING_KICK:
+        return vub_set_vring_fd_exec(dev, vmsg, true);
+    case VHOST_USER_SET_VRING_CALL:
+        return vub_set_vring_fd_exec(dev, vmsg, false);
+    case VHOST_USER_SET_VRING_ERR:
+        if (vmsg->fd_num) {
+            close(vmsg->fds[0]);
+        }
+        return 0;
+    case VHOST_USER_SET_VRING_ENABLE:
+        vq->enable = vmsg->payload.state.num;
+        return 0;
+    case VHOST_USER_GET_CONFIG:
+        return vub_get_config_exec(dev, vmsg);
+    default:
+        fprintf(stderr, "Unsupported request %d\n", vmsg->request);
+        return -1;
+    }
+}
+
+static ssize_t vub_read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t rc = read(fd, (uint8_t *)buf + done, len - done);
+
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+        done += rc;
+    }
+    return done;
+}
+
+static int vub_message_read(int conn_fd, VhostUserMsg *vmsg)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = (char *)vmsg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t rc;
+
+    do {
+        rc = recvmsg(conn_fd, &msg, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc <= 0) {
+        return -1;
+    }
+
+    vmsg->fd_num = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t fd_size = cmsg->cmsg_len - CMSG_LEN(0);
+
+            vmsg->fd_num = fd_size / sizeof(int);
+            memcpy(vmsg->fds, CMSG_DATA(cmsg), fd_size);
+            break;
+        }
+    }
+
+    if (rc < VHOST_USER_HDR_SIZE &&
+        vub_read_full(conn_fd, (uint8_t *)vmsg + rc,
+                      VHOST_USER_HDR_SIZE - rc) < 0) {
+        return -1;
+    }
+
+    if (vmsg->size > sizeof(vmsg->payload)) {
+        fprintf(stderr, "Message too big: request %d, size %u\n",
+                vmsg->request, vmsg->size);
+        return -1;
+    }
+
+    if (vmsg->size &&
+        vub_read_full(conn_fd, &vmsg->payload, vmsg->size) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vub_message_write(int conn_fd, VhostUserMsg *vmsg)
+{
+    ssize_t rc;
+
+    /* Set the version in the flags when sending the reply */
+    vmsg->flags &= ~VHOST_USER_VERSION_MASK;
+    vmsg->flags |= VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+
+    do {
+        rc = write(conn_fd, vmsg, VHOST_USER_HDR_SIZE + vmsg->size);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc == VHOST_USER_HDR_SIZE + vmsg->size ? 0 : -1;
+}
+
+/* Drop all the state of the connection, QEMU sends it again */
+static void vub_disconnect(VubDev *dev)
+{
+    int i;
+
+    DPRINT("QEMU disconnected\n");
+    close(dev->conn_fd);
+    dev->conn_fd = -1;
+    for (i = 0; i < dev->num_queues; i++) {
+        vub_reset_vq(&dev->vq[i]);
+    }
+    vub_unmap_regions(dev);
+    dev->features = 0;
+}
+
+static void vub_receive(VubDev *dev)
+{
+    VhostUserMsg vmsg;
+    int ret;
+
+    if (vub_message_read(dev->conn_fd, &vmsg) < 0) {
+        vub_disconnect(dev);
+        return;
+    }
+
+    ret = vub_execute_request(dev, &vmsg);
+    if (ret > 0) {
+        ret = vub_message_write(dev->conn_fd, &vmsg);
+    }
+    if (ret < 0) {
+        vub_disconnect(dev);
+    }
+}
+
+static void vub_connect(VubDev *dev)
+{
+    struct sockaddr_un un = { .sun_family = AF_UNIX };
+
+    if (!dev->client) {
+        dev->conn_fd = accept(dev->listen_fd, NULL, NULL);
+        if (dev->conn_fd == -1) {
+            vub_die("accept");
+        }
+        DPRINT("QEMU connected\n");
+        return;
+    }
+
+    dev->conn_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (dev->conn_fd == -1) {
+        vub_die("socket");
+    }
+    pstrcpy(un.sun_path, sizeof(un.sun_path), dev->sock_path);
+    while (connect(dev->conn_fd, (struct sockaddr *)&un, sizeof(un)) == -1) {
+        DPRINT("Waiting for QEMU on %s\n", dev->sock_path);
+        sleep(1);
+    }
+    DPRINT("Connected to QEMU\n");
+}
+
+static void vub_listen(VubDev *dev)
+{
+    struct sockaddr_un un = { .sun_family = AF_UNIX };
+
+    dev->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (dev->listen_fd == -1) {
+        vub_die("socket");
+    }
+
+    pstrcpy(un.sun_path, sizeof(un.sun_path), dev->sock_path);
+    unlink(dev->sock_path);
+    if (bind(dev->listen_fd, (struct sockaddr *)&un, sizeof(un)) == -1) {
+        vub_die("bind");
+    }
+    if (listen(dev->listen_fd, 1) == -1) {
+        vub_die("listen");
+    }
+    DPRINT("Waiting for connections on UNIX socket %s\n", dev->sock_path);
+}
+
+static void vub_run(VubDev *dev)
+{
+    struct pollfd fds[VUB_MAX_QUEUES + 1];
+    int i, n;
+
+    for (;;) {
+        if (dev->conn_fd == -1) {
+            vub_connect(dev);
+        }
+
+        fds[0] = (struct pollfd) { .fd = dev->conn_fd, .events = POLLIN };
+        for (i = 0, n = 1; i < dev->num_queues; i++) {
+            fds[n++] = (struct pollfd) {
+                .fd = dev->vq[i].kick_fd,
+                .events = POLLIN,
+            };
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            vub_die("poll");
+        }
+
+        /* Kicks first, a message may close the eventfds */
+        for (i = 0; i < dev->num_queues; i++) {
+            if (fds[i + 1].revents & POLLIN) {
+                eventfd_t kick_data;
+
+                eventfd_read(dev->vq[i].kick_fd, &kick_data);
+                vub_process_vq(dev, &dev->vq[i]);
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            vub_receive(dev);
+        }
+    }
+}
+
+static void vub_usage(const char *progname)
+{
+    printf("Usage: %s [OPTION]... -b <image> -s <unix-socket-path>\n"
+           "  -h: show this help\n"
+           "  -v: verbose mode\n"
+           "  -b <image>: the image file or block device to serve\n"
+           "  -s <unix-socket-path>: path to the unix socket\n"
+           "  -c: connect to QEMU instead of waiting for it\n"
+           "  -r: read-only\n"
+           "  -q <queues>: number of virtqueues, up to %d, default 1\n",
+           progname, VUB_MAX_QUEUES);
+}
+
+int main(int argc, char *argv[])
+{
+    VubDev dev = {
+        .listen_fd = -1,
+        .conn_fd = -1,
+        .num_queues = 1,
+    };
+    const char *blk_path = NULL;
+    off_t size;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "hvb:s:crq:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'b':
+            blk_path = optarg;
+            break;
+        case 's':
+            dev.sock_path = optarg;
+            break;
+        case 'c':
+            dev.client = true;
+            break;
+        case 'r':
+            dev.readonly = true;
+            break;
+        case 'q':
+            dev.num_queues = atoi(optarg);
+            break;
+        case 'h':
+            vub_usage(argv[0]);
+            return 0;
+        default:
+            vub_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!blk_path || !dev.sock_path ||
+        dev.num_queues < 1 || dev.num_queues > VUB_MAX_QUEUES) {
+        vub_usage(argv[0]);
+        return 1;
+    }
+
+    dev.blk_fd = open(blk_path, dev.readonly ? O_RDONLY : O_RDWR);
+    if (dev.blk_fd == -1) {
+        vub_die("open");
+    }
+    size = lseek(dev.blk_fd, 0, SEEK_END);
+    if (size == -1) {
+        vub_die("lseek");
+    }
+    dev.capacity = size >> VUB_SECTOR_BITS;
+
+    for (i = 0; i < VUB_MAX_QUEUES; i++) {
+        vub_reset_vq(&dev.vq[i]);
+    }
+
+    /* A dying QEMU must not take the backend down with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!dev.client) {
+        vub_listen(&dev);
+    }
+    vub_run(&dev);
+    return 0;
+}
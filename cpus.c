@@ -40,6 +40,7 @@
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
 #include "sysemu/qtest.h"
+#include "sysemu/numa.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
@@ -76,6 +77,7 @@ int64_t max_advance;
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+static int64_t throttle_period_ns;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -344,7 +346,7 @@ static int64_t qemu_icount_round(int64_t count)
     return (count + (1 << icount_time_shift) - 1) >> icount_time_shift;
 }
 
-static void icount_warp_rt(void)
+static bool icount_warp_pending(void)
 {
     unsigned seq;
     int64_t warp_start;
@@ -357,7 +359,12 @@ static void icount_warp_rt(void)
         warp_start = vm_clock_warp_start;
     } while (seqlock_read_retry(&timers_state.vm_clock_seqlock, seq));
 
-    if (warp_start == -1) {
+    return warp_start != -1;
+}
+
+static void icount_warp_rt(void)
+{
+    if (!icount_warp_pending()) {
         return;
     }
 
@@ -447,7 +454,6 @@ void qemu_start_warp_timer(void)
     }
 
     /* We want to use the earliest deadline from ALL vm_clocks */
-    clock = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT);
     deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
     if (deadline < 0) {
         static bool notified;
@@ -487,6 +493,7 @@ void qemu_start_warp_timer(void)
              * you will not be sending network packets continuously instead of
              * every 100ms.
              */
+            clock = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT);
             seqlock_write_begin(&timers_state.vm_clock_seqlock);
             if (vm_clock_warp_start == -1 || vm_clock_warp_start > clock) {
                 vm_clock_warp_start = clock;
@@ -517,6 +524,14 @@ static void qemu_account_warp_timer(void)
         return;
     }
 
+    /* This runs before every round of execution, but a warp is only
+     * pending if all vCPUs went idle.  Do not take the timer list lock
+     * in timer_del() for nothing.
+     */
+    if (!icount_warp_pending()) {
+        return;
+    }
+
     timer_del(icount_warp_timer);
     icount_warp_rt();
 }
@@ -560,16 +575,18 @@ static const VMStateDescription vmstate_timers = {
 static void cpu_throttle_thread(CPUState *cpu, void *opaque)
 {
     double pct;
-    double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_get_vcpu_percentage(cpu)) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    /* Sleep for pct of the timer period, which is sized so that the
+     * most throttled vcpu still runs for CPU_THROTTLE_TIMESLICE_NS.
+     */
+    pct = (double)cpu_throttle_get_vcpu_percentage(cpu) / 100;
+    sleeptime_ns = (long)(pct * atomic_read(&throttle_period_ns));
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
@@ -580,21 +597,31 @@ static void cpu_throttle_thread(CPUState *cpu, void *opaque)
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
+    int max_pct = 0;
     double pct;
 
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, cpu_throttle_get_vcpu_percentage(cpu));
+    }
+
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!max_pct) {
         return;
     }
+
+    pct = (double)max_pct / 100;
+    atomic_set(&throttle_period_ns,
+               (int64_t)(CPU_THROTTLE_TIMESLICE_NS / (1 - pct)));
+
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_get_vcpu_percentage(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread, NULL);
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   atomic_read(&throttle_period_ns));
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -609,14 +636,44 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    if (new_throttle_pct) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    if (new_throttle_pct && !timer_pending(throttle_timer)) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
 {
-    return (cpu_throttle_get_percentage() != 0);
+    CPUState *cpu;
+
+    if (cpu_throttle_get_percentage()) {
+        return true;
+    }
+    CPU_FOREACH(cpu) {
+        if (atomic_read(&cpu->throttle_percentage)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 int cpu_throttle_get_percentage(void)
@@ -624,6 +681,12 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               atomic_read(&cpu->throttle_percentage));
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock);
@@ -980,6 +1043,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     cpu->thread_id = qemu_get_thread_id();
     cpu->can_do_io = 1;
     current_cpu = cpu;
+    numa_vcpu_thread_init(cpu);
 
     r = kvm_init_vcpu(cpu);
     if (r < 0) {
@@ -32,6 +32,7 @@
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
 #include "exec/log.h"
+#include "qemu/main-loop.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -61,6 +62,60 @@
 /* statistics */
 int tlb_flush_count;
 
+/* Pick the victim TLB size for the next flush interval of a mode.
+ * A mode that was filled with more pages than the main and victim TLB
+ * can hold together has a working set that does not fit, so its victim
+ * TLB doubles; a mode that saw little use and no victim hits halves it,
+ * which keeps both flushing and the victim search cheap.
+ */
+static size_t tlb_vtlb_resize(const CPUTLBDesc *desc)
+{
+    size_t old_size = desc->vtlb_size;
+
+    if (old_size == 0) {
+        return CPU_VTLB_MIN_SIZE;
+    }
+    if (desc->n_fills > CPU_TLB_SIZE + old_size &&
+        old_size < CPU_VTLB_MAX_SIZE) {
+        return old_size * 2;
+    }
+    if (desc->n_vhits == 0 && desc->n_fills < CPU_TLB_SIZE / 2 &&
+        old_size > CPU_VTLB_MIN_SIZE) {
+        return old_size / 2;
+    }
+    return old_size;
+}
+
+/* Drop every entry of @mmu_idx and resize its victim TLB.
+ *
+ * Victim entries at or beyond vtlb_size are kept invalid, so only the
+ * part in use has to be cleared.  A vtlb_size of zero means the
+ * descriptor was wiped together with the tables (e.g. by a CPU reset
+ * that zeroes env), in which case everything is cleared.
+ */
+static void tlb_flush_one_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+    size_t old_size = desc->vtlb_size;
+
+    if (!desc->clean) {
+        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+        if (old_size == 0) {
+            memset(env->tlb_v_table[mmu_idx], -1,
+                   sizeof(env->tlb_v_table[0]));
+        } else {
+            memset(env->tlb_v_table[mmu_idx], -1,
+                   old_size * sizeof(CPUTLBEntry));
+        }
+    }
+
+    desc->vtlb_size = tlb_vtlb_resize(desc);
+    desc->vtlb_index = 0;
+    desc->n_fills = 0;
+    desc->n_vhits = 0;
+    desc->clean = true;
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -76,36 +131,52 @@ int tlb_flush_count;
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     tlb_debug("(%d)\n", flush_global);
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(env, mmu_idx);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
-    env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+static inline unsigned long make_mmu_index_bitmap(va_list args)
 {
-    CPUArchState *env = cpu->env_ptr;
-
-    tlb_debug("start\n");
+    unsigned long bitmap = 0;
+    int mmu_index;
 
     for (;;) {
-        int mmu_idx = va_arg(argp, int);
+        mmu_index = va_arg(args, int);
 
-        if (mmu_idx < 0) {
+        if (mmu_index < 0) {
             break;
         }
 
-        tlb_debug("%d\n", mmu_idx);
+        assert(mmu_index < NB_MMU_MODES);
+        bitmap |= 1UL << mmu_index;
+    }
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+    return bitmap;
+}
+
+static void tlb_flush_by_mmuidx_bitmap(CPUState *cpu, unsigned long idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+    tlb_debug("start: mmu_idx:0x%04lx\n", idxmap);
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (test_bit(mmu_idx, &idxmap)) {
+            tlb_debug("%d\n", mmu_idx);
+
+            tlb_flush_one_mmuidx(env, mmu_idx);
+        }
     }
 
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
@@ -114,9 +185,13 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+    unsigned long idxmap;
+
     va_start(argp, cpu);
-    v_tlb_flush_by_mmuidx(cpu, argp);
+    idxmap = make_mmu_index_bitmap(argp);
     va_end(argp);
+
+    tlb_flush_by_mmuidx_bitmap(cpu, idxmap);
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
@@ -158,7 +233,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     /* check whether there are entries that need to be flushed in the vtlb */
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < env->tlb_d[mmu_idx].vtlb_size; k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
@@ -169,12 +244,15 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
 void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i, k;
+    unsigned long idxmap;
+    int i, k, mmu_idx;
     va_list argp;
 
     va_start(argp, addr);
+    idxmap = make_mmu_index_bitmap(argp);
+    va_end(argp);
 
-    tlb_debug("addr "TARGET_FMT_lx"\n", addr);
+    tlb_debug("addr "TARGET_FMT_lx" mmu_idx:0x%04lx\n", addr, idxmap);
 
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
@@ -182,19 +260,16 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
+        tlb_flush_by_mmuidx_bitmap(cpu, idxmap);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
-
-        if (mmu_idx < 0) {
-            break;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!test_bit(mmu_idx, &idxmap)) {
+            continue;
         }
 
         tlb_debug("idx %d\n", mmu_idx);
@@ -202,11 +277,10 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
 
         /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < env->tlb_d[mmu_idx].vtlb_size; k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
-    va_end(argp);
 
     tb_flush_jmp_cache(cpu, addr);
 }
@@ -266,12 +340,16 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
 
+        if (env->tlb_d[mmu_idx].clean) {
+            continue;
+        }
+
         for (i = 0; i < CPU_TLB_SIZE; i++) {
             tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                   start1, length);
         }
 
-        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        for (i = 0; i < env->tlb_d[mmu_idx].vtlb_size; i++) {
             tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
                                   start1, length);
         }
@@ -301,7 +379,7 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < env->tlb_d[mmu_idx].vtlb_size; k++) {
             tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
         }
     }
@@ -348,10 +426,19 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     target_ulong code_address;
     uintptr_t addend;
     CPUTLBEntry *te;
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
     hwaddr iotlb, xlat, sz;
-    unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+    unsigned vidx;
     int asidx = cpu_asidx_from_attrs(cpu, attrs);
 
+    if (unlikely(desc->vtlb_size == 0)) {
+        /* The tables were zeroed without a flush; start from scratch.  */
+        tlb_flush_one_mmuidx(env, mmu_idx);
+    }
+    vidx = desc->vtlb_index++ % desc->vtlb_size;
+    desc->n_fills++;
+    desc->clean = false;
+
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
@@ -503,8 +590,10 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
                            size_t elt_ofs, target_ulong page)
 {
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
     size_t vidx;
-    for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
+
+    for (vidx = 0; vidx < desc->vtlb_size; ++vidx) {
         CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][vidx];
         target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
 
@@ -516,6 +605,7 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 
             tmptlb = *tlb; *tlb = *vtlb; *vtlb = tmptlb;
             tmpio = *io; *io = *vio; *vio = tmpio;
+            desc->n_vhits++;
             return true;
         }
     }
@@ -404,8 +404,10 @@ qcrypto_block_luks_essiv_cipher(QCryptoCipherAlgorithm cipher,
 }
 
 /*
- * Given a key slot, and user password, this will attempt to unlock
- * the master encryption key from the key slot.
+ * Given a key slot, its encrypted key material in @splitkey and
+ * the user password, this will attempt to unlock the master
+ * encryption key from the key slot.  @splitkey is decrypted in
+ * place.  This does no I/O, so it may run in any thread.
  *
  * Returns:
  *    0 if the key slot is disabled, or key could not be decrypted
@@ -426,16 +428,13 @@ qcrypto_block_luks_load_key(QCryptoBlock *block,
                             QCryptoHashAlgorithm ivhash,
                             uint8_t *masterkey,
                             size_t masterkeylen,
-                            QCryptoBlockReadFunc readfunc,
-                            void *opaque,
+                            uint8_t *splitkey,
                             Error **errp)
 {
     QCryptoBlockLUKS *luks = block->opaque;
-    uint8_t *splitkey;
     size_t splitkeylen;
     uint8_t *possiblekey;
     int ret = -1;
-    ssize_t rv;
     QCryptoCipher *cipher = NULL;
     uint8_t keydigest[QCRYPTO_BLOCK_LUKS_DIGEST_LEN];
     QCryptoIVGen *ivgen = NULL;
@@ -446,7 +445,6 @@ qcrypto_block_luks_load_key(QCryptoBlock *block,
     }
 
     splitkeylen = masterkeylen * slot->stripes;
-    splitkey = g_new0(uint8_t, splitkeylen);
     possiblekey = g_new0(uint8_t, masterkeylen);
 
     /*
@@ -465,23 +463,6 @@ qcrypto_block_luks_load_key(QCryptoBlock *block,
         goto cleanup;
     }
 
-    /*
-     * We need to read the master key material from the
-     * LUKS key material header. What we're reading is
-     * not the raw master key, but rather the data after
-     * it has been passed through AFSplit and the result
-     * then encrypted.
-     */
-    rv = readfunc(block,
-                  slot->key_offset * QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
-                  splitkey, splitkeylen,
-                  errp,
-                  opaque);
-    if (rv < 0) {
-        goto cleanup;
-    }
-
-
     /* Setup the cipher/ivgen that we'll use to try to decrypt
      * the split master key material */
     cipher = qcrypto_cipher_new(cipheralg, ciphermode,
@@ -510,14 +491,14 @@ qcrypto_block_luks_load_key(QCryptoBlock *block,
      * to reset the encryption cipher every time the master
      * key crosses a sector boundary.
      */
-    if (qcrypto_block_decrypt_helper(cipher,
-                                     niv,
-                                     ivgen,
-                                     QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
-                                     0,
-                                     splitkey,
-                                     splitkeylen,
-                                     errp) < 0) {
+    if (qcrypto_block_cipher_decrypt_helper(cipher,
+                                            niv,
+                                            ivgen,
+                                            QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
+                                            0,
+                                            splitkey,
+                                            splitkeylen,
+                                            errp) < 0) {
         goto cleanup;
     }
 
@@ -567,16 +548,57 @@ qcrypto_block_luks_load_key(QCryptoBlock *block,
  cleanup:
     qcrypto_ivgen_free(ivgen);
     qcrypto_cipher_free(cipher);
-    g_free(splitkey);
     g_free(possiblekey);
     return ret;
 }
 
 
+typedef struct QCryptoBlockLUKSKeyJob {
+    QemuThread thread;
+    QCryptoBlock *block;
+    QCryptoBlockLUKSKeySlot *slot;
+    const char *password;
+    QCryptoCipherAlgorithm cipheralg;
+    QCryptoCipherMode ciphermode;
+    QCryptoHashAlgorithm hash;
+    QCryptoIVGenAlgorithm ivalg;
+    QCryptoCipherAlgorithm ivcipheralg;
+    QCryptoHashAlgorithm ivhash;
+    uint8_t *masterkey;
+    size_t masterkeylen;
+    uint8_t *splitkey;
+    int ret;
+    Error *err;
+} QCryptoBlockLUKSKeyJob;
+
+static void *qcrypto_block_luks_load_key_job(void *opaque)
+{
+    QCryptoBlockLUKSKeyJob *job = opaque;
+
+    job->ret = qcrypto_block_luks_load_key(job->block,
+                                           job->slot,
+                                           job->password,
+                                           job->cipheralg,
+                                           job->ciphermode,
+                                           job->hash,
+                                           job->ivalg,
+                                           job->ivcipheralg,
+                                           job->ivhash,
+                                           job->masterkey,
+                                           job->masterkeylen,
+                                           job->splitkey,
+                                           &job->err);
+    return NULL;
+}
+
+
 /*
- * Given a user password, this will iterate over all key
- * slots and try to unlock each active key slot using the
- * password until it successfully obtains a master key.
+ * Given a user password, this will try to unlock each active
+ * key slot using the password until it successfully obtains
+ * a master key.  The key material of all slots is read first,
+ * then the slots are tried in parallel threads, since the
+ * PBKDF2 iterations of each slot are the bulk of the time
+ * needed to open the volume.
  *
  * Returns 0 if a key was loaded, -1 if no keys could be loaded
  */
@@ -596,42 +618,104 @@ qcrypto_block_luks_find_key(QCryptoBlock *block,
                             Error **errp)
 {
     QCryptoBlockLUKS *luks = block->opaque;
-    size_t i;
-    int rv;
+    QCryptoBlockLUKSKeyJob jobs[QCRYPTO_BLOCK_LUKS_NUM_KEY_SLOTS];
+    QCryptoBlockLUKSKeyJob *found = NULL;
+    Error *err = NULL;
+    size_t i, njobs = 0;
+    int ret = -1;
+    ssize_t rv;
 
-    *masterkey = g_new0(uint8_t, luks->header.key_bytes);
-    *masterkeylen = luks->header.key_bytes;
+    *masterkey = NULL;
+    *masterkeylen = 0;
 
+    memset(jobs, 0, sizeof(jobs));
     for (i = 0; i < QCRYPTO_BLOCK_LUKS_NUM_KEY_SLOTS; i++) {
-        rv = qcrypto_block_luks_load_key(block,
-                                         &luks->header.key_slots[i],
-                                         password,
-                                         cipheralg,
-                                         ciphermode,
-                                         hash,
-                                         ivalg,
-                                         ivcipheralg,
-                                         ivhash,
-                                         *masterkey,
-                                         *masterkeylen,
-                                         readfunc,
-                                         opaque,
-                                         errp);
+        QCryptoBlockLUKSKeySlot *slot = &luks->header.key_slots[i];
+        QCryptoBlockLUKSKeyJob *job;
+        size_t splitkeylen;
+
+        if (slot->active != QCRYPTO_BLOCK_LUKS_KEY_SLOT_ENABLED) {
+            continue;
+        }
+
+        job = &jobs[njobs++];
+        job->block = block;
+        job->slot = slot;
+        job->password = password;
+        job->cipheralg = cipheralg;
+        job->ciphermode = ciphermode;
+        job->hash = hash;
+        job->ivalg = ivalg;
+        job->ivcipheralg = ivcipheralg;
+        job->ivhash = ivhash;
+        job->masterkeylen = luks->header.key_bytes;
+        job->masterkey = g_new0(uint8_t, job->masterkeylen);
+
+        /*
+         * We need to read the master key material from the
+         * LUKS key material header. What we're reading is
+         * not the raw master key, but rather the data after
+         * it has been passed through AFSplit and the result
+         * then encrypted.
+         */
+        splitkeylen = job->masterkeylen * slot->stripes;
+        job->splitkey = g_new0(uint8_t, splitkeylen);
+        rv = readfunc(block,
+                      slot->key_offset * QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
+                      job->splitkey, splitkeylen,
+                      errp,
+                      opaque);
         if (rv < 0) {
-            goto error;
+            goto cleanup;
         }
-        if (rv == 1) {
-            return 0;
+    }
+
+    if (njobs == 1) {
+        qcrypto_block_luks_load_key_job(&jobs[0]);
+    } else {
+        for (i = 0; i < njobs; i++) {
+            qemu_thread_create(&jobs[i].thread, "luks-keyslot",
+                               qcrypto_block_luks_load_key_job, &jobs[i],
+                               QEMU_THREAD_JOINABLE);
+        }
+        for (i = 0; i < njobs; i++) {
+            qemu_thread_join(&jobs[i].thread);
         }
     }
 
-    error_setg(errp, "Invalid password, cannot unlock any keyslot");
+    /* Any slot that unlocks wins, even if another one had an error */
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].ret == 1 && !found) {
+            found = &jobs[i];
+        } else if (jobs[i].ret < 0 && !err) {
+            err = jobs[i].err;
+            jobs[i].err = NULL;
+        }
+    }
 
- error:
-    g_free(*masterkey);
-    *masterkey = NULL;
-    *masterkeylen = 0;
-    return -1;
+    if (found) {
+        *masterkey = found->masterkey;
+        *masterkeylen = found->masterkeylen;
+        found->masterkey = NULL;
+        ret = 0;
+    } else if (err) {
+        error_propagate(errp, err);
+        err = NULL;
+    } else {
+        error_setg(errp, "Invalid password, cannot unlock any keyslot");
+    }
+
+ cleanup:
+    error_free(err);
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].masterkey) {
+            memset(jobs[i].masterkey, 0, jobs[i].masterkeylen);
+        }
+        g_free(jobs[i].masterkey);
+        g_free(jobs[i].splitkey);
+        error_free(jobs[i].err);
+    }
+    return ret;
 }
 
 
@@ -641,6 +725,7 @@ qcrypto_block_luks_open(QCryptoBlock *block,
                         QCryptoBlockReadFunc readfunc,
                         void *opaque,
                         unsigned int flags,
+                        size_t n_threads,
                         Error **errp)
 {
     QCryptoBlockLUKS *luks;
@@ -840,11 +925,10 @@ qcrypto_block_luks_open(QCryptoBlock *block,
             goto fail;
         }
 
-        block->cipher = qcrypto_cipher_new(cipheralg,
-                                           ciphermode,
-                                           masterkey, masterkeylen,
-                                           errp);
-        if (!block->cipher) {
+        ret = qcrypto_block_init_cipher(block, cipheralg, ciphermode,
+                                        masterkey, masterkeylen, n_threads,
+                                        errp);
+        if (ret < 0) {
             ret = -ENOTSUP;
             goto fail;
         }
@@ -866,7 +950,7 @@ qcrypto_block_luks_open(QCryptoBlock *block,
 
  fail:
     g_free(masterkey);
-    qcrypto_cipher_free(block->cipher);
+    qcrypto_block_free_cipher(block);
     qcrypto_ivgen_free(block->ivgen);
     g_free(luks);
     g_free(password);
@@ -1031,11 +1115,10 @@ qcrypto_block_luks_create(QCryptoBlock *block,
 
 
     /* Setup the block device payload encryption objects */
-    block->cipher = qcrypto_cipher_new(luks_opts.cipher_alg,
-                                       luks_opts.cipher_mode,
-                                       masterkey, luks->header.key_bytes,
-                                       errp);
-    if (!block->cipher) {
+    if (qcrypto_block_init_cipher(block, luks_opts.cipher_alg,
+                                  luks_opts.cipher_mode,
+                                  masterkey, luks->header.key_bytes,
+                                  1, errp) < 0) {
         goto error;
     }
 
@@ -1220,12 +1303,12 @@ qcrypto_block_luks_create(QCryptoBlock *block,
 
     /* Now we encrypt the split master key with the key generated
      * from the user's password, before storing it */
-    if (qcrypto_block_encrypt_helper(cipher, block->niv, ivgen,
-                                     QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
-                                     0,
-                                     splitkey,
-                                     splitkeylen,
-                                     errp) < 0) {
+    if (qcrypto_block_cipher_encrypt_helper(cipher, block->niv, ivgen,
+                                            QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
+                                            0,
+                                            splitkey,
+                                            splitkeylen,
+                                            errp) < 0) {
         goto error;
     }
 
@@ -1404,8 +1487,7 @@ qcrypto_block_luks_decrypt(QCryptoBlock *block,
                            size_t len,
                            Error **errp)
 {
-    return qcrypto_block_decrypt_helper(block->cipher,
-                                        block->niv, block->ivgen,
+    return qcrypto_block_decrypt_helper(block,
                                         QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
                                         startsector, buf, len, errp);
 }
@@ -1418,8 +1500,7 @@ qcrypto_block_luks_encrypt(QCryptoBlock *block,
                            size_t len,
                            Error **errp)
 {
-    return qcrypto_block_encrypt_helper(block->cipher,
-                                        block->niv, block->ivgen,
+    return qcrypto_block_encrypt_helper(block,
                                         QCRYPTO_BLOCK_LUKS_SECTOR_SIZE,
                                         startsector, buf, len, errp);
 }
@@ -31,6 +31,18 @@
 
 #include <gnutls/x509.h>
 
+#ifdef CONFIG_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -500,6 +512,116 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+#ifdef CONFIG_KTLS
+typedef union QCryptoTLSKernelInfo {
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+#ifdef TLS_CIPHER_AES_GCM_256
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+#endif
+} QCryptoTLSKernelInfo;
+
+/*
+ * The kernel wants the 4 byte implicit nonce as salt, and for
+ * TLS 1.2 the explicit nonce starts as the sequence number, as
+ * gnutls does it.
+ */
+#define QCRYPTO_TLS_KERNEL_INFO(info, bits, key, iv, seq)               \
+    do {                                                                \
+        QEMU_BUILD_BUG_ON(TLS_CIPHER_AES_GCM_##bits##_SALT_SIZE != 4);  \
+        (info)->info.version = TLS_1_2_VERSION;                         \
+        (info)->info.cipher_type = TLS_CIPHER_AES_GCM_##bits;           \
+        memcpy((info)->key, (key)->data, sizeof((info)->key));          \
+        memcpy((info)->salt, (iv)->data, sizeof((info)->salt));         \
+        memcpy((info)->iv, seq, sizeof((info)->iv));                    \
+        memcpy((info)->rec_seq, seq, sizeof((info)->rec_seq));          \
+    } while (0)
+
+static bool
+qcrypto_tls_session_ktls_dir(QCryptoTLSSession *session,
+                             int fd, bool read)
+{
+    gnutls_datum_t mac_key, iv, cipher_key;
+    unsigned char seq[8];
+    QCryptoTLSKernelInfo info;
+    size_t len;
+    int ret;
+
+    if (gnutls_record_get_state(session->handle, read, &mac_key,
+                                &iv, &cipher_key, seq) < 0) {
+        return false;
+    }
+    if (iv.size < 4) {
+        return false;
+    }
+
+    memset(&info, 0, sizeof(info));
+    switch (gnutls_cipher_get(session->handle)) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        if (cipher_key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+            return false;
+        }
+        QCRYPTO_TLS_KERNEL_INFO(&info.aes128, 128, &cipher_key, &iv, seq);
+        len = sizeof(info.aes128);
+        break;
+#ifdef TLS_CIPHER_AES_GCM_256
+    case GNUTLS_CIPHER_AES_256_GCM:
+        if (cipher_key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE) {
+            return false;
+        }
+        QCRYPTO_TLS_KERNEL_INFO(&info.aes256, 256, &cipher_key, &iv, seq);
+        len = sizeof(info.aes256);
+        break;
+#endif
+    default:
+        return false;
+    }
+
+#ifdef TLS_RX
+    ret = setsockopt(fd, SOL_TLS, read ? TLS_RX : TLS_TX, &info, len);
+#else
+    ret = read ? -1 : setsockopt(fd, SOL_TLS, TLS_TX, &info, len);
+#endif
+    memset(&info, 0, sizeof(info));
+
+    return ret == 0;
+}
+
+
+void
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session,
+                                int fd, bool *tx, bool *rx)
+{
+    *tx = *rx = false;
+
+    assert(session->handshakeComplete);
+    if (gnutls_protocol_get_version(session->handle) != GNUTLS_TLS1_2) {
+        goto out;
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        goto out;
+    }
+
+    *tx = qcrypto_tls_session_ktls_dir(session, fd, false);
+
+    /* Records that gnutls already pulled off the socket would be lost */
+    if (!gnutls_record_check_pending(session->handle) &&
+        !gnutls_record_check_unprocessed(session->handle)) {
+        *rx = qcrypto_tls_session_ktls_dir(session, fd, true);
+    }
+
+ out:
+    trace_qcrypto_tls_session_ktls(session, fd, *tx, *rx);
+}
+#else /* ! CONFIG_KTLS */
+void
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session,
+                                int fd, bool *tx, bool *rx)
+{
+    *tx = *rx = false;
+}
+#endif
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -591,4 +713,12 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+void
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess,
+                                int fd, bool *tx, bool *rx)
+{
+    *tx = *rx = false;
+}
+
 #endif
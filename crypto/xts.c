@@ -24,20 +24,72 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "crypto/xts.h"
 
+/*
+ * Number of blocks passed to the cipher function at once.  Backends
+ * that implement the block cipher with AES-NI can then pipeline the
+ * rounds of several independent blocks.
+ */
+#define XTS_BATCH_BLOCKS 8
+
+/* Multiply the tweak by x in GF(2^128), as a 128-bit little endian value */
 static void xts_mult_x(uint8_t *I)
+{
+    uint64_t lo = ldq_le_p(I);
+    uint64_t hi = ldq_le_p(I + 8);
+    uint64_t carry = hi >> 63;
+
+    hi = (hi << 1) | (lo >> 63);
+    lo = (lo << 1) ^ (-carry & 0x87);
+    stq_le_p(I, lo);
+    stq_le_p(I + 8, hi);
+}
+
+static void xts_xor_block(uint8_t *dst, const uint8_t *src, const uint8_t *iv)
 {
     int x;
-    uint8_t t, tt;
 
-    for (x = t = 0; x < 16; x++) {
-        tt = I[x] >> 7;
-        I[x] = ((I[x] << 1) | t) & 0xFF;
-        t = tt;
+    for (x = 0; x < XTS_BLOCK_SIZE; x++) {
+        dst[x] = src[x] ^ iv[x];
     }
-    if (tt) {
-        I[0] ^= 0x87;
+}
+
+/*
+ * Encrypt or decrypt @nblocks full blocks in batches, advancing the
+ * tweak @T past them.
+ */
+static void xts_crypt_blocks(const void *ctx,
+                             xts_cipher_func *func,
+                             const uint8_t *src,
+                             uint8_t *dst,
+                             uint8_t *T,
+                             unsigned long nblocks)
+{
+    uint8_t tweaks[XTS_BATCH_BLOCKS][XTS_BLOCK_SIZE];
+
+    while (nblocks) {
+        unsigned long n = MIN(nblocks, XTS_BATCH_BLOCKS);
+        unsigned long i;
+
+        for (i = 0; i < n; i++) {
+            memcpy(tweaks[i], T, XTS_BLOCK_SIZE);
+            xts_xor_block(dst + i * XTS_BLOCK_SIZE,
+                          src + i * XTS_BLOCK_SIZE, T);
+            xts_mult_x(T);
+        }
+
+        func(ctx, n * XTS_BLOCK_SIZE, dst, dst);
+
+        for (i = 0; i < n; i++) {
+            xts_xor_block(dst + i * XTS_BLOCK_SIZE,
+                          dst + i * XTS_BLOCK_SIZE, tweaks[i]);
+        }
+
+        src += n * XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
+        nblocks -= n;
     }
 }
 
@@ -104,12 +156,9 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_decrypt(datactx, decfunc, src, dst, T);
-
-        src += XTS_BLOCK_SIZE;
-        dst += XTS_BLOCK_SIZE;
-    }
+    xts_crypt_blocks(datactx, decfunc, src, dst, T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -199,12 +248,9 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_encrypt(datactx, encfunc, src, dst, T);
-
-        dst += XTS_BLOCK_SIZE;
-        src += XTS_BLOCK_SIZE;
-    }
+    xts_crypt_blocks(datactx, encfunc, src, dst, T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -1173,6 +1173,47 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
     return 0;
 }
 
+/*
+ * The pages of a kdump-compressed dump are compressed by a pool of threads,
+ * a chunk of consecutive pages at a time.  The dump thread fills the chunks
+ * and writes them in order, so that the vmcore does not depend on the
+ * number of threads.
+ */
+#define DUMP_MAX_COMPRESS_THREADS 64
+#define DUMP_DEFAULT_COMPRESS_THREADS 8
+#define DUMP_CHUNK_PAGES 256
+
+typedef struct DumpPageChunk {
+    int nr_pages;
+    /* host address of each page */
+    uint8_t *pages[DUMP_CHUNK_PAGES];
+    /* compression format of each page, 0 if saved in plaintext */
+    uint32_t flags[DUMP_CHUNK_PAGES];
+    /* size of the data of each page, 0 for a zero page */
+    size_t size_out[DUMP_CHUNK_PAGES];
+    /* the compressed data of page i is at i * len_buf_out */
+    uint8_t *buf_out;
+    /* protected by DumpCompress.lock */
+    bool done;
+} DumpPageChunk;
+
+typedef struct DumpCompress {
+    DumpState *s;
+    size_t len_buf_out;
+    int nr_threads;
+    QemuThread *threads;
+    int nr_chunks;
+    DumpPageChunk *chunks;
+
+    QemuMutex lock;
+    QemuCond work_cond;         /* a chunk was filled */
+    QemuCond done_cond;         /* a chunk was compressed */
+    /* chunk sequence numbers, written with lock held */
+    uint64_t filled;
+    uint64_t compressed;
+    bool quit;
+} DumpCompress;
+
 /*
  * check if the page is all 0
  */
@@ -1181,20 +1222,192 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * Compress the page at @buf into @buf_out, whose size is passed in
+ * @size_out, and return the compression format used, or 0 if the page
+ * must be saved in plaintext.  Only one compression format will be used
+ * here, for s->flag_compress is set.  But when compression fails to work
+ * or does not reduce the size, we fall back to save in plaintext.
+ */
+static uint32_t compress_page(DumpState *s, const uint8_t *buf,
+                              uint8_t *buf_out, size_t *size_out,
+                              void *wrkmem)
+{
+    size_t page_size = s->dump_info.page_size;
+
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+            (compress2(buf_out, (uLongf *)size_out, buf, page_size,
+                       Z_BEST_SPEED) == Z_OK) &&
+            (*size_out < page_size)) {
+        return DUMP_DH_COMPRESSED_ZLIB;
+    }
+#ifdef CONFIG_LZO
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+            (lzo1x_1_compress(buf, page_size, buf_out,
+                              (lzo_uint *)size_out, wrkmem) == LZO_E_OK) &&
+            (*size_out < page_size)) {
+        return DUMP_DH_COMPRESSED_LZO;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+            (snappy_compress((char *)buf, page_size, (char *)buf_out,
+                             size_out) == SNAPPY_OK) &&
+            (*size_out < page_size)) {
+        return DUMP_DH_COMPRESSED_SNAPPY;
+    }
+#endif
+    return 0;
+}
+
+static void *compress_thread(void *opaque)
+{
+    DumpCompress *dc = opaque;
+    DumpState *s = dc->s;
+    size_t page_size = s->dump_info.page_size;
+    DumpPageChunk *chunk;
+    void *wrkmem = NULL;
+    int i;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&dc->lock);
+    for (;;) {
+        while (dc->compressed == dc->filled && !dc->quit) {
+            qemu_cond_wait(&dc->work_cond, &dc->lock);
+        }
+        if (dc->quit) {
+            break;
+        }
+        chunk = &dc->chunks[dc->compressed++ % dc->nr_chunks];
+        qemu_mutex_unlock(&dc->lock);
+
+        for (i = 0; i < chunk->nr_pages; i++) {
+            if (is_zero_page(chunk->pages[i], page_size)) {
+                chunk->flags[i] = 0;
+                chunk->size_out[i] = 0;
+                continue;
+            }
+
+            chunk->size_out[i] = dc->len_buf_out;
+            chunk->flags[i] = compress_page(s, chunk->pages[i],
+                                            chunk->buf_out +
+                                            i * dc->len_buf_out,
+                                            &chunk->size_out[i], wrkmem);
+            if (!chunk->flags[i]) {
+                /*
+                 * fall back to save in plaintext, size_out should be
+                 * assigned the target's page size
+                 */
+                chunk->size_out[i] = page_size;
+            }
+        }
+
+        qemu_mutex_lock(&dc->lock);
+        chunk->done = true;
+        qemu_cond_broadcast(&dc->done_cond);
+    }
+    qemu_mutex_unlock(&dc->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static void compress_init(DumpCompress *dc, DumpState *s, size_t len_buf_out)
+{
+    int i;
+
+    dc->s = s;
+    dc->len_buf_out = len_buf_out;
+    dc->filled = 0;
+    dc->compressed = 0;
+    dc->quit = false;
+    qemu_mutex_init(&dc->lock);
+    qemu_cond_init(&dc->work_cond);
+    qemu_cond_init(&dc->done_cond);
+
+    /* two chunks per thread, so that they do not wait for the writes */
+    dc->nr_chunks = 2 * s->compress_threads;
+    dc->chunks = g_new0(DumpPageChunk, dc->nr_chunks);
+    for (i = 0; i < dc->nr_chunks; i++) {
+        dc->chunks[i].buf_out = g_malloc(DUMP_CHUNK_PAGES * len_buf_out);
+    }
+
+    dc->nr_threads = s->compress_threads;
+    dc->threads = g_new0(QemuThread, dc->nr_threads);
+    for (i = 0; i < dc->nr_threads; i++) {
+        qemu_thread_create(&dc->threads[i], "dump_compress", compress_thread,
+                           dc, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compress_cleanup(DumpCompress *dc)
+{
+    int i;
+
+    qemu_mutex_lock(&dc->lock);
+    dc->quit = true;
+    qemu_cond_broadcast(&dc->work_cond);
+    qemu_mutex_unlock(&dc->lock);
+    for (i = 0; i < dc->nr_threads; i++) {
+        qemu_thread_join(&dc->threads[i]);
+    }
+    g_free(dc->threads);
+
+    for (i = 0; i < dc->nr_chunks; i++) {
+        g_free(dc->chunks[i].buf_out);
+    }
+    g_free(dc->chunks);
+
+    qemu_cond_destroy(&dc->done_cond);
+    qemu_cond_destroy(&dc->work_cond);
+    qemu_mutex_destroy(&dc->lock);
+}
+
+/*
+ * Fill the next chunk with the pages that follow @block_iter/@pfn_iter, and
+ * return false if there are no pages left.
+ */
+static bool compress_fill_chunk(DumpCompress *dc, GuestPhysBlock **block_iter,
+                                uint64_t *pfn_iter)
+{
+    DumpPageChunk *chunk = &dc->chunks[dc->filled % dc->nr_chunks];
+
+    chunk->nr_pages = 0;
+    while (chunk->nr_pages < DUMP_CHUNK_PAGES &&
+           get_next_page(block_iter, pfn_iter,
+                         &chunk->pages[chunk->nr_pages], dc->s)) {
+        chunk->nr_pages++;
+    }
+    if (!chunk->nr_pages) {
+        return false;
+    }
+
+    qemu_mutex_lock(&dc->lock);
+    dc->filled++;
+    qemu_cond_signal(&dc->work_cond);
+    qemu_mutex_unlock(&dc->lock);
+
+    return chunk->nr_pages == DUMP_CHUNK_PAGES;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    size_t len_buf_out;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    DumpCompress dc;
+    DumpPageChunk *chunk;
+    uint64_t written = 0;
+    bool more = true;
+    int i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1207,11 +1420,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
     assert(len_buf_out != 0);
 
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    compress_init(&dc, s, len_buf_out);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1233,99 +1442,69 @@ static void write_dump_pages(DumpState *s, Error **errp)
 
     /*
      * dump memory to vmcore page by page. zero page will all be resided in the
-     * first page of page section
+     * first page of page section.  The compression threads work on the
+     * chunks ahead, while the chunks are written in order here.
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+    for (;;) {
+        while (more && dc.filled - written < dc.nr_chunks) {
+            more = compress_fill_chunk(&dc, &block_iter, &pfn_iter);
+        }
+        if (written == dc.filled) {
+            break;
+        }
+
+        chunk = &dc.chunks[written % dc.nr_chunks];
+        qemu_mutex_lock(&dc.lock);
+        while (!chunk->done) {
+            qemu_cond_wait(&dc.done_cond, &dc.lock);
+        }
+        chunk->done = false;
+        qemu_mutex_unlock(&dc.lock);
+
+        for (i = 0; i < chunk->nr_pages; i++) {
+            /* check zero page */
+            if (!chunk->size_out[i]) {
+                ret = write_cache(&page_desc, &pd_zero,
+                                  sizeof(PageDescriptor), false);
+                if (ret < 0) {
+                    error_setg(errp, "dump: failed to write page desc");
+                    goto out;
+                }
+                s->written_size += s->dump_info.page_size;
+                continue;
             }
-        } else {
+
             /*
              * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
+             * 1. write the compressed page into the cache of page_data
+             * 2. get page desc of the compressed page and write it into the
              *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
              */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
+            ret = write_cache(&page_data,
+                              chunk->flags[i] ?
+                              chunk->buf_out + i * len_buf_out :
+                              chunk->pages[i],
+                              chunk->size_out[i], false);
+            if (ret < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                goto out;
             }
 
             /* get and write page desc here */
+            pd.flags = cpu_to_dump32(s, chunk->flags[i]);
+            pd.size = cpu_to_dump32(s, chunk->size_out[i]);
             pd.page_flags = cpu_to_dump64(s, 0);
             pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            offset_data += chunk->size_out[i];
 
             ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
             if (ret < 0) {
                 error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
+            s->written_size += s->dump_info.page_size;
         }
-        s->written_size += s->dump_info.page_size;
+        written++;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1340,14 +1519,9 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
 out:
+    compress_cleanup(&dc);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1452,6 +1626,15 @@ static void dump_state_prepare(DumpState *s)
     *s = (DumpState) { .status = DUMP_STATUS_ACTIVE };
 }
 
+static int dump_host_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    return MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+#else
+    return 1;
+#endif
+}
+
 bool dump_in_progress(void)
 {
     DumpState *state = &dump_state_global;
@@ -1712,7 +1895,9 @@ void qmp_dump_guest_memory(bool paging, const char *file,
                            bool has_detach, bool detach,
                            bool has_begin, int64_t begin, bool has_length,
                            int64_t length, bool has_format,
-                           DumpGuestMemoryFormat format, Error **errp)
+                           DumpGuestMemoryFormat format,
+                           bool has_compress_threads, int64_t compress_threads,
+                           Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -1753,6 +1938,17 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     if (has_detach) {
         detach_p = detach;
     }
+    if (has_compress_threads) {
+        if (compress_threads < 1 ||
+            compress_threads > DUMP_MAX_COMPRESS_THREADS) {
+            error_setg(errp, "compress-threads must be between 1 and %d",
+                       DUMP_MAX_COMPRESS_THREADS);
+            return;
+        }
+    } else {
+        compress_threads = MIN(DUMP_DEFAULT_COMPRESS_THREADS,
+                               dump_host_cpus());
+    }
 
     /* check whether lzo/snappy is supported */
 #ifndef CONFIG_LZO
@@ -1793,6 +1989,7 @@ void qmp_dump_guest_memory(bool paging, const char *file,
 
     s = &dump_state_global;
     dump_state_prepare(s);
+    s->compress_threads = compress_threads;
 
     dump_init(s, fd, has_format, format, paging, has_begin,
               begin, length, &local_err);
@@ -61,6 +61,9 @@
 #include "qemu/range.h"
 #ifndef _WIN32
 #include "qemu/mmap-alloc.h"
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
 #endif
 
 //#define DEBUG_SUBPAGE
@@ -137,15 +140,18 @@ typedef struct PhysPageMap {
 } PhysPageMap;
 
 struct AddressSpaceDispatch {
-    struct rcu_head rcu;
-
     MemoryRegionSection *mru_section;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
-    AddressSpace *as;
+    /* The tree belongs to a FlatView and may be used by any number of
+     * address spaces.  Its sections and subpages refer to this private
+     * address space instead, whose only field in use is the dispatch
+     * pointer back to the tree.
+     */
+    AddressSpace as;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -414,6 +420,39 @@ address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *x
     return section;
 }
 
+/* Called from RCU critical section */
+IOMMUTLBEntry address_space_get_iotlb_entry(AddressSpace *as, hwaddr addr,
+                                            bool is_write)
+{
+    IOMMUTLBEntry iotlb = {0};
+    MemoryRegionSection *section;
+    MemoryRegion *mr;
+
+    for (;;) {
+        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        section = address_space_lookup_region(d, addr, false);
+        addr = addr - section->offset_within_address_space
+               + section->offset_within_region;
+        mr = section->mr;
+
+        if (!mr->iommu_ops) {
+            break;
+        }
+
+        iotlb = mr->iommu_ops->translate(mr, addr, is_write);
+        if (!(iotlb.perm & (1 << is_write))) {
+            iotlb.target_as = NULL;
+            break;
+        }
+
+        addr = ((iotlb.translated_addr & ~iotlb.addr_mask)
+                | (addr & iotlb.addr_mask));
+        as = iotlb.target_as;
+    }
+
+    return iotlb;
+}
+
 /* Called from RCU critical section */
 MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
                                       hwaddr *xlat, hwaddr *plen,
@@ -542,7 +581,8 @@ const VMStateDescription vmstate_cpu_common = {
         &vmstate_cpu_common_exception_index,
         &vmstate_cpu_common_crash_occurred,
         NULL
-    }
+    },
+    .thread_safe_save = true,
 };
 
 #endif
@@ -1111,8 +1151,8 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
     assert(existing->mr->subpage || existing->mr == &io_mem_unassigned);
 
     if (!(existing->mr->subpage)) {
-        subpage = subpage_init(d->as, base);
-        subsection.address_space = d->as;
+        subpage = subpage_init(&d->as, base);
+        subsection.address_space = &d->as;
         subsection.mr = &subpage->iomem;
         phys_page_set(d, base >> TARGET_PAGE_BITS, 1,
                       phys_section_add(&d->map, &subsection));
@@ -1138,13 +1178,15 @@ static void register_multipage(AddressSpaceDispatch *d,
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
-static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
+void address_space_dispatch_add(AddressSpaceDispatch *d,
+                                MemoryRegionSection *section)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = as->next_dispatch;
-    MemoryRegionSection now = *section, remain = *section;
+    MemoryRegionSection now = *section, remain;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
+    now.address_space = &d->as;
+    remain = now;
+
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
@@ -1285,7 +1327,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory, errp);
+        os_mem_prealloc(fd, area, memory, 0, errp);
         if (errp && *errp) {
             goto error;
         }
@@ -1378,6 +1420,20 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+/* True if @rb is a shared mapping of a file (memory-backend-file,share=on) */
+bool qemu_ram_is_shared_file(RAMBlock *rb)
+{
+    return rb->fd >= 0 && (rb->flags & RAM_SHARED);
+}
+
+/* True if QEMU allocated the memory of @rb, rather than being handed a
+ * pointer to it, e.g. the mmap of a device BAR.
+ */
+bool qemu_ram_is_allocated(RAMBlock *rb)
+{
+    return !(rb->flags & RAM_PREALLOC);
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
@@ -1708,6 +1764,7 @@ static void reclaim_ramblock(RAMBlock *block)
     } else {
         qemu_anon_ram_free(block->host, block->max_length);
     }
+    g_free(block->clear_bmap);
     g_free(block);
 }
 
@@ -1776,6 +1833,44 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
 }
 #endif /* !_WIN32 */
 
+/*
+ * Give the memory backing @length bytes at @start of @rb back to the
+ * host.  File backed blocks get a hole punched in the file, and private
+ * mappings are dropped, so that the range reads back as zeroes (or as
+ * the file contents for a private file mapping) on the next access.
+ *
+ * Returns 0 on success, a negative errno value otherwise.
+ */
+int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length)
+{
+    uint8_t *host = ramblock_ptr(rb, start);
+    int ret = 0;
+
+    if ((uintptr_t)host & ~qemu_real_host_page_mask ||
+        length & ~qemu_real_host_page_mask ||
+        start + length > rb->used_length) {
+        return -EINVAL;
+    }
+
+    if (rb->fd >= 0) {
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        if (fallocate(rb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      start, length)) {
+            return -errno;
+        }
+#else
+        return -ENOSYS;
+#endif
+    }
+
+    if (rb->fd < 0 || !(rb->flags & RAM_SHARED)) {
+        if (qemu_madvise(host, length, QEMU_MADV_DONTNEED)) {
+            ret = -errno;
+        }
+    }
+    return ret;
+}
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
  * This should not be used for general purpose DMA.  Use address_space_map
  * or address_space_rw instead. For local memory (e.g. video ram) that the
@@ -1958,6 +2053,14 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
+    /* Count the pages each vcpu dirties for migration's dirty-limit
+     * throttling; this is the only place where writes are attributed
+     * to a vcpu.
+     */
+    if (current_cpu &&
+        !cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&current_cpu->dirty_pages);
+    }
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
@@ -2257,44 +2360,35 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+AddressSpaceDispatch *address_space_dispatch_new(void)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
-    n = dummy_section(&d->map, as, &io_mem_unassigned);
+    d->as.dispatch = d;
+
+    n = dummy_section(&d->map, &d->as, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
-    n = dummy_section(&d->map, as, &io_mem_notdirty);
+    n = dummy_section(&d->map, &d->as, &io_mem_notdirty);
     assert(n == PHYS_SECTION_NOTDIRTY);
-    n = dummy_section(&d->map, as, &io_mem_rom);
+    n = dummy_section(&d->map, &d->as, &io_mem_rom);
     assert(n == PHYS_SECTION_ROM);
-    n = dummy_section(&d->map, as, &io_mem_watch);
+    n = dummy_section(&d->map, &d->as, &io_mem_watch);
     assert(n == PHYS_SECTION_WATCH);
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
-    d->as = as;
-    as->next_dispatch = d;
+    return d;
 }
 
-static void address_space_dispatch_free(AddressSpaceDispatch *d)
+void address_space_dispatch_compact(AddressSpaceDispatch *d)
 {
-    phys_sections_free(&d->map);
-    g_free(d);
+    phys_page_compact_all(d, d->map.nodes_nb);
 }
 
-static void mem_commit(MemoryListener *listener)
+void address_space_dispatch_free(AddressSpaceDispatch *d)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *cur = as->dispatch;
-    AddressSpaceDispatch *next = as->next_dispatch;
-
-    phys_page_compact_all(next, next->map.nodes_nb);
-
-    atomic_rcu_set(&as->dispatch, next);
-    if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
-    }
+    phys_sections_free(&d->map);
+    g_free(d);
 }
 
 static void tcg_commit(MemoryListener *listener)
@@ -2315,34 +2409,6 @@ static void tcg_commit(MemoryListener *listener)
     tlb_flush(cpuas->cpu, 1);
 }
 
-void address_space_init_dispatch(AddressSpace *as)
-{
-    as->dispatch = NULL;
-    as->dispatch_listener = (MemoryListener) {
-        .begin = mem_begin,
-        .commit = mem_commit,
-        .region_add = mem_add,
-        .region_nop = mem_add,
-        .priority = 0,
-    };
-    memory_listener_register(&as->dispatch_listener, as);
-}
-
-void address_space_unregister(AddressSpace *as)
-{
-    memory_listener_unregister(&as->dispatch_listener);
-}
-
-void address_space_destroy_dispatch(AddressSpace *as)
-{
-    AddressSpaceDispatch *d = as->dispatch;
-
-    atomic_rcu_set(&as->dispatch, NULL);
-    if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
-    }
-}
-
 static void memory_map_init(void)
 {
     system_memory = g_malloc(sizeof(*system_memory));
@@ -2746,53 +2812,51 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+/* Each AddressSpace may have up to as->max_bounce_buffer_size bytes of
+ * bounce buffers mapped at a time, so that DMA to regions that are not
+ * RAM does not serialize all the devices of the guest.
+ */
+struct BounceBuffer {
     MemoryRegion *mr;
     void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
-} BounceBuffer;
-
-static BounceBuffer bounce;
+    QLIST_ENTRY(BounceBuffer) link;
+};
 
-typedef struct MapClient {
+struct MapClient {
     QEMUBH *bh;
     QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+};
 
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(MapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
     MapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_clients)) {
+        client = QLIST_FIRST(&as->map_clients);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_clients, client, link);
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -2800,28 +2864,72 @@ void cpu_exec_init_all(void)
     qemu_mutex_init(&ram_list.mutex);
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->map_lock);
+    QLIST_FOREACH(client, &as->map_clients, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_lock);
 }
 
-static void cpu_notify_map_clients(void)
+/* Reserve up to @len bytes of @as's bounce buffer budget */
+static BounceBuffer *address_space_alloc_bounce(AddressSpace *as, hwaddr len)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    BounceBuffer *bounce = NULL;
+
+    qemu_mutex_lock(&as->map_lock);
+    len = MIN(len, as->max_bounce_buffer_size - as->bounce_buffer_size);
+    if (len) {
+        bounce = g_new0(BounceBuffer, 1);
+        bounce->len = len;
+        atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size + len);
+        as->bounce_maps++;
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+    } else {
+        as->bounce_failures++;
+    }
+    qemu_mutex_unlock(&as->map_lock);
+    return bounce;
+}
+
+static BounceBuffer *address_space_find_bounce(AddressSpace *as, void *buffer)
+{
+    BounceBuffer *bounce;
+
+    /* Unlocked fast path for the common case of mapped RAM */
+    if (!atomic_read(&as->bounce_buffer_size)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&as->map_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->map_lock);
+    return bounce;
+}
+
+static void address_space_free_bounce(AddressSpace *as, BounceBuffer *bounce)
+{
+    qemu_vfree(bounce->buffer);
+    memory_region_unref(bounce->mr);
+
+    qemu_mutex_lock(&as->map_lock);
+    QLIST_REMOVE(bounce, link);
+    atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size - bounce->len);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->map_lock);
+    g_free(bounce);
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2851,8 +2959,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2874,26 +2982,26 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce = address_space_alloc_bounce(as, l);
+
+        if (!bounce) {
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        l = bounce->len;
+        bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
+        bounce->addr = addr;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -2928,7 +3036,9 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = address_space_find_bounce(as, buffer);
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -2944,14 +3054,10 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+    address_space_free_bounce(as, bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -2967,6 +3073,106 @@ void cpu_physical_memory_unmap(void *buffer, hwaddr len,
     return address_space_unmap(&address_space_memory, buffer, len, is_write, access_len);
 }
 
+void address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr l = len;
+    hwaddr xlat;
+
+    *cache = MEMORY_REGION_CACHE_INVALID;
+    cache->as = as;
+    cache->addr = addr;
+    cache->len = len;
+    cache->is_write = is_write;
+
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    if (len && l == len && memory_access_is_direct(mr, is_write)) {
+        memory_region_ref(mr);
+        cache->mr = mr;
+        cache->xlat = xlat;
+        cache->ptr = qemu_map_ram_ptr(mr->ram_block, xlat);
+    }
+    rcu_read_unlock();
+}
+
+void address_space_cache_destroy(MemoryRegionCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
+    }
+    *cache = MEMORY_REGION_CACHE_INVALID;
+}
+
+void address_space_read_cached(MemoryRegionCache *cache, hwaddr addr,
+                               void *buf, int len)
+{
+    assert(addr <= cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy(buf, cache->ptr + addr, len);
+    } else {
+        address_space_read(cache->as, cache->addr + addr,
+                           MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+void address_space_write_cached(MemoryRegionCache *cache, hwaddr addr,
+                                const void *buf, int len)
+{
+    assert(cache->is_write);
+    assert(addr <= cache->len && len <= cache->len - addr);
+    if (likely(cache->ptr)) {
+        memcpy(cache->ptr + addr, buf, len);
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, len);
+    } else {
+        address_space_write(cache->as, cache->addr + addr,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+uint32_t lduw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr)
+{
+    assert(addr <= cache->len && cache->len - addr >= 2);
+    if (likely(cache->ptr)) {
+        return lduw_le_p(cache->ptr + addr);
+    }
+    return lduw_le_phys(cache->as, cache->addr + addr);
+}
+
+uint32_t lduw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr)
+{
+    assert(addr <= cache->len && cache->len - addr >= 2);
+    if (likely(cache->ptr)) {
+        return lduw_be_p(cache->ptr + addr);
+    }
+    return lduw_be_phys(cache->as, cache->addr + addr);
+}
+
+void stw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val)
+{
+    assert(cache->is_write);
+    assert(addr <= cache->len && cache->len - addr >= 2);
+    if (likely(cache->ptr)) {
+        stw_le_p(cache->ptr + addr, val);
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, 2);
+    } else {
+        stw_le_phys(cache->as, cache->addr + addr, val);
+    }
+}
+
+void stw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val)
+{
+    assert(cache->is_write);
+    assert(addr <= cache->len && cache->len - addr >= 2);
+    if (likely(cache->ptr)) {
+        stw_be_p(cache->ptr + addr, val);
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, 2);
+    } else {
+        stw_be_phys(cache->as, cache->addr + addr, val);
+    }
+}
+
 /* warning: addr must be aligned */
 static inline uint32_t address_space_ldl_internal(AddressSpace *as, hwaddr addr,
                                                   MemTxAttrs attrs,
@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <math.h>
+#include <float.h>
 
 #include "fpu/softfloat.h"
 
@@ -2164,7 +2166,7 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add(float32 a, float32 b, float_status *status)
+static float32 soft_float32_add(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2187,7 +2189,7 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub(float32 a, float32 b, float_status *status)
+static float32 soft_float32_sub(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2210,7 +2212,7 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul(float32 a, float32 b, float_status *status)
+static float32 soft_float32_mul(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2275,7 +2277,7 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 soft_float32_div(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2452,8 +2454,8 @@ float32 float32_rem(float32 a, float32 b, float_status *status)
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
-                       float_status *status)
+static float32 soft_float32_muladd(float32 a, float32 b, float32 c,
+                                   int flags, float_status *status)
 {
     flag aSign, bSign, cSign, zSign;
     int aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -2673,7 +2675,7 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sqrt(float32 a, float_status *status)
+static float32 soft_float32_sqrt(float32 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -3959,7 +3961,7 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add(float64 a, float64 b, float_status *status)
+static float64 soft_float64_add(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3982,7 +3984,7 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub(float64 a, float64 b, float_status *status)
+static float64 soft_float64_sub(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -4005,7 +4007,7 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul(float64 a, float64 b, float_status *status)
+static float64 soft_float64_mul(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4068,7 +4070,7 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 soft_float64_div(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4239,8 +4241,8 @@ float64 float64_rem(float64 a, float64 b, float_status *status)
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
-                       float_status *status)
+static float64 soft_float64_muladd(float64 a, float64 b, float64 c,
+                                   int flags, float_status *status)
 {
     flag aSign, bSign, cSign, zSign;
     int aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -4481,7 +4483,7 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sqrt(float64 a, float_status *status)
+static float64 soft_float64_sqrt(float64 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -7793,3 +7795,280 @@ float128 float128_scalbn(float128 a, int n, float_status *status)
                                          , status);
 
 }
+
+/*----------------------------------------------------------------------------
+| Host FPU fast paths for the basic single and double precision operations.
+|
+| With round-to-nearest-even, and inputs that are zero or normal, the host
+| FPU computes exactly the result that the code above would, and raises no
+| flag other than inexact, overflow and underflow.  The fast path is only
+| taken when the inexact flag is already set in `status', so that it does not
+| have to find out whether the result is exact.  Overflow is recognized from
+| the infinite result, and results that may be tiny go to the softfloat code,
+| which knows about the target's tininess detection and flush-to-zero.
+|
+| Hosts that evaluate in a wider format than the operands (x87) would round
+| twice, so they always use softfloat.
+*----------------------------------------------------------------------------*/
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define QEMU_HARDFLOAT 1
+#else
+#define QEMU_HARDFLOAT 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_fpu(const float_status *status)
+{
+    return QEMU_HARDFLOAT &&
+           likely(status->float_exception_flags & float_flag_inexact) &&
+           likely(status->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    int exp = extractFloat32Exp(a);
+
+    return (exp != 0 && exp != 0xFF) || float32_is_zero(a);
+}
+
+static inline bool float64_is_zero_or_normal(float64 a)
+{
+    int exp = extractFloat64Exp(a);
+
+    return (exp != 0 && exp != 0x7FF) || float64_is_zero(a);
+}
+
+/*----------------------------------------------------------------------------
+| Finish a fast path operation that produced `r'.  Returns false if the
+| result may be subnormal and the operation has to be redone in softfloat,
+| unless `zero_ok' says that a zero result is known to be exact.
+*----------------------------------------------------------------------------*/
+
+static inline bool float32_hard_result(float r, bool zero_ok,
+                                       float_status *status)
+{
+    if (unlikely(isinf(r))) {
+        float_raise(float_flag_overflow | float_flag_inexact, status);
+    } else if (unlikely(fabsf(r) <= FLT_MIN)) {
+        return zero_ok && r == 0;
+    }
+    return true;
+}
+
+static inline bool float64_hard_result(double r, bool zero_ok,
+                                       float_status *status)
+{
+    if (unlikely(isinf(r))) {
+        float_raise(float_flag_overflow | float_flag_inexact, status);
+    } else if (unlikely(fabs(r) <= DBL_MIN)) {
+        return zero_ok && r == 0;
+    }
+    return true;
+}
+
+/*----------------------------------------------------------------------------
+| The sum of two normal numbers is only zero if it is exact, so a zero
+| result of an addition or subtraction never needs softfloat.
+*----------------------------------------------------------------------------*/
+
+float32 float32_add(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (can_use_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float32_hard_result(ur.h, true, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_add(a, b, status);
+}
+
+float32 float32_sub(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (can_use_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float32_hard_result(ur.h, true, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_sub(a, b, status);
+}
+
+float32 float32_mul(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (can_use_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float32_hard_result(ur.h, float32_is_zero(a) ||
+                                float32_is_zero(b), status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_mul(a, b, status);
+}
+
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (can_use_fpu(status) && float32_is_zero_or_normal(a) &&
+        float32_is_zero_or_normal(b) && !float32_is_zero(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float32_hard_result(ur.h, float32_is_zero(a), status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_div(a, b, status);
+}
+
+float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
+                       float_status *status)
+{
+    union_float32 ua, ub, uc, ur;
+
+    if (can_use_fpu(status) && !flags && float32_is_zero_or_normal(a) &&
+        float32_is_zero_or_normal(b) && float32_is_zero_or_normal(c)) {
+        ua.s = a;
+        ub.s = b;
+        uc.s = c;
+        ur.h = fmaf(ua.h, ub.h, uc.h);
+        if (float32_hard_result(ur.h, false, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float32_muladd(a, b, c, flags, status);
+}
+
+float32 float32_sqrt(float32 a, float_status *status)
+{
+    union_float32 ua, ur;
+
+    if (can_use_fpu(status) && float32_is_zero_or_normal(a) &&
+        (!extractFloat32Sign(a) || float32_is_zero(a))) {
+        ua.s = a;
+        ur.h = sqrtf(ua.h);
+        return ur.s;
+    }
+    return soft_float32_sqrt(a, status);
+}
+
+float64 float64_add(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (can_use_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float64_hard_result(ur.h, true, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_add(a, b, status);
+}
+
+float64 float64_sub(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (can_use_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float64_hard_result(ur.h, true, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_sub(a, b, status);
+}
+
+float64 float64_mul(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (can_use_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float64_hard_result(ur.h, float64_is_zero(a) ||
+                                float64_is_zero(b), status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_mul(a, b, status);
+}
+
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (can_use_fpu(status) && float64_is_zero_or_normal(a) &&
+        float64_is_zero_or_normal(b) && !float64_is_zero(b)) {
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float64_hard_result(ur.h, float64_is_zero(a), status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_div(a, b, status);
+}
+
+float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
+                       float_status *status)
+{
+    union_float64 ua, ub, uc, ur;
+
+    if (can_use_fpu(status) && !flags && float64_is_zero_or_normal(a) &&
+        float64_is_zero_or_normal(b) && float64_is_zero_or_normal(c)) {
+        ua.s = a;
+        ub.s = b;
+        uc.s = c;
+        ur.h = fma(ua.h, ub.h, uc.h);
+        if (float64_hard_result(ur.h, false, status)) {
+            return ur.s;
+        }
+    }
+    return soft_float64_muladd(a, b, c, flags, status);
+}
+
+float64 float64_sqrt(float64 a, float_status *status)
+{
+    union_float64 ua, ur;
+
+    if (can_use_fpu(status) && float64_is_zero_or_normal(a) &&
+        (!extractFloat64Sign(a) || float64_is_zero(a))) {
+        ua.s = a;
+        ur.h = sqrt(ua.h);
+        return ur.s;
+    }
+    return soft_float64_sqrt(a, status);
+}
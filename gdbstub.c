@@ -29,7 +29,7 @@
 #include "exec/gdbstub.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+#define MAX_PACKET_LENGTH 0x10000
 
 #include "cpu.h"
 #include "qemu/sockets.h"
@@ -43,6 +43,83 @@
 #define GDB_ATTACHED "1"
 #endif
 
+#ifndef CONFIG_USER_ONLY
+/*
+ * Translations of the guest pages accessed by the debugger.  While the VM
+ * is stopped, gdb reads many small ranges close to each other (symbols,
+ * backtraces), and each of them used to walk the guest page tables again.
+ * The cache is flushed when the VM state changes, and after any register
+ * or memory write since those can change the page tables.
+ */
+#define GDB_TLB_SIZE 256
+
+typedef struct GDBTLBEntry {
+    CPUState *cpu;
+    target_ulong page;
+    hwaddr phys;
+    MemTxAttrs attrs;
+} GDBTLBEntry;
+
+static GDBTLBEntry gdb_tlb[GDB_TLB_SIZE];
+
+static void gdb_tlb_flush(void)
+{
+    memset(gdb_tlb, 0, sizeof(gdb_tlb));
+}
+
+static hwaddr gdb_get_phys_page(CPUState *cpu, target_ulong page,
+                                MemTxAttrs *attrs)
+{
+    GDBTLBEntry *e = &gdb_tlb[(page >> TARGET_PAGE_BITS) % GDB_TLB_SIZE];
+
+    if (e->cpu != cpu || e->page != page) {
+        hwaddr phys = cpu_get_phys_page_attrs_debug(cpu, page, attrs);
+
+        if (phys == -1) {
+            return -1;
+        }
+        e->cpu = cpu;
+        e->page = page;
+        e->phys = phys;
+        e->attrs = *attrs;
+    }
+    *attrs = e->attrs;
+    return e->phys;
+}
+
+/* Like cpu_memory_rw_debug(), but using the translation cache */
+static int gdb_memory_rw_debug(CPUState *cpu, target_ulong addr,
+                               uint8_t *buf, int len, bool is_write)
+{
+    target_ulong page;
+    hwaddr phys_addr;
+    MemTxAttrs attrs;
+    int l, asidx;
+
+    while (len > 0) {
+        page = addr & TARGET_PAGE_MASK;
+        phys_addr = gdb_get_phys_page(cpu, page, &attrs);
+        if (phys_addr == -1) {
+            return -1;
+        }
+        asidx = cpu_asidx_from_attrs(cpu, attrs);
+        l = MIN(len, (page + TARGET_PAGE_SIZE) - addr);
+        phys_addr += addr & ~TARGET_PAGE_MASK;
+        if (is_write) {
+            cpu_physical_memory_write_rom(cpu->cpu_ases[asidx].as,
+                                          phys_addr, buf, l);
+        } else {
+            address_space_rw(cpu->cpu_ases[asidx].as, phys_addr,
+                             MEMTXATTRS_UNSPECIFIED, buf, l, 0);
+        }
+        len -= l;
+        buf += l;
+        addr += l;
+    }
+    return 0;
+}
+#endif
+
 static inline int target_memory_rw_debug(CPUState *cpu, target_ulong addr,
                                          uint8_t *buf, int len, bool is_write)
 {
@@ -51,7 +128,26 @@ static inline int target_memory_rw_debug(CPUState *cpu, target_ulong addr,
     if (cc->memory_rw_debug) {
         return cc->memory_rw_debug(cpu, addr, buf, len, is_write);
     }
+#ifndef CONFIG_USER_ONLY
+    if (is_write) {
+        int ret = gdb_memory_rw_debug(cpu, addr, buf, len, true);
+
+        gdb_tlb_flush();
+        return ret;
+    }
+    return gdb_memory_rw_debug(cpu, addr, buf, len, false);
+#else
     return cpu_memory_rw_debug(cpu, addr, buf, len, is_write);
+#endif
+}
+
+/* Flush the translations after a register write, e.g. of the page table
+ * base register. */
+static inline void gdb_registers_changed(void)
+{
+#ifndef CONFIG_USER_ONLY
+    gdb_tlb_flush();
+#endif
 }
 
 enum {
@@ -298,6 +394,11 @@ typedef struct GDBState {
     int line_csum;
     uint8_t last_packet[MAX_PACKET_LENGTH + 4];
     int last_packet_len;
+    /* Buffers for gdb_handle_packet, too large for the stack of a
+     * user-mode guest thread.  'm' replies fill all of str_buf with
+     * hex digits, plus the NUL. */
+    char str_buf[MAX_PACKET_LENGTH + 1];
+    uint8_t mem_buf[MAX_PACKET_LENGTH];
     int signal;
 #ifdef CONFIG_USER_ONLY
     int fd;
@@ -496,6 +597,29 @@ static int put_packet(GDBState *s, const char *buf)
     return put_packet_binary(s, buf, strlen(buf));
 }
 
+/* Decode @len bytes of data in the encoding of 'X' packets, which escapes
+   '#', '$', '*' and '}' as in memtox().  Return -1 if @buf, which ends at
+   @end, has less than @len bytes.  */
+static int xtomem(uint8_t *mem, const char *buf, const char *end, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (buf >= end) {
+            return -1;
+        }
+        if (*buf == '}') {
+            if (++buf >= end) {
+                return -1;
+            }
+            mem[i] = *(buf++) ^ 0x20;
+        } else {
+            mem[i] = *(buf++);
+        }
+    }
+    return 0;
+}
+
 /* Encode data using the encoding for 'x' packets.  */
 static int memtox(char *buf, const char *mem, int len)
 {
@@ -784,15 +908,15 @@ static int is_query_packet(const char *p, const char *query, char separator)
         (p[query_len] == '\0' || p[query_len] == separator);
 }
 
-static int gdb_handle_packet(GDBState *s, const char *line_buf)
+static int gdb_handle_packet(GDBState *s, const char *line_buf, int line_len)
 {
     CPUState *cpu;
     CPUClass *cc;
     const char *p;
     uint32_t thread;
     int ch, reg_size, type, res;
-    char buf[MAX_PACKET_LENGTH];
-    uint8_t mem_buf[MAX_PACKET_LENGTH];
+    char *buf = s->str_buf;
+    uint8_t *mem_buf = s->mem_buf;
     uint8_t *registers;
     target_ulong addr, len;
 
@@ -804,7 +928,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
     switch(ch) {
     case '?':
         /* TODO: Make this return the correct value for user-mode.  */
-        snprintf(buf, sizeof(buf), "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
+        snprintf(buf, sizeof(s->str_buf), "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
                  cpu_index(s->c_cpu));
         put_packet(s, buf);
         /* Remove all the breakpoints when this query is issued,
@@ -953,6 +1077,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             len -= reg_size;
             registers += reg_size;
         }
+        gdb_registers_changed();
         put_packet(s, "OK");
         break;
     case 'm':
@@ -995,6 +1120,27 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, "OK");
         }
         break;
+    case 'X':
+        {
+            /* Like 'M', with binary data; half the size on the wire */
+            uint64_t xaddr, xlen;
+
+            if (qemu_strtoull(p, &p, 16, &xaddr) || *p++ != ',' ||
+                qemu_strtoull(p, &p, 16, &xlen) || *p++ != ':' ||
+                xlen > MAX_PACKET_LENGTH ||
+                xtomem(mem_buf, p, line_buf + line_len, xlen) < 0) {
+                put_packet(s, "E22");
+                break;
+            }
+            /* gdb probes for 'X' support with an empty write */
+            if (xlen && target_memory_rw_debug(s->g_cpu, xaddr, mem_buf,
+                                               xlen, true) != 0) {
+                put_packet(s, "E14");
+            } else {
+                put_packet(s, "OK");
+            }
+        }
+        break;
     case 'p':
         /* Older gdb are really dumb, and don't use 'g' if 'p' is avaialable.
            This works, but can be very slow.  Anything new enough to
@@ -1019,6 +1165,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         reg_size = strlen(p) / 2;
         hextomem(mem_buf, p, reg_size);
         gdb_write_register(s->g_cpu, mem_buf, addr);
+        gdb_registers_changed();
         put_packet(s, "OK");
         break;
     case 'Z':
@@ -1082,7 +1229,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         /* parse any 'q' packets here */
         if (!strcmp(p,"qemu.sstepbits")) {
             /* Query Breakpoint bit definitions */
-            snprintf(buf, sizeof(buf), "ENABLE=%x,NOIRQ=%x,NOTIMER=%x",
+            snprintf(buf, sizeof(s->str_buf), "ENABLE=%x,NOIRQ=%x,NOTIMER=%x",
                      SSTEP_ENABLE,
                      SSTEP_NOIRQ,
                      SSTEP_NOTIMER);
@@ -1093,7 +1240,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p += 10;
             if (*p != '=') {
                 /* Display current setting */
-                snprintf(buf, sizeof(buf), "0x%x", sstep_flags);
+                snprintf(buf, sizeof(s->str_buf), "0x%x", sstep_flags);
                 put_packet(s, buf);
                 break;
             }
@@ -1113,7 +1260,8 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         } else if (strcmp(p,"sThreadInfo") == 0) {
         report_cpuinfo:
             if (s->query_cpu) {
-                snprintf(buf, sizeof(buf), "m%x", cpu_index(s->query_cpu));
+                snprintf(buf, sizeof(s->str_buf), "m%x",
+                         cpu_index(s->query_cpu));
                 put_packet(s, buf);
                 s->query_cpu = CPU_NEXT(s->query_cpu);
             } else
@@ -1125,7 +1273,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             if (cpu != NULL) {
                 cpu_synchronize_state(cpu);
                 /* memtohex() doubles the required space */
-                len = snprintf((char *)mem_buf, sizeof(buf) / 2,
+                len = snprintf((char *)mem_buf, sizeof(s->str_buf) / 2,
                                "CPU#%d [%s]", cpu->cpu_index,
                                cpu->halted ? "halted " : "running");
                 memtohex(buf, mem_buf, len);
@@ -1137,7 +1285,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         else if (strcmp(p, "Offsets") == 0) {
             TaskState *ts = s->c_cpu->opaque;
 
-            snprintf(buf, sizeof(buf),
+            snprintf(buf, sizeof(s->str_buf),
                      "Text=" TARGET_ABI_FMT_lx ";Data=" TARGET_ABI_FMT_lx
                      ";Bss=" TARGET_ABI_FMT_lx,
                      ts->info->code_offset,
@@ -1163,10 +1311,11 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
 #endif /* !CONFIG_USER_ONLY */
         if (is_query_packet(p, "Supported", ':')) {
-            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
+            snprintf(buf, sizeof(s->str_buf), "PacketSize=%x",
+                     MAX_PACKET_LENGTH);
             cc = CPU_GET_CLASS(first_cpu);
             if (cc->gdb_core_xml_file != NULL) {
-                pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
+                pstrcat(buf, sizeof(s->str_buf), ";qXfer:features:read+");
             }
             put_packet(s, buf);
             break;
@@ -1184,7 +1333,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p += 19;
             xml = get_feature_xml(p, &p, cc);
             if (!xml) {
-                snprintf(buf, sizeof(buf), "E00");
+                snprintf(buf, sizeof(s->str_buf), "E00");
                 put_packet(s, buf);
                 break;
             }
@@ -1198,7 +1347,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 
             total_len = strlen(xml);
             if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
+                snprintf(buf, sizeof(s->str_buf), "E00");
                 put_packet(s, buf);
                 break;
             }
@@ -1246,6 +1395,9 @@ static void gdb_vm_state_change(void *opaque, int running, RunState state)
     const char *type;
     int ret;
 
+    /* The guest may change its page tables while it runs */
+    gdb_tlb_flush();
+
     if (running || s->state == RS_INACTIVE) {
         return;
     }
@@ -1457,7 +1609,8 @@ static void gdb_read_byte(GDBState *s, int ch)
             } else {
                 reply = '+';
                 put_buffer(s, &reply, 1);
-                s->state = gdb_handle_packet(s, s->line_buf);
+                s->state = gdb_handle_packet(s, s->line_buf,
+                                             s->line_buf_index);
             }
             break;
         default:
@@ -287,6 +287,24 @@ STEXI
 @item info opcount
 @findex opcount
 Show dynamic compiler opcode counters
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "disas:-d,count:i?",
+        .params     = "[-d] [count]",
+        .help       = "show the most executed translation blocks "
+                      "(-d: disassemble them)",
+        .cmd        = hmp_info_tb_profile,
+    },
+
+STEXI
+@item info tb-profile [-d] [@var{count}]
+@findex tb-profile
+Show the @var{count} (default 10) translation blocks that executed the
+most guest instructions since profiling was enabled with
+@code{tb-profile on}.  With @code{-d}, disassemble the guest code of
+each block.
 ETEXI
 
     {
@@ -557,6 +575,21 @@ STEXI
 @item info migrate_cache_size
 @findex migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of the last dirty rate measurement",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex dirty_rate
+Show the result of the last dirty rate measurement started with
+@code{calc_dirty_rate}.
 ETEXI
 
     {
@@ -698,7 +731,7 @@ ETEXI
 STEXI
 @item info iothreads
 @findex iothreads
-Show iothread's identifiers.
+Show iothread's identifiers, polling parameters and load.
 ETEXI
 
     {
@@ -799,6 +832,22 @@ STEXI
 @item info hotpluggable-cpus
 @findex hotpluggable-cpus
 Show information about hotpluggable CPUs
+ETEXI
+
+    {
+        .name       = "stats",
+        .args_type  = "provider:s?,instance:s?",
+        .params     = "[provider [instance]]",
+        .help       = "show the statistics of all subsystems, or of those "
+                      "matching the provider and instance patterns",
+        .cmd        = hmp_info_stats,
+    },
+
+STEXI
+@item info stats [@var{provider} [@var{instance}]]
+@findex stats
+Show the statistics reported by query-stats, optionally only those of the
+providers and instances matching the given shell-style patterns.
 ETEXI
 
 STEXI
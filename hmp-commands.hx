@@ -277,6 +277,22 @@ STEXI
 @item logfile @var{filename}
 @findex logfile
 Output logs to @var{filename}.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "state:b",
+        .params     = "on|off",
+        .help       = "enable or disable per-TB execution counters",
+        .cmd        = hmp_tb_profile,
+    },
+
+STEXI
+@item tb-profile on|off
+@findex tb-profile
+Enable or disable counting of translation block executions, as reported
+by @code{info tb-profile}.  Either way the translation cache is flushed,
+which also resets the counters.
 ETEXI
 
     {
@@ -894,23 +910,25 @@ ETEXI
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,resume:-r,uri:s",
+        .params     = "[-d] [-b] [-i] [-r] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -r to resume a paused postcopy migration",
         .cmd        = hmp_migrate,
     },
 
 
 STEXI
-@item migrate [-d] [-b] [-i] @var{uri}
+@item migrate [-d] [-b] [-i] [-r] @var{uri}
 @findex migrate
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+	-r to resume a paused postcopy migration over a new connection
 ETEXI
 
     {
@@ -942,6 +960,39 @@ STEXI
 Continue an incoming migration using the @var{uri} (that has the same syntax
 as the -incoming option).
 
+ETEXI
+
+    {
+        .name       = "migrate_recover",
+        .args_type  = "uri:s",
+        .params     = "uri",
+        .help       = "Listen on URI to recover a paused postcopy migration",
+        .cmd        = hmp_migrate_recover,
+    },
+
+STEXI
+@item migrate_recover @var{uri}
+@findex migrate_recover
+On the destination of a paused postcopy migration, listen on @var{uri} for
+the source to resume it with @code{migrate -r}.
+
+ETEXI
+
+    {
+        .name       = "migrate_pause",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Pause a postcopy migration by shutting down its "
+                      "connection",
+        .cmd        = hmp_migrate_pause,
+    },
+
+STEXI
+@item migrate_pause
+@findex migrate_pause
+Shut down the connection of a postcopy migration, so that it pauses and
+can be recovered.
+
 ETEXI
 
     {
@@ -961,6 +1012,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:l,sample_pages:l?",
+        .params     = "second [sample_pages]",
+        .help       = "start measuring the guest dirty page rate for 'second' "
+                      "seconds, sampling 'sample_pages' pages per GiB of RAM",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties memory for @var{second}
+seconds.  The result is shown by @code{info dirty_rate}.
 ETEXI
 
     {
@@ -244,6 +244,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
@@ -253,6 +257,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_vcpu_dirty_limit) {
+        VcpuDirtyLimitList *vcpu;
+
+        for (vcpu = info->vcpu_dirty_limit; vcpu; vcpu = vcpu->next) {
+            monitor_printf(mon, "cpu %" PRId64 ": dirty rate: %" PRIu64
+                           " pages/s, throttle percentage: %" PRIu64 "\n",
+                           vcpu->value->cpu_index, vcpu->value->dirty_rate,
+                           vcpu->value->throttle_percentage);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -305,6 +320,24 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: '%s'",
             MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
             params->tls_hostname ? : "");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES],
+            params->postcopy_prefetch_pages);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DEVICE_STATE_THREADS],
+            params->device_state_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_STREAM_BUFFER_SIZE],
+            params->stream_buffer_size);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_LOAD_THREADS],
+            params->load_threads);
         monitor_printf(mon, "\n");
     }
 
@@ -317,6 +350,26 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->status != DIRTY_RATE_STATUS_UNSTARTED) {
+        monitor_printf(mon, "start time: %" PRId64 " s\n", info->start_time);
+        monitor_printf(mon, "calc time: %" PRId64 " s\n", info->calc_time);
+        monitor_printf(mon, "sample pages: %" PRId64 " per GiB\n",
+                       info->sample_pages);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1260,6 +1313,25 @@ void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_migrate_recover(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *uri = qdict_get_str(qdict, "uri");
+
+    qmp_migrate_recover(uri, &err);
+
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_migrate_pause(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_pause(&err);
+
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1278,6 +1350,22 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "second");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, has_sample_pages, sample_pages, &err);
+    if (err) {
+        error_report_err(err);
+        return;
+    }
+    monitor_printf(mon, "Measuring the dirty rate for %" PRId64 " seconds, "
+                   "use \"info dirty_rate\" to see the result\n", calc_time);
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1327,6 +1415,13 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_cpu_throttle_increment = false;
     bool has_tls_creds = false;
     bool has_tls_hostname = false;
+    bool has_multifd_channels = false;
+    bool has_compress_method = false;
+    int compress_method = 0;
+    bool has_postcopy_prefetch_pages = false;
+    bool has_device_state_threads = false;
+    bool has_stream_buffer_size = false;
+    bool has_load_threads = false;
     bool use_int_value = false;
     int i;
 
@@ -1358,6 +1453,35 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_TLS_HOSTNAME:
                 has_tls_hostname = true;
                 break;
+            case MIGRATION_PARAMETER_MULTIFD_CHANNELS:
+                has_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                has_compress_method = true;
+                compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                break;
+            case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+                has_postcopy_prefetch_pages = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_DEVICE_STATE_THREADS:
+                has_device_state_threads = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_STREAM_BUFFER_SIZE:
+                has_stream_buffer_size = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_LOAD_THREADS:
+                has_load_threads = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1375,6 +1499,12 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                                        has_cpu_throttle_increment, valueint,
                                        has_tls_creds, valuestr,
                                        has_tls_hostname, valuestr,
+                                       has_multifd_channels, valueint,
+                                       has_compress_method, compress_method,
+                                       has_postcopy_prefetch_pages, valueint,
+                                       has_device_state_threads, valueint,
+                                       has_stream_buffer_size, valueint,
+                                       has_load_threads, valueint,
                                        &err);
             break;
         }
@@ -1633,10 +1763,12 @@ void hmp_migrate(Monitor *mon, const QDict *qdict)
     bool detach = qdict_get_try_bool(qdict, "detach", false);
     bool blk = qdict_get_try_bool(qdict, "blk", false);
     bool inc = qdict_get_try_bool(qdict, "inc", false);
+    bool resume = qdict_get_try_bool(qdict, "resume", false);
     const char *uri = qdict_get_str(qdict, "uri");
     Error *err = NULL;
 
-    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false, &err);
+    qmp_migrate(uri, !!blk, blk, !!inc, inc, false, false,
+                true, resume, &err);
     if (err) {
         error_report_err(err);
         return;
@@ -1725,7 +1857,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, true, detach, has_begin, begin,
-                          has_length, length, true, dump_format, &err);
+                          has_length, length, true, dump_format,
+                          false, 0, &err);
     hmp_handle_error(mon, &err);
     g_free(prot);
 }
@@ -2109,8 +2242,22 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        IOThreadInfo *value = info->value;
+        int64_t total = value->busy_ns + value->idle_ns;
+
+        monitor_printf(mon, "%s:\n", value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n", value->thread_id);
+        if (value->has_cpu_affinity) {
+            monitor_printf(mon, "  cpu-affinity=%s\n", value->cpu_affinity);
+        }
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 " poll-grow=%" PRId64
+                       " poll-shrink=%" PRId64 "\n", value->poll_max_ns,
+                       value->poll_grow, value->poll_shrink);
+        monitor_printf(mon, "  busy=%" PRId64 "%% (polling %" PRId64 "%%)"
+                       " iterations=%" PRId64 "\n",
+                       total ? value->busy_ns * 100 / total : 0,
+                       total ? value->poll_ns * 100 / total : 0,
+                       value->iterations);
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -2483,6 +2630,63 @@ void hmp_info_dump(Monitor *mon, const QDict *qdict)
     qapi_free_DumpQueryResult(result);
 }
 
+static void hmp_print_stat_histogram(Monitor *mon, StatHistogram *hist)
+{
+    uint64List *boundary = hist->boundaries;
+    uint64List *bin;
+    uint64_t lower = 0;
+
+    for (bin = hist->bins; bin; bin = bin->next) {
+        if (boundary) {
+            monitor_printf(mon, " [%" PRIu64 ",%" PRIu64 "):%" PRIu64,
+                           lower, boundary->value, bin->value);
+            lower = boundary->value;
+            boundary = boundary->next;
+        } else {
+            monitor_printf(mon, " [%" PRIu64 ",inf):%" PRIu64,
+                           lower, bin->value);
+        }
+    }
+}
+
+void hmp_info_stats(Monitor *mon, const QDict *qdict)
+{
+    const char *provider = qdict_get_try_str(qdict, "provider");
+    const char *instance = qdict_get_try_str(qdict, "instance");
+    strList providers = { .value = (char *)provider };
+    strList instances = { .value = (char *)instance };
+    StatsResultList *res, *l;
+    StatList *s;
+
+    res = qmp_query_stats(!!provider, &providers, !!instance, &instances,
+                          false, NULL, NULL);
+    for (l = res; l; l = l->next) {
+        monitor_printf(mon, "%s %s:\n", l->value->provider,
+                       l->value->instance);
+        for (s = l->value->stats; s; s = s->next) {
+            Stat *stat = s->value;
+
+            monitor_printf(mon, "  %s:", stat->name);
+            switch (stat->type) {
+            case STAT_TYPE_COUNTER:
+                monitor_printf(mon, " %" PRIu64, stat->u.counter.value);
+                break;
+            case STAT_TYPE_GAUGE:
+                monitor_printf(mon, " %" PRId64, stat->u.gauge.value);
+                break;
+            case STAT_TYPE_HISTOGRAM:
+                hmp_print_stat_histogram(mon, &stat->u.histogram);
+                break;
+            default:
+                abort();
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+
+    qapi_free_StatsResultList(res);
+}
+
 void hmp_hotpluggable_cpus(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
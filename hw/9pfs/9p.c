@@ -221,6 +221,9 @@ int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
  */
 static int v9fs_path_is_ancestor(V9fsPath *s1, V9fsPath *s2)
 {
+    if (s2->size < s1->size) {
+        return 0;
+    }
     if (!strncmp(s1->data, s2->data, s1->size - 1)) {
         if (s2->data[s1->size - 1] == '\0' || s2->data[s1->size - 1] == '/') {
             return 1;
@@ -261,33 +264,32 @@ static V9fsFidState *get_fid(V9fsPDU *pdu, int32_t fid)
     V9fsFidState *f;
     V9fsState *s = pdu->s;
 
-    for (f = s->fid_list; f; f = f->next) {
+    f = g_hash_table_lookup(s->fids, GINT_TO_POINTER(fid));
+    if (f) {
         BUG_ON(f->clunked);
-        if (f->fid == fid) {
-            /*
-             * Update the fid ref upfront so that
-             * we don't get reclaimed when we yield
-             * in open later.
-             */
-            f->ref++;
-            /*
-             * check whether we need to reopen the
-             * file. We might have closed the fd
-             * while trying to free up some file
-             * descriptors.
-             */
-            err = v9fs_reopen_fid(pdu, f);
-            if (err < 0) {
-                f->ref--;
-                return NULL;
-            }
-            /*
-             * Mark the fid as referenced so that the LRU
-             * reclaim won't close the file descriptor
-             */
-            f->flags |= FID_REFERENCED;
-            return f;
+        /*
+         * Update the fid ref upfront so that
+         * we don't get reclaimed when we yield
+         * in open later.
+         */
+        f->ref++;
+        /*
+         * check whether we need to reopen the
+         * file. We might have closed the fd
+         * while trying to free up some file
+         * descriptors.
+         */
+        err = v9fs_reopen_fid(pdu, f);
+        if (err < 0) {
+            f->ref--;
+            return NULL;
         }
+        /*
+         * Mark the fid as referenced so that the LRU
+         * reclaim won't close the file descriptor
+         */
+        f->flags |= FID_REFERENCED;
+        return f;
     }
     return NULL;
 }
@@ -296,12 +298,11 @@ static V9fsFidState *alloc_fid(V9fsState *s, int32_t fid)
 {
     V9fsFidState *f;
 
-    for (f = s->fid_list; f; f = f->next) {
+    f = g_hash_table_lookup(s->fids, GINT_TO_POINTER(fid));
+    if (f) {
         /* If fid is already there return NULL */
         BUG_ON(f->clunked);
-        if (f->fid == fid) {
-            return NULL;
-        }
+        return NULL;
     }
     f = g_malloc0(sizeof(V9fsFidState));
     f->fid = fid;
@@ -312,8 +313,8 @@ static V9fsFidState *alloc_fid(V9fsState *s, int32_t fid)
      * reclaim won't close the file descriptor
      */
     f->flags |= FID_REFERENCED;
-    f->next = s->fid_list;
-    s->fid_list = f;
+    QLIST_INSERT_HEAD(&s->fid_list, f, next);
+    g_hash_table_insert(s->fids, GINT_TO_POINTER(fid), f);
 
     v9fs_readdir_init(&f->fs.dir);
     v9fs_readdir_init(&f->fs_reclaim.dir);
@@ -374,6 +375,34 @@ static int free_fid(V9fsPDU *pdu, V9fsFidState *fidp)
     return retval;
 }
 
+/* Runs in the main loop, which owns the list of migration blockers */
+static void v9fs_update_migration_blocker(void *opaque)
+{
+    V9fsState *s = opaque;
+    bool blocked = atomic_read(&s->migration_blocked);
+
+    if (blocked && !s->migration_blocker) {
+        error_setg(&s->migration_blocker,
+                   "Migration is disabled when VirtFS export path '%s' is mounted in the guest using mount_tag '%s'",
+                   s->ctx.fs_root ? s->ctx.fs_root : "NULL", s->tag);
+        migrate_add_blocker(s->migration_blocker);
+    } else if (!blocked && s->migration_blocker) {
+        migrate_del_blocker(s->migration_blocker);
+        error_free(s->migration_blocker);
+        s->migration_blocker = NULL;
+    }
+}
+
+static void v9fs_set_migration_blocked(V9fsState *s, bool blocked)
+{
+    atomic_set(&s->migration_blocked, blocked);
+    if (s->aio_context == qemu_get_aio_context()) {
+        v9fs_update_migration_blocker(s);
+    } else {
+        qemu_bh_schedule(s->migration_bh);
+    }
+}
+
 static int put_fid(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     BUG_ON(!fidp->ref);
@@ -389,10 +418,8 @@ static int put_fid(V9fsPDU *pdu, V9fsFidState *fidp)
              * delete the migration blocker. Ideally, this
              * should be hooked to transport close notification
              */
-            if (pdu->s->migration_blocker) {
-                migrate_del_blocker(pdu->s->migration_blocker);
-                error_free(pdu->s->migration_blocker);
-                pdu->s->migration_blocker = NULL;
+            if (pdu->s->migration_blocked) {
+                v9fs_set_migration_blocked(pdu->s, false);
             }
         }
         return free_fid(pdu, fidp);
@@ -402,18 +429,14 @@ static int put_fid(V9fsPDU *pdu, V9fsFidState *fidp)
 
 static V9fsFidState *clunk_fid(V9fsState *s, int32_t fid)
 {
-    V9fsFidState **fidpp, *fidp;
+    V9fsFidState *fidp;
 
-    for (fidpp = &s->fid_list; *fidpp; fidpp = &(*fidpp)->next) {
-        if ((*fidpp)->fid == fid) {
-            break;
-        }
-    }
-    if (*fidpp == NULL) {
+    fidp = g_hash_table_lookup(s->fids, GINT_TO_POINTER(fid));
+    if (fidp == NULL) {
         return NULL;
     }
-    fidp = *fidpp;
-    *fidpp = fidp->next;
+    g_hash_table_remove(s->fids, GINT_TO_POINTER(fid));
+    QLIST_REMOVE(fidp, next);
     fidp->clunked = 1;
     return fidp;
 }
@@ -424,7 +447,7 @@ void v9fs_reclaim_fd(V9fsPDU *pdu)
     V9fsState *s = pdu->s;
     V9fsFidState *f, *reclaim_list = NULL;
 
-    for (f = s->fid_list; f; f = f->next) {
+    QLIST_FOREACH(f, &s->fid_list, next) {
         /*
          * Unlink fids cannot be reclaimed. Check
          * for them and skip them. Also skip fids
@@ -503,10 +526,10 @@ static int v9fs_mark_fids_unreclaim(V9fsPDU *pdu, V9fsPath *path)
 {
     int err;
     V9fsState *s = pdu->s;
-    V9fsFidState *fidp, head_fid;
+    V9fsFidState *fidp;
 
-    head_fid.next = s->fid_list;
-    for (fidp = s->fid_list; fidp; fidp = fidp->next) {
+again:
+    QLIST_FOREACH(fidp, &s->fid_list, next) {
         if (fidp->path.size != path->size) {
             continue;
         }
@@ -525,7 +548,7 @@ static int v9fs_mark_fids_unreclaim(V9fsPDU *pdu, V9fsPath *path)
              * switched to the worker thread
              */
             if (err == 0) {
-                fidp = &head_fid;
+                goto again;
             }
         }
     }
@@ -538,9 +561,10 @@ static void virtfs_reset(V9fsPDU *pdu)
     V9fsFidState *fidp = NULL;
 
     /* Free all fids */
-    while (s->fid_list) {
-        fidp = s->fid_list;
-        s->fid_list = fidp->next;
+    g_hash_table_remove_all(s->fids);
+    while (!QLIST_EMPTY(&s->fid_list)) {
+        fidp = QLIST_FIRST(&s->fid_list);
+        QLIST_REMOVE(fidp, next);
 
         if (fidp->ref) {
             fidp->clunked = 1;
@@ -1030,12 +1054,9 @@ static void v9fs_attach(void *opaque)
      * disable migration if we haven't done already.
      * attach could get called multiple times for the same export.
      */
-    if (!s->migration_blocker) {
+    if (!s->migration_blocked) {
         s->root_fid = fid;
-        error_setg(&s->migration_blocker,
-                   "Migration is disabled when VirtFS export path '%s' is mounted in the guest using mount_tag '%s'",
-                   s->ctx.fs_root ? s->ctx.fs_root : "NULL", s->tag);
-        migrate_add_blocker(s->migration_blocker);
+        v9fs_set_migration_blocked(s, true);
     }
 out:
     put_fid(pdu, fidp);
@@ -1826,16 +1847,23 @@ static void v9fs_read(void *opaque)
             if (len < 0) {
                 /* IO error return the error */
                 err = len;
-                goto out;
+                break;
             }
-        } while (count < max_count && len > 0);
+            /*
+             * The guest may have provided less room than max_count; stop
+             * once it is full rather than issuing an empty preadv.
+             */
+        } while (count < qiov_full.size && len > 0);
+        qemu_iovec_destroy(&qiov);
+        qemu_iovec_destroy(&qiov_full);
+        if (len < 0) {
+            goto out;
+        }
         err = pdu_marshal(pdu, offset, "d", count);
         if (err < 0) {
             goto out;
         }
         err += offset + count;
-        qemu_iovec_destroy(&qiov);
-        qemu_iovec_destroy(&qiov_full);
     } else if (fidp->fid_type == P9_FID_XATTR) {
         err = v9fs_xattr_read(s, pdu, fidp, off, max_count);
     } else {
@@ -1848,79 +1876,55 @@ out_nofid:
     pdu_complete(pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
-{
-    /*
-     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
-     * size of type (1) + size of name.size (2) + strlen(name.data)
-     */
-    return 24 + v9fs_string_size(name);
-}
-
 static int v9fs_do_readdir(V9fsPDU *pdu,
                            V9fsFidState *fidp, int32_t max_count)
 {
-    size_t size;
     V9fsQID qid;
-    V9fsString name;
-    int len, err = 0;
+    V9fsDirEnt *entries, *e;
+    int len, err;
     int32_t count = 0;
     off_t saved_dir_pos;
-    struct dirent *dent;
-
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
-    }
 
-    while (1) {
-        v9fs_readdir_lock(&fidp->fs.dir);
+    /*
+     * Fetch all the entries that fit in the reply with a single trip to
+     * the worker thread, instead of one trip per entry.
+     */
+    v9fs_readdir_lock(&fidp->fs.dir);
 
-        err = v9fs_co_readdir(pdu, fidp, &dent);
-        if (err || !dent) {
-            break;
-        }
-        v9fs_string_init(&name);
-        v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            v9fs_readdir_unlock(&fidp->fs.dir);
+    err = v9fs_co_readdir_many(pdu, fidp, &entries, max_count,
+                               &saved_dir_pos);
+    if (err < 0) {
+        v9fs_readdir_unlock(&fidp->fs.dir);
+        return err;
+    }
 
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            return count;
-        }
+    for (e = entries; e; e = e->next) {
         /*
          * Fill up just the path field of qid because the client uses
          * only that. To fill the entire qid structure we will have
          * to stat each dirent found, which is expensive
          */
-        size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
-        memcpy(&qid.path, &dent->d_ino, size);
+        qid.path = e->ino;
         /* Fill the other fields with dummy values */
         qid.type = 0;
         qid.version = 0;
 
         /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
-                          &qid, dent->d_off,
-                          dent->d_type, &name);
-
-        v9fs_readdir_unlock(&fidp->fs.dir);
-
+                          &qid, e->off, e->type, &e->name);
         if (len < 0) {
+            /* Set dir back to the last entry that made it into the reply */
             v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            return len;
+            err = len;
+            break;
         }
         count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
+        saved_dir_pos = e->off;
     }
 
     v9fs_readdir_unlock(&fidp->fs.dir);
 
+    v9fs_free_dirents(entries);
     if (err < 0) {
         return err;
     }
@@ -2088,7 +2092,7 @@ static void v9fs_write(void *opaque)
             err = len;
             goto out_qiov;
         }
-    } while (total < count && len > 0);
+    } while (total < qiov_full.size && len > 0);
 
     offset = 7;
     err = pdu_marshal(pdu, offset, "d", total);
@@ -2573,7 +2577,7 @@ static int v9fs_complete_rename(V9fsPDU *pdu, V9fsFidState *fidp,
      * Fixup fid's pointing to the old name to
      * start pointing to the new name
      */
-    for (tfidp = s->fid_list; tfidp; tfidp = tfidp->next) {
+    QLIST_FOREACH(tfidp, &s->fid_list, next) {
         if (v9fs_path_is_ancestor(&fidp->path, &tfidp->path)) {
             /* replace the name */
             v9fs_fix_path(&tfidp->path, &new_path, strlen(fidp->path.data));
@@ -2658,7 +2662,7 @@ static void v9fs_fix_fid_paths(V9fsPDU *pdu, V9fsPath *olddir,
      * Fixup fid's pointing to the old name to
      * start pointing to the new name
      */
-    for (tfidp = s->fid_list; tfidp; tfidp = tfidp->next) {
+    QLIST_FOREACH(tfidp, &s->fid_list, next) {
         if (v9fs_path_is_ancestor(&oldpath, &tfidp->path)) {
             /* replace the name */
             v9fs_fix_path(&tfidp->path, &newpath, strlen(oldpath.data));
@@ -3478,7 +3482,8 @@ int v9fs_device_realize_common(V9fsState *s, Error **errp)
 
     s->ops = fse->ops;
 
-    s->fid_list = NULL;
+    QLIST_INIT(&s->fid_list);
+    s->fids = g_hash_table_new(NULL, NULL);
     qemu_co_rwlock_init(&s->rename_lock);
 
     if (s->ops->init(&s->ctx) < 0) {
@@ -3506,9 +3511,15 @@ int v9fs_device_realize_common(V9fsState *s, Error **errp)
     }
     v9fs_path_free(&path);
 
+    s->aio_context = qemu_get_aio_context();
+    s->migration_bh = qemu_bh_new(v9fs_update_migration_blocker, s);
     rc = 0;
 out:
     if (rc) {
+        if (s->fids) {
+            g_hash_table_destroy(s->fids);
+            s->fids = NULL;
+        }
         g_free(s->ctx.fs_root);
         g_free(s->tag);
         v9fs_path_free(&path);
@@ -3518,6 +3529,8 @@ out:
 
 void v9fs_device_unrealize_common(V9fsState *s, Error **errp)
 {
+    qemu_bh_delete(s->migration_bh);
+    g_hash_table_destroy(s->fids);
     g_free(s->ctx.fs_root);
     g_free(s->tag);
 }
@@ -186,6 +186,24 @@ static inline void v9fs_readdir_init(V9fsDir *dir)
     qemu_mutex_init(&dir->readdir_mutex);
 }
 
+/* A directory entry copied out of the stream by v9fs_co_readdir_many */
+typedef struct V9fsDirEnt {
+    uint64_t ino;
+    off_t off;
+    uint8_t type;
+    V9fsString name;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
+static inline size_t v9fs_readdir_data_size(V9fsString *name)
+{
+    /*
+     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
+     * size of type (1) + size of name.size (2) + strlen(name.data)
+     */
+    return 24 + v9fs_string_size(name);
+}
+
 /*
  * Filled by fs driver on open and other
  * calls.
@@ -214,7 +232,7 @@ struct V9fsFidState
     uid_t uid;
     int ref;
     int clunked;
-    V9fsFidState *next;
+    QLIST_ENTRY(V9fsFidState) next;
     V9fsFidState *rclm_lst;
 };
 
@@ -222,7 +240,9 @@ typedef struct V9fsState
 {
     QLIST_HEAD(, V9fsPDU) free_list;
     QLIST_HEAD(, V9fsPDU) active_list;
-    V9fsFidState *fid_list;
+    QLIST_HEAD(, V9fsFidState) fid_list;
+    /* The fids in fid_list, indexed by fid number */
+    GHashTable *fids;
     FileOperations *ops;
     FsContext ctx;
     char *tag;
@@ -234,7 +254,15 @@ typedef struct V9fsState
      */
     CoRwlock rename_lock;
     int32_t root_fid;
+    /*
+     * Set by requests when the guest mounts and unmounts the export;
+     * migration_bh then updates migration_blocker in the main loop.
+     */
+    bool migration_blocked;
+    QEMUBH *migration_bh;
     Error *migration_blocker;
+    /* Where requests run: the main loop or the device's IOThread */
+    AioContext *aio_context;
     V9fsConf fsconf;
     V9fsQID root_qid;
 } V9fsState;
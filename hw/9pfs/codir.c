@@ -41,6 +41,100 @@ int v9fs_co_readdir(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent **dent)
     return err;
 }
 
+void v9fs_free_dirents(V9fsDirEnt *e)
+{
+    V9fsDirEnt *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        v9fs_string_free(&e->name);
+        g_free(e);
+    }
+}
+
+/*
+ * Runs in the worker thread.  Copy entries out of the directory stream
+ * until Rreaddir would grow past @maxsize bytes, and put back the first
+ * entry that did not fit.
+ */
+static int do_readdir_many(V9fsState *s, V9fsFidState *fidp,
+                           V9fsDirEnt **entries, int32_t maxsize,
+                           off_t *saved_dir_pos)
+{
+    V9fsDirEnt **tail = entries;
+    V9fsDirEnt *e;
+    struct dirent *dent;
+    int32_t size = 0;
+    off_t pos;
+    int err = 0;
+
+    *entries = NULL;
+    pos = s->ops->telldir(&s->ctx, &fidp->fs);
+    if (pos < 0) {
+        return -errno;
+    }
+    *saved_dir_pos = pos;
+
+    while (1) {
+        errno = 0;
+        dent = s->ops->readdir(&s->ctx, &fidp->fs);
+        if (!dent) {
+            if (errno) {
+                err = -errno;
+            }
+            break;
+        }
+
+        e = g_new0(V9fsDirEnt, 1);
+        v9fs_string_init(&e->name);
+        v9fs_string_sprintf(&e->name, "%s", dent->d_name);
+        if (size + v9fs_readdir_data_size(&e->name) > maxsize) {
+            v9fs_string_free(&e->name);
+            g_free(e);
+            s->ops->seekdir(&s->ctx, &fidp->fs, pos);
+            break;
+        }
+        QEMU_BUILD_BUG_ON(sizeof(dent->d_ino) > sizeof(e->ino));
+        e->ino = dent->d_ino;
+        e->off = dent->d_off;
+        e->type = dent->d_type;
+        size += v9fs_readdir_data_size(&e->name);
+        pos = dent->d_off;
+
+        *tail = e;
+        tail = &e->next;
+    }
+
+    /* Report errors next time if some entries could be read */
+    if (err < 0 && *entries) {
+        s->ops->seekdir(&s->ctx, &fidp->fs, pos);
+        err = 0;
+    }
+    return err;
+}
+
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, int32_t maxsize,
+                         off_t *saved_dir_pos)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            err = do_readdir_many(s, fidp, entries, maxsize, saved_dir_pos);
+        });
+    if (err < 0) {
+        v9fs_free_dirents(*entries);
+        *entries = NULL;
+    }
+    return err;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -18,7 +18,7 @@
 #include "qemu/coroutine.h"
 #include "coth.h"
 
-/* Called from QEMU I/O thread.  */
+/* Called from the thread that runs the device's AioContext.  */
 static void coroutine_enter_cb(void *opaque, int ret)
 {
     Coroutine *co = opaque;
@@ -35,7 +35,8 @@ static int coroutine_enter_func(void *arg)
 
 void co_run_in_worker_bh(void *opaque)
 {
-    Coroutine *co = opaque;
-    thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
-                           coroutine_enter_func, co, coroutine_enter_cb, co);
+    V9fsCoWorker *w = opaque;
+    thread_pool_submit_aio(aio_get_thread_pool(w->ctx),
+                           coroutine_enter_func, w->co, coroutine_enter_cb,
+                           w->co);
 }
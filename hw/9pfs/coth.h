@@ -29,12 +29,25 @@
  *   3. Enter the coroutine in the worker thread.
  * we cannot swap step 1 and 2, because that would imply worker thread
  * can enter coroutine while step1 is still running
+ *
+ * The caller must have a V9fsPDU *pdu in scope.  The request runs in
+ * the AioContext of its device (the main loop, or an IOThread), and it
+ * is resumed there once the code block has run.
  */
+typedef struct V9fsCoWorker {
+    Coroutine *co;
+    AioContext *ctx;
+} V9fsCoWorker;
+
 #define v9fs_co_run_in_worker(code_block)                               \
     do {                                                                \
+        V9fsCoWorker co_worker = {                                      \
+            .co = qemu_coroutine_self(),                                \
+            .ctx = pdu->s->aio_context,                                 \
+        };                                                              \
         QEMUBH *co_bh;                                                  \
-        co_bh = qemu_bh_new(co_run_in_worker_bh,                        \
-                            qemu_coroutine_self());                     \
+        co_bh = aio_bh_new(co_worker.ctx, co_run_in_worker_bh,          \
+                           &co_worker);                                 \
         qemu_bh_schedule(co_bh);                                        \
         /*                                                              \
          * yield in qemu thread and re-enter back                       \
@@ -50,6 +63,9 @@
 extern void co_run_in_worker_bh(void *);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir(V9fsPDU *, V9fsFidState *, struct dirent **);
+extern int v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *, V9fsDirEnt **,
+                                int32_t, off_t *);
+extern void v9fs_free_dirents(V9fsDirEnt *);
 extern off_t v9fs_co_telldir(V9fsPDU *, V9fsFidState *);
 extern void v9fs_co_seekdir(V9fsPDU *, V9fsFidState *, off_t);
 extern void v9fs_co_rewinddir(V9fsPDU *, V9fsFidState *);
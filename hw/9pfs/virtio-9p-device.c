@@ -12,7 +12,10 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "virtio-9p.h"
 #include "fsdev/qemu-fsdev.h"
@@ -32,10 +35,17 @@ void virtio_9p_push_and_notify(V9fsPDU *pdu)
     v->elems[pdu->idx] = NULL;
 
     /* FIXME: we should batch these completions */
-    virtio_notify(VIRTIO_DEVICE(v), v->vq);
+    if (v->dataplane_started && !v->dataplane_disabled) {
+        /* Not in the main loop; raise the interrupt through the irqfd */
+        if (virtio_should_notify(VIRTIO_DEVICE(v), v->vq)) {
+            event_notifier_set(virtio_queue_get_guest_notifier(v->vq));
+        }
+    } else {
+        virtio_notify(VIRTIO_DEVICE(v), v->vq);
+    }
 }
 
-static void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_9p_handle_vq(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsVirtioState *v = (V9fsVirtioState *)vdev;
     V9fsState *s = &v->state;
@@ -90,6 +100,137 @@ out_free_pdu:
     pdu_free(pdu);
 }
 
+/* Context: QEMU global mutex held */
+static void virtio_9p_data_plane_start(V9fsVirtioState *v)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(v);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    AioContext *ctx = iothread_get_aio_context(v->iothread);
+    int r;
+
+    if (v->dataplane_started || v->dataplane_starting) {
+        return;
+    }
+
+    v->dataplane_starting = true;
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    if (r != 0) {
+        error_report("virtio-9p failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        goto fail_guest_notifiers;
+    }
+
+    /* Set up virtqueue notify */
+    r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), 0, true);
+    if (r != 0) {
+        error_report("virtio-9p failed to set host notifier (%d)", r);
+        k->set_guest_notifiers(qbus->parent, 1, false);
+        goto fail_guest_notifiers;
+    }
+
+    v->dataplane_starting = false;
+    v->dataplane_started = true;
+
+    /*
+     * Requests must not move between threads while in flight.  Only a
+     * data plane that failed to start earlier leaves any behind, which
+     * then run in the main loop.
+     */
+    while (!QLIST_EMPTY(&v->state.active_list)) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    v->state.aio_context = ctx;
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(virtio_queue_get_host_notifier(v->vq));
+
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(v->vq, ctx,
+                                               virtio_9p_handle_vq);
+    aio_context_release(ctx);
+    return;
+
+fail_guest_notifiers:
+    v->dataplane_disabled = true;
+    v->dataplane_starting = false;
+    v->dataplane_started = true;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_9p_data_plane_stop(V9fsVirtioState *v)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(v);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    V9fsState *s = &v->state;
+    AioContext *ctx;
+
+    if (!v->dataplane_started) {
+        return;
+    }
+
+    /* Better luck next time. */
+    if (v->dataplane_disabled) {
+        v->dataplane_disabled = false;
+        v->dataplane_started = false;
+        return;
+    }
+
+    ctx = iothread_get_aio_context(v->iothread);
+    aio_context_acquire(ctx);
+
+    /* Stop notifications for new requests from guest */
+    virtio_queue_aio_set_host_notifier_handler(v->vq, ctx, NULL);
+
+    /*
+     * Requests hop between the IOThread and the worker threads; let the
+     * ones in flight complete before moving back to the main loop.
+     */
+    while (!QLIST_EMPTY(&s->active_list)) {
+        aio_poll(ctx, true);
+    }
+    s->aio_context = qemu_get_aio_context();
+
+    aio_context_release(ctx);
+
+    virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), 0, false);
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, 1, false);
+
+    v->dataplane_started = false;
+}
+
+static void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+    V9fsVirtioState *v = (V9fsVirtioState *)vdev;
+
+    if (v->iothread) {
+        /*
+         * Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so
+         * start the data plane here instead of waiting for .set_status().
+         */
+        virtio_9p_data_plane_start(v);
+        if (!v->dataplane_disabled) {
+            return;
+        }
+    }
+    virtio_9p_handle_vq(vdev, vq);
+}
+
+static void virtio_9p_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    V9fsVirtioState *v = VIRTIO_9P(vdev);
+
+    if (v->iothread && !(status & (VIRTIO_CONFIG_S_DRIVER |
+                                   VIRTIO_CONFIG_S_DRIVER_OK))) {
+        virtio_9p_data_plane_stop(v);
+    }
+}
+
 static uint64_t virtio_9p_get_features(VirtIODevice *vdev, uint64_t features,
                                        Error **errp)
 {
@@ -119,6 +260,18 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
     V9fsVirtioState *v = VIRTIO_9P(dev);
     V9fsState *s = &v->state;
 
+    if (v->iothread) {
+        BusState *qbus = BUS(qdev_get_parent_bus(dev));
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+        /* Don't try if transport does not support notifiers. */
+        if (!k->set_guest_notifiers || !k->ioeventfd_started) {
+            error_setg(errp, "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            goto out;
+        }
+    }
+
     if (v9fs_device_realize_common(s, errp)) {
         goto out;
     }
@@ -137,6 +290,9 @@ static void virtio_9p_device_unrealize(DeviceState *dev, Error **errp)
     V9fsVirtioState *v = VIRTIO_9P(dev);
     V9fsState *s = &v->state;
 
+    if (v->iothread) {
+        virtio_9p_data_plane_stop(v);
+    }
     virtio_cleanup(vdev);
     v9fs_device_unrealize_common(s, errp);
 }
@@ -207,12 +363,24 @@ static void virtio_9p_class_init(ObjectClass *klass, void *data)
     vdc->unrealize = virtio_9p_device_unrealize;
     vdc->get_features = virtio_9p_get_features;
     vdc->get_config = virtio_9p_get_config;
+    vdc->set_status = virtio_9p_set_status;
+}
+
+static void virtio_9p_instance_init(Object *obj)
+{
+    V9fsVirtioState *v = VIRTIO_9P(obj);
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&v->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_9P,
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(V9fsVirtioState),
+    .instance_init = virtio_9p_instance_init,
     .class_init = virtio_9p_class_init,
 };
 
@@ -3,6 +3,7 @@
 
 #include "standard-headers/linux/virtio_9p.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 #include "9p.h"
 
 typedef struct V9fsVirtioState
@@ -10,6 +11,14 @@ typedef struct V9fsVirtioState
     VirtIODevice parent_obj;
     VirtQueue *vq;
     size_t config_size;
+    /*
+     * With an IOThread, requests are popped, run and completed there
+     * instead of in the main loop (see virtio_9p_data_plane_start).
+     */
+    IOThread *iothread;
+    bool dataplane_starting;
+    bool dataplane_started;
+    bool dataplane_disabled;
     V9fsPDU pdus[MAX_REQ];
     VirtQueueElement *elems[MAX_REQ];
     V9fsState state;
@@ -1,8 +1,21 @@
 #include "qemu/osdep.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "hw/hotplug.h"
 #include "qemu/module.h"
+#include "qemu/queue.h"
 
-void acpi_send_event(DeviceState *dev, AcpiEventStatusBits event)
+/* Events held back while a group of devices is plugged */
+typedef struct AcpiPendingEvent {
+    DeviceState *dev;
+    AcpiEventStatusBits event;
+    QSIMPLEQ_ENTRY(AcpiPendingEvent) next;
+} AcpiPendingEvent;
+
+static QSIMPLEQ_HEAD(, AcpiPendingEvent) acpi_pending_events =
+    QSIMPLEQ_HEAD_INITIALIZER(acpi_pending_events);
+static Notifier acpi_batch_notifier;
+
+static void acpi_do_send_event(DeviceState *dev, AcpiEventStatusBits event)
 {
     AcpiDeviceIfClass *adevc = ACPI_DEVICE_IF_GET_CLASS(dev);
     if (adevc->send_event) {
@@ -11,6 +24,45 @@ void acpi_send_event(DeviceState *dev, AcpiEventStatusBits event)
     }
 }
 
+static void acpi_flush_events(Notifier *notifier, void *data)
+{
+    AcpiPendingEvent *ev;
+
+    while ((ev = QSIMPLEQ_FIRST(&acpi_pending_events))) {
+        QSIMPLEQ_REMOVE_HEAD(&acpi_pending_events, next);
+        acpi_do_send_event(ev->dev, ev->event);
+        object_unref(OBJECT(ev->dev));
+        g_free(ev);
+    }
+}
+
+void acpi_send_event(DeviceState *dev, AcpiEventStatusBits event)
+{
+    AcpiPendingEvent *ev;
+
+    if (!hotplug_batch_active()) {
+        acpi_do_send_event(dev, event);
+        return;
+    }
+
+    /* The status bits of all slots are already latched, a single event
+     * makes the guest scan all of them */
+    QSIMPLEQ_FOREACH(ev, &acpi_pending_events, next) {
+        if (ev->dev == dev && ev->event == event) {
+            return;
+        }
+    }
+    if (!acpi_batch_notifier.notify) {
+        acpi_batch_notifier.notify = acpi_flush_events;
+        hotplug_batch_add_notifier(&acpi_batch_notifier);
+    }
+    ev = g_new0(AcpiPendingEvent, 1);
+    ev->dev = dev;
+    ev->event = event;
+    object_ref(OBJECT(dev));
+    QSIMPLEQ_INSERT_TAIL(&acpi_pending_events, ev, next);
+}
+
 static void register_types(void)
 {
     static const TypeInfo acpi_dev_if_info = {
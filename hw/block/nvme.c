@@ -18,6 +18,15 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * The drive of the controller is namespace 1.  More namespaces can be
+ * attached to a controller with id=<id> with
+ *      -device nvme-ns,drive=<drive_id>,bus=<id>.0,nsid=<nsid[optional]>
+ *
+ * I/O queues are processed in the main loop, or in an IOThread given with
+ *      -device nvme,...,iothread=<iothread_id>
+ * The admin queue always runs in the main loop: admin commands change
+ * the controller state and need the iothread lock.
  */
 
 #include "qemu/osdep.h"
@@ -29,10 +38,13 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
+static void nvme_process_admin_sq(void *opaque);
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -68,7 +80,7 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
-static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
+static void nvme_irq_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
         if (msix_enabled(&(n->parent_obj))) {
@@ -79,6 +91,78 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/*
+ * Raising an interrupt needs the iothread lock, which the IOThread
+ * cannot take while a vCPU may hold it and wait for the AioContext;
+ * completions posted there are signalled from a bottom half instead.
+ */
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int i;
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < n->num_queues; i++) {
+        if (bitmap_test_and_clear_atomic(n->irq_pending, i, 1) && n->cq[i]) {
+            nvme_irq_notify(n, n->cq[i]);
+        }
+    }
+    aio_context_release(n->ctx);
+}
+
+static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (qemu_mutex_iothread_locked()) {
+        nvme_irq_notify(n, cq);
+    } else {
+        set_bit_atomic(cq->cqid, n->irq_pending);
+        qemu_bh_schedule(n->irq_bh);
+    }
+}
+
+/*
+ * With a doorbell buffer configured, the host writes the new SQ tail
+ * and CQ head to the shadow doorbells in memory and only rings the
+ * MMIO doorbell when the value passes the event index the controller
+ * publishes, so a busy queue is driven without exits.  The admin
+ * queue always uses the MMIO doorbells.
+ */
+static void nvme_update_sq_tail(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < sq->size) {
+        sq->tail = v;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&n->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < cq->size) {
+        cq->head = v;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&n->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -170,6 +254,12 @@ static void nvme_post_cqes(void *opaque)
         NvmeSQueue *sq;
         hwaddr addr;
 
+        if (cq->db_addr) {
+            nvme_update_cq_eventidx(n, cq);
+            /* publish the event index before reading the head */
+            smp_mb();
+            nvme_update_cq_head(n, cq);
+        }
         if (nvme_cq_full(cq)) {
             break;
         }
@@ -188,6 +278,20 @@ static void nvme_post_cqes(void *opaque)
     nvme_isr_notify(n, cq);
 }
 
+/*
+ * The admin queue runs in the main loop but shares the controller with
+ * the I/O queues, so it also takes their AioContext.
+ */
+static void nvme_post_admin_cqes(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    aio_context_acquire(n->ctx);
+    nvme_post_cqes(cq);
+    aio_context_release(n->ctx);
+}
+
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
 {
     assert(cq->cqid == req->sq->cqid);
@@ -202,12 +306,13 @@ static void nvme_rw_cb(void *opaque, int ret)
     NvmeSQueue *sq = req->sq;
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
+    BlockBackend *blk = req->ns->blk;
 
     if (!ret) {
-        block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
+        block_acct_done(blk_get_stats(blk), &req->acct);
         req->status = NVME_SUCCESS;
     } else {
-        block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+        block_acct_failed(blk_get_stats(blk), &req->acct);
         req->status = NVME_INTERNAL_DEV_ERROR;
     }
     if (req->has_sg) {
@@ -220,9 +325,9 @@ static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
     req->has_sg = false;
-    block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
+    block_acct_start(blk_get_stats(ns->blk), &req->acct, 0,
          BLOCK_ACCT_FLUSH);
-    req->aiocb = blk_aio_flush(n->conf.blk, nvme_rw_cb, req);
+    req->aiocb = blk_aio_flush(ns->blk, nvme_rw_cb, req);
 
     return NVME_NO_COMPLETE;
 }
@@ -244,22 +349,22 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     enum BlockAcctType acct = is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ;
 
     if ((slba + nlb) > ns->id_ns.nsze) {
-        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+        block_acct_invalid(blk_get_stats(ns->blk), acct);
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
     if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
-        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+        block_acct_invalid(blk_get_stats(ns->blk), acct);
         return NVME_INVALID_FIELD | NVME_DNR;
     }
 
     assert((nlb << data_shift) == req->qsg.size);
 
     req->has_sg = true;
-    dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
+    dma_acct_start(ns->blk, &req->acct, &req->qsg, acct);
     req->aiocb = is_write ?
-        dma_blk_write(n->conf.blk, &req->qsg, data_offset, nvme_rw_cb, req) :
-        dma_blk_read(n->conf.blk, &req->qsg, data_offset, nvme_rw_cb, req);
+        dma_blk_write(ns->blk, &req->qsg, data_offset, nvme_rw_cb, req) :
+        dma_blk_read(ns->blk, &req->qsg, data_offset, nvme_rw_cb, req);
 
     return NVME_NO_COMPLETE;
 }
@@ -274,6 +379,11 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 
     ns = &n->namespaces[nsid - 1];
+    if (!ns->blk) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    req->ns = ns;
     switch (cmd->opcode) {
     case NVME_CMD_FLUSH:
         return nvme_flush(n, ns, cmd, req);
@@ -343,6 +453,11 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
+    if (sqid && n->dbbuf_dbs) {
+        sq->db_addr = n->dbbuf_dbs + 2 * sqid * sizeof(uint32_t);
+        sq->ei_addr = n->dbbuf_eis + 2 * sqid * sizeof(uint32_t);
+    }
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -351,7 +466,13 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (sqid) {
+        sq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_process_sq, sq);
+    } else {
+        sq->timer = aio_timer_new(qemu_get_aio_context(), QEMU_CLOCK_VIRTUAL,
+                                  SCALE_NS, nvme_process_admin_sq, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
@@ -430,11 +551,22 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
+    if (cqid && n->dbbuf_dbs) {
+        cq->db_addr = n->dbbuf_dbs + (2 * cqid + 1) * sizeof(uint32_t);
+        cq->ei_addr = n->dbbuf_eis + (2 * cqid + 1) * sizeof(uint32_t);
+    }
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (cqid) {
+        cq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_post_cqes, cq);
+    } else {
+        cq->timer = aio_timer_new(qemu_get_aio_context(), QEMU_CLOCK_VIRTUAL,
+                                  SCALE_NS, nvme_post_admin_cqes, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -489,6 +621,7 @@ static uint16_t nvme_identify_ns(NvmeCtrl *n, NvmeIdentify *c)
         return NVME_INVALID_NSID | NVME_DNR;
     }
 
+    /* an inactive namespace reports a zeroed identify structure */
     ns = &n->namespaces[nsid - 1];
     return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
         prp1, prp2);
@@ -506,7 +639,7 @@ static uint16_t nvme_identify_nslist(NvmeCtrl *n, NvmeIdentify *c)
 
     list = g_malloc0(data_len);
     for (i = 0; i < n->num_namespaces; i++) {
-        if (i < min_nsid) {
+        if (i < min_nsid || !n->namespaces[i].blk) {
             continue;
         }
         list[j++] = cpu_to_le32(i + 1);
@@ -560,10 +693,15 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
     uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    int i;
 
     switch (dw10) {
     case NVME_VOLATILE_WRITE_CACHE:
-        blk_set_enable_write_cache(n->conf.blk, dw11 & 1);
+        for (i = 0; i < n->num_namespaces; i++) {
+            if (n->namespaces[i].blk) {
+                blk_set_enable_write_cache(n->namespaces[i].blk, dw11 & 1);
+            }
+        }
         break;
     case NVME_NUMBER_OF_QUEUES:
         req->cqe.result =
@@ -575,6 +713,39 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+        !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+
+    /* queues created later pick the buffers up in nvme_init_[sc]q */
+    for (i = 1; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+
+        if (sq) {
+            sq->db_addr = dbs_addr + 2 * i * sizeof(uint32_t);
+            sq->ei_addr = eis_addr + 2 * i * sizeof(uint32_t);
+            nvme_update_sq_eventidx(n, sq);
+        }
+        if (cq) {
+            cq->db_addr = dbs_addr + (2 * i + 1) * sizeof(uint32_t);
+            cq->ei_addr = eis_addr + (2 * i + 1) * sizeof(uint32_t);
+            nvme_update_cq_eventidx(n, cq);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -592,6 +763,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -608,6 +781,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(n, sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -618,6 +795,7 @@ static void nvme_process_sq(void *opaque)
         QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
         memset(&req->cqe, 0, sizeof(req->cqe));
         req->cqe.cid = cmd.cid;
+        req->ns = NULL;
 
         status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
             nvme_admin_cmd(n, &cmd, req);
@@ -625,9 +803,26 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr) {
+            nvme_update_sq_eventidx(n, sq);
+            /* publish the event index before reading the tail */
+            smp_mb();
+            nvme_update_sq_tail(n, sq);
+        }
     }
 }
 
+static void nvme_process_admin_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    aio_context_acquire(n->ctx);
+    nvme_process_sq(sq);
+    aio_context_release(n->ctx);
+}
+
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
@@ -643,7 +838,12 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
         }
     }
 
-    blk_flush(n->conf.blk);
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (n->namespaces[i].blk) {
+            blk_flush(n->namespaces[i].blk);
+        }
+    }
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
     n->bar.cc = 0;
 }
 
@@ -808,11 +1008,14 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    aio_context_acquire(n->ctx);
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
         nvme_process_db(n, addr, data);
     }
+    aio_context_release(n->ctx);
 }
 
 static const MemoryRegionOps nvme_mmio_ops = {
@@ -825,24 +1028,43 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+static int nvme_ns_init(NvmeCtrl *n, NvmeNamespace *ns, BlockBackend *blk)
+{
+    NvmeIdNs *id_ns = &ns->id_ns;
+    int64_t bs_size;
+
+    bs_size = blk_getlength(blk);
+    if (bs_size < 0) {
+        return -1;
+    }
+
+    id_ns->nsfeat = 0;
+    id_ns->nlbaf = 0;
+    id_ns->flbas = 0;
+    id_ns->mc = 0;
+    id_ns->dpc = 0;
+    id_ns->dps = 0;
+    id_ns->lbaf[0].ds = BDRV_SECTOR_BITS;
+    id_ns->ncap  = id_ns->nuse = id_ns->nsze =
+        cpu_to_le64(bs_size >>
+            id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
+
+    blk_set_aio_context(blk, n->ctx);
+    ns->blk = blk;
+    return 0;
+}
+
 static int nvme_init(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
     NvmeIdCtrl *id = &n->id_ctrl;
 
-    int i;
-    int64_t bs_size;
     uint8_t *pci_conf;
 
     if (!n->conf.blk) {
         return -1;
     }
 
-    bs_size = blk_getlength(n->conf.blk);
-    if (bs_size < 0) {
-        return -1;
-    }
-
     blkconf_serial(&n->conf, &n->serial);
     if (!n->serial) {
         return -1;
@@ -856,15 +1078,28 @@ static int nvme_init(PCIDevice *pci_dev)
     pci_config_set_class(pci_dev->config, PCI_CLASS_STORAGE_EXPRESS);
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
-    n->num_namespaces = 1;
+    n->num_namespaces = NVME_MAX_NAMESPACES;
     n->num_queues = 64;
     n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
-    n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
 
+    if (n->iothread) {
+        n->ctx = iothread_get_aio_context(n->iothread);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+    n->irq_bh = qemu_bh_new(nvme_irq_bh, n);
+    n->irq_pending = bitmap_new(n->num_queues);
+
+    if (nvme_ns_init(n, &n->namespaces[0], n->conf.blk)) {
+        return -1;
+    }
+    qbus_create_inplace(&n->bus, sizeof(n->bus), TYPE_NVME_BUS,
+                        DEVICE(pci_dev), NULL);
+
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
     pci_register_bar(&n->parent_obj, 0,
@@ -881,7 +1116,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -905,28 +1140,25 @@ static int nvme_init(PCIDevice *pci_dev)
     n->bar.vs = 0x00010100;
     n->bar.intmc = n->bar.intms = 0;
 
-    for (i = 0; i < n->num_namespaces; i++) {
-        NvmeNamespace *ns = &n->namespaces[i];
-        NvmeIdNs *id_ns = &ns->id_ns;
-        id_ns->nsfeat = 0;
-        id_ns->nlbaf = 0;
-        id_ns->flbas = 0;
-        id_ns->mc = 0;
-        id_ns->dpc = 0;
-        id_ns->dps = 0;
-        id_ns->lbaf[0].ds = BDRV_SECTOR_BITS;
-        id_ns->ncap  = id_ns->nuse = id_ns->nsze =
-            cpu_to_le64(n->ns_size >>
-                id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
-    }
     return 0;
 }
 
 static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
+    int i;
 
+    aio_context_acquire(n->ctx);
     nvme_clear_ctrl(n);
+    aio_context_release(n->ctx);
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (n->namespaces[i].blk) {
+            blk_set_aio_context(n->namespaces[i].blk, qemu_get_aio_context());
+        }
+    }
+    qemu_bh_delete(n->irq_bh);
+    g_free(n->irq_pending);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -939,6 +1171,81 @@ static Property nvme_props[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static void nvme_ns_realize(DeviceState *dev, Error **errp)
+{
+    NvmeNsDevice *nsdev = NVME_NS(dev);
+    NvmeCtrl *n = NVME(dev->parent_bus->parent);
+    uint32_t nsid = nsdev->nsid;
+    int ret;
+
+    if (!nsdev->conf.blk) {
+        error_setg(errp, "drive property not set");
+        return;
+    }
+
+    if (!nsid) {
+        for (nsid = 1; nsid <= n->num_namespaces; nsid++) {
+            if (!n->namespaces[nsid - 1].blk) {
+                break;
+            }
+        }
+        if (nsid > n->num_namespaces) {
+            error_setg(errp, "no free namespace left on the controller");
+            return;
+        }
+    } else if (nsid > n->num_namespaces) {
+        error_setg(errp, "nsid must be between 1 and %u", n->num_namespaces);
+        return;
+    } else if (n->namespaces[nsid - 1].blk) {
+        error_setg(errp, "namespace %u is already in use", nsid);
+        return;
+    }
+
+    blkconf_blocksizes(&nsdev->conf);
+    blkconf_apply_backend_options(&nsdev->conf);
+
+    aio_context_acquire(n->ctx);
+    ret = nvme_ns_init(n, &n->namespaces[nsid - 1], nsdev->conf.blk);
+    aio_context_release(n->ctx);
+    if (ret) {
+        error_setg(errp, "could not get the size of the drive");
+        return;
+    }
+    nsdev->nsid = nsid;
+}
+
+static Property nvme_ns_props[] = {
+    DEFINE_BLOCK_PROPERTIES(NvmeNsDevice, conf),
+    DEFINE_PROP_UINT32("nsid", NvmeNsDevice, nsid, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nvme_ns_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    dc->desc = "Virtual NVMe namespace";
+    dc->bus_type = TYPE_NVME_BUS;
+    dc->realize = nvme_ns_realize;
+    dc->props = nvme_ns_props;
+    /* namespaces are only detached together with their controller */
+    dc->hotpluggable = false;
+}
+
+static const TypeInfo nvme_ns_info = {
+    .name          = TYPE_NVME_NS,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(NvmeNsDevice),
+    .class_init    = nvme_ns_class_init,
+};
+
+static const TypeInfo nvme_bus_info = {
+    .name          = TYPE_NVME_BUS,
+    .parent        = TYPE_BUS,
+    .instance_size = sizeof(NvmeBus),
+};
+
 static const VMStateDescription nvme_vmstate = {
     .name = "nvme",
     .unmigratable = 1,
@@ -967,6 +1274,10 @@ static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *s = NVME(obj);
 
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
@@ -983,6 +1294,8 @@ static const TypeInfo nvme_info = {
 static void nvme_register_types(void)
 {
     type_register_static(&nvme_info);
+    type_register_static(&nvme_bus_info);
+    type_register_static(&nvme_ns_info);
 }
 
 type_init(nvme_register_types)
@@ -16,6 +16,8 @@
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qemu/stats.h"
 #include "trace.h"
 #include "hw/block/block.h"
 #include "sysemu/block-backend.h"
@@ -38,33 +40,80 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
     req->in_len = 0;
     req->next = NULL;
     req->mr_next = NULL;
+    req->trace.start_ns = 0;
 }
 
+/* Requests in flight for the pool */
+#define VIRTIO_BLK_REQ_POOL_SIZE    128
+/* Header, status and up to 14 data segments */
+#define VIRTIO_BLK_REQ_POOL_MAX_SG  16
+
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
     if (req) {
-        g_free(req);
+        virtqueue_element_free(&req->dev->req_pool, req);
     }
 }
 
-static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
+static void virtio_blk_account_latency(VirtIOBlockReq *req)
 {
-    VirtIOBlock *s = req->dev;
+    IOTrace *t = &req->trace;
+
+    io_trace_mark(t, IO_TRACE_NOTIFY);
+    if (io_trace_account(req->dev->latency, t)) {
+        trace_virtio_blk_latency_submit(req, t->stage_ns[IO_TRACE_POP],
+                                        t->stage_ns[IO_TRACE_SETUP],
+                                        t->stage_ns[IO_TRACE_BLOCK],
+                                        t->stage_ns[IO_TRACE_THROTTLE],
+                                        t->stage_ns[IO_TRACE_METADATA]);
+        trace_virtio_blk_latency_complete(req, t->stage_ns[IO_TRACE_QUEUE],
+                                          t->stage_ns[IO_TRACE_DEVICE],
+                                          t->stage_ns[IO_TRACE_COMPLETION],
+                                          t->stage_ns[IO_TRACE_NOTIFY],
+                                          t->stage_ns[IO_TRACE_TOTAL]);
+    }
+}
+
+/* Complete @n requests of the same virtqueue with a single used index
+ * update and notification.
+ */
+static void virtio_blk_req_complete_batch(VirtIOBlockReq **reqs,
+                                          unsigned int n,
+                                          unsigned char status)
+{
+    VirtIOBlock *s = reqs[0]->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtQueue *vq = reqs[0]->vq;
+    unsigned int i;
 
-    trace_virtio_blk_req_complete(req, status);
+    for (i = 0; i < n; i++) {
+        trace_virtio_blk_req_complete(reqs[i], status);
 
-    stb_p(&req->in->status, status);
-    virtqueue_push(req->vq, &req->elem, req->in_len);
+        assert(reqs[i]->vq == vq);
+        stb_p(&reqs[i]->in->status, status);
+        virtqueue_fill(vq, &reqs[i]->elem, reqs[i]->in_len, i);
+    }
+    virtqueue_flush(vq, n);
     if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
+        virtio_blk_data_plane_notify(s->dataplane, vq);
     } else {
-        virtio_notify(vdev, req->vq);
+        virtio_notify(vdev, vq);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (reqs[i]->trace.start_ns) {
+            virtio_blk_account_latency(reqs[i]);
+        }
     }
 }
 
+static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
+{
+    virtio_blk_req_complete_batch(&req, 1, status);
+}
+
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
-    bool is_read)
+    bool is_read, bool acct_failed)
 {
     BlockErrorAction action = blk_get_error_action(req->dev->blk,
                                                    is_read, error);
@@ -76,9 +125,13 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         req->mr_next = NULL;
         req->next = s->rq;
         s->rq = req;
+        /* Do not charge the time the VM is stopped to the request */
+        req->trace.start_ns = 0;
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
-        block_acct_failed(blk_get_stats(s->blk), &req->acct);
+        if (acct_failed) {
+            block_acct_failed(blk_get_stats(s->blk), &req->acct);
+        }
         virtio_blk_free_request(req);
     }
 
@@ -86,10 +139,34 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     return action != BLOCK_ERROR_ACTION_IGNORE;
 }
 
+/*
+ * Only the first of merged requests was followed through the block layer,
+ * the others take their breakdown from it.
+ */
+static void virtio_blk_trace_rw_complete(VirtIOBlockReq *head)
+{
+    IOTrace *trace = &head->trace;
+    VirtIOBlockReq *req;
+
+    if (trace->start_ns) {
+        io_trace_mark(trace, IO_TRACE_COMPLETION);
+    }
+    for (req = head->mr_next; req; req = req->mr_next) {
+        if (req->trace.start_ns && trace->start_ns) {
+            io_trace_inherit(&req->trace, trace);
+        } else {
+            req->trace.start_ns = 0;
+        }
+    }
+}
+
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *next = opaque;
+    VirtIOBlockReq *done[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i, start, ndone = 0;
 
+    virtio_blk_trace_rw_complete(next);
     while (next) {
         VirtIOBlockReq *req = next;
         next = req->mr_next;
@@ -113,14 +190,32 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
              * the memory until the request is completed (which will
              * happen on the other side of the migration).
              */
-            if (virtio_blk_handle_rw_error(req, -ret, is_read)) {
+            if (virtio_blk_handle_rw_error(req, -ret, is_read, true)) {
                 continue;
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
-        virtio_blk_free_request(req);
+        assert(ndone < ARRAY_SIZE(done));
+        done[ndone++] = req;
+    }
+
+    if (!ndone) {
+        return;
+    }
+    /*
+     * With a merge window, a merged request may span virtqueues; complete
+     * each run of requests from the same queue as one batch.
+     */
+    for (i = 1, start = 0; i <= ndone; i++) {
+        if (i == ndone || done[i]->vq != done[start]->vq) {
+            virtio_blk_req_complete_batch(&done[start], i - start,
+                                          VIRTIO_BLK_S_OK);
+            start = i;
+        }
+    }
+    for (i = 0; i < ndone; i++) {
+        block_acct_done(blk_get_stats(done[i]->dev->blk), &done[i]->acct);
+        virtio_blk_free_request(done[i]);
     }
 }
 
@@ -129,7 +224,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     VirtIOBlockReq *req = opaque;
 
     if (ret) {
-        if (virtio_blk_handle_rw_error(req, -ret, 0)) {
+        if (virtio_blk_handle_rw_error(req, -ret, 0, true)) {
             return;
         }
     }
@@ -189,16 +284,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
-{
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
-    }
-    return req;
-}
-
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
     int status = VIRTIO_BLK_S_OK;
@@ -325,6 +410,7 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
     QEMUIOVector *qiov = &mrb->reqs[start]->qiov;
     int64_t sector_num = mrb->reqs[start]->sector_num;
     bool is_write = mrb->is_write;
+    bool traced;
 
     if (num_reqs > 1) {
         int i;
@@ -354,6 +440,17 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
                               num_reqs - 1);
     }
 
+    /* See virtio_blk_trace_rw_complete() */
+    traced = mrb->reqs[start]->trace.start_ns;
+    if (traced) {
+        int i;
+
+        for (i = start; i < start + num_reqs; i++) {
+            io_trace_mark(&mrb->reqs[i]->trace, IO_TRACE_SETUP);
+        }
+        io_trace_set_current(&mrb->reqs[start]->trace);
+    }
+
     if (is_write) {
         blk_aio_pwritev(blk, sector_num << BDRV_SECTOR_BITS, qiov, 0,
                         virtio_blk_rw_complete, mrb->reqs[start]);
@@ -361,6 +458,10 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
         blk_aio_preadv(blk, sector_num << BDRV_SECTOR_BITS, qiov, 0,
                        virtio_blk_rw_complete, mrb->reqs[start]);
     }
+
+    if (traced) {
+        io_trace_set_current(NULL);
+    }
 }
 
 static int multireq_compare(const void *a, const void *b)
@@ -468,6 +569,164 @@ static bool virtio_blk_sect_range_ok(VirtIOBlock *dev,
     return true;
 }
 
+typedef struct VirtIOBlockRange {
+    uint64_t sector;
+    uint32_t nb_sectors;
+    uint32_t flags;
+} VirtIOBlockRange;
+
+typedef struct VirtIOBlockDiscardReq {
+    VirtIOBlockReq *req;
+    bool is_wzeroes;
+    unsigned int pending;
+    int ret;
+} VirtIOBlockDiscardReq;
+
+static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
+{
+    VirtIOBlockDiscardReq *dreq = opaque;
+    VirtIOBlockReq *req = dreq->req;
+    bool is_wzeroes = dreq->is_wzeroes;
+
+    if (ret && !dreq->ret) {
+        dreq->ret = ret;
+    }
+    if (--dreq->pending) {
+        return;
+    }
+    ret = dreq->ret;
+    g_free(dreq);
+
+    /* discards are not accounted, there is no type for them */
+    if (ret && virtio_blk_handle_rw_error(req, -ret, false, is_wzeroes)) {
+        return;
+    }
+
+    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+    if (is_wzeroes) {
+        block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
+    }
+    virtio_blk_free_request(req);
+}
+
+static int virtio_blk_range_compare(const void *a, const void *b)
+{
+    const VirtIOBlockRange *r1 = a, *r2 = b;
+
+    if (r1->sector > r2->sector) {
+        return 1;
+    } else if (r1->sector < r2->sector) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+/*
+ * The ranges of a request are sorted and adjacent ones merged, as is
+ * done for reads and writes by virtio_blk_submit_multireq(), and the
+ * request completes when the last of the resulting operations does.
+ */
+static uint8_t virtio_blk_handle_discard_write_zeroes(VirtIOBlockReq *req,
+                                                      struct iovec *iov,
+                                                      unsigned out_num,
+                                                      bool is_wzeroes)
+{
+    VirtIOBlock *s = req->dev;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    struct virtio_blk_discard_write_zeroes seg;
+    VirtIOBlockRange ranges[VIRTIO_BLK_MAX_DISCARD_SEGS];
+    VirtIOBlockDiscardReq *dreq;
+    size_t size = iov_size(iov, out_num);
+    uint32_t max_sectors, valid_flags;
+    unsigned int nsegs, nranges, i;
+    uint64_t bytes = 0;
+
+    if (!virtio_vdev_has_feature(vdev, is_wzeroes ? VIRTIO_BLK_F_WRITE_ZEROES
+                                                  : VIRTIO_BLK_F_DISCARD)) {
+        return VIRTIO_BLK_S_UNSUPP;
+    }
+
+    nsegs = size / sizeof(seg);
+    if (!nsegs || size % sizeof(seg) || nsegs > VIRTIO_BLK_MAX_DISCARD_SEGS) {
+        return VIRTIO_BLK_S_UNSUPP;
+    }
+
+    if (is_wzeroes) {
+        max_sectors = s->conf.max_write_zeroes_sectors;
+        valid_flags = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+    } else {
+        max_sectors = s->conf.max_discard_sectors;
+        valid_flags = 0;
+    }
+
+    for (i = 0; i < nsegs; i++) {
+        iov_to_buf(iov, out_num, i * sizeof(seg), &seg, sizeof(seg));
+        ranges[i].sector = le64_to_cpu(seg.sector);
+        ranges[i].nb_sectors = le32_to_cpu(seg.num_sectors);
+        ranges[i].flags = le32_to_cpu(seg.flags);
+
+        if (ranges[i].flags & ~valid_flags) {
+            return VIRTIO_BLK_S_UNSUPP;
+        }
+        if (ranges[i].nb_sectors > max_sectors ||
+            !virtio_blk_sect_range_ok(s, ranges[i].sector,
+                                      (uint64_t)ranges[i].nb_sectors <<
+                                      BDRV_SECTOR_BITS)) {
+            if (is_wzeroes) {
+                block_acct_invalid(blk_get_stats(s->blk), BLOCK_ACCT_WRITE);
+            }
+            return VIRTIO_BLK_S_IOERR;
+        }
+        bytes += (uint64_t)ranges[i].nb_sectors << BDRV_SECTOR_BITS;
+    }
+
+    qsort(ranges, nsegs, sizeof(ranges[0]), virtio_blk_range_compare);
+    nranges = 0;
+    for (i = 1; i < nsegs; i++) {
+        VirtIOBlockRange *last = &ranges[nranges];
+
+        if (last->sector + last->nb_sectors == ranges[i].sector &&
+            last->flags == ranges[i].flags &&
+            ranges[i].nb_sectors <=
+                BDRV_REQUEST_MAX_SECTORS - last->nb_sectors) {
+            last->nb_sectors += ranges[i].nb_sectors;
+        } else {
+            ranges[++nranges] = ranges[i];
+        }
+    }
+    nranges++;
+
+    trace_virtio_blk_handle_discard_write_zeroes(req, is_wzeroes, nsegs,
+                                                 nranges);
+    if (is_wzeroes) {
+        block_acct_start(blk_get_stats(s->blk), &req->acct, bytes,
+                         BLOCK_ACCT_WRITE);
+    }
+
+    dreq = g_new0(VirtIOBlockDiscardReq, 1);
+    dreq->req = req;
+    dreq->is_wzeroes = is_wzeroes;
+    dreq->pending = nranges;
+    for (i = 0; i < nranges; i++) {
+        int64_t offset = ranges[i].sector << BDRV_SECTOR_BITS;
+        int count = ranges[i].nb_sectors << BDRV_SECTOR_BITS;
+
+        if (is_wzeroes) {
+            blk_aio_pwrite_zeroes(s->blk, offset, count,
+                                  ranges[i].flags &
+                                  VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP ?
+                                  BDRV_REQ_MAY_UNMAP : 0,
+                                  virtio_blk_discard_write_zeroes_complete,
+                                  dreq);
+        } else {
+            blk_aio_pdiscard(s->blk, offset, count,
+                             virtio_blk_discard_write_zeroes_complete, dreq);
+        }
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
 static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     uint32_t type;
@@ -505,6 +764,12 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
     type = virtio_ldl_p(VIRTIO_DEVICE(req->dev), &req->out.type);
 
+    /* Only reads and writes are traced down to the host */
+    if ((type & ~(VIRTIO_BLK_T_OUT | VIRTIO_BLK_T_BARRIER)) !=
+        VIRTIO_BLK_T_IN) {
+        req->trace.start_ns = 0;
+    }
+
     /* VIRTIO_BLK_T_OUT defines the command direction. VIRTIO_BLK_T_BARRIER
      * is an optional flag. Although a guest should not send this flag if
      * not negotiated we ignored it in the past. So keep ignoring it. */
@@ -557,6 +822,25 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     case VIRTIO_BLK_T_SCSI_CMD:
         virtio_blk_handle_scsi(req);
         break;
+    /*
+     * VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES have the
+     * VIRTIO_BLK_T_OUT bit set, which is masked out above.
+     */
+    case VIRTIO_BLK_T_DISCARD & ~VIRTIO_BLK_T_OUT:
+    case VIRTIO_BLK_T_WRITE_ZEROES & ~VIRTIO_BLK_T_OUT:
+    {
+        bool is_wzeroes = (type & ~(VIRTIO_BLK_T_OUT | VIRTIO_BLK_T_BARRIER)) ==
+                          (VIRTIO_BLK_T_WRITE_ZEROES & ~VIRTIO_BLK_T_OUT);
+        uint8_t status;
+
+        status = virtio_blk_handle_discard_write_zeroes(req, iov, out_num,
+                                                        is_wzeroes);
+        if (status != VIRTIO_BLK_S_OK) {
+            virtio_blk_req_complete(req, status);
+            virtio_blk_free_request(req);
+        }
+        break;
+    }
     case VIRTIO_BLK_T_GET_ID:
     {
         VirtIOBlock *s = req->dev;
@@ -581,23 +865,100 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     return 0;
 }
 
+/* Submit the writes held back by the merge window */
+void virtio_blk_merge_window_flush(VirtIOBlock *s)
+{
+    if (!s->merge_mrb) {
+        return;
+    }
+    timer_del(s->merge_timer);
+    if (s->merge_mrb->num_reqs) {
+        virtio_blk_submit_multireq(s->blk, s->merge_mrb);
+    }
+}
+
+static void virtio_blk_merge_timer_cb(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    blk_io_plug(s->blk);
+    virtio_blk_merge_window_flush(s);
+    blk_io_unplug(s->blk);
+}
+
+/*
+ * Writes left over at the end of a batch wait up to merge_window_us for
+ * adjacent writes from later batches or other queues.  Reads are not
+ * held back, their latency is seen directly by the guest.
+ */
+static void virtio_blk_merge_window_arm(VirtIOBlock *s)
+{
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    /* Nothing may be held back while the backend is drained */
+    if (!s->merge_mrb->is_write || s->merge_quiesce_counter) {
+        virtio_blk_submit_multireq(s->blk, s->merge_mrb);
+        return;
+    }
+    if (s->merge_timer && s->merge_timer_ctx != ctx) {
+        /* the window was flushed when the context changed */
+        timer_free(s->merge_timer);
+        s->merge_timer = NULL;
+    }
+    if (!s->merge_timer) {
+        s->merge_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                       virtio_blk_merge_timer_cb, s);
+        s->merge_timer_ctx = ctx;
+    }
+    if (!timer_pending(s->merge_timer)) {
+        timer_mod(s->merge_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                  s->conf.merge_window_us * SCALE_US);
+    }
+}
+
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = s->merge_mrb ? s->merge_mrb : &local_mrb;
+    unsigned int i, n;
+    int64_t pop_ns;
+    bool error = false;
 
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s, vq))) {
-        if (virtio_blk_handle_request(req, &mrb)) {
-            virtqueue_detach_element(req->vq, &req->elem, 0);
-            virtio_blk_free_request(req);
-            break;
+    pop_ns = s->latency ? get_clock() : 0;
+    while (!error &&
+           (n = virtqueue_pop_batch(vq, &s->req_pool, (void **)reqs,
+                                    ARRAY_SIZE(reqs)))) {
+        for (i = 0; i < n; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
+            if (s->latency) {
+                /* each request waited for the whole batch */
+                io_trace_start(&reqs[i]->trace, pop_ns);
+                io_trace_mark(&reqs[i]->trace, IO_TRACE_POP);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            if (error) {
+                /* The device is broken, drop the rest of the batch */
+                virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                virtio_blk_free_request(reqs[i]);
+            } else if (virtio_blk_handle_request(reqs[i], mrb)) {
+                virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                virtio_blk_free_request(reqs[i]);
+                error = true;
+            }
         }
+        pop_ns = s->latency ? get_clock() : 0;
     }
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    if (mrb->num_reqs) {
+        if (mrb == s->merge_mrb && !error) {
+            virtio_blk_merge_window_arm(s);
+        } else {
+            virtio_blk_submit_multireq(s->blk, mrb);
+        }
     }
 
     blk_io_unplug(s->blk);
@@ -658,6 +1019,12 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     VirtIOBlock *s = opaque;
 
     if (!running) {
+        /* Requests must not wait in the window across the vm stop drain */
+        AioContext *ctx = blk_get_aio_context(s->conf.conf.blk);
+
+        aio_context_acquire(ctx);
+        virtio_blk_merge_window_flush(s);
+        aio_context_release(ctx);
         return;
     }
 
@@ -676,6 +1043,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
+    virtio_blk_merge_window_flush(s);
     blk_drain(s->blk);
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
@@ -735,7 +1103,26 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.alignment_offset = 0;
     blkcfg.wce = blk_enable_write_cache(s->blk);
     virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    if (virtio_has_feature(s->host_features, VIRTIO_BLK_F_DISCARD)) {
+        uint32_t align = conf->discard_granularity != -1 &&
+                         conf->discard_granularity ?
+                         conf->discard_granularity : blk_size;
+
+        virtio_stl_p(vdev, &blkcfg.max_discard_sectors,
+                     s->conf.max_discard_sectors);
+        virtio_stl_p(vdev, &blkcfg.max_discard_seg,
+                     VIRTIO_BLK_MAX_DISCARD_SEGS);
+        virtio_stl_p(vdev, &blkcfg.discard_sector_alignment,
+                     align >> BDRV_SECTOR_BITS);
+    }
+    if (virtio_has_feature(s->host_features, VIRTIO_BLK_F_WRITE_ZEROES)) {
+        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_sectors,
+                     s->conf.max_write_zeroes_sectors);
+        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_seg,
+                     VIRTIO_BLK_MAX_DISCARD_SEGS);
+        blkcfg.write_zeroes_may_unmap = 1;
+    }
+    memcpy(config, &blkcfg, s->config_size);
 }
 
 static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -743,7 +1130,7 @@ static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     struct virtio_blk_config blkcfg;
 
-    memcpy(&blkcfg, config, sizeof(blkcfg));
+    memcpy(&blkcfg, config, s->config_size);
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_set_enable_write_cache(s->blk, blkcfg.wce != 0);
@@ -777,6 +1164,10 @@ static uint64_t virtio_blk_get_features(VirtIODevice *vdev, uint64_t features,
     }
     if (blk_is_read_only(s->blk)) {
         virtio_add_feature(&features, VIRTIO_BLK_F_RO);
+    } else {
+        features |= s->host_features &
+                    ((1ULL << VIRTIO_BLK_F_DISCARD) |
+                     (1ULL << VIRTIO_BLK_F_WRITE_ZEROES));
     }
     if (s->conf.num_queues > 1) {
         virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
@@ -834,7 +1225,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -860,7 +1251,7 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
             }
         }
 
-        req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
+        req = qemu_get_virtqueue_element(vdev, f, sizeof(VirtIOBlockReq));
         virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
         req->next = s->rq;
         s->rq = req;
@@ -876,8 +1267,29 @@ static void virtio_blk_resize(void *opaque)
     virtio_notify_config(vdev);
 }
 
+static void virtio_blk_drained_begin(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    /* The drain must see the writes waiting in the merge window */
+    s->merge_quiesce_counter++;
+    virtio_blk_merge_window_flush(s);
+}
+
+static void virtio_blk_drained_end(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    /* The section may have begun before realize set the dev_ops */
+    if (s->merge_quiesce_counter) {
+        s->merge_quiesce_counter--;
+    }
+}
+
 static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
+    .drained_begin = virtio_blk_drained_begin,
+    .drained_end = virtio_blk_drained_end,
 };
 
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
@@ -900,6 +1312,22 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "num-queues property must be larger than 0");
         return;
     }
+    if (!conf->max_discard_sectors ||
+        conf->max_discard_sectors > BDRV_REQUEST_MAX_SECTORS) {
+        error_setg(errp, "max-discard-sectors property must be between 1 "
+                   "and %d", (int)BDRV_REQUEST_MAX_SECTORS);
+        return;
+    }
+    if (!conf->max_write_zeroes_sectors ||
+        conf->max_write_zeroes_sectors > BDRV_REQUEST_MAX_SECTORS) {
+        error_setg(errp, "max-write-zeroes-sectors property must be between "
+                   "1 and %d", (int)BDRV_REQUEST_MAX_SECTORS);
+        return;
+    }
+    if (conf->merge_window_us > 100000) {
+        error_setg(errp, "merge-window-us property must be at most 100000");
+        return;
+    }
 
     blkconf_serial(&conf->conf, &conf->serial);
     blkconf_apply_backend_options(&conf->conf);
@@ -911,12 +1339,24 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     }
     blkconf_blocksizes(&conf->conf);
 
-    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
-                sizeof(struct virtio_blk_config));
+    /* the config space only grows for the features that need it */
+    if (virtio_has_feature(s->host_features, VIRTIO_BLK_F_WRITE_ZEROES)) {
+        s->config_size = offsetof(struct virtio_blk_config, unused1);
+    } else if (virtio_has_feature(s->host_features, VIRTIO_BLK_F_DISCARD)) {
+        s->config_size = offsetof(struct virtio_blk_config,
+                                  max_write_zeroes_sectors);
+    } else {
+        s->config_size = offsetof(struct virtio_blk_config,
+                                  max_discard_sectors);
+    }
+    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
+    virtqueue_element_pool_init(&s->req_pool, sizeof(VirtIOBlockReq),
+                                VIRTIO_BLK_REQ_POOL_SIZE,
+                                VIRTIO_BLK_REQ_POOL_MAX_SG);
 
     for (i = 0; i < conf->num_queues; i++) {
         virtio_add_queue_aio(vdev, 128, virtio_blk_handle_output);
@@ -924,10 +1364,19 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        virtqueue_element_pool_destroy(&s->req_pool);
         virtio_cleanup(vdev);
         return;
     }
 
+    if (conf->merge_window_us) {
+        s->merge_mrb = g_new0(MultiReqBuffer, 1);
+    }
+    if (conf->latency_trace) {
+        s->latency = g_new0(IOTraceStats, 1);
+        s->latency->sample_every = conf->latency_trace_sample;
+        io_trace_enable();
+    }
     s->change = qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     blk_set_dev_ops(s->blk, &virtio_block_ops, s);
     blk_set_guest_block_size(s->blk, s->conf.conf.logical_block_size);
@@ -939,11 +1388,31 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
+    VirtIOBlockReq *req;
 
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
+    if (s->merge_mrb) {
+        virtio_blk_merge_window_flush(s);
+        blk_drain(s->blk);
+        if (s->merge_timer) {
+            timer_free(s->merge_timer);
+        }
+        g_free(s->merge_mrb);
+    }
+    if (s->latency) {
+        io_trace_disable();
+        g_free(s->latency);
+        s->latency = NULL;
+    }
     blockdev_mark_auto_del(s->blk);
+    while (s->rq) {
+        req = s->rq;
+        s->rq = req->next;
+        virtio_blk_free_request(req);
+    }
+    virtqueue_element_pool_destroy(&s->req_pool);
     virtio_cleanup(vdev);
 }
 
@@ -982,6 +1451,19 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
+                      VIRTIO_BLK_F_DISCARD, true),
+    DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
+                      VIRTIO_BLK_F_WRITE_ZEROES, true),
+    DEFINE_PROP_UINT32("max-discard-sectors", VirtIOBlock,
+                       conf.max_discard_sectors, BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("max-write-zeroes-sectors", VirtIOBlock,
+                       conf.max_write_zeroes_sectors,
+                       BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("merge-window-us", VirtIOBlock, conf.merge_window_us, 0),
+    DEFINE_PROP_BIT("latency-trace", VirtIOBlock, conf.latency_trace, 0, false),
+    DEFINE_PROP_UINT32("latency-trace-sample", VirtIOBlock,
+                       conf.latency_trace_sample, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1012,9 +1494,37 @@ static const TypeInfo virtio_blk_info = {
     .class_init = virtio_blk_class_init,
 };
 
+/* Each device that traces its requests is reported by its QOM path */
+static int virtio_blk_latency_stats_one(Object *obj, void *opaque)
+{
+    StatsCollector *c = opaque;
+    VirtIOBlock *s;
+    char *path;
+
+    s = (VirtIOBlock *)object_dynamic_cast(obj, TYPE_VIRTIO_BLK);
+    if (!s || !s->latency) {
+        return 0;
+    }
+
+    path = object_get_canonical_path(obj);
+    if (stats_begin_instance(c, path)) {
+        io_trace_stats_report(c, s->latency);
+    }
+    g_free(path);
+    return 0;
+}
+
+static void virtio_blk_latency_stats(StatsCollector *c, void *opaque)
+{
+    object_child_foreach_recursive(object_get_root(),
+                                   virtio_blk_latency_stats_one, c);
+}
+
 static void virtio_register_types(void)
 {
     type_register_static(&virtio_blk_info);
+    stats_register_provider("virtio-blk-latency", virtio_blk_latency_stats,
+                            NULL);
 }
 
 type_init(virtio_register_types)
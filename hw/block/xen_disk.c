@@ -36,13 +36,14 @@
 
 static int batch_maps   = 0;
 
-static int max_requests = 32;
-
 /* ------------------------------------------------------------- */
 
 #define BLOCK_SIZE  512
 #define IOCB_COUNT  (BLKIF_MAX_SEGMENTS_PER_REQUEST + 2)
 
+/* Up to 16 pages of shared ring, as for blkback */
+#define MAX_RING_PAGE_ORDER 4
+
 struct PersistentGrant {
     void *page;
     struct XenBlkDev *blkdev;
@@ -94,7 +95,8 @@ struct XenBlkDev {
     bool                directiosafe;
     const char          *fileproto;
     const char          *filename;
-    int                 ring_ref;
+    uint32_t            ring_ref[1 << MAX_RING_PAGE_ORDER];
+    unsigned int        nr_ring_ref;
     void                *sring;
     int64_t             file_blk;
     int64_t             file_size;
@@ -102,6 +104,7 @@ struct XenBlkDev {
     blkif_back_rings_t  rings;
     int                 more_work;
     int                 cnt_map;
+    int                 max_requests;   /* Number of slots of the ring */
 
     /* request lists */
     QLIST_HEAD(inflight_head, ioreq) inflight;
@@ -199,7 +202,7 @@ static struct ioreq *ioreq_start(struct XenBlkDev *blkdev)
     struct ioreq *ioreq = NULL;
 
     if (QLIST_EMPTY(&blkdev->freelist)) {
-        if (blkdev->requests_total >= max_requests) {
+        if (blkdev->requests_total >= blkdev->max_requests) {
             goto out;
         }
         /* allocate new struct */
@@ -875,7 +878,8 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
         ioreq_runio_qemu_aio(ioreq);
     }
 
-    if (blkdev->more_work && blkdev->requests_inflight < max_requests) {
+    if (blkdev->more_work &&
+        blkdev->requests_inflight < blkdev->max_requests) {
         qemu_bh_schedule(blkdev->bh);
     }
 }
@@ -908,11 +912,6 @@ static void blk_alloc(struct XenDevice *xendev)
     if (xen_mode != XEN_EMULATE) {
         batch_maps = 1;
     }
-    if (xengnttab_set_max_grants(xendev->gnttabdev,
-            MAX_GRANTS(max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST)) < 0) {
-        xen_be_printf(xendev, 0, "xengnttab_set_max_grants failed: %s\n",
-                      strerror(errno));
-    }
 }
 
 static void blk_parse_discard(struct XenBlkDev *blkdev)
@@ -998,6 +997,8 @@ static int blk_init(struct XenDevice *xendev)
      */
     xenstore_write_be_int(&blkdev->xendev, "feature-flush-cache", 1);
     xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
+    xenstore_write_be_int(&blkdev->xendev, "max-ring-page-order",
+                          MAX_RING_PAGE_ORDER);
     xenstore_write_be_int(&blkdev->xendev, "info", info);
 
     blk_parse_discard(blkdev);
@@ -1024,7 +1025,8 @@ out_error:
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
-    int pers, index, qflags;
+    int pers, index, qflags, order, ring_ref;
+    unsigned int ring_size, i;
     bool readonly = true;
     bool writethrough = true;
 
@@ -1100,7 +1102,30 @@ static int blk_connect(struct XenDevice *xendev)
     xenstore_write_be_int64(&blkdev->xendev, "sectors",
                             blkdev->file_size / blkdev->file_blk);
 
-    if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1) {
+    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order",
+                             &order) == -1) {
+        /* Single page ring */
+        if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref",
+                                 &ring_ref) == -1) {
+            return -1;
+        }
+        blkdev->nr_ring_ref = 1;
+        blkdev->ring_ref[0] = ring_ref;
+    } else if (order >= 0 && order <= MAX_RING_PAGE_ORDER) {
+        blkdev->nr_ring_ref = 1 << order;
+        for (i = 0; i < blkdev->nr_ring_ref; i++) {
+            char *key = g_strdup_printf("ring-ref%u", i);
+            int ret = xenstore_read_fe_int(&blkdev->xendev, key, &ring_ref);
+
+            g_free(key);
+            if (ret == -1) {
+                return -1;
+            }
+            blkdev->ring_ref[i] = ring_ref;
+        }
+    } else {
+        xen_be_printf(&blkdev->xendev, 0, "invalid ring-page-order: %d\n",
+                      order);
         return -1;
     }
     if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
@@ -1125,41 +1150,73 @@ static int blk_connect(struct XenDevice *xendev)
         blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
     }
 
-    blkdev->sring = xengnttab_map_grant_ref(blkdev->xendev.gnttabdev,
-                                            blkdev->xendev.dom,
-                                            blkdev->ring_ref,
-                                            PROT_READ | PROT_WRITE);
+    ring_size = XC_PAGE_SIZE * blkdev->nr_ring_ref;
+    switch (blkdev->protocol) {
+    case BLKIF_PROTOCOL_NATIVE:
+        blkdev->max_requests = __CONST_RING_SIZE(blkif, ring_size);
+        break;
+    case BLKIF_PROTOCOL_X86_32:
+        blkdev->max_requests = __CONST_RING_SIZE(blkif_x86_32, ring_size);
+        break;
+    case BLKIF_PROTOCOL_X86_64:
+        blkdev->max_requests = __CONST_RING_SIZE(blkif_x86_64, ring_size);
+        break;
+    }
+
+    /* The ring size is only known now, but the ring itself is a grant too */
+    if (xengnttab_set_max_grants(blkdev->xendev.gnttabdev,
+            MAX_GRANTS(blkdev->max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST) +
+            blkdev->nr_ring_ref) < 0) {
+        xen_be_printf(&blkdev->xendev, 0,
+                      "xengnttab_set_max_grants failed: %s\n",
+                      strerror(errno));
+    }
+
+    if (blkdev->nr_ring_ref == 1) {
+        blkdev->sring = xengnttab_map_grant_ref(blkdev->xendev.gnttabdev,
+                                                blkdev->xendev.dom,
+                                                blkdev->ring_ref[0],
+                                                PROT_READ | PROT_WRITE);
+    } else {
+        blkdev->sring = xengnttab_map_domain_grant_refs(
+                                                blkdev->xendev.gnttabdev,
+                                                blkdev->nr_ring_ref,
+                                                blkdev->xendev.dom,
+                                                blkdev->ring_ref,
+                                                PROT_READ | PROT_WRITE);
+    }
     if (!blkdev->sring) {
         return -1;
     }
-    blkdev->cnt_map++;
+    blkdev->cnt_map += blkdev->nr_ring_ref;
 
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
     {
         blkif_sring_t *sring_native = blkdev->sring;
-        BACK_RING_INIT(&blkdev->rings.native, sring_native, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.native, sring_native, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_32:
     {
         blkif_x86_32_sring_t *sring_x86_32 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_64:
     {
         blkif_x86_64_sring_t *sring_x86_64 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, ring_size);
         break;
     }
     }
 
     if (blkdev->feature_persistent) {
         /* Init persistent grants */
-        blkdev->max_grants = max_requests * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        blkdev->max_grants = blkdev->max_requests *
+                             BLKIF_MAX_SEGMENTS_PER_REQUEST;
         blkdev->persistent_gnts = g_tree_new_full((GCompareDataFunc)int_cmp,
                                              NULL, NULL,
                                              batch_maps ?
@@ -1177,9 +1234,9 @@ static int blk_connect(struct XenDevice *xendev)
     xen_be_printf(&blkdev->xendev, 3, "grant copy operation %s\n",
                   blkdev->feature_grant_copy ? "enabled" : "disabled");
 
-    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
+    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, nr-ring-ref %u, "
                   "remote port %d, local port %d\n",
-                  blkdev->xendev.protocol, blkdev->ring_ref,
+                  blkdev->xendev.protocol, blkdev->nr_ring_ref,
                   blkdev->xendev.remote_port, blkdev->xendev.local_port);
     return 0;
 }
@@ -1196,8 +1253,9 @@ static void blk_disconnect(struct XenDevice *xendev)
     xen_be_unbind_evtchn(&blkdev->xendev);
 
     if (blkdev->sring) {
-        xengnttab_unmap(blkdev->xendev.gnttabdev, blkdev->sring, 1);
-        blkdev->cnt_map--;
+        xengnttab_unmap(blkdev->xendev.gnttabdev, blkdev->sring,
+                        blkdev->nr_ring_ref);
+        blkdev->cnt_map -= blkdev->nr_ring_ref;
         blkdev->sring = NULL;
     }
 
@@ -691,7 +691,7 @@ static void virtio_serial_save_device(VirtIODevice *vdev, QEMUFile *f)
         if (elem_popped) {
             qemu_put_be32s(f, &port->iov_idx);
             qemu_put_be64s(f, &port->iov_offset);
-            qemu_put_virtqueue_element(f, port->elem);
+            qemu_put_virtqueue_element(vdev, f, port->elem);
         }
     }
 }
@@ -764,8 +764,8 @@ static int fetch_active_ports_list(QEMUFile *f,
             qemu_get_be32s(f, &port->iov_idx);
             qemu_get_be64s(f, &port->iov_offset);
 
-            port->elem =
-                qemu_get_virtqueue_element(f, sizeof(VirtQueueElement));
+            port->elem = qemu_get_virtqueue_element(VIRTIO_DEVICE(s), f,
+                                                    sizeof(VirtQueueElement));
 
             /*
              *  Port was throttled on source machine.  Let's
@@ -57,6 +57,33 @@ void hotplug_handler_unplug(HotplugHandler *plug_handler,
     }
 }
 
+static int hotplug_batch_depth;
+static NotifierList hotplug_batch_notifiers =
+    NOTIFIER_LIST_INITIALIZER(hotplug_batch_notifiers);
+
+void hotplug_batch_begin(void)
+{
+    hotplug_batch_depth++;
+}
+
+void hotplug_batch_end(void)
+{
+    assert(hotplug_batch_depth > 0);
+    if (--hotplug_batch_depth == 0) {
+        notifier_list_notify(&hotplug_batch_notifiers, NULL);
+    }
+}
+
+bool hotplug_batch_active(void)
+{
+    return hotplug_batch_depth > 0;
+}
+
+void hotplug_batch_add_notifier(Notifier *notifier)
+{
+    notifier_list_add(&hotplug_batch_notifiers, notifier);
+}
+
 static const TypeInfo hotplug_handler_info = {
     .name          = TYPE_HOTPLUG_HANDLER,
     .parent        = TYPE_INTERFACE,
@@ -803,6 +803,8 @@ struct Rom {
     size_t datasize;
 
     uint8_t *data;
+    /* data is a private mapping of the file at path rather than heap memory */
+    bool data_mapped;
     MemoryRegion *mr;
     AddressSpace *as;
     int isrom;
@@ -871,6 +873,54 @@ static void *rom_set_mr(Rom *rom, Object *owner, const char *name)
     return data;
 }
 
+/*
+ * Fill rom->data with the contents of @fd.  The file is mapped rather than
+ * read when possible: the data is usually touched only once, when it is
+ * copied to guest memory or to fw_cfg, so there is no point in reading
+ * all of it before the machine is even built.
+ */
+static int rom_load_data(Rom *rom, int fd)
+{
+    int rc;
+#ifndef _WIN32
+    void *data;
+
+    if (rom->datasize) {
+        data = mmap(NULL, rom->datasize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            rom->data = data;
+            rom->data_mapped = true;
+            return 0;
+        }
+    }
+#endif
+
+    rom->data = g_malloc0(rom->datasize);
+    lseek(fd, 0, SEEK_SET);
+    rc = read(fd, rom->data, rom->datasize);
+    if (rc != rom->datasize) {
+        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                rom->name, rc, rom->datasize);
+        return -1;
+    }
+    return 0;
+}
+
+static void rom_free_data(Rom *rom)
+{
+#ifndef _WIN32
+    if (rom->data_mapped) {
+        munmap(rom->data, rom->datasize);
+        rom->data = NULL;
+        rom->data_mapped = false;
+        return;
+    }
+#endif
+    g_free(rom->data);
+    rom->data = NULL;
+}
+
 int rom_add_file(const char *file, const char *fw_dir,
                  hwaddr addr, int32_t bootindex,
                  bool option_rom, MemoryRegion *mr,
@@ -878,7 +928,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 {
     MachineClass *mc = MACHINE_GET_CLASS(qdev_get_machine());
     Rom *rom;
-    int rc, fd = -1;
+    int fd = -1;
     char devpath[100];
 
     if (as && mr) {
@@ -916,12 +966,7 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
 
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
+    if (rom_load_data(rom, fd) < 0) {
         goto err;
     }
     close(fd);
@@ -964,7 +1009,7 @@ err:
     if (fd != -1)
         close(fd);
 
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     if (fw_dir) {
@@ -1063,8 +1108,7 @@ static void rom_reset(void *unused)
         }
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
         /*
          * The rom loader is really on the same level as firmware in the guest
@@ -25,6 +25,7 @@
 #include "qemu/timer.h"
 #include "qemu/queue.h"
 #include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 #include "sysemu/sysemu.h"
 #include "trace.h"
 
@@ -1529,10 +1530,9 @@ static void qxl_set_mode(PCIQXLDevice *d, unsigned int modenr, int loadvm)
     qxl_rom_set_dirty(d);
 }
 
-static void ioport_write(void *opaque, hwaddr addr,
-                         uint64_t val, unsigned size)
+static void ioport_write_locked(PCIQXLDevice *d, hwaddr addr,
+                                uint64_t val, unsigned size)
 {
-    PCIQXLDevice *d = opaque;
     uint32_t io_port = addr;
     qxl_async_io async = QXL_SYNC;
     uint32_t orig_io_port = io_port;
@@ -1760,6 +1760,68 @@ cancel_async:
     }
 }
 
+/*
+ * The io ports are dispatched without the BQL.  Notifications and
+ * synchronous update area requests from a well behaved guest in native
+ * mode only talk to the spice server, which does not need the BQL, so
+ * they are handled here directly; this matters because the update area
+ * waits for the spice worker to render.  Everything else, including any
+ * request that fails the checks below, goes through the locked path.
+ */
+static bool ioport_write_unlocked(PCIQXLDevice *d, uint32_t io_port,
+                                  uint64_t val, unsigned size)
+{
+    QXLRect update;
+    uint32_t surface_id;
+
+    if (atomic_read(&d->guest_bug) || atomic_read(&d->mode) == QXL_MODE_VGA) {
+        return false;
+    }
+
+    switch (io_port) {
+    case QXL_IO_NOTIFY_CMD:
+    case QXL_IO_NOTIFY_CURSOR:
+        trace_qxl_io_write(d->id, qxl_mode_to_string(d->mode), io_port,
+                           io_port_to_string(io_port), val, size, QXL_SYNC);
+        qemu_spice_wakeup(&d->ssd);
+        return true;
+    case QXL_IO_UPDATE_AREA:
+        update = d->ram->update_area;
+        surface_id = d->ram->update_surface;
+        if (surface_id > d->ssd.num_surfaces ||
+            update.left >= update.right || update.top >= update.bottom ||
+            update.left < 0 || update.top < 0) {
+            return false;
+        }
+        trace_qxl_io_write(d->id, qxl_mode_to_string(d->mode), io_port,
+                           io_port_to_string(io_port), val, size, QXL_SYNC);
+        qxl_spice_update_area(d, surface_id, &update, NULL, 0, 0,
+                              QXL_SYNC, NULL);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void ioport_write(void *opaque, hwaddr addr,
+                         uint64_t val, unsigned size)
+{
+    PCIQXLDevice *d = opaque;
+
+    if (qemu_mutex_iothread_locked()) {
+        ioport_write_locked(d, addr, val, size);
+        return;
+    }
+
+    if (ioport_write_unlocked(d, addr, val, size)) {
+        return;
+    }
+
+    qemu_mutex_lock_iothread();
+    ioport_write_locked(d, addr, val, size);
+    qemu_mutex_unlock_iothread();
+}
+
 static uint64_t ioport_read(void *opaque, hwaddr addr,
                             unsigned size)
 {
@@ -2021,6 +2083,7 @@ static void qxl_realize_common(PCIQXLDevice *qxl, Error **errp)
 
     memory_region_init_io(&qxl->io_bar, OBJECT(qxl), &qxl_io_ops, qxl,
                           "qxl-ioports", io_size);
+    memory_region_clear_global_locking(&qxl->io_bar);
     if (qxl->id == 0) {
         vga_dirty_log_start(&qxl->vga);
     }
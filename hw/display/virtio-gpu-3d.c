@@ -78,9 +78,17 @@ static void virgl_cmd_resource_unref(VirtIOGPU *g,
 {
     struct virtio_gpu_resource_unref unref;
 
+    int i;
+
     VIRTIO_GPU_FILL_CMD(unref);
     trace_virtio_gpu_cmd_res_unref(unref.resource_id);
 
+    /* The texture name may be reused, do not take it for the same one */
+    for (i = 0; i < g->conf.max_outputs; i++) {
+        if (g->scanout[i].resource_id == unref.resource_id) {
+            g->scanout[i].gl.tex_id = 0;
+        }
+    }
     virgl_renderer_resource_unref(unref.resource_id);
 }
 
@@ -141,6 +149,7 @@ static void virgl_cmd_set_scanout(VirtIOGPU *g,
 {
     struct virtio_gpu_set_scanout ss;
     struct virgl_renderer_resource_info info;
+    struct virtio_gpu_scanout *scanout;
     int ret;
 
     VIRTIO_GPU_FILL_CMD(ss);
@@ -154,6 +163,7 @@ static void virgl_cmd_set_scanout(VirtIOGPU *g,
         return;
     }
     g->enable = 1;
+    scanout = &g->scanout[ss.scanout_id];
 
     memset(&info, 0, sizeof(info));
 
@@ -166,21 +176,40 @@ static void virgl_cmd_set_scanout(VirtIOGPU *g,
             cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
             return;
         }
-        qemu_console_resize(g->scanout[ss.scanout_id].con,
-                            ss.r.width, ss.r.height);
+
+        /*
+         * Guests repeat SET_SCANOUT with the same framebuffer on every
+         * plane update.  Passing the same texture again would only make
+         * the UI export and import it (e.g. as a dmabuf for SPICE) again.
+         */
+        if (scanout->resource_id == ss.resource_id && info.tex_id &&
+            scanout->gl.tex_id == info.tex_id &&
+            scanout->gl.y_0_top == (info.flags & 1) &&
+            scanout->gl.width == info.width &&
+            scanout->gl.height == info.height &&
+            !memcmp(&scanout->gl.r, &ss.r, sizeof(ss.r))) {
+            return;
+        }
+
+        qemu_console_resize(scanout->con, ss.r.width, ss.r.height);
         virgl_renderer_force_ctx_0();
-        dpy_gl_scanout(g->scanout[ss.scanout_id].con, info.tex_id,
+        dpy_gl_scanout(scanout->con, info.tex_id,
                        info.flags & 1 /* FIXME: Y_0_TOP */,
                        info.width, info.height,
                        ss.r.x, ss.r.y, ss.r.width, ss.r.height);
+        scanout->gl.tex_id = info.tex_id;
+        scanout->gl.y_0_top = info.flags & 1;
+        scanout->gl.width = info.width;
+        scanout->gl.height = info.height;
+        scanout->gl.r = ss.r;
     } else {
         if (ss.scanout_id != 0) {
-            dpy_gfx_replace_surface(g->scanout[ss.scanout_id].con, NULL);
+            dpy_gfx_replace_surface(scanout->con, NULL);
         }
-        dpy_gl_scanout(g->scanout[ss.scanout_id].con, 0, false,
-                       0, 0, 0, 0, 0, 0);
+        dpy_gl_scanout(scanout->con, 0, false, 0, 0, 0, 0, 0, 0);
+        scanout->gl.tex_id = 0;
     }
-    g->scanout[ss.scanout_id].resource_id = ss.resource_id;
+    scanout->resource_id = ss.resource_id;
 }
 
 static void virgl_cmd_submit_3d(VirtIOGPU *g,
@@ -582,6 +611,7 @@ void virtio_gpu_virgl_reset(VirtIOGPU *g)
             dpy_gfx_replace_surface(g->scanout[i].con, NULL);
         }
         dpy_gl_scanout(g->scanout[i].con, 0, false, 0, 0, 0, 0, 0, 0);
+        g->scanout[i].gl.tex_id = 0;
     }
 }
 
@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/bitmap.h"
 #include "ui/console.h"
 #include "trace.h"
 #include "hw/virtio/virtio.h"
@@ -349,6 +350,7 @@ static void virtio_gpu_resource_create_2d(VirtIOGPU *g,
         cmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
         return;
     }
+    pixman_region_init(&res->damage);
 
     QTAILQ_INSERT_HEAD(&g->reslist, res, next);
 }
@@ -357,6 +359,7 @@ static void virtio_gpu_resource_destroy(VirtIOGPU *g,
                                         struct virtio_gpu_simple_resource *res)
 {
     pixman_image_unref(res->image);
+    pixman_region_fini(&res->damage);
     QTAILQ_REMOVE(&g->reslist, res, next);
     g_free(res);
 }
@@ -380,6 +383,77 @@ static void virtio_gpu_resource_unref(VirtIOGPU *g,
     virtio_gpu_resource_destroy(g, res);
 }
 
+/*
+ * Transfers into resources that are on a scanout are compared against the
+ * previous contents in tiles of VIRTIO_GPU_DAMAGE_TILE pixels by
+ * VIRTIO_GPU_DAMAGE_BAND lines, and only the tiles that changed are
+ * added to the damage.  Many guests transfer and flush the whole screen
+ * for every update.
+ */
+#define VIRTIO_GPU_DAMAGE_TILE      64
+#define VIRTIO_GPU_DAMAGE_BAND      16
+
+/* Above this number of rectangles, flush the extents of the damage */
+#define VIRTIO_GPU_DAMAGE_MAX_RECTS 16
+
+static void virtio_gpu_damage_band(struct virtio_gpu_simple_resource *res,
+                                   unsigned long *tiles, int n_tiles,
+                                   struct virtio_gpu_rect *r, int y, int h)
+{
+    int i = find_first_bit(tiles, n_tiles);
+
+    while (i < n_tiles) {
+        int end = find_next_zero_bit(tiles, n_tiles, i);
+        int x = i * VIRTIO_GPU_DAMAGE_TILE;
+        int w = MIN(end * VIRTIO_GPU_DAMAGE_TILE, r->width) - x;
+
+        pixman_region_union_rect(&res->damage, &res->damage,
+                                 r->x + x, r->y + y, w, h);
+        i = find_next_bit(tiles, n_tiles, end);
+    }
+    bitmap_zero(tiles, n_tiles);
+}
+
+static void virtio_gpu_xfer_cmp(struct virtio_gpu_simple_resource *res,
+                                struct virtio_gpu_transfer_to_host_2d *t2d,
+                                uint32_t stride, int bpp)
+{
+    uint8_t *img_data = (uint8_t *)pixman_image_get_data(res->image);
+    int n_tiles = DIV_ROUND_UP(t2d->r.width, VIRTIO_GPU_DAMAGE_TILE);
+    unsigned long *tiles = bitmap_new(n_tiles);
+    size_t line_bytes = t2d->r.width * bpp;
+    size_t tile_bytes = VIRTIO_GPU_DAMAGE_TILE * bpp;
+    uint8_t *line = g_malloc(line_bytes);
+    int band_y = 0;
+    int h, i;
+
+    for (h = 0; h < t2d->r.height; h++) {
+        uint8_t *dst = img_data + (t2d->r.y + h) * stride + t2d->r.x * bpp;
+
+        iov_to_buf(res->iov, res->iov_cnt, t2d->offset + stride * h,
+                   line, line_bytes);
+        for (i = 0; i < n_tiles; i++) {
+            size_t off = i * tile_bytes;
+            size_t len = MIN(tile_bytes, line_bytes - off);
+
+            if (memcmp(dst + off, line + off, len)) {
+                memcpy(dst + off, line + off, len);
+                set_bit(i, tiles);
+            }
+        }
+
+        if (h + 1 - band_y == VIRTIO_GPU_DAMAGE_BAND ||
+            h + 1 == t2d->r.height) {
+            virtio_gpu_damage_band(res, tiles, n_tiles, &t2d->r,
+                                   band_y, h + 1 - band_y);
+            band_y = h + 1;
+        }
+    }
+
+    g_free(line);
+    g_free(tiles);
+}
+
 static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
                                            struct virtio_gpu_ctrl_command *cmd)
 {
@@ -419,6 +493,14 @@ static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
     bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
     stride = pixman_image_get_stride(res->image);
 
+    if (res->scanout_bitmask) {
+        virtio_gpu_xfer_cmp(res, &t2d, stride, bpp);
+        return;
+    }
+
+    /* Not visible; set_scanout redraws the whole surface anyway */
+    pixman_region_union_rect(&res->damage, &res->damage,
+                             t2d.r.x, t2d.r.y, t2d.r.width, t2d.r.height);
     if (t2d.offset || t2d.r.x || t2d.r.y ||
         t2d.r.width != pixman_image_get_width(res->image)) {
         void *img_data = pixman_image_get_data(res->image);
@@ -472,12 +554,16 @@ static void virtio_gpu_resource_flush(VirtIOGPU *g,
         return;
     }
 
+    /* Only what changed since the last flush needs to be redrawn */
     pixman_region_init_rect(&flush_region,
                             rf.r.x, rf.r.y, rf.r.width, rf.r.height);
+    pixman_region_intersect(&flush_region, &flush_region, &res->damage);
+    pixman_region_subtract(&res->damage, &res->damage, &flush_region);
     for (i = 0; i < g->conf.max_outputs; i++) {
         struct virtio_gpu_scanout *scanout;
         pixman_region16_t region, finalregion;
-        pixman_box16_t *extents;
+        pixman_box16_t *boxes;
+        int j, n_boxes;
 
         if (!(res->scanout_bitmask & (1 << i))) {
             continue;
@@ -490,12 +576,18 @@ static void virtio_gpu_resource_flush(VirtIOGPU *g,
 
         pixman_region_intersect(&finalregion, &flush_region, &region);
         pixman_region_translate(&finalregion, -scanout->x, -scanout->y);
-        extents = pixman_region_extents(&finalregion);
         /* work out the area we need to update for each console */
-        dpy_gfx_update(g->scanout[i].con,
-                       extents->x1, extents->y1,
-                       extents->x2 - extents->x1,
-                       extents->y2 - extents->y1);
+        boxes = pixman_region_rectangles(&finalregion, &n_boxes);
+        if (n_boxes > VIRTIO_GPU_DAMAGE_MAX_RECTS) {
+            boxes = pixman_region_extents(&finalregion);
+            n_boxes = 1;
+        }
+        for (j = 0; j < n_boxes; j++) {
+            dpy_gfx_update(g->scanout[i].con,
+                           boxes[j].x1, boxes[j].y1,
+                           boxes[j].x2 - boxes[j].x1,
+                           boxes[j].y2 - boxes[j].y1);
+        }
 
         pixman_region_fini(&region);
         pixman_region_fini(&finalregion);
@@ -1042,6 +1134,7 @@ static int virtio_gpu_load(QEMUFile *f, void *opaque, size_t size)
         if (!res->image) {
             return -EINVAL;
         }
+        pixman_region_init(&res->damage);
 
         res->addrs = g_new(uint64_t, res->iov_cnt);
         res->iov = g_new(struct iovec, res->iov_cnt);
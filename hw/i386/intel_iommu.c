@@ -21,6 +21,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
+#include "qemu/stats.h"
+#include "qapi/error.h"
 #include "hw/sysbus.h"
 #include "exec/address-spaces.h"
 #include "intel_iommu_internal.h"
@@ -153,14 +155,6 @@ static guint vtd_uint64_hash(gconstpointer v)
     return (guint)*(const uint64_t *)v;
 }
 
-static gboolean vtd_hash_remove_by_domain(gpointer key, gpointer value,
-                                          gpointer user_data)
-{
-    VTDIOTLBEntry *entry = (VTDIOTLBEntry *)value;
-    uint16_t domain_id = *(uint16_t *)user_data;
-    return entry->domain_id == domain_id;
-}
-
 /* The shift of an addr for a certain level of paging structure */
 static inline uint32_t vtd_slpt_level_shift(uint32_t level)
 {
@@ -172,16 +166,47 @@ static inline uint64_t vtd_slpt_level_page_mask(uint32_t level)
     return ~((1ULL << vtd_slpt_level_shift(level)) - 1);
 }
 
-static gboolean vtd_hash_remove_by_page(gpointer key, gpointer value,
-                                        gpointer user_data)
+/* Whether an invalidation covers the translation of @gfn, a page of the
+ * size given by @mask, in domain @domain_id.
+ */
+static bool vtd_inv_info_match(VTDIOTLBPageInvInfo *info, uint16_t domain_id,
+                               uint64_t gfn, uint64_t mask)
+{
+    uint64_t gfn_inv = (info->addr >> VTD_PAGE_SHIFT_4K) & info->mask;
+    uint64_t gfn_tlb = (info->addr & mask) >> VTD_PAGE_SHIFT_4K;
+    return (domain_id == info->domain_id) &&
+            (((gfn & info->mask) == gfn_inv) || (gfn == gfn_tlb));
+}
+
+static gboolean vtd_hash_remove_by_batch(gpointer key, gpointer value,
+                                         gpointer user_data)
+{
+    VTDIOTLBEntry *entry = (VTDIOTLBEntry *)value;
+    IntelIOMMUState *s = user_data;
+    int i;
+
+    for (i = 0; i < s->inv_batch_len; i++) {
+        if (vtd_inv_info_match(&s->inv_batch[i], entry->domain_id,
+                               entry->gfn, entry->mask)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Second chance eviction: drop the entries that were not hit since the
+ * previous scan.
+ */
+static gboolean vtd_hash_remove_unused(gpointer key, gpointer value,
+                                       gpointer user_data)
 {
     VTDIOTLBEntry *entry = (VTDIOTLBEntry *)value;
-    VTDIOTLBPageInvInfo *info = (VTDIOTLBPageInvInfo *)user_data;
-    uint64_t gfn = (info->addr >> VTD_PAGE_SHIFT_4K) & info->mask;
-    uint64_t gfn_tlb = (info->addr & entry->mask) >> VTD_PAGE_SHIFT_4K;
-    return (entry->domain_id == info->domain_id) &&
-            (((entry->gfn & info->mask) == gfn) ||
-             (entry->gfn == gfn_tlb));
+
+    if (entry->accessed) {
+        entry->accessed = false;
+        return false;
+    }
+    return true;
 }
 
 /* Reset all the gen of VTDAddressSpace to zero and set the gen of
@@ -209,13 +234,52 @@ static void vtd_reset_context_cache(IntelIOMMUState *s)
     s->context_cache_gen = 1;
 }
 
+/* Drop the page walk caches of all the devices */
+static void vtd_reset_pwc(IntelIOMMUState *s)
+{
+    VTDAddressSpace *vtd_as;
+    VTDBus *vtd_bus;
+    GHashTableIter bus_it;
+    uint32_t devfn_it;
+
+    s->pwc_gen++;
+    if (s->pwc_gen != VTD_CONTEXT_CACHE_GEN_MAX) {
+        return;
+    }
+
+    g_hash_table_iter_init(&bus_it, s->vtd_as_by_busptr);
+    while (g_hash_table_iter_next(&bus_it, NULL, (void **)&vtd_bus)) {
+        for (devfn_it = 0; devfn_it < X86_IOMMU_PCI_DEVFN_MAX; ++devfn_it) {
+            vtd_as = vtd_bus->dev_as[devfn_it];
+            if (vtd_as) {
+                vtd_as->pwc.gen = 0;
+            }
+        }
+    }
+    s->pwc_gen = 1;
+}
+
 static void vtd_reset_iotlb(IntelIOMMUState *s)
 {
     assert(s->iotlb);
     g_hash_table_remove_all(s->iotlb);
 }
 
-static uint64_t vtd_get_iotlb_key(uint64_t gfn, uint8_t source_id,
+static void vtd_evict_iotlb(IntelIOMMUState *s)
+{
+    guint n;
+
+    n = g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_unused, NULL);
+    if (!n) {
+        /* Everything was hit, and is now marked as unused */
+        n = g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_unused,
+                                        NULL);
+    }
+    VTD_DPRINTF(CACHE, "iotlb exceeds size limit, evicted %u entries", n);
+    s->iotlb_evictions += n;
+}
+
+static uint64_t vtd_get_iotlb_key(uint64_t gfn, uint16_t source_id,
                                   uint32_t level)
 {
     return gfn | ((uint64_t)(source_id) << VTD_IOTLB_SID_SHIFT) |
@@ -239,6 +303,7 @@ static VTDIOTLBEntry *vtd_lookup_iotlb(IntelIOMMUState *s, uint16_t source_id,
                                 source_id, level);
         entry = g_hash_table_lookup(s->iotlb, &key);
         if (entry) {
+            entry->accessed = true;
             goto out;
         }
     }
@@ -259,9 +324,8 @@ static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
     VTD_DPRINTF(CACHE, "update iotlb sid 0x%"PRIx16 " gpa 0x%"PRIx64
                 " slpte 0x%"PRIx64 " did 0x%"PRIx16, source_id, addr, slpte,
                 domain_id);
-    if (g_hash_table_size(s->iotlb) >= VTD_IOTLB_MAX_SIZE) {
-        VTD_DPRINTF(CACHE, "iotlb exceeds size limit, forced to reset");
-        vtd_reset_iotlb(s);
+    if (g_hash_table_size(s->iotlb) >= s->iotlb_size) {
+        vtd_evict_iotlb(s);
     }
 
     entry->gfn = gfn;
@@ -269,6 +333,7 @@ static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
     entry->slpte = slpte;
     entry->read_flags = read_flags;
     entry->write_flags = write_flags;
+    entry->accessed = false;
     entry->mask = vtd_slpt_level_page_mask(level);
     *key = vtd_get_iotlb_key(gfn, source_id, level);
     g_hash_table_replace(s->iotlb, key, entry);
@@ -628,17 +693,22 @@ static bool vtd_slpte_nonzero_rsvd(uint64_t slpte, uint32_t level)
 
 /* Given the @gpa, get relevant @slptep. @slpte_level will be the last level
  * of the translation, can be used for deciding the size of large page.
+ * The walk starts from the page walk cache of @vtd_as when it covers @gpa.
  */
-static int vtd_gpa_to_slpte(VTDContextEntry *ce, uint64_t gpa, bool is_write,
+static int vtd_gpa_to_slpte(VTDAddressSpace *vtd_as, VTDContextEntry *ce,
+                            uint64_t gpa, bool is_write,
                             uint64_t *slptep, uint32_t *slpte_level,
                             bool *reads, bool *writes)
 {
+    IntelIOMMUState *s = vtd_as->iommu_state;
+    VTDPageWalkCache *pwc = &vtd_as->pwc;
     dma_addr_t addr = vtd_get_slpt_base_from_context(ce);
     uint32_t level = vtd_get_level_from_context_entry(ce);
     uint32_t offset;
     uint64_t slpte;
     uint32_t ce_agaw = vtd_get_agaw_from_context_entry(ce);
     uint64_t access_right_check;
+    uint64_t gfn_2m = vtd_get_iotlb_gfn(gpa, VTD_SL_PD_LEVEL);
 
     /* Check if @gpa is above 2^X-1, where X is the minimum of MGAW in CAP_REG
      * and AW in context-entry.
@@ -651,6 +721,21 @@ static int vtd_gpa_to_slpte(VTDContextEntry *ce, uint64_t gpa, bool is_write,
     /* FIXME: what is the Atomics request here? */
     access_right_check = is_write ? VTD_SL_W : VTD_SL_R;
 
+    if (pwc->gen == s->pwc_gen && pwc->gfn == gfn_2m &&
+        pwc->domain_id == VTD_CONTEXT_ENTRY_DID(ce->hi)) {
+        /* The upper levels were checked when the cache was filled */
+        if (!(is_write ? pwc->writes : pwc->reads)) {
+            VTD_DPRINTF(GENERAL, "error: lack of %s permission for "
+                        "gpa 0x%"PRIx64, (is_write ? "write" : "read"), gpa);
+            return is_write ? -VTD_FR_WRITE : -VTD_FR_READ;
+        }
+        s->pwc_hits++;
+        addr = pwc->table;
+        level = VTD_SL_PT_LEVEL;
+        *reads = pwc->reads;
+        *writes = pwc->writes;
+    }
+
     while (true) {
         offset = vtd_gpa_level_offset(gpa, level);
         slpte = vtd_get_slpte(addr, offset);
@@ -688,6 +773,14 @@ static int vtd_gpa_to_slpte(VTDContextEntry *ce, uint64_t gpa, bool is_write,
         }
         addr = vtd_get_slpte_addr(slpte);
         level--;
+        if (level == VTD_SL_PT_LEVEL) {
+            pwc->gen = s->pwc_gen;
+            pwc->domain_id = VTD_CONTEXT_ENTRY_DID(ce->hi);
+            pwc->gfn = gfn_2m;
+            pwc->table = addr;
+            pwc->reads = *reads;
+            pwc->writes = *writes;
+        }
     }
 }
 
@@ -841,8 +934,10 @@ static void vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
         reads = iotlb_entry->read_flags;
         writes = iotlb_entry->write_flags;
         page_mask = iotlb_entry->mask;
+        s->iotlb_hits++;
         goto out;
     }
+    s->iotlb_misses++;
     /* Try to fetch context-entry from cache first */
     if (cc_entry->context_cache_gen == s->context_cache_gen) {
         VTD_DPRINTF(CACHE, "hit context-cache bus %d devfn %d "
@@ -852,6 +947,7 @@ static void vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
         ce = cc_entry->context_entry;
         is_fpd_set = ce.lo & VTD_CONTEXT_ENTRY_FPD;
     } else {
+        s->context_cache_misses++;
         ret_fr = vtd_dev_to_context_entry(s, bus_num, devfn, &ce);
         is_fpd_set = ce.lo & VTD_CONTEXT_ENTRY_FPD;
         if (ret_fr) {
@@ -874,7 +970,7 @@ static void vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
         cc_entry->context_cache_gen = s->context_cache_gen;
     }
 
-    ret_fr = vtd_gpa_to_slpte(&ce, addr, is_write, &slpte, &level,
+    ret_fr = vtd_gpa_to_slpte(vtd_as, &ce, addr, is_write, &slpte, &level,
                               &reads, &writes);
     if (ret_fr) {
         ret_fr = -ret_fr;
@@ -934,6 +1030,7 @@ static void vtd_context_global_invalidate(IntelIOMMUState *s)
     if (s->context_cache_gen == VTD_CONTEXT_CACHE_GEN_MAX) {
         vtd_reset_context_cache(s);
     }
+    vtd_reset_pwc(s);
 }
 
 
@@ -997,6 +1094,7 @@ static void vtd_context_device_invalidate(IntelIOMMUState *s,
                 VTD_DPRINTF(INV, "invalidate context-cahce of devfn 0x%"PRIx16,
                             devfn_it);
                 vtd_as->context_cache_entry.context_cache_gen = 0;
+                vtd_as->pwc.gen = 0;
             }
         }
     }
@@ -1034,27 +1132,138 @@ static uint64_t vtd_context_cache_invalidate(IntelIOMMUState *s, uint64_t val)
     return caig;
 }
 
+/* Tell the IOMMU notifiers, e.g. vhost device IOTLBs, that a range of
+ * IOVAs was invalidated.  Address spaces don't record their domain, so
+ * every address space with a notifier sees every invalidation.
+ */
+static void vtd_iotlb_notify_unmap(IntelIOMMUState *s, hwaddr addr,
+                                   hwaddr mask)
+{
+    IOMMUTLBEntry entry = {
+        .target_as = &address_space_memory,
+        .iova = addr,
+        .translated_addr = 0,
+        .addr_mask = mask,
+        .perm = IOMMU_NONE,
+    };
+    GHashTableIter iter;
+    VTDBus *vtd_bus;
+    int devfn;
+
+    g_hash_table_iter_init(&iter, s->vtd_as_by_busptr);
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&vtd_bus)) {
+        for (devfn = 0; devfn < X86_IOMMU_PCI_DEVFN_MAX; devfn++) {
+            VTDAddressSpace *vtd_as = vtd_bus->dev_as[devfn];
+
+            if (vtd_as && !QLIST_EMPTY(&vtd_as->iommu.iommu_notify)) {
+                memory_region_notify_iommu(&vtd_as->iommu, entry);
+            }
+        }
+    }
+}
+
+/* Apply the pending IOTLB invalidations */
+static void vtd_iotlb_inv_flush(IntelIOMMUState *s)
+{
+    uint64_t pd_mask = vtd_slpt_level_page_mask(VTD_SL_PD_LEVEL);
+    VTDAddressSpace *vtd_as;
+    VTDBus *vtd_bus;
+    GHashTableIter bus_it;
+    hwaddr mask;
+    int devfn, i;
+
+    if (s->inv_batch_len) {
+        g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_batch, s);
+
+        g_hash_table_iter_init(&bus_it, s->vtd_as_by_busptr);
+        while (g_hash_table_iter_next(&bus_it, NULL, (void **)&vtd_bus)) {
+            for (devfn = 0; devfn < X86_IOMMU_PCI_DEVFN_MAX; devfn++) {
+                vtd_as = vtd_bus->dev_as[devfn];
+                if (!vtd_as || vtd_as->pwc.gen != s->pwc_gen) {
+                    continue;
+                }
+                for (i = 0; i < s->inv_batch_len; i++) {
+                    if (vtd_inv_info_match(&s->inv_batch[i],
+                                           vtd_as->pwc.domain_id,
+                                           vtd_as->pwc.gfn, pd_mask)) {
+                        vtd_as->pwc.gen = 0;
+                        break;
+                    }
+                }
+            }
+        }
+        s->inv_batch_len = 0;
+        s->inv_flushes++;
+    }
+
+    if (s->inv_notify) {
+        /* The smallest naturally aligned range covering all of them */
+        mask = ~VTD_PAGE_MASK_4K;
+        while ((s->inv_notify_start & ~mask) != (s->inv_notify_end & ~mask)) {
+            mask = (mask << 1) | 1;
+        }
+        vtd_iotlb_notify_unmap(s, s->inv_notify_start & ~mask, mask);
+        s->inv_notify = false;
+        s->inv_notifies++;
+    }
+}
+
+static void vtd_iotlb_inv_notify(IntelIOMMUState *s, hwaddr start, hwaddr end)
+{
+    if (s->inv_notify) {
+        s->inv_notify_start = MIN(s->inv_notify_start, start);
+        s->inv_notify_end = MAX(s->inv_notify_end, end);
+    } else {
+        s->inv_notify_start = start;
+        s->inv_notify_end = end;
+        s->inv_notify = true;
+    }
+}
+
+static void vtd_iotlb_inv_add(IntelIOMMUState *s, uint16_t domain_id,
+                              hwaddr addr, uint64_t mask)
+{
+    VTDIOTLBPageInvInfo *info;
+
+    if (s->inv_batch_len == VTD_INV_BATCH_MAX) {
+        vtd_iotlb_inv_flush(s);
+    }
+    info = &s->inv_batch[s->inv_batch_len++];
+    info->domain_id = domain_id;
+    info->addr = addr;
+    info->mask = mask;
+}
+
 static void vtd_iotlb_global_invalidate(IntelIOMMUState *s)
 {
+    /* Supersedes whatever is pending */
+    s->inv_batch_len = 0;
     vtd_reset_iotlb(s);
+    vtd_reset_pwc(s);
+    vtd_iotlb_inv_notify(s, 0, (1ULL << VTD_MGAW) - 1);
+    if (!s->inv_batching) {
+        vtd_iotlb_inv_flush(s);
+    }
 }
 
 static void vtd_iotlb_domain_invalidate(IntelIOMMUState *s, uint16_t domain_id)
 {
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_domain,
-                                &domain_id);
+    vtd_iotlb_inv_add(s, domain_id, 0, 0);
+    vtd_iotlb_inv_notify(s, 0, (1ULL << VTD_MGAW) - 1);
+    if (!s->inv_batching) {
+        vtd_iotlb_inv_flush(s);
+    }
 }
 
 static void vtd_iotlb_page_invalidate(IntelIOMMUState *s, uint16_t domain_id,
                                       hwaddr addr, uint8_t am)
 {
-    VTDIOTLBPageInvInfo info;
-
     assert(am <= VTD_MAMV);
-    info.domain_id = domain_id;
-    info.addr = addr;
-    info.mask = ~((1 << am) - 1);
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_page, &info);
+    vtd_iotlb_inv_add(s, domain_id, addr, ~((1ULL << am) - 1));
+    vtd_iotlb_inv_notify(s, addr, addr + (VTD_PAGE_SIZE << am) - 1);
+    if (!s->inv_batching) {
+        vtd_iotlb_inv_flush(s);
+    }
 }
 
 /* Flush IOTLB
@@ -1450,6 +1659,7 @@ static bool vtd_process_inv_desc(IntelIOMMUState *s)
         return false;
     }
     desc_type = inv_desc.lo & VTD_INV_DESC_TYPE;
+    s->inv_descs++;
     /* FIXME: should update at first or at last? */
     s->iq_last_desc_type = desc_type;
 
@@ -1473,6 +1683,8 @@ static bool vtd_process_inv_desc(IntelIOMMUState *s)
     case VTD_INV_DESC_WAIT:
         VTD_DPRINTF(INV, "Invalidation Wait Descriptor hi 0x%"PRIx64
                     " lo 0x%"PRIx64, inv_desc.hi, inv_desc.lo);
+        /* Invalidations before the wait must be complete when it is */
+        vtd_iotlb_inv_flush(s);
         if (!vtd_process_wait_desc(s, &inv_desc)) {
             return false;
         }
@@ -1511,6 +1723,7 @@ static void vtd_fetch_inv_desc(IntelIOMMUState *s)
         vtd_handle_inv_queue_error(s);
         return;
     }
+    s->inv_batching = true;
     while (s->iq_head != s->iq_tail) {
         if (!vtd_process_inv_desc(s)) {
             /* Invalidation Queue Errors */
@@ -1522,6 +1735,8 @@ static void vtd_fetch_inv_desc(IntelIOMMUState *s)
                          (((uint64_t)(s->iq_head)) << VTD_IQH_QH_SHIFT) &
                          VTD_IQH_QH_MASK);
     }
+    s->inv_batching = false;
+    vtd_iotlb_inv_flush(s);
 }
 
 /* Handle write to Invalidation Queue Tail Register */
@@ -2012,6 +2227,8 @@ static const MemoryRegionOps vtd_mem_ops = {
 
 static Property vtd_properties[] = {
     DEFINE_PROP_UINT32("version", IntelIOMMUState, version, 0),
+    DEFINE_PROP_UINT32("iotlb-size", IntelIOMMUState, iotlb_size,
+                       VTD_IOTLB_DEFAULT_SIZE),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -2387,6 +2604,10 @@ static void vtd_init(IntelIOMMUState *s)
 
     vtd_reset_context_cache(s);
     vtd_reset_iotlb(s);
+    vtd_reset_pwc(s);
+    s->inv_batching = false;
+    s->inv_batch_len = 0;
+    s->inv_notify = false;
 
     /* Define registers with default values and bit semantics */
     vtd_define_long(s, DMAR_VER_REG, 0x10UL, 0, 0);
@@ -2471,6 +2692,10 @@ static void vtd_realize(DeviceState *dev, Error **errp)
     X86IOMMUState *x86_iommu = X86_IOMMU_DEVICE(dev);
 
     VTD_DPRINTF(GENERAL, "");
+    if (!s->iotlb_size) {
+        error_setg(errp, "iotlb-size must be at least 1");
+        return;
+    }
     x86_iommu->type = TYPE_INTEL;
     memset(s->vtd_as_by_bus_num, 0, sizeof(s->vtd_as_by_bus_num));
     memory_region_init_io(&s->csrmem, OBJECT(s), &vtd_mem_ops, s,
@@ -2516,10 +2741,37 @@ static const TypeInfo vtd_info = {
     .class_init    = vtd_class_init,
 };
 
+static void vtd_stats_provider(StatsCollector *c, void *opaque)
+{
+    X86IOMMUState *x86_iommu = x86_iommu_get_default();
+    IntelIOMMUState *s;
+    char *path;
+
+    if (!x86_iommu || x86_iommu->type != TYPE_INTEL) {
+        return;
+    }
+    s = INTEL_IOMMU_DEVICE(x86_iommu);
+    path = object_get_canonical_path(OBJECT(s));
+    if (stats_begin_instance(c, path)) {
+        stats_add_counter(c, "iotlb-hits", s->iotlb_hits);
+        stats_add_counter(c, "iotlb-misses", s->iotlb_misses);
+        stats_add_counter(c, "iotlb-evictions", s->iotlb_evictions);
+        stats_add_gauge(c, "iotlb-entries", g_hash_table_size(s->iotlb));
+        stats_add_counter(c, "context-cache-misses",
+                          s->context_cache_misses);
+        stats_add_counter(c, "page-walk-cache-hits", s->pwc_hits);
+        stats_add_counter(c, "inv-descriptors", s->inv_descs);
+        stats_add_counter(c, "inv-flushes", s->inv_flushes);
+        stats_add_counter(c, "inv-notifies", s->inv_notifies);
+    }
+    g_free(path);
+}
+
 static void vtd_register_types(void)
 {
     VTD_DPRINTF(GENERAL, "");
     type_register_static(&vtd_info);
+    stats_register_provider("intel-iommu", vtd_stats_provider, NULL);
 }
 
 type_init(vtd_register_types)
@@ -0,0 +1,488 @@
+/*
+ * Minimal x86 machine that boots a Linux kernel directly
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The microvm machine has no PCI bus, no firmware and no ACPI tables.  The
+ * only devices are the interrupt controllers, the PIT, the RTC, the serial
+ * ports and a fixed set of virtio-mmio transports.  A bzImage passed with
+ * -kernel is entered directly in 32-bit protected mode, as described by
+ * the 32-bit boot protocol in Documentation/x86/boot.txt; the memory map
+ * is passed in the zero page and the CPUs and interrupt routing in an MP
+ * table.  The virtio-mmio transports are announced on the kernel command
+ * line, so the kernel needs CONFIG_VIRTIO_MMIO_CMDLINE_DEVICES.
+ *
+ * There is no keyboard controller; use reboot=t in the guest.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+#include "hw/hw.h"
+#include "hw/loader.h"
+#include "hw/boards.h"
+#include "hw/sysbus.h"
+#include "hw/i386/pc.h"
+#include "hw/i386/ioapic.h"
+#include "hw/char/serial.h"
+#include "hw/timer/i8254.h"
+#include "hw/timer/mc146818rtc.h"
+#include "hw/kvm/clock.h"
+#include "hw/xen/xen.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
+#include "exec/address-spaces.h"
+#include "cpu.h"
+
+/* Leave room below 4G for the virtio-mmio transports and the APICs */
+#define MICROVM_MAX_RAM_BELOW_4G    0xc0000000ULL
+
+#define MICROVM_GDT_ADDR            0x500
+#define MICROVM_ZERO_PAGE_ADDR      0x7000
+#define MICROVM_CMDLINE_ADDR        0x20000
+#define MICROVM_CMDLINE_MAX         0x10000
+#define MICROVM_MPTABLE_ADDR        0x9fc00
+#define MICROVM_LOW_RAM_END         0xa0000
+#define MICROVM_KERNEL_ADDR         0x100000
+
+#define MICROVM_VIRTIO_MMIO_BASE    0xfeb00000
+#define MICROVM_VIRTIO_MMIO_SIZE    0x200
+
+/* Free ISA interrupts, used level triggered for the virtio-mmio transports */
+static const int microvm_virtio_irq[] = { 5, 6, 7, 9, 10, 11, 12, 14 };
+
+#define MICROVM_NUM_VIRTIO          ARRAY_SIZE(microvm_virtio_irq)
+
+/* Offsets into struct boot_params */
+#define BP_E820_ENTRIES             0x1e8
+#define BP_SETUP_HEADER             0x1f1
+#define BP_E820_MAP                 0x2d0
+#define BP_E820_MAX                 128
+
+/* Offsets into the setup header, relative to the start of the image */
+#define HDR_SETUP_SECTS             0x1f1
+#define HDR_JUMP                    0x200
+#define HDR_MAGIC                   0x202
+#define HDR_VERSION                 0x206
+#define HDR_TYPE_OF_LOADER          0x210
+#define HDR_LOADFLAGS               0x211
+#define HDR_CODE32_START            0x214
+#define HDR_RAMDISK_IMAGE           0x218
+#define HDR_RAMDISK_SIZE            0x21c
+#define HDR_CMD_LINE_PTR            0x228
+#define HDR_INITRD_ADDR_MAX         0x22c
+#define HDR_CMDLINE_SIZE            0x238
+
+#define LOADFLAGS_LOADED_HIGH       0x01
+
+static uint32_t microvm_entry;
+
+typedef struct MicrovmE820 {
+    uint8_t *zero_page;
+    int nr;
+} MicrovmE820;
+
+static void microvm_e820_add(MicrovmE820 *e820, uint64_t addr,
+                             uint64_t size, uint32_t type)
+{
+    uint8_t *entry = e820->zero_page + BP_E820_MAP + e820->nr * 20;
+
+    assert(e820->nr < BP_E820_MAX);
+    stq_p(entry, addr);
+    stq_p(entry + 8, size);
+    stl_p(entry + 16, type);
+    e820->nr++;
+    e820->zero_page[BP_E820_ENTRIES] = e820->nr;
+}
+
+static uint8_t microvm_checksum(const uint8_t *buf, size_t len)
+{
+    uint8_t sum = 0;
+
+    while (len--) {
+        sum += *buf++;
+    }
+    return -sum;
+}
+
+/*
+ * Build an Intel MultiProcessor Specification 1.4 table: the floating
+ * pointer, followed by the configuration table with the processors, the
+ * ISA bus, the I/O APIC and the interrupt routing.
+ */
+static void microvm_build_mptable(PCMachineState *pcms)
+{
+    int nr_entries = smp_cpus + 2 + ISA_NUM_IRQS + 2;
+    size_t table_len = 44 + smp_cpus * 20 + (nr_entries - smp_cpus) * 8;
+    uint8_t *buf = g_malloc0(16 + table_len);
+    uint8_t *mpf = buf, *table = buf + 16, *p;
+    uint32_t signature, features;
+    X86CPU *cpu = X86_CPU(first_cpu);
+    int i;
+
+    signature = cpu->env.cpuid_version;
+    features = cpu->env.features[FEAT_1_EDX];
+
+    memcpy(mpf, "_MP_", 4);
+    stl_p(mpf + 4, MICROVM_MPTABLE_ADDR + 16);
+    mpf[8] = 1;                 /* length in paragraphs */
+    mpf[9] = 4;                 /* spec revision */
+
+    memcpy(table, "PCMP", 4);
+    stw_p(table + 4, table_len);
+    table[6] = 4;
+    memcpy(table + 8, "QEMU    ", 8);
+    memcpy(table + 16, "MICROVM     ", 12);
+    stw_p(table + 34, nr_entries);
+    stl_p(table + 36, APIC_DEFAULT_ADDRESS);
+
+    p = table + 44;
+    for (i = 0; i < smp_cpus; i++) {
+        p[0] = 0;               /* processor */
+        p[1] = pcms->possible_cpus->cpus[i].arch_id;
+        p[2] = 0x14;            /* local APIC version */
+        p[3] = 0x01 | (i == 0 ? 0x02 : 0);
+        stl_p(p + 4, signature);
+        stl_p(p + 8, features);
+        p += 20;
+    }
+
+    p[0] = 1;                   /* bus */
+    p[1] = 0;
+    memcpy(p + 2, "ISA   ", 6);
+    p += 8;
+
+    p[0] = 2;                   /* I/O APIC */
+    p[1] = 0;
+    p[2] = 0x11;
+    p[3] = 0x01;
+    stl_p(p + 4, IO_APIC_DEFAULT_ADDRESS);
+    p += 8;
+
+    for (i = 0; i < ISA_NUM_IRQS; i++) {
+        uint16_t flags = 0;
+        int j;
+
+        for (j = 0; j < MICROVM_NUM_VIRTIO; j++) {
+            if (microvm_virtio_irq[j] == i) {
+                flags = 0x0d;   /* active high, level triggered */
+            }
+        }
+        p[0] = 3;               /* I/O interrupt */
+        p[1] = 0;               /* INT */
+        stw_p(p + 2, flags);
+        p[4] = 0;
+        p[5] = i;
+        p[6] = 0;
+        p[7] = i == 0 ? 2 : i;  /* the PIT is wired to pin 2 */
+        p += 8;
+    }
+
+    for (i = 0; i < 2; i++) {
+        p[0] = 4;               /* local interrupt */
+        p[1] = i == 0 ? 3 : 1;  /* ExtINT on LINT0, NMI on LINT1 */
+        p[4] = 0;
+        p[5] = 0;
+        p[6] = 0xff;
+        p[7] = i;
+        p += 8;
+    }
+    assert(p == table + table_len);
+
+    table[7] = microvm_checksum(table, table_len);
+    mpf[10] = microvm_checksum(mpf, 16);
+
+    assert(MICROVM_MPTABLE_ADDR + 16 + table_len <= MICROVM_LOW_RAM_END);
+    rom_add_blob_fixed("mptable", buf, 16 + table_len, MICROVM_MPTABLE_ADDR);
+    g_free(buf);
+}
+
+static void microvm_build_gdt(void)
+{
+    uint64_t gdt[4] = {
+        0,
+        0,
+        cpu_to_le64(0x00cf9b000000ffffULL),     /* 0x10: flat code */
+        cpu_to_le64(0x00cf93000000ffffULL),     /* 0x18: flat data */
+    };
+
+    rom_add_blob_fixed("gdt", gdt, sizeof(gdt), MICROVM_GDT_ADDR);
+}
+
+static void microvm_load_linux(PCMachineState *pcms)
+{
+    MachineState *machine = MACHINE(pcms);
+    uint8_t *zero_page = g_malloc0(TARGET_PAGE_SIZE);
+    MicrovmE820 e820 = { .zero_page = zero_page };
+    GString *cmdline;
+    gchar *kernel, *initrd;
+    gsize kernel_size, initrd_size;
+    size_t setup_size, hdr_end;
+    uint32_t cmdline_max, initrd_max, initrd_addr, kernel_end;
+    uint16_t protocol;
+    int i;
+
+    if (!machine->kernel_filename) {
+        error_report("microvm requires a kernel image (-kernel)");
+        exit(1);
+    }
+    if (!g_file_get_contents(machine->kernel_filename, &kernel,
+                             &kernel_size, NULL)) {
+        error_report("could not load kernel '%s'", machine->kernel_filename);
+        exit(1);
+    }
+
+    if (kernel_size < 0x1000 || memcmp(kernel + HDR_MAGIC, "HdrS", 4)) {
+        error_report("'%s' is not a bzImage", machine->kernel_filename);
+        exit(1);
+    }
+    protocol = lduw_p(kernel + HDR_VERSION);
+    if (protocol < 0x206 || !(kernel[HDR_LOADFLAGS] & LOADFLAGS_LOADED_HIGH)) {
+        error_report("kernel '%s' uses boot protocol %x.%02x, "
+                     "2.06 or newer is required",
+                     machine->kernel_filename, protocol >> 8, protocol & 0xff);
+        exit(1);
+    }
+
+    setup_size = ((uint8_t)kernel[HDR_SETUP_SECTS] ?: 4) + 1;
+    setup_size *= 512;
+    hdr_end = HDR_JUMP + 2 + (uint8_t)kernel[HDR_JUMP + 1];
+    if (setup_size >= kernel_size || hdr_end > setup_size ||
+        hdr_end > BP_E820_MAP) {
+        error_report("invalid setup header in '%s'", machine->kernel_filename);
+        exit(1);
+    }
+    memcpy(zero_page + BP_SETUP_HEADER, kernel + BP_SETUP_HEADER,
+           hdr_end - BP_SETUP_HEADER);
+    microvm_entry = ldl_p(kernel + HDR_CODE32_START);
+    cmdline_max = MIN(ldl_p(kernel + HDR_CMDLINE_SIZE) + 1,
+                      MICROVM_CMDLINE_MAX);
+    initrd_max = ldl_p(kernel + HDR_INITRD_ADDR_MAX);
+
+    kernel_end = MICROVM_KERNEL_ADDR + kernel_size - setup_size;
+    rom_add_blob_fixed("linux", kernel + setup_size, kernel_size - setup_size,
+                       MICROVM_KERNEL_ADDR);
+    g_free(kernel);
+
+    zero_page[HDR_TYPE_OF_LOADER] = 0xff;
+
+    cmdline = g_string_new(machine->kernel_cmdline);
+    for (i = 0; i < MICROVM_NUM_VIRTIO; i++) {
+        g_string_append_printf(cmdline, " virtio_mmio.device=%d@0x%x:%d",
+                               MICROVM_VIRTIO_MMIO_SIZE,
+                               MICROVM_VIRTIO_MMIO_BASE +
+                               i * MICROVM_VIRTIO_MMIO_SIZE,
+                               microvm_virtio_irq[i]);
+    }
+    if (cmdline->len >= cmdline_max) {
+        error_report("kernel command line is too long (%zu bytes, max %u)",
+                     cmdline->len, cmdline_max - 1);
+        exit(1);
+    }
+    rom_add_blob_fixed("cmdline", cmdline->str, cmdline->len + 1,
+                       MICROVM_CMDLINE_ADDR);
+    stl_p(zero_page + HDR_CMD_LINE_PTR, MICROVM_CMDLINE_ADDR);
+    g_string_free(cmdline, true);
+
+    if (machine->initrd_filename) {
+        if (!g_file_get_contents(machine->initrd_filename, &initrd,
+                                 &initrd_size, NULL)) {
+            error_report("could not load initrd '%s'",
+                         machine->initrd_filename);
+            exit(1);
+        }
+        initrd_max = MIN(initrd_max, pcms->below_4g_mem_size - 1);
+        if (kernel_end > initrd_max || initrd_size > initrd_max - kernel_end) {
+            error_report("initrd '%s' is too large (%zu bytes)",
+                         machine->initrd_filename, (size_t)initrd_size);
+            exit(1);
+        }
+        initrd_addr = (initrd_max - initrd_size + 1) & TARGET_PAGE_MASK;
+        rom_add_blob_fixed("initrd", initrd, initrd_size, initrd_addr);
+        stl_p(zero_page + HDR_RAMDISK_IMAGE, initrd_addr);
+        stl_p(zero_page + HDR_RAMDISK_SIZE, initrd_size);
+        g_free(initrd);
+    }
+
+    microvm_e820_add(&e820, 0, MICROVM_MPTABLE_ADDR, E820_RAM);
+    microvm_e820_add(&e820, MICROVM_MPTABLE_ADDR,
+                     MICROVM_LOW_RAM_END - MICROVM_MPTABLE_ADDR,
+                     E820_RESERVED);
+    microvm_e820_add(&e820, MICROVM_KERNEL_ADDR,
+                     pcms->below_4g_mem_size - MICROVM_KERNEL_ADDR, E820_RAM);
+    if (pcms->above_4g_mem_size) {
+        microvm_e820_add(&e820, 0x100000000ULL, pcms->above_4g_mem_size,
+                         E820_RAM);
+    }
+
+    rom_add_blob_fixed("zero-page", zero_page, TARGET_PAGE_SIZE,
+                       MICROVM_ZERO_PAGE_ADDR);
+    g_free(zero_page);
+}
+
+static void microvm_memory_init(PCMachineState *pcms)
+{
+    MachineState *machine = MACHINE(pcms);
+    MemoryRegion *system_memory = get_system_memory();
+    MemoryRegion *ram, *ram_below_4g, *ram_above_4g;
+
+    if (machine->ram_size > MICROVM_MAX_RAM_BELOW_4G) {
+        pcms->below_4g_mem_size = MICROVM_MAX_RAM_BELOW_4G;
+        pcms->above_4g_mem_size = machine->ram_size - MICROVM_MAX_RAM_BELOW_4G;
+    } else {
+        pcms->below_4g_mem_size = machine->ram_size;
+        pcms->above_4g_mem_size = 0;
+    }
+    if (pcms->below_4g_mem_size < 16 * M_BYTE) {
+        error_report("microvm needs at least 16 MB of RAM");
+        exit(1);
+    }
+    if (machine->ram_slots || machine->maxram_size > machine->ram_size) {
+        error_report("microvm does not support memory hotplug");
+        exit(1);
+    }
+
+    ram = g_new(MemoryRegion, 1);
+    memory_region_allocate_system_memory(ram, NULL, "microvm.ram",
+                                         machine->ram_size);
+    ram_below_4g = g_new(MemoryRegion, 1);
+    memory_region_init_alias(ram_below_4g, NULL, "ram-below-4g", ram,
+                             0, pcms->below_4g_mem_size);
+    memory_region_add_subregion(system_memory, 0, ram_below_4g);
+    if (pcms->above_4g_mem_size) {
+        ram_above_4g = g_new(MemoryRegion, 1);
+        memory_region_init_alias(ram_above_4g, NULL, "ram-above-4g", ram,
+                                 pcms->below_4g_mem_size,
+                                 pcms->above_4g_mem_size);
+        memory_region_add_subregion(system_memory, 0x100000000ULL,
+                                    ram_above_4g);
+    }
+}
+
+static void microvm_init(MachineState *machine)
+{
+    PCMachineState *pcms = PC_MACHINE(machine);
+    GSIState *gsi_state;
+    ISABus *isa_bus;
+    qemu_irq *i8259;
+    int i;
+
+    if (xen_enabled()) {
+        error_report("microvm does not support Xen");
+        exit(1);
+    }
+
+    microvm_memory_init(pcms);
+    pc_cpus_init(pcms);
+
+    if (kvm_enabled()) {
+        kvmclock_create();
+    }
+
+    gsi_state = g_malloc0(sizeof(*gsi_state));
+    if (kvm_ioapic_in_kernel()) {
+        kvm_pc_setup_irq_routing(false);
+        pcms->gsi = qemu_allocate_irqs(kvm_pc_gsi_handler, gsi_state,
+                                       GSI_NUM_PINS);
+    } else {
+        pcms->gsi = qemu_allocate_irqs(gsi_handler, gsi_state, GSI_NUM_PINS);
+    }
+
+    isa_bus = isa_bus_new(NULL, get_system_memory(), get_system_io(),
+                          &error_abort);
+    isa_bus_irqs(isa_bus, pcms->gsi);
+
+    if (kvm_pic_in_kernel()) {
+        i8259 = kvm_i8259_init(isa_bus);
+    } else {
+        i8259 = i8259_init(isa_bus, pc_allocate_cpu_irq());
+    }
+    for (i = 0; i < ISA_NUM_IRQS; i++) {
+        gsi_state->i8259_irq[i] = i8259[i];
+    }
+    g_free(i8259);
+
+    pcms->ioapic_as = &address_space_memory;
+    ioapic_init_gsi(gsi_state, NULL);
+
+    if (kvm_pit_in_kernel()) {
+        kvm_pit_init(isa_bus, 0x40);
+    } else {
+        pit_init(isa_bus, 0x40, 0, NULL);
+    }
+    pcms->rtc = rtc_init(isa_bus, 2000, NULL);
+    serial_hds_isa_init(isa_bus, MAX_SERIAL_PORTS);
+
+    for (i = 0; i < MICROVM_NUM_VIRTIO; i++) {
+        sysbus_create_simple("virtio-mmio",
+                             MICROVM_VIRTIO_MMIO_BASE +
+                             i * MICROVM_VIRTIO_MMIO_SIZE,
+                             pcms->gsi[microvm_virtio_irq[i]]);
+    }
+
+    microvm_build_gdt();
+    microvm_build_mptable(pcms);
+    microvm_load_linux(pcms);
+}
+
+/*
+ * After the devices (and thus the CPUs) are reset, point the boot CPU at
+ * the 32-bit entry of the kernel, with flat segments and %esi pointing to
+ * the zero page.  The other CPUs wait for an INIT/SIPI as usual.
+ */
+static void microvm_machine_reset(void)
+{
+    X86CPU *cpu = X86_CPU(first_cpu);
+    CPUX86State *env = &cpu->env;
+    unsigned int flags = DESC_P_MASK | DESC_S_MASK | DESC_G_MASK |
+                         DESC_B_MASK | DESC_A_MASK;
+    CPUState *cs;
+
+    qemu_devices_reset();
+
+    CPU_FOREACH(cs) {
+        cpu = X86_CPU(cs);
+        if (cpu->apic_state) {
+            device_reset(cpu->apic_state);
+        }
+    }
+
+    cpu_x86_load_seg_cache(env, R_CS, 0x10, 0, 0xffffffff,
+                           flags | DESC_CS_MASK | DESC_R_MASK);
+    cpu_x86_load_seg_cache(env, R_DS, 0x18, 0, 0xffffffff,
+                           flags | DESC_W_MASK);
+    cpu_x86_load_seg_cache(env, R_ES, 0x18, 0, 0xffffffff,
+                           flags | DESC_W_MASK);
+    cpu_x86_load_seg_cache(env, R_SS, 0x18, 0, 0xffffffff,
+                           flags | DESC_W_MASK);
+    env->gdt.base = MICROVM_GDT_ADDR;
+    env->gdt.limit = 4 * 8 - 1;
+    cpu_x86_update_cr0(env, env->cr[0] | CR0_PE_MASK);
+    env->regs[R_ESI] = MICROVM_ZERO_PAGE_ADDR;
+    env->eip = microvm_entry;
+}
+
+static void microvm_machine_options(MachineClass *m)
+{
+    PCMachineClass *pcmc = PC_MACHINE_CLASS(m);
+
+    m->desc = "Minimal x86 machine without PCI or firmware";
+    m->reset = microvm_machine_reset;
+    m->hot_add_cpu = NULL;
+    m->no_floppy = 1;
+    m->no_cdrom = 1;
+    m->no_parallel = 1;
+    m->no_sdcard = 1;
+    m->default_display = "none";
+    pcmc->pci_enabled = false;
+    pcmc->has_acpi_build = false;
+    pcmc->smbios_defaults = false;
+}
+
+DEFINE_PC_MACHINE(microvm, "microvm", microvm_init, microvm_machine_options);
@@ -28,6 +28,7 @@
 #include "hw/pci/pci.h"
 
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
 #include "hw/ide/internal.h"
@@ -147,6 +148,11 @@ static void ahci_irq_lower(AHCIState *s, AHCIDevice *dev)
     }
 }
 
+static uint32_t ahci_ccc_irq_bit(AHCIState *s)
+{
+    return 1U << ((s->control_regs.ccc_ctl >> HOST_CCC_CTL_INT_SHIFT) & 0x1f);
+}
+
 static void ahci_check_irq(AHCIState *s)
 {
     int i;
@@ -160,6 +166,9 @@ static void ahci_check_irq(AHCIState *s)
             s->control_regs.irqstatus |= (1 << i);
         }
     }
+    if (s->ccc_irq) {
+        s->control_regs.irqstatus |= ahci_ccc_irq_bit(s);
+    }
 
     if (s->control_regs.irqstatus &&
         (s->control_regs.ghc & HOST_CTL_IRQ_EN)) {
@@ -169,6 +178,71 @@ static void ahci_check_irq(AHCIState *s)
     }
 }
 
+/* AHCI 1.3 section 11 ("Command Completion Coalescing"): completions on
+ * the ports in CCC_PORTS are counted, and a single interrupt is raised on
+ * IRQ_STAT bit CCC_CTL.INT once CCC_CTL.CC of them have completed or
+ * CCC_CTL.TV milliseconds after the first one, whichever comes first.
+ * Software masks the completion interrupts of the ports themselves.
+ */
+static void ahci_ccc_fire(AHCIState *s)
+{
+    s->ccc_count = 0;
+    timer_del(s->ccc_timer);
+    s->ccc_irq = true;
+    ahci_check_irq(s);
+}
+
+static void ahci_ccc_timer_cb(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    if (s->ccc_count) {
+        ahci_ccc_fire(s);
+    }
+}
+
+static void ahci_ccc_complete(AHCIDevice *ad)
+{
+    AHCIState *s = ad->hba;
+    uint32_t ctl = s->control_regs.ccc_ctl;
+    uint32_t cc = (ctl & HOST_CCC_CTL_CC_MASK) >> HOST_CCC_CTL_CC_SHIFT;
+    uint32_t tv = (ctl & HOST_CCC_CTL_TV_MASK) >> HOST_CCC_CTL_TV_SHIFT;
+
+    if (!(ctl & HOST_CCC_CTL_EN) ||
+        !(s->control_regs.ccc_ports & (1 << ad->port_no))) {
+        return;
+    }
+
+    s->ccc_count++;
+    if (cc && s->ccc_count >= cc) {
+        ahci_ccc_fire(s);
+    } else if (!timer_pending(s->ccc_timer)) {
+        timer_mod(s->ccc_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + tv);
+    }
+}
+
+static void ahci_ccc_write(AHCIState *s, uint32_t val)
+{
+    uint32_t ctl = s->control_regs.ccc_ctl;
+
+    if (!(s->control_regs.cap & HOST_CAP_CCC)) {
+        return;
+    }
+
+    /* CC and TV may only be changed while coalescing is disabled */
+    if (!(ctl & HOST_CCC_CTL_EN)) {
+        ctl &= ~(HOST_CCC_CTL_CC_MASK | HOST_CCC_CTL_TV_MASK);
+        ctl |= val & (HOST_CCC_CTL_CC_MASK | HOST_CCC_CTL_TV_MASK);
+    }
+    if ((val ^ ctl) & HOST_CCC_CTL_EN) {
+        s->ccc_count = 0;
+        timer_del(s->ccc_timer);
+    }
+    ctl = (ctl & ~HOST_CCC_CTL_EN) | (val & HOST_CCC_CTL_EN);
+    s->control_regs.ccc_ctl = ctl;
+}
+
 static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
                              int irq_type)
 {
@@ -340,6 +414,12 @@ static uint64_t ahci_mem_read_32(void *opaque, hwaddr addr)
         case HOST_VERSION:
             val = s->control_regs.version;
             break;
+        case HOST_CCC_CTL:
+            val = s->control_regs.ccc_ctl;
+            break;
+        case HOST_CCC_PORTS:
+            val = s->control_regs.ccc_ports;
+            break;
         }
 
         DPRINTF(-1, "(addr 0x%08X), val 0x%08X\n", (unsigned) addr, val);
@@ -418,6 +498,9 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
                 break;
             case HOST_IRQ_STAT: /* R/WC, RO */
                 s->control_regs.irqstatus &= ~val;
+                if (val & ahci_ccc_irq_bit(s)) {
+                    s->ccc_irq = false;
+                }
                 ahci_check_irq(s);
                 break;
             case HOST_PORTS_IMPL: /* R/WO, RO */
@@ -426,6 +509,14 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
             case HOST_VERSION: /* RO */
                 /* FIXME report write? */
                 break;
+            case HOST_CCC_CTL: /* R/W */
+                ahci_ccc_write(s, val);
+                break;
+            case HOST_CCC_PORTS: /* R/W */
+                if (s->control_regs.cap & HOST_CAP_CCC) {
+                    s->control_regs.ccc_ports = val & s->control_regs.impl;
+                }
+                break;
             default:
                 DPRINTF(-1, "write to unknown register 0x%x\n", (unsigned)addr);
         }
@@ -489,6 +580,10 @@ static void ahci_reg_init(AHCIState *s)
                           (AHCI_NUM_COMMAND_SLOTS << 8) |
                           (AHCI_SUPPORTED_SPEED_GEN1 << AHCI_SUPPORTED_SPEED) |
                           HOST_CAP_NCQ | HOST_CAP_AHCI;
+    /* CCC_CTL.INT is the first IRQ_STAT bit not used by a port */
+    if (s->ccc && s->ports < 32) {
+        s->control_regs.cap |= HOST_CAP_CCC;
+    }
 
     s->control_regs.impl = (1 << s->ports) - 1;
 
@@ -505,12 +600,21 @@ static void check_cmd(AHCIState *s, int port)
     uint8_t slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        BlockBackend *blk = s->dev[port].port.ifs[0].blk;
+
+        /* Submit the NCQ commands issued together as one batch */
+        if (blk) {
+            blk_io_plug(blk);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1U << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1U << slot);
             }
         }
+        if (blk) {
+            blk_io_unplug(blk);
+        }
     }
 }
 
@@ -941,6 +1045,7 @@ static void ncq_finish(NCQTransferState *ncq_tfs)
                     &ncq_tfs->acct);
     qemu_sglist_destroy(&ncq_tfs->sglist);
     ncq_tfs->used = 0;
+    ahci_ccc_complete(ncq_tfs->drive);
 }
 
 static void ncq_cb(void *opaque, int ret)
@@ -1423,6 +1528,7 @@ static void ahci_cmd_done(IDEDMA *dma)
 
     /* update d2h status */
     ahci_write_fis_d2h(ad);
+    ahci_ccc_complete(ad);
 
     if (!ad->check_bh) {
         /* maybe we still have something to process, check later */
@@ -1464,6 +1570,7 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
     s->as = as;
     s->ports = ports;
     s->dev = g_new0(AHCIDevice, ports);
+    s->ccc_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, ahci_ccc_timer_cb, s);
     ahci_reg_init(s);
     irqs = qemu_allocate_irqs(ahci_irq_set, s, s->ports);
     for (i = 0; i < s->ports; i++) {
@@ -1483,9 +1590,21 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
 
 void ahci_uninit(AHCIState *s)
 {
+    timer_del(s->ccc_timer);
+    timer_free(s->ccc_timer);
     g_free(s->dev);
 }
 
+static uint32_t ahci_ccc_reset_ctl(AHCIState *s)
+{
+    if (!(s->control_regs.cap & HOST_CAP_CCC)) {
+        return 0;
+    }
+    return (s->ports << HOST_CCC_CTL_INT_SHIFT) |
+           (1 << HOST_CCC_CTL_CC_SHIFT) |
+           (1 << HOST_CCC_CTL_TV_SHIFT);
+}
+
 void ahci_reset(AHCIState *s)
 {
     AHCIPortRegs *pr;
@@ -1502,6 +1621,12 @@ void ahci_reset(AHCIState *s)
      */
     s->control_regs.ghc = HOST_CTL_AHCI_EN;
 
+    s->control_regs.ccc_ctl = ahci_ccc_reset_ctl(s);
+    s->control_regs.ccc_ports = 0;
+    s->ccc_count = 0;
+    s->ccc_irq = false;
+    timer_del(s->ccc_timer);
+
     for (i = 0; i < s->ports; i++) {
         pr = &s->dev[i].port_regs;
         pr->irq_stat = 0;
@@ -1642,6 +1767,29 @@ static int ahci_state_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool ahci_ccc_needed(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    return s->control_regs.ccc_ctl != ahci_ccc_reset_ctl(s) ||
+           s->control_regs.ccc_ports || s->ccc_irq;
+}
+
+static const VMStateDescription vmstate_ahci_ccc = {
+    .name = "ahci/ccc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ahci_ccc_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(control_regs.ccc_ctl, AHCIState),
+        VMSTATE_UINT32(control_regs.ccc_ports, AHCIState),
+        VMSTATE_UINT32(ccc_count, AHCIState),
+        VMSTATE_BOOL(ccc_irq, AHCIState),
+        VMSTATE_TIMER_PTR(ccc_timer, AHCIState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
     .version_id = 1,
@@ -1658,6 +1806,10 @@ const VMStateDescription vmstate_ahci = {
         VMSTATE_INT32_EQUAL(ports, AHCIState),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_ahci_ccc,
+        NULL
+    },
 };
 
 static const VMStateDescription vmstate_sysbus_ahci = {
@@ -1695,6 +1847,7 @@ static void sysbus_ahci_realize(DeviceState *dev, Error **errp)
 
 static Property sysbus_ahci_properties[] = {
     DEFINE_PROP_UINT32("num-ports", SysbusAHCIState, num_ports, 1),
+    DEFINE_PROP_BOOL("ccc", SysbusAHCIState, ahci.ccc, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -624,7 +624,10 @@ static uint32_t apic_get_current_count(APICCommonState *s)
 static void apic_timer_update(APICCommonState *s, int64_t current_time)
 {
     if (apic_next_timer(s, current_time)) {
-        timer_mod(s->timer, s->next_time);
+        /* Rewriting the LVT or the same count does not move the deadline */
+        if (timer_expire_time_ns(s->timer) != s->next_time) {
+            timer_mod(s->timer, s->next_time);
+        }
     } else {
         timer_del(s->timer);
     }
@@ -33,6 +33,8 @@
 #include "sysemu/hostmem.h"
 #include "sysemu/qtest.h"
 #include "qapi/visitor.h"
+#include "qemu/stats.h"
+#include "qemu/timer.h"
 
 #include "hw/misc/ivshmem.h"
 
@@ -77,6 +79,10 @@ typedef struct Peer {
 typedef struct MSIVector {
     PCIDevice *pdev;
     int virq;
+    /* interrupt coalescing, only without irqfd */
+    QEMUTimer *coalesce_timer;
+    int64_t last_irq;
+    bool irq_pending;
 } MSIVector;
 
 typedef struct IVShmemState {
@@ -107,6 +113,12 @@ typedef struct IVShmemState {
     MSIVector *msi_vectors;
     uint64_t msg_buf;           /* buffer for receiving server messages */
     int msg_buffered_bytes;     /* #bytes in @msg_buf */
+    uint32_t coalesce_us;       /* minimum interval between interrupts */
+
+    /* statistics */
+    uint64_t doorbell_exits;    /* doorbell writes not handled by ioeventfd */
+    uint64_t notifications;     /* peer notifications handled by QEMU */
+    uint64_t interrupts;        /* interrupts raised by QEMU */
 
     /* migration stuff */
     OnOffAuto master;
@@ -139,6 +151,16 @@ static inline bool ivshmem_is_master(IVShmemState *s)
     return s->master == ON_OFF_AUTO_ON;
 }
 
+/*
+ * With irqfd, KVM injects peer notifications without going through QEMU.
+ * Coalescing needs QEMU to see every notification, so it disables irqfd.
+ */
+static inline bool ivshmem_use_irqfd(IVShmemState *s)
+{
+    return kvm_msi_via_irqfd_enabled() &&
+        ivshmem_has_feature(s, IVSHMEM_MSI) && !s->coalesce_us;
+}
+
 static void ivshmem_update_irq(IVShmemState *s)
 {
     PCIDevice *d = PCI_DEVICE(s);
@@ -227,6 +249,7 @@ static void ivshmem_io_write(void *opaque, hwaddr addr,
             break;
 
         case DOORBELL:
+            s->doorbell_exits++;
             /* check that dest VM ID is reasonable */
             if (dest >= s->nb_peers) {
                 IVSHMEM_DPRINTF("Invalid destination VM ID (%d)\n", dest);
@@ -286,6 +309,31 @@ static const MemoryRegionOps ivshmem_mmio_ops = {
     },
 };
 
+static void ivshmem_vector_raise(IVShmemState *s, int vector)
+{
+    PCIDevice *pdev = PCI_DEVICE(s);
+
+    IVSHMEM_DPRINTF("interrupt on vector %p %d\n", pdev, vector);
+    s->interrupts++;
+    if (ivshmem_has_feature(s, IVSHMEM_MSI)) {
+        if (msix_enabled(pdev)) {
+            msix_notify(pdev, vector);
+        }
+    } else {
+        ivshmem_IntrStatus_write(s, 1);
+    }
+}
+
+static void ivshmem_coalesce_timer(void *opaque)
+{
+    MSIVector *entry = opaque;
+    IVShmemState *s = IVSHMEM_COMMON(entry->pdev);
+
+    entry->irq_pending = false;
+    entry->last_irq = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    ivshmem_vector_raise(s, entry - s->msi_vectors);
+}
+
 static void ivshmem_vector_notify(void *opaque)
 {
     MSIVector *entry = opaque;
@@ -297,15 +345,28 @@ static void ivshmem_vector_notify(void *opaque)
     if (!event_notifier_test_and_clear(n)) {
         return;
     }
+    s->notifications++;
 
-    IVSHMEM_DPRINTF("interrupt on vector %p %d\n", pdev, vector);
-    if (ivshmem_has_feature(s, IVSHMEM_MSI)) {
-        if (msix_enabled(pdev)) {
-            msix_notify(pdev, vector);
+    if (s->coalesce_us) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        int64_t next = entry->last_irq + s->coalesce_us * SCALE_US;
+
+        /*
+         * Notifications arriving within coalesce-us of the last interrupt
+         * are merged into one interrupt at the end of the interval.
+         */
+        if (entry->irq_pending) {
+            return;
         }
-    } else {
-        ivshmem_IntrStatus_write(s, 1);
+        if (now < next) {
+            entry->irq_pending = true;
+            timer_mod(entry->coalesce_timer, next);
+            return;
+        }
+        entry->last_irq = now;
     }
+
+    ivshmem_vector_raise(s, vector);
 }
 
 static int ivshmem_vector_unmask(PCIDevice *dev, unsigned vector,
@@ -460,8 +521,7 @@ static void ivshmem_add_kvm_msi_virq(IVShmemState *s, int vector,
 static void setup_interrupt(IVShmemState *s, int vector, Error **errp)
 {
     EventNotifier *n = &s->peers[s->vm_id].eventfds[vector];
-    bool with_irqfd = kvm_msi_via_irqfd_enabled() &&
-        ivshmem_has_feature(s, IVSHMEM_MSI);
+    bool with_irqfd = ivshmem_use_irqfd(s);
     PCIDevice *pdev = PCI_DEVICE(s);
     Error *err = NULL;
 
@@ -741,9 +801,14 @@ static void ivshmem_msix_vector_use(IVShmemState *s)
 static void ivshmem_reset(DeviceState *d)
 {
     IVShmemState *s = IVSHMEM_COMMON(d);
+    int i;
 
     s->intrstatus = 0;
     s->intrmask = 0;
+    for (i = 0; s->msi_vectors && s->coalesce_us && i < s->vectors; i++) {
+        timer_del(s->msi_vectors[i].coalesce_timer);
+        s->msi_vectors[i].irq_pending = false;
+    }
     if (ivshmem_has_feature(s, IVSHMEM_MSI)) {
         ivshmem_msix_vector_use(s);
     }
@@ -751,9 +816,17 @@ static void ivshmem_reset(DeviceState *d)
 
 static int ivshmem_setup_interrupts(IVShmemState *s)
 {
+    int i;
+
     /* allocate QEMU callback data for receiving interrupts */
     s->msi_vectors = g_malloc0(s->vectors * sizeof(MSIVector));
 
+    for (i = 0; s->coalesce_us && i < s->vectors; i++) {
+        s->msi_vectors[i].coalesce_timer =
+            timer_new_ns(QEMU_CLOCK_VIRTUAL, ivshmem_coalesce_timer,
+                         &s->msi_vectors[i]);
+    }
+
     if (ivshmem_has_feature(s, IVSHMEM_MSI)) {
         if (msix_init_exclusive_bar(PCI_DEVICE(s), s->vectors, 1)) {
             return -1;
@@ -824,7 +897,7 @@ static void ivshmem_write_config(PCIDevice *pdev, uint32_t address,
     pci_default_write_config(pdev, address, val, len);
     is_enabled = msix_enabled(pdev);
 
-    if (kvm_msi_via_irqfd_enabled()) {
+    if (ivshmem_use_irqfd(s)) {
         if (!was_enabled && is_enabled) {
             ivshmem_enable_irqfd(s);
         } else if (was_enabled && !is_enabled) {
@@ -954,6 +1027,10 @@ static void ivshmem_exit(PCIDevice *dev)
         msix_uninit_exclusive_bar(dev);
     }
 
+    for (i = 0; s->msi_vectors && s->coalesce_us && i < s->vectors; i++) {
+        timer_del(s->msi_vectors[i].coalesce_timer);
+        timer_free(s->msi_vectors[i].coalesce_timer);
+    }
     g_free(s->msi_vectors);
 }
 
@@ -1105,6 +1182,7 @@ static Property ivshmem_doorbell_properties[] = {
     DEFINE_PROP_UINT32("vectors", IVShmemState, vectors, 1),
     DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD,
                     true),
+    DEFINE_PROP_UINT32("coalesce-us", IVShmemState, coalesce_us, 0),
     DEFINE_PROP_ON_OFF_AUTO("master", IVShmemState, master, ON_OFF_AUTO_OFF),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1218,6 +1296,7 @@ static Property ivshmem_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD,
                     false),
     DEFINE_PROP_BIT("msi", IVShmemState, features, IVSHMEM_MSI, true),
+    DEFINE_PROP_UINT32("coalesce-us", IVShmemState, coalesce_us, 0),
     DEFINE_PROP_STRING("shm", IVShmemState, shmobj),
     DEFINE_PROP_STRING("role", IVShmemState, role),
     DEFINE_PROP_UINT32("use64", IVShmemState, not_legacy_32bit, 1),
@@ -1314,12 +1393,39 @@ static const TypeInfo ivshmem_info = {
     .class_init    = ivshmem_class_init,
 };
 
+static int ivshmem_stats_one(Object *obj, void *opaque)
+{
+    StatsCollector *c = opaque;
+    IVShmemState *s;
+    char *path;
+
+    s = (IVShmemState *)object_dynamic_cast(obj, TYPE_IVSHMEM_COMMON);
+    if (!s) {
+        return 0;
+    }
+
+    path = object_get_canonical_path(obj);
+    if (stats_begin_instance(c, path)) {
+        stats_add_counter(c, "doorbell-exits", s->doorbell_exits);
+        stats_add_counter(c, "notifications", s->notifications);
+        stats_add_counter(c, "interrupts", s->interrupts);
+    }
+    g_free(path);
+    return 0;
+}
+
+static void ivshmem_stats_provider(StatsCollector *c, void *opaque)
+{
+    object_child_foreach_recursive(object_get_root(), ivshmem_stats_one, c);
+}
+
 static void ivshmem_register_types(void)
 {
     type_register_static(&ivshmem_common_info);
     type_register_static(&ivshmem_plain_info);
     type_register_static(&ivshmem_doorbell_info);
     type_register_static(&ivshmem_info);
+    stats_register_provider("ivshmem", ivshmem_stats_provider, NULL);
 }
 
 type_init(ivshmem_register_types)
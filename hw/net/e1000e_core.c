@@ -51,6 +51,7 @@
 #define E1000E_MIN_XITR     (500) /* No more then 7813 interrupts per
                                      second according to spec 10.2.4.2 */
 #define E1000E_MAX_TX_FRAGS (64)
+#define E1000E_DESC_BATCH   (32) /* Descriptors fetched per DMA transfer */
 
 static inline void
 e1000e_set_interrupt_cause(E1000ECore *core, uint32_t val);
@@ -155,6 +156,12 @@ e1000e_intrmgr_on_throttling_timer(void *opaque)
         trace_e1000e_irq_throttling_no_pending_interrupts();
         return;
     }
+    timer->core->itr_intr_pending = false;
+
+    /*
+     * Delivering the interrupt below restarts the interval, so that
+     * interrupts are never closer than ITR apart.
+     */
 
     if (msi_enabled(timer->core->owner)) {
         trace_e1000e_irq_msi_notify_postponed();
@@ -179,6 +186,12 @@ e1000e_intrmgr_on_msix_throttling_timer(void *opaque)
         trace_e1000e_irq_throttling_no_pending_vec(idx);
         return;
     }
+    timer->core->eitr_intr_pending[idx] = false;
+
+    /* Start a new interval, interrupts before its end are postponed again */
+    if (timer->core->mac[timer->delay_reg] != 0) {
+        e1000e_intrmgr_rearm_timer(timer);
+    }
 
     trace_e1000e_irq_msix_notify_postponed_vec(idx);
     msix_notify(timer->core->owner, idx);
@@ -773,9 +786,14 @@ e1000e_rx_wb_interrupt_cause(E1000ECore *core, int queue_idx,
     return (queue_idx == 0) ? E1000_ICR_RXQ0 : E1000_ICR_RXQ1;
 }
 
+/*
+ * Set the DD bit of a processed descriptor.  Returns the interrupt cause,
+ * or 0 if the descriptor needs no writeback; the caller writes it to
+ * guest memory.
+ */
 static uint32_t
-e1000e_txdesc_writeback(E1000ECore *core, dma_addr_t base,
-                        struct e1000_tx_desc *dp, bool *ide, int queue_idx)
+e1000e_txdesc_writeback(E1000ECore *core, struct e1000_tx_desc *dp,
+                        bool *ide, int queue_idx)
 {
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
@@ -789,8 +807,6 @@ e1000e_txdesc_writeback(E1000ECore *core, dma_addr_t base,
     txd_upper = le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD;
 
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(core->owner, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
     return e1000e_tx_wb_interrupt_cause(core, queue_idx);
 }
 
@@ -853,6 +869,20 @@ e1000e_ring_free_descr_num(E1000ECore *core, const E1000E_RingInfo *r)
     return 0;
 }
 
+/* Descriptors owned by the device that are contiguous in memory */
+static inline uint32_t
+e1000e_ring_contiguous_descr_num(E1000ECore *core, const E1000E_RingInfo *r)
+{
+    uint32_t size = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (core->mac[r->dh] >= size) {
+        /* Bogus head, e1000e_ring_advance() wraps it after one descriptor */
+        return 1;
+    }
+
+    return MIN(e1000e_ring_free_descr_num(core, r), size - core->mac[r->dh]);
+}
+
 static inline bool
 e1000e_ring_enabled(E1000ECore *core, const E1000E_RingInfo *r)
 {
@@ -911,10 +941,11 @@ static void
 e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000E_DESC_BATCH];
     bool ide = false;
     const E1000E_RingInfo *txi = txr->i;
     uint32_t cause = E1000_ICS_TXQE;
+    uint32_t i, n, wb_first, wb_last, wb_cause;
 
     if (!(core->mac[TCTL] & E1000_TCTL_EN)) {
         trace_e1000e_tx_disabled();
@@ -923,16 +954,39 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 
     while (!e1000e_ring_empty(core, txi)) {
         base = e1000e_ring_head_descr(core, txi);
+        n = MIN(e1000e_ring_contiguous_descr_num(core, txi),
+                E1000E_DESC_BATCH);
+
+        pci_dma_read(core->owner, base, desc, n * sizeof(desc[0]));
+
+        wb_first = n;
+        wb_last = 0;
+        for (i = 0; i < n; i++) {
+            trace_e1000e_tx_descr((void *)(intptr_t)desc[i].buffer_addr,
+                                  desc[i].lower.data, desc[i].upper.data);
+
+            e1000e_process_tx_desc(core, txr->tx, &desc[i], txi->idx);
+            wb_cause = e1000e_txdesc_writeback(core, &desc[i], &ide,
+                                               txi->idx);
+            if (wb_cause) {
+                cause |= wb_cause;
+                wb_first = MIN(wb_first, i);
+                wb_last = i;
+            }
 
-        pci_dma_read(core->owner, base, &desc, sizeof(desc));
-
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.buffer_addr,
-                              desc.lower.data, desc.upper.data);
-
-        e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx);
-        cause |= e1000e_txdesc_writeback(core, base, &desc, &ide, txi->idx);
+            e1000e_ring_advance(core, txi, 1);
+        }
 
-        e1000e_ring_advance(core, txi, 1);
+        /*
+         * Write back the statuses with a single transfer.  Descriptors in
+         * between that need no writeback are still owned by the device and
+         * are written back unchanged.
+         */
+        if (wb_first < n) {
+            pci_dma_write(core->owner, base + wb_first * sizeof(desc[0]),
+                          &desc[wb_first],
+                          (wb_last - wb_first + 1) * sizeof(desc[0]));
+        }
     }
 
     if (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause)) {
@@ -1495,8 +1549,11 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
                              const E1000E_RSSInfo *rss_info)
 {
     PCIDevice *d = core->owner;
-    dma_addr_t base;
-    uint8_t desc[E1000_MAX_RX_DESC_LEN];
+    dma_addr_t base = 0;
+    uint8_t descs[E1000E_DESC_BATCH * E1000_MAX_RX_DESC_LEN];
+    uint8_t *desc;
+    uint32_t desc_slots = core->rx_desc_len / E1000_MIN_RX_DESC_LEN;
+    uint32_t batch_len = 0, batch_pos = 0;
     size_t desc_size;
     size_t desc_offset = 0;
     size_t iov_ofs = 0;
@@ -1522,11 +1579,29 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
             desc_size = core->rx_desc_buf_size;
         }
 
-        base = e1000e_ring_head_descr(core, rxi);
-
-        pci_dma_read(d, base, &desc, core->rx_desc_len);
+        /*
+         * Fetch the descriptors needed by the rest of the packet at once,
+         * up to the end of the ring.
+         */
+        if (batch_pos == batch_len) {
+            if (batch_len) {
+                pci_dma_write(d, base, descs, batch_len * core->rx_desc_len);
+            }
+            base = e1000e_ring_head_descr(core, rxi);
+            batch_len = DIV_ROUND_UP(total_size - desc_offset,
+                                     core->rx_desc_buf_size);
+            batch_len = MIN(batch_len, E1000E_DESC_BATCH);
+            batch_len = MIN(batch_len,
+                            e1000e_ring_contiguous_descr_num(core, rxi) /
+                            desc_slots);
+            batch_len = MAX(batch_len, 1);
+            batch_pos = 0;
+            pci_dma_read(d, base, descs, batch_len * core->rx_desc_len);
+        }
+        desc = descs + batch_pos * core->rx_desc_len;
 
-        trace_e1000e_rx_descr(rxi->idx, base, core->rx_desc_len);
+        trace_e1000e_rx_descr(rxi->idx, base + batch_pos * core->rx_desc_len,
+                              core->rx_desc_len);
 
         e1000e_read_rx_descr(core, desc, &ba);
 
@@ -1600,13 +1675,15 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
 
         e1000e_write_rx_descr(core, desc, is_last ? core->rx_pkt : NULL,
                            rss_info, do_ps ? ps_hdr_len : 0, &bastate.written);
-        pci_dma_write(d, base, &desc, core->rx_desc_len);
+        batch_pos++;
 
-        e1000e_ring_advance(core, rxi,
-                            core->rx_desc_len / E1000_MIN_RX_DESC_LEN);
+        e1000e_ring_advance(core, rxi, desc_slots);
 
     } while (desc_offset < total_size);
 
+    /* Write back all the descriptors used by the packet at once */
+    pci_dma_write(d, base, descs, batch_pos * core->rx_desc_len);
+
     e1000e_update_rx_stats(core, size, total_size);
 }
 
@@ -594,15 +594,117 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
-bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
+/*
+ * TCP segmentation offload in software: every segment is sent as a
+ * vector of the shared L2 header, the L3 header and a TCP header that are
+ * rewritten in place for each segment, and of slices of the payload.  The
+ * payload is neither copied nor checksummed as a whole.
+ */
+static bool net_tx_pkt_do_sw_segmentation(struct NetTxPkt *pkt,
+    NetClientState *nc)
 {
-    assert(pkt);
+    struct iovec seg[NET_MAX_FRAG_SG_LIST];
+    struct iovec *l3 = &pkt->vec[NET_TX_PKT_L3HDR_FRAG];
+    struct iovec *pl = &pkt->vec[NET_TX_PKT_PL_START_FRAG];
+    uint8_t l4_hdr[15 * sizeof(uint32_t)];
+    struct tcp_hdr *tcp = (struct tcp_hdr *)l4_hdr;
+    bool is_ip4 = (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                  VIRTIO_NET_HDR_GSO_TCPV4;
+    size_t mss = pkt->virt_hdr.gso_size;
+    size_t l4_len = pkt->virt_hdr.hdr_len - pkt->hdr_len;
+    size_t data_len, offset = 0, src_offset;
+    uint32_t src_idx = 0;
+    uint32_t seq;
+    uint16_t ip_id = 0;
+    uint8_t flags;
+
+    if (!mss || l4_len < sizeof(struct tcp_hdr) || l4_len > sizeof(l4_hdr) ||
+        pkt->payload_len < l4_len ||
+        iov_to_buf(pl, pkt->payload_frags, 0, l4_hdr, l4_len) < l4_len) {
+        return false;
+    }
+    data_len = pkt->payload_len - l4_len;
+    seq = be32_to_cpu(tcp->th_seq);
+    flags = tcp->th_flags;
+    if (is_ip4) {
+        ip_id = be16_to_cpu(((struct ip_header *)l3->iov_base)->ip_id);
+    }
 
-    if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
-        net_tx_pkt_do_sw_csum(pkt);
+    seg[0] = pkt->vec[NET_TX_PKT_L2HDR_FRAG];
+    seg[1] = *l3;
+    seg[2].iov_base = l4_hdr;
+    seg[2].iov_len = l4_len;
+
+    /* Skip the TCP header in the payload */
+    src_offset = l4_len;
+    while (src_idx < pkt->payload_frags && src_offset >= pl[src_idx].iov_len) {
+        src_offset -= pl[src_idx].iov_len;
+        src_idx++;
     }
 
+    do {
+        size_t seg_len = 0;
+        uint32_t csum_cntr, cso;
+        int cnt = 3;
+
+        while (seg_len < mss && src_idx < pkt->payload_frags &&
+               cnt < NET_MAX_FRAG_SG_LIST) {
+            size_t len = MIN(pl[src_idx].iov_len - src_offset, mss - seg_len);
+
+            seg[cnt].iov_base = pl[src_idx].iov_base + src_offset;
+            seg[cnt++].iov_len = len;
+            seg_len += len;
+            src_offset += len;
+            if (src_offset == pl[src_idx].iov_len) {
+                src_offset = 0;
+                src_idx++;
+            }
+        }
+
+        tcp->th_seq = cpu_to_be32(seq + offset);
+        tcp->th_flags = flags;
+        if (offset) {
+            tcp->th_flags &= ~TH_CWR;
+        }
+        if (offset + seg_len < data_len) {
+            tcp->th_flags &= ~(TH_FIN | TH_PUSH);
+        }
+        tcp->th_sum = 0;
+
+        if (is_ip4) {
+            struct ip_header *ip = l3->iov_base;
+
+            ip->ip_len = cpu_to_be16(l3->iov_len + l4_len + seg_len);
+            ip->ip_id = cpu_to_be16(ip_id++);
+            eth_fix_ip4_checksum(ip, l3->iov_len);
+            csum_cntr = eth_calc_ip4_pseudo_hdr_csum(ip, l4_len + seg_len,
+                                                     &cso);
+        } else {
+            struct ip6_header *ip6 = l3->iov_base;
+
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+                cpu_to_be16(l3->iov_len - sizeof(struct ip6_header) +
+                            l4_len + seg_len);
+            csum_cntr = eth_calc_ip6_pseudo_hdr_csum(ip6, l4_len + seg_len,
+                                                     IP_PROTO_TCP, &cso);
+        }
+        csum_cntr += net_checksum_add_cont(l4_len, l4_hdr, cso);
+        csum_cntr += net_checksum_add_iov(&seg[3], cnt - 3, 0, seg_len,
+                                          cso + l4_len);
+        tcp->th_sum = cpu_to_be16(net_checksum_finish(csum_cntr));
+
+        net_tx_pkt_sendv(pkt, nc, seg, cnt);
+
+        offset += seg_len;
+    } while (offset < data_len && src_idx < pkt->payload_frags);
+
+    return true;
+}
+
+bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
+{
+    assert(pkt);
+
     /*
      * Since underlying infrastructure does not support IP datagrams longer
      * than 64K we should drop such packets and don't even try to send
@@ -615,6 +717,21 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         }
     }
 
+    if (!pkt->has_virt_hdr) {
+        switch (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+        case VIRTIO_NET_HDR_GSO_TCPV4:
+        case VIRTIO_NET_HDR_GSO_TCPV6:
+            /* every segment gets its own checksum */
+            return net_tx_pkt_do_sw_segmentation(pkt, nc);
+        default:
+            break;
+        }
+
+        if (pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            net_tx_pkt_do_sw_csum(pkt);
+        }
+    }
+
     if (pkt->has_virt_hdr ||
         pkt->virt_hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
         net_tx_pkt_sendv(pkt, nc, pkt->vec,
@@ -25,6 +25,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "qapi/error.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -95,7 +96,9 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR) &&
         !virtio_vdev_has_feature(vdev, VIRTIO_F_VERSION_1) &&
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
+        virtio_net_aio_context_acquire(n);
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
+        virtio_net_aio_context_release(n);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     }
 }
@@ -107,6 +110,16 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
         (n->status & VIRTIO_NET_S_LINK_UP) && vdev->vm_running;
 }
 
+/*
+ * A vhost-user backend that went away still owns the rings: userspace must
+ * not consume the guest's buffers until it reconnects and resumes them.
+ */
+static bool virtio_net_backend_away(NetClientState *nc)
+{
+    return nc->peer && nc->peer->link_down &&
+           nc->peer->info->type == NET_CLIENT_DRIVER_VHOST_USER;
+}
+
 static void virtio_net_announce_timer(void *opaque)
 {
     VirtIONet *n = opaque;
@@ -218,6 +231,32 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/*
+ * Keep the iothreads out of the queues while the main loop changes state
+ * that the rx and tx paths use.  The locks are recursive, so an iothread
+ * listed for several queue pairs is simply acquired several times.
+ */
+static void virtio_net_aio_context_acquire(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        aio_context_acquire(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
+static void virtio_net_aio_context_release(VirtIONet *n)
+{
+    int i;
+
+    for (i = n->num_iothreads - 1; i >= 0; i--) {
+        aio_context_release(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
+static void virtio_net_dataplane_start(VirtIONet *n);
+static void virtio_net_dataplane_stop(VirtIONet *n);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -225,9 +264,19 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_aio_context_acquire(n);
+
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    if (n->num_iothreads) {
+        if (virtio_net_started(n, status) && !n->vhost_started) {
+            virtio_net_dataplane_start(n);
+        } else {
+            virtio_net_dataplane_stop(n);
+        }
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -239,7 +288,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             queue_status = status;
         }
         queue_started =
-            virtio_net_started(n, queue_status) && !n->vhost_started;
+            virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !virtio_net_backend_away(ncs);
 
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
@@ -264,6 +314,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    virtio_net_aio_context_release(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -411,6 +463,9 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    /* Give the iothreads another chance on the next start */
+    n->dataplane_disabled = false;
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -908,6 +963,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov2 = iov = g_memdup(elem->out_sg, sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
+        virtio_net_aio_context_acquire(n);
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
@@ -923,6 +979,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
+        virtio_net_aio_context_release(n);
 
         s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
@@ -1007,23 +1064,31 @@ static void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr)
  * checksums.  This is terrible but it's better than hacking the guest
  * kernels.
  *
- * N.B. if we introduce a zero-copy API, this operation is no longer free so
- * we should provide a mechanism to disable it to avoid polluting the host
- * cache.
+ * The zero-copy receive path only looks at the first bytes of each packet
+ * and hands the affected packets back to the copying path.
  */
+static bool is_broken_dhclient_packet(struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
+{
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+           (size > 27 && size < 1500) && /* normal sized MTU */
+           (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
+           (buf[23] == 17) && /* ip.protocol == UDP */
+           (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
 static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
                                         uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
-        (size > 27 && size < 1500) && /* normal sized MTU */
-        (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
-        (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
 }
 
+/* Bytes of a packet that receive_filter() and the dhclient check look at */
+#define VIRTIO_NET_RX_HEAD_LEN (sizeof(struct virtio_net_hdr_mrg_rxbuf) + 36)
+
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
                            const void *buf, size_t size)
 {
@@ -1097,6 +1162,38 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+/*
+ * With iothreads, the rx and tx queues are served outside the QEMU global
+ * mutex and can only interrupt the guest through its guest notifier.
+ */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (!n->dataplane_started) {
+        virtio_notify(vdev, vq);
+    } else if (virtio_should_notify(vdev, vq)) {
+        event_notifier_set(virtio_queue_get_guest_notifier(vq));
+    }
+}
+
+/* At most this many rx buffers are held back while receiving a batch */
+#define VIRTIO_NET_RX_BATCH_MAX 64
+
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    if (q->rx_pending) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        virtio_net_notify(q->n, q->rx_vq);
+        q->rx_pending = 0;
+    }
+}
+
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    virtio_net_rx_flush(virtio_net_get_subqueue(nc));
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -1183,7 +1280,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_pending + i++);
         g_free(elem);
     }
 
@@ -1194,8 +1291,148 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_pending += i;
+    if (!nc->receive_batch || q->rx_pending >= VIRTIO_NET_RX_BATCH_MAX) {
+        virtio_net_rx_flush(q);
+    }
+
+    return size;
+}
+
+/*
+ * Zero-copy receive: the backend reads the packet into the first rx
+ * buffer, past the header the guest expects.  This needs the backend to
+ * produce that header itself, or no header at all.
+ */
+static int virtio_net_rx_iov_get(NetClientState *nc, struct iovec *iov,
+                                 int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtQueueElement *elem;
+    size_t hdr_len = n->has_vnet_hdr ? 0 : n->guest_hdr_len;
+    int cnt;
+
+    assert(!q->rx_elem);
+
+    if (!virtio_net_can_receive(nc) || n->needs_vnet_hdr_swap ||
+        (n->has_vnet_hdr && n->host_hdr_len != n->guest_hdr_len) ||
+        !virtio_net_has_buffers(q, n->guest_hdr_len +
+                                   VIRTIO_NET_RX_HEAD_LEN)) {
+        return 0;
+    }
+
+    elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+    if (!elem) {
+        return 0;
+    }
+
+    cnt = iov_copy(iov, iovcnt, elem->in_sg, elem->in_num, hdr_len, -1);
+    if (iov_size(iov, cnt) < VIRTIO_NET_RX_HEAD_LEN) {
+        /* Leave odd buffers to virtio_net_receive() */
+        virtqueue_discard(q->rx_vq, elem, 0);
+        g_free(elem);
+        return 0;
+    }
+
+    q->rx_elem = elem;
+    q->rx_elem_len = iov_size(iov, cnt);
+    return cnt;
+}
+
+static ssize_t virtio_net_rx_iov_put(NetClientState *nc, uint8_t *buf,
+                                     size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elem = q->rx_elem;
+    size_t cap = q->rx_elem_len;
+    size_t hdr_len = n->has_vnet_hdr ? 0 : n->guest_hdr_len;
+    uint8_t head[VIRTIO_NET_RX_HEAD_LEN] = { 0 };
+    struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+    unsigned mhdr_cnt = 0;
+    size_t offset, i = 0;
+
+    q->rx_elem = NULL;
+    if (!size) {
+        virtqueue_discard(q->rx_vq, elem, 0);
+        g_free(elem);
+        return 0;
+    }
+
+    iov_to_buf(elem->in_sg, elem->in_num, hdr_len, head,
+               MIN(size, sizeof(head)));
+    if (!receive_filter(n, head, size) ||
+        (size > cap && !n->mergeable_rx_bufs)) {
+        /* Dropped, just like virtio_net_receive() would */
+        virtqueue_discard(q->rx_vq, elem, 0);
+        g_free(elem);
+        return size;
+    }
+
+    if ((n->has_vnet_hdr &&
+         is_broken_dhclient_packet((struct virtio_net_hdr *)head,
+                                   head + n->host_hdr_len,
+                                   size - n->host_hdr_len)) ||
+        (size > cap && !virtio_net_has_buffers(q, size - cap))) {
+        /* Let virtio_net_receive() deal with it */
+        iov_to_buf(elem->in_sg, elem->in_num, hdr_len, buf, MIN(size, cap));
+        virtqueue_discard(q->rx_vq, elem, 0);
+        g_free(elem);
+        return 0;
+    }
+
+    if (n->mergeable_rx_bufs) {
+        mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
+                            elem->in_sg, elem->in_num,
+                            offsetof(typeof(mhdr), num_buffers),
+                            sizeof(mhdr.num_buffers));
+    }
+    if (!n->has_vnet_hdr) {
+        receive_header(n, elem->in_sg, elem->in_num, NULL, 0);
+    }
+
+    offset = MIN(size, cap);
+    virtqueue_fill(q->rx_vq, elem, hdr_len + offset, q->rx_pending + i++);
+    g_free(elem);
+
+    /* The rest of the packet was left in @buf */
+    while (offset < size) {
+        size_t len;
+
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            virtio_error(vdev, "virtio-net unexpected empty queue");
+            return -1;
+        }
+        if (elem->in_num < 1) {
+            virtio_error(vdev,
+                         "virtio-net receive queue contains no in buffers");
+            virtqueue_detach_element(q->rx_vq, elem, 0);
+            g_free(elem);
+            return -1;
+        }
+
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0,
+                           buf + offset, size - offset);
+        offset += len;
+        virtqueue_fill(q->rx_vq, elem, len, q->rx_pending + i++);
+        g_free(elem);
+    }
+
+    if (mhdr_cnt) {
+        virtio_stw_p(vdev, &mhdr.num_buffers, i);
+        iov_from_buf(mhdr_sg, mhdr_cnt,
+                     0,
+                     &mhdr.num_buffers, sizeof mhdr.num_buffers);
+    }
+
+    q->rx_pending += i;
+    if (!nc->receive_batch || q->rx_pending >= VIRTIO_NET_RX_BATCH_MAX) {
+        virtio_net_rx_flush(q);
+    }
 
     return size;
 }
@@ -1206,10 +1443,9 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -1218,6 +1454,19 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtio_net_flush_tx(q);
 }
 
+/* Transmitted packets are returned to the guest this many at a time */
+#define VIRTIO_NET_TX_COMPLETE_BATCH 64
+
+static void virtio_net_tx_complete_batch(VirtIONetQueue *q,
+                                         unsigned int *count)
+{
+    if (*count) {
+        virtqueue_flush(q->tx_vq, *count);
+        virtio_net_notify(q->n, q->tx_vq);
+        *count = 0;
+    }
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
@@ -1225,11 +1474,16 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
     int32_t num_packets = 0;
+    unsigned int completed = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
+    if (virtio_net_backend_away(qemu_get_subqueue(n->nic, queue_index))) {
+        return num_packets;
+    }
+
     if (q->async_tx.elem) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
@@ -1252,6 +1506,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
             g_free(elem);
+            virtio_net_tx_complete_batch(q, &completed);
             return -EINVAL;
         }
 
@@ -1261,6 +1516,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
                 g_free(elem);
+                virtio_net_tx_complete_batch(q, &completed);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -1299,18 +1555,22 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_complete_batch(q, &completed);
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtqueue_fill(q->tx_vq, elem, 0, completed++);
         g_free(elem);
+        if (completed == VIRTIO_NET_TX_COMPLETE_BATCH) {
+            virtio_net_tx_complete_batch(q, &completed);
+        }
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_complete_batch(q, &completed);
     return num_packets;
 }
 
@@ -1433,6 +1693,12 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
+    /* Queue pairs are spread round-robin over the iothreads */
+    if (n->num_iothreads) {
+        n->vqs[index].ctx = iothread_get_aio_context(
+            n->iothreads[index % n->num_iothreads]);
+    }
+
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
@@ -1514,6 +1780,178 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
     virtio_net_set_queues(n);
 }
 
+/* Resolve the colon-separated list of the "iothreads" property */
+static void virtio_net_dataplane_init(VirtIONet *n, Error **errp)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    char **ids;
+    int i;
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->ioeventfd_started) {
+        error_setg(errp, "device is incompatible with iothreads "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    ids = g_strsplit(n->net_conf.iothreads, ":", -1);
+    n->num_iothreads = g_strv_length(ids);
+    n->iothreads = g_new0(IOThread *, n->num_iothreads);
+    for (i = 0; i < n->num_iothreads; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "iothread '%s' not found", ids[i]);
+            break;
+        }
+        object_ref(obj);
+        n->iothreads[i] = IOTHREAD(obj);
+    }
+    if (!n->num_iothreads) {
+        error_setg(errp, "iothreads must name at least one iothread");
+    }
+    g_strfreev(ids);
+}
+
+static void virtio_net_dataplane_cleanup(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        if (n->iothreads[i]) {
+            object_unref(OBJECT(n->iothreads[i]));
+        }
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    n->num_iothreads = 0;
+}
+
+/* Move the tx bottom half or timer of @q to @ctx */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+        timer_free(q->tx_timer);
+        q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                    virtio_net_tx_timer, q);
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+    }
+}
+
+/*
+ * Hand each queue pair, together with the fd handlers of its backend, to
+ * its iothread.  A queue pair and its peer are then only touched from
+ * that thread, except by the callers of virtio_net_aio_context_acquire().
+ *
+ * Context: QEMU global mutex and the iothread AioContexts held
+ */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, j, r;
+
+    if (n->dataplane_started || n->dataplane_disabled) {
+        return;
+    }
+
+    /* Filters and hubs would be entered from several threads */
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (!QTAILQ_EMPTY(&nc->filters) ||
+            (nc->peer && !QTAILQ_EMPTY(&nc->peer->filters)) ||
+            qemu_net_set_aio_context(nc->peer, n->vqs[i].ctx) < 0) {
+            error_report("virtio-net: iothreads need a tap backend without "
+                         "vhost or filters, using the main loop");
+            goto fail_peers;
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net: failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        goto fail_peers;
+    }
+
+    /* Set up virtqueue notify */
+    for (j = 0; j < queues * 2; j++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), j, true);
+        if (r != 0) {
+            error_report("virtio-net: failed to set host notifier (%d)", r);
+            while (j--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), j, false);
+            }
+            k->set_guest_notifiers(qbus->parent, queues * 2, false);
+            goto fail_peers;
+        }
+    }
+
+    n->dataplane_started = true;
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_net_tx_set_aio_context(q, q->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx,
+                                                   virtio_net_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx,
+                q->tx_timer ? virtio_net_handle_tx_timer
+                            : virtio_net_handle_tx_bh);
+
+        /* Kick right away to begin processing buffers already in vring */
+        event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+    }
+    return;
+
+fail_peers:
+    while (i--) {
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+    }
+    n->dataplane_disabled = true;
+}
+
+/* Context: QEMU global mutex and the iothread AioContexts held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        /* Stop notifications for new buffers from guest */
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+        virtio_net_tx_set_aio_context(q, qemu_get_aio_context());
+    }
+
+    for (i = 0; i < queues * 2; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+
+    n->dataplane_started = false;
+}
+
 static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1665,6 +2103,9 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch_end = virtio_net_receive_batch_end,
+    .rx_iov_get = virtio_net_rx_iov_get,
+    .rx_iov_put = virtio_net_rx_iov_put,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1718,6 +2159,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    Error *err = NULL;
     int i;
 
     virtio_net_set_config_size(n, n->host_features);
@@ -1747,6 +2189,16 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (n->net_conf.iothreads) {
+        virtio_net_dataplane_init(n, &err);
+        if (err) {
+            error_propagate(errp, err);
+            virtio_net_dataplane_cleanup(n);
+            virtio_cleanup(vdev);
+            return;
+        }
+    }
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -1834,6 +2286,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     timer_free(n->announce_timer);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
+    virtio_net_dataplane_cleanup(n);
     virtio_cleanup(vdev);
 }
 
@@ -1918,6 +2371,7 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
+    DEFINE_PROP_STRING("iothreads", VirtIONet, net_conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -297,6 +297,13 @@ typedef struct {
 
         uint8_t rxq_num;
 
+        /* Receive side scaling configuration of the guest */
+        bool rss_enabled;
+        uint16_t rss_hash_type;
+        uint16_t rss_ind_table_size;
+        uint8_t rss_key[UPT1_RSS_MAX_KEY_SIZE];
+        uint8_t rss_ind_table[UPT1_RSS_MAX_IND_TABLE_SIZE];
+
         /* Network MTU */
         uint32_t mtu;
 
@@ -524,23 +531,52 @@ vmxnet3_dec_rx_completion_counter(VMXNET3State *s, int qidx)
     vmxnet3_ring_dec(&s->rxq_descr[qidx].comp_ring);
 }
 
-static void vmxnet3_complete_packet(VMXNET3State *s, int qidx, uint32_t tx_ridx)
+/* Maximum number of TX completion descriptors written with one DMA */
+#define VMXNET3_TXC_BATCH (32)
+
+/* TX completion descriptors for contiguous cells of the completion ring */
+typedef struct {
+    struct Vmxnet3_TxCompDesc descr[VMXNET3_TXC_BATCH];
+    hwaddr pa;
+    int num;
+} Vmxnet3TxcBatch;
+
+static void vmxnet3_flush_tx_completions(VMXNET3State *s,
+                                         Vmxnet3TxcBatch *batch)
 {
-    struct Vmxnet3_TxCompDesc txcq_descr;
-    PCIDevice *d = PCI_DEVICE(s);
+    if (!batch->num) {
+        return;
+    }
+
+    vmw_shmem_write(PCI_DEVICE(s), batch->pa, batch->descr,
+                    batch->num * sizeof(batch->descr[0]));
+    batch->num = 0;
+}
 
-    VMXNET3_RING_DUMP(VMW_RIPRN, "TXC", qidx, &s->txq_descr[qidx].comp_ring);
+static void vmxnet3_complete_packet(VMXNET3State *s, int qidx, uint32_t tx_ridx,
+                                    Vmxnet3TxcBatch *batch)
+{
+    Vmxnet3Ring *ring = &s->txq_descr[qidx].comp_ring;
+    struct Vmxnet3_TxCompDesc *txcq_descr;
 
-    txcq_descr.txdIdx = tx_ridx;
-    txcq_descr.gen = vmxnet3_ring_curr_gen(&s->txq_descr[qidx].comp_ring);
+    VMXNET3_RING_DUMP(VMW_RIPRN, "TXC", qidx, ring);
 
-    vmxnet3_ring_write_curr_cell(d, &s->txq_descr[qidx].comp_ring, &txcq_descr);
+    if (!batch->num) {
+        batch->pa = vmxnet3_ring_curr_cell_pa(ring);
+    }
 
-    /* Flush changes in TX descriptor before changing the counter value */
-    smp_wmb();
+    txcq_descr = &batch->descr[batch->num++];
+    memset(txcq_descr, 0, sizeof(*txcq_descr));
+    txcq_descr->txdIdx = tx_ridx;
+    txcq_descr->gen = vmxnet3_ring_curr_gen(ring);
 
     vmxnet3_inc_tx_completion_counter(s, qidx);
-    vmxnet3_trigger_interrupt(s, s->txq_descr[qidx].intr_idx);
+
+    /* The batch cannot go past the end of the ring */
+    if (batch->num == VMXNET3_TXC_BATCH ||
+        vmxnet3_ring_curr_cell_idx(ring) == 0) {
+        vmxnet3_flush_tx_completions(s, batch);
+    }
 }
 
 static bool
@@ -707,6 +743,12 @@ vmxnet3_pop_next_tx_descr(VMXNET3State *s,
     return false;
 }
 
+/* Map TX queues to the queues of a multiqueue backend */
+static NetClientState *vmxnet3_get_tx_queue(VMXNET3State *s, uint32_t qidx)
+{
+    return qemu_get_subqueue(s->nic, qidx % MAX(s->conf.peers.queues, 1));
+}
+
 static bool
 vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
 {
@@ -721,7 +763,7 @@ vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
     vmxnet3_dump_virt_hdr(net_tx_pkt_get_vhdr(s->tx_pkt));
     net_tx_pkt_dump(s->tx_pkt);
 
-    if (!net_tx_pkt_send(s->tx_pkt, qemu_get_queue(s->nic))) {
+    if (!net_tx_pkt_send(s->tx_pkt, vmxnet3_get_tx_queue(s, qidx))) {
         status = VMXNET3_PKT_STATUS_DISCARD;
         goto func_exit;
     }
@@ -734,10 +776,14 @@ func_exit:
 static void vmxnet3_process_tx_queue(VMXNET3State *s, int qidx)
 {
     struct Vmxnet3_TxDesc txd;
+    Vmxnet3TxcBatch batch;
+    bool completed = false;
     uint32_t txd_idx;
     uint32_t data_len;
     hwaddr data_pa;
 
+    batch.num = 0;
+
     for (;;) {
         if (!vmxnet3_pop_next_tx_descr(s, qidx, &txd, &txd_idx)) {
             break;
@@ -773,12 +819,22 @@ static void vmxnet3_process_tx_queue(VMXNET3State *s, int qidx)
                                                 VMXNET3_PKT_STATUS_ERROR);
             }
 
-            vmxnet3_complete_packet(s, qidx, txd_idx);
+            vmxnet3_complete_packet(s, qidx, txd_idx, &batch);
+            completed = true;
             s->tx_sop = true;
             s->skip_current_tx_pkt = false;
             net_tx_pkt_reset(s->tx_pkt);
         }
     }
+
+    if (completed) {
+        vmxnet3_flush_tx_completions(s, &batch);
+
+        /* Flush TX completion descriptors before raising the interrupt */
+        smp_wmb();
+
+        vmxnet3_trigger_interrupt(s, s->txq_descr[qidx].intr_idx);
+    }
 }
 
 static inline void
@@ -826,23 +882,22 @@ vmxnet3_revert_rxc_descr(VMXNET3State *s, int qidx)
     vmxnet3_dec_rx_completion_counter(s, qidx);
 }
 
-#define RXQ_IDX      (0)
 #define RX_HEAD_BODY_RING (0)
 #define RX_BODY_ONLY_RING (1)
 
 static bool
-vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_head_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *descr_buf,
                                uint32_t *descr_idx,
                                uint32_t *ridx)
 {
     for (;;) {
         uint32_t ring_gen;
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* If no more free descriptors - return */
-        ring_gen = vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        ring_gen = vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING);
         if (descr_buf->gen != ring_gen) {
             return false;
         }
@@ -850,11 +905,11 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* Mark current descriptor as used/skipped */
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
 
         /* If this is what we are looking for - return */
         if (descr_buf->btype == VMXNET3_RXD_BTYPE_HEAD) {
@@ -865,21 +920,21 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
 }
 
 static bool
-vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_body_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *d,
                                uint32_t *didx,
                                uint32_t *ridx)
 {
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
 
     /* Try to find corresponding descriptor in head/body ring */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
         if (d->btype == VMXNET3_RXD_BTYPE_BODY) {
-            vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+            vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
             *ridx = RX_HEAD_BODY_RING;
             return true;
         }
@@ -889,17 +944,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
      * If there is no free descriptors on head/body ring or next free
      * descriptor is a head descriptor switch to body only ring
      */
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
 
     /* If no more free descriptors - return */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_BODY_ONLY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_BODY_ONLY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
         assert(d->btype == VMXNET3_RXD_BTYPE_BODY);
         *ridx = RX_BODY_ONLY_RING;
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_BODY_ONLY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_BODY_ONLY_RING);
         return true;
     }
 
@@ -907,15 +962,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
 }
 
 static inline bool
-vmxnet3_get_next_rx_descr(VMXNET3State *s, bool is_head,
+vmxnet3_get_next_rx_descr(VMXNET3State *s, int qidx, bool is_head,
                           struct Vmxnet3_RxDesc *descr_buf,
                           uint32_t *descr_idx,
                           uint32_t *ridx)
 {
     if (is_head || !s->rx_packets_compound) {
-        return vmxnet3_get_next_head_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_head_rx_descr(s, qidx, descr_buf, descr_idx,
+                                              ridx);
     } else {
-        return vmxnet3_get_next_body_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_body_rx_descr(s, qidx, descr_buf, descr_idx,
+                                              ridx);
     }
 }
 
@@ -1059,7 +1116,8 @@ vmxnet3_pci_dma_writev(PCIDevice *pci_dev,
 }
 
 static bool
-vmxnet3_indicate_packet(VMXNET3State *s)
+vmxnet3_indicate_packet(VMXNET3State *s, int qidx, uint8_t rss_type,
+                        uint32_t rss_hash)
 {
     struct Vmxnet3_RxDesc rxd;
     PCIDevice *d = PCI_DEVICE(s);
@@ -1086,12 +1144,13 @@ vmxnet3_indicate_packet(VMXNET3State *s)
             break;
         }
 
-        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, RXQ_IDX, &new_rxcd_gen);
+        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, qidx, &new_rxcd_gen);
         if (!new_rxcd_pa) {
             break;
         }
 
-        if (!vmxnet3_get_next_rx_descr(s, is_head, &rxd, &rxd_idx, &rx_ridx)) {
+        if (!vmxnet3_get_next_rx_descr(s, qidx, is_head, &rxd, &rxd_idx,
+                                       &rx_ridx)) {
             break;
         }
 
@@ -1112,7 +1171,9 @@ vmxnet3_indicate_packet(VMXNET3State *s)
         rxcd.len = chunk_size;
         rxcd.sop = is_head;
         rxcd.gen = new_rxcd_gen;
-        rxcd.rqID = RXQ_IDX + rx_ridx * s->rxq_num;
+        rxcd.rqID = qidx + rx_ridx * s->rxq_num;
+        rxcd.rssType = rss_type;
+        rxcd.rssHash = cpu_to_le32(rss_hash);
 
         if (bytes_left == 0) {
             vmxnet3_rx_update_descr(s->rx_pkt, &rxcd);
@@ -1143,19 +1204,19 @@ vmxnet3_indicate_packet(VMXNET3State *s)
     }
 
     if (new_rxcd_pa != 0) {
-        vmxnet3_revert_rxc_descr(s, RXQ_IDX);
+        vmxnet3_revert_rxc_descr(s, qidx);
     }
 
-    vmxnet3_trigger_interrupt(s, s->rxq_descr[RXQ_IDX].intr_idx);
+    vmxnet3_trigger_interrupt(s, s->rxq_descr[qidx].intr_idx);
 
     if (bytes_left == 0) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_OK);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_OK);
         return true;
     } else if (num_frags == s->max_rx_frags) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_ERROR);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_ERROR);
         return false;
     } else {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX,
+        vmxnet3_on_rx_done_update_stats(s, qidx,
                                         VMXNET3_PKT_STATUS_OUT_OF_BUF);
         return false;
     }
@@ -1404,6 +1465,7 @@ static void vmxnet3_update_features(VMXNET3State *s)
     uint32_t guest_features;
     int rxcso_supported;
     PCIDevice *d = PCI_DEVICE(s);
+    int i;
 
     guest_features = VMXNET3_READ_DRV_SHARED32(d, s->drv_shmem,
                                                devRead.misc.uptFeatures);
@@ -1416,13 +1478,80 @@ static void vmxnet3_update_features(VMXNET3State *s)
               s->lro_supported, rxcso_supported,
               s->rx_vlan_stripping);
     if (s->peer_has_vhdr) {
-        qemu_set_offload(qemu_get_queue(s->nic)->peer,
-                         rxcso_supported,
-                         s->lro_supported,
-                         s->lro_supported,
-                         0,
-                         0);
+        for (i = 0; i < MAX(s->conf.peers.queues, 1); i++) {
+            qemu_set_offload(qemu_get_subqueue(s->nic, i)->peer,
+                             rxcso_supported,
+                             s->lro_supported,
+                             s->lro_supported,
+                             0,
+                             0);
+        }
+    }
+}
+
+static void vmxnet3_update_rss(VMXNET3State *s)
+{
+    struct Vmxnet3_VariableLenConfDesc rss_descr;
+    struct UPT1_RSSConf rss_conf;
+    uint32_t guest_features;
+    uint16_t key_size;
+    PCIDevice *d = PCI_DEVICE(s);
+    int i;
+
+    s->rss_enabled = false;
+
+    guest_features = VMXNET3_READ_DRV_SHARED32(d, s->drv_shmem,
+                                               devRead.misc.uptFeatures);
+    if (!VMXNET_FLAG_IS_SET(guest_features, UPT1_F_RSS) || s->rxq_num < 2) {
+        VMW_CFPRN("RSS is disabled");
+        return;
+    }
+
+    rss_descr.confLen =
+        VMXNET3_READ_DRV_SHARED32(d, s->drv_shmem, devRead.rssConfDesc.confLen);
+    rss_descr.confVer =
+        VMXNET3_READ_DRV_SHARED32(d, s->drv_shmem, devRead.rssConfDesc.confVer);
+    rss_descr.confPA =
+        VMXNET3_READ_DRV_SHARED64(d, s->drv_shmem, devRead.rssConfDesc.confPA);
+
+    vmxnet3_dump_conf_descr("RSS", &rss_descr);
+
+    if (rss_descr.confLen < sizeof(rss_conf)) {
+        VMW_WRPRN("RSS configuration is too short: %u", rss_descr.confLen);
+        return;
+    }
+
+    pci_dma_read(d, rss_descr.confPA, &rss_conf, sizeof(rss_conf));
+
+    key_size = le16_to_cpu(rss_conf.hashKeySize);
+    s->rss_hash_type = le16_to_cpu(rss_conf.hashType);
+    s->rss_ind_table_size = le16_to_cpu(rss_conf.indTableSize);
+
+    if (le16_to_cpu(rss_conf.hashFunc) != UPT1_RSS_HASH_FUNC_TOEPLITZ ||
+        key_size > UPT1_RSS_MAX_KEY_SIZE || !s->rss_ind_table_size ||
+        s->rss_ind_table_size > UPT1_RSS_MAX_IND_TABLE_SIZE) {
+        VMW_WRPRN("Unsupported RSS configuration: function %u, key size %u, "
+                  "table size %u", le16_to_cpu(rss_conf.hashFunc), key_size,
+                  s->rss_ind_table_size);
+        return;
     }
+
+    for (i = 0; i < s->rss_ind_table_size; i++) {
+        if (rss_conf.indTable[i] >= s->rxq_num) {
+            VMW_WRPRN("Bad RSS indirection table entry %d: %u",
+                      i, rss_conf.indTable[i]);
+            return;
+        }
+    }
+
+    /* The Toeplitz hash always consumes a full size key */
+    memset(s->rss_key, 0, sizeof(s->rss_key));
+    memcpy(s->rss_key, rss_conf.hashKey, key_size);
+    memcpy(s->rss_ind_table, rss_conf.indTable, s->rss_ind_table_size);
+    s->rss_enabled = true;
+
+    VMW_CFPRN("RSS configuration: hash types 0x%x, table size %u",
+              s->rss_hash_type, s->rss_ind_table_size);
 }
 
 static bool vmxnet3_verify_intx(VMXNET3State *s, int intx)
@@ -1627,6 +1756,7 @@ static void vmxnet3_activate_device(VMXNET3State *s)
     }
 
     vmxnet3_validate_interrupts(s);
+    vmxnet3_update_rss(s);
 
     /* Make sure everything is in place before device activation */
     smp_wmb();
@@ -1677,6 +1807,9 @@ static void vmxnet3_handle_command(VMXNET3State *s, uint64_t cmd)
     case VMXNET3_CMD_UPDATE_FEATURE:
         VMW_CBPRN("Set: Update features");
         vmxnet3_update_features(s);
+        if (s->device_active) {
+            vmxnet3_update_rss(s);
+        }
         break;
 
     case VMXNET3_CMD_UPDATE_PMCFG:
@@ -1684,6 +1817,13 @@ static void vmxnet3_handle_command(VMXNET3State *s, uint64_t cmd)
         vmxnet3_update_pm_state(s);
         break;
 
+    case VMXNET3_CMD_UPDATE_RSSIDT:
+        VMW_CBPRN("Set: Update RSS indirection table");
+        if (s->device_active) {
+            vmxnet3_update_rss(s);
+        }
+        break;
+
     case VMXNET3_CMD_GET_LINK:
         VMW_CBPRN("Set: Get link");
         break;
@@ -2029,12 +2169,56 @@ vmxnet3_rx_filter_may_indicate(VMXNET3State *s, const void *data,
     return true;
 }
 
+/*
+ * Select the RX queue of the packet with the guest RSS configuration.
+ * Packets that are not hashed go to the first queue.
+ */
+static int
+vmxnet3_rx_select_queue(VMXNET3State *s, uint8_t *rss_type, uint32_t *rss_hash)
+{
+    bool isip4, isip6, isudp, istcp;
+    NetRxPktRssType type;
+
+    *rss_type = VMXNET3_RCD_RSS_TYPE_NONE;
+    *rss_hash = 0;
+
+    if (!s->rss_enabled) {
+        return 0;
+    }
+
+    net_rx_pkt_get_protocols(s->rx_pkt, &isip4, &isip6, &isudp, &istcp);
+
+    if (isip4 && istcp &&
+        (s->rss_hash_type & UPT1_RSS_HASH_TYPE_TCP_IPV4)) {
+        type = NetPktRssIpV4Tcp;
+        *rss_type = VMXNET3_RCD_RSS_TYPE_TCPIPV4;
+    } else if (isip4 && (s->rss_hash_type & UPT1_RSS_HASH_TYPE_IPV4)) {
+        type = NetPktRssIpV4;
+        *rss_type = VMXNET3_RCD_RSS_TYPE_IPV4;
+    } else if (isip6 && istcp &&
+               (s->rss_hash_type & UPT1_RSS_HASH_TYPE_TCP_IPV6)) {
+        type = NetPktRssIpV6Tcp;
+        *rss_type = VMXNET3_RCD_RSS_TYPE_TCPIPV6;
+    } else if (isip6 && (s->rss_hash_type & UPT1_RSS_HASH_TYPE_IPV6)) {
+        type = NetPktRssIpV6;
+        *rss_type = VMXNET3_RCD_RSS_TYPE_IPV6;
+    } else {
+        return 0;
+    }
+
+    *rss_hash = net_rx_pkt_calc_rss_hash(s->rx_pkt, type, s->rss_key);
+    return s->rss_ind_table[*rss_hash % s->rss_ind_table_size];
+}
+
 static ssize_t
 vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VMXNET3State *s = qemu_get_nic_opaque(nc);
     size_t bytes_indicated;
     uint8_t min_buf[MIN_BUF_SIZE];
+    uint8_t rss_type;
+    uint32_t rss_hash;
+    int qidx;
 
     if (!vmxnet3_can_receive(nc)) {
         VMW_PKPRN("Cannot receive now");
@@ -2062,7 +2246,9 @@ vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         net_rx_pkt_set_protocols(s->rx_pkt, buf, size);
         vmxnet3_rx_need_csum_calculate(s->rx_pkt, buf, size);
         net_rx_pkt_attach_data(s->rx_pkt, buf, size, s->rx_vlan_stripping);
-        bytes_indicated = vmxnet3_indicate_packet(s) ? size : -1;
+        qidx = vmxnet3_rx_select_queue(s, &rss_type, &rss_hash);
+        bytes_indicated =
+            vmxnet3_indicate_packet(s, qidx, rss_type, rss_hash) ? size : -1;
         if (bytes_indicated < size) {
             VMW_PKPRN("RX: %zu of %zu bytes indicated", bytes_indicated, size);
         }
@@ -2118,6 +2304,7 @@ static void vmxnet3_net_uninit(VMXNET3State *s)
 static void vmxnet3_net_init(VMXNET3State *s)
 {
     DeviceState *d = DEVICE(s);
+    int i;
 
     VMW_CBPRN("vmxnet3_net_init called...");
 
@@ -2146,10 +2333,12 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->lro_supported = false;
 
     if (s->peer_has_vhdr) {
-        qemu_set_vnet_hdr_len(qemu_get_queue(s->nic)->peer,
-            sizeof(struct virtio_net_hdr));
+        for (i = 0; i < MAX(s->conf.peers.queues, 1); i++) {
+            NetClientState *peer = qemu_get_subqueue(s->nic, i)->peer;
 
-        qemu_using_vnet_hdr(qemu_get_queue(s->nic)->peer, 1);
+            qemu_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+            qemu_using_vnet_hdr(peer, 1);
+        }
     }
 
     qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
@@ -2565,6 +2754,10 @@ static int vmxnet3_post_load(void *opaque, int version_id)
     vmxnet3_validate_queues(s);
     vmxnet3_validate_interrupts(s);
 
+    if (s->device_active) {
+        vmxnet3_update_rss(s);
+    }
+
     return 0;
 }
 
@@ -12,6 +12,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "hw/virtio/virtio-scsi.h"
 #include "qemu/error-report.h"
 #include "sysemu/block-backend.h"
@@ -20,12 +21,134 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
+static VirtIOSCSIMailbox *virtio_scsi_vq_mailbox(VirtIOSCSI *s,
+                                                 VirtQueue *vq)
+{
+    int n = virtio_get_queue_index(vq);
+
+    /* The control and event queues stay in s->ctx */
+    return &s->mailboxes[n < 2 ? 0 : (n - 2) % s->num_mailboxes];
+}
+
+static VirtIOSCSIMailbox *virtio_scsi_target_mailbox(VirtIOSCSI *s,
+                                                     int target)
+{
+    return &s->mailboxes[target % s->num_mailboxes];
+}
+
+/* All LUNs of a target share an AioContext, so that TMFs addressed to the
+ * I_T nexus only touch requests of a single IOThread.
+ */
+AioContext *virtio_scsi_target_ctx(VirtIOSCSI *s, int target)
+{
+    return virtio_scsi_target_mailbox(s, target)->ctx;
+}
+
+/* Context: @mb->ctx held */
+static bool virtio_scsi_mailbox_run(VirtIOSCSIMailbox *mb)
+{
+    VirtIOSCSIReq *req;
+    bool progress = false;
+
+    VirtIOSCSIReqList reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+
+    qemu_mutex_lock(&mb->lock);
+    while ((req = QTAILQ_FIRST(&mb->submit))) {
+        QTAILQ_REMOVE(&mb->submit, req, next);
+        QTAILQ_INSERT_TAIL(&reqs, req, next);
+    }
+    qemu_mutex_unlock(&mb->lock);
+
+    if (!QTAILQ_EMPTY(&reqs)) {
+        virtio_scsi_handle_forwarded_reqs(mb->s, &reqs);
+        progress = true;
+    }
+
+    for (;;) {
+        qemu_mutex_lock(&mb->lock);
+        req = QTAILQ_FIRST(&mb->complete);
+        if (req) {
+            QTAILQ_REMOVE(&mb->complete, req, next);
+        }
+        qemu_mutex_unlock(&mb->lock);
+        if (!req) {
+            break;
+        }
+        virtio_scsi_push_req(req);
+        virtio_scsi_free_req(req);
+        progress = true;
+    }
+    return progress;
+}
+
+static void virtio_scsi_mailbox_bh(void *opaque)
+{
+    virtio_scsi_mailbox_run(opaque);
+}
+
+/* Context: the AioContext of @req's virtqueue
+ *
+ * Returns true if @req was handed to the IOThread that owns its target;
+ * the request is then completed back through the virtqueue's mailbox.
+ */
+bool virtio_scsi_dataplane_forward(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                   uint8_t *lun)
+{
+    VirtIOSCSIMailbox *mb;
+
+    if (s->num_mailboxes < 2 || !s->dataplane_started ||
+        s->dataplane_fenced) {
+        return false;
+    }
+    mb = virtio_scsi_target_mailbox(s, lun[1]);
+    if (mb == virtio_scsi_vq_mailbox(s, req->vq)) {
+        return false;
+    }
+
+    req->remote = true;
+    qemu_mutex_lock(&mb->lock);
+    QTAILQ_INSERT_TAIL(&mb->submit, req, next);
+    qemu_mutex_unlock(&mb->lock);
+    qemu_bh_schedule(mb->bh);
+    return true;
+}
+
+/* Context: the AioContext of @req's target */
+void virtio_scsi_dataplane_return_req(VirtIOSCSIReq *req)
+{
+    VirtIOSCSIMailbox *mb = virtio_scsi_vq_mailbox(req->dev, req->vq);
+
+    qemu_mutex_lock(&mb->lock);
+    QTAILQ_INSERT_TAIL(&mb->complete, req, next);
+    qemu_mutex_unlock(&mb->lock);
+    qemu_bh_schedule(mb->bh);
+}
+
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    char **ids = NULL;
+    int i, n = 0;
+
+    /* Additional IOThreads for command queues and targets, "id1:id2:..." */
+    if (vs->conf.iothreads) {
+        ids = g_strsplit(vs->conf.iothreads, ":", 0);
+        n = g_strv_length(ids);
+    }
+    for (i = 0; i < n; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "iothreads: '%s' is not an iothread", ids[i]);
+            g_strfreev(ids);
+            return;
+        }
+    }
 
     assert(!s->ctx);
     s->ctx = iothread_get_aio_context(vs->conf.iothread);
@@ -36,6 +159,47 @@ void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
                    "(transport does not support notifiers)");
         exit(1);
     }
+
+    s->num_mailboxes = n + 1;
+    s->mailboxes = g_new0(VirtIOSCSIMailbox, s->num_mailboxes);
+    for (i = 0; i < s->num_mailboxes; i++) {
+        VirtIOSCSIMailbox *mb = &s->mailboxes[i];
+
+        if (i == 0) {
+            mb->iothread = iothread;
+        } else {
+            mb->iothread = IOTHREAD(object_resolve_path_component(
+                                        object_get_objects_root(), ids[i - 1]));
+            object_ref(OBJECT(mb->iothread));
+        }
+        mb->s = s;
+        mb->ctx = iothread_get_aio_context(mb->iothread);
+        mb->bh = aio_bh_new(mb->ctx, virtio_scsi_mailbox_bh, mb);
+        qemu_mutex_init(&mb->lock);
+        QTAILQ_INIT(&mb->submit);
+        QTAILQ_INIT(&mb->complete);
+    }
+    g_strfreev(ids);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_clear_iothread(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_mailboxes; i++) {
+        VirtIOSCSIMailbox *mb = &s->mailboxes[i];
+
+        assert(QTAILQ_EMPTY(&mb->submit) && QTAILQ_EMPTY(&mb->complete));
+        qemu_bh_delete(mb->bh);
+        qemu_mutex_destroy(&mb->lock);
+        if (i > 0) {
+            object_unref(OBJECT(mb->iothread));
+        }
+    }
+    g_free(s->mailboxes);
+    s->mailboxes = NULL;
+    s->num_mailboxes = 0;
 }
 
 static void virtio_scsi_data_plane_handle_cmd(VirtIODevice *vdev,
@@ -69,6 +233,7 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n,
                                   void (*fn)(VirtIODevice *vdev, VirtQueue *vq))
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    AioContext *ctx = virtio_scsi_vq_mailbox(s, vq)->ctx;
     int rc;
 
     /* Set up virtqueue notify */
@@ -80,7 +245,7 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n,
         return rc;
     }
 
-    virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, fn);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, fn);
     return 0;
 }
 
@@ -91,19 +256,61 @@ void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req)
     }
 }
 
-/* assumes s->ctx held */
+static void virtio_scsi_clear_vq_aio(VirtIOSCSI *s, VirtQueue *vq)
+{
+    AioContext *ctx = virtio_scsi_vq_mailbox(s, vq)->ctx;
+
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+    aio_context_release(ctx);
+}
+
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
-    virtio_queue_aio_set_host_notifier_handler(vs->ctrl_vq, s->ctx, NULL);
-    virtio_queue_aio_set_host_notifier_handler(vs->event_vq, s->ctx, NULL);
+    virtio_scsi_clear_vq_aio(s, vs->ctrl_vq);
+    virtio_scsi_clear_vq_aio(s, vs->event_vq);
     for (i = 0; i < vs->conf.num_queues; i++) {
-        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i], s->ctx, NULL);
+        virtio_scsi_clear_vq_aio(s, vs->cmd_vqs[i]);
+    }
+}
+
+static void virtio_scsi_acquire_mailboxes(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_mailboxes; i++) {
+        aio_context_acquire(s->mailboxes[i].ctx);
+    }
+}
+
+static void virtio_scsi_release_mailboxes(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_mailboxes; i++) {
+        aio_context_release(s->mailboxes[i].ctx);
     }
 }
 
+/* Context: QEMU global mutex held */
+static bool virtio_scsi_flush_mailboxes(VirtIOSCSI *s)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i < s->num_mailboxes; i++) {
+        VirtIOSCSIMailbox *mb = &s->mailboxes[i];
+
+        aio_context_acquire(mb->ctx);
+        progress |= virtio_scsi_mailbox_run(mb);
+        aio_context_release(mb->ctx);
+    }
+    return progress;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_scsi_dataplane_start(VirtIOSCSI *s)
 {
@@ -130,7 +337,7 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
         goto fail_guest_notifiers;
     }
 
-    aio_context_acquire(s->ctx);
+    virtio_scsi_acquire_mailboxes(s);
     rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0,
                                 virtio_scsi_data_plane_handle_ctrl);
     if (rc) {
@@ -151,12 +358,12 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
 
     s->dataplane_starting = false;
     s->dataplane_started = true;
-    aio_context_release(s->ctx);
+    virtio_scsi_release_mailboxes(s);
     return;
 
 fail_vrings:
     virtio_scsi_clear_aio(s);
-    aio_context_release(s->ctx);
+    virtio_scsi_release_mailboxes(s);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
     }
@@ -188,13 +395,14 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     s->dataplane_stopping = true;
     assert(s->ctx == iothread_get_aio_context(vs->conf.iothread));
 
-    aio_context_acquire(s->ctx);
-
     virtio_scsi_clear_aio(s);
 
-    blk_drain_all(); /* ensure there are no in-flight requests */
-
-    aio_context_release(s->ctx);
+    /* ensure there are no in-flight requests, including those that are
+     * still waiting to be submitted or returned by another IOThread
+     */
+    do {
+        blk_drain_all();
+    } while (virtio_scsi_flush_mailboxes(s));
 
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
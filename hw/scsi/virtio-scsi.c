@@ -60,25 +60,39 @@ void virtio_scsi_free_req(VirtIOSCSIReq *req)
     g_free(req);
 }
 
-static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+/* Context: the AioContext of @req's virtqueue */
+void virtio_scsi_push_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
-    qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
     virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
     if (s->dataplane_started && !s->dataplane_fenced) {
         virtio_scsi_dataplane_notify(vdev, req);
     } else {
         virtio_notify(vdev, vq);
     }
+}
+
+static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+{
+    qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
+    if (!req->remote) {
+        virtio_scsi_push_req(req);
+    }
 
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
+        req->sreq = NULL;
+    }
+    if (req->remote) {
+        /* The virtqueue belongs to another IOThread */
+        virtio_scsi_dataplane_return_req(req);
+    } else {
+        virtio_scsi_free_req(req);
     }
-    virtio_scsi_free_req(req);
 }
 
 static void virtio_scsi_bad_req(VirtIOSCSIReq *req)
@@ -190,7 +204,7 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < vs->conf.num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_virtqueue_element(f, &req->elem);
+    qemu_put_virtqueue_element(VIRTIO_DEVICE(req->dev), f, &req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -203,7 +217,8 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
-    req = qemu_get_virtqueue_element(f, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    req = qemu_get_virtqueue_element(VIRTIO_DEVICE(s), f,
+                                     sizeof(VirtIOSCSIReq) + vs->cdb_size);
     virtio_scsi_init_req(s, vs->cmd_vqs[n], req);
 
     if (virtio_scsi_parse_req(req, sizeof(VirtIOSCSICmdReq) + vs->cdb_size,
@@ -240,7 +255,8 @@ static void virtio_scsi_cancel_notify(Notifier *notifier, void *data)
 static inline void virtio_scsi_ctx_check(VirtIOSCSI *s, SCSIDevice *d)
 {
     if (s->dataplane_started && d && blk_is_available(d->conf.blk)) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+        assert(blk_get_aio_context(d->conf.blk) ==
+               virtio_scsi_target_ctx(s, d->id));
     }
 }
 
@@ -398,6 +414,8 @@ static void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
                     sizeof(VirtIOSCSICtrlTMFResp)) < 0) {
             virtio_scsi_bad_req(req);
             return;
+        } else if (virtio_scsi_dataplane_forward(s, req, req->req.tmf.lun)) {
+            return;
         } else {
             r = virtio_scsi_do_tmf(s, req);
         }
@@ -524,23 +542,10 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_cmd_req(req);
 }
 
-static int virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
+/* Context: the AioContext of the request's target */
+static int virtio_scsi_handle_cmd_req_lookup(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
-    VirtIOSCSICommon *vs = &s->parent_obj;
     SCSIDevice *d;
-    int rc;
-
-    rc = virtio_scsi_parse_req(req, sizeof(VirtIOSCSICmdReq) + vs->cdb_size,
-                               sizeof(VirtIOSCSICmdResp) + vs->sense_size);
-    if (rc < 0) {
-        if (rc == -ENOTSUP) {
-            virtio_scsi_fail_cmd_req(req);
-            return -ENOTSUP;
-        } else {
-            virtio_scsi_bad_req(req);
-            return -EINVAL;
-        }
-    }
 
     d = virtio_scsi_device_find(s, req->req.cmd.lun);
     if (!d) {
@@ -565,6 +570,29 @@ static int virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
     return 0;
 }
 
+static int virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    VirtIOSCSICommon *vs = &s->parent_obj;
+    int rc;
+
+    rc = virtio_scsi_parse_req(req, sizeof(VirtIOSCSICmdReq) + vs->cdb_size,
+                               sizeof(VirtIOSCSICmdResp) + vs->sense_size);
+    if (rc < 0) {
+        if (rc == -ENOTSUP) {
+            virtio_scsi_fail_cmd_req(req);
+            return -ENOTSUP;
+        } else {
+            virtio_scsi_bad_req(req);
+            return -EINVAL;
+        }
+    }
+
+    if (virtio_scsi_dataplane_forward(s, req, req->req.cmd.lun)) {
+        return -EINPROGRESS;
+    }
+    return virtio_scsi_handle_cmd_req_lookup(s, req);
+}
+
 static void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     SCSIRequest *sreq = req->sreq;
@@ -604,6 +632,34 @@ void virtio_scsi_handle_cmd_vq(VirtIOSCSI *s, VirtQueue *vq)
     }
 }
 
+/* Context: the AioContext of the requests' target
+ *
+ * Runs control and command requests that another IOThread's virtqueue
+ * forwarded here with virtio_scsi_dataplane_forward.
+ */
+void virtio_scsi_handle_forwarded_reqs(VirtIOSCSI *s, VirtIOSCSIReqList *reqs)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    VirtIOSCSIReq *req, *next;
+
+    VirtIOSCSIReqList ready = QTAILQ_HEAD_INITIALIZER(ready);
+
+    while ((req = QTAILQ_FIRST(reqs))) {
+        QTAILQ_REMOVE(reqs, req, next);
+        if (req->vq == vs->ctrl_vq) {
+            if (virtio_scsi_do_tmf(s, req) == 0) {
+                virtio_scsi_complete_req(req);
+            }
+        } else if (virtio_scsi_handle_cmd_req_lookup(s, req) == 0) {
+            QTAILQ_INSERT_TAIL(&ready, req, next);
+        }
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &ready, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
+    }
+}
+
 static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     /* use non-QOM casts in the data path */
@@ -775,14 +831,16 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
     VirtIODevice *vdev = VIRTIO_DEVICE(hotplug_dev);
     VirtIOSCSI *s = VIRTIO_SCSI(vdev);
     SCSIDevice *sd = SCSI_DEVICE(dev);
+    AioContext *ctx;
 
     if (s->ctx && !s->dataplane_fenced) {
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
-        aio_context_acquire(s->ctx);
-        blk_set_aio_context(sd->conf.blk, s->ctx);
-        aio_context_release(s->ctx);
+        ctx = virtio_scsi_target_ctx(s, sd->id);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(sd->conf.blk, ctx);
+        aio_context_release(ctx);
 
     }
 
@@ -844,6 +902,11 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
         virtio_cleanup(vdev);
         return;
     }
+    if (s->conf.iothreads && !s->conf.iothread) {
+        error_setg(errp, "iothreads requires the iothread property");
+        virtio_cleanup(vdev);
+        return;
+    }
     s->cmd_vqs = g_new0(VirtQueue *, s->conf.num_queues);
     s->sense_size = VIRTIO_SCSI_SENSE_DEFAULT_SIZE;
     s->cdb_size = VIRTIO_SCSI_CDB_DEFAULT_SIZE;
@@ -855,7 +918,14 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
     }
 
     if (s->conf.iothread) {
-        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread);
+        Error *err = NULL;
+
+        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread, &err);
+        if (err) {
+            error_propagate(errp, err);
+            g_free(s->cmd_vqs);
+            virtio_cleanup(vdev);
+        }
     }
 }
 
@@ -908,6 +978,7 @@ void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp)
 
 static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
 {
+    virtio_scsi_clear_iothread(VIRTIO_SCSI(dev));
     virtio_scsi_common_unrealize(dev, errp);
 }
 
@@ -917,6 +988,7 @@ static Property virtio_scsi_properties[] = {
                                                   0xFFFF),
     DEFINE_PROP_UINT32("cmd_per_lun", VirtIOSCSI, parent_obj.conf.cmd_per_lun,
                                                   128),
+    DEFINE_PROP_STRING("iothreads", VirtIOSCSI, parent_obj.conf.iothreads),
     DEFINE_PROP_BIT("hotplug", VirtIOSCSI, host_features,
                                            VIRTIO_SCSI_F_HOTPLUG, true),
     DEFINE_PROP_BIT("param_change", VirtIOSCSI, host_features,
@@ -30,8 +30,10 @@
 #include "exec/address-spaces.h"
 #include "exec/memory.h"
 #include "hw/hw.h"
+#include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/range.h"
+#include "qemu/timer.h"
 #include "sysemu/kvm.h"
 #include "trace.h"
 
@@ -242,6 +244,29 @@ static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
     return -errno;
 }
 
+/*
+ * Pinning faults in the pages that the guest has not touched yet one at a
+ * time, under the container lock.  For large guests that takes minutes, so
+ * fault them in from several threads first; the kernel then only has to
+ * take references to resident pages.
+ */
+#define VFIO_POPULATE_MIN_SIZE (1ULL << 30)
+
+static void vfio_dma_populate(MemoryRegion *mr, void *vaddr, ram_addr_t size)
+{
+    Error *local_err = NULL;
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    os_mem_populate(memory_region_get_fd(mr), vaddr, size, 0, &local_err);
+    if (local_err) {
+        /* Let VFIO_IOMMU_MAP_DMA report the failure */
+        error_free(local_err);
+        return;
+    }
+    trace_vfio_dma_populate(vaddr, size,
+                            qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start);
+}
+
 static void vfio_host_win_add(VFIOContainer *container,
                               hwaddr min_iova, hwaddr max_iova,
                               uint64_t iova_pgsizes)
@@ -472,6 +497,11 @@ static void vfio_listener_region_add(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
+    if (int128_get64(llsize) >= VFIO_POPULATE_MIN_SIZE && !section->readonly &&
+        qemu_ram_is_allocated(section->mr->ram_block)) {
+        vfio_dma_populate(section->mr, vaddr, int128_get64(llsize));
+    }
+
     ret = vfio_dma_map(container, iova, int128_get64(llsize),
                        vaddr, section->readonly);
     if (ret) {
@@ -23,6 +23,7 @@
 #include "hw/virtio/virtio-balloon.h"
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
+#include "migration/migration.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "trace.h"
@@ -299,16 +300,194 @@ out:
     }
 }
 
+/*
+ * Free page reporting: the guest queues batches of free pages, which
+ * are discarded on the host right away.  Unlike inflating the balloon
+ * this does not change the memory size seen by the guest; a page that
+ * is touched again is simply faulted back in.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+    RAMBlock *rb;
+    ram_addr_t offset;
+    unsigned int i;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if (qemu_balloon_is_inhibited() ||
+            (kvm_enabled() && !kvm_has_sync_mmu())) {
+            goto skip;
+        }
+
+        for (i = 0; i < elem->in_num; i++) {
+            void *addr = elem->in_sg[i].iov_base;
+            size_t len = elem->in_sg[i].iov_len;
+
+            rb = qemu_ram_block_from_host(addr, false, &offset);
+            if (!rb || offset + len > rb->used_length) {
+                continue;
+            }
+            trace_virtio_balloon_handle_report(qemu_ram_get_idstr(rb),
+                                               offset, len);
+            ram_block_discard_range(rb, offset, len);
+        }
+
+skip:
+        /* The pages are not written, only discarded */
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+    }
+    virtio_notify(vdev, vq);
+}
+
+/*
+ * Free page hinting: while the migration thread is between two dirty
+ * bitmap syncs, the guest is asked to report pages that are free, and
+ * those are dropped from the set of pages still to be sent.  A report
+ * is started with a new command id in the config space; the guest
+ * echoes the id on the free page queue, then queues the free pages, and
+ * stops when the id changes to VIRTIO_BALLOON_CMD_ID_STOP.
+ */
+static bool virtio_balloon_free_page_support(VirtIOBalloon *s)
+{
+    return virtio_vdev_has_feature(VIRTIO_DEVICE(s),
+                                   VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    uint32_t id;
+    unsigned int i;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if (elem->out_num) {
+            if (iov_to_buf(elem->out_sg, elem->out_num, 0, &id,
+                           sizeof(id)) != sizeof(id)) {
+                virtqueue_detach_element(vq, elem, 0);
+                g_free(elem);
+                virtio_error(vdev, "virtio-balloon: bad free page report id");
+                return;
+            }
+            virtio_tswap32s(vdev, &id);
+            if (s->free_page_report_status == FREE_PAGE_REPORT_S_REQUESTED &&
+                id == s->free_page_report_cmd_id) {
+                s->free_page_report_status = FREE_PAGE_REPORT_S_START;
+            } else if (s->free_page_report_status ==
+                       FREE_PAGE_REPORT_S_START) {
+                /* the guest has finished this report */
+                s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+            }
+        }
+
+        if (s->free_page_report_status == FREE_PAGE_REPORT_S_START) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
+        }
+
+        /* Nothing was written, so the pages are not marked dirty */
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+    }
+    virtio_notify(vdev, vq);
+}
+
+static void virtio_balloon_free_page_start(VirtIOBalloon *s)
+{
+    if (s->free_page_report_cmd_id == UINT32_MAX) {
+        s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE + 1;
+    } else {
+        s->free_page_report_cmd_id++;
+    }
+    s->free_page_report_status = FREE_PAGE_REPORT_S_REQUESTED;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_stop(VirtIOBalloon *s)
+{
+    if (s->free_page_report_status != FREE_PAGE_REPORT_S_STOP) {
+        s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+        virtio_notify_config(VIRTIO_DEVICE(s));
+    }
+}
+
+static void virtio_balloon_free_page_done(VirtIOBalloon *s)
+{
+    s->free_page_report_status = FREE_PAGE_REPORT_S_DONE;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_report_notify(Notifier *notifier,
+                                                   void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    free_page_report_notify);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    PrecopyNotifyReason *reason = data;
+
+    if (!virtio_balloon_free_page_support(s) ||
+        !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+
+    switch (*reason) {
+    case PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC:
+        /* Hints arriving after the sync could hide pages it found dirty */
+        virtio_balloon_free_page_stop(s);
+        break;
+    case PRECOPY_NOTIFY_AFTER_BITMAP_SYNC:
+        if (vdev->vm_running) {
+            virtio_balloon_free_page_start(s);
+        } else {
+            virtio_balloon_free_page_done(s);
+        }
+        break;
+    case PRECOPY_NOTIFY_CLEANUP:
+        virtio_balloon_free_page_done(s);
+        break;
+    default:
+        break;
+    }
+}
+
+static size_t virtio_balloon_config_size(VirtIOBalloon *s)
+{
+    if (s->host_features & (1ULL << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        return offsetof(struct virtio_balloon_config, poison_val);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_report_cmd_id);
+}
+
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
-    struct virtio_balloon_config config;
+    struct virtio_balloon_config config = {};
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
 
+    switch (dev->free_page_report_status) {
+    case FREE_PAGE_REPORT_S_REQUESTED:
+    case FREE_PAGE_REPORT_S_START:
+        config.free_page_report_cmd_id =
+            cpu_to_le32(dev->free_page_report_cmd_id);
+        break;
+    case FREE_PAGE_REPORT_S_STOP:
+        config.free_page_report_cmd_id =
+            cpu_to_le32(VIRTIO_BALLOON_CMD_ID_STOP);
+        break;
+    default:
+        config.free_page_report_cmd_id =
+            cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+        break;
+    }
+
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, virtio_balloon_config_size(dev));
 }
 
 static int build_dimm_list(Object *obj, void *opaque)
@@ -352,7 +531,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, virtio_balloon_config_size(dev));
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
@@ -423,7 +602,7 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     int ret;
 
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -438,6 +617,21 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
 
+    if (s->host_features & (1ULL << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_vq = virtio_add_queue(vdev, VIRTQUEUE_MAX_SIZE,
+                                           virtio_balloon_handle_free_page_vq);
+        s->free_page_report_status = FREE_PAGE_REPORT_S_DONE;
+        s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+        s->free_page_report_notify.notify =
+            virtio_balloon_free_page_report_notify;
+        precopy_add_notifier(&s->free_page_report_notify);
+    }
+
+    if (s->host_features & (1ULL << VIRTIO_BALLOON_F_REPORTING)) {
+        s->reporting_vq = virtio_add_queue(vdev, 32,
+                                           virtio_balloon_handle_report);
+    }
+
     reset_stats(s);
 }
 
@@ -446,6 +640,9 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    if (s->free_page_vq) {
+        precopy_remove_notifier(&s->free_page_report_notify);
+    }
     balloon_stats_destroy_timer(s);
     qemu_remove_balloon_handler(s);
     virtio_cleanup(vdev);
@@ -460,6 +657,7 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         g_free(s->stats_vq_elem);
         s->stats_vq_elem = NULL;
     }
+    s->free_page_report_status = FREE_PAGE_REPORT_S_DONE;
 }
 
 static void virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
@@ -500,6 +698,10 @@ static const VMStateDescription vmstate_virtio_balloon = {
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
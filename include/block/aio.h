@@ -46,9 +46,36 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
+
+typedef QSLIST_HEAD(, QEMUBH) BHList;
+
+/* A list of BHs taken out of ctx->bh_list by one aio_bh_poll call */
+typedef struct BHListSlice BHListSlice;
+struct BHListSlice {
+    BHList bh_list;
+    QSIMPLEQ_ENTRY(BHListSlice) next;
+};
 
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
+
+/*
+ * Event loop statistics.  They are only written by the thread that runs the
+ * AioContext, without atomics; readers in other threads may see slightly
+ * stale or torn values, which is good enough for monitoring.
+ */
+typedef struct AioContextStats {
+    uint64_t polls;             /* aio_poll() calls */
+    uint64_t idle_ns;           /* time blocked waiting for events */
+    uint64_t poll_ns;           /* time spent busy polling */
+    uint64_t bh_calls;          /* bottom half callbacks */
+    uint64_t bh_ns;
+    uint64_t fd_handler_calls;  /* fd read/write handler callbacks */
+    uint64_t fd_handler_ns;
+    uint64_t timer_ns;          /* time spent running timers */
+} AioContextStats;
 
 struct AioContext {
     GSource source;
@@ -90,16 +117,25 @@ struct AioContext {
      */
     uint32_t notify_me;
 
-    /* lock to protect between bh's adders and deleter */
+    /* Protects all_bhs */
     QemuMutex bh_lock;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* Bottom halves that were scheduled or deleted since the last
+     * aio_bh_poll.  Pushed locklessly from any thread, taken out as a
+     * whole by aio_bh_poll, so that BHs that are not scheduled cost nothing.
+     */
+    BHList bh_list;
 
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
+    /* Slices of bh_list that (possibly nested) aio_bh_poll calls are
+     * dispatching, oldest first.  Only accessed by the thread that runs
+     * the event loop.
      */
-    int walking_bh;
+    QSIMPLEQ_HEAD(, BHListSlice) bh_slice_list;
+
+    /* All BHs except the one-shot ones, for x-debug-query-bhs */
+    QLIST_HEAD(, QEMUBH) all_bhs;
+    uint64_t oneshot_bh_calls;
+    uint64_t oneshot_bh_time_ns;
 
     /* Used by aio_notify.
      *
@@ -128,16 +164,44 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 
     int external_disable_cnt;
 
+    /* Number of AioHandlers without .io_poll() */
+    int poll_disable_cnt;
+
+    /* Polling mode parameters */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+    /* Thread pool parameters, see aio_context_set_thread_pool_params */
+    int thread_pool_min;
+    int thread_pool_max;
+    int thread_pool_node;
+
+    AioContextStats stats;
+
     /* epoll(7) state used when built with CONFIG_EPOLL */
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* If true, epoll_pfd is the only GPollFD of the GSource.  See
+     * aio_context_enable_epoll_source.
+     */
+    bool epoll_source;
+    GPollFD epoll_pfd;
 };
 
 /**
@@ -242,15 +306,25 @@ void aio_bh_call(QEMUBH *bh);
  */
 int aio_bh_poll(AioContext *ctx);
 
+/**
+ * aio_bh_get_info: Return the call statistics of the BHs of @ctx.
+ *
+ * @name is used as the context name for the entries.  This is used by the
+ * x-debug-query-bhs QMP command; the statistics of the one-shot BHs are
+ * summed up in a single entry.
+ */
+struct BHInfoList *aio_bh_get_info(AioContext *ctx, const char *name);
+
 /**
  * qemu_bh_schedule: Schedule a bottom half.
  *
  * Scheduling a bottom half interrupts the main loop and causes the
  * execution of the callback that was passed to qemu_bh_new.
  *
- * Bottom halves that are scheduled from a bottom half handler are instantly
- * invoked.  This can create an infinite loop if a bottom half handler
- * schedules itself.
+ * Bottom halves that are scheduled from a bottom half handler run in the
+ * next aio_bh_poll, which the event loop reaches without blocking.  A bottom
+ * half handler that always schedules itself therefore keeps the event loop
+ * busy.
  *
  * @bh: The bottom half to be scheduled.
  */
@@ -296,6 +370,14 @@ bool aio_prepare(AioContext *ctx);
  */
 bool aio_pending(AioContext *ctx);
 
+/* Collect the events of the file descriptors that the GSource attached
+ * to the AioContext does not get from g_poll directly, after g_poll is
+ * invoked and before aio_pending.
+ *
+ * This is used internally in the implementation of the GSource.
+ */
+void aio_fetch_events(AioContext *ctx);
+
 /* Dispatch any pending callbacks from the GSource attached to the AioContext.
  *
  * This is used internally in the implementation of the GSource.
@@ -323,12 +405,18 @@ bool aio_poll(AioContext *ctx, bool blocking);
  *
  * Code that invokes AIO completion functions should rely on this function
  * instead of qemu_set_fd_handler[2].
+ *
+ * @io_poll is optional.  It is called by aio_poll() while busy waiting
+ * before blocking, and should return true after processing any new
+ * event.  As long as one handler has no @io_poll, polling is disabled
+ * for the whole AioContext, since its events would go unnoticed.
  */
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         bool is_external,
                         IOHandler *io_read,
                         IOHandler *io_write,
+                        AioPollFn *io_poll,
                         void *opaque);
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
@@ -337,11 +425,15 @@ void aio_set_fd_handler(AioContext *ctx,
  *
  * Code that invokes AIO completion functions should rely on this function
  * instead of event_notifier_set_handler.
+ *
+ * @io_poll is called with @notifier as the opaque pointer; see
+ * aio_set_fd_handler().
  */
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             bool is_external,
-                            EventNotifierHandler *io_read);
+                            EventNotifierHandler *io_read,
+                            AioPollFn *io_poll);
 
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
@@ -354,6 +446,10 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Return the LuringState bound to this AioContext, or NULL if io_uring
+ * is not available on this host */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -460,4 +556,49 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_enable_epoll_source:
+ * @ctx: the aio context
+ *
+ * Make the GSource of @ctx hand a single epoll file descriptor to glib,
+ * instead of one GPollFD per handler.  Handlers are added to and removed
+ * from the epoll set as they are registered, so the cost of an iteration
+ * of the glib main loop does not grow with the number of handlers.
+ *
+ * Does nothing if epoll is not available; the GSource then keeps using
+ * one GPollFD per handler.
+ */
+void aio_context_enable_epoll_source(AioContext *ctx);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds
+ * @grow: polling time growth factor
+ * @shrink: polling time shrink factor
+ *
+ * Poll mode can be disabled by setting poll_max_ns to 0.  The polling
+ * time starts at zero and adapts between 0 and @max_ns depending on how
+ * long aio_poll() actually had to block; a factor of 0 selects the
+ * default.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads that are kept even when idle
+ * @max: maximum number of worker threads
+ * @node: host NUMA node whose CPUs the workers run on, or -1 to inherit
+ *        the CPU affinity of the thread that runs @ctx
+ *
+ * The parameters also apply to a thread pool that already exists.  Extra
+ * workers beyond a lowered @max exit when they become idle.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, int64_t node,
+                                        Error **errp);
+
 #endif
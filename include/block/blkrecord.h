@@ -0,0 +1,48 @@
+/*
+ * Block request recorder
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_BLKRECORD_H
+#define BLOCK_BLKRECORD_H
+
+/*
+ * The blkrecord filter writes one line per completed request to a trace
+ * file:
+ *
+ *   <start> <latency> <op> <offset> <bytes> <ret>
+ *
+ * @start is the submission time in nanoseconds since the node was opened,
+ * @latency the time the request took, @op one of the BLKRECORD_OP_*
+ * characters and @ret the return value passed back to the parent.  Lines
+ * are in completion order; blkrecord_load() sorts them by submission time.
+ */
+
+#define BLKRECORD_TRACE_HEADER "# blkrecord trace v1"
+
+#define BLKRECORD_OP_READ         'r'
+#define BLKRECORD_OP_WRITE        'w'
+#define BLKRECORD_OP_WRITE_ZEROES 'z'
+#define BLKRECORD_OP_DISCARD      'd'
+#define BLKRECORD_OP_FLUSH        'f'
+
+typedef struct BlkrecordEntry {
+    int64_t start;
+    int64_t latency;
+    char op;
+    uint64_t offset;
+    uint64_t bytes;
+} BlkrecordEntry;
+
+/*
+ * Read the trace in @filename.  Returns the requests sorted by submission
+ * time and stores their number in @nr_entries, or returns NULL on error.
+ */
+BlkrecordEntry *blkrecord_load(const char *filename, size_t *nr_entries,
+                               Error **errp);
+
+#endif
@@ -38,6 +38,7 @@
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTENDED_L2      16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -56,6 +57,7 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -78,10 +80,18 @@ typedef struct BdrvTrackedRequest {
     unsigned int overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    QLIST_ENTRY(BdrvTrackedRequest) serialising_list;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    /* The aligned part of a write that is passed to before_write_notifiers;
+     * a write request may be split into several of them. */
+    int64_t write_offset;
+    unsigned int write_bytes;
+    QEMUIOVector *write_qiov;
+    BdrvRequestFlags write_flags;
 } BdrvTrackedRequest;
 
 struct BlockDriver {
@@ -167,6 +177,21 @@ struct BlockDriver {
         int64_t offset, int count, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int count);
+
+    /*
+     * Copy a range without going through a bounce buffer.
+     * bdrv_co_copy_range_from is called on the node that @src points to
+     * and forwards the request towards the protocol layer, which then calls
+     * bdrv_co_copy_range_to() so that the destination side can do the same.
+     * The protocol driver of @dst performs the copy.  Either may return
+     * -ENOTSUP, e.g. if the two nodes are not of the same kind.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, int64_t src_offset, BdrvChild *dst,
+        int64_t dst_offset, int bytes, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, int64_t src_offset, BdrvChild *dst,
+        int64_t dst_offset, int bytes, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -199,9 +224,24 @@ struct BlockDriver {
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
+    /*
+     * Allocates space for an existing range of the image, as selected by
+     * @prealloc (which is never PREALLOC_MODE_OFF).  May block; only used
+     * by tools after growing an image.
+     */
+    int (*bdrv_preallocate)(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, PreallocMode prealloc,
+                            Error **errp);
 
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     bool has_variable_length;
+
+    /*
+     * Set if bdrv_co_get_block_status is expensive and its results only
+     * change when the node is written to through the block layer, so that
+     * they can be kept in BlockDriverState.block_status_cache.
+     */
+    bool cache_block_status;
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_co_pwritev_compressed)(BlockDriverState *bs,
@@ -223,6 +263,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -320,6 +361,15 @@ struct BlockDriver {
     void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
                            Error **errp);
 
+    /**
+     * Check whether a new persistent dirty bitmap with the given @name and
+     * @granularity (in bytes) can be stored in the image on close.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -423,6 +473,16 @@ struct BdrvChild {
     QLIST_ENTRY(BdrvChild) next_parent;
 };
 
+#define BDRV_BLOCK_STATUS_CACHE_SIZE 16
+
+/* A range with the same block status; unused if nb_sectors is 0 */
+typedef struct BdrvBlockStatusCacheEntry {
+    int64_t sector_num;
+    int nb_sectors;
+    int64_t ret;    /* block status of sector_num */
+    BlockDriverState *file;
+} BdrvBlockStatusCacheEntry;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -447,6 +507,11 @@ struct BlockDriverState {
     unsigned int write_gen;         /* Current data generation */
     unsigned int flushed_gen;       /* Flushed write generation */
 
+    /* Recent results of drv->bdrv_co_get_block_status, if the driver sets
+     * cache_block_status; overlapping entries are dropped on writes */
+    BdrvBlockStatusCacheEntry block_status_cache[BDRV_BLOCK_STATUS_CACHE_SIZE];
+    int block_status_cache_next;
+
     BlockDriver *drv; /* NULL means no media */
     void *opaque;
 
@@ -471,8 +536,10 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
-    /* number of in-flight serialising requests */
-    unsigned int serialising_in_flight;
+    /* In-flight serialising requests, a subset of tracked_requests.
+     * Non-serialising requests only have to be checked against these.
+     */
+    QLIST_HEAD(, BdrvTrackedRequest) serialising_requests;
 
     /* Offset after the highest byte written to */
     uint64_t wr_highest_offset;
@@ -717,6 +784,7 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
+ * @copy_mode: When to copy data to the destination.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
@@ -732,7 +800,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -780,6 +848,10 @@ bool blk_dev_is_tray_open(BlockBackend *blk);
 bool blk_dev_is_medium_locked(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int64_t nr_sect);
+
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int64_t nb_sectors);
 bool bdrv_requests_pending(BlockDriverState *bs);
 
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
@@ -27,6 +27,12 @@
 #define BLOCKJOB_H
 
 #include "block/block.h"
+#include "qemu/ratelimit.h"
+
+/* Weight of a job in the host-wide budget, see block_job_set_priority() */
+#define BLOCK_JOB_MIN_PRIORITY      1
+#define BLOCK_JOB_DEFAULT_PRIORITY  100
+#define BLOCK_JOB_MAX_PRIORITY      1000
 
 /**
  * BlockJobDriver:
@@ -43,6 +49,19 @@ typedef struct BlockJobDriver {
     /** Optional callback for job types that support setting a speed limit */
     void (*set_speed)(BlockJob *job, int64_t speed, Error **errp);
 
+    /**
+     * Optional callback for job types whose number of requests in flight
+     * and request size can be tuned.  A value of 0 lets the job choose;
+     * a field is left alone if its has_* argument is false.
+     */
+    void (*set_pipeline)(BlockJob *job,
+                         bool has_max_in_flight, int64_t max_in_flight,
+                         bool has_chunk_size, int64_t chunk_size,
+                         Error **errp);
+
+    /** Optional callback to add job type specific fields to @info */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
+
     /** Optional callback for job types that need to forward I/O status reset */
     void (*iostatus_reset)(BlockJob *job);
 
@@ -175,6 +194,14 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /** Weight that was set with @block_job_set_priority.  */
+    int priority;
+
+    /** The job's share of the host-wide budget, see block_job_sched_delay */
+    RateLimit sched_bw;
+    RateLimit sched_ops;
+    uint64_t sched_period;
+
     /** The completion function that will be called when the job completes.  */
     BlockCompletionFunc *cb;
 
@@ -302,6 +329,68 @@ void block_job_completed(BlockJob *job, int ret);
  */
 void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp);
 
+/**
+ * block_job_set_priority:
+ * @job: The job to set the priority for.
+ * @priority: The new weight, between %BLOCK_JOB_MIN_PRIORITY and
+ * %BLOCK_JOB_MAX_PRIORITY.
+ * @errp: Error object.
+ *
+ * Jobs that copy data at the same time split the host-wide budget in
+ * proportion to their priority.
+ */
+void block_job_set_priority(BlockJob *job, int64_t priority, Error **errp);
+
+/**
+ * block_job_sched_configure:
+ * @bandwidth: Bytes per second for all jobs together, or 0 for unlimited.
+ * @iops: Copy operations per second for all jobs together, or 0 for
+ * unlimited.
+ * @guest_reserve: Percentage of @bandwidth that jobs give up while guest
+ * devices are doing I/O.
+ *
+ * Set the host-wide budget that is shared by all block jobs.
+ */
+void block_job_sched_configure(int64_t bandwidth, int64_t iops,
+                               int64_t guest_reserve);
+
+/**
+ * block_job_sched_query:
+ *
+ * Return the host-wide budget and how much of it is currently left for jobs.
+ */
+BlockJobSchedulerInfo *block_job_sched_query(void);
+
+/**
+ * block_job_sched_delay:
+ * @job: The job that copied data.
+ * @n: The number of bytes that were copied.
+ *
+ * Account @n bytes and, unless @n is 0, one copy operation against the
+ * share of the host-wide budget that @job is entitled to, and return how
+ * long the job should sleep, in nanoseconds.  This comes on top of the
+ * job's own speed limit.
+ */
+int64_t block_job_sched_delay(BlockJob *job, uint64_t n);
+
+/**
+ * block_job_set_pipeline:
+ * @job: The job to tune.
+ * @has_max_in_flight: Whether @max_in_flight should be changed.
+ * @max_in_flight: The maximum number of requests in flight, or 0 to let
+ * the job adapt it.
+ * @has_chunk_size: Whether @chunk_size should be changed.
+ * @chunk_size: The maximum size of a request in bytes, or 0 to let the
+ * job adapt it.
+ * @errp: Error object.
+ *
+ * Override how much I/O the job keeps in flight.
+ */
+void block_job_set_pipeline(BlockJob *job,
+                            bool has_max_in_flight, int64_t max_in_flight,
+                            bool has_chunk_size, int64_t chunk_size,
+                            Error **errp);
+
 /**
  * block_job_cancel:
  * @job: The job to be canceled.
@@ -360,6 +449,16 @@ void block_job_pause(BlockJob *job);
  */
 void block_job_resume(BlockJob *job);
 
+/**
+ * block_job_add_backend:
+ * @job: A block job.
+ * @blk: A BlockBackend that @job submits requests to, besides job->blk.
+ *
+ * Pause @job while the root node of @blk is drained, as is done for the
+ * node of job->blk.
+ */
+void block_job_add_backend(BlockJob *job, BlockBackend *blk);
+
 /**
  * block_job_enter:
  * @job: The job to enter.
@@ -0,0 +1,140 @@
+/*
+ * Per-request I/O latency breakdown
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_IO_TRACE_H
+#define BLOCK_IO_TRACE_H
+
+#include "qemu/atomic.h"
+#include "qemu/coroutine.h"
+#include "qemu/timer.h"
+#include "qemu/stats.h"
+
+/*
+ * A device that wants to know where the time of its requests goes embeds
+ * an IOTrace in each request and attaches it to the coroutine that runs
+ * the request.  The layers the request goes through then time their stage
+ * with io_trace_mark(): every mark charges the time since the previous one
+ * to the stage that just ended, so the stages add up to the total latency.
+ * Time that no layer claims is charged to IO_TRACE_BLOCK.
+ *
+ * The stages are listed in the order a read or write goes through them;
+ * a request split by the format driver goes through QUEUE and DEVICE
+ * once per piece.
+ */
+typedef enum IOTraceStage {
+    IO_TRACE_POP,           /* fetching the request from the virtqueue */
+    IO_TRACE_SETUP,         /* parsing, merging, until handed to the backend */
+    IO_TRACE_BLOCK,         /* block layer and driver processing */
+    IO_TRACE_THROTTLE,      /* held back by the backend's I/O limits */
+    IO_TRACE_METADATA,      /* format driver metadata cache misses */
+    IO_TRACE_QUEUE,         /* queued in linux-aio until io_submit() */
+    IO_TRACE_DEVICE,        /* io_submit() until the completion is reaped */
+    IO_TRACE_COMPLETION,    /* completion reaped until the device sees it */
+    IO_TRACE_NOTIFY,        /* used ring update and guest notification */
+    IO_TRACE_TOTAL,
+    IO_TRACE__MAX,
+} IOTraceStage;
+
+struct IOTrace {
+    int64_t start_ns;
+    int64_t mark_ns;
+    /* inside a stage that claims the time of nested I/O, e.g. metadata */
+    int depth;
+    int64_t stage_ns[IO_TRACE__MAX];
+};
+
+/* Power of two bins from 1 microsecond to 1 second */
+#define IO_TRACE_NBINS 22
+
+typedef struct IOTraceStats {
+    uint64_t requests;
+    uint64_t bins[IO_TRACE__MAX][IO_TRACE_NBINS];
+    /* emit a trace event for one request every sample_every, 0 for none */
+    uint32_t sample_every;
+    uint32_t sample_count;
+} IOTraceStats;
+
+/* Number of devices that trace their requests */
+extern int io_trace_users;
+
+void io_trace_enable(void);
+void io_trace_disable(void);
+
+/* The trace of the request run by the current coroutine, if any */
+static inline IOTrace *io_trace_current(void)
+{
+    if (likely(!atomic_read(&io_trace_users))) {
+        return NULL;
+    }
+    return qemu_coroutine_get_io_trace(qemu_coroutine_self());
+}
+
+/*
+ * Attach @trace to the current coroutine.  Outside coroutine context this
+ * is the thread's main context: a device sets the trace around the call
+ * that submits the request and the backend passes it on to the coroutine
+ * it creates for the request.
+ */
+static inline void io_trace_set_current(IOTrace *trace)
+{
+    qemu_coroutine_set_io_trace(qemu_coroutine_self(), trace);
+}
+
+/* Start tracing a request that arrived at @start_ns, in get_clock() time */
+void io_trace_start(IOTrace *trace, int64_t start_ns);
+
+/* Charge the time since the previous mark to @stage */
+static inline void io_trace_mark(IOTrace *trace, IOTraceStage stage)
+{
+    int64_t now;
+
+    if (!trace || trace->depth) {
+        return;
+    }
+    now = get_clock();
+    trace->stage_ns[stage] += now - trace->mark_ns;
+    trace->mark_ns = now;
+}
+
+/*
+ * Bracket a stage that can issue I/O of its own, such as a metadata read;
+ * the nested stages are not marked and the whole time goes to @stage.
+ */
+static inline void io_trace_enter(IOTrace *trace)
+{
+    if (trace) {
+        io_trace_mark(trace, IO_TRACE_BLOCK);
+        trace->depth++;
+    }
+}
+
+static inline void io_trace_leave(IOTrace *trace, IOTraceStage stage)
+{
+    if (trace) {
+        trace->depth--;
+        io_trace_mark(trace, stage);
+    }
+}
+
+/*
+ * Give @trace the stages after IO_TRACE_SETUP of @from, for requests that
+ * were merged into @from before submission.
+ */
+void io_trace_inherit(IOTrace *trace, const IOTrace *from);
+
+/*
+ * Account a finished request, computing its IO_TRACE_TOTAL.  Returns true
+ * if the caller should emit a trace event with its breakdown.
+ */
+bool io_trace_account(IOTraceStats *stats, IOTrace *trace);
+
+/* Report the number of requests and one histogram per stage */
+void io_trace_stats_report(StatsCollector *c, const IOTraceStats *stats);
+
+#endif
@@ -38,14 +38,40 @@ struct nbd_request {
 struct nbd_reply {
     uint64_t handle;
     uint32_t error;
+    /* Only for chunks of a structured reply, whose payload of @length
+     * bytes is left on the channel for the caller to read */
+    bool structured;
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 };
 
+/* One descriptor of an NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+typedef struct NBDExtent {
+    uint32_t length;
+    uint32_t flags; /* NBD_STATE_* */
+} QEMU_PACKED NBDExtent;
+
+/* Export parameters.  @structured_reply and @base_allocation are set by the
+ * caller of nbd_receive_negotiate() to request the feature, and are cleared
+ * if the server does not support it. */
+typedef struct NBDExportInfo {
+    bool structured_reply;
+    bool base_allocation;
+    uint32_t meta_base_allocation_id;
+
+    uint16_t flags;
+    off_t size;
+} NBDExportInfo;
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)     /* Send WRITE_ZEROES */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections OK */
 
 /* New-style global flags. */
 #define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Fixed newstyle protocol. */
@@ -56,23 +82,47 @@ struct nbd_reply {
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Meta context ID. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_POLICY      ((UINT32_C(1) << 31) | 2) /* Server denied */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 #define NBD_REP_ERR_TLS_REQD    ((UINT32_C(1) << 31) | 5) /* TLS required */
+#define NBD_REP_ERR_UNKNOWN     ((UINT32_C(1) << 31) | 6) /* No such export */
 
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_NO_HOLE	(1 << 17) /* Don't punch holes on zero writes */
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19) /* Only one block status extent */
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    /* 5 reserved for failed experiment NBD_CMD_CACHE */
+    NBD_CMD_WRITE_ZEROES = 6,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Structured reply chunk flags and types */
+#define NBD_REPLY_FLAG_DONE           (1 << 0) /* Last chunk of the reply */
+
+#define NBD_REPLY_TYPE_NONE           0
+#define NBD_REPLY_TYPE_OFFSET_DATA    1
+#define NBD_REPLY_TYPE_OFFSET_HOLE    2
+#define NBD_REPLY_TYPE_BLOCK_STATUS   5
+#define NBD_REPLY_TYPE_ERROR          ((1 << 15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET   ((1 << 15) + 2)
+
+#define nbd_reply_type_is_error(type) ((type) & (1 << 15))
+
+/* The "base:allocation" meta context and its extent flags */
+#define NBD_META_BASE_ALLOCATION      "base:allocation"
+#define NBD_STATE_HOLE                (1 << 0) /* Unallocated */
+#define NBD_STATE_ZERO                (1 << 1) /* Reads as zeroes */
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -90,13 +140,14 @@ ssize_t nbd_wr_syncv(QIOChannel *ioc,
                      size_t niov,
                      size_t length,
                      bool do_read);
-int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
+int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp);
+                          NBDExportInfo *info, Error **errp);
 int nbd_init(int fd, QIOChannelSocket *sioc, uint16_t flags, off_t size);
 ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request);
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply);
+int nbd_errno_to_system_errno(int err);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
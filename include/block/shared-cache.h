@@ -0,0 +1,53 @@
+/*
+ * Read cache for immutable images, shared between QEMU processes
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_SHARED_CACHE_H
+#define BLOCK_SHARED_CACHE_H
+
+#include "qemu/iov.h"
+
+/*
+ * A SharedCache is a direct-mapped cache of fixed-size chunks of an image
+ * file, kept in a shared memory segment (a file in /dev/shm) whose name is
+ * derived from the identity of the image.  All processes that open the
+ * same image read-only with a cache attach to the same segment, so a base
+ * image used by many overlays is read from storage only once.
+ *
+ * The image must not change while any process uses the cache; the size
+ * and mtime of the image are part of the key, so a modified image gets a
+ * fresh segment the next time it is opened.
+ *
+ * Slots are protected by a per-slot sequence counter and never block: a
+ * lookup that races with an insertion is simply a miss.
+ */
+
+#define SHARED_CACHE_CHUNK_SIZE (64 * 1024)
+
+typedef struct SharedCache SharedCache;
+
+/*
+ * Attach to (or create) the segment for the image open at @fd, with room
+ * for about @cache_size bytes of data.  If another process already created
+ * the segment, its size wins.
+ */
+SharedCache *shared_cache_open(int fd, uint64_t cache_size, Error **errp);
+void shared_cache_close(SharedCache *c);
+
+/*
+ * Copy @bytes at @offset of the image to @qiov, starting at @qiov_offset.
+ * The range must not cross a chunk boundary.  Returns false on a miss, in
+ * which case @qiov may have been partially overwritten.
+ */
+bool shared_cache_lookup(SharedCache *c, uint64_t offset, QEMUIOVector *qiov,
+                         size_t qiov_offset, size_t bytes);
+
+/* Store the chunk that starts at @offset (chunk aligned) from @buf */
+void shared_cache_insert(SharedCache *c, uint64_t offset, const void *buf);
+
+#endif
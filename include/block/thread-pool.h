@@ -20,6 +20,8 @@
 
 #include "block/block.h"
 
+#define THREAD_POOL_MAX_THREADS_DEFAULT 64
+
 typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
@@ -34,4 +36,12 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+/* Apply new aio_context_set_thread_pool_params values */
+void thread_pool_update_params(ThreadPool *pool, struct AioContext *ctx);
+
+/* Check that @node is a host NUMA node that workers can be bound to */
+bool thread_pool_node_valid(int node, Error **errp);
+
+struct ThreadPoolInfo *thread_pool_get_info(ThreadPool *pool);
+
 #endif
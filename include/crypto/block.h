@@ -74,6 +74,8 @@ typedef enum {
  * @readfunc: callback for reading data from the volume
  * @opaque: data to pass to @readfunc
  * @flags: bitmask of QCryptoBlockOpenFlags values
+ * @n_threads: maximum number of threads that will call
+ *             qcrypto_block_encrypt/qcrypto_block_decrypt at once
  * @errp: pointer to a NULL-initialized error object
  *
  * Create a new block encryption object for an existing
@@ -105,6 +107,7 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp);
 
 /**
@@ -163,7 +166,9 @@ QCryptoBlockInfo *qcrypto_block_get_info(QCryptoBlock *block,
  * @errp: pointer to a NULL-initialized error object
  *
  * Decrypt @len bytes of cipher text in @buf, writing
- * plain text back into @buf
+ * plain text back into @buf.  This may be called from
+ * up to as many threads at once as were given to
+ * qcrypto_block_open.
  *
  * Returns 0 on success, -1 on failure
  */
@@ -182,7 +187,9 @@ int qcrypto_block_decrypt(QCryptoBlock *block,
  * @errp: pointer to a NULL-initialized error object
  *
  * Encrypt @len bytes of plain text in @buf, writing
- * cipher text back into @buf
+ * cipher text back into @buf.  This may be called from
+ * up to as many threads at once as were given to
+ * qcrypto_block_open.
  *
  * Returns 0 on success, -1 on failure
  */
@@ -319,4 +319,26 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_enable_ktls:
+ * @sess: the TLS session object
+ * @fd: the TCP socket that carries the session
+ * @tx: filled with whether the kernel now encrypts outgoing data
+ * @rx: filled with whether the kernel now decrypts incoming data
+ *
+ * Once the handshake has completed, try to hand the record
+ * layer of the session over to the kernel, so that payload
+ * data can be written to and read from @fd directly, without
+ * a copy through userspace encryption.
+ *
+ * Each direction is switched independently. A direction that
+ * could not be switched (old kernel, unsupported cipher, data
+ * already buffered by the session, ...) keeps using
+ * qcrypto_tls_session_write/qcrypto_tls_session_read, so a
+ * failure is not an error. A direction that was switched must
+ * no longer be used through the session.
+ */
+void qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess,
+                                     int fd, bool *tx, bool *rx);
+
 #endif /* QCRYPTO_TLSSESSION_H */
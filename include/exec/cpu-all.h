@@ -227,8 +227,16 @@ typedef int (*walk_memory_regions_fn)(void *, target_ulong,
 int walk_memory_regions(void *, walk_memory_regions_fn);
 
 int page_get_flags(target_ulong address);
+/* Like page_get_flags(), also returning the run of pages around @address
+   that have the same flags in [*start, *last], unless there are none.  */
+int page_get_flags_range(target_ulong address, target_ulong *start,
+                         target_ulong *last);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+void page_fork_start(void);
+void page_fork_end(int child);
+
+void tb_log_stats(void);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
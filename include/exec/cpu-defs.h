@@ -55,8 +55,11 @@ typedef uint64_t target_ulong;
 #endif
 
 #if !defined(CONFIG_USER_ONLY)
-/* use a fully associative victim tlb of 8 entries */
-#define CPU_VTLB_SIZE 8
+/* use a fully associative victim tlb; its size per MMU mode adapts
+ * between these bounds to the use the mode gets between flushes
+ */
+#define CPU_VTLB_MIN_SIZE 8
+#define CPU_VTLB_MAX_SIZE 64
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -129,15 +132,31 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* Per-MMU-mode bookkeeping used to size the victim TLB and to skip
+ * flushing modes that have not been filled since they were last flushed.
+ * All fields are only accessed from C code, never from generated code.
+ */
+typedef struct CPUTLBDesc {
+    /* Number of victim TLB entries in use; 0 until the first flush.  */
+    uint16_t vtlb_size;
+    /* Next victim TLB entry to be replaced.  */
+    uint16_t vtlb_index;
+    /* TLB fills and victim TLB hits since the last flush.  */
+    uint32_t n_fills;
+    uint32_t n_vhits;
+    /* True if no entry of this mode has been filled since the last flush.  */
+    bool clean;
+} CPUTLBDesc;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_MAX_SIZE];           \
     CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
-    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_MAX_SIZE];             \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];                                     \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
-    target_ulong vtlb_index;                                            \
 
 #else
 
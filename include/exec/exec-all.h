@@ -213,6 +213,7 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_PROFILE     0x80000 /* Count executions in exec_count */
 
     uint16_t invalid;
 
@@ -253,10 +254,30 @@ struct TranslationBlock {
      */
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_list_first;
+
+    /* Number of times the TB was entered; only maintained for TBs
+     * translated with CF_PROFILE.  Updated without atomics, so counts
+     * may be slightly low when several vCPU threads run the same TB.
+     */
+    uint64_t exec_count;
 };
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
+
+/* Per-TB execution profiling */
+typedef struct TBProfileEntry {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    uint16_t icount;
+    uint16_t size;
+    uint64_t exec_count;
+} TBProfileEntry;
+
+extern bool tb_profile_enabled;
+void tb_profile_set(CPUState *cpu, bool enable);
+size_t tb_profile_snapshot(TBProfileEntry **pentries, uint64_t *total_insns);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 #if defined(USE_DIRECT_JUMP)
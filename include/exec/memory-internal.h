@@ -22,9 +22,14 @@
 #ifndef CONFIG_USER_ONLY
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
 
-void address_space_init_dispatch(AddressSpace *as);
-void address_space_unregister(AddressSpace *as);
-void address_space_destroy_dispatch(AddressSpace *as);
+/* A dispatch tree is built once per FlatView and shared by all the
+ * address spaces using that view.
+ */
+AddressSpaceDispatch *address_space_dispatch_new(void);
+void address_space_dispatch_add(AddressSpaceDispatch *d,
+                                MemoryRegionSection *section);
+void address_space_dispatch_compact(AddressSpaceDispatch *d);
+void address_space_dispatch_free(AddressSpaceDispatch *d);
 
 extern const MemoryRegionOps unassigned_mem_ops;
 
@@ -31,6 +31,7 @@
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 #define RAM_ADDR_INVALID (~(ram_addr_t)0)
 
@@ -183,6 +184,15 @@ struct MemoryRegionIOMMUOps {
 typedef struct CoalescedMemoryRange CoalescedMemoryRange;
 typedef struct MemoryRegionIoeventfd MemoryRegionIoeventfd;
 
+/* Accelerator exits dispatched to a region, see set-mmio-exit-stats */
+typedef struct MemoryRegionExitStats {
+    QemuSpin lock;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} MemoryRegionExitStats;
+
 struct MemoryRegion {
     Object parent_obj;
 
@@ -222,6 +232,7 @@ struct MemoryRegion {
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    MemoryRegionExitStats mmio_exit_stats;
     QLIST_HEAD(, IOMMUNotifier) iommu_notify;
     IOMMUNotifierFlag iommu_notify_flags;
 };
@@ -243,6 +254,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -262,6 +274,12 @@ struct MemoryListener {
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
+/* Default for AddressSpace.max_bounce_buffer_size */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
+typedef struct BounceBuffer BounceBuffer;
+typedef struct MapClient MapClient;
+
 struct AddressSpace {
     /* All fields are private. */
     struct rcu_head rcu;
@@ -276,10 +294,19 @@ struct AddressSpace {
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
-    struct AddressSpaceDispatch *next_dispatch;
-    MemoryListener dispatch_listener;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+
+    /* Bounce buffers used by address_space_map for regions that are not
+     * RAM, and the clients waiting for them; protected by map_lock.
+     */
+    QemuMutex map_lock;
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_size;
+    size_t bounce_maps;
+    size_t bounce_failures;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, MapClient) map_clients;
 };
 
 /**
@@ -861,6 +888,23 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: clear the accelerator's dirty log for
+ *                                   a range of a region
+ *
+ * Accelerators that fetch their dirty log without clearing it (kvm with
+ * manual dirty log protection) leave the pages writable until told that
+ * the dirty information has been consumed.  This re-arms write tracking
+ * for the pages that were reported dirty in [@start, @start + @len) since
+ * the last call.
+ *
+ * @mr: the region being cleared.
+ * @start: the start of the range, relative to the start of the region.
+ * @len: the length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -963,6 +1007,21 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+extern bool mmio_exit_stats_enabled;
+
+/**
+ * memory_region_account_mmio_exit: Account an MMIO exit to a region
+ *
+ * Called by accelerators that dispatch MMIO exits, such as kvm, when
+ * mmio_exit_stats_enabled is set.  Can be called without the global mutex.
+ *
+ * @mr: the region the access was dispatched to.
+ * @is_write: whether the access was a write.
+ * @ns: time spent dispatching the access, in nanoseconds.
+ */
+void memory_region_account_mmio_exit(MemoryRegion *mr, bool is_write,
+                                     int64_t ns);
+
 /**
  * memory_region_set_global_locking: Declares the access processing requires
  *                                   QEMU's global lock.
@@ -1388,6 +1447,19 @@ void address_space_stq_le(AddressSpace *as, hwaddr addr, uint64_t val,
 void address_space_stq_be(AddressSpace *as, hwaddr addr, uint64_t val,
                             MemTxAttrs attrs, MemTxResult *result);
 
+/* address_space_get_iotlb_entry: translate an address into an IOTLB
+ * entry. Should be called from an RCU critical section.
+ *
+ * Returns the entry of the last IOMMU on the path; its @target_as is NULL
+ * if the access is not permitted or if no IOMMU translates @addr.
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @is_write: indicates the transfer direction
+ */
+IOMMUTLBEntry address_space_get_iotlb_entry(AddressSpace *as, hwaddr addr,
+                                            bool is_write);
+
 /* address_space_translate: translate an address range into an address space
  * into a MemoryRegion and an address range into that section.  Should be
  * called from an RCU critical section, to avoid that the last reference
@@ -1426,8 +1498,11 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
+ *
+ * Regions that are not RAM are mapped through bounce buffers, of which
+ * at most as->max_bounce_buffer_size bytes may be in use at a time.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1451,6 +1526,71 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: wait for bounce buffers of @as
+ *
+ * Schedules @bh once as soon as a bounce buffer of @as may be available,
+ * i.e. after a failed address_space_map() may succeed if retried.
+ *
+ * @as: #AddressSpace where address_space_map() failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel a pending map client
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
+/**
+ * MemoryRegionCache: a guest memory range translated once, for code that
+ * accesses the same small area over and over (e.g. virtqueue rings).
+ *
+ * If the whole range is directly accessible RAM, accesses go straight to
+ * the host pointer; otherwise they go through the address space as usual.
+ * The translation does not follow changes to the memory map: users must
+ * re-create the cache when it changes, e.g. from a MemoryListener commit
+ * callback, and free the old one after an RCU grace period.
+ */
+typedef struct MemoryRegionCache {
+    uint8_t *ptr;
+    hwaddr xlat;
+    hwaddr addr;
+    hwaddr len;
+    MemoryRegion *mr;
+    AddressSpace *as;
+    bool is_write;
+} MemoryRegionCache;
+
+#define MEMORY_REGION_CACHE_INVALID ((MemoryRegionCache) { .mr = NULL })
+
+/* address_space_cache_init: translate @len bytes at @addr of @as into @cache
+ *
+ * Takes a reference to the memory region until address_space_cache_destroy().
+ *
+ * @cache: #MemoryRegionCache to be filled
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the range; accesses must stay within it
+ * @is_write: whether the cache is going to be written to
+ */
+void address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                              hwaddr addr, hwaddr len, bool is_write);
+
+/* address_space_cache_destroy: release the region held by @cache */
+void address_space_cache_destroy(MemoryRegionCache *cache);
+
+/* Accesses through a #MemoryRegionCache; @addr is relative to its start */
+void address_space_read_cached(MemoryRegionCache *cache, hwaddr addr,
+                               void *buf, int len);
+void address_space_write_cached(MemoryRegionCache *cache, hwaddr addr,
+                                const void *buf, int len);
+uint32_t lduw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr);
+uint32_t lduw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr);
+void stw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val);
+void stw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
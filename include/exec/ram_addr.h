@@ -36,8 +36,19 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* Migration only: one bit per 1 << CLEAR_BITMAP_SHIFT pages whose
+     * dirty log has been fetched from the accelerator but not cleared yet
+     */
+    unsigned long *clear_bmap;
 };
 
+#define CLEAR_BITMAP_SHIFT 18   /* 1 GiB with 4 KiB pages */
+
+static inline unsigned long clear_bmap_size(uint64_t pages)
+{
+    return DIV_ROUND_UP(pages, 1UL << CLEAR_BITMAP_SHIFT);
+}
+
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
 {
     return (b && b->host && offset < b->used_length) ? true : false;
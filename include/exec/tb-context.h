@@ -40,6 +40,7 @@ struct TBContext {
     /* statistics */
     unsigned tb_flush_count;
     int tb_phys_invalidate_count;
+    uint64_t tb_gen_count;
 };
 
 #endif
@@ -14,6 +14,22 @@
         .driver   = "ioapic",\
         .property = "version",\
         .value    = "0x11",\
+    },{\
+        .driver   = "virtio-blk-device",\
+        .property = "discard",\
+        .value    = "off",\
+    },{\
+        .driver   = "virtio-blk-device",\
+        .property = "write-zeroes",\
+        .value    = "off",\
+    },{\
+        .driver   = "ich9-ahci",\
+        .property = "ccc",\
+        .value    = "off",\
+    },{\
+        .driver   = "sysbus-ahci",\
+        .property = "ccc",\
+        .value    = "off",\
     },
 
 #define HW_COMPAT_2_6 \
@@ -13,6 +13,7 @@
 #define HOTPLUG_H
 
 #include "qom/object.h"
+#include "qemu/notify.h"
 
 #define TYPE_HOTPLUG_HANDLER "hotplug-handler"
 
@@ -100,4 +101,35 @@ void hotplug_handler_unplug_request(HotplugHandler *plug_handler,
 void hotplug_handler_unplug(HotplugHandler *plug_handler,
                             DeviceState *plugged_dev,
                             Error **errp);
+
+/**
+ * hotplug_batch_begin:
+ *
+ * Start plugging a group of devices.  Until the matching
+ * hotplug_batch_end(), hotplug handlers may hold back the notifications
+ * to the guest and send them once for the whole group.  Batches nest.
+ */
+void hotplug_batch_begin(void);
+
+/**
+ * hotplug_batch_end:
+ *
+ * End a group started by hotplug_batch_begin().  The notifiers added with
+ * hotplug_batch_add_notifier() run when the outermost group ends.
+ */
+void hotplug_batch_end(void);
+
+/**
+ * hotplug_batch_active:
+ *
+ * Returns: true between hotplug_batch_begin() and hotplug_batch_end().
+ */
+bool hotplug_batch_active(void);
+
+/**
+ * hotplug_batch_add_notifier:
+ *
+ * Run @notifier at the end of every batch, to send what was held back.
+ */
+void hotplug_batch_add_notifier(Notifier *notifier);
 #endif
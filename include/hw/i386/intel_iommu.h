@@ -55,9 +55,11 @@
 
 typedef struct VTDContextEntry VTDContextEntry;
 typedef struct VTDContextCacheEntry VTDContextCacheEntry;
+typedef struct VTDPageWalkCache VTDPageWalkCache;
 typedef struct IntelIOMMUState IntelIOMMUState;
 typedef struct VTDAddressSpace VTDAddressSpace;
 typedef struct VTDIOTLBEntry VTDIOTLBEntry;
+typedef struct VTDIOTLBPageInvInfo VTDIOTLBPageInvInfo;
 typedef struct VTDBus VTDBus;
 typedef union VTD_IR_TableEntry VTD_IR_TableEntry;
 typedef union VTD_IR_MSIAddress VTD_IR_MSIAddress;
@@ -78,6 +80,20 @@ struct VTDContextCacheEntry {
     struct VTDContextEntry context_entry;
 };
 
+/* The last-level page table found by the latest page walk of a device, so
+ * that misses in the same 2M region read a single paging entry.  Like the
+ * hardware paging-structure caches, it is dropped by IOTLB and context-cache
+ * invalidations that cover it.
+ */
+struct VTDPageWalkCache {
+    uint32_t gen;           /* Obsolete if != IntelIOMMUState.pwc_gen */
+    uint16_t domain_id;
+    uint64_t gfn;           /* First 4K frame of the 2M region */
+    dma_addr_t table;       /* Address of the level-1 page table */
+    bool reads;             /* Permissions of the upper levels */
+    bool writes;
+};
+
 struct VTDAddressSpace {
     PCIBus *bus;
     uint8_t devfn;
@@ -86,6 +102,7 @@ struct VTDAddressSpace {
     MemoryRegion iommu_ir;      /* Interrupt region: 0xfeeXXXXX */
     IntelIOMMUState *iommu_state;
     VTDContextCacheEntry context_cache_entry;
+    VTDPageWalkCache pwc;
 };
 
 struct VTDBus {
@@ -100,8 +117,21 @@ struct VTDIOTLBEntry {
     uint64_t mask;
     bool read_flags;
     bool write_flags;
+    bool accessed;      /* Hit since the last eviction scan */
 };
 
+/* Information about page-selective IOTLB invalidate.  A domain-selective
+ * invalidation is one with a zero @mask.
+ */
+struct VTDIOTLBPageInvInfo {
+    uint16_t domain_id;
+    uint64_t addr;
+    uint64_t mask;      /* Mask of the 4K frame numbers to compare */
+};
+
+/* Max number of IOTLB invalidations collected before they are applied */
+#define VTD_INV_BATCH_MAX           64
+
 /* VT-d Source-ID Qualifier types */
 enum {
     VTD_SQ_FULL = 0x00,     /* Full SID verification */
@@ -279,6 +309,29 @@ struct IntelIOMMUState {
 
     uint32_t context_cache_gen;     /* Should be in [1,MAX] */
     GHashTable *iotlb;              /* IOTLB */
+    uint32_t iotlb_size;            /* Max number of IOTLB entries */
+    uint32_t pwc_gen;               /* Should be in [1,MAX] */
+
+    /* IOTLB invalidations are collected while the invalidation queue is
+     * processed, and applied with one pass over the IOTLB and a single
+     * notification before the next wait descriptor or at the end of the run.
+     */
+    bool inv_batching;
+    int inv_batch_len;
+    VTDIOTLBPageInvInfo inv_batch[VTD_INV_BATCH_MAX];
+    bool inv_notify;                /* inv_notify_start/end are valid */
+    hwaddr inv_notify_start;
+    hwaddr inv_notify_end;
+
+    /* Statistics, for query-stats */
+    uint64_t iotlb_hits;
+    uint64_t iotlb_misses;
+    uint64_t iotlb_evictions;
+    uint64_t context_cache_misses;
+    uint64_t pwc_hits;
+    uint64_t inv_descs;
+    uint64_t inv_flushes;
+    uint64_t inv_notifies;
 
     MemoryRegionIOMMUOps iommu_ops;
     GHashTable *vtd_as_by_busptr;   /* VTDBus objects indexed by PCIBus* reference */
@@ -59,13 +59,24 @@
 #define HOST_IRQ_STAT             0x08 /* interrupt status */
 #define HOST_PORTS_IMPL           0x0c /* bitmap of implemented ports */
 #define HOST_VERSION              0x10 /* AHCI spec. version compliancy */
+#define HOST_CCC_CTL              0x14 /* command completion coalescing */
+#define HOST_CCC_PORTS            0x18 /* ports taking part in coalescing */
 
 /* HOST_CTL bits */
 #define HOST_CTL_RESET            (1 << 0)  /* reset controller; self-clear */
 #define HOST_CTL_IRQ_EN           (1 << 1)  /* global IRQ enable */
 #define HOST_CTL_AHCI_EN          (1U << 31) /* AHCI enabled */
 
+/* HOST_CCC_CTL bits */
+#define HOST_CCC_CTL_EN           (1 << 0)  /* coalescing enabled */
+#define HOST_CCC_CTL_INT_SHIFT    3         /* IRQ_STAT bit used, RO */
+#define HOST_CCC_CTL_CC_SHIFT     8         /* completions per interrupt */
+#define HOST_CCC_CTL_CC_MASK      (0xff << HOST_CCC_CTL_CC_SHIFT)
+#define HOST_CCC_CTL_TV_SHIFT     16        /* timeout in milliseconds */
+#define HOST_CCC_CTL_TV_MASK      (0xffffU << HOST_CCC_CTL_TV_SHIFT)
+
 /* HOST_CAP bits */
+#define HOST_CAP_CCC              (1 << 7)  /* Command Completion Coalescing */
 #define HOST_CAP_SSC              (1 << 14) /* Slumber capable */
 #define HOST_CAP_AHCI             (1 << 18) /* AHCI only */
 #define HOST_CAP_CLO              (1 << 24) /* Command List Override support */
@@ -216,6 +227,8 @@ typedef struct AHCIControlRegs {
     uint32_t    irqstatus;
     uint32_t    impl;
     uint32_t    version;
+    uint32_t    ccc_ctl;
+    uint32_t    ccc_ports;
 } AHCIControlRegs;
 
 typedef struct AHCIPortRegs {
@@ -298,6 +311,12 @@ typedef struct AHCIState {
     int32_t ports;
     qemu_irq irq;
     AddressSpace *as;
+
+    /* Command completion coalescing */
+    bool ccc;               /* advertise CAP.CCCS */
+    QEMUTimer *ccc_timer;
+    uint32_t ccc_count;     /* completions since the last CCC interrupt */
+    bool ccc_irq;           /* IRQ_STAT bit CCC_CTL.INT is set */
 } AHCIState;
 
 typedef struct AHCIPCIState {
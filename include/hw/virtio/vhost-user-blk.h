@@ -0,0 +1,41 @@
+/*
+ * vhost-user-blk host device
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+#include "standard-headers/linux/virtio_blk.h"
+#include "qemu-common.h"
+#include "hw/qdev.h"
+#include "hw/virtio/vhost.h"
+
+#define TYPE_VHOST_USER_BLK "vhost-user-blk"
+#define VHOST_USER_BLK(obj) \
+        OBJECT_CHECK(VHostUserBlk, (obj), TYPE_VHOST_USER_BLK)
+
+typedef struct VHostUserBlk {
+    VirtIODevice parent_obj;
+
+    /* the socket to the vhost-user backend */
+    CharDriverState *chardev;
+    int32_t bootindex;
+    /* the config space, as reported by the backend */
+    struct virtio_blk_config blkcfg;
+    uint16_t num_queues;
+    uint32_t queue_size;
+    struct vhost_dev dev;
+    /* kept across reconnections, vhost_dev_cleanup() clears dev.vqs */
+    struct vhost_virtqueue *vqs;
+    /* notices the backend going away while no request is in flight */
+    guint watch;
+    bool connected;
+} VHostUserBlk;
+
+#endif
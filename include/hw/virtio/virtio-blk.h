@@ -19,6 +19,7 @@
 #include "hw/block/block.h"
 #include "sysemu/iothread.h"
 #include "sysemu/block-backend.h"
+#include "block/io-trace.h"
 
 #define TYPE_VIRTIO_BLK "virtio-blk-device"
 #define VIRTIO_BLK(obj) \
@@ -39,6 +40,11 @@ struct VirtIOBlkConf
     uint32_t config_wce;
     uint32_t request_merging;
     uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t merge_window_us;
+    uint32_t latency_trace;
+    uint32_t latency_trace_sample;
 };
 
 struct VirtIOBlockDataPlane;
@@ -56,6 +62,16 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    VirtQueueElementPool req_pool;
+    uint64_t host_features;
+    size_t config_size;
+    /* writes held back for up to merge_window_us, shared by all queues */
+    struct MultiReqBuffer *merge_mrb;
+    QEMUTimer *merge_timer;
+    AioContext *merge_timer_ctx;
+    unsigned merge_quiesce_counter; /* nested drained sections */
+    /* latency breakdown of reads and writes, NULL unless latency-trace=on */
+    IOTraceStats *latency;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -70,10 +86,15 @@ typedef struct VirtIOBlockReq {
     struct VirtIOBlockReq *next;
     struct VirtIOBlockReq *mr_next;
     BlockAcctCookie acct;
+    /* only started for traced reads and writes */
+    IOTrace trace;
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
 
+/* Ranges accepted in one discard or write zeroes request */
+#define VIRTIO_BLK_MAX_DISCARD_SEGS 32
+
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
@@ -81,5 +102,6 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_merge_window_flush(VirtIOBlock *s);
 
 #endif
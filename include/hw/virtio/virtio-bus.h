@@ -92,6 +92,12 @@ typedef struct VirtioBusClass {
      */
     int (*ioeventfd_assign)(DeviceState *d, EventNotifier *notifier,
                             int n, bool assign);
+    /*
+     * Returns the address space the device DMAs into when it is behind
+     * an IOMMU (VIRTIO_F_IOMMU_PLATFORM).  Transports that don't
+     * implement it only give the device the system address space.
+     */
+    AddressSpace *(*get_dma_as)(DeviceState *d);
     /*
      * Does the transport have variable vring alignment?
      * (ie can it ever call virtio_queue_set_align()?)
@@ -38,6 +38,8 @@ struct virtio_gpu_simple_resource {
     unsigned int iov_cnt;
     uint32_t scanout_bitmask;
     pixman_image_t *image;
+    /* Changed by transfers and not flushed yet */
+    pixman_region16_t damage;
     QTAILQ_ENTRY(virtio_gpu_simple_resource) next;
 };
 
@@ -50,6 +52,14 @@ struct virtio_gpu_scanout {
     uint32_t resource_id;
     struct virtio_gpu_update_cursor cursor;
     QEMUCursor *current_cursor;
+
+    /* Last arguments of dpy_gl_scanout, tex_id is 0 if none */
+    struct {
+        uint32_t tex_id;
+        bool y_0_top;
+        uint32_t width, height;
+        struct virtio_gpu_rect r;
+    } gl;
 };
 
 struct virtio_gpu_requested_state {
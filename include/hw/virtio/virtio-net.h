@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -36,6 +37,7 @@ typedef struct virtio_net_conf
     int32_t txburst;
     char *tx;
     uint16_t rx_queue_size;
+    char *iothreads;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -50,6 +52,13 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* Filled rx buffers not flushed yet, see virtio_net_rx_flush() */
+    unsigned int rx_pending;
+    /* rx buffer exposed to the backend for zero-copy receive */
+    VirtQueueElement *rx_elem;
+    size_t rx_elem_len;
+    /* IOThread context serving this queue pair, NULL without iothreads */
+    AioContext *ctx;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -96,6 +105,10 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    IOThread **iothreads;
+    uint32_t num_iothreads;
+    bool dataplane_started;
+    bool dataplane_disabled;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -53,9 +53,27 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *iothreads;
 };
 
 struct VirtIOSCSI;
+struct VirtIOSCSIReq;
+
+typedef QTAILQ_HEAD(VirtIOSCSIReqList, VirtIOSCSIReq) VirtIOSCSIReqList;
+
+/* One per IOThread of a dataplane device.  Requests whose target lives in
+ * another IOThread than their virtqueue are queued on the target's
+ * submit list, and handed back on the virtqueue's complete list.
+ */
+typedef struct VirtIOSCSIMailbox {
+    struct VirtIOSCSI *s;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;
+    QemuMutex lock;
+    VirtIOSCSIReqList submit;
+    VirtIOSCSIReqList complete;
+} VirtIOSCSIMailbox;
 
 typedef struct VirtIOSCSICommon {
     VirtIODevice parent_obj;
@@ -76,7 +94,13 @@ typedef struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* context of the control and event queues */
+
+    /* Command queue i runs in mailboxes[i % num_mailboxes], target t in
+     * mailboxes[t % num_mailboxes]; mailboxes[0] is s->ctx.
+     */
+    VirtIOSCSIMailbox *mailboxes;
+    uint32_t num_mailboxes;
 
     bool dataplane_started;
     bool dataplane_starting;
@@ -106,6 +130,7 @@ typedef struct VirtIOSCSIReq {
     };
 
     SCSIRequest *sreq;
+    bool remote;
     size_t resp_size;
     enum SCSIXferMode mode;
     union {
@@ -131,10 +156,18 @@ void virtio_scsi_handle_cmd_vq(VirtIOSCSI *s, VirtQueue *vq);
 void virtio_scsi_handle_ctrl_vq(VirtIOSCSI *s, VirtQueue *vq);
 void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
 void virtio_scsi_free_req(VirtIOSCSIReq *req);
+void virtio_scsi_push_req(VirtIOSCSIReq *req);
+void virtio_scsi_handle_forwarded_reqs(VirtIOSCSI *s, VirtIOSCSIReqList *reqs);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp);
+void virtio_scsi_clear_iothread(VirtIOSCSI *s);
+AioContext *virtio_scsi_target_ctx(VirtIOSCSI *s, int target);
+bool virtio_scsi_dataplane_forward(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                   uint8_t *lun);
+void virtio_scsi_dataplane_return_req(VirtIOSCSIReq *req);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req);
@@ -48,6 +48,10 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    bool zero_copy;
+    /* number of zero copy sends and of the ones the kernel has released */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
@@ -248,4 +252,62 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_set_zero_copy:
+ * @ioc: the socket channel object
+ * @enabled: whether to send without copying the data
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Enable MSG_ZEROCOPY sends on a connected TCP socket, so that
+ * qio_channel_socket_writev_zero_copy() lets the kernel send the
+ * data straight from the caller's pages.  This is only available
+ * on Linux hosts.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 bool enabled,
+                                 Error **errp);
+
+
+/**
+ * qio_channel_socket_writev_zero_copy:
+ * @ioc: the socket channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write all of @iov like qio_channel_writev_all().  If zero copy
+ * was enabled with qio_channel_socket_set_zero_copy(), the kernel
+ * keeps referencing the memory after the call returns: the caller
+ * must not free or reuse it for something else until
+ * qio_channel_socket_flush() has returned.  Data that is changed in
+ * the meantime may be sent in its old or in its new version.
+ *
+ * Returns: 0 if all bytes were written, -1 on error
+ */
+int
+qio_channel_socket_writev_zero_copy(QIOChannelSocket *ioc,
+                                    const struct iovec *iov,
+                                    size_t niov,
+                                    Error **errp);
+
+
+/**
+ * qio_channel_socket_flush:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait until the kernel has released all the memory passed to
+ * qio_channel_socket_writev_zero_copy().  This is a no-op if zero
+ * copy is not enabled.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+qio_channel_socket_flush(QIOChannelSocket *ioc,
+                         Error **errp);
+
+
 #endif /* QIO_CHANNEL_SOCKET_H */
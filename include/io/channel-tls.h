@@ -48,6 +48,11 @@ struct QIOChannelTLS {
     QIOChannel parent;
     QIOChannel *master;
     QCryptoTLSSession *session;
+    /* Directions whose records are handled by the kernel */
+    bool ktls_tx;
+    bool ktls_rx;
+    /* Staging area to send short iovecs in a single record */
+    char *wbuf;
 };
 
 /**
@@ -21,6 +21,7 @@
 #include "migration/vmstate.h"
 #include "qapi-types.h"
 #include "exec/cpu-common.h"
+#include "io/task.h"
 
 #define QEMU_VM_FILE_MAGIC           0x5145564d
 #define QEMU_VM_FILE_VERSION_COMPAT  0x00000002
@@ -51,6 +52,10 @@ enum mig_rp_message_type {
     MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
     MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
 
+    /* data (len: byte, id: string), followed by the bitmap on the stream */
+    MIG_RP_MSG_RECV_BITMAP,
+    MIG_RP_MSG_RESUME_ACK,   /* Postcopy can go on; data (value: be32) */
+
     MIG_RP_MSG_MAX
 };
 
@@ -104,6 +109,21 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     void     *postcopy_tmp_page;
 
+    /* Postcopy preempt channel and the thread loading pages from it */
+    QEMUFile      *postcopy_preempt_file;
+    bool           have_preempt_thread;
+    QemuThread     preempt_thread;
+
+    /* Posted when a new channel arrives in postcopy-paused state */
+    QemuSemaphore  postcopy_pause_sem_dst;
+    /*
+     * Host pages requested from the source, to be asked for again after
+     * a postcopy recovery; and the block of the last request.
+     */
+    QemuMutex      page_request_mutex;
+    GHashTable    *page_requested;
+    RAMBlock      *last_rb;
+
     QEMUBH *bh;
 
     int state;
@@ -135,6 +155,8 @@ struct MigrationState
     QemuThread thread;
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
+    /* Postcopy preempt channel, set once it has connected */
+    QEMUFile *postcopy_qemufile_src;
 
     /* New style params from 'migrate-set-parameters' */
     MigrationParameters parameters;
@@ -148,6 +170,9 @@ struct MigrationState
         QEMUFile     *from_dst_file;
         QemuThread    rp_thread;
         bool          error;
+        /* Posted on RESUME_ACK, or when the thread exits in recovery */
+        QemuSemaphore rp_sem;
+        bool          resume_ack;
     } rp_state;
 
     double mbps;
@@ -171,6 +196,9 @@ struct MigrationState
     /* Flag set once the migration thread is running (and needs joining) */
     bool migration_thread_running;
 
+    /* Posted when a new connection is set up in postcopy-paused state */
+    QemuSemaphore postcopy_pause_sem;
+
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
@@ -189,6 +217,7 @@ void qemu_start_incoming_migration(const char *uri, Error **errp);
 
 void migration_channel_process_incoming(MigrationState *s,
                                         QIOChannel *ioc);
+bool migration_has_all_channels(void);
 
 void migration_tls_channel_process_incoming(MigrationState *s,
                                             QIOChannel *ioc,
@@ -217,10 +246,19 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+int socket_send_channel_create(QIOTaskFunc f, void *data, Error **errp);
+
+void socket_send_channel_cleanup(void);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -228,9 +266,25 @@ void rdma_start_incoming_migration(const char *host_port, Error **errp);
 void migrate_fd_error(MigrationState *s, const Error *error);
 
 void migrate_fd_connect(MigrationState *s);
+void migrate_fd_connect_resume(MigrationState *s, QEMUFile *f);
 
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
+
+typedef enum PrecopyNotifyReason {
+    PRECOPY_NOTIFY_SETUP = 0,
+    PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC = 1,
+    PRECOPY_NOTIFY_AFTER_BITMAP_SYNC = 2,
+    PRECOPY_NOTIFY_CLEANUP = 3,
+} PrecopyNotifyReason;
+
+/*
+ * Notifiers on the RAM save path; the data passed to them points to a
+ * PrecopyNotifyReason.  They are called with the iothread lock held.
+ */
+void precopy_add_notifier(Notifier *n);
+void precopy_remove_notifier(Notifier *n);
+void qemu_guest_free_page_hint(void *addr, size_t len);
 MigrationState *migrate_init(const MigrationParams *params);
 bool migration_is_blocked(Error **errp);
 bool migration_in_setup(MigrationState *);
@@ -246,6 +300,15 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void migrate_load_threads_create(void);
+void migrate_load_threads_join(void);
+int multifd_save_setup(void);
+void multifd_save_shutdown(void);
+void multifd_save_cleanup(void);
+int multifd_load_setup(void);
+void multifd_load_cleanup(void);
+void multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
+bool multifd_recv_all_channels_created(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -264,6 +327,8 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+double xbzrle_mig_cache_hit_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -273,6 +338,14 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+int ram_load_postcopy_preempt(QEMUFile *f, void *tmp_page);
+/* Postcopy recovery */
+bool ram_postcopy_page_received(void *host);
+void ram_postcopy_recv_bitmap_free(void);
+int ram_write_recv_bitmap(QEMUFile *f, const char *block_name);
+int ram_dirty_bitmap_reload(MigrationState *s, QEMUFile *f,
+                            const char *block_name);
+void ram_postcopy_resume_prepare(QEMUFile *f);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -296,6 +369,8 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/* Select the next encoder implementation; only for the unit test */
+bool test_xbzrle_encode_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -307,6 +382,18 @@ int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_multifd(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_dirty_limit(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
+bool migrate_ignore_shared(void);
+int migrate_postcopy_prefetch_pages(void);
+int migrate_device_state_threads(void);
+int migrate_load_threads(void);
+bool migrate_prefault_ram(void);
+MigrationCompressMethod migrate_compress_method(void);
+int migrate_multifd_channels(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
@@ -318,6 +405,9 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
                           uint32_t value);
 void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char* rbname,
                               ram_addr_t start, size_t len);
+void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
+                                 const char *block_name);
+void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
@@ -62,6 +62,10 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
+ * A page that was recently used, or that had cache hits, is not
+ * replaced by a page at another address.  Each refusal uses up one of
+ * its hits.
+ *
  * Returns -1 when the page isn't inserted into cache
  *
  * @cache pointer to the PageCache struct
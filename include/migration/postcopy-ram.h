@@ -96,4 +96,39 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Ask the source for a host page the guest faulted on; the request is
+ * remembered until the page has arrived.
+ */
+void postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
+                           ram_addr_t offset, void *host);
+
+/* Ask again for requested pages that have not arrived, after a recovery */
+void postcopy_resend_page_requests(MigrationIncomingState *mis);
+
+/* First word sent on the postcopy preempt channel */
+#define POSTCOPY_PREEMPT_MAGIC 0x51505043U    /* "QPPC" */
+
+/*
+ * Source: start connecting the postcopy preempt channel; pages requested
+ * by the destination use it once it has connected.
+ */
+void postcopy_preempt_send_setup(MigrationState *ms);
+
+/* Source: close the preempt channel at the end of a migration */
+void postcopy_preempt_send_cleanup(MigrationState *ms);
+
+/* Destination: the preempt channel has connected */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis,
+                                  QIOChannel *ioc);
+
+/*
+ * Destination: start loading pages from the preempt channel, if it has
+ * connected; called once postcopy is listening.
+ */
+void postcopy_preempt_incoming_start(MigrationIncomingState *mis);
+
+/* Destination: close the preempt channel when postcopy pauses */
+void postcopy_preempt_incoming_stop(MigrationIncomingState *mis);
+
 #endif
@@ -102,6 +102,15 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Compress @src_len bytes at @src into at most @dest_len bytes at @dest,
+ * see qemu_put_compression_data().
+ * Returns the compressed size, or -1 on error
+ */
+typedef ssize_t (QEMUFileCompressFunc)(void *opaque, uint8_t *dest,
+                                       size_t dest_len, const uint8_t *src,
+                                       size_t src_len);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -118,9 +127,13 @@ typedef struct QEMUFileHooks {
     QEMURamSaveFunc *save_page;
 } QEMUFileHooks;
 
+/* Default and minimum size of the buffer of a QEMUFile */
+#define QEMU_FILE_MIN_BUFFER_SIZE 32768
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 QEMUFile *qemu_fopen_channel_input(QIOChannel *ioc);
 QEMUFile *qemu_fopen_channel_output(QIOChannel *ioc);
+void qemu_file_set_buffering(QEMUFile *f, size_t size, bool async);
 void qemu_file_set_hooks(QEMUFile *f, const QEMUFileHooks *hooks);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
@@ -151,7 +164,8 @@ size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
 ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level);
+                                  size_t bound, QEMUFileCompressFunc *func,
+                                  void *opaque);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
 /*
@@ -163,6 +177,7 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, int64_t size);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
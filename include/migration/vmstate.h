@@ -214,6 +214,13 @@ struct VMStateDescription {
     bool (*needed)(void *opaque);
     VMStateField *fields;
     const VMStateDescription **subsections;
+    /*
+     * May be saved by a device-state-threads worker, concurrently with
+     * other devices.  Only set this if the pre_save hooks of the
+     * description, its subsections and the structs it embeds touch
+     * nothing but the state being saved.
+     */
+    bool thread_safe_save;
 };
 
 extern const VMStateDescription vmstate_dummy;
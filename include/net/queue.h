@@ -25,6 +25,7 @@
 #define QEMU_NET_QUEUE_H
 
 #include "qemu-common.h"
+#include "qapi-types.h"
 
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
@@ -72,5 +73,7 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
+bool qemu_net_queue_empty(NetQueue *queue);
+void qemu_net_queue_get_info(NetQueue *queue, NetQueueInfo *info);
 
 #endif /* QEMU_NET_QUEUE_H */
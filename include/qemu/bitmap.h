@@ -34,6 +34,7 @@
  * bitmap_intersects(src1, src2, nbits)         Do *src1 and *src2 overlap?
  * bitmap_empty(src, nbits)			Are all bits zero in *src?
  * bitmap_full(src, nbits)			Are all bits set in *src?
+ * bitmap_count_one(src, nbits)                 Number of bits set in *src
  * bitmap_set(dst, pos, nbits)			Set specified bit area
  * bitmap_set_atomic(dst, pos, nbits)   Set specified bit area with atomic ops
  * bitmap_clear(dst, pos, nbits)		Clear specified bit area
@@ -68,6 +69,7 @@
 
 int slow_bitmap_empty(const unsigned long *bitmap, long bits);
 int slow_bitmap_full(const unsigned long *bitmap, long bits);
+long slow_bitmap_count_one(const unsigned long *bitmap, long bits);
 int slow_bitmap_equal(const unsigned long *bitmap1,
                       const unsigned long *bitmap2, long bits);
 void slow_bitmap_complement(unsigned long *dst, const unsigned long *src,
@@ -206,6 +208,15 @@ static inline int bitmap_full(const unsigned long *src, long nbits)
     }
 }
 
+static inline long bitmap_count_one(const unsigned long *src, long nbits)
+{
+    if (small_nbits(nbits)) {
+        return ctpopl(*src & BITMAP_LAST_WORD_MASK(nbits));
+    } else {
+        return slow_bitmap_count_one(src, nbits);
+    }
+}
+
 static inline int bitmap_intersects(const unsigned long *src1,
                                     const unsigned long *src2, long nbits)
 {
@@ -106,6 +106,14 @@ bool qemu_in_coroutine(void);
  */
 bool qemu_coroutine_entered(Coroutine *co);
 
+/**
+ * Get or set the latency trace of the I/O request that @co runs
+ *
+ * New coroutines start without one; see include/block/io-trace.h.
+ */
+IOTrace *qemu_coroutine_get_io_trace(Coroutine *co);
+void qemu_coroutine_set_io_trace(Coroutine *co, IOTrace *trace);
+
 
 /**
  * CoQueues are a mechanism to queue coroutines in order to continue executing
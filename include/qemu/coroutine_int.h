@@ -28,7 +28,14 @@
 #include "qemu/queue.h"
 #include "qemu/coroutine.h"
 
+/* Only the pages a coroutine actually touches become resident; the stack
+ * is mmap()ed and preceded by a guard page (see qemu_alloc_stack).
+ */
+#ifdef CONFIG_COROUTINE_STACK_SIZE
+#define COROUTINE_STACK_SIZE CONFIG_COROUTINE_STACK_SIZE
+#else
 #define COROUTINE_STACK_SIZE (1 << 20)
+#endif
 
 typedef enum {
     COROUTINE_YIELD = 1,
@@ -42,6 +49,7 @@ struct Coroutine {
     Coroutine *caller;
     QSLIST_ENTRY(Coroutine) pool_next;
     size_t locks_held;
+    IOTrace *io_trace;
 
     /* Coroutines that should be woken up when we yield or terminate */
     QSIMPLEQ_HEAD(, Coroutine) co_queue_wakeup;
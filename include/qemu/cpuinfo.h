@@ -0,0 +1,45 @@
+/*
+ * Host CPU features
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUINFO_H
+#define QEMU_CPUINFO_H
+
+/*
+ * Features of the host CPU, used by hot loops (buffer_is_zero, XBZRLE,
+ * crc32c, ...) to pick an accelerated implementation at startup.  Each
+ * of them keeps a mask of the implementations usable on this host, and
+ * a test_*_next_accel() function that tests can use to go through all of
+ * them.
+ *
+ * Only features that the operating system has enabled are reported,
+ * e.g. AVX2 is not reported if the OS does not save the YMM registers.
+ */
+#define CPUINFO_ALWAYS      (1u << 0)   /* cpuinfo_init has run */
+#define CPUINFO_SSE2        (1u << 1)
+#define CPUINFO_SSE4_1      (1u << 2)
+#define CPUINFO_SSE4_2      (1u << 3)
+#define CPUINFO_PCLMUL      (1u << 4)
+#define CPUINFO_AVX2        (1u << 5)
+#define CPUINFO_AVX512F     (1u << 6)
+#define CPUINFO_AVX512BW    (1u << 7)
+#define CPUINFO_NEON        (1u << 8)
+#define CPUINFO_CRC32       (1u << 9)   /* ARMv8 CRC32 instructions */
+#define CPUINFO_AES         (1u << 10)  /* AES-NI or ARMv8 AES */
+#define CPUINFO_PMULL       (1u << 11)  /* ARMv8 64-bit PMULL */
+
+extern unsigned cpuinfo;
+
+/*
+ * Detect the host features, if not done yet, and return them.  This can
+ * be called from constructors, which may run before the one that
+ * initializes @cpuinfo.
+ */
+unsigned cpuinfo_init(void);
+
+#endif
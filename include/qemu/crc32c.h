@@ -31,5 +31,6 @@
 #include "qemu-common.h"
 
 uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
+bool test_crc32c_next_accel(void);
 
 #endif
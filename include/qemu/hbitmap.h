@@ -81,6 +81,9 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size);
  * Merge two bitmaps together.
  * A := A (BITOR) B.
  * B is left unmodified.
+ *
+ * When B is sparse only its nonzero words are visited; otherwise large
+ * bitmaps are merged in ranges by several threads.
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b);
 
@@ -145,6 +148,119 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Granularity of serialization chunks, used by other serialization functions.
+ * For every chunk:
+ * 1. Chunk start should be aligned to this granularity.
+ * 2. Chunk size should be aligned too, except for last chunk (for which
+ *      start + count == hb->size)
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: Starting bit
+ * @count: Number of bits
+ *
+ * Return number of bytes hbitmap_(de)serialize_part needs
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store serialized bitmap.
+ * @start: First bit to store.
+ * @count: Number of bits to store.
+ *
+ * Stores HBitmap data corresponding to given region.  The format of saved
+ * data is linear sequence of bits, so it can be used by
+ * hbitmap_deserialize_part independently of endianness and size of
+ * HBitmap level array elements.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to restore bitmap data from.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ *
+ * Restores HBitmap data corresponding to given region.  The format is the
+ * same as for hbitmap_serialize_part.  Only the last level is updated;
+ * call hbitmap_deserialize_finish once all parts have been restored.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_zeroes
+ * @hb: HBitmap to operate on.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ *
+ * Fills the bitmap with zeroes, as if a buffer of zeroes had been passed to
+ * hbitmap_deserialize_part.
+ */
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_ones
+ * @hb: HBitmap to operate on.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ *
+ * Fills the bitmap with ones, as if a buffer of 0xff bytes had been passed to
+ * hbitmap_deserialize_part.
+ */
+void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_finish
+ * @hb: HBitmap to operate on.
+ *
+ * Repair HBitmap after calling hbitmap_deserialize_part/_zeroes/_ones:
+ * rebuild the upper levels and recompute the number of set bits.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
+/**
+ * hbitmap_serialize_compact
+ * @hb: HBitmap to operate on.
+ * @size: Location to store the size of the returned buffer.
+ *
+ * Serialize the whole HBitmap in a format that only stores the nonzero
+ * parts of the hbitmap_serialize_part format, so that its size depends
+ * on the number of set bits rather than on the size of the bitmap.  The
+ * result is independent of endianness and word size, and is empty for an
+ * empty bitmap.
+ *
+ * Return the serialized data, to be freed with g_free.
+ */
+uint8_t *hbitmap_serialize_compact(const HBitmap *hb, size_t *size);
+
+/**
+ * hbitmap_deserialize_compact
+ * @hb: HBitmap to operate on.
+ * @buf: Data produced by hbitmap_serialize_compact.
+ * @size: Size of @buf.
+ *
+ * Replace the contents of @hb with those stored in @buf, which must come
+ * from a bitmap of the same size and granularity.  There is no need to
+ * call hbitmap_deserialize_finish.
+ *
+ * Return 0 on success, or -EINVAL if @buf is malformed, in which case
+ * @hb is left empty.
+ */
+int hbitmap_deserialize_compact(HBitmap *hb, uint8_t *buf, size_t size);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
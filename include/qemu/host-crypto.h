@@ -0,0 +1,51 @@
+/*
+ * Host AES and carry-less multiplication instructions
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_HOST_CRYPTO_H
+#define QEMU_HOST_CRYPTO_H
+
+/*
+ * Building blocks for the TCG helpers that emulate the guest's own AES
+ * and polynomial multiply instructions.  The AES functions behave like
+ * the x86 AES-NI instructions of the same name and take 16-byte blocks
+ * in AES byte order (the first byte of the state at the lowest address),
+ * which is also the layout of a little-endian vector register.
+ *
+ * The functions may only be called if the corresponding HOST_CRYPTO_*
+ * bit is set in @host_crypto.  On hosts without support @host_crypto is
+ * the constant 0, so the fallback paths of the callers compile away.
+ */
+#define HOST_CRYPTO_AES     1
+#define HOST_CRYPTO_CLMUL   2
+
+#if (defined(CONFIG_AVX2_OPT) || \
+     (defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO))) && \
+    !defined(HOST_WORDS_BIGENDIAN)
+#define HOST_CRYPTO_OPT
+extern unsigned host_crypto;
+#else
+#define host_crypto 0u
+#endif
+
+void host_aesenc(void *d, const void *st, const void *rk);
+void host_aesenclast(void *d, const void *st, const void *rk);
+void host_aesdec(void *d, const void *st, const void *rk);
+void host_aesdeclast(void *d, const void *st, const void *rk);
+void host_aesimc(void *d, const void *st);
+
+/* r[1]:r[0] = carry-less product of @a and @b */
+void host_clmul64(uint64_t r[2], uint64_t a, uint64_t b);
+
+/*
+ * Disable the next host feature, so that tests can exercise the
+ * fallbacks.  Returns false if the fallbacks are already in use.
+ */
+bool test_host_crypto_next_accel(void);
+
+#endif
@@ -136,15 +136,27 @@ size_t iov_discard_front(struct iovec **iov, unsigned int *iov_cnt,
 size_t iov_discard_back(struct iovec *iov, unsigned int *iov_cnt,
                         size_t bytes);
 
+/* Number of elements stored in QEMUIOVector itself */
+#define QEMU_IOVEC_INLINE 4
+
+/*
+ * @nalloc is -1 when @iov is not owned by the vector, i.e. for
+ * qemu_iovec_init_external() and for slices that reference the array
+ * of their source.  Short vectors use @local_iov instead of allocating
+ * memory, so a QEMUIOVector must not be copied by value.
+ */
 typedef struct QEMUIOVector {
     struct iovec *iov;
     int niov;
     int nalloc;
     size_t size;
+    struct iovec local_iov[QEMU_IOVEC_INLINE];
 } QEMUIOVector;
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint);
 void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov);
+void qemu_iovec_init_slice(QEMUIOVector *qiov, QEMUIOVector *src,
+                           size_t offset, size_t bytes);
 void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len);
 void qemu_iovec_concat(QEMUIOVector *dst,
                        QEMUIOVector *src, size_t soffset, size_t sbytes);
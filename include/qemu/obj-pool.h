@@ -0,0 +1,63 @@
+/*
+ * Pools of fixed-size objects
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#ifndef QEMU_OBJ_POOL_H
+#define QEMU_OBJ_POOL_H
+
+#include "qemu/queue.h"
+
+/*
+ * An ObjPool caches freed objects of up to @size bytes so that hot paths
+ * (e.g. one allocation per guest I/O request) do not go through malloc.
+ *
+ * Like the coroutine pool, every thread has a private free list that is
+ * used without atomic operations; objects freed by other threads (e.g.
+ * thread pool workers) go into a shared release list, which is moved to
+ * the allocating thread's free list @batch objects at a time.
+ *
+ * Pools are meant to be statically allocated with OBJ_POOL_INITIALIZER and
+ * are never destroyed.  Objects can be freed from any thread; the pool
+ * they came from is remembered in a small header in front of them.
+ */
+
+typedef struct ObjPoolHeader ObjPoolHeader;
+
+typedef struct ObjPool {
+    size_t size;
+    unsigned int batch;
+
+    /* private */
+    int id;
+    QSLIST_HEAD(, ObjPoolHeader) release;
+    unsigned int release_size;
+} ObjPool;
+
+#define OBJ_POOL_INITIALIZER(_size, _batch) \
+    { .size = (_size), .batch = (_batch) }
+
+/**
+ * obj_pool_alloc:
+ * @pool: the pool to allocate from
+ * @size: the size of the object
+ *
+ * Return an uninitialized object of @size bytes.  If @size is larger than
+ * the object size of @pool, the object is allocated with g_malloc and not
+ * recycled when freed.
+ */
+void *obj_pool_alloc(ObjPool *pool, size_t size);
+
+/**
+ * obj_pool_free:
+ * @obj: an object returned by obj_pool_alloc, or %NULL
+ *
+ * Return @obj to the pool it was allocated from.
+ */
+void obj_pool_free(void *obj);
+
+#endif
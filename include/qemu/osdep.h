@@ -239,6 +239,11 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #else
 #define QEMU_MADV_NOHUGEPAGE QEMU_MADV_INVALID
 #endif
+#ifdef MADV_POPULATE_WRITE
+#define QEMU_MADV_POPULATE_WRITE MADV_POPULATE_WRITE
+#else
+#define QEMU_MADV_POPULATE_WRITE QEMU_MADV_INVALID
+#endif
 
 #elif defined(CONFIG_POSIX_MADVISE)
 
@@ -251,6 +256,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_DONTDUMP QEMU_MADV_INVALID
 #define QEMU_MADV_HUGEPAGE  QEMU_MADV_INVALID
 #define QEMU_MADV_NOHUGEPAGE  QEMU_MADV_INVALID
+#define QEMU_MADV_POPULATE_WRITE QEMU_MADV_INVALID
 
 #else /* no-op */
 
@@ -263,6 +269,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_DONTDUMP QEMU_MADV_INVALID
 #define QEMU_MADV_HUGEPAGE  QEMU_MADV_INVALID
 #define QEMU_MADV_NOHUGEPAGE  QEMU_MADV_INVALID
+#define QEMU_MADV_POPULATE_WRITE QEMU_MADV_INVALID
 
 #endif
 
@@ -383,7 +390,29 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz, Error **errp);
+/**
+ * os_mem_prealloc:
+ * @fd: file descriptor backing @area, or -1 for anonymous memory
+ * @area: start of the memory to preallocate
+ * @sz: size of @area in bytes
+ * @max_threads: number of threads touching the pages in parallel,
+ *               or 0 to pick one from the number of host CPUs
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Fault in every page of @area so that running out of host memory
+ * is reported now rather than when the guest first touches the page.
+ */
+void os_mem_prealloc(int fd, char *area, size_t sz, int max_threads,
+                     Error **errp);
+
+/**
+ * os_mem_populate:
+ *
+ * Like os_mem_prealloc(), but keep the contents of @area, which may be
+ * in use, e.g. by running vCPUs.  Every page is faulted in for writing.
+ */
+void os_mem_populate(int fd, char *area, size_t sz, int max_threads,
+                     Error **errp);
 
 int qemu_read_password(char *buf, int buf_size);
 
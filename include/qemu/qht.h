@@ -13,7 +13,7 @@
 
 struct qht {
     struct qht_map *map;
-    QemuMutex lock; /* serializes setters of ht->map */
+    QemuMutex lock; /* serializes setters of ht->map and bucket moves */
     unsigned int mode;
 };
 
@@ -42,7 +42,11 @@ struct qht_stats {
 typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
 typedef void (*qht_iter_func_t)(struct qht *ht, void *p, uint32_t h, void *up);
 
-#define QHT_MODE_AUTO_RESIZE 0x1 /* auto-resize when heavily loaded */
+/*
+ * Auto-resize when heavily loaded.  The resize is incremental: each
+ * subsequent insertion or removal moves a batch of buckets to the new map.
+ */
+#define QHT_MODE_AUTO_RESIZE 0x1
 
 /**
  * qht_init - Initialize a QHT
@@ -146,6 +150,9 @@ bool qht_reset_size(struct qht *ht, size_t n_elems);
  * @ht: QHT to be resized
  * @n_elems: number of entries the resized hash table should be optimized for
  *
+ * Writers are not blocked while the entries are moved to the new buckets,
+ * except briefly when they write to the bucket being moved.
+ *
  * Returns true on success.
  * Returns false if the resize was not necessary and therefore not performed.
  * See also: qht_reset_size().
@@ -55,6 +55,8 @@ extern unsigned long rcu_gp_ctr;
 
 extern QemuEvent rcu_gp_event;
 
+struct rcu_head;
+
 struct rcu_reader_data {
     /* Data used by both reader and synchronize_rcu() */
     unsigned long ctr;
@@ -65,6 +67,10 @@ struct rcu_reader_data {
 
     /* Data used for registry, protected by rcu_registry_lock */
     QLIST_ENTRY(rcu_reader_data) node;
+    bool registered;
+
+    /* Callbacks queued by this thread, stolen by the call_rcu thread */
+    struct rcu_head *cbs;
 };
 
 extern __thread struct rcu_reader_data rcu_reader;
@@ -100,6 +106,13 @@ static inline void rcu_read_unlock(void)
 
 extern void synchronize_rcu(void);
 
+/*
+ * Like synchronize_rcu(), but busy waits for a while for the readers to
+ * leave their critical sections instead of sleeping right away.  This
+ * trades CPU time for latency.
+ */
+extern void synchronize_rcu_expedited(void);
+
 /*
  * Reader thread registration.
  */
@@ -117,6 +130,13 @@ struct rcu_head {
 
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 
+/*
+ * Wait until all callbacks queued with call_rcu() before the call have run,
+ * without the usual batching delay.  Callbacks run under the iothread lock,
+ * so the caller must not hold it.
+ */
+extern void drain_call_rcu(void);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
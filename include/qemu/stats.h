@@ -0,0 +1,59 @@
+/*
+ * Statistics registry for query-stats
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_STATS_H
+#define QEMU_STATS_H
+
+#include "qapi-types.h"
+
+/*
+ * A subsystem registers a provider once, at initialization.  When the
+ * statistics are queried, the provider's callback walks its instances
+ * (block backends, net clients, vCPUs, ...) and reports the current value
+ * of its counters for each of them.  The callback only reads counters
+ * that the subsystem maintains anyway, so that polling is cheap.
+ *
+ * Providers are registered and called with the global mutex held.
+ */
+
+typedef struct StatsCollector StatsCollector;
+
+typedef void StatsProviderFunc(StatsCollector *c, void *opaque);
+
+void stats_register_provider(const char *name, StatsProviderFunc *fn,
+                             void *opaque);
+
+/*
+ * Start reporting the statistics of @instance.  Returns false if the query
+ * filters it out; the provider can then skip it, though the stats_add_*()
+ * functions ignore statistics of filtered out instances in any case.
+ */
+bool stats_begin_instance(StatsCollector *c, const char *instance);
+
+/* Whether the statistic @name of the current instance is wanted */
+bool stats_wanted(StatsCollector *c, const char *name);
+
+void stats_add_counter(StatsCollector *c, const char *name, uint64_t value);
+void stats_add_gauge(StatsCollector *c, const char *name, int64_t value);
+
+/*
+ * Add a histogram with @nbins bins, separated by the @nbins - 1 increasing
+ * values in @boundaries.
+ */
+void stats_add_histogram(StatsCollector *c, const char *name, int nbins,
+                         const uint64_t *boundaries, const uint64_t *bins);
+
+/*
+ * Collect the statistics of all providers.  Each filter is a list of
+ * glob patterns, NULL to match everything.
+ */
+StatsResultList *stats_query(strList *providers, strList *instances,
+                             strList *names);
+
+#endif
@@ -55,6 +55,14 @@ void qemu_thread_create(QemuThread *thread, const char *name,
 void *qemu_thread_join(QemuThread *thread);
 void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
+
+/*
+ * Restrict @thread to the host CPUs in @cpus, a list of CPU numbers and
+ * ranges such as "0-3,8".  Returns 0 on success, -EINVAL if @cpus cannot
+ * be parsed and another negative errno value if the host refuses it (in
+ * particular -ENOTSUP where thread affinity is not supported).
+ */
+int qemu_thread_set_affinity(QemuThread *thread, const char *cpus);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
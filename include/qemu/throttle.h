@@ -151,6 +151,11 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+double throttle_op_units(uint64_t op_size, uint64_t size);
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 
+void throttle_unaccount(ThrottleState *ts, bool is_write, uint64_t size,
+                        double units);
+
 #endif
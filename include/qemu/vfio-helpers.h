@@ -0,0 +1,53 @@
+/*
+ * VFIO utility
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VFIO_HELPERS_H
+#define QEMU_VFIO_HELPERS_H
+
+#include "qemu/typedefs.h"
+
+/*
+ * Helpers for drivers that run a PCI device from userspace through VFIO,
+ * without a guest device model in between (e.g. block/nvme.c).  Each
+ * QEMUVFIOState owns its own container, so the IOVA space is private to
+ * the device.
+ */
+
+typedef struct QEMUVFIOState QEMUVFIOState;
+
+/* Open the PCI device at @device, a "DDDD:BB:DD.F" address */
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp);
+void qemu_vfio_close(QEMUVFIOState *s);
+
+/*
+ * Make @size bytes at @host (both page aligned) accessible to the device
+ * and return the bus address in @iova.
+ *
+ * Fixed mappings stay until qemu_vfio_dma_unmap.  Temporary mappings are
+ * meant for buffers that change on every request; they are not tracked
+ * and are only released, all at once, by qemu_vfio_dma_reset_temporary.
+ * The caller must make sure that the device does not access them any
+ * more by then.  Returns -ENOMEM when the IOVA space is exhausted.
+ */
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova);
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host);
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s);
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size,
+                            Error **errp);
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size);
+
+/* Route interrupt @irq_type (e.g. VFIO_PCI_MSIX_IRQ_INDEX) to @e */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp);
+
+#endif
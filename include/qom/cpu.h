@@ -226,7 +226,9 @@ struct CPUWatchpoint {
 };
 
 struct KVMState;
+struct KVMExitStats;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -344,6 +346,9 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    struct KVMExitStats *kvm_exit_stats;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate, TRACE_VCPU_EVENT_COUNT);
@@ -362,6 +367,14 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Per-vcpu throttle set by cpu_throttle_set_vcpu, 0 if none */
+    int throttle_percentage;
+    /* Pages this vcpu moved from clean to dirty in the migration dirty
+     * bitmap; only maintained by TCG, see notdirty_mem_write.
+     */
+    unsigned int dirty_pages;
+    /* Pages per second dirtied in the last migration sync period */
+    uint64_t dirty_pages_rate;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -725,6 +738,27 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time, 1 to 99, or 0 to stop throttling
+ * this vcpu.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  A vcpu sleeps for the larger
+ * of its own percentage and the one set with cpu_throttle_set.
+ * cpu_throttle_stop clears the percentage of every vcpu.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to query.
+ *
+ * Returns: The throttle percentage currently applied to @cpu, 0 if it
+ * is not throttled.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
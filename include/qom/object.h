@@ -358,7 +358,7 @@ typedef void (ObjectUnparent)(Object *obj);
  */
 typedef void (ObjectFree)(void *obj);
 
-#define OBJECT_CLASS_CAST_CACHE 4
+#define OBJECT_CLASS_CAST_CACHE 8
 
 /**
  * ObjectClass:
@@ -58,6 +58,13 @@ typedef struct BlockDevOps {
      * Runs when the size changed (e.g. monitor command block_resize)
      */
     void (*resize_cb)(void *opaque);
+    /*
+     * Runs when the root node enters or leaves a drained section.  Users
+     * that submit requests of their own, such as block jobs, must stop
+     * doing so until the section ends.
+     */
+    void (*drained_begin)(void *opaque);
+    void (*drained_end)(void *opaque);
 } BlockDevOps;
 
 /* This struct is embedded in (the private) BlockBackend struct and contains
@@ -76,6 +83,17 @@ typedef struct BlockBackendPublic {
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
     QLIST_ENTRY(BlockBackendPublic) round_robin;
+
+    /* The following fields are only used by this BlockBackend's own
+     * requests.  throttle_credit_* have already been accounted to the
+     * group, see THROTTLE_GROUP_BATCH in block/throttle-groups.c */
+    uint64_t       throttle_credit_bytes[2];
+    double         throttle_credit_units[2];
+    uint64_t       throttle_credit_op_size;
+    unsigned       throttle_credit_gen;
+    uint64_t       throttle_served[2];      /* requests let through */
+    uint64_t       throttle_delayed[2];     /* ... of which had to wait */
+    uint64_t       throttle_wait_ns[2];     /* total time spent waiting */
 } BlockBackendPublic;
 
 BlockBackend *blk_new(void);
@@ -111,6 +129,7 @@ int blk_attach_dev(BlockBackend *blk, DeviceState *dev);
 void blk_attach_dev_legacy(BlockBackend *blk, void *dev);
 void blk_detach_dev(BlockBackend *blk, void *dev);
 void *blk_get_attached_dev(BlockBackend *blk);
+unsigned long blk_guest_bytes(void);
 BlockBackend *blk_by_dev(void *dev);
 BlockBackend *blk_by_qdev_id(const char *id, Error **errp);
 void blk_set_dev_ops(BlockBackend *blk, const BlockDevOps *ops, void *opaque);
@@ -205,6 +224,9 @@ void *blk_aio_get(const AIOCBInfo *aiocb_info, BlockBackend *blk,
                   BlockCompletionFunc *cb, void *opaque);
 int coroutine_fn blk_co_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                                       int count, BdrvRequestFlags flags);
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags);
 int blk_pwrite_compressed(BlockBackend *blk, int64_t offset, const void *buf,
                           int count);
 int blk_truncate(BlockBackend *blk, int64_t offset);
@@ -110,6 +110,19 @@ struct CharDriverState {
     int mux_idx;
     guint fd_in_tag;
     bool replay;
+    /* Ring of output that the backend did not take yet, if enabled */
+    uint8_t *wbuf;
+    uint32_t wbuf_size;
+    uint32_t wbuf_head;
+    uint32_t wbuf_num;
+    ChardevWriteBufferPolicy wbuf_policy;
+    guint wbuf_tag;
+    /* Flow control statistics */
+    uint64_t bytes_written;
+    uint64_t bytes_dropped;
+    uint64_t bytes_overwritten;
+    uint64_t write_stalls;
+    uint64_t wbuf_flushes;
     DECLARE_BITMAP(features, QEMU_CHAR_FEATURE_LAST);
     QTAILQ_ENTRY(CharDriverState) next;
 };
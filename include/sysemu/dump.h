@@ -177,6 +177,7 @@ typedef struct DumpState {
     off_t offset_page;          /* offset of page part in vmcore */
     size_t num_dumpable;        /* number of page that can be dumped */
     uint32_t flag_compress;     /* indicate the compression format */
+    int compress_threads;       /* threads compressing the pages */
     DumpStatus status;          /* current dump status */
 
     bool has_format;              /* whether format is provided */
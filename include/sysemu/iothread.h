@@ -28,6 +28,18 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+    int64_t start_ns;           /* get_clock() when the thread started */
+    char *cpu_affinity;         /* host CPU list, or NULL */
+
+    /* AioContext poll parameters */
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Thread pool parameters */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+    int64_t thread_pool_node;
 } IOThread;
 
 #define IOTHREAD(obj) \
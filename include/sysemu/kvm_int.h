@@ -9,6 +9,7 @@
 #ifndef QEMU_KVM_INT_H
 #define QEMU_KVM_INT_H
 
+#include "qemu/thread.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/accel.h"
 #include "sysemu/kvm.h"
@@ -18,12 +19,18 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    /* start of the slot in ram_addr_t space, for dirty ring entries */
+    ram_addr_t ram_start_offset;
     int slot;
     int flags;
+    /* dirty pages fetched from KVM and not yet cleared (manual protect) */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
     MemoryListener listener;
+    /* protects the slots, log_clear runs outside the iothread lock */
+    QemuMutex slots_lock;
     KVMSlot *slots;
     int as_id;
 } KVMMemoryListener;
@@ -102,7 +102,20 @@ struct SimpleSpiceDisplay {
      * to them must be protected by the lock.
      */
     QemuMutex lock;
-    QTAILQ_HEAD(, SimpleSpiceUpdate) updates;
+    QTAILQ_HEAD(SimpleSpiceUpdateList, SimpleSpiceUpdate) updates;
+
+    /*
+     * update thread: diffs the guest surface against the mirror and
+     * builds the updates.  While update_busy it owns the mirror and
+     * works on update_rect of update_surface.
+     */
+    QemuThread update_thread;
+    QemuCond update_cond;
+    bool update_thread_started;
+    bool update_busy;
+    QXLRect update_rect;
+    pixman_image_t *update_surface;
+    pixman_image_t *update_mirror;
 
     /* cursor (without qxl): displaychangelistener -> spice server */
     SimpleSpiceCursor *ptr_define;
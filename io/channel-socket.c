@@ -24,6 +24,15 @@
 #include "io/channel-watch.h"
 #include "trace.h"
 #include "qapi/clone-visitor.h"
+#include "qemu/iov.h"
+
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+#endif
 
 #define SOCKET_MAX_FDS 16
 
@@ -654,6 +663,175 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 }
 #endif /* WIN32 */
 
+#ifdef QEMU_MSG_ZEROCOPY
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 bool enabled,
+                                 Error **errp)
+{
+    int v = 1;
+
+    if (!enabled) {
+        /* The kernel may still reference memory of earlier sends */
+        if (qio_channel_socket_flush(ioc, errp) < 0) {
+            return -1;
+        }
+        ioc->zero_copy = false;
+        return 0;
+    }
+
+    if (qemu_setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY,
+                        &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno,
+                         "Unable to enable zero copy on socket");
+        return -1;
+    }
+    ioc->zero_copy = true;
+    return 0;
+}
+
+int
+qio_channel_socket_writev_zero_copy(QIOChannelSocket *ioc,
+                                    const struct iovec *iov,
+                                    size_t niov,
+                                    Error **errp)
+{
+    int ret = -1;
+    struct iovec *local_iov;
+    struct iovec *local_iov_head;
+    unsigned int nlocal_iov;
+
+    if (!ioc->zero_copy) {
+        return qio_channel_writev_all(QIO_CHANNEL(ioc), iov, niov, errp);
+    }
+
+    local_iov = local_iov_head = g_new(struct iovec, niov);
+    nlocal_iov = iov_copy(local_iov, niov, iov, niov, 0, iov_size(iov, niov));
+
+    while (nlocal_iov > 0) {
+        struct msghdr msg = { NULL, };
+        int flags = MSG_ZEROCOPY;
+        ssize_t len;
+
+    retry:
+        msg.msg_iov = local_iov;
+        msg.msg_iovlen = nlocal_iov;
+        len = sendmsg(ioc->fd, &msg, flags);
+        if (len < 0) {
+            if (errno == EINTR) {
+                goto retry;
+            }
+            if (errno == EAGAIN) {
+                qio_channel_wait(QIO_CHANNEL(ioc), G_IO_OUT);
+                goto retry;
+            }
+            if (errno == ENOBUFS) {
+                /* The kernel limits how much memory a socket may pin.
+                 * Wait for the earlier sends to release theirs, or
+                 * copy this one if there is nothing to wait for.
+                 */
+                if (ioc->zero_copy_sent == ioc->zero_copy_queued) {
+                    flags = 0;
+                } else if (qio_channel_socket_flush(ioc, errp) < 0) {
+                    goto cleanup;
+                }
+                goto retry;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to write to socket");
+            goto cleanup;
+        }
+        if (flags & MSG_ZEROCOPY) {
+            ioc->zero_copy_queued++;
+        }
+
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+    }
+
+    ret = 0;
+
+ cleanup:
+    g_free(local_iov_head);
+    return ret;
+}
+
+int
+qio_channel_socket_flush(QIOChannelSocket *ioc,
+                         Error **errp)
+{
+    while (ioc->zero_copy_sent < ioc->zero_copy_queued) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = { NULL, };
+        struct sock_extended_err *serr;
+        struct cmsghdr *cmsg;
+        ssize_t ret;
+
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(ioc->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                /* Completions are queued as socket errors */
+                qio_channel_wait(QIO_CHANNEL(ioc), G_IO_ERR | G_IO_HUP);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to read socket error queue");
+            return -1;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg) {
+            error_setg(errp, "Missing zero copy completion");
+            return -1;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+            serr->ee_errno != 0) {
+            error_setg_errno(errp, serr->ee_errno,
+                             "Zero copy send failed");
+            return -1;
+        }
+
+        /* Sends ee_info to ee_data (both included) have completed */
+        ioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+    }
+    return 0;
+}
+#else /* ! QEMU_MSG_ZEROCOPY */
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 bool enabled,
+                                 Error **errp)
+{
+    if (enabled) {
+        error_setg(errp, "Zero copy sends are not supported on this host");
+        return -1;
+    }
+    return 0;
+}
+
+int
+qio_channel_socket_writev_zero_copy(QIOChannelSocket *ioc,
+                                    const struct iovec *iov,
+                                    size_t niov,
+                                    Error **errp)
+{
+    return qio_channel_writev_all(QIO_CHANNEL(ioc), iov, niov, errp);
+}
+
+int
+qio_channel_socket_flush(QIOChannelSocket *ioc,
+                         Error **errp)
+{
+    return 0;
+}
+#endif /* ! QEMU_MSG_ZEROCOPY */
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
@@ -21,8 +21,13 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
+#include "qemu/iov.h"
 #include "trace.h"
 
+/* Maximum payload of a TLS record */
+#define QIO_CHANNEL_TLS_RECORD_SIZE 16384
+
 
 static ssize_t qio_channel_tls_write_handler(const char *buf,
                                              size_t len,
@@ -167,6 +172,12 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             goto cleanup;
         }
         trace_qio_channel_tls_credentials_allow(ioc);
+        if (object_dynamic_cast(OBJECT(ioc->master),
+                                TYPE_QIO_CHANNEL_SOCKET)) {
+            qcrypto_tls_session_enable_ktls(
+                ioc->session, QIO_CHANNEL_SOCKET(ioc->master)->fd,
+                &ioc->ktls_tx, &ioc->ktls_rx);
+        }
         qio_task_complete(task);
     } else {
         GIOCondition condition;
@@ -231,6 +242,7 @@ static void qio_channel_tls_finalize(Object *obj)
 
     object_unref(OBJECT(ioc->master));
     qcrypto_tls_session_free(ioc->session);
+    g_free(ioc->wbuf);
 }
 
 
@@ -245,6 +257,10 @@ static ssize_t qio_channel_tls_readv(QIOChannel *ioc,
     size_t i;
     ssize_t got = 0;
 
+    if (tioc->ktls_rx) {
+        return qio_channel_readv(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_read(tioc->session,
                                                iov[i].iov_base,
@@ -279,13 +295,37 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
                                       Error **errp)
 {
     QIOChannelTLS *tioc = QIO_CHANNEL_TLS(ioc);
-    size_t i;
+    size_t i, n;
     ssize_t done = 0;
 
-    for (i = 0 ; i < niov ; i++) {
-        ssize_t ret = qcrypto_tls_session_write(tioc->session,
-                                                iov[i].iov_base,
-                                                iov[i].iov_len);
+    if (tioc->ktls_tx) {
+        return qio_channel_writev(tioc->master, iov, niov, errp);
+    }
+
+    for (i = 0 ; i < niov ; i += n) {
+        const char *buf = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        ssize_t ret;
+
+        /*
+         * Each call makes at least one record, with its header and
+         * MAC, so gather runs of short elements into a single one.
+         */
+        for (n = 1; i + n < niov; n++) {
+            if (len + iov[i + n].iov_len > QIO_CHANNEL_TLS_RECORD_SIZE) {
+                break;
+            }
+            len += iov[i + n].iov_len;
+        }
+        if (n > 1) {
+            if (!tioc->wbuf) {
+                tioc->wbuf = g_malloc(QIO_CHANNEL_TLS_RECORD_SIZE);
+            }
+            iov_to_buf(iov + i, n, 0, tioc->wbuf, len);
+            buf = tioc->wbuf;
+        }
+
+        ret = qcrypto_tls_session_write(tioc->session, buf, len);
         if (ret <= 0) {
             if (errno == EAGAIN) {
                 if (done) {
@@ -300,7 +340,7 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
             return -1;
         }
         done += ret;
-        if (ret < iov[i].iov_len) {
+        if (ret < len) {
             break;
         }
     }
@@ -41,6 +41,7 @@ static void iohandler_init(void)
 {
     if (!iohandler_ctx) {
         iohandler_ctx = aio_context_new(&error_abort);
+        aio_context_enable_epoll_source(iohandler_ctx);
     }
 }
 
@@ -63,7 +64,7 @@ void qemu_set_fd_handler(int fd,
 {
     iohandler_init();
     aio_set_fd_handler(iohandler_ctx, fd, false,
-                       fd_read, fd_write, opaque);
+                       fd_read, fd_write, NULL, opaque);
 }
 
 /* reaping of zombies.  right now we're not passing the status to
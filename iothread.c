@@ -16,10 +16,15 @@
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
 #include "block/aio.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/stats.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -28,6 +33,16 @@ typedef ObjectClass IOThreadClass;
 #define IOTHREAD_CLASS(klass) \
    OBJECT_CLASS_CHECK(IOThreadClass, klass, TYPE_IOTHREAD)
 
+/* Benchmark results from 2016 on NVMe SSD drives show max polling times
+ * around 16-32 microseconds yield IOPS improvements for both iodepth=1 and
+ * iodepth=32 workloads.
+ */
+#ifdef __linux__
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768ULL
+#else
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 0ULL
+#endif
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
@@ -68,11 +83,21 @@ static int iothread_stop(Object *object, void *opaque)
     return 0;
 }
 
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    iothread->thread_pool_node = -1;
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
 
     iothread_stop(obj, NULL);
+    g_free(iothread->cpu_affinity);
     qemu_cond_destroy(&iothread->init_done_cond);
     qemu_mutex_destroy(&iothread->init_done_lock);
     if (!iothread->ctx) {
@@ -86,6 +111,7 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     Error *local_error = NULL;
     IOThread *iothread = IOTHREAD(obj);
     char *name, *thread_name;
+    int ret;
 
     iothread->stopping = false;
     iothread->thread_id = -1;
@@ -95,12 +121,32 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_poll_params(iothread->ctx,
+                                iothread->poll_max_ns,
+                                iothread->poll_grow,
+                                iothread->poll_shrink,
+                                &local_error);
+    if (!local_error) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           iothread->thread_pool_node,
+                                           &local_error);
+    }
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
     /* This assumes we are called from a thread with useful CPU affinity for us
-     * to inherit.
+     * to inherit, unless cpu-affinity is set.
      */
+    iothread->start_ns = get_clock();
     name = object_get_canonical_path_component(OBJECT(obj));
     thread_name = g_strdup_printf("IO %s", name);
     qemu_thread_create(&iothread->thread, thread_name, iothread_run,
@@ -115,12 +161,180 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    if (iothread->cpu_affinity) {
+        ret = qemu_thread_set_affinity(&iothread->thread,
+                                       iothread->cpu_affinity);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Cannot set CPU affinity '%s'",
+                             iothread->cpu_affinity);
+            iothread_stop(OBJECT(obj), NULL);
+            aio_context_unref(iothread->ctx);
+            iothread->ctx = NULL;
+        }
+    }
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+} IOThreadParamInfo;
+
+static IOThreadParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+};
+static IOThreadParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+};
+static IOThreadParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+};
+static IOThreadParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static IOThreadParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
+static IOThreadParamInfo thread_pool_node_info = {
+    "thread-pool-node", offsetof(IOThread, thread_pool_node),
+};
+
+static void iothread_get_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, name, field, errp);
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0) {
+        error_setg(&local_err, "%s value must be in range [0, %"PRId64"]",
+                   info->name, INT64_MAX);
+        goto out;
+    }
+
+    *field = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx,
+                                    iothread->poll_max_ns,
+                                    iothread->poll_grow,
+                                    iothread->poll_shrink,
+                                    &local_err);
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value, old;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    /* The values are checked together once the AioContext exists */
+    old = *field;
+    *field = value;
+
+    if (iothread->ctx) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           iothread->thread_pool_node,
+                                           &local_err);
+        if (local_err) {
+            *field = old;
+        }
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static char *iothread_get_cpu_affinity(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return g_strdup(iothread->cpu_affinity);
+}
+
+static void iothread_set_cpu_affinity(Object *obj, const char *value,
+                                      Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int ret;
+
+    if (iothread->ctx) {
+        ret = qemu_thread_set_affinity(&iothread->thread, value);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Cannot set CPU affinity '%s'",
+                             value);
+            return;
+        }
+    }
+
+    g_free(iothread->cpu_affinity);
+    iothread->cpu_affinity = g_strdup(value);
 }
 
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
     ucc->complete = iothread_complete;
+
+    object_class_property_add(klass, "poll-max-ns", "int",
+                              iothread_get_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_max_ns_info, &error_abort);
+    object_class_property_add(klass, "poll-grow", "int",
+                              iothread_get_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_grow_info, &error_abort);
+    object_class_property_add(klass, "poll-shrink", "int",
+                              iothread_get_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_min_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_max_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-node", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_node_info, &error_abort);
+    object_class_property_add_str(klass, "cpu-affinity",
+                                  iothread_get_cpu_affinity,
+                                  iothread_set_cpu_affinity,
+                                  &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -128,6 +342,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -135,9 +350,50 @@ static const TypeInfo iothread_info = {
     },
 };
 
+static int iothread_stats_one(Object *object, void *opaque)
+{
+    StatsCollector *c = opaque;
+    IOThread *iothread;
+    AioContextStats *stats;
+    char *id;
+    bool wanted;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread || !iothread->ctx) {
+        return 0;
+    }
+
+    id = iothread_get_id(iothread);
+    wanted = stats_begin_instance(c, id);
+    g_free(id);
+    if (!wanted) {
+        return 0;
+    }
+
+    stats = &iothread->ctx->stats;
+    stats_add_counter(c, "busy-ns",
+                      MAX(get_clock() - iothread->start_ns -
+                          (int64_t)stats->idle_ns, 0));
+    stats_add_counter(c, "idle-ns", stats->idle_ns);
+    stats_add_counter(c, "poll-ns", stats->poll_ns);
+    stats_add_counter(c, "iterations", stats->polls);
+    stats_add_counter(c, "bh-calls", stats->bh_calls);
+    stats_add_counter(c, "bh-ns", stats->bh_ns);
+    stats_add_counter(c, "fd-handler-calls", stats->fd_handler_calls);
+    stats_add_counter(c, "fd-handler-ns", stats->fd_handler_ns);
+    stats_add_counter(c, "timer-ns", stats->timer_ns);
+    return 0;
+}
+
+static void iothread_stats_provider(StatsCollector *c, void *opaque)
+{
+    object_child_foreach(object_get_objects_root(), iothread_stats_one, c);
+}
+
 static void iothread_register_types(void)
 {
     type_register_static(&iothread_info);
+    stats_register_provider("iothread", iothread_stats_provider, NULL);
 }
 
 type_init(iothread_register_types)
@@ -167,6 +423,27 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    info->poll_max_ns = iothread->poll_max_ns;
+    info->poll_grow = iothread->poll_grow;
+    info->poll_shrink = iothread->poll_shrink;
+    if (iothread->cpu_affinity) {
+        info->has_cpu_affinity = true;
+        info->cpu_affinity = g_strdup(iothread->cpu_affinity);
+    }
+    if (iothread->ctx) {
+        AioContextStats *stats = &iothread->ctx->stats;
+        int64_t elapsed = get_clock() - iothread->start_ns;
+
+        info->busy_ns = MAX(elapsed - (int64_t)stats->idle_ns, 0);
+        info->idle_ns = stats->idle_ns;
+        info->poll_ns = stats->poll_ns;
+        info->iterations = stats->polls;
+        info->bh_calls = stats->bh_calls;
+        info->bh_ns = stats->bh_ns;
+        info->fd_handler_calls = stats->fd_handler_calls;
+        info->fd_handler_ns = stats->fd_handler_ns;
+        info->timer_ns = stats->timer_ns;
+    }
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -187,6 +464,89 @@ IOThreadInfoList *qmp_query_iothreads(Error **errp)
     return head;
 }
 
+static int query_one_iothread_bhs(Object *object, void *opaque)
+{
+    BHInfoList ***prev = opaque;
+    IOThread *iothread;
+    char *id;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread || !iothread->ctx) {
+        return 0;
+    }
+
+    id = iothread_get_id(iothread);
+    **prev = aio_bh_get_info(iothread->ctx, id);
+    while (**prev) {
+        *prev = &(**prev)->next;
+    }
+    g_free(id);
+    return 0;
+}
+
+BHInfoList *qmp_x_debug_query_bhs(Error **errp)
+{
+    BHInfoList *head, **prev = &head;
+    Object *container = object_get_objects_root();
+
+    *prev = aio_bh_get_info(qemu_get_aio_context(), "main-loop");
+    while (*prev) {
+        prev = &(*prev)->next;
+    }
+    object_child_foreach(container, query_one_iothread_bhs, &prev);
+    return head;
+}
+
+static ThreadPoolInfoList *thread_pool_info_list(AioContext *ctx,
+                                                 const char *name)
+{
+    ThreadPoolInfoList *elem;
+
+    /* The pool is only created when the context first uses it */
+    if (!ctx->thread_pool) {
+        return NULL;
+    }
+
+    elem = g_new0(ThreadPoolInfoList, 1);
+    elem->value = thread_pool_get_info(ctx->thread_pool);
+    elem->value->context = g_strdup(name);
+    return elem;
+}
+
+static int query_one_iothread_thread_pool(Object *object, void *opaque)
+{
+    ThreadPoolInfoList ***prev = opaque;
+    IOThread *iothread;
+    char *id;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread || !iothread->ctx) {
+        return 0;
+    }
+
+    id = iothread_get_id(iothread);
+    **prev = thread_pool_info_list(iothread->ctx, id);
+    if (**prev) {
+        *prev = &(**prev)->next;
+    }
+    g_free(id);
+    return 0;
+}
+
+ThreadPoolInfoList *qmp_query_thread_pools(Error **errp)
+{
+    ThreadPoolInfoList *head, **prev = &head;
+    Object *container = object_get_objects_root();
+
+    *prev = thread_pool_info_list(qemu_get_aio_context(), "main-loop");
+    if (*prev) {
+        prev = &(*prev)->next;
+    }
+    object_child_foreach(container, query_one_iothread_thread_pool, &prev);
+    *prev = NULL;
+    return head;
+}
+
 void iothread_stop_all(void)
 {
     Object *container = object_get_objects_root();
@@ -20,8 +20,11 @@
 
 #include "qemu-common.h"
 #include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
@@ -36,6 +39,7 @@
 #include "qemu/event_notifier.h"
 #include "trace.h"
 #include "hw/irq.h"
+#include "qemu/stats.h"
 
 #include "hw/boards.h"
 
@@ -61,12 +65,66 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* Address spaces whose slots can show up in dirty ring entries */
+#define KVM_MAX_AS_ID           2
+
+/* How often the reaper thread collects the dirty rings */
+#define KVM_DIRTY_RING_REAP_INTERVAL_US  (1000 * 1000)
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    /* the kernel's ring position survives parking */
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
+/* Exit reasons reported by query-stats, as "exits-<name>" */
+static const char *const kvm_exit_names[] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+    [KVM_EXIT_SYSTEM_EVENT] = "system-event",
+    [KVM_EXIT_S390_STSI] = "s390-stsi",
+    [KVM_EXIT_IOAPIC_EOI] = "ioapic-eoi",
+    [KVM_EXIT_HYPERV] = "hyperv",
+    [KVM_EXIT_DIRTY_RING_FULL] = "dirty-ring-full",
+};
+
+#define KVM_EXIT_STATS_NR ARRAY_SIZE(kvm_exit_names)
+
+/* Only written by the vCPU thread */
+typedef struct KVMExitStats {
+    /* The last entry of each array is for reasons beyond kvm_exit_names */
+    uint64_t exits[KVM_EXIT_STATS_NR + 1];
+    /* Time spent in QEMU handling each exit reason */
+    uint64_t ns[KVM_EXIT_STATS_NR + 1];
+    /* Time spent in KVM_RUN, running the guest or handling exits in KVM */
+    uint64_t run_ns;
+    /* KVM_RUN interrupted by a signal before the guest exited */
+    uint64_t interrupted;
+} KVMExitStats;
+
 struct KVMState
 {
     AccelState parent_obj;
@@ -86,6 +144,12 @@ struct KVMState
 #endif
     int many_ioeventfds;
     int intx_set_mask;
+    bool manual_dirty_log_protect;
+    /* entries per vcpu ring, 0 if dirty pages are tracked with bitmaps */
+    uint32_t kvm_dirty_ring_size;
+    uint64_t kvm_dirty_ring_bytes;
+    KVMMemoryListener *as_listeners[KVM_MAX_AS_ID];
+    QemuThread dirty_ring_reaper;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -103,6 +167,8 @@ struct KVMState
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
 };
 
+static uint64_t kvm_dirty_ring_reap(KVMState *s);
+
 KVMState *kvm_state;
 bool kvm_kernel_irqchip;
 bool kvm_split_irqchip;
@@ -273,15 +339,29 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
+    g_free(cpu->kvm_exit_stats);
+    cpu->kvm_exit_stats = NULL;
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -291,11 +371,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -307,7 +389,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -316,6 +398,9 @@ int kvm_init_vcpu(CPUState *cpu)
     cpu->kvm_fd = ret;
     cpu->kvm_state = s;
     cpu->kvm_vcpu_dirty = true;
+    if (!cpu->kvm_exit_stats) {
+        cpu->kvm_exit_stats = g_new0(KVMExitStats, 1);
+    }
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -337,6 +422,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -401,7 +499,9 @@ static void kvm_log_start(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kml->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kml->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -418,7 +518,9 @@ static void kvm_log_stop(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kml->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kml->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -436,6 +538,130 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     return 0;
 }
 
+/*
+ * Dirty ring: KVM pushes the guest frames that each vcpu dirtied into a
+ * ring shared with userspace, so collecting them costs in proportion to
+ * the number of dirtied pages rather than to the size of the slots.
+ * Rings are collected by log syncs, by a reaper thread in the background
+ * and by a vcpu whose ring is full; all of them hold the BQL, which also
+ * keeps the slots stable.
+ */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+
+    if (as_id >= KVM_MAX_AS_ID || slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->as_listeners[as_id];
+    if (!kml) {
+        return;
+    }
+    mem = &kml->slots[slot_id];
+    if (!mem->memory_size || mem->ram_start_offset == RAM_ADDR_INVALID ||
+        offset >= mem->memory_size / qemu_real_host_page_size) {
+        return;
+    }
+
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * qemu_real_host_page_size,
+                                        qemu_real_host_page_size,
+                                        DIRTY_CLIENTS_NOCODE);
+}
+
+static uint64_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfns = cpu->kvm_dirty_gfns;
+    uint32_t mask = s->kvm_dirty_ring_size - 1;
+    uint64_t count = 0;
+
+    for (;;) {
+        struct kvm_dirty_gfn *cur = &gfns[cpu->kvm_fetch_index & mask];
+
+        if (!(atomic_read(&cur->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        /* read the entry only after seeing it published */
+        smp_rmb();
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        /* hand the entry back only after reading it */
+        smp_wmb();
+        atomic_set(&cur->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+
+    return count;
+}
+
+/* Must be called with the BQL held */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+    if (total && kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS) < 0) {
+        error_report("KVM_RESET_DIRTY_RINGS failed: %s", strerror(errno));
+    }
+    trace_kvm_dirty_ring_reap(total);
+
+    return total;
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+    for (;;) {
+        g_usleep(KVM_DIRTY_RING_REAP_INTERVAL_US);
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s, uint32_t size)
+{
+    uint64_t bytes = (uint64_t)size * sizeof(struct kvm_dirty_gfn);
+    int max_bytes;
+    int ret;
+
+    max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max_bytes <= 0) {
+        error_report("kvm-dirty-ring-size: KVM does not support the dirty "
+                     "ring");
+        return -ENOTSUP;
+    }
+    if (bytes < qemu_real_host_page_size || bytes > max_bytes) {
+        error_report("kvm-dirty-ring-size: %" PRIu32 " entries do not fit "
+                     "into %zu to %d bytes", size,
+                     (size_t)qemu_real_host_page_size, max_bytes);
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, bytes);
+    if (ret) {
+        error_report("Enabling the KVM dirty ring failed: %s",
+                     strerror(-ret));
+        return ret;
+    }
+
+    s->kvm_dirty_ring_size = size;
+    s->kvm_dirty_ring_bytes = bytes;
+    return 0;
+}
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 /**
@@ -451,13 +677,19 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
                                           MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
+    /* The rings are not per slot; collecting them once covers everything */
+    if (s->kvm_dirty_ring_size) {
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
@@ -479,13 +711,15 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        /* The bitmap is kept with the slot: with manual protection the
+         * pages are only re-protected by kvm_log_clear(), which needs to
+         * know which of them KVM reported.  KVM_GET_DIRTY_LOG overwrites
+         * the whole buffer, and still includes the uncleared pages.
+         */
+        if (!mem->dirty_bmap) {
+            mem->dirty_bmap = g_malloc0(size);
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
+        d.dirty_bitmap = mem->dirty_bmap;
 
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
@@ -497,7 +731,51 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+
+    return ret;
+}
+
+/*
+ * Re-protect the pages of [@start, @start + @size) (relative to the slot)
+ * that the last KVM_GET_DIRTY_LOG reported dirty.  KVM wants the range
+ * aligned to 64 pages unless it ends at the end of the slot, so the
+ * bitmap passed down is widened but only carries bits of the range.
+ */
+static int kvm_log_clear_one_slot(KVMMemoryListener *kml, KVMSlot *mem,
+                                  uint64_t start, uint64_t size)
+{
+    KVMState *s = kvm_state;
+    struct kvm_clear_dirty_log d = {};
+    uint64_t slot_pages = mem->memory_size >> TARGET_PAGE_BITS;
+    uint64_t end = MIN(TARGET_PAGE_ALIGN(start + size) >> TARGET_PAGE_BITS,
+                       slot_pages);
+    uint64_t first = QEMU_ALIGN_DOWN(start >> TARGET_PAGE_BITS, 64);
+    uint64_t last = MIN(QEMU_ALIGN_UP(end, 64), slot_pages);
+    unsigned long *bmap;
+    unsigned long page;
+    bool found = false;
+    int ret = 0;
+
+    /* the kernel reads whole 64-bit words, see above */
+    bmap = bitmap_new(ALIGN(last - first, 64));
+    for (page = find_next_bit(mem->dirty_bmap, end, start >> TARGET_PAGE_BITS);
+         page < end; page = find_next_bit(mem->dirty_bmap, end, page + 1)) {
+        clear_bit(page, mem->dirty_bmap);
+        set_bit(page - first, bmap);
+        found = true;
+    }
+
+    if (found) {
+        d.slot = mem->slot | (kml->as_id << 16);
+        d.first_page = first;
+        d.num_pages = last - first;
+        d.dirty_bitmap = bmap;
+        if (kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d) < 0) {
+            DPRINTF("KVM_CLEAR_DIRTY_LOG failed %d\n", errno);
+            ret = -1;
+        }
+    }
+    g_free(bmap);
 
     return ret;
 }
@@ -701,6 +979,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     hwaddr start_addr = section->offset_within_address_space;
     ram_addr_t size = int128_get64(section->size);
     void *ram = NULL;
+    ram_addr_t ram_start_offset;
     unsigned delta;
 
     /* kvm works in page size chunks, but the function may be called
@@ -729,6 +1008,10 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     }
 
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region + delta;
+    ram_start_offset = memory_region_get_ram_addr(mr);
+    if (ram_start_offset != RAM_ADDR_INVALID) {
+        ram_start_offset += section->offset_within_region + delta;
+    }
 
     while (1) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, start_addr + size);
@@ -752,6 +1035,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         }
 
         /* unregister the overlapping slot */
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         mem->memory_size = 0;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
@@ -774,6 +1059,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = old.memory_size;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -785,6 +1071,9 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
             start_addr += old.memory_size;
             ram += old.memory_size;
+            if (ram_start_offset != RAM_ADDR_INVALID) {
+                ram_start_offset += old.memory_size;
+            }
             size -= old.memory_size;
             continue;
         }
@@ -795,6 +1084,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = start_addr - old.start_addr;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags =  kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -819,6 +1109,10 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             size_delta = mem->start_addr - old.start_addr;
             mem->memory_size = old.memory_size - size_delta;
             mem->ram = old.ram + size_delta;
+            mem->ram_start_offset = old.ram_start_offset;
+            if (mem->ram_start_offset != RAM_ADDR_INVALID) {
+                mem->ram_start_offset += size_delta;
+            }
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -841,6 +1135,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = ram_start_offset;
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem);
@@ -857,7 +1152,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kml->slots_lock);
     kvm_set_phys_mem(kml, section, true);
+    qemu_mutex_unlock(&kml->slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -865,7 +1162,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    qemu_mutex_lock(&kml->slots_lock);
     kvm_set_phys_mem(kml, section, false);
+    qemu_mutex_unlock(&kml->slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -875,7 +1174,41 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    qemu_mutex_lock(&kml->slots_lock);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    qemu_mutex_unlock(&kml->slots_lock);
+    if (r < 0) {
+        abort();
+    }
+}
+
+/* Called for ranges whose dirty information has been consumed */
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    hwaddr start = section->offset_within_address_space;
+    hwaddr end = start + int128_get64(section->size);
+    int i, r = 0;
+
+    if (!s->manual_dirty_log_protect) {
+        return;
+    }
+
+    qemu_mutex_lock(&kml->slots_lock);
+    for (i = 0; i < s->nr_slots && r == 0; i++) {
+        KVMSlot *mem = &kml->slots[i];
+        hwaddr slot_start = MAX(start, mem->start_addr);
+        hwaddr slot_end = MIN(end, mem->start_addr + mem->memory_size);
+
+        if (!mem->memory_size || !mem->dirty_bmap || slot_start >= slot_end) {
+            continue;
+        }
+        r = kvm_log_clear_one_slot(kml, mem, slot_start - mem->start_addr,
+                                   slot_end - slot_start);
+    }
+    qemu_mutex_unlock(&kml->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -955,8 +1288,11 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 {
     int i;
 
+    qemu_mutex_init(&kml->slots_lock);
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    assert(as_id < KVM_MAX_AS_ID);
+    s->as_listeners[as_id] = kml;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -967,6 +1303,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1559,6 +1896,48 @@ bool kvm_vcpu_id_is_valid(int vcpu_id)
     return vcpu_id >= 0 && vcpu_id < kvm_max_vcpu_id(s);
 }
 
+static void kvm_stats_provider(StatsCollector *c, void *opaque)
+{
+    CPUState *cpu;
+    char name[64];
+    int i;
+
+    CPU_FOREACH(cpu) {
+        KVMExitStats *stats = cpu->kvm_exit_stats;
+        uint64_t total, other, total_ns, other_ns;
+
+        if (!stats) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "cpu%d", cpu->cpu_index);
+        if (!stats_begin_instance(c, name)) {
+            continue;
+        }
+
+        total = other = stats->exits[KVM_EXIT_STATS_NR];
+        total_ns = other_ns = stats->ns[KVM_EXIT_STATS_NR];
+        for (i = 0; i < KVM_EXIT_STATS_NR; i++) {
+            total += stats->exits[i];
+            total_ns += stats->ns[i];
+            if (!kvm_exit_names[i]) {
+                other += stats->exits[i];
+                other_ns += stats->ns[i];
+                continue;
+            }
+            snprintf(name, sizeof(name), "exits-%s", kvm_exit_names[i]);
+            stats_add_counter(c, name, stats->exits[i]);
+            snprintf(name, sizeof(name), "exits-%s-ns", kvm_exit_names[i]);
+            stats_add_counter(c, name, stats->ns[i]);
+        }
+        stats_add_counter(c, "exits-other", other);
+        stats_add_counter(c, "exits-other-ns", other_ns);
+        stats_add_counter(c, "exits", total);
+        stats_add_counter(c, "userspace-ns", total_ns);
+        stats_add_counter(c, "run-ns", stats->run_ns);
+        stats_add_counter(c, "interrupted", stats->interrupted);
+    }
+}
+
 static int kvm_init(MachineState *ms)
 {
     MachineClass *mc = MACHINE_GET_CLASS(ms);
@@ -1718,6 +2097,27 @@ static int kvm_init(MachineState *ms)
 
     s->intx_set_mask = kvm_check_extension(s, KVM_CAP_PCI_2_3);
 
+    /* The dirty ring replaces KVM_GET_DIRTY_LOG, so it has to be set up
+     * before any vcpu exists and instead of manual protection.
+     */
+    if (machine_kvm_dirty_ring_size(ms)) {
+        ret = kvm_dirty_ring_init(s, machine_kvm_dirty_ring_size(ms));
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    /* Let KVM_GET_DIRTY_LOG leave the pages alone; they are re-protected
+     * by kvm_log_clear() once their dirty state has been consumed.
+     */
+    if (!s->kvm_dirty_ring_size &&
+        (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) &
+         KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE)) {
+        s->manual_dirty_log_protect =
+            kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                              KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE) == 0;
+    }
+
     s->irq_set_ioctl = KVM_IRQ_LINE;
     if (kvm_check_extension(s, KVM_CAP_IRQ_INJECT_STATUS)) {
         s->irq_set_ioctl = KVM_IRQ_LINE_STATUS;
@@ -1768,7 +2168,14 @@ static int kvm_init(MachineState *ms)
 
     s->many_ioeventfds = kvm_check_many_ioeventfds();
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     cpu_interrupt_handler = kvm_handle_interrupt;
+    stats_register_provider("kvm", kvm_stats_provider, NULL);
 
     return 0;
 
@@ -1790,20 +2197,56 @@ void kvm_set_sigmask_len(KVMState *s, unsigned int sigmask_len)
     s->sigmask_len = sigmask_len;
 }
 
+/* Dispatch an exit and account it to its region, see set-mmio-exit-stats */
+static void kvm_dispatch_accounted(AddressSpace *as, hwaddr addr,
+                                   MemTxAttrs attrs, uint8_t *buf, int len,
+                                   bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+    int64_t start;
+
+    /* The RCU critical section keeps the region alive until accounted */
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    start = get_clock();
+    address_space_rw(as, addr, attrs, buf, len, is_write);
+    memory_region_account_mmio_exit(mr, is_write, get_clock() - start);
+    rcu_read_unlock();
+}
+
 static void kvm_handle_io(uint16_t port, MemTxAttrs attrs, void *data, int direction,
                           int size, uint32_t count)
 {
+    bool account = atomic_read(&mmio_exit_stats_enabled);
     int i;
     uint8_t *ptr = data;
 
     for (i = 0; i < count; i++) {
-        address_space_rw(&address_space_io, port, attrs,
-                         ptr, size,
-                         direction == KVM_EXIT_IO_OUT);
+        if (account) {
+            kvm_dispatch_accounted(&address_space_io, port, attrs, ptr, size,
+                                   direction == KVM_EXIT_IO_OUT);
+        } else {
+            address_space_rw(&address_space_io, port, attrs,
+                             ptr, size,
+                             direction == KVM_EXIT_IO_OUT);
+        }
         ptr += size;
     }
 }
 
+static void kvm_handle_mmio(struct kvm_run *run, MemTxAttrs attrs)
+{
+    if (!atomic_read(&mmio_exit_stats_enabled)) {
+        address_space_rw(&address_space_memory, run->mmio.phys_addr, attrs,
+                         run->mmio.data, run->mmio.len, run->mmio.is_write);
+        return;
+    }
+
+    kvm_dispatch_accounted(&address_space_memory, run->mmio.phys_addr, attrs,
+                           run->mmio.data, run->mmio.len, run->mmio.is_write);
+}
+
 static int kvm_handle_internal_error(CPUState *cpu, struct kvm_run *run)
 {
     fprintf(stderr, "KVM internal error. Suberror: %d\n",
@@ -1896,6 +2339,9 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
+    KVMExitStats *stats = cpu->kvm_exit_stats;
+    int64_t run_start, exit_start;
+    unsigned int reason;
     int ret, run_ret;
 
     DPRINTF("kvm_cpu_exec()\n");
@@ -1926,13 +2372,17 @@ int kvm_cpu_exec(CPUState *cpu)
             qemu_cpu_kick_self();
         }
 
+        run_start = get_clock();
         run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        exit_start = get_clock();
+        stats->run_ns += exit_start - run_start;
 
         attrs = kvm_arch_post_run(cpu, run);
 
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
                 DPRINTF("io window exit\n");
+                stats->interrupted++;
                 ret = EXCP_INTERRUPT;
                 break;
             }
@@ -1951,6 +2401,8 @@ int kvm_cpu_exec(CPUState *cpu)
         }
 
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+        reason = MIN(run->exit_reason, KVM_EXIT_STATS_NR);
+        stats->exits[reason]++;
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
@@ -1965,11 +2417,7 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_MMIO:
             DPRINTF("handle_mmio\n");
             /* Called outside BQL */
-            address_space_rw(&address_space_memory,
-                             run->mmio.phys_addr, attrs,
-                             run->mmio.data,
-                             run->mmio.len,
-                             run->mmio.is_write);
+            kvm_handle_mmio(run, attrs);
             ret = 0;
             break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
@@ -1989,6 +2437,13 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* KVM does not run the vcpu again until its ring is reset */
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
@@ -2016,6 +2471,7 @@ int kvm_cpu_exec(CPUState *cpu)
             ret = kvm_arch_handle_exit(cpu, run);
             break;
         }
+        stats->ns[reason] += get_clock() - exit_start;
     } while (ret == 0);
 
     qemu_mutex_lock_iothread();
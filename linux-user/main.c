@@ -416,6 +416,63 @@ void cpu_loop(CPUX86State *env)
     })
 
 #ifdef TARGET_ABI32
+
+#if HOST_LONG_BITS == 64
+/* On a 64-bit host every AArch32 atomic access fits in a single host
+ * compare-and-swap, so the kuser cmpxchg helpers and STREX of naturally
+ * aligned data can be done without stopping the other guest threads.
+ * Misaligned accesses (which fault on real hardware) still go through
+ * start_exclusive().  A 32-bit host keeps using start_exclusive() for
+ * everything, so that 64-bit accesses are serialized correctly against
+ * the others.
+ */
+#define ARM_HOST_ATOMICS
+
+/* Convert a 16- or 32-bit value to guest data memory byte order.  */
+static uint16_t arm_mem16(CPUARMState *env, uint16_t val)
+{
+    val = tswap16(val);
+    return arm_cpu_bswap_data(env) ? bswap16(val) : val;
+}
+
+static uint32_t arm_mem32(CPUARMState *env, uint32_t val)
+{
+    val = tswap32(val);
+    return arm_cpu_bswap_data(env) ? bswap32(val) : val;
+}
+
+/* Atomically replace the SIZE bytes at guest address ADDR by NEWVAL if
+ * they hold OLDVAL.  Both values are in guest memory byte order and ADDR
+ * must be aligned to SIZE.  Return 1 if the store was done, 0 if memory
+ * did not hold OLDVAL, and -1 if ADDR is not writable.
+ */
+static int arm_host_cmpxchg(abi_ulong addr, int size,
+                            uint64_t oldval, uint64_t newval)
+{
+    void *host;
+
+    if (!access_ok(VERIFY_WRITE, addr, size)) {
+        return -1;
+    }
+    host = g2h(addr);
+    switch (size) {
+    case 1:
+        return atomic_cmpxchg((uint8_t *)host, oldval, newval)
+            == (uint8_t)oldval;
+    case 2:
+        return atomic_cmpxchg((uint16_t *)host, oldval, newval)
+            == (uint16_t)oldval;
+    case 4:
+        return atomic_cmpxchg((uint32_t *)host, oldval, newval)
+            == (uint32_t)oldval;
+    case 8:
+        return atomic_cmpxchg((uint64_t *)host, oldval, newval) == oldval;
+    default:
+        abort();
+    }
+}
+#endif
+
 /* Commpage handling -- there is no commpage for AArch64 */
 
 /*
@@ -440,24 +497,42 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
 
     /* Based on the 32 bit code in do_kernel_trap */
 
-    /* XXX: This only works between threads, not between processes.
-       It's probably possible to implement this with native host
-       operations. However things like ldrex/strex are much harder so
-       there's not much point trying.  */
-    start_exclusive();
     cpsr = cpsr_read(env);
     addr = env->regs[2];
 
     if (get_user_u64(oldval, env->regs[0])) {
         env->exception.vaddress = env->regs[0];
-        goto segv;
+        goto segv_unlocked;
     };
 
     if (get_user_u64(newval, env->regs[1])) {
         env->exception.vaddress = env->regs[1];
-        goto segv;
+        goto segv_unlocked;
     };
 
+#ifdef ARM_HOST_ATOMICS
+    if (!(addr & 7)) {
+        switch (arm_host_cmpxchg(addr, 8, tswap64(oldval), tswap64(newval))) {
+        case 1:
+            env->regs[0] = 0;
+            cpsr |= CPSR_C;
+            break;
+        case 0:
+            env->regs[0] = -1;
+            cpsr &= ~CPSR_C;
+            break;
+        default:
+            env->exception.vaddress = addr;
+            goto segv_unlocked;
+        }
+        cpsr_write(env, cpsr, CPSR_C, CPSRWriteByInstr);
+        return;
+    }
+#endif
+
+    /* XXX: This only works between threads, not between processes.  */
+    start_exclusive();
+
     if (get_user_u64(val, addr)) {
         env->exception.vaddress = addr;
         goto segv;
@@ -483,6 +558,7 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
 
 segv:
     end_exclusive();
+segv_unlocked:
     /* We get the PC of the entry address - which is as good as anything,
        on a real kernel what you get depends on which mode it uses. */
     info.si_signo = TARGET_SIGSEGV;
@@ -506,13 +582,25 @@ do_kernel_trap(CPUARMState *env)
         /* ??? No-op. Will need to do better for SMP.  */
         break;
     case 0xffff0fc0: /* __kernel_cmpxchg */
-         /* XXX: This only works between threads, not between processes.
-            It's probably possible to implement this with native host
-            operations. However things like ldrex/strex are much harder so
-            there's not much point trying.  */
-        start_exclusive();
         cpsr = cpsr_read(env);
         addr = env->regs[2];
+#ifdef ARM_HOST_ATOMICS
+        if (!(addr & 3)) {
+            /* FIXME: This should SEGV if the access fails.  */
+            if (arm_host_cmpxchg(addr, 4, tswap32(env->regs[0]),
+                                 tswap32(env->regs[1])) == 1) {
+                env->regs[0] = 0;
+                cpsr |= CPSR_C;
+            } else {
+                env->regs[0] = -1;
+                cpsr &= ~CPSR_C;
+            }
+            cpsr_write(env, cpsr, CPSR_C, CPSRWriteByInstr);
+            break;
+        }
+#endif
+        /* XXX: This only works between threads, not between processes.  */
+        start_exclusive();
         /* FIXME: This should SEGV if the access fails.  */
         if (get_user_u32(val, addr))
             val = ~env->regs[0];
@@ -550,6 +638,67 @@ do_kernel_trap(CPUARMState *env)
     return 0;
 }
 
+#ifdef ARM_HOST_ATOMICS
+/* Store exclusive for naturally aligned data, using a host cmpxchg */
+static int do_strex_host(CPUARMState *env)
+{
+    uint32_t addr = env->exclusive_addr;
+    int size = env->exclusive_info & 0xf;
+    uint64_t oldval = env->exclusive_val;
+    uint64_t newval = env->regs[(env->exclusive_info >> 8) & 0xf];
+    uint32_t w[2];
+    int rc = 1;
+
+    if (env->exclusive_addr != env->exclusive_test) {
+        goto fail;
+    }
+    switch (size) {
+    case 0:
+        break;
+    case 1:
+        oldval = arm_mem16(env, oldval);
+        newval = arm_mem16(env, newval);
+        break;
+    case 2:
+        oldval = arm_mem32(env, oldval);
+        newval = arm_mem32(env, newval);
+        break;
+    case 3:
+        /* Rebuild the doubleword as it appears in memory; see do_strex
+           for how exclusive_val was assembled from the two words.  */
+        if (arm_cpu_bswap_data(env)) {
+            w[0] = arm_mem32(env, oldval >> 32);
+            w[1] = arm_mem32(env, oldval);
+        } else {
+            w[0] = arm_mem32(env, oldval);
+            w[1] = arm_mem32(env, oldval >> 32);
+        }
+        memcpy(&oldval, w, 8);
+        w[0] = arm_mem32(env, newval);
+        w[1] = arm_mem32(env, env->regs[(env->exclusive_info >> 12) & 0xf]);
+        memcpy(&newval, w, 8);
+        break;
+    default:
+        abort();
+    }
+
+    switch (arm_host_cmpxchg(addr, 1 << size, oldval, newval)) {
+    case 1:
+        rc = 0;
+        break;
+    case 0:
+        break;
+    default:
+        env->exception.vaddress = addr;
+        return 1;
+    }
+fail:
+    env->regs[15] += 4;
+    env->regs[(env->exclusive_info >> 4) & 0xf] = rc;
+    return 0;
+}
+#endif
+
 /* Store exclusive handling for AArch32 */
 static int do_strex(CPUARMState *env)
 {
@@ -558,6 +707,12 @@ static int do_strex(CPUARMState *env)
     int rc = 1;
     int segv = 0;
     uint32_t addr;
+
+#ifdef ARM_HOST_ATOMICS
+    if (!(env->exclusive_addr & ((1 << (env->exclusive_info & 0xf)) - 1))) {
+        return do_strex_host(env);
+    }
+#endif
     start_exclusive();
     if (env->exclusive_addr != env->exclusive_test) {
         goto fail;
@@ -49,10 +49,12 @@ void mmap_fork_start(void)
     if (mmap_lock_count)
         abort();
     pthread_mutex_lock(&mmap_mutex);
+    page_fork_start();
 }
 
 void mmap_fork_end(int child)
 {
+    page_fork_end(child);
     if (child)
         pthread_mutex_init(&mmap_mutex, NULL);
     else
@@ -206,6 +208,7 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
     abi_ulong end_addr;
+    target_ulong run_start, run_last;
     int prot;
     int looped = 0;
 
@@ -230,9 +233,11 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
             looped = 1;
             continue;
         }
-        prot = page_get_flags(addr);
+        prot = page_get_flags_range(addr, &run_start, &run_last);
         if (prot) {
-            end_addr = addr;
+            /* Skip the whole mapping, not just this page */
+            end_addr = run_start & qemu_host_page_mask;
+            addr = end_addr;
         }
         if (addr + size == end_addr) {
             break;
@@ -3292,6 +3292,47 @@ static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
     g_free(vec);
 }
 
+/*
+ * Return true if the guest iovec array at @target_addr can be handed to
+ * the host as is, because target_iovec and struct iovec match and guest
+ * addresses are host addresses.  This skips the copy made by lock_iovec();
+ * the buffers are still checked, so that pages holding translated code
+ * get unprotected before the host writes to them.  Anything unusual (bad
+ * buffers, bad lengths) is left to lock_iovec() to report.
+ */
+static bool iovec_passthrough(int type, abi_ulong target_addr,
+                              abi_ulong count)
+{
+#if TARGET_ABI_BITS == HOST_LONG_BITS && !defined(DEBUG_REMAP) && \
+    defined(TARGET_WORDS_BIGENDIAN) == defined(HOST_WORDS_BIGENDIAN)
+    struct target_iovec *target_vec;
+    int i;
+
+    QEMU_BUILD_BUG_ON(sizeof(struct target_iovec) != sizeof(struct iovec));
+
+    if (guest_base || count == 0 || count > IOV_MAX) {
+        return false;
+    }
+    target_vec = lock_user(VERIFY_READ, target_addr,
+                           count * sizeof(struct target_iovec), 1);
+    if (!target_vec) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        abi_long len = target_vec[i].iov_len;
+
+        if (len < 0 ||
+            (len && !access_ok(type, target_vec[i].iov_base, len))) {
+            break;
+        }
+    }
+    unlock_user(target_vec, target_addr, 0);
+    return i == count;
+#else
+    return false;
+#endif
+}
+
 static inline int target_to_host_sock_type(int *type)
 {
     int host_type = 0;
@@ -7504,6 +7545,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_log_stats();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -9500,6 +9542,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_log_stats();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
@@ -9878,6 +9921,10 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         ret = get_errno(safe_flock(arg1, arg2));
         break;
     case TARGET_NR_readv:
+        if (iovec_passthrough(VERIFY_WRITE, arg2, arg3)) {
+            ret = get_errno(safe_readv(arg1, g2h(arg2), arg3));
+            break;
+        }
         {
             struct iovec *vec = lock_iovec(VERIFY_WRITE, arg2, arg3, 0);
             if (vec != NULL) {
@@ -9889,6 +9936,10 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         }
         break;
     case TARGET_NR_writev:
+        if (iovec_passthrough(VERIFY_READ, arg2, arg3)) {
+            ret = get_errno(safe_writev(arg1, g2h(arg2), arg3));
+            break;
+        }
         {
             struct iovec *vec = lock_iovec(VERIFY_READ, arg2, arg3, 1);
             if (vec != NULL) {
@@ -158,6 +158,7 @@ int qemu_init_main_loop(Error **errp)
         error_propagate(errp, local_error);
         return -EMFILE;
     }
+    aio_context_enable_epoll_source(qemu_aio_context);
     qemu_notify_bh = qemu_bh_new(notify_event_cb, NULL);
     gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     src = aio_get_g_source(qemu_aio_context);
@@ -23,7 +23,9 @@
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include "qom/object.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
 #include "exec/memory-internal.h"
@@ -234,6 +236,7 @@ struct FlatView {
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    AddressSpaceDispatch *dispatch;
 };
 
 typedef struct AddressSpaceOps AddressSpaceOps;
@@ -269,6 +272,7 @@ static void flatview_init(FlatView *view)
     view->ranges = NULL;
     view->nr = 0;
     view->nr_allocated = 0;
+    view->dispatch = NULL;
 }
 
 /* Insert a range into a given position.  Caller is responsible for maintaining
@@ -295,6 +299,9 @@ static void flatview_destroy(FlatView *view)
     for (i = 0; i < view->nr; i++) {
         memory_region_unref(view->ranges[i].mr);
     }
+    if (view->dispatch) {
+        address_space_dispatch_free(view->dispatch);
+    }
     g_free(view->ranges);
     g_free(view);
 }
@@ -304,13 +311,49 @@ static void flatview_ref(FlatView *view)
     atomic_inc(&view->ref);
 }
 
+/* Take a reference unless the last one is already gone, i.e. unless
+ * @view is only waiting for RCU readers before being destroyed.
+ */
+static bool flatview_tryref(FlatView *view)
+{
+    unsigned ref = atomic_read(&view->ref);
+
+    while (ref) {
+        unsigned old = atomic_cmpxchg(&view->ref, ref, ref + 1);
+        if (old == ref) {
+            return true;
+        }
+        ref = old;
+    }
+    return false;
+}
+
+/* A FlatView can be the current map of several address spaces, so it is
+ * freed only after the last of them dropped it and RCU readers are done.
+ */
 static void flatview_unref(FlatView *view)
 {
     if (atomic_fetch_dec(&view->ref) == 1) {
-        flatview_destroy(view);
+        call_rcu(view, flatview_destroy, rcu);
     }
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static bool can_merge(FlatRange *r1, FlatRange *r2)
 {
     return int128_eq(addrrange_end(r1->addr), r2->addr.start)
@@ -706,6 +749,58 @@ static void render_memory_region(FlatView *view,
     }
 }
 
+/* Skip the containers and aliases at the top of an address space that do
+ * not change what is rendered below them: a lone enabled subregion at
+ * offset 0, or an alias covering all of its target.  Address spaces that
+ * end up at the same region share a FlatView; for example the bus master
+ * address spaces of PCI devices all resolve to the PCI address space (or
+ * to NULL while bus mastering is disabled).
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    if (mr && mr->addr) {
+        return mr;
+    }
+
+    while (mr && mr->enabled) {
+        if (mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (!mr->alias_offset && !mr->alias->addr
+                && int128_ge(mr->size, mr->alias->size)) {
+                mr = mr->alias;
+                continue;
+            }
+        } else if (!mr->terminates) {
+            MemoryRegion *child, *next = NULL;
+            unsigned found = 0;
+
+            QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+                if (!child->enabled) {
+                    continue;
+                }
+                if (++found > 1) {
+                    next = NULL;
+                    break;
+                }
+                if (!child->addr && int128_ge(mr->size, child->size)) {
+                    next = child;
+                }
+            }
+            if (!found) {
+                return NULL;
+            }
+            if (next) {
+                mr = next;
+                continue;
+            }
+        }
+        return mr;
+    }
+    return NULL;
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
@@ -723,6 +818,24 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+static void flatview_build_dispatch(FlatView *view)
+{
+    AddressSpaceDispatch *d;
+    FlatRange *fr;
+
+    if (view->dispatch) {
+        return;
+    }
+
+    d = address_space_dispatch_new();
+    FOR_EACH_FLAT_RANGE(fr, view) {
+        MemoryRegionSection section = section_from_flat_range(fr, NULL);
+        address_space_dispatch_add(d, &section);
+    }
+    address_space_dispatch_compact(d);
+    view->dispatch = d;
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -777,8 +890,9 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
     FlatView *view;
 
     rcu_read_lock();
-    view = atomic_rcu_read(&as->current_map);
-    flatview_ref(view);
+    do {
+        view = atomic_rcu_read(&as->current_map);
+    } while (!flatview_tryref(view));
     rcu_read_unlock();
     return view;
 }
@@ -885,25 +999,53 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* @views caches the FlatViews rendered during this transaction, keyed
+ * by their root, so that each distinct topology is rendered only once.
+ */
+static void address_space_update_topology(AddressSpace *as, GHashTable *views)
 {
+    MemoryRegion *root = memory_region_get_flatview_root(as->root);
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = g_hash_table_lookup(views, root);
+
+    if (!new_view) {
+        new_view = generate_memory_topology(root);
+        g_hash_table_insert(views, root, new_view);
+    }
+
+    if (old_view == new_view || flatview_equal(old_view, new_view)) {
+        /* Nothing to tell the listeners.  Still switch to the shared view
+         * if another address space already paid for its dispatch tree, so
+         * that identical address spaces converge on a single copy.
+         */
+        if (old_view != new_view && new_view->dispatch) {
+            flatview_ref(new_view);
+            atomic_rcu_set(&as->current_map, new_view);
+            atomic_rcu_set(&as->dispatch, new_view->dispatch);
+            flatview_unref(old_view);
+        }
+        flatview_unref(old_view);
+        address_space_update_ioeventfds(as);
+        return;
+    }
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
     /* Writes are protected by the BQL.  */
+    flatview_build_dispatch(new_view);
+    flatview_ref(new_view);
     atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    atomic_rcu_set(&as->dispatch, new_view->dispatch);
 
-    /* Note that all the old MemoryRegions are still alive up to this
-     * point.  This relieves most MemoryListeners from the need to
-     * ref/unref the MemoryRegions they get---unless they use them
-     * outside the iothread mutex, in which case precise reference
-     * counting is necessary.
+    /* Drop both our reference and the one of as->current_map.  The old
+     * MemoryRegions stay alive until RCU readers are done with the view.
+     * This relieves most MemoryListeners from the need to ref/unref the
+     * MemoryRegions they get---unless they use them outside the iothread
+     * mutex, in which case precise reference counting is necessary.
      */
     flatview_unref(old_view);
+    flatview_unref(old_view);
 
     address_space_update_ioeventfds(as);
 }
@@ -928,13 +1070,18 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            GHashTable *views;
+
+            views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                          (GDestroyNotify)flatview_unref);
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            g_hash_table_destroy(views);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1642,9 +1789,15 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client)
 {
+    bool dirty;
+
     assert(mr->ram_block);
-    return cpu_physical_memory_test_and_clear_dirty(
+    dirty = cpu_physical_memory_test_and_clear_dirty(
                 memory_region_get_ram_addr(mr) + addr, size, client);
+    if (dirty) {
+        memory_region_clear_dirty_bitmap(mr, addr, size);
+    }
+    return dirty;
 }
 
 
@@ -1664,6 +1817,38 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    AddressSpace *as;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        FlatView *view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            MemoryRegionSection mrs;
+            hwaddr sec_start, sec_end;
+
+            if (fr->mr != mr) {
+                continue;
+            }
+            mrs = section_from_flat_range(fr, as);
+            sec_start = MAX(mrs.offset_within_region, start);
+            sec_end = MIN(mrs.offset_within_region + int128_get64(mrs.size),
+                          start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+            mrs.offset_within_address_space +=
+                sec_start - mrs.offset_within_region;
+            mrs.offset_within_region = sec_start;
+            mrs.size = int128_make64(sec_end - sec_start);
+            MEMORY_LISTENER_CALL(log_clear, Forward, &mrs);
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1688,8 +1873,10 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
                                hwaddr size, unsigned client)
 {
     assert(mr->ram_block);
-    cpu_physical_memory_test_and_clear_dirty(
-        memory_region_get_ram_addr(mr) + addr, size, client);
+    if (cpu_physical_memory_test_and_clear_dirty(
+            memory_region_get_ram_addr(mr) + addr, size, client)) {
+        memory_region_clear_dirty_bitmap(mr, addr, size);
+    }
 }
 
 int memory_region_get_fd(MemoryRegion *mr)
@@ -1854,6 +2041,112 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+bool mmio_exit_stats_enabled;
+
+void memory_region_account_mmio_exit(MemoryRegion *mr, bool is_write,
+                                     int64_t ns)
+{
+    MemoryRegionExitStats *st = &mr->mmio_exit_stats;
+
+    qemu_spin_lock(&st->lock);
+    if (is_write) {
+        st->writes++;
+    } else {
+        st->reads++;
+    }
+    st->total_ns += ns;
+    st->max_ns = MAX(st->max_ns, ns);
+    qemu_spin_unlock(&st->lock);
+}
+
+/*
+ * Visit every region mapped in an address space once, together with the
+ * first address space and guest address it is mapped at
+ */
+static void mmio_exit_stats_foreach(void (*fn)(MemoryRegion *mr,
+                                               AddressSpace *as,
+                                               hwaddr addr,
+                                               void *opaque),
+                                    void *opaque)
+{
+    GHashTable *seen = g_hash_table_new(NULL, NULL);
+    AddressSpace *as;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        FlatView *view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            if (!memory_region_is_ram(fr->mr) &&
+                !g_hash_table_lookup(seen, fr->mr)) {
+                g_hash_table_insert(seen, fr->mr, fr->mr);
+                fn(fr->mr, as,
+                   int128_get64(fr->addr.start) - fr->offset_in_region,
+                   opaque);
+            }
+        }
+        flatview_unref(view);
+    }
+    g_hash_table_destroy(seen);
+}
+
+static void mmio_exit_stats_reset(MemoryRegion *mr, AddressSpace *as,
+                                  hwaddr addr, void *opaque)
+{
+    MemoryRegionExitStats *st = &mr->mmio_exit_stats;
+
+    qemu_spin_lock(&st->lock);
+    st->reads = st->writes = st->total_ns = st->max_ns = 0;
+    qemu_spin_unlock(&st->lock);
+}
+
+static void mmio_exit_stats_info(MemoryRegion *mr, AddressSpace *as,
+                                 hwaddr addr, void *opaque)
+{
+    MmioExitInfoList **head = opaque;
+    MmioExitInfoList *entry;
+    MmioExitInfo *info = g_new0(MmioExitInfo, 1);
+    MemoryRegionExitStats *st = &mr->mmio_exit_stats;
+
+    qemu_spin_lock(&st->lock);
+    info->reads = st->reads;
+    info->writes = st->writes;
+    info->total_ns = st->total_ns;
+    info->max_ns = st->max_ns;
+    qemu_spin_unlock(&st->lock);
+
+    if (!info->reads && !info->writes) {
+        g_free(info);
+        return;
+    }
+    info->name = g_strdup(memory_region_name(mr) ?: "");
+    info->address_space = g_strdup(as->name ?: "");
+    info->address = addr;
+    info->size = int128_get64(int128_min(mr->size, int128_make64(UINT64_MAX)));
+    info->locked = mr->global_locking;
+    info->ioeventfds = mr->ioeventfd_nb;
+
+    entry = g_new0(MmioExitInfoList, 1);
+    entry->value = info;
+    entry->next = *head;
+    *head = entry;
+}
+
+void qmp_set_mmio_exit_stats(bool enable, Error **errp)
+{
+    if (enable && !mmio_exit_stats_enabled) {
+        mmio_exit_stats_foreach(mmio_exit_stats_reset, NULL);
+    }
+    atomic_mb_set(&mmio_exit_stats_enabled, enable);
+}
+
+MmioExitInfoList *qmp_query_mmio_exits(Error **errp)
+{
+    MmioExitInfoList *head = NULL;
+
+    mmio_exit_stats_foreach(mmio_exit_stats_info, &head);
+    return head;
+}
+
 void memory_region_set_global_locking(MemoryRegion *mr)
 {
     mr->global_locking = true;
@@ -2293,11 +2586,19 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->malloced = false;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
+    flatview_build_dispatch(as->current_map);
+    as->dispatch = as->current_map->dispatch;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    qemu_mutex_init(&as->map_lock);
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    as->bounce_maps = 0;
+    as->bounce_failures = 0;
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_clients);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
-    address_space_init_dispatch(as);
     memory_region_update_pending |= root->enabled;
     memory_region_transaction_commit();
 }
@@ -2307,12 +2608,14 @@ static void do_address_space_destroy(AddressSpace *as)
     MemoryListener *listener;
     bool do_free = as->malloced;
 
-    address_space_destroy_dispatch(as);
-
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
         assert(listener->address_space_filter != as);
     }
 
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_clients));
+    qemu_mutex_destroy(&as->map_lock);
+
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
@@ -2352,7 +2655,6 @@ void address_space_destroy(AddressSpace *as)
     as->root = NULL;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
-    address_space_unregister(as);
 
     /* At this point, as->dispatch and as->current_map are dummy
      * entries that the guest should never use.  Wait for the old
@@ -2480,6 +2782,13 @@ void mtree_info(fprintf_function mon_printf, void *f)
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         mon_printf(f, "address-space: %s\n", as->name);
+        if (as->bounce_maps || as->bounce_failures) {
+            mon_printf(f, "  bounce buffers: %zu maps, %zu failed, "
+                       "%zu/%zu bytes in use\n",
+                       as->bounce_maps, as->bounce_failures,
+                       atomic_read(&as->bounce_buffer_size),
+                       as->max_bounce_buffer_size);
+        }
         mtree_print_mr(mon_printf, f, as->root, 1, 0, &ml_head);
         mon_printf(f, "\n");
     }
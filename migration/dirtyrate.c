@@ -0,0 +1,209 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/crc32c.h"
+#include "qemu/rcu.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+/*
+ * The rate is estimated without touching the dirty log, so that it can
+ * run while the guest is not being migrated: a random sample of pages of
+ * every RAM block is hashed, hashed again after calc-time seconds, and
+ * the fraction of changed pages is scaled to the size of the blocks.
+ */
+
+#define DIRTYRATE_MIN_CALC_TIME         1
+#define DIRTYRATE_MAX_CALC_TIME         60
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512     /* per GiB of RAM */
+#define DIRTYRATE_MIN_SAMPLE_PAGES      128
+#define DIRTYRATE_MAX_SAMPLE_PAGES      4096
+
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    ram_addr_t used_length;
+    unsigned int npages;
+    ram_addr_t *offsets;
+    uint32_t *hashes;
+} DirtyRateBlock;
+
+typedef struct DirtyRateState {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    int64_t dirty_rate;
+} DirtyRateState;
+
+static DirtyRateState dirtyrate = {
+    .status = DIRTY_RATE_STATUS_UNSTARTED,
+};
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32c(0xffffffff, ramblock_ptr(block, offset), TARGET_PAGE_SIZE);
+}
+
+static DirtyRateBlock *dirtyrate_sample(int64_t sample_pages, int *nblocks)
+{
+    DirtyRateBlock *info = NULL;
+    RAMBlock *block;
+    int n = 0, i;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        DirtyRateBlock *b;
+        uint64_t pages = block->used_length >> TARGET_PAGE_BITS;
+
+        if (!pages || !block->host) {
+            continue;
+        }
+        info = g_renew(DirtyRateBlock, info, n + 1);
+        b = &info[n++];
+        pstrcpy(b->idstr, sizeof(b->idstr), block->idstr);
+        b->used_length = block->used_length;
+        b->npages = MIN(pages, MAX(1, sample_pages * block->used_length >> 30));
+        b->offsets = g_new(ram_addr_t, b->npages);
+        b->hashes = g_new(uint32_t, b->npages);
+        for (i = 0; i < b->npages; i++) {
+            b->offsets[i] = (ram_addr_t)(g_random_double() * pages)
+                            << TARGET_PAGE_BITS;
+            b->hashes[i] = dirtyrate_hash_page(block, b->offsets[i]);
+        }
+    }
+    rcu_read_unlock();
+
+    *nblocks = n;
+    return info;
+}
+
+/* Blocks that were resized or removed in the meantime are skipped */
+static int64_t dirtyrate_compare(DirtyRateBlock *info, int nblocks,
+                                 int64_t elapsed_ms)
+{
+    RAMBlock *block;
+    uint64_t sampled = 0, dirty = 0, total = 0;
+    int i, j;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        for (i = 0; i < nblocks; i++) {
+            if (!strcmp(info[i].idstr, block->idstr) &&
+                info[i].used_length == block->used_length) {
+                break;
+            }
+        }
+        if (i == nblocks) {
+            continue;
+        }
+        for (j = 0; j < info[i].npages; j++) {
+            if (dirtyrate_hash_page(block, info[i].offsets[j]) !=
+                info[i].hashes[j]) {
+                dirty++;
+            }
+        }
+        sampled += info[i].npages;
+        total += info[i].used_length;
+    }
+    rcu_read_unlock();
+
+    if (!sampled || !elapsed_ms) {
+        return 0;
+    }
+    /* MB/s */
+    return (double)dirty / sampled * total / (1024 * 1024) * 1000 / elapsed_ms;
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateBlock *info;
+    int64_t start, dirty_rate;
+    int nblocks, i;
+
+    rcu_register_thread();
+
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    info = dirtyrate_sample(dirtyrate.sample_pages, &nblocks);
+    g_usleep(dirtyrate.calc_time * G_USEC_PER_SEC);
+    dirty_rate = dirtyrate_compare(info, nblocks,
+                                   qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                   start);
+
+    for (i = 0; i < nblocks; i++) {
+        g_free(info[i].offsets);
+        g_free(info[i].hashes);
+    }
+    g_free(info);
+
+    trace_dirtyrate_measured(dirty_rate);
+    dirtyrate.dirty_rate = dirty_rate;
+    atomic_mb_set(&dirtyrate.status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    QemuThread thread;
+
+    if (atomic_mb_read(&dirtyrate.status) == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "an integer in the range of 128 to 4096");
+        return;
+    }
+
+    dirtyrate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    dirtyrate.calc_time = calc_time;
+    dirtyrate.sample_pages = sample_pages;
+    dirtyrate.dirty_rate = 0;
+    atomic_mb_set(&dirtyrate.status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+
+    info->status = atomic_mb_read(&dirtyrate.status);
+    info->start_time = dirtyrate.start_time;
+    info->calc_time = dirtyrate.calc_time;
+    info->sample_pages = dirtyrate.sample_pages;
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirtyrate.dirty_rate;
+    }
+
+    return info;
+}
@@ -35,6 +35,7 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "io/channel-buffer.h"
+#include "io/channel-socket.h"
 #include "io/channel-tls.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
@@ -54,6 +55,17 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+/* Default number of multifd channels */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default number of host pages prefetched after a postcopy fault */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES 8
+/* Device state is serialized by the migration thread by default */
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREADS 0
+/* The main stream uses a single small buffer by default */
+#define DEFAULT_MIGRATE_STREAM_BUFFER_SIZE 0
+#define MAX_MIGRATE_STREAM_BUFFER_SIZE (64 * 1024 * 1024)
+/* Incoming pages are copied by the incoming coroutine by default */
+#define DEFAULT_MIGRATE_LOAD_THREADS 0
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -89,11 +101,18 @@ MigrationState *migrate_get_current(void)
             .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
             .cpu_throttle_initial = DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
             .cpu_throttle_increment = DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
+            .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .postcopy_prefetch_pages = DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES,
+            .device_state_threads = DEFAULT_MIGRATE_DEVICE_STATE_THREADS,
+            .stream_buffer_size = DEFAULT_MIGRATE_STREAM_BUFFER_SIZE,
+            .load_threads = DEFAULT_MIGRATE_LOAD_THREADS,
         },
     };
 
     if (!once) {
         qemu_mutex_init(&current_migration.src_page_req_mutex);
+        qemu_sem_init(&current_migration.postcopy_pause_sem, 0);
+        qemu_sem_init(&current_migration.rp_state.rp_sem, 0);
         once = true;
     }
     return &current_migration;
@@ -115,12 +134,24 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
     QLIST_INIT(&mis_current->loadvm_handlers);
     qemu_mutex_init(&mis_current->rp_mutex);
     qemu_event_init(&mis_current->main_thread_load_event, false);
+    qemu_sem_init(&mis_current->postcopy_pause_sem_dst, 0);
+    qemu_mutex_init(&mis_current->page_request_mutex);
+    mis_current->page_requested = g_hash_table_new(g_direct_hash,
+                                                   g_direct_equal);
 
     return mis_current;
 }
 
 void migration_incoming_state_destroy(void)
 {
+    if (mis_current->postcopy_preempt_file) {
+        qemu_fclose(mis_current->postcopy_preempt_file);
+    }
+    g_hash_table_destroy(mis_current->page_requested);
+    qemu_mutex_destroy(&mis_current->page_request_mutex);
+    qemu_sem_destroy(&mis_current->postcopy_pause_sem_dst);
+    ram_postcopy_recv_bitmap_free();
+    migrate_load_threads_join();
     qemu_event_destroy(&mis_current->main_thread_load_event);
     loadvm_free_handlers(mis_current);
     g_free(mis_current);
@@ -315,6 +346,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -379,6 +412,7 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    multifd_load_cleanup();
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -416,23 +450,135 @@ static void process_incoming_migration_co(void *opaque)
     qemu_bh_schedule(mis->bh);
 }
 
+/*
+ * Set up the buffers of the main migration stream; outgoing streams are
+ * sent by a separate thread when a buffer size is configured
+ */
+static void migrate_setup_stream_buffer(QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->parameters.stream_buffer_size) {
+        qemu_file_set_buffering(f, s->parameters.stream_buffer_size, true);
+    }
+}
+
 void migration_fd_process_incoming(QEMUFile *f)
 {
     Coroutine *co = qemu_coroutine_create(process_incoming_migration_co, f);
 
     migrate_decompress_threads_create();
+    migrate_load_threads_create();
     qemu_file_set_blocking(f, false);
     qemu_coroutine_enter(co);
 }
 
 
+/*
+ * With multifd the main channel arrives first; its stream is only
+ * processed once all the multifd channels have connected, because
+ * loading RAM has to wait for them.
+ */
+static QEMUFile *multifd_incoming_main_file;
+
+static void multifd_channel_process_incoming(QIOChannel *ioc)
+{
+    Error *local_err = NULL;
+
+    if (!multifd_incoming_main_file) {
+        if (multifd_load_setup() < 0) {
+            error_report("Unable to set up multifd threads");
+            return;
+        }
+        multifd_incoming_main_file = qemu_fopen_channel_input(ioc);
+        migrate_setup_stream_buffer(multifd_incoming_main_file);
+    } else {
+        multifd_recv_new_channel(ioc, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            return;
+        }
+    }
+
+    if (multifd_recv_all_channels_created()) {
+        QEMUFile *f = multifd_incoming_main_file;
+
+        multifd_incoming_main_file = NULL;
+        migration_fd_process_incoming(f);
+    }
+}
+
+/*
+ * Returns true when the incoming side needs no further connections
+ * and can close its listening socket.
+ */
+bool migration_has_all_channels(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (mis && mis->have_listen_thread) {
+        /* Postcopy is running, or being recovered over one new channel */
+        return true;
+    }
+    if (migrate_postcopy_preempt() &&
+        !migrate_get_current()->parameters.tls_creds &&
+        (!mis || !mis->postcopy_preempt_file)) {
+        return false;
+    }
+    return !migrate_use_multifd() || multifd_recv_all_channels_created();
+}
+
+/*
+ * A new connection from the source of a paused postcopy migration; the
+ * listen thread carries on loading from it.
+ */
+static void migration_incoming_recover(MigrationIncomingState *mis,
+                                       QIOChannel *ioc)
+{
+    QEMUFile *f = qemu_fopen_channel_input(ioc);
+    QEMUFile *rp = qemu_file_get_return_path(f);
+
+    if (!rp) {
+        error_report("Unable to open return-path for postcopy recovery");
+        qemu_fclose(f);
+        return;
+    }
+
+    trace_migration_incoming_recover();
+    mis->from_src_file = f;
+    qemu_mutex_lock(&mis->rp_mutex);
+    mis->to_src_file = rp;
+    qemu_mutex_unlock(&mis->rp_mutex);
+
+    migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_PAUSED,
+                      MIGRATION_STATUS_POSTCOPY_RECOVER);
+    qemu_sem_post(&mis->postcopy_pause_sem_dst);
+}
+
 void migration_channel_process_incoming(MigrationState *s,
                                         QIOChannel *ioc)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
     trace_migration_set_incoming_channel(
         ioc, object_get_typename(OBJECT(ioc)));
 
-    if (s->parameters.tls_creds &&
+    if (mis && mis->state == MIGRATION_STATUS_POSTCOPY_PAUSED &&
+        (!s->parameters.tls_creds ||
+         object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TLS))) {
+        migration_incoming_recover(mis, ioc);
+    } else if (migrate_postcopy_preempt() && mis && mis->from_src_file) {
+        /* The main channel is already being loaded */
+        postcopy_preempt_new_channel(mis, ioc);
+    } else if (migrate_use_multifd()) {
+        if (s->parameters.tls_creds ||
+            !object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_SOCKET)) {
+            error_report("multifd migration needs a tcp: or unix: "
+                         "channel without TLS");
+            return;
+        }
+        multifd_channel_process_incoming(ioc);
+    } else if (s->parameters.tls_creds &&
         !object_dynamic_cast(OBJECT(ioc),
                              TYPE_QIO_CHANNEL_TLS)) {
         Error *local_err = NULL;
@@ -442,6 +588,7 @@ void migration_channel_process_incoming(MigrationState *s,
         }
     } else {
         QEMUFile *f = qemu_fopen_channel_input(ioc);
+        migrate_setup_stream_buffer(f);
         migration_fd_process_incoming(f);
     }
 }
@@ -466,6 +613,11 @@ void migration_channel_connect(MigrationState *s,
     } else {
         QEMUFile *f = qemu_fopen_channel_output(ioc);
 
+        migrate_setup_stream_buffer(f);
+        if (s->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+            migrate_fd_connect_resume(s, f);
+            return;
+        }
         s->to_dst_file = f;
 
         migrate_fd_connect(s);
@@ -483,13 +635,52 @@ void migrate_send_rp_message(MigrationIncomingState *mis,
 {
     trace_migrate_send_rp_message((int)message_type, len);
     qemu_mutex_lock(&mis->rp_mutex);
-    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
-    qemu_put_be16(mis->to_src_file, len);
-    qemu_put_buffer(mis->to_src_file, data, len);
-    qemu_fflush(mis->to_src_file);
+    /* While postcopy is paused there is no return path */
+    if (mis->to_src_file) {
+        qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+        qemu_put_be16(mis->to_src_file, len);
+        qemu_put_buffer(mis->to_src_file, data, len);
+        qemu_fflush(mis->to_src_file);
+    }
     qemu_mutex_unlock(&mis->rp_mutex);
 }
 
+/*
+ * Send the received bitmap of a RAMBlock, for the source to resume a
+ * paused postcopy; it is too large for a message, so it follows the
+ * message on the stream.
+ */
+void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
+                                 const char *block_name)
+{
+    size_t len = strlen(block_name);
+    uint8_t buf[256];
+
+    trace_migrate_send_rp_recv_bitmap(block_name);
+    assert(len < 256);
+    buf[0] = len;
+    memcpy(buf + 1, block_name, len);
+
+    qemu_mutex_lock(&mis->rp_mutex);
+    if (mis->to_src_file) {
+        qemu_put_be16(mis->to_src_file, MIG_RP_MSG_RECV_BITMAP);
+        qemu_put_be16(mis->to_src_file, len + 1);
+        qemu_put_buffer(mis->to_src_file, buf, len + 1);
+        ram_write_recv_bitmap(mis->to_src_file, block_name);
+        qemu_fflush(mis->to_src_file);
+    }
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/* Tell the source that a recovered postcopy can go on */
+void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_RESUME_ACK, sizeof(buf), &buf);
+}
+
 /*
  * Send a 'SHUT' message on the return channel with the given value
  * to indicate that we've finished with the RP.  Non-0 value indicates
@@ -566,6 +757,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->tls_hostname = g_strdup(s->parameters.tls_hostname);
+    params->multifd_channels = s->parameters.multifd_channels;
+    params->compress_method = s->parameters.compress_method;
+    params->postcopy_prefetch_pages = s->parameters.postcopy_prefetch_pages;
+    params->device_state_threads = s->parameters.device_state_threads;
+    params->stream_buffer_size = s->parameters.stream_buffer_size;
+    params->load_threads = s->parameters.load_threads;
 
     return params;
 }
@@ -579,6 +776,8 @@ static bool migration_is_setup_or_active(int state)
     switch (state) {
     case MIGRATION_STATUS_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_PAUSED:
+    case MIGRATION_STATUS_POSTCOPY_RECOVER:
     case MIGRATION_STATUS_SETUP:
         return true;
 
@@ -598,10 +797,36 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_vcpu_dirty_limit(MigrationInfo *info)
+{
+    VcpuDirtyLimitList **tail = &info->vcpu_dirty_limit;
+    CPUState *cpu;
+
+    /* Only TCG tells which vcpu dirtied a page */
+    if (!migrate_dirty_limit() || !tcg_enabled()) {
+        return;
+    }
+
+    info->has_vcpu_dirty_limit = true;
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->cpu_index = cpu->cpu_index;
+        entry->value->dirty_rate = cpu->dirty_pages_rate;
+        entry->value->throttle_percentage =
+            cpu_throttle_get_vcpu_percentage(cpu);
+        *tail = entry;
+        tail = &entry->next;
+    }
+}
+
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 {
     info->has_ram = true;
@@ -626,6 +851,15 @@ MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
     MigrationState *s = migrate_get_current();
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (mis && (mis->state == MIGRATION_STATUS_POSTCOPY_PAUSED ||
+                mis->state == MIGRATION_STATUS_POSTCOPY_RECOVER)) {
+        /* The destination has to be told to recover */
+        info->has_status = true;
+        info->status = mis->state;
+        return info;
+    }
 
     switch (s->state) {
     case MIGRATION_STATUS_NONE:
@@ -661,9 +895,12 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->cpu_throttle_percentage = cpu_throttle_get_percentage();
         }
 
+        get_vcpu_dirty_limit(info);
         get_xbzrle_cache_stats(info);
         break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_PAUSED:
+    case MIGRATION_STATUS_POSTCOPY_RECOVER:
         /* Mostly the same as active; TODO add some postcopy stats */
         info->has_status = true;
         info->has_total_time = true;
@@ -757,6 +994,47 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* RAM pages sent on the multifd channels bypass the main stream,
+         * so everything that encodes pages in that stream, or needs them
+         * to be placed atomically, is out.
+         */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle()) {
+            error_report("multifd is not currently compatible with "
+                         "postcopy-ram, compress or xbzrle");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_use_zero_copy_send() && !migrate_use_multifd()) {
+        /* Only the multifd channels send guest pages without copying */
+        error_report("zero-copy-send requires multifd");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND] = false;
+    }
+
+    if (migrate_dirty_limit() && !migrate_auto_converge()) {
+        error_report("dirty-limit requires auto-converge");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT] = false;
+    }
+
+    if (migrate_postcopy_preempt() && !migrate_postcopy_ram()) {
+        error_report("postcopy-preempt requires postcopy-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT] = false;
+    }
+
+    if (migrate_background_snapshot() && migrate_postcopy_ram()) {
+        error_report("background-snapshot is not compatible with "
+                     "postcopy-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] =
+            false;
+    }
+
+    if (migrate_ignore_shared() && migrate_postcopy_ram()) {
+        error_report("x-ignore-shared is not compatible with postcopy-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED] = false;
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -773,6 +1051,18 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 const char *tls_creds,
                                 bool has_tls_hostname,
                                 const char *tls_hostname,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_postcopy_prefetch_pages,
+                                int64_t postcopy_prefetch_pages,
+                                bool has_device_state_threads,
+                                int64_t device_state_threads,
+                                bool has_stream_buffer_size,
+                                int64_t stream_buffer_size,
+                                bool has_load_threads,
+                                int64_t load_threads,
                                 Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -808,6 +1098,49 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_multifd_channels &&
+            (multifd_channels < 1 || multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_postcopy_prefetch_pages &&
+            (postcopy_prefetch_pages < 0 || postcopy_prefetch_pages > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to 64");
+        return;
+    }
+    if (has_device_state_threads &&
+            (device_state_threads < 0 || device_state_threads > 16)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "device_state_threads",
+                   "is invalid, it should be in the range of 0 to 16");
+        return;
+    }
+    if (has_stream_buffer_size && stream_buffer_size &&
+            (stream_buffer_size < QEMU_FILE_MIN_BUFFER_SIZE ||
+             stream_buffer_size > MAX_MIGRATE_STREAM_BUFFER_SIZE)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "stream_buffer_size",
+                   "is invalid, it should be 0 or in the range of "
+                   "32768 to 67108864");
+        return;
+    }
+    if (has_load_threads && (load_threads < 0 || load_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "load_threads",
+                   "is invalid, it should be in the range of 0 to 255");
+        return;
+    }
+#ifndef CONFIG_ZSTD
+    if (has_compress_method &&
+            compress_method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        error_setg(errp, "zstd support is not compiled in");
+        return;
+    }
+#endif
 
     if (has_compress_level) {
         s->parameters.compress_level = compress_level;
@@ -832,6 +1165,24 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         g_free(s->parameters.tls_hostname);
         s->parameters.tls_hostname = g_strdup(tls_hostname);
     }
+    if (has_multifd_channels) {
+        s->parameters.multifd_channels = multifd_channels;
+    }
+    if (has_compress_method) {
+        s->parameters.compress_method = compress_method;
+    }
+    if (has_postcopy_prefetch_pages) {
+        s->parameters.postcopy_prefetch_pages = postcopy_prefetch_pages;
+    }
+    if (has_device_state_threads) {
+        s->parameters.device_state_threads = device_state_threads;
+    }
+    if (has_stream_buffer_size) {
+        s->parameters.stream_buffer_size = stream_buffer_size;
+    }
+    if (has_load_threads) {
+        s->parameters.load_threads = load_threads;
+    }
 }
 
 
@@ -886,9 +1237,12 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_save_cleanup();
+        postcopy_preempt_send_cleanup(s);
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
+    socket_send_channel_cleanup();
 
     assert((s->state != MIGRATION_STATUS_ACTIVE) &&
            (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
@@ -904,7 +1258,14 @@ static void migrate_fd_cleanup(void *opaque)
 void migrate_fd_error(MigrationState *s, const Error *error)
 {
     trace_migrate_fd_error(error ? error_get_pretty(error) : "");
+    if (s->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        /* Only the attempt to resume failed, postcopy stays paused */
+        error_report("Unable to resume postcopy: %s",
+                     error ? error_get_pretty(error) : "");
+        return;
+    }
     assert(s->to_dst_file == NULL);
+    socket_send_channel_cleanup();
     migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
                       MIGRATION_STATUS_FAILED);
     if (!s->error) {
@@ -941,7 +1302,13 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
+        if (s->postcopy_qemufile_src) {
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+        }
     }
+    /* A paused postcopy migration thread waits to be resumed */
+    qemu_sem_post(&s->postcopy_pause_sem);
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -1071,7 +1438,7 @@ bool migration_is_blocked(Error **errp)
 
 void qmp_migrate(const char *uri, bool has_blk, bool blk,
                  bool has_inc, bool inc, bool has_detach, bool detach,
-                 Error **errp)
+                 bool has_resume, bool resume, Error **errp)
 {
     Error *local_err = NULL;
     MigrationState *s = migrate_get_current();
@@ -1081,21 +1448,29 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = has_blk && blk;
     params.shared = has_inc && inc;
 
-    if (migration_is_setup_or_active(s->state) ||
-        s->state == MIGRATION_STATUS_CANCELLING) {
-        error_setg(errp, QERR_MIGRATION_ACTIVE);
-        return;
-    }
-    if (runstate_check(RUN_STATE_INMIGRATE)) {
-        error_setg(errp, "Guest is waiting for an incoming migration");
-        return;
-    }
+    if (has_resume && resume) {
+        if (s->state != MIGRATION_STATUS_POSTCOPY_PAUSED) {
+            error_setg(errp, "There is no paused postcopy migration "
+                       "to resume");
+            return;
+        }
+    } else {
+        if (migration_is_setup_or_active(s->state) ||
+            s->state == MIGRATION_STATUS_CANCELLING) {
+            error_setg(errp, QERR_MIGRATION_ACTIVE);
+            return;
+        }
+        if (runstate_check(RUN_STATE_INMIGRATE)) {
+            error_setg(errp, "Guest is waiting for an incoming migration");
+            return;
+        }
 
-    if (migration_is_blocked(errp)) {
-        return;
-    }
+        if (migration_is_blocked(errp)) {
+            return;
+        }
 
-    s = migrate_init(&params);
+        s = migrate_init(&params);
+    }
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -1109,6 +1484,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -1129,6 +1506,41 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_recover(const char *uri, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    const char *p;
+
+    if (!mis || mis->state != MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        error_setg(errp, "There is no paused incoming postcopy migration");
+        return;
+    }
+
+    if (strstart(uri, "tcp:", &p)) {
+        tcp_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "unix:", &p)) {
+        unix_start_incoming_migration(p, errp);
+    } else {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                   "a tcp: or unix: URI");
+    }
+}
+
+void qmp_migrate_pause(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    /* The loading/sending side notices the broken stream and pauses */
+    if (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        qemu_file_shutdown(s->to_dst_file);
+    } else if (mis && mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        qemu_file_shutdown(mis->from_src_file);
+    } else {
+        error_setg(errp, "There is no postcopy migration to pause");
+    }
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -1261,6 +1673,114 @@ bool migrate_use_events(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+}
+
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_pages;
+}
+
+int migrate_device_state_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.device_state_threads;
+}
+
+int migrate_load_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.load_threads;
+}
+
+bool migrate_prefault_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PREFAULT_RAM];
+}
+
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_channels;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -1298,6 +1818,8 @@ static struct rp_cmd_args {
     [MIG_RP_MSG_PONG]           = { .len =  4, .name = "PONG" },
     [MIG_RP_MSG_REQ_PAGES]      = { .len = 12, .name = "REQ_PAGES" },
     [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
+    [MIG_RP_MSG_RECV_BITMAP]    = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_RP_MSG_RESUME_ACK]     = { .len =  4, .name = "RESUME_ACK" },
     [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
 };
 
@@ -1428,6 +1950,31 @@ static void *source_return_path_thread(void *opaque)
             migrate_handle_rp_req_pages(ms, (char *)&buf[13], start, len);
             break;
 
+        case MIG_RP_MSG_RECV_BITMAP:
+            if (header_len < 1 || header_len != 1 + buf[0]) {
+                error_report("RP: Recv_Bitmap with length %d", header_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            buf[header_len] = '\0';
+            if (ram_dirty_bitmap_reload(ms, rp, (char *)&buf[1])) {
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            break;
+
+        case MIG_RP_MSG_RESUME_ACK:
+            tmp32 = ldl_be_p(buf);
+            trace_source_return_path_thread_resume_ack(tmp32);
+            if (ms->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+                error_report("RP: Resume_Ack while not recovering");
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            ms->rp_state.resume_ack = true;
+            qemu_sem_post(&ms->rp_state.rp_sem);
+            break;
+
         default:
             break;
         }
@@ -1441,6 +1988,10 @@ static void *source_return_path_thread(void *opaque)
 out:
     ms->rp_state.from_dst_file = NULL;
     qemu_fclose(rp);
+    if (ms->state == MIGRATION_STATUS_POSTCOPY_RECOVER) {
+        /* Don't leave the migration thread waiting for the ack */
+        qemu_sem_post(&ms->rp_state.rp_sem);
+    }
     return NULL;
 }
 
@@ -1483,6 +2034,73 @@ static int await_return_path_close_on_source(MigrationState *ms)
     return ms->rp_state.error;
 }
 
+/*
+ * Resynchronise with the destination over a new connection: its received
+ * bitmaps replace our dirty bitmap, so that everything it doesn't have is
+ * sent again.  Returns non-0 on error.
+ */
+static int postcopy_do_resume(MigrationState *s)
+{
+    trace_postcopy_do_resume();
+    ram_postcopy_resume_prepare(s->to_dst_file);
+    qemu_savevm_send_postcopy_resume(s->to_dst_file);
+    qemu_fflush(s->to_dst_file);
+
+    /* The return path thread reloads the bitmaps, then gets the ack */
+    qemu_sem_wait(&s->rp_state.rp_sem);
+    if (!s->rp_state.resume_ack || s->rp_state.error ||
+        qemu_file_get_error(s->to_dst_file)) {
+        error_report("Failed to resume postcopy migration");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The connection broke during postcopy.  Neither side has the whole guest
+ * any more, so instead of failing wait for 'migrate' with 'resume' to set
+ * up a new one (see migrate_fd_connect_resume).  Returns true when
+ * postcopy can go on, false if the migration was cancelled meanwhile.
+ */
+static bool postcopy_pause(MigrationState *s)
+{
+    int state = MIGRATION_STATUS_POSTCOPY_ACTIVE;
+
+    while (true) {
+        trace_postcopy_pause();
+
+        /* Make the return path thread exit, a new one comes with resume */
+        qemu_file_shutdown(s->to_dst_file);
+        if (s->rp_state.from_dst_file) {
+            qemu_file_shutdown(s->rp_state.from_dst_file);
+        }
+        qemu_thread_join(&s->rp_state.rp_thread);
+
+        qemu_mutex_lock_iothread();
+        postcopy_preempt_send_cleanup(s);
+        qemu_mutex_unlock_iothread();
+
+        migrate_set_state(&s->state, state, MIGRATION_STATUS_POSTCOPY_PAUSED);
+        error_report("Postcopy migration paused, waiting for it to be "
+                     "resumed");
+        while (s->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+            qemu_sem_wait(&s->postcopy_pause_sem);
+        }
+        if (s->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+            return false;
+        }
+
+        if (!postcopy_do_resume(s)) {
+            migrate_set_state(&s->state, MIGRATION_STATUS_POSTCOPY_RECOVER,
+                              MIGRATION_STATUS_POSTCOPY_ACTIVE);
+            trace_postcopy_pause_continued();
+            return s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE;
+        }
+        state = MIGRATION_STATUS_POSTCOPY_RECOVER;
+    }
+}
+
 /*
  * Switch from normal iteration to postcopy
  * Returns non-0 on error
@@ -1632,7 +2250,8 @@ static void migration_completion(MigrationState *s, int current_active_state,
 
         if (!ret) {
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
-            if (ret >= 0) {
+            /* A snapshot's guest keeps using its images */
+            if (ret >= 0 && !migrate_background_snapshot()) {
                 ret = bdrv_inactivate_all();
             }
             if (ret >= 0) {
@@ -1682,7 +2301,8 @@ fail_invalidate:
     /* If not doing postcopy, vm_start() will be called: let's regain
      * control on images.
      */
-    if (s->state == MIGRATION_STATUS_ACTIVE) {
+    if (s->state == MIGRATION_STATUS_ACTIVE &&
+        !migrate_background_snapshot()) {
         Error *local_err = NULL;
 
         bdrv_invalidate_cache_all(&local_err);
@@ -1781,7 +2401,15 @@ static void *migration_thread(void *opaque)
             }
         }
 
-        if (qemu_file_get_error(s->to_dst_file)) {
+        if (qemu_file_get_error(s->to_dst_file) ||
+            (entered_postcopy && s->rp_state.error)) {
+            if (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+                postcopy_pause(s)) {
+                /* Carry on over the new connection */
+                initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                initial_bytes = 0;
+                continue;
+            }
             migrate_set_state(&s->state, current_active_state,
                               MIGRATION_STATUS_FAILED);
             trace_migration_thread_file_err();
@@ -1833,7 +2461,12 @@ static void *migration_thread(void *opaque)
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        if (migrate_background_snapshot() && old_vm_running) {
+            /* The snapshot is written, the guest carries on */
+            vm_start();
+        } else {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
     } else {
         if (old_vm_running && !entered_postcopy) {
             vm_start();
@@ -1850,6 +2483,36 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * A new connection to the destination of a paused postcopy migration;
+ * the migration thread resumes over it.
+ */
+void migrate_fd_connect_resume(MigrationState *s, QEMUFile *f)
+{
+    QEMUFile *old = s->to_dst_file;
+
+    trace_migrate_fd_connect_resume();
+    qemu_file_set_blocking(f, true);
+    qemu_file_set_rate_limit(f, s->bandwidth_limit / XFER_LIMIT_RATIO);
+    /* The migration thread is waiting, it doesn't use the old one */
+    s->to_dst_file = f;
+    qemu_fclose(old);
+
+    s->rp_state.error = false;
+    s->rp_state.resume_ack = false;
+    while (!qemu_sem_timedwait(&s->rp_state.rp_sem, 0)) {
+        /* Drop wakeups left over from an earlier attempt */
+    }
+    if (open_return_path_on_source(s)) {
+        error_report("Unable to open return-path for postcopy");
+        return;
+    }
+
+    migrate_set_state(&s->state, MIGRATION_STATUS_POSTCOPY_PAUSED,
+                      MIGRATION_STATUS_POSTCOPY_RECOVER);
+    qemu_sem_post(&s->postcopy_pause_sem);
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     /* This is a best 1st approximation. ns to ms */
@@ -1875,9 +2538,18 @@ void migrate_fd_connect(MigrationState *s)
             migrate_fd_cleanup(s);
             return;
         }
+        if (migrate_postcopy_preempt()) {
+            postcopy_preempt_send_setup(s);
+        }
     }
 
     migrate_compress_threads_create();
+    if (multifd_save_setup() < 0) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
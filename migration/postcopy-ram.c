@@ -24,6 +24,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qapi/error.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -31,6 +33,9 @@
  */
 #define MAX_DISCARDS_PER_COMMAND 12
 
+/* Requested pages that have arrived are dropped beyond this many */
+#define POSTCOPY_REQUESTED_PRUNE 4096
+
 struct PostcopyDiscardState {
     const char *ramblock_name;
     uint64_t offset; /* Bitmap entry for the 1st bit of this RAMBlock */
@@ -277,6 +282,15 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        if (qemu_file_get_error(mis->from_src_file)) {
+            /* The source is gone, don't wait for the end of the channel */
+            qemu_file_shutdown(mis->postcopy_preempt_file);
+        }
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -398,7 +412,6 @@ static void *postcopy_ram_fault_thread(void *opaque)
     int ret;
     size_t hostpagesize = getpagesize();
     RAMBlock *rb = NULL;
-    RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
@@ -472,15 +485,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
          * Send the request to the source - we want to request one
          * of our host page sizes (which is >= TPS)
          */
-        if (rb != last_rb) {
-            last_rb = rb;
-            migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, hostpagesize);
-        } else {
-            /* Save some space */
-            migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, hostpagesize);
-        }
+        postcopy_request_page(mis, rb, rb_offset,
+                              (void *)(uintptr_t)(msg.arg.pagefault.address &
+                                                  ~(hostpagesize - 1)));
     }
     trace_postcopy_ram_fault_thread_exit();
     return NULL;
@@ -614,6 +621,67 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return mis->postcopy_tmp_page;
 }
 
+/*
+ * Loads the pages the source sends on the preempt channel; it has its
+ * own temporary page since it runs next to the listen thread.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f = mis->postcopy_preempt_file;
+    void *tmp_page;
+    uint32_t magic;
+    int ret = 0;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+    qemu_file_set_blocking(f, true);
+
+    magic = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        /* Closed before use, everything goes on the main channel */
+        goto out;
+    }
+    if (magic != POSTCOPY_PREEMPT_MAGIC) {
+        error_report("%s: bad channel magic 0x%x", __func__, magic);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    tmp_page = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tmp_page == MAP_FAILED) {
+        ret = -errno;
+        error_report("%s: %s", __func__, strerror(errno));
+        goto out;
+    }
+    ret = ram_load_postcopy_preempt(f, tmp_page);
+    munmap(tmp_page, getpagesize());
+    if (ret < 0) {
+        error_report("%s: loading pages failed: %d", __func__, ret);
+    }
+
+out:
+    if (ret < 0) {
+        /* Make the listen thread fail too */
+        qemu_file_shutdown(mis->from_src_file);
+    }
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void postcopy_preempt_incoming_start(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_preempt_file || mis->have_preempt_thread) {
+        return;
+    }
+
+    mis->have_preempt_thread = true;
+    qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+}
+
 #else
 /* No target OS support, stubs just fail */
 bool postcopy_ram_supported_by_host(void)
@@ -671,10 +739,181 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+void postcopy_preempt_incoming_start(MigrationIncomingState *mis)
+{
+    assert(0);
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
 
+static gboolean postcopy_page_arrived(gpointer key, gpointer value,
+                                      gpointer opaque)
+{
+    return ram_postcopy_page_received(key);
+}
+
+/*
+ * Ask the source for the host page at @offset of @rb (@host), and remember
+ * it so that it can be asked for again after a postcopy recovery.
+ */
+void postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
+                           ram_addr_t offset, void *host)
+{
+    qemu_mutex_lock(&mis->page_request_mutex);
+    if (g_hash_table_size(mis->page_requested) >= POSTCOPY_REQUESTED_PRUNE) {
+        g_hash_table_foreach_remove(mis->page_requested,
+                                    postcopy_page_arrived, NULL);
+    }
+    g_hash_table_insert(mis->page_requested, host, host);
+
+    if (rb != mis->last_rb) {
+        mis->last_rb = rb;
+        migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
+                                  offset, getpagesize());
+    } else {
+        /* Save some space */
+        migrate_send_rp_req_pages(mis, NULL, offset, getpagesize());
+    }
+    qemu_mutex_unlock(&mis->page_request_mutex);
+}
+
+static void postcopy_resend_page_request(gpointer key, gpointer value,
+                                         gpointer opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    ram_addr_t offset;
+    RAMBlock *rb;
+
+    rb = qemu_ram_block_from_host(key, true, &offset);
+    if (rb) {
+        migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb), offset,
+                                  getpagesize());
+    }
+}
+
+/*
+ * After a postcopy recovery, ask again for the pages that were requested
+ * but have not arrived; the requests may have been lost with the old
+ * connection, and the vCPUs waiting for them would not fault again.
+ */
+void postcopy_resend_page_requests(MigrationIncomingState *mis)
+{
+    qemu_mutex_lock(&mis->page_request_mutex);
+    g_hash_table_foreach_remove(mis->page_requested,
+                                postcopy_page_arrived, NULL);
+    trace_postcopy_resend_page_requests(g_hash_table_size(mis->page_requested));
+
+    /* The source may not know the block of our last request */
+    mis->last_rb = NULL;
+    rcu_read_lock();
+    g_hash_table_foreach(mis->page_requested, postcopy_resend_page_request,
+                         mis);
+    rcu_read_unlock();
+    qemu_mutex_unlock(&mis->page_request_mutex);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Bumped at the end of each migration, so that late connections are dropped */
+static unsigned int postcopy_preempt_generation;
+
+static void postcopy_preempt_send_channel_async(Object *src, Error *err,
+                                                gpointer opaque)
+{
+    MigrationState *ms = migrate_get_current();
+    QEMUFile *f;
+
+    if (GPOINTER_TO_UINT(opaque) != postcopy_preempt_generation) {
+        /* The migration this channel was opened for has gone away */
+        object_unref(src);
+        return;
+    }
+    if (err) {
+        /* Not fatal, requested pages just keep using the main channel */
+        error_report("postcopy-preempt: %s", error_get_pretty(err));
+        object_unref(src);
+        return;
+    }
+
+    f = qemu_fopen_channel_output(QIO_CHANNEL(src));
+    object_unref(src);
+    qemu_file_set_blocking(f, true);
+    qemu_put_be32(f, POSTCOPY_PREEMPT_MAGIC);
+    qemu_fflush(f);
+
+    trace_postcopy_preempt_send_connected();
+    atomic_mb_set(&ms->postcopy_qemufile_src, f);
+}
+
+void postcopy_preempt_send_setup(MigrationState *ms)
+{
+    unsigned int generation = postcopy_preempt_generation;
+    Error *local_err = NULL;
+
+    if (ms->parameters.tls_creds) {
+        error_report("postcopy-preempt does not support TLS, "
+                     "requested pages use the main channel");
+        return;
+    }
+
+    if (socket_send_channel_create(postcopy_preempt_send_channel_async,
+                                   GUINT_TO_POINTER(generation),
+                                   &local_err) < 0) {
+        error_report_err(local_err);
+    }
+}
+
+void postcopy_preempt_send_cleanup(MigrationState *ms)
+{
+    QEMUFile *f = ms->postcopy_qemufile_src;
+
+    postcopy_preempt_generation++;
+    if (f) {
+        atomic_mb_set(&ms->postcopy_qemufile_src, NULL);
+        qemu_fclose(f);
+    }
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis,
+                                  QIOChannel *ioc)
+{
+    PostcopyState ps = postcopy_state_get();
+
+    if (mis->postcopy_preempt_file) {
+        error_report("postcopy-preempt: unexpected extra channel");
+        return;
+    }
+
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_preempt_file = qemu_fopen_channel_input(ioc);
+
+    /* Normally it connects early, but don't let a late one go unread */
+    if (ps == POSTCOPY_INCOMING_LISTENING || ps == POSTCOPY_INCOMING_RUNNING) {
+        postcopy_preempt_incoming_start(mis);
+    }
+}
+
+/*
+ * Destination: stop using the preempt channel, when postcopy pauses; the
+ * recovered migration only uses the main channel.
+ */
+void postcopy_preempt_incoming_stop(MigrationIncomingState *mis)
+{
+    if (mis->have_preempt_thread) {
+        qemu_file_shutdown(mis->postcopy_preempt_file);
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+    if (mis->postcopy_preempt_file) {
+        qemu_fclose(mis->postcopy_preempt_file);
+        mis->postcopy_preempt_file = NULL;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
 /**
  * postcopy_discard_send_init: Called at the start of each RAMBlock before
  *   asking to discard individual ranges.
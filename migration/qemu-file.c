@@ -22,19 +22,40 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "qemu/coroutine.h"
+#include "qemu/thread.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "trace.h"
 
-#define IO_BUF_SIZE 32768
+#define IO_BUF_SIZE QEMU_FILE_MIN_BUFFER_SIZE
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
+/*
+ * Second set of buffers of a writable QEMUFile, sent by a separate
+ * thread while the first one is filled.  See qemu_file_set_buffering().
+ */
+typedef struct QEMUFileFlusher {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+
+    uint8_t *buf;
+    struct iovec *iov;
+    unsigned int iovcnt; /* not 0 until the result of the write is seen */
+    int64_t pos;
+    ssize_t expect;
+    ssize_t ret;
+
+    /* Protected by lock */
+    bool busy;
+    bool quit;
+} QEMUFileFlusher;
+
 struct QEMUFile {
     const QEMUFileOps *ops;
     const QEMUFileHooks *hooks;
@@ -47,12 +68,16 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_alloc;
+    uint8_t *buf;
 
-    struct iovec iov[MAX_IOV_SIZE];
+    struct iovec *iov;
     unsigned int iovcnt;
+    unsigned int iov_alloc;
 
     int last_error;
+
+    QEMUFileFlusher *flusher;
 };
 
 /*
@@ -99,9 +124,77 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->buf_alloc = IO_BUF_SIZE;
+    f->buf = g_malloc(f->buf_alloc);
+    f->iov_alloc = MAX_IOV_SIZE;
+    f->iov = g_new(struct iovec, f->iov_alloc);
     return f;
 }
 
+static void *qemu_file_flush_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    QEMUFileFlusher *fl = f->flusher;
+    ssize_t ret;
+
+    qemu_mutex_lock(&fl->lock);
+    for (;;) {
+        while (!fl->busy && !fl->quit) {
+            qemu_cond_wait(&fl->cond, &fl->lock);
+        }
+        if (!fl->busy) {
+            break;
+        }
+        qemu_mutex_unlock(&fl->lock);
+
+        ret = f->ops->writev_buffer(f->opaque, fl->iov, fl->iovcnt, fl->pos);
+
+        qemu_mutex_lock(&fl->lock);
+        fl->ret = ret;
+        fl->busy = false;
+        qemu_cond_broadcast(&fl->cond);
+    }
+    qemu_mutex_unlock(&fl->lock);
+
+    return NULL;
+}
+
+/*
+ * Resize the buffer of @f to @size bytes, and with @async send the data
+ * of writable files from a separate thread, so that filling a second
+ * buffer overlaps with the write.  Readable files read up to @size bytes
+ * ahead.  This must be called before any data goes through @f, and
+ * @async must only be used if the ops of @f can be called from another
+ * thread than the one using @f.
+ */
+void qemu_file_set_buffering(QEMUFile *f, size_t size, bool async)
+{
+    QEMUFileFlusher *fl;
+
+    assert(!f->buf_index && !f->buf_size && !f->iovcnt && !f->flusher);
+    assert(size <= INT_MAX);
+
+    f->buf_alloc = MAX(size, IO_BUF_SIZE);
+    f->iov_alloc = MIN(IOV_MAX, MAX(MAX_IOV_SIZE, f->buf_alloc / 4096));
+    g_free(f->buf);
+    g_free(f->iov);
+    f->buf = g_malloc(f->buf_alloc);
+    f->iov = g_new(struct iovec, f->iov_alloc);
+
+    if (!async || !qemu_file_is_writable(f)) {
+        return;
+    }
+
+    fl = g_new0(QEMUFileFlusher, 1);
+    fl->buf = g_malloc(f->buf_alloc);
+    fl->iov = g_new(struct iovec, f->iov_alloc);
+    qemu_mutex_init(&fl->lock);
+    qemu_cond_init(&fl->cond);
+    f->flusher = fl;
+    qemu_thread_create(&fl->thread, "qemufile_flush", qemu_file_flush_thread,
+                       f, QEMU_THREAD_JOINABLE);
+}
+
 
 void qemu_file_set_hooks(QEMUFile *f, const QEMUFileHooks *hooks)
 {
@@ -132,6 +225,76 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer;
 }
 
+/* Wait for the write of the flush thread, and check its result */
+static void qemu_file_flush_wait(QEMUFile *f)
+{
+    QEMUFileFlusher *fl = f->flusher;
+
+    qemu_mutex_lock(&fl->lock);
+    while (fl->busy) {
+        qemu_cond_wait(&fl->cond, &fl->lock);
+    }
+    qemu_mutex_unlock(&fl->lock);
+
+    if (fl->iovcnt) {
+        /* Same check as qemu_fflush() */
+        if (fl->ret != fl->expect) {
+            qemu_file_set_error(f, fl->ret < 0 ? fl->ret : -EIO);
+        }
+        fl->iovcnt = 0;
+    }
+}
+
+/*
+ * Hand the pending data over to the flush thread, and continue with the
+ * other buffer once the previous write is done.  Like with a synchronous
+ * flush, the position moves forward as if the write had succeeded.
+ */
+static void qemu_file_flush_start(QEMUFile *f)
+{
+    QEMUFileFlusher *fl = f->flusher;
+    struct iovec *iov;
+    uint8_t *buf;
+
+    qemu_file_flush_wait(f);
+    if (!f->iovcnt) {
+        f->buf_index = 0;
+        return;
+    }
+
+    buf = fl->buf;
+    fl->buf = f->buf;
+    f->buf = buf;
+    iov = fl->iov;
+    fl->iov = f->iov;
+    f->iov = iov;
+
+    fl->iovcnt = f->iovcnt;
+    fl->expect = iov_size(fl->iov, fl->iovcnt);
+    fl->pos = f->pos;
+    f->pos += fl->expect;
+    f->buf_index = 0;
+    f->iovcnt = 0;
+
+    qemu_mutex_lock(&fl->lock);
+    fl->busy = true;
+    qemu_cond_signal(&fl->cond);
+    qemu_mutex_unlock(&fl->lock);
+}
+
+/*
+ * Flush a full buffer; with a flush thread this does not wait for the
+ * data to be sent
+ */
+static void qemu_file_flush_full(QEMUFile *f)
+{
+    if (f->flusher) {
+        qemu_file_flush_start(f);
+    } else {
+        qemu_fflush(f);
+    }
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -148,6 +311,12 @@ void qemu_fflush(QEMUFile *f)
         return;
     }
 
+    if (f->flusher) {
+        qemu_file_flush_start(f);
+        qemu_file_flush_wait(f);
+        return;
+    }
+
     if (f->iovcnt > 0) {
         expect = iov_size(f->iov, f->iovcnt);
         ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
@@ -255,7 +424,7 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
     f->buf_size = pending;
 
     len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+                        f->buf_alloc - pending);
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -273,6 +442,15 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account @size bytes sent outside of @f (e.g. on multifd channels)
+ * against the rate limit of @f.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t size)
+{
+    f->bytes_xfer += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -281,10 +459,31 @@ void qemu_update_position(QEMUFile *f, size_t size)
  * The meaning of return value on success depends on the specific backend
  * being used.
  */
+static void qemu_file_flusher_free(QEMUFile *f)
+{
+    QEMUFileFlusher *fl = f->flusher;
+
+    qemu_mutex_lock(&fl->lock);
+    fl->quit = true;
+    qemu_cond_signal(&fl->cond);
+    qemu_mutex_unlock(&fl->lock);
+    qemu_thread_join(&fl->thread);
+
+    qemu_cond_destroy(&fl->cond);
+    qemu_mutex_destroy(&fl->lock);
+    g_free(fl->buf);
+    g_free(fl->iov);
+    g_free(fl);
+    f->flusher = NULL;
+}
+
 int qemu_fclose(QEMUFile *f)
 {
     int ret;
     qemu_fflush(f);
+    if (f->flusher) {
+        qemu_file_flusher_free(f);
+    }
     ret = qemu_file_get_error(f);
 
     if (f->ops->close) {
@@ -299,6 +498,8 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    g_free(f->buf);
+    g_free(f->iov);
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -315,8 +516,8 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size)
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
-        qemu_fflush(f);
+    if (f->iovcnt >= f->iov_alloc) {
+        qemu_file_flush_full(f);
     }
 }
 
@@ -339,7 +540,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
     }
 
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_alloc - f->buf_index;
         if (l > size) {
             l = size;
         }
@@ -347,8 +548,8 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
         f->bytes_xfer += l;
         add_to_iovec(f, f->buf + f->buf_index, l);
         f->buf_index += l;
-        if (f->buf_index == IO_BUF_SIZE) {
-            qemu_fflush(f);
+        if (f->buf_index == f->buf_alloc) {
+            qemu_file_flush_full(f);
         }
         if (qemu_file_get_error(f)) {
             break;
@@ -368,8 +569,8 @@ void qemu_put_byte(QEMUFile *f, int v)
     f->bytes_xfer++;
     add_to_iovec(f, f->buf + f->buf_index, 1);
     f->buf_index++;
-    if (f->buf_index == IO_BUF_SIZE) {
-        qemu_fflush(f);
+    if (f->buf_index == f->buf_alloc) {
+        qemu_file_flush_full(f);
     }
 }
 
@@ -394,8 +595,8 @@ size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset)
     size_t index;
 
     assert(!qemu_file_is_writable(f));
-    assert(offset < IO_BUF_SIZE);
-    assert(size <= IO_BUF_SIZE - offset);
+    assert(offset < f->buf_alloc);
+    assert(size <= f->buf_alloc - offset);
 
     /* The 1st byte to read from */
     index = f->buf_index + offset;
@@ -445,7 +646,7 @@ size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size)
         size_t res;
         uint8_t *src;
 
-        res = qemu_peek_buffer(f, &src, MIN(pending, IO_BUF_SIZE), 0);
+        res = qemu_peek_buffer(f, &src, MIN(pending, f->buf_alloc), 0);
         if (res == 0) {
             return done;
         }
@@ -479,7 +680,7 @@ size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size)
  */
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size)
 {
-    if (size < IO_BUF_SIZE) {
+    if (size < f->buf_alloc) {
         size_t res;
         uint8_t *src;
 
@@ -504,7 +705,7 @@ int qemu_peek_byte(QEMUFile *f, int offset)
     int index = f->buf_index + offset;
 
     assert(!qemu_file_is_writable(f));
-    assert(offset < IO_BUF_SIZE);
+    assert(offset < f->buf_alloc);
 
     if (index >= f->buf_size) {
         qemu_fill_buffer(f);
@@ -615,43 +816,46 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* Compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+/* Compress size bytes of data start at p with func and store the
+ * compressed data, preceded by its length, to the buffer of f.  bound
+ * is the largest size the compressed data can have.
  *
  * When f is not writable, return -1 if f has no space to save the
  * compressed data.
  * When f is wirtable and it has no space to save the compressed data,
  * do fflush first, if f still has no space to save the compressed
- * data, return -1.
+ * data, return -1.  Also return -1 if func fails.
  */
 
 ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
+                                  size_t bound, QEMUFileCompressFunc *func,
+                                  void *opaque)
 {
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+    ssize_t blen = f->buf_alloc - f->buf_index - sizeof(int32_t);
 
-    if (blen < compressBound(size)) {
+    if (blen < (ssize_t)bound) {
         if (!qemu_file_is_writable(f)) {
             return -1;
         }
         qemu_fflush(f);
-        blen = IO_BUF_SIZE - sizeof(int32_t);
-        if (blen < compressBound(size)) {
+        blen = f->buf_alloc - sizeof(int32_t);
+        if (blen < (ssize_t)bound) {
             return -1;
         }
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = func(opaque, f->buf + f->buf_index + sizeof(int32_t), blen,
+                p, size);
+    if (blen < 0) {
         error_report("Compress Failed!");
-        return 0;
+        return -1;
     }
     qemu_put_be32(f, blen);
     if (f->ops->writev_buffer) {
         add_to_iovec(f, f->buf + f->buf_index, blen);
     }
     f->buf_index += blen;
-    if (f->buf_index == IO_BUF_SIZE) {
-        qemu_fflush(f);
+    if (f->buf_index == f->buf_alloc) {
+        qemu_file_flush_full(f);
     }
     return blen + sizeof(int32_t);
 }
@@ -88,6 +88,13 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/* Add the finished document @value as a property (or array element) */
+void json_prop_qjson(QJSON *json, const char *name, QJSON *value)
+{
+    json_emit_element(json, name);
+    qstring_append(json->str, qjson_get_str(value));
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
@@ -29,15 +29,20 @@
 #include "qemu-common.h"
 #include "cpu.h"
 #include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
+#include "io/channel-socket.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
 #include "exec/address-spaces.h"
+#include "sysemu/sysemu.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
@@ -68,6 +73,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -153,6 +159,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
+    uint64_t xbzrle_cache_hit;
+    double xbzrle_cache_hit_rate;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
 
@@ -213,6 +221,16 @@ double xbzrle_mig_cache_miss_rate(void)
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+double xbzrle_mig_cache_hit_rate(void)
+{
+    return acct_info.xbzrle_cache_hit_rate;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -226,8 +244,16 @@ static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
+static NotifierList precopy_notifier_list =
+    NOTIFIER_LIST_INITIALIZER(precopy_notifier_list);
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/*
+ * Pages the destination has got, indexed by ram_addr >> TARGET_PAGE_BITS;
+ * after a lost postcopy connection the source resends everything else.
+ * Only allocated when postcopy has been advised.
+ */
+static unsigned long *postcopy_recv_bitmap;
 
 /* used by the search for pages to send */
 struct PageSearchStatus {
@@ -252,6 +278,29 @@ static struct BitmapRcu {
     unsigned long *unsentmap;
 } *migration_bitmap_rcu;
 
+/*
+ * Number of pages handed to a (de)compression thread at once.  The
+ * output of a whole batch must fit into the buffer of the QEMUFile of a
+ * compression thread.
+ */
+#define COMPRESS_BATCH_PAGES MAX(1, 16384 / TARGET_PAGE_SIZE)
+
+/*
+ * Compression stream of one thread.  It is set up once per migration
+ * and only reset between pages, which are still compressed
+ * independently of each other.
+ */
+typedef struct PageCodec {
+    MigrationCompressMethod method;
+    int level;
+    bool compress;
+    z_stream zstream;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+} PageCodec;
+
 struct CompressParam {
     bool done;
     bool quit;
@@ -259,18 +308,25 @@ struct CompressParam {
     QemuMutex mutex;
     QemuCond cond;
     RAMBlock *block;
-    ram_addr_t offset;
+    int npages;
+    ram_addr_t offset[COMPRESS_BATCH_PAGES];
+    PageCodec codec;
 };
 typedef struct CompressParam CompressParam;
 
 struct DecompressParam {
     bool done;
     bool quit;
+    bool start;
     QemuMutex mutex;
     QemuCond cond;
-    void *des;
+    PageCodec codec;
     uint8_t *compbuf;
-    int len;
+    /* filled by the main thread while the thread is idle */
+    int npages;
+    size_t used;
+    void *des[COMPRESS_BATCH_PAGES];
+    int len[COMPRESS_BATCH_PAGES];
 };
 typedef struct DecompressParam DecompressParam;
 
@@ -284,31 +340,189 @@ static QemuMutex comp_done_lock;
 static QemuCond comp_done_cond;
 /* The empty QEMUFileOps will be used by file in CompressParam */
 static const QEMUFileOps empty_ops = { };
+/* Pages gathered by the migration thread for the next compression thread */
+static struct {
+    RAMBlock *block;
+    int npages;
+    ram_addr_t offset[COMPRESS_BATCH_PAGES];
+} comp_batch;
+/* Used by the migration thread for the first page of each block */
+static PageCodec comp_main_codec;
 
 static bool compression_switch;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
+/* decomp_param being filled by the main thread, or -1 */
+static int decomp_batch_idx;
+
+static voidpf page_codec_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return g_malloc((gsize)items * size);
+}
+
+static void page_codec_zfree(voidpf opaque, voidpf address)
+{
+    g_free(address);
+}
+
+/* Largest size of a compressed page */
+static size_t page_codec_bound(MigrationCompressMethod method)
+{
+#ifdef CONFIG_ZSTD
+    if (method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        return ZSTD_compressBound(TARGET_PAGE_SIZE);
+    }
+#endif
+    return compressBound(TARGET_PAGE_SIZE);
+}
+
+/*
+ * page_codec_init: set up a stream to compress or decompress pages
+ *
+ * Like g_malloc(), allocation failures are fatal.
+ *
+ * @codec: the stream
+ * @compress: true to compress, false to decompress
+ */
+static void page_codec_init(PageCodec *codec, bool compress)
+{
+    int ret;
+
+    memset(codec, 0, sizeof(*codec));
+    codec->method = migrate_compress_method();
+    codec->level = migrate_compress_level();
+    codec->compress = compress;
+
+#ifdef CONFIG_ZSTD
+    if (codec->method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        if (compress) {
+            codec->zstd_cctx = ZSTD_createCCtx();
+        } else {
+            codec->zstd_dctx = ZSTD_createDCtx();
+        }
+        if (!codec->zstd_cctx && !codec->zstd_dctx) {
+            error_report("Failed to allocate a zstd context");
+            abort();
+        }
+        return;
+    }
+#endif
+
+    codec->zstream.zalloc = page_codec_zalloc;
+    codec->zstream.zfree = page_codec_zfree;
+    if (compress) {
+        ret = deflateInit(&codec->zstream, codec->level);
+    } else {
+        ret = inflateInit(&codec->zstream);
+    }
+    /* With the allocators above, only an invalid level can fail */
+    assert(ret == Z_OK);
+}
+
+static void page_codec_cleanup(PageCodec *codec)
+{
+#ifdef CONFIG_ZSTD
+    if (codec->method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        ZSTD_freeCCtx(codec->zstd_cctx);
+        ZSTD_freeDCtx(codec->zstd_dctx);
+        return;
+    }
+#endif
+
+    if (codec->compress) {
+        deflateEnd(&codec->zstream);
+    } else {
+        inflateEnd(&codec->zstream);
+    }
+}
+
+/* A QEMUFileCompressFunc; @opaque is the PageCodec */
+static ssize_t page_codec_compress(void *opaque, uint8_t *dest,
+                                   size_t dest_len, const uint8_t *src,
+                                   size_t src_len)
+{
+    PageCodec *codec = opaque;
+    z_stream *zs = &codec->zstream;
+
+#ifdef CONFIG_ZSTD
+    if (codec->method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        size_t ret = ZSTD_compressCCtx(codec->zstd_cctx, dest, dest_len,
+                                       src, src_len, codec->level);
+
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+    if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    /* next_in is not const in old zlib versions */
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = src_len;
+    zs->next_out = dest;
+    zs->avail_out = dest_len;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dest_len - zs->avail_out;
+}
+
+/*
+ * page_codec_decompress: decompress exactly @dest_len bytes
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int page_codec_decompress(PageCodec *codec, uint8_t *dest,
+                                 size_t dest_len, const uint8_t *src,
+                                 size_t src_len)
+{
+    z_stream *zs = &codec->zstream;
+
+#ifdef CONFIG_ZSTD
+    if (codec->method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        size_t ret = ZSTD_decompressDCtx(codec->zstd_dctx, dest, dest_len,
+                                         src, src_len);
+
+        return ZSTD_isError(ret) || ret != dest_len ? -1 : 0;
+    }
+#endif
+
+    if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = src_len;
+    zs->next_out = dest;
+    zs->avail_out = dest_len;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out) {
+        return -1;
+    }
+    return 0;
+}
+
+static int do_compress_ram_page(QEMUFile *f, PageCodec *codec,
+                                RAMBlock *block, ram_addr_t offset);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
     RAMBlock *block;
-    ram_addr_t offset;
+    int i;
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
         if (param->block) {
             block = param->block;
-            offset = param->offset;
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            /* The batch is not touched again until done is set */
+            for (i = 0; i < param->npages; i++) {
+                do_compress_ram_page(param->file, &param->codec, block,
+                                     param->offset[i]);
+            }
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
@@ -350,9 +564,11 @@ void migrate_compress_threads_join(void)
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        page_codec_cleanup(&comp_param[i].codec);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
+    page_codec_cleanup(&comp_main_codec);
     qemu_mutex_destroy(&comp_done_lock);
     qemu_cond_destroy(&comp_done_cond);
     g_free(compress_threads);
@@ -374,6 +590,9 @@ void migrate_compress_threads_create(void)
     comp_param = g_new0(CompressParam, thread_count);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
+    comp_batch.block = NULL;
+    comp_batch.npages = 0;
+    page_codec_init(&comp_main_codec, true);
     for (i = 0; i < thread_count; i++) {
         /* comp_param[i].file is just used as a dummy buffer to save data,
          * set its ops to empty.
@@ -381,6 +600,7 @@ void migrate_compress_threads_create(void)
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
         comp_param[i].done = true;
         comp_param[i].quit = false;
+        page_codec_init(&comp_param[i].codec, true);
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
         qemu_thread_create(compress_threads + i, "compress",
@@ -438,6 +658,92 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Throttle just the vcpus that dirty memory, and each one only as much as
+ * needed for the pages dirtied in a sync period to be sent within the
+ * maximum downtime.  The budget is shared out max-min fairly: vcpus whose
+ * unthrottled dirty rate is below the fair share run freely, the others get
+ * the same share each.  Dirty rates are assumed proportional to run time.
+ *
+ * @dirty_pages: pages dirtied during the period, by vcpus and devices
+ * @bytes_xfer: bytes sent during the period
+ * @period_ms: length of the period
+ *
+ * Returns false, leaving throttling alone, if the accelerator does not
+ * attribute dirty pages to vcpus.
+ */
+static bool mig_throttle_dirty_limit(uint64_t dirty_pages, uint64_t bytes_xfer,
+                                     int64_t period_ms)
+{
+    CPUState *cpu;
+    double *rate, *sorted;
+    double budget, quota = -1;
+    uint64_t vcpu_pages = 0;
+    int ncpus = 0, i;
+
+    CPU_FOREACH(cpu) {
+        ncpus++;
+    }
+    rate = g_new(double, ncpus);
+    sorted = g_new(double, ncpus);
+
+    /* Unthrottled dirty pages per period of each vcpu */
+    i = 0;
+    CPU_FOREACH(cpu) {
+        unsigned int pages = atomic_xchg(&cpu->dirty_pages, 0);
+        double pct = cpu_throttle_get_vcpu_percentage(cpu) / 100.0;
+
+        cpu->dirty_pages_rate = (uint64_t)pages * 1000 / period_ms;
+        vcpu_pages += pages;
+        rate[i] = sorted[i] = pages / (1 - pct);
+        i++;
+    }
+
+    if (!vcpu_pages && dirty_pages) {
+        g_free(rate);
+        g_free(sorted);
+        return false;
+    }
+
+    /* Whatever devices dirty cannot be throttled, take it off the top */
+    budget = (double)bytes_xfer * migrate_max_downtime() / 1000000 /
+             period_ms / TARGET_PAGE_SIZE;
+    budget -= dirty_pages > vcpu_pages ? dirty_pages - vcpu_pages : 0;
+    budget = MAX(budget, 0);
+
+    qsort(sorted, ncpus, sizeof(*sorted), compare_double);
+    for (i = 0; i < ncpus; i++) {
+        if (sorted[i] * (ncpus - i) > budget) {
+            quota = budget / (ncpus - i);
+            break;
+        }
+        budget -= sorted[i];
+    }
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        int pct = 0;
+
+        if (quota >= 0 && rate[i] > quota) {
+            pct = 100 - (int)(100 * quota / rate[i]);
+        }
+        trace_migration_throttle_vcpu(cpu->cpu_index, cpu->dirty_pages_rate,
+                                      pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+        i++;
+    }
+
+    g_free(rate);
+    g_free(sorted);
+    return true;
+}
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -496,6 +802,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         return -1;
     }
 
+    acct_info.xbzrle_cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -569,20 +876,141 @@ ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
+/*
+ * The dirty log is fetched from the accelerator without clearing it, so
+ * that the pages stay writable until they are about to be sent.  Clear
+ * it for the whole chunk of @page the first time one of its pages is
+ * looked at after a sync; a write after this point is logged again and
+ * the page resent, a write before it is in the page that is sent.
+ */
+static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
+                                                       unsigned long page)
+{
+    unsigned long chunk = page >> CLEAR_BITMAP_SHIFT;
+
+    if (!rb->clear_bmap) {
+        /* block added during migration */
+        memory_region_clear_dirty_bitmap(rb->mr,
+                                         (hwaddr)page << TARGET_PAGE_BITS,
+                                         TARGET_PAGE_SIZE);
+        return;
+    }
+    if (!test_and_clear_bit(chunk, rb->clear_bmap)) {
+        return;
+    }
+    memory_region_clear_dirty_bitmap(rb->mr,
+        (hwaddr)chunk << (CLEAR_BITMAP_SHIFT + TARGET_PAGE_BITS),
+        1ULL << (CLEAR_BITMAP_SHIFT + TARGET_PAGE_BITS));
+}
+
+static void
+migration_clear_memory_region_dirty_bitmap_range(RAMBlock *rb,
+                                                 unsigned long start,
+                                                 unsigned long npages)
+{
+    unsigned long chunk;
+
+    if (!rb->clear_bmap) {
+        memory_region_clear_dirty_bitmap(rb->mr,
+                                         (hwaddr)start << TARGET_PAGE_BITS,
+                                         (hwaddr)npages << TARGET_PAGE_BITS);
+        return;
+    }
+    for (chunk = start >> CLEAR_BITMAP_SHIFT;
+         chunk <= (start + npages - 1) >> CLEAR_BITMAP_SHIFT; chunk++) {
+        migration_clear_memory_region_dirty_bitmap(rb,
+                                                   chunk << CLEAR_BITMAP_SHIFT);
+    }
+}
+
+/*
+ * The lock is only contended by free page hints coming from the guest,
+ * which clear bits of the same words from the main loop.
+ */
+static inline bool migration_bitmap_clear_dirty(RAMBlock *rb,
+                                                ram_addr_t addr)
 {
     bool ret;
     int nr = addr >> TARGET_PAGE_BITS;
     unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
 
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    migration_clear_memory_region_dirty_bitmap(rb,
+        (addr - rb->offset) >> TARGET_PAGE_BITS);
     ret = test_and_clear_bit(nr, bitmap);
 
     if (ret) {
         migration_dirty_pages--;
     }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
     return ret;
 }
 
+void precopy_add_notifier(Notifier *n)
+{
+    notifier_list_add(&precopy_notifier_list, n);
+}
+
+void precopy_remove_notifier(Notifier *n)
+{
+    notifier_remove(n);
+}
+
+static void precopy_notify(PrecopyNotifyReason reason)
+{
+    notifier_list_notify(&precopy_notifier_list, &reason);
+}
+
+/*
+ * Drop the guest pages at @addr, @len bytes, from the set of pages that
+ * are still to be sent: the guest has told us they are free, so their
+ * contents do not matter.  The dirty log is cleared for them too, so
+ * that only pages the guest writes again are picked up by the next
+ * sync.  Partial pages at either end are kept.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    struct BitmapRcu *bitmap;
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t used_len;
+    unsigned long start, end, page;
+
+    rcu_read_lock();
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    if (!bitmap) {
+        rcu_read_unlock();
+        return;
+    }
+
+    for (; len > 0; len -= used_len, addr = (uint8_t *)addr + used_len) {
+        block = qemu_ram_block_from_host(addr, false, &offset);
+        if (!block || offset >= block->used_length) {
+            break;
+        }
+        used_len = MIN(len, block->used_length - offset);
+
+        start = TARGET_PAGE_ALIGN(offset) >> TARGET_PAGE_BITS;
+        end = (offset + used_len) >> TARGET_PAGE_BITS;
+        if (end <= start) {
+            continue;
+        }
+
+        qemu_mutex_lock(&migration_bitmap_mutex);
+        migration_clear_memory_region_dirty_bitmap_range(block, start,
+                                                         end - start);
+        start += block->offset >> TARGET_PAGE_BITS;
+        end += block->offset >> TARGET_PAGE_BITS;
+        for (page = find_next_bit(bitmap->bmap, end, start); page < end;
+             page = find_next_bit(bitmap->bmap, end, page + 1)) {
+            clear_bit(page, bitmap->bmap);
+            migration_dirty_pages--;
+        }
+        qemu_mutex_unlock(&migration_bitmap_mutex);
+    }
+    rcu_read_unlock();
+}
+
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
     unsigned long *bitmap;
@@ -591,20 +1019,227 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
         cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
 }
 
+/*
+ * On large guests merging the dirty log into the migration bitmap takes
+ * long enough to be seen as a stall, so RAM blocks are cut into chunks
+ * that a few worker threads merge in parallel with the migration thread.
+ *
+ * Only blocks that start on a bitmap word boundary are split: their
+ * chunks go through the word-at-a-time path of
+ * cpu_physical_memory_sync_dirty_bitmap and never share a word of the
+ * migration bitmap.  The remaining blocks use the per-page path and are
+ * done afterwards by the migration thread alone.
+ */
+#define BITMAP_SYNC_CHUNK_SIZE  (1ULL << 30)
+#define BITMAP_SYNC_MAX_THREADS 8
+
+typedef struct BitmapSyncRange {
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncRange;
+
+static struct {
+    QemuThread *threads;
+    int nthreads;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    bool quit;
+    unsigned long *bitmap;
+    BitmapSyncRange *ranges;
+    int nranges;
+    int next;
+    int done;
+    uint64_t num_dirty;
+} bitmap_sync;
+
+/* Called with bitmap_sync.lock held, returns when no chunk is left */
+static void bitmap_sync_do_ranges(void)
+{
+    while (bitmap_sync.next < bitmap_sync.nranges) {
+        BitmapSyncRange *range = &bitmap_sync.ranges[bitmap_sync.next++];
+        uint64_t num_dirty;
+
+        qemu_mutex_unlock(&bitmap_sync.lock);
+        num_dirty = cpu_physical_memory_sync_dirty_bitmap(bitmap_sync.bitmap,
+                                                          range->start,
+                                                          range->length);
+        qemu_mutex_lock(&bitmap_sync.lock);
+
+        bitmap_sync.num_dirty += num_dirty;
+        if (++bitmap_sync.done == bitmap_sync.nranges) {
+            qemu_cond_signal(&bitmap_sync.done_cond);
+        }
+    }
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    qemu_mutex_lock(&bitmap_sync.lock);
+    while (!bitmap_sync.quit) {
+        if (bitmap_sync.next < bitmap_sync.nranges) {
+            bitmap_sync_do_ranges();
+        } else {
+            qemu_cond_wait(&bitmap_sync.work_cond, &bitmap_sync.lock);
+        }
+    }
+    qemu_mutex_unlock(&bitmap_sync.lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int bitmap_sync_host_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    return MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+#else
+    return 1;
+#endif
+}
+
+static void bitmap_sync_threads_create(void)
+{
+    int nchunks = DIV_ROUND_UP(ram_bytes_total(), BITMAP_SYNC_CHUNK_SIZE);
+    int i;
+
+    /* Leave half of the host to the guest */
+    bitmap_sync.nthreads = MIN(MIN(BITMAP_SYNC_MAX_THREADS, nchunks - 1),
+                               bitmap_sync_host_cpus() / 2);
+    if (bitmap_sync.nthreads <= 0) {
+        bitmap_sync.nthreads = 0;
+        return;
+    }
+
+    qemu_mutex_init(&bitmap_sync.lock);
+    qemu_cond_init(&bitmap_sync.work_cond);
+    qemu_cond_init(&bitmap_sync.done_cond);
+    bitmap_sync.quit = false;
+    bitmap_sync.nranges = bitmap_sync.next = bitmap_sync.done = 0;
+    bitmap_sync.threads = g_new0(QemuThread, bitmap_sync.nthreads);
+    for (i = 0; i < bitmap_sync.nthreads; i++) {
+        qemu_thread_create(&bitmap_sync.threads[i], "bitmapsync",
+                           bitmap_sync_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void bitmap_sync_threads_join(void)
+{
+    int i;
+
+    if (!bitmap_sync.nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync.lock);
+    bitmap_sync.quit = true;
+    qemu_cond_broadcast(&bitmap_sync.work_cond);
+    qemu_mutex_unlock(&bitmap_sync.lock);
+    for (i = 0; i < bitmap_sync.nthreads; i++) {
+        qemu_thread_join(&bitmap_sync.threads[i]);
+    }
+
+    g_free(bitmap_sync.threads);
+    g_free(bitmap_sync.ranges);
+    bitmap_sync.threads = NULL;
+    bitmap_sync.ranges = NULL;
+    bitmap_sync.nthreads = 0;
+    qemu_cond_destroy(&bitmap_sync.done_cond);
+    qemu_cond_destroy(&bitmap_sync.work_cond);
+    qemu_mutex_destroy(&bitmap_sync.lock);
+}
+
+/* RAM blocks whose contents the destination gets from the backing file */
+static bool ram_block_is_ignored(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared_file(block);
+}
+
+static bool bitmap_sync_aligned(RAMBlock *block)
+{
+    return !((block->offset >> TARGET_PAGE_BITS) % BITS_PER_LONG);
+}
+
+/* Called with migration_bitmap_mutex and the RCU read lock held */
+static void migration_bitmap_sync_blocks(void)
+{
+    RAMBlock *block;
+    int nranges = 0;
+
+    if (!bitmap_sync.nthreads) {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (!ram_block_is_ignored(block)) {
+                migration_bitmap_sync_range(block->offset, block->used_length);
+            }
+        }
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync.lock);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t offset;
+
+        if (!bitmap_sync_aligned(block) || ram_block_is_ignored(block)) {
+            continue;
+        }
+        for (offset = 0; offset < block->used_length;
+             offset += BITMAP_SYNC_CHUNK_SIZE) {
+            BitmapSyncRange *range;
+
+            bitmap_sync.ranges = g_renew(BitmapSyncRange, bitmap_sync.ranges,
+                                         nranges + 1);
+            range = &bitmap_sync.ranges[nranges++];
+            range->start = block->offset + offset;
+            range->length = MIN(BITMAP_SYNC_CHUNK_SIZE,
+                                block->used_length - offset);
+        }
+    }
+    bitmap_sync.bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    bitmap_sync.nranges = nranges;
+    bitmap_sync.next = 0;
+    bitmap_sync.done = 0;
+    bitmap_sync.num_dirty = 0;
+    qemu_cond_broadcast(&bitmap_sync.work_cond);
+
+    bitmap_sync_do_ranges();
+    while (bitmap_sync.done < bitmap_sync.nranges) {
+        qemu_cond_wait(&bitmap_sync.done_cond, &bitmap_sync.lock);
+    }
+    migration_dirty_pages += bitmap_sync.num_dirty;
+    bitmap_sync.nranges = 0;
+    qemu_mutex_unlock(&bitmap_sync.lock);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!bitmap_sync_aligned(block) && !ram_block_is_ignored(block)) {
+            migration_bitmap_sync_range(block->offset, block->used_length);
+        }
+    }
+}
+
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
 static int64_t bytes_xfer_prev;
 static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
+static uint64_t xbzrle_cache_hit_prev;
 static uint64_t iterations_prev;
 
 static void migration_bitmap_sync_init(void)
 {
+    CPUState *cpu;
+
     start_time = 0;
     bytes_xfer_prev = 0;
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
+    xbzrle_cache_hit_prev = 0;
     iterations_prev = 0;
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_pages, 0);
+        cpu->dirty_pages_rate = 0;
+    }
 }
 
 static void migration_bitmap_sync(void)
@@ -614,6 +1249,7 @@ static void migration_bitmap_sync(void)
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    bool throttled;
 
     bitmap_sync_count++;
 
@@ -625,19 +1261,26 @@ static void migration_bitmap_sync(void)
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
+    precopy_notify(PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC);
+
     trace_migration_bitmap_sync_start();
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+        if (block->clear_bmap) {
+            bitmap_set(block->clear_bmap, 0,
+                       clear_bmap_size(block->used_length >> TARGET_PAGE_BITS));
+        }
     }
+    migration_bitmap_sync_blocks();
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -651,7 +1294,15 @@ static void migration_bitmap_sync(void)
                throttling */
             bytes_xfer_now = ram_bytes_transferred();
 
-            if (s->dirty_pages_rate &&
+            /* With dirty-limit the throttle is recomputed every period;
+             * the heuristic below is the fallback when the accelerator
+             * cannot tell which vcpu dirtied a page.
+             */
+            throttled = migrate_dirty_limit() &&
+                mig_throttle_dirty_limit(num_dirty_pages_period,
+                                         bytes_xfer_now - bytes_xfer_prev,
+                                         end_time - start_time);
+            if (!throttled && s->dirty_pages_rate &&
                (num_dirty_pages_period * TARGET_PAGE_SIZE >
                    (bytes_xfer_now - bytes_xfer_prev)/2) &&
                (dirty_rate_high_cnt++ >= 2)) {
@@ -663,14 +1314,22 @@ static void migration_bitmap_sync(void)
         }
 
         if (migrate_use_xbzrle()) {
+            uint64_t hits = acct_info.xbzrle_cache_hit - xbzrle_cache_hit_prev;
+            uint64_t misses = acct_info.xbzrle_cache_miss -
+                              xbzrle_cache_miss_prev;
+
             if (iterations_prev != acct_info.iterations) {
-                acct_info.xbzrle_cache_miss_rate =
-                   (double)(acct_info.xbzrle_cache_miss -
-                            xbzrle_cache_miss_prev) /
+                acct_info.xbzrle_cache_miss_rate = (double)misses /
                    (acct_info.iterations - iterations_prev);
             }
+            /* fraction of cache lookups in this period that found the page */
+            if (hits + misses) {
+                acct_info.xbzrle_cache_hit_rate =
+                   (double)hits / (hits + misses);
+            }
             iterations_prev = acct_info.iterations;
             xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
+            xbzrle_cache_hit_prev = acct_info.xbzrle_cache_hit;
         }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
@@ -802,8 +1461,8 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+static int do_compress_ram_page(QEMUFile *f, PageCodec *codec,
+                                RAMBlock *block, ram_addr_t offset)
 {
     int bytes_sent, blen;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
@@ -811,7 +1470,8 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
     bytes_sent = save_page_header(f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
     blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+                                     page_codec_bound(codec->method),
+                                     page_codec_compress, codec);
     if (blen < 0) {
         bytes_sent = 0;
         qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
@@ -825,7 +1485,45 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
 
 static uint64_t bytes_transferred;
 
-static void flush_compressed_data(QEMUFile *f)
+/* Hand the pages in comp_batch to the next idle compression thread */
+static void compress_submit_batch(QEMUFile *f)
+{
+    CompressParam *param;
+    int idx, thread_count;
+
+    thread_count = migrate_compress_threads();
+    qemu_mutex_lock(&comp_done_lock);
+    while (true) {
+        for (idx = 0; idx < thread_count; idx++) {
+            if (comp_param[idx].done) {
+                break;
+            }
+        }
+        if (idx < thread_count) {
+            break;
+        }
+        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+    }
+    param = &comp_param[idx];
+    param->done = false;
+    qemu_mutex_unlock(&comp_done_lock);
+
+    /* The thread is idle, so its output can be taken without locks */
+    bytes_transferred += qemu_put_qemu_file(f, param->file);
+
+    qemu_mutex_lock(&param->mutex);
+    param->npages = comp_batch.npages;
+    memcpy(param->offset, comp_batch.offset,
+           comp_batch.npages * sizeof(comp_batch.offset[0]));
+    param->block = comp_batch.block;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    comp_batch.block = NULL;
+    comp_batch.npages = 0;
+}
+
+static void flush_compressed_data(QEMUFile *f)
 {
     int idx, len, thread_count;
 
@@ -834,6 +1532,10 @@ static void flush_compressed_data(QEMUFile *f)
     }
     thread_count = migrate_compress_threads();
 
+    if (comp_batch.npages) {
+        compress_submit_batch(f);
+    }
+
     qemu_mutex_lock(&comp_done_lock);
     for (idx = 0; idx < thread_count; idx++) {
         while (!comp_param[idx].done) {
@@ -852,45 +1554,35 @@ static void flush_compressed_data(QEMUFile *f)
     }
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
-}
-
+/*
+ * compress_page_with_multi_thread: queue a page for the compression threads
+ *
+ * The pages are handed to the threads COMPRESS_BATCH_PAGES at a time;
+ * the bytes they produce are accounted when their output is written to
+ * @f, which happens at the latest in flush_compressed_data().
+ *
+ * Returns: Number of pages queued (1)
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page, with the page flags
+ */
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
-                                           ram_addr_t offset,
-                                           uint64_t *bytes_transferred)
+                                           ram_addr_t offset)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    /* A batch only holds pages of one block */
+    if (comp_batch.npages && comp_batch.block != block) {
+        compress_submit_batch(f);
+    }
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                comp_param[idx].done = false;
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                qemu_mutex_lock(&comp_param[idx].mutex);
-                set_compress_params(&comp_param[idx], block, offset);
-                qemu_cond_signal(&comp_param[idx].cond);
-                qemu_mutex_unlock(&comp_param[idx].mutex);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
+    comp_batch.block = block;
+    comp_batch.offset[comp_batch.npages++] = offset;
+    acct_info.norm_pages++;
+    if (comp_batch.npages == COMPRESS_BATCH_PAGES) {
+        compress_submit_batch(f);
     }
-    qemu_mutex_unlock(&comp_done_lock);
 
-    return pages;
+    return 1;
 }
 
 /**
@@ -946,7 +1638,8 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
                 bytes_xmit = save_page_header(f, block, offset |
                                               RAM_SAVE_FLAG_COMPRESS_PAGE);
                 blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
+                                    page_codec_bound(comp_main_codec.method),
+                                    page_codec_compress, &comp_main_codec);
                 if (blen > 0) {
                     *bytes_transferred += bytes_xmit + blen;
                     acct_info.norm_pages++;
@@ -960,8 +1653,7 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             offset |= RAM_SAVE_FLAG_CONTINUE;
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
+                pages = compress_page_with_multi_thread(f, block, offset);
             }
         }
     }
@@ -1224,6 +1916,582 @@ err:
  *
  * Returns: Number of pages written.
  */
+/* Multiple fd's (multifd): RAM pages sent on parallel channels */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* Maximum number of pages in a multifd packet */
+#define MULTIFD_PACKET_PAGES 128
+
+/* All the packets sent before this one on the channel have been sent */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Sent once on each channel after it connects; fields are big endian */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t id;
+    uint8_t unused[7];
+} QEMU_PACKED MultiFDInit_t;
+
+/*
+ * Header of a multifd packet, followed by @pages big endian offsets
+ * into @ramblock and then by the contents of these pages.  The integer
+ * fields are big endian.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t pages;
+    uint64_t packet_num;
+    char ramblock[256];
+} QEMU_PACKED MultiFDPacket_t;
+
+typedef struct {
+    /* number of pages queued */
+    uint32_t used;
+    /* the block all the pages belong to */
+    RAMBlock *block;
+    ram_addr_t offset[MULTIFD_PACKET_PAGES];
+} MultiFDPages_t;
+
+typedef struct {
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted when there is a packet to send, or when the thread must quit */
+    QemuSemaphore sem;
+    /* protects the fields below */
+    QemuMutex mutex;
+    bool running;
+    bool quit;
+    bool pending_job;
+    uint32_t flags;
+    uint64_t packet_num;
+    /* pages of the pending packet */
+    MultiFDPages_t *pages;
+    /* only used by the thread */
+    MultiFDPacket_t packet;
+    uint64_t offset[MULTIFD_PACKET_PAGES];
+    struct iovec iov[MULTIFD_PACKET_PAGES + 2];
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* pages being gathered by the migration thread */
+    MultiFDPages_t *pages;
+    /* posted once for each channel that is ready to take a packet */
+    QemuSemaphore channels_ready;
+    bool quit;
+    int next_channel;
+    uint64_t packet_num;
+    /* bitmap_sync_count at the last synchronization of the channels */
+    uint64_t sync_count;
+    /* tells connections of a previous migration from the current ones */
+    uint64_t generation;
+} *multifd_send_state;
+
+static uint64_t multifd_send_generation;
+
+typedef struct {
+    uint64_t generation;
+    int id;
+} MultiFDConnectData;
+
+static void multifd_send_terminate_threads(Error *err)
+{
+    int i;
+
+    if (err) {
+        error_report_err(err);
+    }
+
+    atomic_set(&multifd_send_state->quit, true);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+        /* the migration thread may be waiting for any channel */
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+}
+
+/* Unblock the channels when the migration is cancelled */
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+    }
+    multifd_send_terminate_threads(NULL);
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    if (!migration_has_finished(migrate_get_current())) {
+        /* Don't wait for writes on a connection that may be dead */
+        multifd_save_shutdown();
+    }
+    multifd_send_terminate_threads(NULL);
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->c) {
+            qemu_thread_join(&p->thread);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->name);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Fill in the packet and the iovec for the pending job of @p */
+static int multifd_send_fill_packet(MultiFDSendParams *p)
+{
+    MultiFDPacket_t *packet = &p->packet;
+    MultiFDPages_t *pages = p->pages;
+    int i, niov;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(p->flags);
+    packet->pages = cpu_to_be32(pages->used);
+    packet->packet_num = cpu_to_be64(p->packet_num);
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (pages->block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
+
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = sizeof(*packet);
+    p->iov[1].iov_base = p->offset;
+    p->iov[1].iov_len = pages->used * sizeof(p->offset[0]);
+
+    /* Pages of a contiguous dirty run share a single iovec entry */
+    niov = 2;
+    for (i = 0; i < pages->used; i++) {
+        uint8_t *host = pages->block->host + pages->offset[i];
+        struct iovec *last = &p->iov[niov - 1];
+
+        p->offset[i] = cpu_to_be64(pages->offset[i]);
+        if (niov > 2 && (uint8_t *)last->iov_base + last->iov_len == host) {
+            last->iov_len += TARGET_PAGE_SIZE;
+        } else {
+            p->iov[niov].iov_base = host;
+            p->iov[niov].iov_len = TARGET_PAGE_SIZE;
+            niov++;
+        }
+    }
+
+    return niov;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDInit_t msg = { 0 };
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    Error *local_err = NULL;
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+    if (qio_channel_writev_all(p->c, &iov, 1, &local_err) < 0) {
+        goto out;
+    }
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        if (p->pending_job) {
+            int niov = multifd_send_fill_packet(p);
+            bool sync = p->flags & MULTIFD_FLAG_SYNC;
+
+            qemu_mutex_unlock(&p->mutex);
+
+            /* The pages of the previous dirty bitmap pass must have left
+             * before the sync packet does.
+             */
+            if (sync && qio_channel_socket_flush(QIO_CHANNEL_SOCKET(p->c),
+                                                 &local_err) < 0) {
+                break;
+            }
+            /* The header and offsets are reused for the next packet, so
+             * only the guest pages may be sent without copying them.
+             */
+            if (qio_channel_writev_all(p->c, p->iov, 2, &local_err) < 0) {
+                break;
+            }
+            if (niov > 2 &&
+                qio_channel_socket_writev_zero_copy(QIO_CHANNEL_SOCKET(p->c),
+                                                    p->iov + 2, niov - 2,
+                                                    &local_err) < 0) {
+                break;
+            }
+            trace_multifd_send(p->id, p->packet_num, p->pages->used,
+                               p->flags);
+
+            qemu_mutex_lock(&p->mutex);
+            p->pending_job = false;
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            qemu_mutex_unlock(&p->mutex);
+
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+out:
+    if (local_err) {
+        multifd_send_terminate_threads(local_err);
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    p->running = false;
+    qemu_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+static void multifd_new_send_channel_async(Object *src, Error *err,
+                                           gpointer opaque)
+{
+    MultiFDConnectData *data = opaque;
+    MultiFDSendParams *p;
+
+    if (!multifd_send_state ||
+        multifd_send_state->generation != data->generation ||
+        atomic_read(&multifd_send_state->quit)) {
+        /* The migration this channel was opened for has gone away */
+        object_unref(src);
+        goto out;
+    }
+
+    p = &multifd_send_state->params[data->id];
+    if (err) {
+        object_unref(src);
+        multifd_send_terminate_threads(error_copy(err));
+        goto out;
+    }
+
+    if (migrate_use_zero_copy_send()) {
+        Error *local_err = NULL;
+
+        if (qio_channel_socket_set_zero_copy(QIO_CHANNEL_SOCKET(src), true,
+                                             &local_err) < 0) {
+            object_unref(src);
+            multifd_send_terminate_threads(local_err);
+            goto out;
+        }
+    }
+
+    p->c = QIO_CHANNEL(src);
+    qemu_mutex_lock(&p->mutex);
+    p->running = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                       QEMU_THREAD_JOINABLE);
+
+out:
+    g_free(data);
+}
+
+int multifd_save_setup(void)
+{
+    int thread_count, i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (migrate_get_current()->parameters.tls_creds) {
+        error_report("multifd is not compatible with TLS");
+        return -1;
+    }
+
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->pages = g_new0(MultiFDPages_t, 1);
+    multifd_send_state->generation = ++multifd_send_generation;
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        MultiFDConnectData *data = g_new0(MultiFDConnectData, 1);
+        Error *local_err = NULL;
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->id = i;
+        p->pages = g_new0(MultiFDPages_t, 1);
+        p->name = g_strdup_printf("multifdsend_%d", i);
+        multifd_send_state->count++;
+
+        data->generation = multifd_send_state->generation;
+        data->id = i;
+        if (socket_send_channel_create(multifd_new_send_channel_async, data,
+                                       &local_err) < 0) {
+            g_free(data);
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * multifd_send_pages: hand the queued pages to the next idle channel
+ *
+ * Returns: Number of bytes that will be sent on the channel
+ *          -1 if the channels have failed
+ *
+ * @f: QEMUFile of the main stream, credited with the bytes sent
+ * @flags: MULTIFD_FLAG_* for the packet
+ */
+static int multifd_send_pages(QEMUFile *f, uint32_t flags)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    int i, transferred;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->quit)) {
+        return -1;
+    }
+
+    /* channels_ready guarantees that there is an idle channel */
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        if (p->running && !p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+
+    transferred = sizeof(MultiFDPacket_t) +
+                  pages->used * (sizeof(uint64_t) + TARGET_PAGE_SIZE);
+
+    p->pending_job = true;
+    p->flags = flags;
+    p->packet_num = multifd_send_state->packet_num++;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    qemu_update_position(f, transferred);
+    qemu_file_update_transfer(f, transferred);
+    return transferred;
+}
+
+/*
+ * multifd_queue_page: queue a page to be sent on a multifd channel
+ *
+ * Returns: 0 on success, -1 if the channels have failed
+ *
+ * @f: QEMUFile of the main stream
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                              uint64_t *bytes_transferred)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    int ret;
+
+    if (pages->used && pages->block != block) {
+        ret = multifd_send_pages(f, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        *bytes_transferred += ret;
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+
+    if (pages->used == MULTIFD_PACKET_PAGES) {
+        ret = multifd_send_pages(f, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        *bytes_transferred += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * multifd_send_sync_main: synchronize the channels with the main stream
+ *
+ * Sends all the queued pages, waits until every channel has written
+ * them and then sends a sync packet on every channel and a
+ * RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream.  The destination does
+ * not load anything that follows the flag before all the packets that
+ * precede the sync packets have been received, so a page sent in one
+ * dirty bitmap pass can not overwrite a copy sent in a later one.
+ *
+ * Returns: 0 on success, -1 if the channels have failed
+ *
+ * @f: QEMUFile of the main stream
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int multifd_send_sync_main(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    int i, ret;
+
+    if (multifd_send_state->pages->used) {
+        ret = multifd_send_pages(f, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+        *bytes_transferred += ret;
+    }
+
+    /* Wait until all channels are idle... */
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+        if (atomic_read(&multifd_send_state->quit)) {
+            goto fail;
+        }
+    }
+
+    /* ...give each of them its sync packet... */
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        assert(!p->pending_job && !p->pages->used);
+        p->pending_job = true;
+        p->flags = MULTIFD_FLAG_SYNC;
+        p->packet_num = multifd_send_state->packet_num++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    /* ...and wait until they have been written */
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+        if (atomic_read(&multifd_send_state->quit)) {
+            goto fail;
+        }
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+
+    ret = multifd_send_state->count * sizeof(MultiFDPacket_t);
+    qemu_update_position(f, ret);
+    qemu_file_update_transfer(f, ret);
+    *bytes_transferred += ret;
+
+    multifd_send_state->sync_count = bitmap_sync_count;
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    *bytes_transferred += 8;
+    trace_multifd_send_sync_main(bitmap_sync_count);
+    return 0;
+
+fail:
+    error_report("multifd: failed to send pages");
+    qemu_file_set_error(f, -EIO);
+    return -1;
+}
+
+/* Synchronize the channels if the dirty bitmap was synced since last time */
+static int multifd_send_sync_pass(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    if (!multifd_send_state ||
+        multifd_send_state->sync_count == bitmap_sync_count) {
+        return 0;
+    }
+    return multifd_send_sync_main(f, bytes_transferred);
+}
+
+/**
+ * ram_save_multifd_page: Send the given page on a multifd channel
+ *
+ * Zero pages are still sent on the main stream.
+ *
+ * Returns: Number of pages written, or < 0 on error
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    pages = save_zero_page(f, block,
+                           block == last_sent_block ?
+                           offset | RAM_SAVE_FLAG_CONTINUE : offset,
+                           block->host + offset, bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
+
+    if (multifd_queue_page(f, block, offset, bytes_transferred) < 0) {
+        error_report("multifd: failed to send pages");
+        qemu_file_set_error(f, -EIO);
+        return -1;
+    }
+    acct_info.norm_pages++;
+    return 1;
+}
+
 static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
                                 PageSearchStatus *pss,
                                 bool last_stage,
@@ -1233,9 +2501,11 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     int res = 0;
 
     /* Check the pages is dirty and if it is send it */
-    if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
+    if (migration_bitmap_clear_dirty(pss->block, dirty_ram_abs)) {
         unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
+        if (multifd_send_state) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
+        } else if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
@@ -1253,9 +2523,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  Pages sent on multifd channels aren't in the
+         * stream at all.
          */
-        if (res > 0) {
+        if (res > 0 && !multifd_send_state) {
             last_sent_block = pss->block;
         }
     }
@@ -1304,6 +2575,70 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
     return pages;
 }
 
+static bool ram_page_queue_empty(MigrationState *ms)
+{
+    bool empty;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    empty = QSIMPLEQ_EMPTY(&ms->src_page_requests);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return empty;
+}
+
+/*
+ * With postcopy-preempt the host page the destination faulted on is sent
+ * on its own channel, so that it does not queue up behind the background
+ * stream, followed by up to postcopy-prefetch-pages of the host pages
+ * after it; guest accesses tend to be sequential.  Prefetching stops as
+ * soon as another request comes in.
+ *
+ * Each batch is self contained: it starts with a full block header and
+ * ends with RAM_SAVE_FLAG_EOS.  A batch without pages closes the channel.
+ *
+ * Returns the number of pages written, or a negative error.
+ */
+static int ram_save_postcopy_preempt(MigrationState *ms, QEMUFile *pf,
+                                     PageSearchStatus *pss,
+                                     uint64_t *bytes_transferred,
+                                     ram_addr_t dirty_ram_abs)
+{
+    RAMBlock *main_last_sent_block = last_sent_block;
+    int prefetch = migrate_postcopy_prefetch_pages();
+    int pages, tmppages;
+
+    last_sent_block = NULL;
+    pages = ram_save_host_page(ms, pf, pss, false, bytes_transferred,
+                               dirty_ram_abs);
+    trace_ram_save_postcopy_preempt(pss->block->idstr,
+                                    (uint64_t)pss->offset, pages);
+
+    while (pages >= 0 && prefetch-- > 0 && ram_page_queue_empty(ms)) {
+        ram_addr_t offset = pss->offset + TARGET_PAGE_SIZE;
+
+        if (offset >= pss->block->used_length) {
+            break;
+        }
+        pss->offset = offset;
+        tmppages = ram_save_host_page(ms, pf, pss, false, bytes_transferred,
+                                      pss->block->offset + offset);
+        if (tmppages < 0) {
+            pages = tmppages;
+            break;
+        }
+        pages += tmppages;
+    }
+
+    qemu_put_be64(pf, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(pf);
+    last_sent_block = main_last_sent_block;
+
+    if (pages >= 0 && qemu_file_get_error(pf)) {
+        pages = qemu_file_get_error(pf);
+    }
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -1326,7 +2661,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     PageSearchStatus pss;
     MigrationState *ms = migrate_get_current();
     int pages = 0;
-    bool again, found;
+    bool again, found, queued;
     ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
                                  ram_addr_t space */
 
@@ -1341,6 +2676,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     do {
         again = true;
         found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        queued = found;
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -1348,9 +2684,17 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
         }
 
         if (found) {
-            pages = ram_save_host_page(ms, f, &pss,
-                                       last_stage, bytes_transferred,
-                                       dirty_ram_abs);
+            QEMUFile *pf = atomic_mb_read(&ms->postcopy_qemufile_src);
+
+            if (queued && pf) {
+                pages = ram_save_postcopy_preempt(ms, pf, &pss,
+                                                  bytes_transferred,
+                                                  dirty_ram_abs);
+            } else {
+                pages = ram_save_host_page(ms, f, &pss,
+                                           last_stage, bytes_transferred,
+                                           dirty_ram_abs);
+            }
         }
     } while (!pages && again);
 
@@ -1418,12 +2762,24 @@ static void ram_migration_cleanup(void *opaque)
      * no writing race against this migration_bitmap
      */
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
+    RAMBlock *block;
+
+    precopy_notify(PRECOPY_NOTIFY_CLEANUP);
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
 
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->clear_bmap);
+        block->clear_bmap = NULL;
+    }
+    rcu_read_unlock();
+
+    bitmap_sync_threads_join();
+
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
@@ -1856,6 +3212,11 @@ int ram_discard_range(MigrationIncomingState *mis,
             goto err;
         }
         ret = postcopy_ram_discard_range(mis, host_startaddr, length);
+        if (!ret && postcopy_recv_bitmap) {
+            bitmap_clear(postcopy_recv_bitmap,
+                         (rb->offset + start) >> TARGET_PAGE_BITS,
+                         length >> TARGET_PAGE_BITS);
+        }
     } else {
         error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
                      "/%zx/" RAM_ADDR_FMT")",
@@ -1939,6 +3300,19 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->clear_bmap =
+            bitmap_new(clear_bmap_size(block->max_length >> TARGET_PAGE_BITS));
+        if (ram_block_is_ignored(block)) {
+            bitmap_clear(migration_bitmap_rcu->bmap,
+                         block->offset >> TARGET_PAGE_BITS,
+                         block->used_length >> TARGET_PAGE_BITS);
+            migration_dirty_pages -= block->used_length >> TARGET_PAGE_BITS;
+        }
+    }
+
+    bitmap_sync_threads_create();
+    precopy_notify(PRECOPY_NOTIFY_SETUP);
     memory_global_dirty_log_start();
     migration_bitmap_sync();
     qemu_mutex_unlock_ramlist();
@@ -1950,6 +3324,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_ignore_shared()) {
+            qemu_put_byte(f, ram_block_is_ignored(block));
+        }
     }
 
     rcu_read_unlock();
@@ -1957,6 +3334,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
+    /* This also waits for all the multifd channels to connect */
+    if (multifd_send_state &&
+        multifd_send_sync_main(f, &bytes_transferred) < 0) {
+        return -1;
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -1977,6 +3360,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     /* Read version before ram_list.blocks */
     smp_rmb();
 
+    multifd_send_sync_pass(f, &bytes_transferred);
+
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
@@ -2030,12 +3415,17 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    MigrationState *ms = migrate_get_current();
+    QEMUFile *pf = atomic_mb_read(&ms->postcopy_qemufile_src);
+
     rcu_read_lock();
 
     if (!migration_in_postcopy(migrate_get_current())) {
         migration_bitmap_sync();
     }
 
+    multifd_send_sync_pass(f, &bytes_transferred);
+
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
     /* try transferring iterative blocks of memory */
@@ -2052,10 +3442,18 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (multifd_send_state) {
+        multifd_send_sync_main(f, &bytes_transferred);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
 
+    if (pf && migration_in_postcopy(ms)) {
+        /* An empty batch tells the preempt thread to finish */
+        qemu_put_be64(pf, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(pf);
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2129,32 +3527,44 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * f: Stream to read from
  * flags: Page flags (mostly to see if it's a continuation of previous block)
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f,
-                                              int flags)
+/* Block of the last page header read from the main stream */
+static RAMBlock *last_recv_block;
+
+/*
+ * Read the block of a page header from @f; @last caches the block of the
+ * previous header on the same channel for RAM_SAVE_FLAG_CONTINUE.
+ */
+static inline RAMBlock *ram_block_from_channel(QEMUFile *f, int flags,
+                                               RAMBlock **last)
 {
-    static RAMBlock *block = NULL;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!*last) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return *last;
     }
 
     len = qemu_get_byte(f);
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    block = qemu_ram_block_by_name(id);
-    if (!block) {
+    *last = qemu_ram_block_by_name(id);
+    if (!*last) {
         error_report("Can't find block %s", id);
         return NULL;
     }
 
-    return block;
+    return *last;
+}
+
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f,
+                                              int flags)
+{
+    return ram_block_from_channel(f, flags, &last_recv_block);
 }
 
 static inline void *host_from_ram_block_offset(RAMBlock *block,
@@ -2167,6 +3577,177 @@ static inline void *host_from_ram_block_offset(RAMBlock *block,
     return block->host + offset;
 }
 
+#define RAMBLOCK_RECV_BITMAP_ENDING  (0x0123456789abcdefULL)
+
+static void ram_recv_bitmap_set(RAMBlock *block, ram_addr_t offset,
+                                size_t len)
+{
+    unsigned long *bitmap = atomic_rcu_read(&postcopy_recv_bitmap);
+    unsigned long page = (block->offset + offset) >> TARGET_PAGE_BITS;
+    unsigned long end = page + (len >> TARGET_PAGE_BITS);
+
+    if (!bitmap) {
+        return;
+    }
+    for (; page < end; page++) {
+        set_bit_atomic(page, bitmap);
+    }
+}
+
+static bool ram_recv_bitmap_test(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long *bitmap = atomic_rcu_read(&postcopy_recv_bitmap);
+
+    return bitmap &&
+           test_bit((block->offset + offset) >> TARGET_PAGE_BITS, bitmap);
+}
+
+/*
+ * Has the page at @host been received?  Pages are assumed to be there
+ * when nothing is being tracked.
+ */
+bool ram_postcopy_page_received(void *host)
+{
+    ram_addr_t offset;
+    RAMBlock *block;
+    bool ret = true;
+
+    rcu_read_lock();
+    block = qemu_ram_block_from_host(host, false, &offset);
+    if (block && postcopy_recv_bitmap) {
+        ret = ram_recv_bitmap_test(block, offset);
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+void ram_postcopy_recv_bitmap_free(void)
+{
+    g_free(postcopy_recv_bitmap);
+    postcopy_recv_bitmap = NULL;
+}
+
+/*
+ * Write the received bitmap of @block_name to the return path @f: its size
+ * in bytes, the bitmap with the bits of each byte in page order, and an
+ * end marker.  Returns 0 on success.
+ */
+int ram_write_recv_bitmap(QEMUFile *f, const char *block_name)
+{
+    RAMBlock *block;
+    unsigned long first, i, pages;
+    uint64_t nbytes = 0;
+    uint8_t *buf = NULL;
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(block_name);
+    if (block && postcopy_recv_bitmap) {
+        first = block->offset >> TARGET_PAGE_BITS;
+        pages = block->used_length >> TARGET_PAGE_BITS;
+        nbytes = DIV_ROUND_UP(pages, 8);
+        buf = g_malloc0(nbytes);
+        for (i = 0; i < pages; i++) {
+            if (test_bit(first + i, postcopy_recv_bitmap)) {
+                buf[i / 8] |= 1 << (i % 8);
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    /* An unknown block goes out empty, the source then refuses it */
+    trace_ram_write_recv_bitmap(block_name, nbytes);
+    qemu_put_be64(f, nbytes);
+    qemu_put_buffer(f, buf, nbytes);
+    qemu_put_be64(f, RAMBLOCK_RECV_BITMAP_ENDING);
+    g_free(buf);
+
+    return qemu_file_get_error(f);
+}
+
+/*
+ * Read the received bitmap of @block_name from the return path @f while
+ * recovering postcopy, and make the dirty bitmap the pages it lacks.
+ * Returns 0 on success.
+ */
+int ram_dirty_bitmap_reload(MigrationState *s, QEMUFile *f,
+                            const char *block_name)
+{
+    RAMBlock *block;
+    unsigned long *bitmap;
+    unsigned long first, i, pages;
+    uint64_t nbytes, ending;
+    uint8_t *buf;
+    int ret = -EINVAL;
+
+    if (s->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+        error_report("%s: received bitmap while not recovering", __func__);
+        return -EINVAL;
+    }
+
+    nbytes = qemu_get_be64(f);
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(block_name);
+    if (!block) {
+        error_report("%s: unknown ramblock '%s'", __func__, block_name);
+        goto out;
+    }
+    pages = block->used_length >> TARGET_PAGE_BITS;
+    if (nbytes != DIV_ROUND_UP(pages, 8)) {
+        error_report("%s: ramblock '%s' bitmap size %" PRIu64
+                     " expected %lu", __func__, block_name, nbytes,
+                     DIV_ROUND_UP(pages, 8));
+        goto out;
+    }
+
+    buf = g_malloc(nbytes);
+    qemu_get_buffer(f, buf, nbytes);
+    ending = qemu_get_be64(f);
+    if (qemu_file_get_error(f) || ending != RAMBLOCK_RECV_BITMAP_ENDING) {
+        error_report("%s: ramblock '%s' bitmap is corrupted", __func__,
+                     block_name);
+        g_free(buf);
+        goto out;
+    }
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    first = block->offset >> TARGET_PAGE_BITS;
+    for (i = 0; i < pages; i++) {
+        if (buf[i / 8] & (1 << (i % 8))) {
+            migration_dirty_pages -= test_and_clear_bit(first + i, bitmap);
+        } else {
+            migration_dirty_pages += !test_and_set_bit(first + i, bitmap);
+        }
+    }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+    g_free(buf);
+
+    trace_ram_dirty_bitmap_reload(block_name, migration_dirty_pages);
+    ret = 0;
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * Ask the destination for the received bitmap of every block, before
+ * postcopy restarts over a new connection.
+ */
+void ram_postcopy_resume_prepare(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    /* The new stream has to start every block afresh */
+    last_sent_block = NULL;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        qemu_savevm_send_recv_bitmap(f, block->idstr);
+    }
+    rcu_read_unlock();
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -2181,26 +3762,27 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
-    uint8_t *des;
-    int len;
+    uint8_t *compbuf;
+    int i;
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
-        if (param->des) {
-            des = param->des;
-            len = param->len;
-            param->des = 0;
+        if (param->start) {
+            param->start = false;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
-             * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+            /* Decompression will fail in some case, especially when the
+             * page is dirtied while it is being compressed.  It's not a
+             * problem because the dirty page will be retransferred and
+             * the failure won't break the data in other pages.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            compbuf = param->compbuf;
+            for (i = 0; i < param->npages; i++) {
+                page_codec_decompress(&param->codec, param->des[i],
+                                      TARGET_PAGE_SIZE, compbuf,
+                                      param->len[i]);
+                compbuf += param->len[i];
+            }
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2217,14 +3799,33 @@ static void *do_data_decompress(void *opaque)
     return NULL;
 }
 
+/* Start the thread that decomp_batch_idx points to */
+static void decompress_submit_batch(void)
+{
+    DecompressParam *param = &decomp_param[decomp_batch_idx];
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+    decomp_batch_idx = -1;
+}
+
 static void wait_for_decompress_done(void)
 {
     int idx, thread_count;
 
-    if (!migrate_use_compression()) {
+    /* Compressed pages are accepted whether or not the capability is set
+     * on the destination, so check for the threads themselves.
+     */
+    if (!decomp_param) {
         return;
     }
 
+    if (decomp_batch_idx >= 0) {
+        decompress_submit_batch();
+    }
+
     thread_count = migrate_decompress_threads();
     qemu_mutex_lock(&decomp_done_lock);
     for (idx = 0; idx < thread_count; idx++) {
@@ -2244,10 +3845,13 @@ void migrate_decompress_threads_create(void)
     decomp_param = g_new0(DecompressParam, thread_count);
     qemu_mutex_init(&decomp_done_lock);
     qemu_cond_init(&decomp_done_cond);
+    decomp_batch_idx = -1;
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        page_codec_init(&decomp_param[i].codec, false);
+        decomp_param[i].compbuf = g_malloc0(COMPRESS_BATCH_PAGES *
+            page_codec_bound(decomp_param[i].codec.method));
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2271,6 +3875,7 @@ void migrate_decompress_threads_join(void)
         qemu_thread_join(decompress_threads + i);
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
+        page_codec_cleanup(&decomp_param[i].codec);
         g_free(decomp_param[i].compbuf);
     }
     g_free(decompress_threads);
@@ -2279,58 +3884,643 @@ void migrate_decompress_threads_join(void)
     decomp_param = NULL;
 }
 
+/*
+ * Read a compressed page into the batch of an idle decompression thread,
+ * which is started once it holds COMPRESS_BATCH_PAGES pages or when
+ * wait_for_decompress_done() is called.
+ */
 static void decompress_data_with_multi_threads(QEMUFile *f,
                                                void *host, int len)
 {
+    DecompressParam *param;
     int idx, thread_count;
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
+    if (decomp_batch_idx < 0) {
+        thread_count = migrate_decompress_threads();
+        qemu_mutex_lock(&decomp_done_lock);
+        while (true) {
+            for (idx = 0; idx < thread_count; idx++) {
+                if (decomp_param[idx].done) {
+                    break;
+                }
+            }
+            if (idx < thread_count) {
                 break;
             }
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
         }
-        if (idx < thread_count) {
-            break;
+        decomp_param[idx].done = false;
+        qemu_mutex_unlock(&decomp_done_lock);
+
+        decomp_param[idx].npages = 0;
+        decomp_param[idx].used = 0;
+        decomp_batch_idx = idx;
+    }
+
+    /* The thread stays idle until the batch is started */
+    param = &decomp_param[decomp_batch_idx];
+    qemu_get_buffer(f, param->compbuf + param->used, len);
+    param->des[param->npages] = host;
+    param->len[param->npages] = len;
+    param->npages++;
+    param->used += len;
+
+    if (param->npages == COMPRESS_BATCH_PAGES) {
+        decompress_submit_batch();
+    }
+}
+
+/* Number of pages copied into guest memory by a load thread at a time */
+#define LOAD_BATCH_PAGES 64
+
+struct LoadParam {
+    bool done;
+    bool quit;
+    bool start;
+    QemuMutex mutex;
+    QemuCond cond;
+    uint8_t *buf;
+    /* filled by the main thread while the thread is idle */
+    RAMBlock *block;
+    int npages;
+    void *des[LOAD_BATCH_PAGES];
+};
+typedef struct LoadParam LoadParam;
+
+static LoadParam *load_param;
+static QemuThread *load_threads;
+static int load_thread_count;
+static QemuMutex load_done_lock;
+static QemuCond load_done_cond;
+/* load_param being filled by the main thread, or -1 */
+static int load_batch_idx;
+
+/*
+ * Anonymous RAM that was never touched since QEMU started, and so still
+ * reads as zero.  Zero pages sent for it are dropped, rather than faulting
+ * in host memory to check it.  Only tracked for incoming migration.
+ */
+static unsigned long *untouched_bitmap;
+
+/*
+ * Populate the range of a batch of pages at once.  The source sends the
+ * pages of a block in address order, so a batch normally covers a dense
+ * range; a sparse one is left to the page faults of the copy.
+ */
+static void load_prefault_batch(LoadParam *param)
+{
+    uintptr_t start = (uintptr_t)param->des[0];
+    uintptr_t end = start;
+    int i;
+
+    for (i = 1; i < param->npages; i++) {
+        start = MIN(start, (uintptr_t)param->des[i]);
+        end = MAX(end, (uintptr_t)param->des[i]);
+    }
+    end += TARGET_PAGE_SIZE;
+    if (end - start > 2 * param->npages * TARGET_PAGE_SIZE) {
+        return;
+    }
+
+    start &= ~(qemu_real_host_page_size - 1);
+    qemu_madvise((void *)start, end - start, QEMU_MADV_POPULATE_WRITE);
+}
+
+static void *do_data_load(void *opaque)
+{
+    LoadParam *param = opaque;
+    bool prefault = migrate_prefault_ram() &&
+                    QEMU_MADV_POPULATE_WRITE != QEMU_MADV_INVALID;
+    int i;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            if (prefault) {
+                load_prefault_batch(param);
+            }
+            for (i = 0; i < param->npages; i++) {
+                memcpy(param->des[i], param->buf + i * TARGET_PAGE_SIZE,
+                       TARGET_PAGE_SIZE);
+            }
+
+            qemu_mutex_lock(&load_done_lock);
+            param->done = true;
+            qemu_cond_signal(&load_done_cond);
+            qemu_mutex_unlock(&load_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
         } else {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+            qemu_cond_wait(&param->cond, &param->mutex);
         }
     }
-    qemu_mutex_unlock(&decomp_done_lock);
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+/* Start the thread that load_batch_idx points to */
+static void load_submit_batch(void)
+{
+    LoadParam *param = &load_param[load_batch_idx];
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+    load_batch_idx = -1;
+}
+
+/*
+ * Wait for the pages handed to the load threads to be in place.  A page
+ * is sent at most once per ram_load() call, so this is only needed before
+ * returning from it.
+ */
+static void wait_for_load_done(void)
+{
+    int idx;
+
+    if (!load_param) {
+        return;
+    }
+
+    if (load_batch_idx >= 0) {
+        load_submit_batch();
+    }
+
+    qemu_mutex_lock(&load_done_lock);
+    for (idx = 0; idx < load_thread_count; idx++) {
+        while (!load_param[idx].done) {
+            qemu_cond_wait(&load_done_cond, &load_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&load_done_lock);
+}
+
+/* Record the anonymous RAM that has no host page yet, see untouched_bitmap */
+static void ram_find_untouched(void)
+{
+#ifdef CONFIG_LINUX
+    uint64_t entries[512];
+    RAMBlock *block;
+    int fd;
+
+    /* multifd channels write pages behind the back of ram_load() */
+    if (migrate_use_multifd()) {
+        return;
+    }
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    untouched_bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        uintptr_t host = (uintptr_t)block->host;
+        size_t pages = block->used_length / qemu_real_host_page_size;
+        size_t done, n, i;
+
+        if (!host || block->fd >= 0 || ram_block_is_ignored(block)) {
+            continue;
+        }
+        for (done = 0; done < pages; done += n) {
+            off_t pos = (host / qemu_real_host_page_size + done) *
+                        sizeof(entries[0]);
+            ssize_t len;
+
+            n = MIN(pages - done, ARRAY_SIZE(entries));
+            len = pread(fd, entries, n * sizeof(entries[0]), pos);
+            if (len <= 0) {
+                break;
+            }
+            n = len / sizeof(entries[0]);
+            for (i = 0; i < n; i++) {
+                /* Neither present nor swapped out */
+                if (!(entries[i] >> 62)) {
+                    ram_addr_t offset = block->offset +
+                                        (done + i) * qemu_real_host_page_size;
+
+                    bitmap_set(untouched_bitmap, offset >> TARGET_PAGE_BITS,
+                               qemu_real_host_page_size >> TARGET_PAGE_BITS);
+                }
+            }
+        }
+    }
+    rcu_read_unlock();
+    close(fd);
+#endif
+}
+
+/*
+ * Note that the page at @offset of @block is being written.  Returns
+ * true if it was never touched before, and so still reads as zero.
+ */
+static bool ram_page_test_and_touch(RAMBlock *block, ram_addr_t offset)
+{
+    return untouched_bitmap &&
+           test_and_clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                              untouched_bitmap);
+}
+
+void migrate_load_threads_create(void)
+{
+    int i;
+
+    ram_find_untouched();
+
+    load_thread_count = migrate_load_threads();
+    if (!load_thread_count) {
+        return;
+    }
+    load_threads = g_new0(QemuThread, load_thread_count);
+    load_param = g_new0(LoadParam, load_thread_count);
+    qemu_mutex_init(&load_done_lock);
+    qemu_cond_init(&load_done_cond);
+    load_batch_idx = -1;
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_init(&load_param[i].mutex);
+        qemu_cond_init(&load_param[i].cond);
+        load_param[i].buf = qemu_memalign(qemu_real_host_page_size,
+                                          LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        load_param[i].done = true;
+        load_param[i].quit = false;
+        qemu_thread_create(load_threads + i, "load", do_data_load,
+                           load_param + i, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_load_threads_join(void)
+{
+    int i;
+
+    g_free(untouched_bitmap);
+    untouched_bitmap = NULL;
+
+    if (!load_param) {
+        return;
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_lock(&load_param[i].mutex);
+        load_param[i].quit = true;
+        qemu_cond_signal(&load_param[i].cond);
+        qemu_mutex_unlock(&load_param[i].mutex);
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_thread_join(load_threads + i);
+        qemu_mutex_destroy(&load_param[i].mutex);
+        qemu_cond_destroy(&load_param[i].cond);
+        qemu_vfree(load_param[i].buf);
+    }
+    qemu_mutex_destroy(&load_done_lock);
+    qemu_cond_destroy(&load_done_cond);
+    g_free(load_threads);
+    g_free(load_param);
+    load_threads = NULL;
+    load_param = NULL;
+}
+
+/*
+ * Read a page into the batch of an idle load thread.  A batch only holds
+ * pages of one block, and is started once it is full, when a page of
+ * another block arrives or when wait_for_load_done() is called.
+ */
+static void load_page_with_multi_threads(QEMUFile *f, RAMBlock *block,
+                                         void *host)
+{
+    LoadParam *param;
+    int idx;
+
+    if (load_batch_idx >= 0 && load_param[load_batch_idx].block != block) {
+        load_submit_batch();
+    }
+
+    if (load_batch_idx < 0) {
+        qemu_mutex_lock(&load_done_lock);
+        while (true) {
+            for (idx = 0; idx < load_thread_count; idx++) {
+                if (load_param[idx].done) {
+                    break;
+                }
+            }
+            if (idx < load_thread_count) {
+                break;
+            }
+            qemu_cond_wait(&load_done_cond, &load_done_lock);
+        }
+        load_param[idx].done = false;
+        qemu_mutex_unlock(&load_done_lock);
+
+        load_param[idx].block = block;
+        load_param[idx].npages = 0;
+        load_batch_idx = idx;
+    }
+
+    /* The thread stays idle until the batch is started */
+    param = &load_param[load_batch_idx];
+    qemu_get_buffer(f, param->buf + param->npages * TARGET_PAGE_SIZE,
+                    TARGET_PAGE_SIZE);
+    param->des[param->npages++] = host;
+
+    if (param->npages == LOAD_BATCH_PAGES) {
+        load_submit_batch();
+    }
 }
 
 /*
  * Allocate data structures etc needed by incoming migration with postcopy-ram
  * postcopy-ram's similarly names postcopy_ram_incoming_init does the work
  */
+typedef struct {
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* the thread waits here after a sync packet */
+    QemuSemaphore sem_sync;
+    bool quit;
+    /* only used by the thread */
+    MultiFDPacket_t packet;
+    uint64_t offset[MULTIFD_PACKET_PAGES];
+    struct iovec iov[MULTIFD_PACKET_PAGES];
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int nr_channels;
+    /* number of channels that have connected */
+    int count;
+    /* posted when a channel reaches a sync packet, or fails */
+    QemuSemaphore sem_sync;
+    bool failed;
+} *multifd_recv_state;
+
+int multifd_load_setup(void)
+{
+    int thread_count, i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->nr_channels = thread_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_sem_init(&p->sem_sync, 0);
+        p->id = i;
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+    }
+
+    return 0;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_recv_state->nr_channels; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->c) {
+            atomic_set(&p->quit, true);
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_sem_post(&p->sem_sync);
+            qemu_thread_join(&p->thread);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/*
+ * Receive one packet and load its pages into guest memory.
+ *
+ * Returns 0 on success and -1 on error, with @flags set to the
+ * MULTIFD_FLAG_* of the packet.
+ */
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags,
+                               Error **errp)
+{
+    MultiFDPacket_t *packet = &p->packet;
+    struct iovec iov = { .iov_base = packet, .iov_len = sizeof(*packet) };
+    RAMBlock *block;
+    uint32_t magic, version, pages;
+    int i, ret;
+
+    if (qio_channel_readv_all(p->c, &iov, 1, errp) < 0) {
+        return -1;
+    }
+
+    magic = be32_to_cpu(packet->magic);
+    if (magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x, expected %x",
+                   magic, MULTIFD_MAGIC);
+        return -1;
+    }
+    version = be32_to_cpu(packet->version);
+    if (version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d, expected %d",
+                   version, MULTIFD_VERSION);
+        return -1;
+    }
+    *flags = be32_to_cpu(packet->flags);
+    if (*flags & ~MULTIFD_FLAG_SYNC) {
+        error_setg(errp, "multifd: unknown packet flags %x", *flags);
+        return -1;
+    }
+    pages = be32_to_cpu(packet->pages);
+    if (pages > MULTIFD_PACKET_PAGES) {
+        error_setg(errp, "multifd: received packet with %d pages, "
+                   "maximum is %d", pages, MULTIFD_PACKET_PAGES);
+        return -1;
+    }
+    trace_multifd_recv(p->id, be64_to_cpu(packet->packet_num), pages,
+                       *flags);
+    if (!pages) {
+        return 0;
+    }
+
+    iov.iov_base = p->offset;
+    iov.iov_len = pages * sizeof(p->offset[0]);
+    if (qio_channel_readv_all(p->c, &iov, 1, errp) < 0) {
+        return -1;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        rcu_read_unlock();
+        error_setg(errp, "multifd: unknown ramblock \"%s\"",
+                   packet->ramblock);
+        return -1;
+    }
+
+    for (i = 0; i < pages; i++) {
+        ram_addr_t offset = be64_to_cpu(p->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            !offset_in_ramblock(block, offset)) {
+            rcu_read_unlock();
+            error_setg(errp, "multifd: illegal offset " RAM_ADDR_FMT
+                       " in ramblock \"%s\"", offset, block->idstr);
+            return -1;
+        }
+        p->iov[i].iov_base = block->host + offset;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    ret = qio_channel_readv_all(p->c, p->iov, pages, errp);
+    if (!ret) {
+        for (i = 0; i < pages; i++) {
+            ram_recv_bitmap_set(block, be64_to_cpu(p->offset[i]),
+                                TARGET_PAGE_SIZE);
+        }
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    uint32_t flags;
+
+    rcu_register_thread();
+
+    while (!atomic_read(&p->quit)) {
+        if (multifd_recv_packet(p, &flags, &local_err) < 0) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    if (local_err) {
+        if (atomic_read(&p->quit)) {
+            /* The channel was shut down by multifd_load_cleanup() */
+            error_free(local_err);
+        } else {
+            error_report_err(local_err);
+            atomic_set(&multifd_recv_state->failed, true);
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
+{
+    MultiFDRecvParams *p;
+    MultiFDInit_t msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+
+    if (qio_channel_readv_all(ioc, &iov, 1, errp) < 0) {
+        return;
+    }
+    if (be32_to_cpu(msg.magic) != MULTIFD_MAGIC ||
+        be32_to_cpu(msg.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: invalid channel header");
+        return;
+    }
+    if (msg.id >= multifd_recv_state->nr_channels) {
+        error_setg(errp, "multifd: channel %d received, only %d configured",
+                   msg.id, multifd_recv_state->nr_channels);
+        return;
+    }
+
+    p = &multifd_recv_state->params[msg.id];
+    if (p->c) {
+        error_setg(errp, "multifd: channel %d received twice", msg.id);
+        return;
+    }
+
+    object_ref(OBJECT(ioc));
+    p->c = ioc;
+    multifd_recv_state->count++;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    return multifd_recv_state &&
+           multifd_recv_state->count == multifd_recv_state->nr_channels;
+}
+
+/*
+ * Wait until every channel has received the sync packet that goes with
+ * a RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream, then let them go on.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd sync received, but multifd is not enabled");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+        if (atomic_read(&multifd_recv_state->failed)) {
+            return -EIO;
+        }
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+
+    return 0;
+}
+
 int ram_postcopy_incoming_init(MigrationIncomingState *mis)
 {
     size_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
 
+    ram_postcopy_recv_bitmap_free();
+    atomic_rcu_set(&postcopy_recv_bitmap, bitmap_new(ram_pages));
+
     return postcopy_ram_incoming_init(mis, ram_pages);
 }
 
 /*
- * Called in postcopy mode by ram_load().
- * rcu_read_lock is taken prior to this being called.
+ * Load postcopy pages from @f up to the next RAM_SAVE_FLAG_EOS, assembling
+ * each host page in @postcopy_host_page before it is placed.  @last_block
+ * is the block cache of the channel, and @npages (if not NULL) is set to
+ * the number of target pages read.
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy_pages(QEMUFile *f, void *postcopy_host_page,
+                                   RAMBlock **last_block, int *npages)
 {
     int flags = 0, ret = 0;
+    int pages = 0;
     bool place_needed = false;
     bool matching_page_sizes = qemu_host_page_size == TARGET_PAGE_SIZE;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -2348,9 +4538,9 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_channel(f, flags, last_block);
 
-            host = host_from_ram_block_offset(block, addr);
+            host = block ? host_from_ram_block_offset(block, addr) : NULL;
             if (!host) {
                 error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
                 ret = -EINVAL;
@@ -2387,6 +4577,7 @@ static int ram_load_postcopy(QEMUFile *f)
             place_needed = (((uintptr_t)host + TARGET_PAGE_SIZE) &
                                      ~qemu_host_page_mask) == 0;
             place_source = postcopy_host_page;
+            pages++;
         }
         last_host = host;
 
@@ -2422,8 +4613,14 @@ static int ram_load_postcopy(QEMUFile *f)
         }
 
         if (place_needed) {
+            void *host_page = host + TARGET_PAGE_SIZE - qemu_host_page_size;
+            ram_addr_t offset = (uint8_t *)host_page - (*last_block)->host;
+
             /* This gets called at the last target page in the host page */
-            if (all_zero) {
+            if (ram_recv_bitmap_test(*last_block, offset)) {
+                /* Sent again after a postcopy recovery, it's already here */
+                trace_ram_load_postcopy_duplicate(host_page);
+            } else if (all_zero) {
                 ret = postcopy_place_page_zero(mis,
                                                host + TARGET_PAGE_SIZE -
                                                qemu_host_page_size);
@@ -2432,12 +4629,53 @@ static int ram_load_postcopy(QEMUFile *f)
                                                qemu_host_page_size,
                                                place_source);
             }
+            if (!ret) {
+                ram_recv_bitmap_set(*last_block, offset, qemu_host_page_size);
+            }
         }
         if (!ret) {
             ret = qemu_file_get_error(f);
         }
     }
 
+    if (npages) {
+        *npages = pages;
+    }
+    return ret;
+}
+
+/*
+ * Called in postcopy mode by ram_load().
+ * rcu_read_lock is taken prior to this being called.
+ */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    /* Temporary page that is later 'placed' */
+    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+
+    return ram_load_postcopy_pages(f, postcopy_host_page, &last_recv_block,
+                                   NULL);
+}
+
+/*
+ * Load the batches sent on the postcopy preempt channel until the empty
+ * batch that ends it; @tmp_page is the preempt thread's own temporary
+ * page.  Called from the preempt thread.
+ */
+int ram_load_postcopy_preempt(QEMUFile *f, void *tmp_page)
+{
+    RAMBlock *block;
+    int ret, pages;
+
+    do {
+        /* Every batch starts with a full block header */
+        block = NULL;
+        rcu_read_lock();
+        ret = ram_load_postcopy_pages(f, tmp_page, &block, &pages);
+        rcu_read_unlock();
+    } while (!ret && pages);
+
     return ret;
 }
 
@@ -2471,7 +4709,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        RAMBlock *block = NULL;
         void *host = NULL;
+        bool untouched = false;
         uint8_t ch;
 
         addr = qemu_get_be64(f);
@@ -2480,7 +4720,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2488,6 +4728,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+            ram_recv_bitmap_set(block, addr, TARGET_PAGE_SIZE);
+            untouched = ram_page_test_and_touch(block, addr);
         }
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
@@ -2498,14 +4740,20 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 RAMBlock *block;
                 char id[256];
                 ram_addr_t length;
+                bool ignored;
 
                 len = qemu_get_byte(f);
                 qemu_get_buffer(f, (uint8_t *)id, len);
                 id[len] = 0;
                 length = qemu_get_be64(f);
+                ignored = migrate_ignore_shared() && qemu_get_byte(f);
 
                 block = qemu_ram_block_by_name(id);
-                if (block) {
+                if (block && ignored && block->fd < 0) {
+                    error_report("RAM block \"%s\" is not sent by the source "
+                                 "and must be backed by the same file", id);
+                    ret = -EINVAL;
+                } else if (block) {
                     if (length != block->used_length) {
                         Error *local_err = NULL;
 
@@ -2529,16 +4777,24 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS:
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (ch || !untouched) {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            }
             break;
 
         case RAM_SAVE_FLAG_PAGE:
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (load_param) {
+                load_page_with_multi_threads(f, block, host);
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            /* compbuf was sized for the method the threads were set up with */
+            if (len < 0 ||
+                len > page_codec_bound(decomp_param[0].codec.method)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2554,6 +4810,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2572,6 +4831,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     wait_for_decompress_done();
+    wait_for_load_done();
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -52,6 +52,7 @@
 #include "block/snapshot.h"
 #include "block/qapi.h"
 #include "qemu/cutils.h"
+#include "qemu/rcu.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 
@@ -79,6 +80,8 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
                                    .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -846,6 +849,26 @@ void qemu_savevm_send_postcopy_run(QEMUFile *f)
     qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
 }
 
+/* Ask the destination for the received bitmap of a RAMBlock */
+void qemu_savevm_send_recv_bitmap(QEMUFile *f, const char *block_name)
+{
+    size_t len = strlen(block_name);
+    uint8_t buf[256];
+
+    trace_savevm_send_recv_bitmap(block_name);
+    assert(len < 256);
+    buf[0] = len;
+    memcpy(buf + 1, block_name, len);
+    qemu_savevm_command_send(f, MIG_CMD_RECV_BITMAP, len + 1, buf);
+}
+
+/* Tell the destination that a recovered postcopy carries on */
+void qemu_savevm_send_postcopy_resume(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_resume();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RESUME, 0, NULL);
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -1014,11 +1037,156 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * With device-state-threads, the sections of the devices whose
+ * VMStateDescription has thread_safe_save are serialized into per-section
+ * buffers by a few
+ * threads while the migration thread (holding the iothread lock, with
+ * the guest stopped) copies them to the stream in their usual order.
+ * The stream itself is the same as without it.
+ */
+typedef struct DeviceStateJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    QJSON *vmdesc;
+    QemuEvent done;
+} DeviceStateJob;
+
+typedef struct DeviceStateSave {
+    DeviceStateJob *jobs;
+    int njobs;
+    int next;
+    int nthreads;
+    QemuThread *threads;
+} DeviceStateSave;
+
+static void *device_state_save_thread(void *opaque)
+{
+    DeviceStateSave *ds = opaque;
+    int i;
+
+    rcu_register_thread();
+    while ((i = atomic_fetch_inc(&ds->next)) < ds->njobs) {
+        DeviceStateJob *job = &ds->jobs[i];
+        SaveStateEntry *se = job->se;
+
+        job->vmdesc = qjson_new();
+        json_prop_str(job->vmdesc, "name", se->idstr);
+        json_prop_int(job->vmdesc, "instance_id", se->instance_id);
+
+        save_section_header(job->fb, se, QEMU_VM_SECTION_FULL);
+        vmstate_save(job->fb, se, job->vmdesc);
+        save_section_footer(job->fb, se);
+        qemu_fflush(job->fb);
+        qjson_finish(job->vmdesc);
+
+        qemu_event_set(&job->done);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static bool device_state_save_needed(SaveStateEntry *se)
+{
+    if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+        return false;
+    }
+    if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Start serializing the devices in parallel; returns NULL when there is
+ * nothing worth splitting up.
+ */
+static DeviceStateSave *device_state_save_start(void)
+{
+    DeviceStateSave *ds;
+    SaveStateEntry *se;
+    int nthreads = migrate_device_state_threads();
+    int i;
+
+    if (!nthreads) {
+        return NULL;
+    }
+
+    ds = g_new0(DeviceStateSave, 1);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        /* Everything else stays on the migration thread */
+        if (!se->vmsd || !se->vmsd->thread_safe_save ||
+            !device_state_save_needed(se)) {
+            continue;
+        }
+        ds->jobs = g_renew(DeviceStateJob, ds->jobs, ds->njobs + 1);
+        ds->jobs[ds->njobs++].se = se;
+    }
+    if (ds->njobs < 2) {
+        g_free(ds->jobs);
+        g_free(ds);
+        return NULL;
+    }
+
+    for (i = 0; i < ds->njobs; i++) {
+        DeviceStateJob *job = &ds->jobs[i];
+
+        job->bioc = qio_channel_buffer_new(4096);
+        job->fb = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+        object_unref(OBJECT(job->bioc));
+        job->vmdesc = NULL;
+        qemu_event_init(&job->done, false);
+    }
+
+    ds->nthreads = MIN(nthreads, ds->njobs);
+    ds->threads = g_new0(QemuThread, ds->nthreads);
+    trace_savevm_device_state_save_start(ds->njobs, ds->nthreads);
+    for (i = 0; i < ds->nthreads; i++) {
+        qemu_thread_create(&ds->threads[i], "savevm/devstate",
+                           device_state_save_thread, ds,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return ds;
+}
+
+/* Copy the section of @job to @f once its thread is done with it */
+static void device_state_save_put(QEMUFile *f, DeviceStateJob *job,
+                                  QJSON *vmdesc)
+{
+    qemu_event_wait(&job->done);
+    trace_savevm_section_start(job->se->idstr, job->se->section_id);
+    qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+    json_prop_qjson(vmdesc, NULL, job->vmdesc);
+    trace_savevm_section_end(job->se->idstr, job->se->section_id, 0);
+}
+
+static void device_state_save_finish(DeviceStateSave *ds)
+{
+    int i;
+
+    for (i = 0; i < ds->nthreads; i++) {
+        qemu_thread_join(&ds->threads[i]);
+    }
+    for (i = 0; i < ds->njobs; i++) {
+        qemu_fclose(ds->jobs[i].fb);
+        qjson_destroy(ds->jobs[i].vmdesc);
+        qemu_event_destroy(&ds->jobs[i].done);
+    }
+    g_free(ds->threads);
+    g_free(ds->jobs);
+    g_free(ds);
+}
+
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 {
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    DeviceStateSave *ds;
+    int job = 0;
     int ret;
     bool in_postcopy = migration_in_postcopy(migrate_get_current());
 
@@ -1056,11 +1224,17 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         return;
     }
 
+    ds = device_state_save_start();
+
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
+        if (ds && job < ds->njobs && ds->jobs[job].se == se) {
+            device_state_save_put(f, &ds->jobs[job++], vmdesc);
+            continue;
+        }
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
@@ -1082,6 +1256,9 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 
         json_end_object(vmdesc);
     }
+    if (ds) {
+        device_state_save_finish(ds);
+    }
 
     if (!in_postcopy) {
         /* Postcopy stream will still be going */
@@ -1390,6 +1567,64 @@ static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
  * (TODO:This could do with being in a postcopy file - but there again it's
  * just another input loop, not that postcopy specific)
  */
+static int postcopy_ram_listen_load(QEMUFile *f, MigrationIncomingState *mis)
+{
+    int ret;
+
+    /*
+     * Because we're a thread and not a coroutine we can't yield
+     * in qemu_file, and thus we must be blocking now.
+     */
+    qemu_file_set_blocking(f, true);
+    ret = qemu_loadvm_state_main(f, mis);
+    if (ret >= 0 && qemu_file_get_error(f)) {
+        /* A lost connection reads as QEMU_VM_EOF */
+        ret = qemu_file_get_error(f);
+    }
+    return ret;
+}
+
+/*
+ * The connection to the source broke during postcopy; neither side has
+ * the whole guest any more, so wait for migrate-recover to bring a new
+ * one instead of failing.  Returns false if postcopy can't be paused.
+ */
+static bool postcopy_pause_incoming(MigrationIncomingState *mis)
+{
+    int state = mis->state;
+
+    if (state != MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+        state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+        return false;
+    }
+    trace_postcopy_pause_incoming();
+    migrate_set_state(&mis->state, state, MIGRATION_STATUS_POSTCOPY_PAUSED);
+
+    /* Don't let the fault thread block on the broken return path */
+    qemu_file_shutdown(mis->from_src_file);
+    if (mis->to_src_file) {
+        qemu_file_shutdown(mis->to_src_file);
+    }
+    postcopy_preempt_incoming_stop(mis);
+
+    qemu_mutex_lock(&mis->rp_mutex);
+    if (mis->to_src_file) {
+        qemu_fclose(mis->to_src_file);
+        mis->to_src_file = NULL;
+    }
+    qemu_mutex_unlock(&mis->rp_mutex);
+    qemu_fclose(mis->from_src_file);
+    mis->from_src_file = NULL;
+
+    error_report("Postcopy migration paused, waiting for migrate-recover");
+    while (mis->state == MIGRATION_STATUS_POSTCOPY_PAUSED) {
+        qemu_sem_wait(&mis->postcopy_pause_sem_dst);
+    }
+    trace_postcopy_pause_incoming_continued();
+
+    return true;
+}
+
 static void *postcopy_ram_listen_thread(void *opaque)
 {
     QEMUFile *f = opaque;
@@ -1401,12 +1636,11 @@ static void *postcopy_ram_listen_thread(void *opaque)
     qemu_sem_post(&mis->listen_thread_sem);
     trace_postcopy_ram_listen_thread_start();
 
-    /*
-     * Because we're a thread and not a coroutine we can't yield
-     * in qemu_file, and thus we must be blocking now.
-     */
-    qemu_file_set_blocking(f, true);
-    load_res = qemu_loadvm_state_main(f, mis);
+    load_res = postcopy_ram_listen_load(f, mis);
+    while (load_res < 0 && postcopy_pause_incoming(mis)) {
+        f = mis->from_src_file;
+        load_res = postcopy_ram_listen_load(f, mis);
+    }
     /* And non-blocking again so we don't block in any cleanup */
     qemu_file_set_blocking(f, false);
 
@@ -1490,6 +1724,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
     qemu_sem_wait(&mis->listen_thread_sem);
     qemu_sem_destroy(&mis->listen_thread_sem);
 
+    postcopy_preempt_incoming_start(mis);
+
     return 0;
 }
 
@@ -1557,6 +1793,47 @@ static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
     return LOADVM_QUIT;
 }
 
+/* The source wants the received bitmap of a block to resume postcopy */
+static int loadvm_handle_recv_bitmap(MigrationIncomingState *mis,
+                                     uint16_t len)
+{
+    char block_name[256];
+    size_t cnt;
+
+    if (mis->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+        error_report("CMD_RECV_BITMAP while postcopy is not recovering");
+        return -EINVAL;
+    }
+
+    cnt = qemu_get_counted_string(mis->from_src_file, block_name);
+    if (!cnt || len != cnt + 1) {
+        error_report("CMD_RECV_BITMAP with bad block name (len %d)", len);
+        return -EINVAL;
+    }
+
+    trace_loadvm_handle_recv_bitmap(block_name);
+    migrate_send_rp_recv_bitmap(mis, block_name);
+    return 0;
+}
+
+/* The source has reloaded our bitmaps; postcopy carries on */
+static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
+{
+    trace_loadvm_postcopy_handle_resume();
+    if (mis->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
+        error_report("CMD_POSTCOPY_RESUME while postcopy is not recovering");
+        return -EINVAL;
+    }
+
+    migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_RECOVER,
+                      MIGRATION_STATUS_POSTCOPY_ACTIVE);
+    migrate_send_rp_resume_ack(mis, 1);
+    /* Requests sent before the connection broke may have been lost */
+    postcopy_resend_page_requests(mis);
+
+    return 0;
+}
+
 /**
  * Immediately following this command is a blob of data containing an embedded
  * chunk of migration stream; read it and load it.
@@ -1672,6 +1949,12 @@ static int loadvm_process_command(QEMUFile *f)
 
     case MIG_CMD_POSTCOPY_RAM_DISCARD:
         return loadvm_postcopy_ram_handle_discard(mis, len);
+
+    case MIG_CMD_RECV_BITMAP:
+        return loadvm_handle_recv_bitmap(mis, len);
+
+    case MIG_CMD_POSTCOPY_RESUME:
+        return loadvm_postcopy_handle_resume(mis);
     }
 
     return 0;
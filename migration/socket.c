@@ -55,6 +55,30 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the last outgoing migration, used to open multifd channels */
+static SocketAddress *outgoing_saddr;
+
+int socket_send_channel_create(QIOTaskFunc f, void *data, Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "extra migration channels need a tcp: or unix: URI");
+        return -1;
+    }
+
+    sioc = qio_channel_socket_new();
+    qio_channel_socket_connect_async(sioc, outgoing_saddr, f, data, NULL);
+    return 0;
+}
+
+void socket_send_channel_cleanup(void)
+{
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = NULL;
+}
+
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -105,7 +129,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -147,6 +172,10 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
     object_unref(OBJECT(sioc));
 
 out:
+    if (!migration_has_all_channels()) {
+        /* Keep listening for the multifd channels */
+        return TRUE;
+    }
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
     return FALSE; /* unregister */
@@ -1003,6 +1003,8 @@ static void qmp_init_marshal(void)
                          QCO_NO_OPTIONS);
     qmp_register_command("device_add", qmp_device_add,
                          QCO_NO_OPTIONS);
+    qmp_register_command("device-add-batch", qmp_device_add_batch,
+                         QCO_NO_OPTIONS);
     qmp_register_command("netdev_add", qmp_netdev_add,
                          QCO_NO_OPTIONS);
 
@@ -1060,6 +1062,58 @@ static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
     dump_opcount_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    if (!tcg_enabled()) {
+        monitor_printf(mon, "TB profiling requires TCG\n");
+        return;
+    }
+    tb_profile_set(mon_get_cpu(), qdict_get_bool(qdict, "state"));
+}
+
+static int tb_profile_disas_flags(const TBProfileEntry *e)
+{
+#ifdef TARGET_I386
+    if (e->flags & HF_CS64_MASK) {
+        return 2;
+    }
+    if (!(e->flags & HF_CS32_MASK)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    int max = qdict_get_try_int(qdict, "count", 10);
+    bool disas = qdict_get_try_bool(qdict, "disas", false);
+    TBProfileEntry *entries;
+    uint64_t total;
+    size_t i, n;
+
+    if (!tb_profile_enabled) {
+        monitor_printf(mon, "TB profiling is off, use 'tb-profile on'\n");
+    }
+    n = tb_profile_snapshot(&entries, &total);
+    monitor_printf(mon, "%zu profiled TBs, %" PRIu64
+                   " guest instructions\n", n, total);
+    for (i = 0; i < n && i < max; i++) {
+        TBProfileEntry *e = &entries[i];
+        uint64_t insns = e->exec_count * e->icount;
+
+        monitor_printf(mon, "%3zu: pc " TARGET_FMT_lx " flags %08x"
+                       " insns %-4u execs %-12" PRIu64 " %5.1f%%\n",
+                       i, e->pc, e->flags, e->icount, e->exec_count,
+                       total ? insns * 100.0 / total : 0.0);
+        if (disas) {
+            monitor_disas(mon, mon_get_cpu(), e->pc, e->icount, 0,
+                          tb_profile_disas_flags(e));
+        }
+    }
+    g_free(entries);
+}
+
 static void hmp_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
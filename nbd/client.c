@@ -20,7 +20,7 @@
 #include "qapi/error.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -408,10 +408,213 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 }
 
 
-int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
+/* Send option @opt with @len bytes of @data */
+static int nbd_send_option_request(QIOChannel *ioc, uint32_t opt,
+                                   uint32_t len, const void *data,
+                                   Error **errp)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    stq_be_p(buf, NBD_OPTS_MAGIC);
+    stl_be_p(buf + 8, opt);
+    stl_be_p(buf + 12, len);
+
+    if (write_sync(ioc, buf, sizeof(buf)) != sizeof(buf)) {
+        error_setg(errp, "Failed to send option %" PRIx32, opt);
+        return -1;
+    }
+    if (len && write_sync(ioc, (void *)data, len) != len) {
+        error_setg(errp, "Failed to send data for option %" PRIx32, opt);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the magic, option and type fields of the server's reply to @opt;
+ * the length field is left for nbd_handle_reply_err() or the caller */
+static int nbd_receive_option_reply_type(QIOChannel *ioc, uint32_t opt,
+                                         uint32_t *type, Error **errp)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    if (read_sync(ioc, buf, sizeof(buf)) != sizeof(buf)) {
+        error_setg(errp, "Failed to read reply to option %" PRIx32, opt);
+        return -1;
+    }
+    if (ldq_be_p(buf) != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option reply magic");
+        return -1;
+    }
+    if (ldl_be_p(buf + 8) != opt) {
+        error_setg(errp, "Unexpected option type %" PRIx32 " expected %x",
+                   ldl_be_p(buf + 8), opt);
+        return -1;
+    }
+    *type = ldl_be_p(buf + 12);
+    return 0;
+}
+
+/* Send an option without data that the server acknowledges with
+ * NBD_REP_ACK.  Return 1 if the server supports it, 0 if it does not,
+ * -1 with errp set on error.
+ */
+static int nbd_request_simple_option(QIOChannel *ioc, uint32_t opt,
+                                     Error **errp)
+{
+    uint32_t type, len;
+    int error;
+
+    if (nbd_send_option_request(ioc, opt, 0, NULL, errp) < 0 ||
+        nbd_receive_option_reply_type(ioc, opt, &type, errp) < 0) {
+        return -1;
+    }
+    error = nbd_handle_reply_err(ioc, opt, type, errp);
+    if (error <= 0) {
+        return error;
+    }
+
+    if (read_sync(ioc, &len, sizeof(len)) != sizeof(len)) {
+        error_setg(errp, "failed to read option length");
+        return -1;
+    }
+    if (type != NBD_REP_ACK || be32_to_cpu(len) != 0) {
+        error_setg(errp, "Unexpected reply %" PRIx32 " to option %" PRIx32,
+                   type, opt);
+        return -1;
+    }
+    return 1;
+}
+
+/* Ask for the "base:allocation" meta context of export @export.  Return 1
+ * and set @context_id if the server provides it, 0 if it does not, -1 with
+ * errp set on error.
+ */
+static int nbd_negotiate_base_allocation(QIOChannel *ioc, const char *export,
+                                         uint32_t *context_id, Error **errp)
+{
+    const char *context = NBD_META_BASE_ALLOCATION;
+    uint32_t export_len = strlen(export);
+    uint32_t context_len = strlen(context);
+    uint32_t data_len = 4 + export_len + 4 + 4 + context_len;
+    uint8_t *data = g_malloc(data_len);
+    uint8_t *p = data;
+    bool found = false;
+    int ret = -1;
+
+    /* [ 0 ..  3]  export name length
+     * ...         export name
+     *             number of queries (1)
+     *             query length
+     * ...         query
+     */
+    stl_be_p(p, export_len);
+    p += 4;
+    memcpy(p, export, export_len);
+    p += export_len;
+    stl_be_p(p, 1);
+    p += 4;
+    stl_be_p(p, context_len);
+    p += 4;
+    memcpy(p, context, context_len);
+
+    if (nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, data_len,
+                                data, errp) < 0) {
+        goto out;
+    }
+
+    while (1) {
+        uint32_t type, len, id;
+        char name[sizeof(NBD_META_BASE_ALLOCATION)];
+
+        if (nbd_receive_option_reply_type(ioc, NBD_OPT_SET_META_CONTEXT,
+                                          &type, errp) < 0) {
+            goto out;
+        }
+        ret = nbd_handle_reply_err(ioc, NBD_OPT_SET_META_CONTEXT, type, errp);
+        if (ret <= 0) {
+            goto out;
+        }
+        ret = -1;
+
+        if (read_sync(ioc, &len, sizeof(len)) != sizeof(len)) {
+            error_setg(errp, "failed to read option length");
+            goto out;
+        }
+        len = be32_to_cpu(len);
+
+        if (type == NBD_REP_ACK) {
+            if (len != 0) {
+                error_setg(errp, "length too long for option end");
+                goto out;
+            }
+            break;
+        }
+        if (type != NBD_REP_META_CONTEXT ||
+            len != sizeof(id) + context_len) {
+            /* We asked for a single context, so this is all we expect */
+            error_setg(errp, "Unexpected meta context reply %" PRIx32, type);
+            goto out;
+        }
+
+        if (read_sync(ioc, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(ioc, name, context_len) != context_len) {
+            error_setg(errp, "failed to read meta context reply");
+            goto out;
+        }
+        name[context_len] = '\0';
+        if (strcmp(name, context) != 0) {
+            error_setg(errp, "Unexpected meta context '%s'", name);
+            goto out;
+        }
+        *context_id = be32_to_cpu(id);
+        found = true;
+    }
+
+    ret = found;
+
+out:
+    g_free(data);
+    return ret;
+}
+
+/* Negotiate structured replies and the base:allocation meta context, as far
+ * as requested in @info and supported by the server */
+static int nbd_negotiate_structured_reply(QIOChannel *ioc, const char *name,
+                                          NBDExportInfo *info, Error **errp)
+{
+    int ret;
+
+    if (!info->structured_reply) {
+        info->base_allocation = false;
+        return 0;
+    }
+
+    ret = nbd_request_simple_option(ioc, NBD_OPT_STRUCTURED_REPLY, errp);
+    if (ret < 0) {
+        return -1;
+    }
+    info->structured_reply = ret;
+
+    if (!info->structured_reply || !info->base_allocation) {
+        info->base_allocation = false;
+        return 0;
+    }
+
+    ret = nbd_negotiate_base_allocation(ioc, name,
+                                        &info->meta_base_allocation_id, errp);
+    if (ret < 0) {
+        return -1;
+    }
+    info->base_allocation = ret;
+    TRACE("Structured replies enabled, base:allocation %s",
+          info->base_allocation ? "enabled" : "not supported");
+    return 0;
+}
+
+int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          NBDExportInfo *info, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
@@ -515,6 +718,12 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+            if (nbd_negotiate_structured_reply(ioc, name, info, errp) < 0) {
+                goto fail;
+            }
+        } else {
+            info->structured_reply = false;
+            info->base_allocation = false;
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -542,13 +751,14 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             error_setg(errp, "Failed to read export length");
             goto fail;
         }
-        *size = be64_to_cpu(s);
+        info->size = be64_to_cpu(s);
 
-        if (read_sync(ioc, flags, sizeof(*flags)) != sizeof(*flags)) {
+        if (read_sync(ioc, &info->flags, sizeof(info->flags)) !=
+            sizeof(info->flags)) {
             error_setg(errp, "Failed to read export flags");
             goto fail;
         }
-        be16_to_cpus(flags);
+        be16_to_cpus(&info->flags);
     } else if (magic == NBD_CLIENT_MAGIC) {
         uint32_t oldflags;
 
@@ -565,8 +775,8 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             error_setg(errp, "Failed to read export length");
             goto fail;
         }
-        *size = be64_to_cpu(s);
-        TRACE("Size is %" PRIu64, *size);
+        info->size = be64_to_cpu(s);
+        TRACE("Size is %" PRIu64, info->size);
 
         if (read_sync(ioc, &oldflags, sizeof(oldflags)) != sizeof(oldflags)) {
             error_setg(errp, "Failed to read export flags");
@@ -577,13 +787,16 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             error_setg(errp, "Unexpected export flags %0x" PRIx32, oldflags);
             goto fail;
         }
-        *flags = oldflags;
+        info->flags = oldflags;
+        info->structured_reply = false;
+        info->base_allocation = false;
     } else {
         error_setg(errp, "Bad magic received");
         goto fail;
     }
 
-    TRACE("Size is %" PRIu64 ", export flags %" PRIx16, *size, *flags);
+    TRACE("Size is %" PRIu64 ", export flags %" PRIx16, info->size,
+          info->flags);
     if (read_sync(ioc, &buf, 124) != 124) {
         error_setg(errp, "Failed to read reserved block");
         goto fail;
@@ -736,40 +949,71 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    /* Both kinds of replies start with at least NBD_REPLY_SIZE bytes */
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
-    /* Reply
-       [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
-       [ 4 ..  7]    error   (0 == no error)
-       [ 7 .. 15]    handle
-     */
-
     magic = ldl_be_p(buf);
-    reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
-    reply->error = nbd_errno_to_system_errno(reply->error);
-
-    TRACE("Got reply: { magic = 0x%" PRIx32 ", .error = % " PRId32
-          ", handle = %" PRIu64" }",
-          magic, reply->error, reply->handle);
-
-    if (magic != NBD_REPLY_MAGIC) {
+    if (magic == NBD_REPLY_MAGIC) {
+        /* Reply
+           [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
+           [ 4 ..  7]    error   (0 == no error)
+           [ 7 .. 15]    handle
+         */
+        reply->error = nbd_errno_to_system_errno(ldl_be_p(buf + 4));
+        reply->structured = false;
+        reply->flags = NBD_REPLY_FLAG_DONE;
+        reply->type = NBD_REPLY_TYPE_NONE;
+        reply->length = 0;
+
+        TRACE("Got reply: { magic = 0x%" PRIx32 ", .error = % " PRId32
+              ", handle = %" PRIu64" }",
+              magic, reply->error, reply->handle);
+    } else if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload that follows
+         */
+        do {
+            /* The header has started to arrive, wait for the rest */
+            ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+            if (ret == -EAGAIN) {
+                qio_channel_wait(ioc, G_IO_IN);
+            }
+        } while (ret == -EAGAIN);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        reply->error = 0;
+        reply->structured = true;
+        reply->flags = lduw_be_p(buf + 4);
+        reply->type = lduw_be_p(buf + 6);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got reply chunk: { .flags = %" PRIx16 ", .type = %" PRIu16
+              ", handle = %" PRIu64 ", length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+    } else {
         LOG("invalid magic (got 0x%" PRIx32 ")", magic);
         return -EINVAL;
     }
     return 0;
 }
-
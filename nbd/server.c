@@ -52,9 +52,16 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    bool data_pooled; /* data belongs to the export's buffer pool */
     bool complete;
 };
 
+/* Requests of up to NBD_POOL_BUFFER_SIZE bytes use buffers that are kept
+ * around by the export instead of being allocated for every request.  At
+ * most MAX_NBD_POOL_BUFFERS idle buffers are kept.  */
+#define NBD_POOL_BUFFER_SIZE (1024 * 1024)
+#define MAX_NBD_POOL_BUFFERS 16
+
 struct NBDExport {
     int refcount;
     void (*close)(NBDExport *exp);
@@ -71,6 +78,10 @@ struct NBDExport {
 
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
+
+    /* Idle request buffers, shared by all clients of the export */
+    void *buffer_pool[MAX_NBD_POOL_BUFFERS];
+    int nb_pool_buffers;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -95,6 +106,10 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    bool structured_reply;
+    bool meta_base_allocation; /* base:allocation selected for ... */
+    char *meta_export_name;    /* ... this export */
 };
 
 /* That's all folks */
@@ -193,12 +208,14 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+/* Send the header of an option reply; @len bytes of reply data must follow */
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
-    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32, type, opt);
+    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32 " len=%" PRIu32,
+          opt, type, len);
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (nbd_negotiate_write(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -215,7 +232,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -223,6 +240,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -311,6 +333,12 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length)
         goto fail;
     }
 
+    if (client->meta_base_allocation &&
+        strcmp(name, client->meta_export_name)) {
+        /* The meta context was selected for a different export */
+        client->meta_base_allocation = false;
+    }
+
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
     nbd_export_get(client->exp);
     rc = 0;
@@ -318,6 +346,132 @@ fail:
     return rc;
 }
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    TRACE("Using structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+/* Upper bound for the data of NBD_OPT_SET_META_CONTEXT: the export name
+ * and a handful of queries */
+#define NBD_MAX_META_CONTEXT_SIZE 65536
+
+static int nbd_negotiate_handle_set_meta_context(NBDClient *client,
+                                                 uint32_t length)
+{
+    const uint32_t opt = NBD_OPT_SET_META_CONTEXT;
+    uint8_t *buf, *p, *end;
+    uint32_t name_len, nb_queries, query_len, i;
+    const size_t ctx_len = strlen(NBD_META_BASE_ALLOCATION);
+    bool base_allocation = false;
+    char *name = NULL;
+    uint32_t id;
+    int ret;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx ..  xx]   number of queries
+        ...           queries (each one a length followed by the string)
+     */
+    if (!client->structured_reply || length > NBD_MAX_META_CONTEXT_SIZE) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+    }
+
+    buf = g_malloc(length);
+    if (nbd_negotiate_read(client->ioc, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+    p = buf;
+    end = buf + length;
+
+    if (end - p < 4) {
+        goto invalid;
+    }
+    name_len = ldl_be_p(p);
+    if (name_len > NBD_MAX_NAME_SIZE || end - p - 4 < name_len + 4) {
+        goto invalid;
+    }
+    name = g_strndup((char *)p + 4, name_len);
+    p += 4 + name_len;
+    nb_queries = ldl_be_p(p);
+    p += 4;
+
+    for (i = 0; i < nb_queries; i++) {
+        if (end - p < 4) {
+            goto invalid;
+        }
+        query_len = ldl_be_p(p);
+        p += 4;
+        if (end - p < query_len) {
+            goto invalid;
+        }
+        if (query_len == ctx_len &&
+            !memcmp(p, NBD_META_BASE_ALLOCATION, ctx_len)) {
+            base_allocation = true;
+        }
+        p += query_len;
+    }
+    if (p != end) {
+        goto invalid;
+    }
+    g_free(buf);
+
+    if (!nbd_export_find(name)) {
+        TRACE("Meta context requested for unknown export '%s'", name);
+        g_free(name);
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_UNKNOWN, opt);
+    }
+
+    /* Each request replaces the previous selection */
+    client->meta_base_allocation = base_allocation;
+    g_free(client->meta_export_name);
+    client->meta_export_name = name;
+
+    if (base_allocation) {
+        /* Reply data
+            [ 0 ..   3]   context id (always 0, we only have one)
+            [ 4 ..  xx]   context name
+         */
+        TRACE("Selected meta context " NBD_META_BASE_ALLOCATION);
+        ret = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT,
+                                         opt, sizeof(id) + ctx_len);
+        if (ret < 0) {
+            return ret;
+        }
+        id = cpu_to_be32(0);
+        if (nbd_negotiate_write(client->ioc, &id, sizeof(id)) != sizeof(id) ||
+            nbd_negotiate_write(client->ioc, (char *)NBD_META_BASE_ALLOCATION,
+                                ctx_len) != ctx_len) {
+            LOG("write failed (meta context)");
+            return -EINVAL;
+        }
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    LOG("Malformed meta context request");
+    g_free(name);
+    g_free(buf);
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+}
+
 
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
                                                  uint32_t length)
@@ -487,6 +641,20 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_set_meta_context(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_STARTTLS:
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
                     return -EIO;
@@ -546,7 +714,8 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     char buf[8 + 8 + 8 + 128];
     int rc;
     const uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                              NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                              NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                              NBD_FLAG_SEND_WRITE_ZEROES);
     bool oldStyle;
 
     /* Old style negotiation header without options
@@ -664,9 +833,16 @@ static ssize_t nbd_receive_request(QIOChannel *ioc, struct nbd_request *request)
     return 0;
 }
 
-static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
+/* Send a simple reply, followed by @len bytes of @data.  Header and data
+ * go out together in a single vectored write.  */
+static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply,
+                              void *data, size_t len)
 {
     uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = data, .iov_len = len },
+    };
     ssize_t ret;
 
     reply->error = system_errno_to_nbd_errno(reply->error);
@@ -684,12 +860,12 @@ static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
     stl_be_p(buf + 4, reply->error);
     stq_be_p(buf + 8, reply->handle);
 
-    ret = write_sync(ioc, buf, sizeof(buf));
+    ret = nbd_wr_syncv(ioc, iov, len ? 2 : 1, sizeof(buf) + len, false);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != sizeof(buf) + len) {
         LOG("writing to socket failed");
         return -EINVAL;
     }
@@ -718,6 +894,7 @@ void nbd_client_put(NBDClient *client)
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsaclname);
+        g_free(client->meta_export_name);
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             nbd_export_put(client->exp);
@@ -760,12 +937,36 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     return req;
 }
 
+/* Allocate the data buffer of @req, taking it from the export's pool if
+ * @len is small enough */
+static int nbd_request_alloc_data(NBDRequest *req, uint32_t len)
+{
+    NBDExport *exp = req->client->exp;
+
+    if (len > NBD_POOL_BUFFER_SIZE) {
+        req->data = blk_try_blockalign(exp->blk, len);
+    } else if (exp->nb_pool_buffers > 0) {
+        req->data = exp->buffer_pool[--exp->nb_pool_buffers];
+        req->data_pooled = true;
+    } else {
+        req->data = blk_try_blockalign(exp->blk, NBD_POOL_BUFFER_SIZE);
+        req->data_pooled = true;
+    }
+
+    return req->data ? 0 : -ENOMEM;
+}
+
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
 
     if (req->data) {
-        qemu_vfree(req->data);
+        if (req->data_pooled && exp->nb_pool_buffers < MAX_NBD_POOL_BUFFERS) {
+            exp->buffer_pool[exp->nb_pool_buffers++] = req->data;
+        } else {
+            qemu_vfree(req->data);
+        }
     }
     g_free(req);
 
@@ -936,6 +1137,9 @@ void nbd_export_put(NBDExport *exp)
             exp->blk = NULL;
         }
 
+        while (exp->nb_pool_buffers > 0) {
+            qemu_vfree(exp->buffer_pool[--exp->nb_pool_buffers]);
+        }
         g_free(exp);
     }
 }
@@ -958,25 +1162,72 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
     NBDClient *client = req->client;
-    ssize_t rc, ret;
+    ssize_t rc;
 
     g_assert(qemu_in_coroutine());
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
     nbd_set_handlers(client);
 
-    if (!len) {
-        rc = nbd_send_reply(client->ioc, reply);
-    } else {
-        qio_channel_set_cork(client->ioc, true);
-        rc = nbd_send_reply(client->ioc, reply);
-        if (rc >= 0) {
-            ret = write_sync(client->ioc, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        qio_channel_set_cork(client->ioc, false);
+    rc = nbd_send_reply(client->ioc, reply, req->data, len);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+/* Send one structured reply chunk, whose payload is @head_len bytes from
+ * @head followed by @data_len bytes from @data.  */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *head, size_t head_len,
+                                 void *data, size_t data_len)
+{
+    NBDClient *client = req->client;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov[3] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+    };
+    size_t niov = 1;
+    ssize_t rc = 0;
+
+    TRACE("Sending chunk to client: { .flags = %" PRIx16 ", .type = %" PRIu16
+          ", handle = %" PRIu64 ", length = %zu }",
+          flags, type, handle, head_len + data_len);
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, head_len + data_len);
+
+    if (head_len) {
+        iov[niov].iov_base = head;
+        iov[niov++].iov_len = head_len;
+    }
+    if (data_len) {
+        iov[niov].iov_base = data;
+        iov[niov++].iov_len = data_len;
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    if (nbd_wr_syncv(client->ioc, iov, niov,
+                     sizeof(buf) + head_len + data_len, false) !=
+        sizeof(buf) + head_len + data_len) {
+        LOG("writing to socket failed");
+        rc = -EIO;
     }
 
     client->send_coroutine = NULL;
@@ -985,6 +1236,167 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Finish a structured reply with an error chunk for @error */
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       int error)
+{
+    uint8_t buf[4 + 2];
+
+    /* [ 0 ..  3]    error
+       [ 4 ..  5]    message length (we send no message)
+     */
+    stl_be_p(buf, system_errno_to_nbd_errno(error));
+    stw_be_p(buf + 4, 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, buf, sizeof(buf), NULL, 0);
+}
+
+/* Serve NBD_CMD_READ with structured replies.  Ranges that the block layer
+ * reports as reading as zeroes are sent as holes instead of data.  Errors
+ * are reported to the client; a negative return value means that the
+ * connection must be dropped.  */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t offset = request->from + exp->dev_offset;
+    uint32_t done = 0;
+    uint8_t buf[8 + 4];
+    ssize_t ret;
+
+    while (done < request->len) {
+        BlockDriverState *file;
+        uint32_t len = request->len - done;
+        int64_t status = 0;
+        uint16_t flags;
+        int pnum;
+
+        if (bs && QEMU_IS_ALIGNED(offset + done, BDRV_SECTOR_SIZE) &&
+            QEMU_IS_ALIGNED(len, BDRV_SECTOR_SIZE)) {
+            status = bdrv_get_block_status_above(bs, NULL,
+                                                 (offset + done) >>
+                                                 BDRV_SECTOR_BITS,
+                                                 len >> BDRV_SECTOR_BITS,
+                                                 &pnum, &file);
+            if (status < 0 || pnum <= 0) {
+                /* Just read the data, the read reports any real error */
+                status = 0;
+            } else {
+                len = MIN(len, (uint32_t)pnum << BDRV_SECTOR_BITS);
+            }
+        }
+        flags = done + len == request->len ? NBD_REPLY_FLAG_DONE : 0;
+
+        /* [ 0 ..  7]    offset
+           [ 8 .. 11]    hole size (NBD_REPLY_TYPE_OFFSET_HOLE only)
+         */
+        stq_be_p(buf, request->from + done);
+        if (status & BDRV_BLOCK_ZERO) {
+            stl_be_p(buf + 8, len);
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    buf, sizeof(buf), NULL, 0);
+        } else {
+            ret = blk_pread(exp->blk, offset + done, req->data + done, len);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(req, request->handle, -ret);
+            }
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    buf, 8, req->data + done, len);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        done += len;
+    }
+
+    TRACE("Read %" PRIu32" byte(s)", request->len);
+    return 0;
+}
+
+/* Maximum number of descriptors in a NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 256
+
+/* Serve NBD_CMD_BLOCK_STATUS for the base:allocation context.  As for
+ * nbd_co_send_sparse_read(), a negative return value means that the
+ * connection must be dropped.  */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t offset = request->from + exp->dev_offset;
+    unsigned int max_extents = request->type & NBD_CMD_FLAG_REQ_ONE ?
+                               1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    NBDExtent *extents = g_new(NBDExtent, max_extents);
+    unsigned int nb_extents = 0;
+    uint32_t done = 0;
+    uint8_t id[4];
+    ssize_t ret;
+    unsigned int i;
+
+    if (!bs || !QEMU_IS_ALIGNED(offset, BDRV_SECTOR_SIZE)) {
+        /* Block status is only known for whole sectors, so say nothing */
+        extents[0].length = request->len;
+        extents[0].flags = 0;
+        nb_extents = 1;
+        done = request->len;
+    }
+
+    while (done < request->len) {
+        BlockDriverState *file;
+        uint64_t sector_num = (offset + done) >> BDRV_SECTOR_BITS;
+        int nb_sectors = DIV_ROUND_UP(request->len - done, BDRV_SECTOR_SIZE);
+        int64_t status;
+        uint32_t len, flags;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                             &pnum, &file);
+        if (status < 0) {
+            g_free(extents);
+            return nbd_co_send_error_chunk(req, request->handle, -status);
+        }
+        if (pnum <= 0) {
+            /* Beyond the end of the image; treat the rest as data */
+            pnum = nb_sectors;
+            status = BDRV_BLOCK_ALLOCATED;
+        }
+        len = MIN((uint64_t)pnum << BDRV_SECTOR_BITS, request->len - done);
+        flags = (status & BDRV_BLOCK_ALLOCATED ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+
+        if (nb_extents && extents[nb_extents - 1].flags == flags) {
+            extents[nb_extents - 1].length += len;
+        } else if (nb_extents < max_extents) {
+            extents[nb_extents].length = len;
+            extents[nb_extents].flags = flags;
+            nb_extents++;
+        } else {
+            /* The client will ask again for the rest */
+            break;
+        }
+        done += len;
+    }
+
+    /* [ 0 ..  3]    context id
+       [ 4 ..  xx]   descriptors (length, flags)
+     */
+    stl_be_p(id, 0);
+    for (i = 0; i < nb_extents; i++) {
+        cpu_to_be32s(&extents[i].length);
+        cpu_to_be32s(&extents[i].flags);
+    }
+    ret = nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                            NBD_REPLY_TYPE_BLOCK_STATUS, id, sizeof(id),
+                            extents, nb_extents * sizeof(NBDExtent));
+    g_free(extents);
+    return ret;
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -1042,9 +1454,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
             goto out;
         }
 
-        req->data = blk_try_blockalign(client->exp->blk, request->len);
-        if (req->data == NULL) {
-            rc = -ENOMEM;
+        rc = nbd_request_alloc_data(req, request->len);
+        if (rc < 0) {
             goto out;
         }
     }
@@ -1060,14 +1471,23 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
     }
 
     /* Sanity checks, part 2. */
+    if (command == NBD_CMD_BLOCK_STATUS &&
+        (!client->meta_base_allocation || !request->len)) {
+        LOG("unexpected block status request");
+        rc = -EINVAL;
+        goto out;
+    }
     if (request->from + request->len > client->exp->size) {
         LOG("operation past EOF; From: %" PRIu64 ", Len: %" PRIu32
             ", Size: %" PRIu64, request->from, request->len,
             (uint64_t)client->exp->size);
-        rc = command == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
+        rc = command == NBD_CMD_WRITE || command == NBD_CMD_WRITE_ZEROES ?
+             -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->type & ~NBD_CMD_MASK_COMMAND & ~NBD_CMD_FLAG_FUA) {
+    if (request->type & ~NBD_CMD_MASK_COMMAND & ~NBD_CMD_FLAG_FUA &
+        ~(command == NBD_CMD_BLOCK_STATUS ? NBD_CMD_FLAG_REQ_ONE : 0) &
+        ~(command == NBD_CMD_WRITE_ZEROES ? NBD_CMD_FLAG_NO_HOLE : 0)) {
         LOG("unsupported flags (got 0x%x)",
             request->type & ~NBD_CMD_MASK_COMMAND);
         rc = -EINVAL;
@@ -1110,12 +1530,12 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (client->closing) {
         /*
@@ -1138,6 +1558,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1178,6 +1605,35 @@ static void nbd_trip(void *opaque)
         }
         break;
 
+    case NBD_CMD_WRITE_ZEROES:
+        TRACE("Request type is WRITE_ZEROES");
+
+        if (exp->nbdflags & NBD_FLAG_READ_ONLY) {
+            TRACE("Server is read-only, return error");
+            reply.error = EROFS;
+            goto error_reply;
+        }
+
+        flags = 0;
+        if (request.type & NBD_CMD_FLAG_FUA) {
+            flags |= BDRV_REQ_FUA;
+        }
+        if (!(request.type & NBD_CMD_FLAG_NO_HOLE)) {
+            flags |= BDRV_REQ_MAY_UNMAP;
+        }
+        ret = blk_co_pwrite_zeroes(exp->blk, request.from + exp->dev_offset,
+                                   request.len, flags);
+        if (ret < 0) {
+            LOG("writing to file failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
+
     case NBD_CMD_DISC:
         /* unreachable, thanks to special case in nbd_co_receive_request() */
         abort();
@@ -1206,14 +1662,28 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
     error_reply:
+        /* Replies to reads and block status requests must be structured
+         * if the client asked for it.  */
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_error_chunk(req, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
-        if (nbd_co_send_reply(req, &reply, 0) < 0 || !req->complete) {
+        if (ret < 0 || !req->complete) {
             goto out;
         }
         break;
@@ -1255,7 +1725,7 @@ static void nbd_set_handlers(NBDClient *client)
                            true,
                            client->can_read ? nbd_read : NULL,
                            client->send_coroutine ? nbd_restart_write : NULL,
-                           client);
+                           NULL, client);
     }
 }
 
@@ -1263,7 +1733,7 @@ static void nbd_unset_handlers(NBDClient *client)
 {
     if (client->exp && client->exp->ctx) {
         aio_set_fd_handler(client->exp->ctx, client->sioc->fd,
-                           true, NULL, NULL, NULL);
+                           true, NULL, NULL, NULL, NULL);
     }
 }
 
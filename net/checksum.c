@@ -20,19 +20,67 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
+/*
+ * The one's complement sum does not depend on the byte order nor on the
+ * width of the words that are added (RFC 1071), so sum the buffer in
+ * native 64-bit words with end-around carry, fold the result and only
+ * then swap it into network order.  The partial sum returned is
+ * congruent to the byte-wise big-endian sum modulo 0xffff, which is all
+ * net_checksum_finish() looks at, and fits in 16 bits.
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum = 0;
-    int i;
+    uint64_t sum = 0;
+    uint16_t res;
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w0 = ldq_he_p(buf + i);
+        uint64_t w1 = ldq_he_p(buf + i + 8);
+        uint64_t w2 = ldq_he_p(buf + i + 16);
+        uint64_t w3 = ldq_he_p(buf + i + 24);
+
+        sum += w0;
+        sum += (sum < w0);
+        sum += w1;
+        sum += (sum < w1);
+        sum += w2;
+        sum += (sum < w2);
+        sum += w3;
+        sum += (sum < w3);
+    }
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = ldq_he_p(buf + i);
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
-        }
+        sum += w;
+        sum += (sum < w);
+    }
+    for (; i + 2 <= len; i += 2) {
+        uint64_t w = lduw_he_p(buf + i);
+
+        sum += w;
+        sum += (sum < w);
+    }
+    if (i < len) {
+        /* pad the odd byte with zero, as the high byte of a BE word */
+        uint8_t last[2] = { buf[i], 0 };
+        uint64_t w = lduw_he_p(last);
+
+        sum += w;
+        sum += (sum < w);
     }
-    return sum;
+
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    res = sum;
+#ifndef HOST_WORDS_BIGENDIAN
+    res = bswap16(res);
+#endif
+    if (seq & 1) {
+        res = bswap16(res);
+    }
+    return res;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
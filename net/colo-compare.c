@@ -37,11 +37,16 @@
 #define COMPARE_READ_LEN_MAX NET_BUFSIZE
 #define MAX_QUEUE_SIZE 1024
 
+#define COMPARE_MAX_WORKERS 64
+/* Preallocated packets per worker, large enough for a full-sized frame */
+#define COMPARE_POOL_SIZE 256
+#define COMPARE_POOL_BUF_SIZE 2048
+
 /* TODO: Should be configurable */
 #define REGULAR_PACKET_CHECK_MS 3000
 
 /*
-  + CompareState ++
+  + CompareWorker +
   |               |
   +---------------+   +---------------+         +---------------+
   |conn list      +--->conn           +--------->conn           |
@@ -62,7 +67,41 @@
                     |packet  |  |packet  +    |packet  | |packet  +
                     +--------+  +--------+    +--------+ +--------+
 */
-typedef struct CompareState {
+typedef struct CompareState CompareState;
+
+/*
+ * The compare thread only reads the packets from the chardevs, and hands
+ * them over to the worker that owns their connection, chosen by the hash
+ * of the connection key.  Each worker has its own connection table, so
+ * that all the packets of a connection are compared by the same thread,
+ * in order, without any locking beyond the hand-over.
+ */
+typedef struct CompareWorker {
+    CompareState *s;
+    QemuThread thread;
+
+    /* protects the fields up to conn_list */
+    QemuMutex lock;
+    QemuCond cond;
+    /* packets not yet enqueued to their connection, element type: Packet */
+    GQueue pri_inbox;
+    GQueue sec_inbox;
+    PacketPool pool;
+    bool check_old;
+    bool quit;
+
+    /* connection list: the connections of this worker could be found
+     * in this list.
+     * element type: Connection
+     */
+    GQueue conn_list;
+    /* hashtable to save connection */
+    GHashTable *connection_track_table;
+    /* compared packets, given back to the pool in a batch */
+    GQueue released;
+} CompareWorker;
+
+struct CompareState {
     Object parent;
 
     char *pri_indev;
@@ -73,20 +112,16 @@ typedef struct CompareState {
     CharDriverState *chr_out;
     SocketReadState pri_rs;
     SocketReadState sec_rs;
+    /* serializes the packets sent to chr_out by the workers */
+    QemuMutex out_lock;
 
-    /* connection list: the connections belonged to this NIC could be found
-     * in this list.
-     * element type: Connection
-     */
-    GQueue conn_list;
-    /* hashtable to save connection */
-    GHashTable *connection_track_table;
     /* compare thread, a thread for each NIC */
     QemuThread thread;
+    uint32_t nr_workers;
+    CompareWorker *workers;
     /* Timer used on the primary to find packets that are never matched */
     QEMUTimer *timer;
-    QemuMutex timer_check_lock;
-} CompareState;
+};
 
 typedef struct CompareClass {
     ObjectClass parent_class;
@@ -101,39 +136,73 @@ enum {
     SECONDARY_IN,
 };
 
-static int compare_chr_send(CharDriverState *out,
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size);
 
 /*
+ * Called from the compare thread on the primary: parse the packet
+ * and pass it to the worker that compares its connection.
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode)
+static int packet_dispatch(CompareState *s, int mode, uint8_t *buf, int size)
 {
+    Packet tmp = { .data = buf, .size = size };
     ConnectionKey key;
-    Packet *pkt = NULL;
-    Connection *conn;
+    CompareWorker *w;
+    GQueue *inbox;
+    Packet *pkt;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf, s->pri_rs.packet_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf, s->sec_rs.packet_len);
+    if (parse_packet_early(&tmp)) {
+        return -1;
     }
+    fill_connection_key(&tmp, &key);
 
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
+    w = &s->workers[connection_key_hash(&key) % s->nr_workers];
+    inbox = mode == PRIMARY_IN ? &w->pri_inbox : &w->sec_inbox;
+
+    qemu_mutex_lock(&w->lock);
+    if (g_queue_get_length(inbox) > MAX_QUEUE_SIZE) {
+        qemu_mutex_unlock(&w->lock);
+        error_report("colo compare worker queue size too big, drop packet");
+        return 0;
     }
+    pkt = packet_pool_get(&w->pool, buf, size);
+    pkt->network_header = (uint8_t *)pkt->data +
+                          (tmp.network_header - buf);
+    pkt->transport_header = (uint8_t *)pkt->data +
+                            (tmp.transport_header - buf);
+    g_queue_push_tail(inbox, pkt);
+    qemu_cond_signal(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/* Called from the worker thread, the packet goes back to the pool later */
+static void packet_release(CompareWorker *w, Packet *pkt)
+{
+    g_queue_push_tail(&w->released, pkt);
+}
+
+/*
+ * Called from the worker thread on the primary
+ * to add a packet to its connection.
+ */
+static Connection *packet_enqueue(CompareWorker *w, Packet *pkt, int mode)
+{
+    ConnectionKey key;
+    Connection *conn;
+
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(w->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &w->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&w->conn_list, conn);
         conn->processing = true;
     }
 
@@ -144,6 +213,7 @@ static int packet_enqueue(CompareState *s, int mode)
         } else {
             error_report("colo compare primary queue size too big,"
                          "drop packet");
+            packet_release(w, pkt);
         }
     } else {
         if (g_queue_get_length(&conn->secondary_list) <=
@@ -152,10 +222,11 @@ static int packet_enqueue(CompareState *s, int mode)
         } else {
             error_report("colo compare secondary queue size too big,"
                          "drop packet");
+            packet_release(w, pkt);
         }
     }
 
-    return 0;
+    return conn;
 }
 
 /*
@@ -307,30 +378,20 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
     return colo_packet_compare(ppkt, spkt);
 }
 
-static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
-{
-    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
-
-    if ((now - pkt->creation_ms) > (*check_time)) {
-        trace_colo_old_packet_check_found(pkt->creation_ms);
-        return 0;
-    } else {
-        return 1;
-    }
-}
-
+/*
+ * Packets are queued in arrival order, and an unmatched packet goes back
+ * to the tail where it was taken from, so the head of the primary list
+ * is always the oldest packet of the connection.
+ */
 static void colo_old_packet_check_one_conn(void *opaque,
                                            void *user_data)
 {
     Connection *conn = opaque;
-    GList *result = NULL;
-    int64_t check_time = REGULAR_PACKET_CHECK_MS;
-
-    result = g_queue_find_custom(&conn->primary_list,
-                                 &check_time,
-                                 (GCompareFunc)colo_old_packet_check_one);
+    int64_t *now = user_data;
+    Packet *pkt = g_queue_peek_head(&conn->primary_list);
 
-    if (result) {
+    if (pkt && (*now - pkt->creation_ms) > REGULAR_PACKET_CHECK_MS) {
+        trace_colo_old_packet_check_found(pkt->creation_ms);
         /* do checkpoint will flush old packet */
         /* TODO: colo_notify_checkpoint();*/
     }
@@ -341,30 +402,26 @@ static void colo_old_packet_check_one_conn(void *opaque,
  * if we have some then we have to checkpoint to wake
  * the secondary up.
  */
-static void colo_old_packet_check(void *opaque)
+static void colo_old_packet_check(CompareWorker *w)
 {
-    CompareState *s = opaque;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
 
-    g_queue_foreach(&s->conn_list, colo_old_packet_check_one_conn, NULL);
+    g_queue_foreach(&w->conn_list, colo_old_packet_check_one_conn, &now);
 }
 
 /*
- * Called from the compare thread on the primary
+ * Called from the worker thread on the primary
  * for compare connection
  */
-static void colo_compare_connection(void *opaque, void *user_data)
+static void colo_compare_connection(CompareWorker *w, Connection *conn)
 {
-    CompareState *s = user_data;
-    Connection *conn = opaque;
     Packet *pkt = NULL;
     GList *result = NULL;
     int ret;
 
     while (!g_queue_is_empty(&conn->primary_list) &&
            !g_queue_is_empty(&conn->secondary_list)) {
-        qemu_mutex_lock(&s->timer_check_lock);
         pkt = g_queue_pop_tail(&conn->primary_list);
-        qemu_mutex_unlock(&s->timer_check_lock);
         switch (conn->ip_proto) {
         case IPPROTO_TCP:
             result = g_queue_find_custom(&conn->secondary_list,
@@ -385,13 +442,14 @@ static void colo_compare_connection(void *opaque, void *user_data)
         }
 
         if (result) {
-            ret = compare_chr_send(s->chr_out, pkt->data, pkt->size);
+            ret = compare_chr_send(w->s, pkt->data, pkt->size);
             if (ret < 0) {
                 error_report("colo_send_primary_packet failed");
             }
             trace_colo_compare_main("packet same and release packet");
-            g_queue_remove(&conn->secondary_list, result->data);
-            packet_destroy(pkt, NULL);
+            packet_release(w, result->data);
+            g_queue_delete_link(&conn->secondary_list, result);
+            packet_release(w, pkt);
         } else {
             /*
              * If one packet arrive late, the secondary_list or
@@ -399,16 +457,14 @@ static void colo_compare_connection(void *opaque, void *user_data)
              * until next comparison.
              */
             trace_colo_compare_main("packet different");
-            qemu_mutex_lock(&s->timer_check_lock);
             g_queue_push_tail(&conn->primary_list, pkt);
-            qemu_mutex_unlock(&s->timer_check_lock);
             /* TODO: colo_notify_checkpoint();*/
             break;
         }
     }
 }
 
-static int compare_chr_send(CharDriverState *out,
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size)
 {
@@ -419,22 +475,129 @@ static int compare_chr_send(CharDriverState *out,
         return 0;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)&len, sizeof(len));
+    qemu_mutex_lock(&s->out_lock);
+    ret = qemu_chr_fe_write_all(s->chr_out, (uint8_t *)&len, sizeof(len));
     if (ret != sizeof(len)) {
         goto err;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)buf, size);
+    ret = qemu_chr_fe_write_all(s->chr_out, (uint8_t *)buf, size);
     if (ret != size) {
         goto err;
     }
 
+    qemu_mutex_unlock(&s->out_lock);
     return 0;
 
 err:
+    qemu_mutex_unlock(&s->out_lock);
     return ret < 0 ? ret : -EIO;
 }
 
+/* Called from the worker thread with w->lock held */
+static void compare_worker_flush_released(CompareWorker *w)
+{
+    Packet *pkt;
+
+    while ((pkt = g_queue_pop_head(&w->released))) {
+        packet_pool_put(&w->pool, pkt);
+    }
+}
+
+static void *colo_compare_worker_thread(void *opaque)
+{
+    CompareWorker *w = opaque;
+    GQueue pri = G_QUEUE_INIT, sec = G_QUEUE_INIT;
+    Connection *conn;
+    Packet *pkt;
+    bool check_old;
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        compare_worker_flush_released(w);
+        while (g_queue_is_empty(&w->pri_inbox) &&
+               g_queue_is_empty(&w->sec_inbox) &&
+               !w->check_old && !w->quit) {
+            qemu_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->quit) {
+            break;
+        }
+
+        /* Take the whole batch, and let the compare thread refill it */
+        pri = w->pri_inbox;
+        sec = w->sec_inbox;
+        g_queue_init(&w->pri_inbox);
+        g_queue_init(&w->sec_inbox);
+        check_old = w->check_old;
+        w->check_old = false;
+        qemu_mutex_unlock(&w->lock);
+
+        /* Only the connection that got a packet can have a new match */
+        while ((pkt = g_queue_pop_head(&pri))) {
+            conn = packet_enqueue(w, pkt, PRIMARY_IN);
+            colo_compare_connection(w, conn);
+        }
+        while ((pkt = g_queue_pop_head(&sec))) {
+            conn = packet_enqueue(w, pkt, SECONDARY_IN);
+            colo_compare_connection(w, conn);
+        }
+        if (check_old) {
+            colo_old_packet_check(w);
+        }
+
+        qemu_mutex_lock(&w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void compare_worker_init(CompareState *s, CompareWorker *w, int id)
+{
+    char thread_name[64];
+
+    w->s = s;
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->cond);
+    g_queue_init(&w->pri_inbox);
+    g_queue_init(&w->sec_inbox);
+    packet_pool_init(&w->pool, COMPARE_POOL_SIZE, COMPARE_POOL_BUF_SIZE);
+    g_queue_init(&w->conn_list);
+    g_queue_init(&w->released);
+    w->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                      connection_key_equal,
+                                                      g_free,
+                                                      connection_destroy);
+
+    snprintf(thread_name, sizeof(thread_name), "colo-compare %d/%d",
+             id, (int)(w - s->workers));
+    qemu_thread_create(&w->thread, thread_name,
+                       colo_compare_worker_thread, w,
+                       QEMU_THREAD_JOINABLE);
+}
+
+static void compare_worker_destroy(CompareWorker *w)
+{
+    qemu_mutex_lock(&w->lock);
+    w->quit = true;
+    qemu_cond_signal(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+    qemu_thread_join(&w->thread);
+
+    g_queue_foreach(&w->pri_inbox, packet_destroy, NULL);
+    g_queue_clear(&w->pri_inbox);
+    g_queue_foreach(&w->sec_inbox, packet_destroy, NULL);
+    g_queue_clear(&w->sec_inbox);
+    g_queue_foreach(&w->released, packet_destroy, NULL);
+    g_queue_clear(&w->released);
+    /* The table owns the connections */
+    g_queue_clear(&w->conn_list);
+    g_hash_table_destroy(w->connection_track_table);
+    packet_pool_destroy(&w->pool);
+    qemu_cond_destroy(&w->cond);
+    qemu_mutex_destroy(&w->lock);
+}
+
 static int compare_chr_can_read(void *opaque)
 {
     return COMPARE_READ_LEN_MAX;
@@ -543,12 +706,9 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
 
-    if (packet_enqueue(s, PRIMARY_IN)) {
+    if (packet_dispatch(s, PRIMARY_IN, pri_rs->buf, pri_rs->packet_len)) {
         trace_colo_compare_main("primary: unsupported packet in");
-        compare_chr_send(s->chr_out, pri_rs->buf, pri_rs->packet_len);
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        compare_chr_send(s, pri_rs->buf, pri_rs->packet_len);
     }
 }
 
@@ -556,11 +716,8 @@ static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
 
-    if (packet_enqueue(s, SECONDARY_IN)) {
+    if (packet_dispatch(s, SECONDARY_IN, sec_rs->buf, sec_rs->packet_len)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
     }
 }
 
@@ -599,17 +756,22 @@ static int find_and_check_chardev(CharDriverState **chr,
 static void check_old_packet_regular(void *opaque)
 {
     CompareState *s = opaque;
+    int i;
 
     timer_mod(s->timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
               REGULAR_PACKET_CHECK_MS);
-    /* if have old packet we will notify checkpoint */
     /*
-     * TODO: Make timer handler run in compare thread
-     * like qemu_chr_add_handlers_full.
+     * if have old packet we will notify checkpoint; each worker checks
+     * its own connections, so that they need no locking.
      */
-    qemu_mutex_lock(&s->timer_check_lock);
-    colo_old_packet_check(s);
-    qemu_mutex_unlock(&s->timer_check_lock);
+    for (i = 0; i < s->nr_workers; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        qemu_mutex_lock(&w->lock);
+        w->check_old = true;
+        qemu_cond_signal(&w->cond);
+        qemu_mutex_unlock(&w->lock);
+    }
 }
 
 /*
@@ -621,6 +783,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
     CompareState *s = COLO_COMPARE(uc);
     char thread_name[64];
     static int compare_id;
+    int i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -655,13 +818,12 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
     net_socket_rs_init(&s->pri_rs, compare_pri_rs_finalize);
     net_socket_rs_init(&s->sec_rs, compare_sec_rs_finalize);
 
-    g_queue_init(&s->conn_list);
-    qemu_mutex_init(&s->timer_check_lock);
+    qemu_mutex_init(&s->out_lock);
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    s->workers = g_new0(CompareWorker, s->nr_workers);
+    for (i = 0; i < s->nr_workers; i++) {
+        compare_worker_init(s, &s->workers[i], compare_id);
+    }
 
     sprintf(thread_name, "colo-compare %d", compare_id);
     qemu_thread_create(&s->thread, thread_name,
@@ -685,8 +847,49 @@ static void colo_compare_class_init(ObjectClass *oc, void *data)
     ucc->complete = colo_compare_complete;
 }
 
+static void compare_get_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->nr_workers;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (s->workers) {
+        error_setg(&local_err, "Property '%s.%s' can not be changed once "
+                   "the object is created", object_get_typename(obj), name);
+        goto out;
+    }
+    if (!value || value > COMPARE_MAX_WORKERS) {
+        error_setg(&local_err, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, COMPARE_MAX_WORKERS);
+        goto out;
+    }
+    s->nr_workers = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static void colo_compare_init(Object *obj)
 {
+    CompareState *s = COLO_COMPARE(obj);
+
+    s->nr_workers = 1;
     object_property_add_str(obj, "primary_in",
                             compare_get_pri_indev, compare_set_pri_indev,
                             NULL);
@@ -696,11 +899,15 @@ static void colo_compare_init(Object *obj)
     object_property_add_str(obj, "outdev",
                             compare_get_outdev, compare_set_outdev,
                             NULL);
+    object_property_add(obj, "workers", "uint32",
+                        compare_get_workers, compare_set_workers,
+                        NULL, NULL, NULL);
 }
 
 static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
+    int i;
 
     if (s->chr_pri_in) {
         qemu_chr_add_handlers(s->chr_pri_in, NULL, NULL, NULL, NULL);
@@ -714,19 +921,18 @@ static void colo_compare_finalize(Object *obj)
         qemu_chr_fe_release(s->chr_out);
     }
 
-    g_queue_free(&s->conn_list);
-
-    if (qemu_thread_is_self(&s->thread)) {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
-        qemu_thread_join(&s->thread);
-    }
-
     if (s->timer) {
         timer_del(s->timer);
+        timer_free(s->timer);
     }
 
-    qemu_mutex_destroy(&s->timer_check_lock);
+    if (s->workers) {
+        for (i = 0; i < s->nr_workers; i++) {
+            compare_worker_destroy(&s->workers[i]);
+        }
+        g_free(s->workers);
+        qemu_mutex_destroy(&s->out_lock);
+    }
 
     g_free(s->pri_indev);
     g_free(s->sec_indev);
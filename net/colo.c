@@ -159,6 +159,7 @@ Packet *packet_new(const void *data, int size)
 
     pkt->data = g_memdup(data, size);
     pkt->size = size;
+    pkt->buf_size = size;
     pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
 
     return pkt;
@@ -172,6 +173,65 @@ void packet_destroy(void *opaque, void *user_data)
     g_slice_free(Packet, pkt);
 }
 
+/*
+ * Preallocate @size packets with @buf_size bytes of data; the pool keeps
+ * at most @size free packets.  Larger packets grow the buffer of the
+ * packet that they are copied to, and keep it when they are put back.
+ */
+void packet_pool_init(PacketPool *pool, int size, int buf_size)
+{
+    int i;
+
+    g_queue_init(&pool->free);
+    pool->max = size;
+    for (i = 0; i < size; i++) {
+        Packet *pkt = g_slice_new(Packet);
+
+        pkt->data = g_malloc(buf_size);
+        pkt->buf_size = buf_size;
+        g_queue_push_tail(&pool->free, pkt);
+    }
+}
+
+void packet_pool_destroy(PacketPool *pool)
+{
+    g_queue_foreach(&pool->free, packet_destroy, NULL);
+    g_queue_clear(&pool->free);
+}
+
+/* Like packet_new(), but take the packet from @pool if possible */
+Packet *packet_pool_get(PacketPool *pool, const void *data, int size)
+{
+    Packet *pkt = g_queue_pop_head(&pool->free);
+
+    if (!pkt) {
+        pkt = g_slice_new(Packet);
+        pkt->data = NULL;
+        pkt->buf_size = 0;
+    }
+    if (pkt->buf_size < size) {
+        g_free(pkt->data);
+        pkt->data = g_malloc(size);
+        pkt->buf_size = size;
+    }
+
+    memcpy(pkt->data, data, size);
+    pkt->size = size;
+    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+
+    return pkt;
+}
+
+void packet_pool_put(PacketPool *pool, Packet *pkt)
+{
+    if (g_queue_get_length(&pool->free) >= pool->max) {
+        packet_destroy(pkt, NULL);
+    } else {
+        /* LIFO, the most recently used buffer is likely still in cache */
+        g_queue_push_head(&pool->free, pkt);
+    }
+}
+
 /*
  * Clear hashtable, stop this hash growing really huge
  */
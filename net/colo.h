@@ -41,10 +41,23 @@ typedef struct Packet {
     };
     uint8_t *transport_header;
     int size;
+    /* Allocated size of data, at least size */
+    int buf_size;
     /* Time of packet creation, in wall clock ms */
     int64_t creation_ms;
 } Packet;
 
+/*
+ * A free list of packets whose data buffers are reused, to avoid two
+ * allocations and frees per packet on the compare fast path.  Not thread
+ * safe, the caller provides the locking.
+ */
+typedef struct PacketPool {
+    /* element type: Packet */
+    GQueue free;
+    int max;
+} PacketPool;
+
 typedef struct ConnectionKey {
     /* (src, dst) must be grouped, in the same way than in IP header */
     struct in_addr src;
@@ -84,5 +97,9 @@ Connection *connection_get(GHashTable *connection_track_table,
 void connection_hashtable_reset(GHashTable *connection_track_table);
 Packet *packet_new(const void *data, int size);
 void packet_destroy(void *opaque, void *user_data);
+void packet_pool_init(PacketPool *pool, int size, int buf_size);
+void packet_pool_destroy(PacketPool *pool);
+Packet *packet_pool_get(PacketPool *pool, const void *data, int size);
+void packet_pool_put(PacketPool *pool, Packet *pkt);
 
 #endif /* QEMU_COLO_PROXY_H */
@@ -47,6 +47,7 @@
 #include "sysemu/sysemu.h"
 #include "net/filter.h"
 #include "qapi/string-output-visitor.h"
+#include "qemu/stats.h"
 
 /* Net bridge is currently not supported for W32. */
 #if !defined(_WIN32)
@@ -520,6 +521,20 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/*
+ * Move the backend's fd handlers to @ctx, or back to the main loop if
+ * @ctx is NULL.  The caller must make sure that the peer of @nc is only
+ * used from @ctx from now on.
+ */
+int qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return -ENOSYS;
+    }
+
+    return nc->info->set_aio_context(nc, ctx);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -601,6 +616,10 @@ void qemu_purge_queued_packets(NetClientState *nc)
 static
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+    /* The queued packets are delivered as one batch */
+    bool batch = nc->info->receive_batch_end && !nc->receive_batch;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_DRIVER_HUBPORT) {
@@ -608,7 +627,17 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+
+    if (batch) {
+        nc->receive_batch = 1;
+    }
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    if (batch) {
+        nc->receive_batch = 0;
+        nc->info->receive_batch_end(nc);
+    }
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -624,6 +653,69 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
+/*
+ * Packets sent by @nc until qemu_send_batch_end() are a burst, and its
+ * peer may defer per-packet work (such as notifying the guest) until
+ * receive_batch_end is called.  Packets that are queued, or held back by a
+ * filter, are delivered outside of the batch.
+ */
+void qemu_send_batch_begin(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->info->receive_batch_end) {
+        nc->peer->receive_batch = 1;
+    }
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->receive_batch) {
+        peer->receive_batch = 0;
+        peer->info->receive_batch_end(peer);
+    }
+}
+
+/*
+ * Zero-copy receive: qemu_receive_iov_get() exposes the receive buffers
+ * of the peer of @nc for the next packet, so that @nc can read it there
+ * directly.  It returns the number of @iov entries filled, or 0 if the
+ * packet has to be sent the usual way.
+ *
+ * Every successful qemu_receive_iov_get() must be followed by
+ * qemu_receive_iov_put() with the size of the packet written, or 0 to
+ * give the buffers back unused.  The bytes that did not fit into the
+ * exposed buffers must be in @buf, at their offset within the packet.
+ * If the peer cannot complete the delivery, it copies the rest of the
+ * packet into @buf and returns 0; @nc must then send @buf as a regular
+ * packet.  Otherwise the packet was delivered or dropped, and @size is
+ * returned.
+ */
+int qemu_receive_iov_get(NetClientState *nc, struct iovec *iov, int iovcnt)
+{
+    NetClientState *peer = nc->peer;
+
+    if (!peer || !peer->info->rx_iov_get ||
+        nc->link_down || peer->link_down || peer->receive_disabled ||
+        !QTAILQ_EMPTY(&nc->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        !qemu_net_queue_empty(peer->incoming_queue)) {
+        return 0;
+    }
+
+    return peer->info->rx_iov_get(peer, iov, iovcnt);
+}
+
+ssize_t qemu_receive_iov_put(NetClientState *nc, uint8_t *buf, size_t size)
+{
+    ssize_t ret = nc->peer->info->rx_iov_put(nc->peer, buf, size);
+
+    if (ret > 0) {
+        nc->peer->rx_packets++;
+        nc->peer->rx_bytes += ret;
+    }
+    return ret;
+}
+
 static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -734,6 +826,9 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        nc->rx_packets++;
+        nc->rx_bytes += ret;
     }
 
     return ret;
@@ -1341,6 +1436,73 @@ RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
     return filter_list;
 }
 
+NetQueueInfoList *qmp_query_net_queues(bool has_name, const char *name,
+                                       Error **errp)
+{
+    NetClientState *nc;
+    NetQueueInfoList *queue_list = NULL, *last_entry = NULL;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetQueueInfoList *entry;
+        NetQueueInfo *info;
+
+        if (has_name && strcmp(nc->name, name) != 0) {
+            continue;
+        }
+
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(nc->name);
+        info->index = nc->queue_index;
+        qemu_net_queue_get_info(nc->incoming_queue, info);
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        if (!queue_list) {
+            queue_list = entry;
+        } else {
+            last_entry->next = entry;
+        }
+        last_entry = entry;
+    }
+
+    if (queue_list == NULL && has_name) {
+        error_setg(errp, "invalid net client name: %s", name);
+    }
+
+    return queue_list;
+}
+
+static void net_stats_provider(StatsCollector *c, void *opaque)
+{
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetQueueInfo info;
+        char *instance;
+        bool wanted;
+
+        /* The queues of a multiqueue client after the first are "name:N" */
+        if (nc->queue_index) {
+            instance = g_strdup_printf("%s:%u", nc->name, nc->queue_index);
+        } else {
+            instance = g_strdup(nc->name);
+        }
+        wanted = stats_begin_instance(c, instance);
+        g_free(instance);
+        if (!wanted) {
+            continue;
+        }
+
+        stats_add_counter(c, "rx-packets", nc->rx_packets);
+        stats_add_counter(c, "rx-bytes", nc->rx_bytes);
+        qemu_net_queue_get_info(nc->incoming_queue, &info);
+        stats_add_gauge(c, "queued-packets", info.queued_packets);
+        stats_add_gauge(c, "queued-bytes", info.queued_bytes);
+        stats_add_counter(c, "dropped-packets", info.dropped_packets);
+        stats_add_counter(c, "dropped-bytes", info.dropped_bytes);
+    }
+}
+
 void hmp_info_network(Monitor *mon, const QDict *qdict)
 {
     NetClientState *nc, *peer;
@@ -1517,6 +1679,7 @@ int net_init_clients(void)
         qemu_add_vm_change_state_handler(net_vm_change_state_handler, NULL);
 
     QTAILQ_INIT(&net_clients);
+    stats_register_provider("net", net_stats_provider, NULL);
 
     if (qemu_opts_foreach(qemu_find_opts("netdev"),
                           net_init_netdev, NULL, NULL)) {
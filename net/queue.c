@@ -37,9 +37,16 @@
  * the packet.
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * unbounded queueing.  The queue is bounded both in packets and in bytes.
+ *
+ * Buffers of small packets are recycled through a per-queue free list, so
+ * that bursts of MTU-sized packets do not go through the allocator.
  */
 
+/* Packets up to this size are stored in recycled buffers */
+#define NET_PACKET_SLOT_SIZE 2048
+#define NET_QUEUE_MAX_FREE_SLOTS 64
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
@@ -53,9 +60,15 @@ struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
     uint32_t nq_count;
+    uint64_t nq_maxbytes;
+    uint64_t nq_bytes;
+    uint64_t nq_dropped;
+    uint64_t nq_dropped_bytes;
     NetQueueDeliverFunc *deliver;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) free_slots;
+    uint32_t nq_free_slots;
 
     unsigned delivering : 1;
 };
@@ -69,9 +82,12 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->opaque = opaque;
     queue->nq_maxlen = 10000;
     queue->nq_count = 0;
+    queue->nq_maxbytes = 16 * 1024 * 1024;
+    queue->nq_bytes = 0;
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->free_slots);
 
     queue->delivering = 0;
 
@@ -86,10 +102,70 @@ void qemu_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->free_slots, entry, next) {
+        QTAILQ_REMOVE(&queue->free_slots, packet, entry);
+        g_free(packet);
+    }
 
     g_free(queue);
 }
 
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_PACKET_SLOT_SIZE) {
+        return g_malloc(sizeof(NetPacket) + size);
+    }
+
+    packet = QTAILQ_FIRST(&queue->free_slots);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->free_slots, packet, entry);
+        queue->nq_free_slots--;
+        return packet;
+    }
+    return g_malloc(sizeof(NetPacket) + NET_PACKET_SLOT_SIZE);
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->size <= NET_PACKET_SLOT_SIZE &&
+        queue->nq_free_slots < NET_QUEUE_MAX_FREE_SLOTS) {
+        QTAILQ_INSERT_HEAD(&queue->free_slots, packet, entry);
+        queue->nq_free_slots++;
+    } else {
+        g_free(packet);
+    }
+}
+
+/* Packets without a sent callback are dropped when the queue is full */
+static bool qemu_net_queue_drop(NetQueue *queue, size_t size,
+                                NetPacketSent *sent_cb)
+{
+    if (sent_cb || (queue->nq_count < queue->nq_maxlen &&
+                    queue->nq_bytes + size <= queue->nq_maxbytes)) {
+        return false;
+    }
+
+    queue->nq_dropped++;
+    queue->nq_dropped_bytes += size;
+    return true;
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    queue->nq_count++;
+    queue->nq_bytes += packet->size;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
+static void qemu_net_queue_remove(NetQueue *queue, NetPacket *packet)
+{
+    QTAILQ_REMOVE(&queue->packets, packet, entry);
+    queue->nq_count--;
+    queue->nq_bytes -= packet->size;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -99,18 +175,17 @@ static void qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
+    if (qemu_net_queue_drop(queue, size, sent_cb)) {
+        return;
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -124,14 +199,14 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     size_t max_len = 0;
     int i;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
-    }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
+    if (qemu_net_queue_drop(queue, max_len, sent_cb)) {
+        return;
+    }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -144,8 +219,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -238,16 +312,20 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
+            qemu_net_queue_remove(queue, packet);
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
 
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return QTAILQ_EMPTY(&queue->packets);
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     while (!QTAILQ_EMPTY(&queue->packets)) {
@@ -255,8 +333,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
         int ret;
 
         packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
+        qemu_net_queue_remove(queue, packet);
 
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
@@ -265,6 +342,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
                                      packet->size);
         if (ret == 0) {
             queue->nq_count++;
+            queue->nq_bytes += packet->size;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             return false;
         }
@@ -273,7 +351,17 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return true;
 }
+
+void qemu_net_queue_get_info(NetQueue *queue, NetQueueInfo *info)
+{
+    info->queued_packets = queue->nq_count;
+    info->queued_bytes = queue->nq_bytes;
+    info->max_packets = queue->nq_maxlen;
+    info->max_bytes = queue->nq_maxbytes;
+    info->dropped_packets = queue->nq_dropped;
+    info->dropped_bytes = queue->nq_dropped_bytes;
+}
@@ -40,6 +40,8 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
@@ -59,6 +61,7 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx;            /* NULL when served by the main loop */
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -69,10 +72,15 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, fd_read, fd_write,
+                           NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -179,31 +187,91 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/*
+ * Read the next packet straight into the receive buffers of the peer,
+ * with s->buf catching whatever does not fit.  Returns -ENOTSUP if the
+ * peer cannot take the packet this way, or the result of the read.  On
+ * success *pbuf is NULL if the packet was consumed, or points to the
+ * packet if it was handed back and must be sent as usual.
+ */
+static ssize_t tap_read_zerocopy(TAPState *s, uint8_t **pbuf)
+{
+#ifdef __sun__
+    /* getmsg() has no scatter/gather variant */
+    return -ENOTSUP;
+#else
+    struct iovec iov[NET_RX_IOV_MAX + 2];
+    size_t skip = 0, cap;
+    uint8_t *buf;
+    ssize_t size;
+    int cnt = 0, n;
+
+    /* A vnet header that the peer does not want lands in s->buf */
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        skip = s->host_vnet_hdr_len;
+        iov[cnt].iov_base = s->buf;
+        iov[cnt++].iov_len = skip;
+    }
+    buf = s->buf + skip;
+
+    n = qemu_receive_iov_get(&s->nc, iov + cnt, NET_RX_IOV_MAX);
+    if (n <= 0) {
+        return -ENOTSUP;
+    }
+    cap = iov_size(iov + cnt, n);
+    cnt += n;
+    if (cap < sizeof(s->buf) - skip) {
+        iov[cnt].iov_base = buf + cap;
+        iov[cnt++].iov_len = sizeof(s->buf) - skip - cap;
+    }
+
+    size = readv(s->fd, iov, cnt);
+    if (size <= (ssize_t)skip) {
+        qemu_receive_iov_put(&s->nc, buf, 0);
+        return size < 0 ? size : 0;
+    }
+
+    size -= skip;
+    *pbuf = qemu_receive_iov_put(&s->nc, buf, size) ? NULL : buf;
+    return size;
+#endif
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
+    /* Let the NIC return the whole burst to the guest at once */
+    qemu_send_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+        size = tap_read_zerocopy(s, &buf);
+        if (size == -ENOTSUP) {
+            size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+            if (size <= 0) {
+                break;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+        } else if (size <= 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
-            break;
+        if (buf) {
+            size = qemu_send_packet_async(&s->nc, buf, size,
+                                          tap_send_completed);
+            if (size == 0) {
+                tap_read_poll(s, false);
+                break;
+            } else if (size < 0) {
+                break;
+            }
         }
 
         /*
@@ -217,6 +285,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_send_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -334,6 +403,28 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static int tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->vhost_net) {
+        return -EBUSY;
+    }
+    if (s->ctx == ctx) {
+        return 0;
+    }
+
+    /* Unregister from the old context before registering in the new one */
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+    return 0;
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -359,6 +450,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
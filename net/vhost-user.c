@@ -15,7 +15,6 @@
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
-#include "qmp-commands.h"
 #include "trace.h"
 
 typedef struct VhostUserState {
@@ -182,6 +181,25 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
+/*
+ * Only the backend side of the link follows the connection: the guest
+ * keeps its link up and virtio-net leaves the rings alone while the
+ * backend is away, so that it resumes where it stopped once it is back.
+ */
+static void net_vhost_user_set_backend_link(int queues, NetClientState *ncs[],
+                                            bool up)
+{
+    NetClientState *peer = ncs[0]->peer;
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        ncs[i]->link_down = !up;
+    }
+    if (peer && peer->info->link_status_changed) {
+        peer->info->link_status_changed(peer);
+    }
+}
+
 static gboolean net_vhost_user_watch(GIOChannel *chan, GIOCondition cond,
                                            void *opaque)
 {
@@ -197,7 +215,6 @@ static void net_vhost_user_event(void *opaque, int event)
     const char *name = opaque;
     NetClientState *ncs[MAX_QUEUE_NUM];
     VhostUserState *s;
-    Error *err = NULL;
     int queues;
 
     queues = qemu_find_net_clients_except(name, ncs,
@@ -215,20 +232,16 @@ static void net_vhost_user_event(void *opaque, int event)
             qemu_chr_disconnect(s->chr);
             return;
         }
-        qmp_set_link(name, true, &err);
+        net_vhost_user_set_backend_link(queues, ncs, true);
         s->started = true;
         break;
     case CHR_EVENT_CLOSED:
-        qmp_set_link(name, false, &err);
+        net_vhost_user_set_backend_link(queues, ncs, false);
         vhost_user_stop(queues, ncs);
         g_source_remove(s->watch);
         s->watch = 0;
         break;
     }
-
-    if (err) {
-        error_report_err(err);
-    }
 }
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
@@ -37,6 +37,12 @@
 #include "hw/mem/pc-dimm.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "qemu/cutils.h"
+
+#ifdef CONFIG_NUMA
+#include <sched.h>
+#include <numaif.h>
+#endif
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -139,6 +145,42 @@ uint32_t numa_get_node(ram_addr_t addr, Error **errp)
     return -1;
 }
 
+#ifdef CONFIG_NUMA
+/* Parse the CPU list of a host node, e.g. "0-7,16-23"; false if no node */
+static bool host_node_get_cpus(int node, cpu_set_t *set)
+{
+    char *path, *contents;
+    const char *p;
+    unsigned long first, last;
+    bool ok;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    ok = g_file_get_contents(path, &contents, NULL, NULL);
+    g_free(path);
+    if (!ok) {
+        return false;
+    }
+
+    CPU_ZERO(set);
+    p = contents;
+    while (qemu_strtoul(p, &p, 10, &first) == 0) {
+        last = first;
+        if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last) < 0) {
+            break;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+    g_free(contents);
+    return true;
+}
+#endif
+
 static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
 {
     uint16_t nodenr;
@@ -207,6 +249,24 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
         numa_info[nodenr].node_mem = object_property_get_int(o, "size", NULL);
         numa_info[nodenr].node_memdev = MEMORY_BACKEND(o);
     }
+    if (node->has_host_node) {
+#ifdef CONFIG_NUMA
+        cpu_set_t host_cpus;
+
+        if (node->host_node >= MAX_NODES ||
+            !host_node_get_cpus(node->host_node, &host_cpus)) {
+            error_setg(errp, "host-node %" PRIu16 " does not exist",
+                       node->host_node);
+            return;
+        }
+        numa_info[nodenr].has_host_node = true;
+        numa_info[nodenr].host_node = node->host_node;
+#else
+        error_setg(errp, "host-node requires NUMA support, which is "
+                   "disabled in this build");
+        return;
+#endif
+    }
     numa_info[nodenr].present = true;
     max_numa_nodeid = MAX(max_numa_nodeid, nodenr + 1);
 }
@@ -390,6 +450,62 @@ void parse_numa_opts(MachineClass *mc)
     }
 }
 
+typedef struct MemdevHostNode {
+    const char *memdev;
+    int host_node;
+} MemdevHostNode;
+
+static int find_memdev_host_node(void *opaque, QemuOpts *opts, Error **errp)
+{
+    MemdevHostNode *data = opaque;
+    const char *memdev = qemu_opt_get(opts, "memdev");
+    const char *host_node = qemu_opt_get(opts, "host-node");
+    unsigned long node;
+
+    if (!memdev || strcmp(memdev, data->memdev) || !host_node) {
+        return 0;
+    }
+    if (qemu_strtoul(host_node, NULL, 10, &node) == 0 && node < MAX_NODES) {
+        data->host_node = node;
+    }
+    return 1;
+}
+
+/*
+ * Memory backends are created, and possibly preallocated, before the
+ * -numa options are parsed, so look at the options directly to bind the
+ * backend before it is touched.  Returns -1 if @memdev has no host node.
+ */
+int numa_get_memdev_host_node(const char *memdev)
+{
+    MemdevHostNode data = { .memdev = memdev, .host_node = -1 };
+
+    qemu_opts_foreach(&qemu_numa_opts, find_memdev_host_node, &data, NULL);
+    return data.host_node;
+}
+
+/* Called by each VCPU thread before it first runs the guest */
+void numa_vcpu_thread_init(CPUState *cpu)
+{
+#ifdef CONFIG_NUMA
+    int node = numa_get_node_for_cpu(cpu->cpu_index);
+    cpu_set_t host_cpus;
+
+    if (node == nb_numa_nodes || !numa_info[node].has_host_node) {
+        return;
+    }
+    if (!host_node_get_cpus(numa_info[node].host_node, &host_cpus) ||
+        !CPU_COUNT(&host_cpus)) {
+        return;
+    }
+    if (sched_setaffinity(0, sizeof(host_cpus), &host_cpus) < 0) {
+        error_report("numa: cannot run VCPU %d on host node %" PRIu16 ": %s",
+                     cpu->cpu_index, numa_info[node].host_node,
+                     strerror(errno));
+    }
+#endif
+}
+
 void numa_post_machine_init(void)
 {
     CPUState *cpu;
@@ -434,6 +550,33 @@ static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
     vmstate_register_ram_global(mr);
 }
 
+/* Record where each node's memory is, and bind it for -numa mem=,host-node */
+static void numa_place_legacy_memory(MemoryRegion *mr)
+{
+    uint8_t *host = memory_region_get_ram_ptr(mr);
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        numa_info[i].host_ram = host;
+#ifdef CONFIG_NUMA
+        if (numa_info[i].has_host_node && numa_info[i].node_mem) {
+            DECLARE_BITMAP(nodes, MAX_NODES + 1);
+
+            bitmap_zero(nodes, MAX_NODES + 1);
+            set_bit(numa_info[i].host_node, nodes);
+            if (mbind(host, numa_info[i].node_mem, MPOL_BIND, nodes,
+                      MAX_NODES + 1, MPOL_MF_MOVE)) {
+                error_report("numa: cannot bind node %d to host node %"
+                             PRIu16 ": %s", i, numa_info[i].host_node,
+                             strerror(errno));
+                exit(1);
+            }
+        }
+#endif
+        host += numa_info[i].node_mem;
+    }
+}
+
 void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
                                           const char *name,
                                           uint64_t ram_size)
@@ -443,6 +586,9 @@ void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
 
     if (nb_numa_nodes == 0 || !have_memdevs) {
         allocate_system_memory_nonnuma(mr, owner, name, ram_size);
+        if (nb_numa_nodes) {
+            numa_place_legacy_memory(mr);
+        }
         return;
     }
 
@@ -465,6 +611,7 @@ void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
         }
 
         host_memory_backend_set_mapped(backend, true);
+        numa_info[i].host_ram = memory_region_get_ram_ptr(seg);
         memory_region_add_subregion(mr, addr, seg);
         vmstate_register_ram_global(seg);
         addr += size;
@@ -562,3 +709,120 @@ int numa_get_node_for_cpu(int idx)
     }
     return i;
 }
+
+#ifdef CONFIG_NUMA
+#define NUMA_PLACEMENT_SAMPLE_PAGES 4096
+
+/* The CPU a thread last ran on, field 39 of /proc/<pid>/task/<tid>/stat */
+static int vcpu_last_host_cpu(CPUState *cpu)
+{
+    char *path, *contents;
+    const char *p, *end;
+    unsigned long host_cpu = ULONG_MAX;
+    int field;
+
+    path = g_strdup_printf("/proc/self/task/%d/stat", cpu->thread_id);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return -1;
+    }
+    g_free(path);
+
+    /* the command name can contain spaces, skip to its end */
+    p = strrchr(contents, ')');
+    for (field = 2; p && field < 39; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    if (!p || qemu_strtoul(p + 1, &end, 10, &host_cpu) < 0) {
+        host_cpu = ULONG_MAX;
+    }
+    g_free(contents);
+    return host_cpu < CPU_SETSIZE ? host_cpu : -1;
+}
+
+static void numa_sample_placement(int node, NumaPlacementInfo *info)
+{
+    size_t page_size = getpagesize();
+    uint64_t pages = numa_info[node].node_mem / page_size;
+    uint64_t step, n, i;
+    void **addrs;
+    int *status;
+
+    if (!numa_info[node].host_ram || !pages) {
+        return;
+    }
+
+    n = MIN(pages, NUMA_PLACEMENT_SAMPLE_PAGES);
+    step = pages / n;
+    addrs = g_new(void *, n);
+    status = g_new(int, n);
+    for (i = 0; i < n; i++) {
+        addrs[i] = (uint8_t *)numa_info[node].host_ram + i * step * page_size;
+    }
+
+    /* Without a target node, move_pages() only reports where pages are */
+    if (move_pages(0, n, addrs, NULL, status, 0) == 0) {
+        info->sampled_pages = n;
+        for (i = 0; i < n; i++) {
+            if (status[i] < 0) {
+                continue;
+            }
+            info->resident_pages++;
+            if (info->has_local_pages && status[i] == info->host_node) {
+                info->local_pages++;
+            }
+        }
+    }
+    g_free(addrs);
+    g_free(status);
+}
+
+NumaPlacementInfoList *qmp_query_numa_placement(Error **errp)
+{
+    NumaPlacementInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        NumaPlacementInfoList *entry = g_new0(NumaPlacementInfoList, 1);
+        NumaPlacementInfo *info = g_new0(NumaPlacementInfo, 1);
+        cpu_set_t host_cpus;
+        bool have_host_cpus = false;
+
+        info->node = i;
+        if (numa_info[i].has_host_node) {
+            info->has_host_node = info->has_local_pages = true;
+            info->has_local_vcpus = true;
+            info->host_node = numa_info[i].host_node;
+            have_host_cpus = host_node_get_cpus(info->host_node, &host_cpus);
+        }
+        numa_sample_placement(i, info);
+
+        CPU_FOREACH(cpu) {
+            int host_cpu;
+
+            if (numa_get_node_for_cpu(cpu->cpu_index) != i) {
+                continue;
+            }
+            info->vcpus++;
+            host_cpu = vcpu_last_host_cpu(cpu);
+            if (have_host_cpus && host_cpu >= 0 &&
+                CPU_ISSET(host_cpu, &host_cpus)) {
+                info->local_vcpus++;
+            }
+        }
+
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+#else
+NumaPlacementInfoList *qmp_query_numa_placement(Error **errp)
+{
+    error_setg(errp, "NUMA support is disabled in this build");
+    return NULL;
+}
+#endif
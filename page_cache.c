@@ -28,12 +28,16 @@
 
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
+/* a page that keeps being hit survives up to that many replacements */
+#define CACHED_PAGE_MAX_HITS 3
 
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* hits since insertion, minus the replacements that were refused */
+    unsigned int it_hits;
     uint8_t *it_data;
 };
 
@@ -86,6 +90,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -142,6 +147,9 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
     if (it->it_addr == addr) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < CACHED_PAGE_MAX_HITS) {
+            it->it_hits++;
+        }
         return true;
     }
     return false;
@@ -156,10 +164,18 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (it->it_data && it->it_addr != addr) {
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            return -1;
+        }
+        if (it->it_hits) {
+            /* the cache page is re-dirtied often, give it another chance
+             * rather than trading it for a page that may never come back
+             */
+            it->it_hits--;
+            return -1;
+        }
     }
     /* allocate page */
     if (!it->it_data) {
@@ -220,6 +236,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 g_free(new_it->it_data);
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
+                new_it->it_hits = old_it->it_hits;
                 new_it->it_addr = old_it->it_addr;
             }
         }
@@ -29,6 +29,8 @@
 #include "qemu/error-report.h"
 #include "qemu/help_option.h"
 #include "sysemu/block-backend.h"
+#include "exec/memory.h"
+#include "hw/mem/pc-dimm.h"
 
 /*
  * Aliases were a bad idea from the start.  Let's keep them
@@ -802,6 +804,68 @@ void qmp_device_add(QDict *qdict, QObject **ret_data, Error **errp)
     object_unref(OBJECT(dev));
 }
 
+/*
+ * Memory devices check for a free KVM and vhost memory slot when they
+ * are plugged.  That check only sees committed memory regions, so they
+ * must not be added inside a pending transaction.
+ */
+static bool device_add_adds_ram(QDict *qdict)
+{
+    const char *driver = qdict_get_try_str(qdict, "driver");
+    DeviceClass *dc;
+
+    if (!driver) {
+        return false;
+    }
+    dc = qdev_get_device_class(&driver, NULL);
+    return dc && object_class_dynamic_cast(OBJECT_CLASS(dc), TYPE_PC_DIMM);
+}
+
+void qmp_device_add_batch(QDict *qdict, QObject **ret_data, Error **errp)
+{
+    QList *devices = qdict_get_qlist(qdict, "devices");
+    const QListEntry *entry;
+    Error *local_err = NULL;
+    int i = 0;
+
+    if (!devices) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE, "devices", "list");
+        return;
+    }
+    QLIST_FOREACH_ENTRY(devices, entry) {
+        if (qobject_type(entry->value) != QTYPE_QDICT) {
+            error_setg(errp, QERR_INVALID_PARAMETER_TYPE, "devices",
+                       "list of objects");
+            return;
+        }
+    }
+
+    /* Let the guest see the new devices all at once */
+    hotplug_batch_begin();
+    memory_region_transaction_begin();
+    QLIST_FOREACH_ENTRY(devices, entry) {
+        QDict *args = qobject_to_qdict(entry->value);
+        bool adds_ram = device_add_adds_ram(args);
+
+        if (adds_ram) {
+            memory_region_transaction_commit();
+        }
+        qmp_device_add(args, NULL, &local_err);
+        if (adds_ram) {
+            memory_region_transaction_begin();
+        }
+        if (local_err) {
+            error_prepend(&local_err, "Device %d: ", i);
+            break;
+        }
+        i++;
+    }
+    memory_region_transaction_commit();
+    hotplug_batch_end();
+
+    error_propagate(errp, local_err);
+}
+
 static DeviceState *find_device_state(const char *id, Error **errp)
 {
     Object *obj;
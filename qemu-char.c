@@ -33,6 +33,7 @@
 #include "hw/usb.h"
 #include "qmp-commands.h"
 #include "qapi/clone-visitor.h"
+#include "qapi/util.h"
 #include "qapi-visit.h"
 #include "qemu/base64.h"
 #include "io/channel-socket.h"
@@ -40,6 +41,7 @@
 #include "io/channel-tls.h"
 #include "sysemu/replay.h"
 #include "qemu/help_option.h"
+#include "qemu/stats.h"
 
 #include <zlib.h>
 
@@ -162,10 +164,23 @@ static void qemu_chr_free_common(CharDriverState *chr);
 
 CharDriverState *qemu_chr_alloc(ChardevCommon *backend, Error **errp)
 {
-    CharDriverState *chr = g_malloc0(sizeof(CharDriverState));
+    CharDriverState *chr;
+
+    if (backend->has_write_buffer && backend->write_buffer > UINT32_MAX) {
+        error_setg(errp, "write-buffer must be less than 4 GiB");
+        return NULL;
+    }
+
+    chr = g_malloc0(sizeof(CharDriverState));
     qemu_mutex_init(&chr->chr_write_lock);
 
     chr->mux_idx = -1;
+    if (backend->has_write_buffer && backend->write_buffer) {
+        chr->wbuf_size = backend->write_buffer;
+        chr->wbuf = g_malloc(chr->wbuf_size);
+        chr->wbuf_policy = backend->has_write_buffer_policy ?
+            backend->write_buffer_policy : CHARDEV_WRITE_BUFFER_POLICY_DROP;
+    }
     if (backend->has_logfile) {
         int flags = O_WRONLY | O_CREAT;
         if (backend->has_logappend &&
@@ -179,6 +194,7 @@ CharDriverState *qemu_chr_alloc(ChardevCommon *backend, Error **errp)
             error_setg_errno(errp, errno,
                              "Unable to open logfile %s",
                              backend->logfile);
+            g_free(chr->wbuf);
             g_free(chr);
             return NULL;
         }
@@ -249,6 +265,7 @@ static int qemu_chr_fe_write_buffer(CharDriverState *s, const uint8_t *buf, int
     retry:
         res = s->chr_write(s, buf + *offset, len - *offset);
         if (res < 0 && errno == EAGAIN) {
+            s->write_stalls++;
             g_usleep(100);
             goto retry;
         }
@@ -260,6 +277,7 @@ static int qemu_chr_fe_write_buffer(CharDriverState *s, const uint8_t *buf, int
         *offset += res;
     }
     if (*offset > 0) {
+        s->bytes_written += *offset;
         qemu_chr_fe_write_log(s, buf, *offset);
     }
     qemu_mutex_unlock(&s->chr_write_lock);
@@ -267,6 +285,130 @@ static int qemu_chr_fe_write_buffer(CharDriverState *s, const uint8_t *buf, int
     return res;
 }
 
+/*
+ * Write buffer.  When the backend cannot take all the output at once, the
+ * rest is queued in s->wbuf and written from the main loop when the backend
+ * becomes writable, so that front ends never wait for a slow peer.  All
+ * the functions below are called with chr_write_lock held.
+ */
+static void qemu_chr_wbuf_discard(CharDriverState *s, uint32_t len)
+{
+    s->wbuf_head = (s->wbuf_head + len) % s->wbuf_size;
+    s->wbuf_num -= len;
+}
+
+static void qemu_chr_wbuf_push(CharDriverState *s, const uint8_t *buf,
+                               uint32_t len)
+{
+    uint32_t space = s->wbuf_size - s->wbuf_num;
+    uint32_t tail, n;
+
+    if (len > space) {
+        if (s->wbuf_policy == CHARDEV_WRITE_BUFFER_POLICY_OVERWRITE) {
+            if (len > s->wbuf_size) {
+                s->bytes_overwritten += len - s->wbuf_size;
+                buf += len - s->wbuf_size;
+                len = s->wbuf_size;
+            }
+            if (len > space) {
+                s->bytes_overwritten += len - space;
+                qemu_chr_wbuf_discard(s, len - space);
+            }
+        } else {
+            s->bytes_dropped += len - space;
+            len = space;
+        }
+    }
+
+    tail = (s->wbuf_head + s->wbuf_num) % s->wbuf_size;
+    n = MIN(len, s->wbuf_size - tail);
+    memcpy(s->wbuf + tail, buf, n);
+    memcpy(s->wbuf, buf + n, len - n);
+    s->wbuf_num += len;
+}
+
+/* Returns false if the backend could not take all the buffered data */
+static bool qemu_chr_wbuf_drain(CharDriverState *s)
+{
+    int ret;
+
+    while (s->wbuf_num) {
+        ret = s->chr_write(s, s->wbuf + s->wbuf_head,
+                           MIN(s->wbuf_num, s->wbuf_size - s->wbuf_head));
+        if (ret < 0 && errno == EAGAIN) {
+            s->write_stalls++;
+            return false;
+        }
+        if (ret <= 0) {
+            /* The backend is broken, nobody is going to read this */
+            s->bytes_dropped += s->wbuf_num;
+            s->wbuf_head = s->wbuf_num = 0;
+            break;
+        }
+        s->bytes_written += ret;
+        qemu_chr_wbuf_discard(s, ret);
+    }
+    return true;
+}
+
+static gboolean qemu_chr_wbuf_flush(GIOChannel *chan, GIOCondition cond,
+                                    void *opaque)
+{
+    CharDriverState *s = opaque;
+    bool done;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    s->wbuf_flushes++;
+    done = qemu_chr_wbuf_drain(s);
+    if (!done && (cond & G_IO_HUP)) {
+        s->bytes_dropped += s->wbuf_num;
+        s->wbuf_head = s->wbuf_num = 0;
+        done = true;
+    }
+    if (done) {
+        s->wbuf_tag = 0;
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+
+    return !done;
+}
+
+static int qemu_chr_write_buffered(CharDriverState *s, const uint8_t *buf,
+                                   int len)
+{
+    int ret = 0;
+
+    /* Keep the output in order: nothing bypasses data already queued */
+    if (!s->wbuf_tag && qemu_chr_wbuf_drain(s)) {
+        ret = s->chr_write(s, buf, len);
+        if (ret < 0) {
+            if (errno != EAGAIN) {
+                return ret;
+            }
+            ret = 0;
+        }
+        s->bytes_written += ret;
+        if (ret < len) {
+            s->write_stalls++;
+        }
+    }
+
+    if (ret < len) {
+        qemu_chr_wbuf_push(s, buf + ret, len - ret);
+        if (s->wbuf_num && !s->wbuf_tag) {
+            /*
+             * If the backend cannot be polled right now (e.g. a socket
+             * that is not connected), the next write retries the drain.
+             */
+            s->wbuf_tag = qemu_chr_fe_add_watch(s, G_IO_OUT | G_IO_HUP,
+                                                qemu_chr_wbuf_flush, s);
+        }
+    }
+    qemu_chr_fe_write_log(s, buf, len);
+
+    return len;
+}
+
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
 {
     int ret;
@@ -280,10 +422,19 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     }
 
     qemu_mutex_lock(&s->chr_write_lock);
+    if (s->wbuf && !s->replay) {
+        ret = qemu_chr_write_buffered(s, buf, len);
+        qemu_mutex_unlock(&s->chr_write_lock);
+        return ret;
+    }
+
     ret = s->chr_write(s, buf, len);
 
     if (ret > 0) {
+        s->bytes_written += ret;
         qemu_chr_fe_write_log(s, buf, ret);
+    } else if (ret < 0 && errno == EAGAIN) {
+        s->write_stalls++;
     }
 
     qemu_mutex_unlock(&s->chr_write_lock);
@@ -307,6 +458,13 @@ int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
         return res;
     }
 
+    if (s->wbuf && !s->replay) {
+        qemu_mutex_lock(&s->chr_write_lock);
+        res = qemu_chr_write_buffered(s, buf, len);
+        qemu_mutex_unlock(&s->chr_write_lock);
+        return res;
+    }
+
     res = qemu_chr_fe_write_buffer(s, buf, len, &offset);
 
     if (s->replay && replay_mode == REPLAY_MODE_RECORD) {
@@ -3646,12 +3804,25 @@ fail:
 void qemu_chr_parse_common(QemuOpts *opts, ChardevCommon *backend)
 {
     const char *logfile = qemu_opt_get(opts, "logfile");
+    const char *policy = qemu_opt_get(opts, "write-buffer-policy");
 
     backend->has_logfile = logfile != NULL;
     backend->logfile = logfile ? g_strdup(logfile) : NULL;
 
     backend->has_logappend = true;
     backend->logappend = qemu_opt_get_bool(opts, "logappend", false);
+
+    backend->has_write_buffer = true;
+    backend->write_buffer = qemu_opt_get_size(opts, "write-buffer", 0);
+
+    /* Validated by qemu_chr_new_from_opts() */
+    backend->has_write_buffer_policy = policy != NULL;
+    if (policy) {
+        backend->write_buffer_policy =
+            qapi_enum_parse(ChardevWriteBufferPolicy_lookup, policy,
+                            CHARDEV_WRITE_BUFFER_POLICY__MAX,
+                            CHARDEV_WRITE_BUFFER_POLICY_DROP, &error_abort);
+    }
 }
 
 
@@ -3928,6 +4099,7 @@ CharDriverState *qemu_chr_new_from_opts(QemuOpts *opts,
     ChardevReturn *ret = NULL;
     ChardevBackend *backend;
     const char *id = qemu_opts_id(opts);
+    const char *policy = qemu_opt_get(opts, "write-buffer-policy");
     char *bid = NULL;
 
     if (qemu_opt_get(opts, "backend") == NULL) {
@@ -3950,6 +4122,16 @@ CharDriverState *qemu_chr_new_from_opts(QemuOpts *opts,
         goto err;
     }
 
+    if (policy) {
+        qapi_enum_parse(ChardevWriteBufferPolicy_lookup, policy,
+                        CHARDEV_WRITE_BUFFER_POLICY__MAX,
+                        CHARDEV_WRITE_BUFFER_POLICY_DROP, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            goto err;
+        }
+    }
+
     for (i = backends; i; i = i->next) {
         cd = i->data;
 
@@ -4138,6 +4320,7 @@ void qemu_chr_disconnect(CharDriverState *chr)
 
 static void qemu_chr_free_common(CharDriverState *chr)
 {
+    g_free(chr->wbuf);
     g_free(chr->filename);
     g_free(chr->label);
     if (chr->logfd != -1) {
@@ -4149,6 +4332,9 @@ static void qemu_chr_free_common(CharDriverState *chr)
 
 void qemu_chr_free(CharDriverState *chr)
 {
+    if (chr->wbuf_tag) {
+        g_source_remove(chr->wbuf_tag);
+    }
     if (chr->chr_close) {
         chr->chr_close(chr);
     }
@@ -4300,6 +4486,12 @@ QemuOptsList qemu_chardev_opts = {
         },{
             .name = "logappend",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "write-buffer",
+            .type = QEMU_OPT_SIZE,
+        },{
+            .name = "write-buffer-policy",
+            .type = QEMU_OPT_STRING,
         },
         { /* end of list */ }
     },
@@ -4656,6 +4848,12 @@ ChardevReturn *qmp_chardev_add(const char *id, ChardevBackend *backend,
         goto out_error;
     }
 
+    if (chr->wbuf && !chr->chr_add_watch) {
+        error_setg(errp, "chardev backend does not support write-buffer");
+        qemu_chr_free(chr);
+        goto out_error;
+    }
+
     chr->label = g_strdup(id);
     chr->avail_connections =
         (backend->type == CHARDEV_BACKEND_KIND_MUX) ? MAX_MUX : 1;
@@ -4704,6 +4902,27 @@ void qemu_chr_cleanup(void)
     }
 }
 
+static void qemu_chr_stats(StatsCollector *c, void *opaque)
+{
+    CharDriverState *chr;
+
+    QTAILQ_FOREACH(chr, &chardevs, next) {
+        if (!stats_begin_instance(c, chr->label)) {
+            continue;
+        }
+        stats_add_counter(c, "bytes-written", chr->bytes_written);
+        stats_add_counter(c, "write-stalls", chr->write_stalls);
+        if (chr->wbuf) {
+            stats_add_gauge(c, "write-buffer-size", chr->wbuf_size);
+            stats_add_gauge(c, "write-buffer-used", chr->wbuf_num);
+            stats_add_counter(c, "write-buffer-flushes", chr->wbuf_flushes);
+            stats_add_counter(c, "bytes-dropped", chr->bytes_dropped);
+            stats_add_counter(c, "bytes-overwritten",
+                              chr->bytes_overwritten);
+        }
+    }
+}
+
 static void register_types(void)
 {
     register_char_driver("null", CHARDEV_BACKEND_KIND_NULL, NULL,
@@ -4750,6 +4969,8 @@ static void register_types(void)
      * is specified
      */
     qemu_add_machine_init_done_notifier(&muxes_realize_notify);
+
+    stats_register_provider("chardev", qemu_chr_stats, NULL);
 }
 
 type_init(register_types);
@@ -28,6 +28,11 @@
 #include "qapi/qmp-output-visitor.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qint.h"
+#include "qapi/qmp/qfloat.h"
+#include "qapi/util.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
@@ -39,9 +44,13 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "block/blkrecord.h"
 #include "crypto/init.h"
+#include "crypto/cipher.h"
+#include "crypto/pbkdf.h"
 #include "trace/control.h"
 #include <getopt.h>
+#include <math.h>
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_VERSION QEMU_PKGVERSION \
                           ", " QEMU_COPYRIGHT "\n"
@@ -59,6 +68,13 @@ enum {
     OPTION_PATTERN = 260,
     OPTION_FLUSH_INTERVAL = 261,
     OPTION_NO_DRAIN = 262,
+    OPTION_RANDOM = 263,
+    OPTION_WRITE_PERCENT = 264,
+    OPTION_JOBS = 265,
+    OPTION_TIME = 266,
+    OPTION_REPLAY = 267,
+    OPTION_REPLAY_SPEED = 268,
+    OPTION_PREALLOCATION = 269,
 };
 
 typedef enum OutputFormat {
@@ -149,6 +165,9 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -1439,6 +1458,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1446,24 +1467,36 @@ typedef struct ImgConvertState {
     int64_t src_cur_offset;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1472,7 +1505,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1535,28 +1568,34 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
-    int n;
-    int ret;
+    int n, ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
-
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_pread(blk,
-                        (sector_num - s->src_cur_offset) << BDRV_SECTOR_BITS,
-                        buf, n << BDRV_SECTOR_BITS);
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_preadv(
+                blk, (sector_num - src_cur_offset) << BDRV_SECTOR_BITS,
+                n << BDRV_SECTOR_BITS, &qiov, 0);
         if (ret < 0) {
             return ret;
         }
@@ -1569,15 +1608,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1598,9 +1640,13 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
                     break;
                 }
 
-                ret = blk_pwrite_compressed(s->target,
-                                            sector_num << BDRV_SECTOR_BITS,
-                                            buf, n << BDRV_SECTOR_BITS);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov,
+                                     BDRV_REQ_WRITE_COMPRESSED);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1613,8 +1659,12 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                 buf, n << BDRV_SECTOR_BITS, 0);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov, 0);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1626,8 +1676,9 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_pwrite_zeroes(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, 0);
+            ret = blk_co_pwrite_zeroes(s->target,
+                                       sector_num << BDRV_SECTOR_BITS,
+                                       n << BDRV_SECTOR_BITS, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1642,12 +1693,122 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
-    int n;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            goto out;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            goto out;
+        }
+        /* save current sector and allocation status to local variables */
+        sector_num = s->sector_num;
+        status = s->status;
+        if (!s->min_sparse && s->status == BLK_ZERO) {
+            n = MIN(n, s->buf_sectors);
+        }
+        /* increment global sector counter so that other coroutines can
+         * already continue reading beyond this request */
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+        }
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                goto out;
+            }
+        } else if (!s->min_sparse && status == BLK_ZERO) {
+            status = BLK_DATA;
+            memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            goto out;
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited
+             * for this write to complete */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    /*
+                     * A -> B -> A cannot occur because A has
+                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                     * B will never enter A during this time window.
+                     */
+                    qemu_coroutine_enter(s->co[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1668,21 +1829,15 @@ static int convert_do_copy(ImgConvertState *s)
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
-    /* Calculate allocated sectors for progress */
-    s->allocated_sectors = 0;
-    sector_num = 0;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
@@ -1695,58 +1850,28 @@ static int convert_do_copy(ImgConvertState *s)
     s->src_cur = 0;
     s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        if (s->status == BLK_DATA) {
-            ret = convert_read(s, sector_num, n, buf);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64
-                             ": %s", sector_num, strerror(-ret));
-                goto fail;
-            }
-        } else if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-            memset(buf, 0, n * BDRV_SECTOR_SIZE);
-            s->status = BLK_DATA;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i]);
+    }
 
-        sector_num += n;
+    while (s->running_coroutines) {
+        main_loop_wait(false);
     }
 
-    if (s->compressed) {
+    if (s->ret == 0 && s->compressed) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1774,6 +1899,8 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1789,7 +1916,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1881,6 +2008,18 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1926,6 +2065,12 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
     src_flags = 0;
     ret = bdrv_parse_cache_mode(src_cache, &src_flags, &src_writethrough);
     if (ret < 0) {
@@ -2140,6 +2285,8 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3158,10 +3305,11 @@ static int img_resize(int argc, char **argv)
     Error *err = NULL;
     int c, ret, relative;
     const char *filename, *fmt, *size;
-    int64_t n, total_size;
+    int64_t n, total_size, current_size;
     bool quiet = false;
     BlockBackend *blk = NULL;
     QemuOpts *param;
+    PreallocMode prealloc = PREALLOC_MODE_OFF;
 
     static QemuOptsList resize_options = {
         .name = "resize_options",
@@ -3194,6 +3342,7 @@ static int img_resize(int argc, char **argv)
             {"help", no_argument, 0, 'h'},
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {"preallocation", required_argument, 0, OPTION_PREALLOCATION},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, "f:hq",
@@ -3223,6 +3372,15 @@ static int img_resize(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_PREALLOCATION:
+            prealloc = qapi_enum_parse(PreallocMode_lookup, optarg,
+                                       PREALLOC_MODE__MAX, PREALLOC_MODE__MAX,
+                                       NULL);
+            if (prealloc == PREALLOC_MODE__MAX) {
+                error_report("Invalid preallocation mode '%s'", optarg);
+                return 1;
+            }
+            break;
         }
     }
     if (optind != argc - 1) {
@@ -3270,8 +3428,16 @@ static int img_resize(int argc, char **argv)
         goto out;
     }
 
+    current_size = blk_getlength(blk);
+    if (current_size < 0) {
+        error_report("Failed to inquire current image length: %s",
+                     strerror(-current_size));
+        ret = -1;
+        goto out;
+    }
+
     if (relative) {
-        total_size = blk_getlength(blk) + n * relative;
+        total_size = current_size + n * relative;
     } else {
         total_size = n;
     }
@@ -3280,8 +3446,22 @@ static int img_resize(int argc, char **argv)
         ret = -1;
         goto out;
     }
+    if (prealloc != PREALLOC_MODE_OFF && total_size < current_size) {
+        error_report("Preallocation can only be used for growing images");
+        ret = -1;
+        goto out;
+    }
 
     ret = blk_truncate(blk, total_size);
+    if (ret == 0 && prealloc != PREALLOC_MODE_OFF) {
+        ret = bdrv_preallocate(blk_bs(blk), current_size,
+                               total_size - current_size, prealloc, &err);
+        if (ret < 0) {
+            error_reportf_err(err, "Image resized, but preallocation failed: ");
+            ret = -1;
+            goto out;
+        }
+    }
     switch (ret) {
     case 0:
         qprintf(quiet, "Image resized.\n");
@@ -3479,23 +3659,200 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+typedef enum BenchPattern {
+    BENCH_SEQUENTIAL,
+    BENCH_UNIFORM,
+    BENCH_ZIPF,
+} BenchPattern;
+
+/*
+ * Latency histogram: values below 16 ns have their own bucket, larger
+ * ones go to one of 16 linear sub-buckets of their power of two, which
+ * keeps percentiles within about 6%.
+ */
+#define BENCH_LAT_SUB_BITS 4
+#define BENCH_LAT_BUCKETS  ((64 - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS)
+
+typedef enum BenchStatsKind {
+    BENCH_STATS_READ,
+    BENCH_STATS_WRITE,
+    BENCH_STATS_OTHER,          /* flush, discard, write zeroes */
+    BENCH_STATS_MAX,
+} BenchStatsKind;
+
+typedef struct BenchStats {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t lat_total;
+    uint64_t lat_min;
+    uint64_t lat_max;
+    uint64_t lat_hist[BENCH_LAT_BUCKETS];
+} BenchStats;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchReq {
+    BenchData *b;
+    int64_t start;
+    BenchStatsKind kind;
+    uint8_t *buf;
+    QEMUIOVector qiov;
+} BenchReq;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int write_percent;
     int bufsize;
     int step;
     int nrreq;
-    int n;
+    int64_t count;
+    int64_t deadline;
     int flush_interval;
     bool drain_on_flush;
+    BenchPattern pattern;
+    double zipf_theta;
+    uint64_t start_offset;
+    uint64_t nr_blocks;
+    uint64_t scatter;
+    GRand *rand;
+    const BlkrecordEntry *trace;
+    bool replay_timing;
+    QEMUTimer *timer;
+    int64_t t0;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchReq *reqs;
+    BenchReq **free_reqs;
+    int nfree;
 
     int in_flight;
     bool in_flush;
+    int64_t issued;
     uint64_t offset;
-} BenchData;
+    BenchStats stats[BENCH_STATS_MAX];
+};
+
+static unsigned bench_lat_bucket(uint64_t ns)
+{
+    int e;
+
+    if (ns < (1 << BENCH_LAT_SUB_BITS)) {
+        return ns;
+    }
+    e = 63 - clz64(ns);
+    return ((e - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS) +
+           ((ns >> (e - BENCH_LAT_SUB_BITS)) & ((1 << BENCH_LAT_SUB_BITS) - 1));
+}
+
+/* The middle of the values that fall in @bucket */
+static uint64_t bench_lat_value(unsigned bucket)
+{
+    int e = (bucket >> BENCH_LAT_SUB_BITS) + BENCH_LAT_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << BENCH_LAT_SUB_BITS) - 1);
+
+    if (bucket < (1 << BENCH_LAT_SUB_BITS)) {
+        return bucket;
+    }
+    return (((1ULL << BENCH_LAT_SUB_BITS) | sub) << (e - BENCH_LAT_SUB_BITS)) +
+           (1ULL << (e - BENCH_LAT_SUB_BITS)) / 2;
+}
+
+static void bench_stats_add(BenchStats *s, uint64_t ns, uint64_t bytes)
+{
+    if (!s->ops || ns < s->lat_min) {
+        s->lat_min = ns;
+    }
+    s->lat_max = MAX(s->lat_max, ns);
+    s->lat_total += ns;
+    s->lat_hist[bench_lat_bucket(ns)]++;
+    s->ops++;
+    s->bytes += bytes;
+}
+
+static void bench_stats_merge(BenchStats *dst, const BenchStats *src)
+{
+    int i;
+
+    if (!src->ops) {
+        return;
+    }
+    if (!dst->ops || src->lat_min < dst->lat_min) {
+        dst->lat_min = src->lat_min;
+    }
+    dst->lat_max = MAX(dst->lat_max, src->lat_max);
+    dst->lat_total += src->lat_total;
+    for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        dst->lat_hist[i] += src->lat_hist[i];
+    }
+    dst->ops += src->ops;
+    dst->bytes += src->bytes;
+}
+
+/* Latency in ns below which @pct percent of the requests completed */
+static uint64_t bench_stats_percentile(const BenchStats *s, double pct)
+{
+    uint64_t target = ceil(s->ops * pct / 100), seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        seen += s->lat_hist[i];
+        if (seen >= target && seen) {
+            return MIN(MAX(bench_lat_value(i), s->lat_min), s->lat_max);
+        }
+    }
+    return s->lat_max;
+}
+
+/*
+ * Pick the rank of a block with a Zipf-like distribution, by inverting
+ * the CDF of the continuous power law with exponent theta on [1, N + 1).
+ */
+static uint64_t bench_zipf(BenchData *b)
+{
+    double n = b->nr_blocks, u = g_rand_double(b->rand), x;
+
+    if (fabs(b->zipf_theta - 1) < 0.000000001) {
+        x = pow(n + 1, u);
+    } else {
+        double a = 1 - b->zipf_theta;
+        x = pow((pow(n + 1, a) - 1) * u + 1, 1 / a);
+    }
+    return MIN((uint64_t)x - 1, b->nr_blocks - 1);
+}
+
+static uint64_t bench_gcd(uint64_t a, uint64_t b)
+{
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t block, offset;
+
+    switch (b->pattern) {
+    case BENCH_UNIFORM:
+        block = g_rand_double(b->rand) * b->nr_blocks;
+        break;
+    case BENCH_ZIPF:
+        /* Spread the hot blocks over the whole range */
+        block = (bench_zipf(b) * b->scatter) % b->nr_blocks;
+        break;
+    case BENCH_SEQUENTIAL:
+    default:
+        offset = b->offset;
+        b->offset += b->step;
+        b->offset %= b->image_size;
+        return offset;
+    }
+    return b->start_offset + MIN(block, b->nr_blocks - 1) * b->bufsize;
+}
+
+static void bench_issue(BenchData *b);
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -3505,9 +3862,22 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
-static void bench_cb(void *opaque, int ret)
+static void bench_drained_flush_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
+
+    bench_undrained_flush_cb(opaque, ret);
+
+    /* Just finished a flush with drained queue: Start next requests */
+    assert(b->in_flight == 0);
+    b->in_flush = false;
+    bench_issue(b);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchData *b = req->b;
     BlockAIOCB *acb;
 
     if (ret < 0) {
@@ -3515,56 +3885,192 @@ static void bench_cb(void *opaque, int ret)
         exit(EXIT_FAILURE);
     }
 
-    if (b->in_flush) {
-        /* Just finished a flush with drained queue: Start next requests */
-        assert(b->in_flight == 0);
-        b->in_flush = false;
-    } else if (b->in_flight > 0) {
-        int remaining = b->n - b->in_flight;
+    bench_stats_add(&b->stats[req->kind], get_clock() - req->start,
+                    req->qiov.size);
+    b->free_reqs[b->nfree++] = req;
+    b->in_flight--;
 
-        b->n--;
-        b->in_flight--;
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval &&
+        (b->deadline ? b->issued : b->count - b->issued)
+            % b->flush_interval == 0) {
+        if (!b->in_flight || !b->drain_on_flush) {
+            BlockCompletionFunc *cb;
 
-        /* Time for flush? Drain queue if requested, then flush */
-        if (b->flush_interval && remaining % b->flush_interval == 0) {
-            if (!b->in_flight || !b->drain_on_flush) {
-                BlockCompletionFunc *cb;
-
-                if (b->drain_on_flush) {
-                    b->in_flush = true;
-                    cb = bench_cb;
-                } else {
-                    cb = bench_undrained_flush_cb;
-                }
+            if (b->drain_on_flush) {
+                b->in_flush = true;
+                cb = bench_drained_flush_cb;
+            } else {
+                cb = bench_undrained_flush_cb;
+            }
 
-                acb = blk_aio_flush(b->blk, cb, b);
-                if (!acb) {
-                    error_report("Failed to issue flush request");
-                    exit(EXIT_FAILURE);
-                }
+            acb = blk_aio_flush(b->blk, cb, b);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
             }
-            if (b->drain_on_flush) {
+        }
+        if (b->drain_on_flush) {
+            return;
+        }
+    }
+
+    bench_issue(b);
+}
+
+static BlockAIOCB *bench_submit_one(BenchData *b, BenchReq *req)
+{
+    uint64_t offset = bench_next_offset(b);
+
+    if (b->write_percent == 100 ||
+        (b->write_percent &&
+         g_rand_int_range(b->rand, 0, 100) < b->write_percent)) {
+        req->kind = BENCH_STATS_WRITE;
+        return blk_aio_pwritev(b->blk, offset, &req->qiov, 0, bench_cb, req);
+    } else {
+        req->kind = BENCH_STATS_READ;
+        return blk_aio_preadv(b->blk, offset, &req->qiov, 0, bench_cb, req);
+    }
+}
+
+/* Send the next request of the trace that is being replayed */
+static BlockAIOCB *bench_replay_one(BenchData *b, BenchReq *req)
+{
+    const BlkrecordEntry *e = &b->trace[b->issued];
+
+    qemu_iovec_reset(&req->qiov);
+    switch (e->op) {
+    case BLKRECORD_OP_READ:
+        qemu_iovec_add(&req->qiov, req->buf, e->bytes);
+        req->kind = BENCH_STATS_READ;
+        return blk_aio_preadv(b->blk, e->offset, &req->qiov, 0, bench_cb, req);
+    case BLKRECORD_OP_WRITE:
+        qemu_iovec_add(&req->qiov, req->buf, e->bytes);
+        req->kind = BENCH_STATS_WRITE;
+        return blk_aio_pwritev(b->blk, e->offset, &req->qiov, 0,
+                               bench_cb, req);
+    case BLKRECORD_OP_WRITE_ZEROES:
+        req->kind = BENCH_STATS_OTHER;
+        return blk_aio_pwrite_zeroes(b->blk, e->offset, e->bytes, 0,
+                                     bench_cb, req);
+    case BLKRECORD_OP_DISCARD:
+        req->kind = BENCH_STATS_OTHER;
+        return blk_aio_pdiscard(b->blk, e->offset, e->bytes, bench_cb, req);
+    case BLKRECORD_OP_FLUSH:
+    default:
+        req->kind = BENCH_STATS_OTHER;
+        return blk_aio_flush(b->blk, bench_cb, req);
+    }
+}
+
+static void bench_issue(BenchData *b)
+{
+    BlockAIOCB *acb;
+
+    if (b->deadline && get_clock() >= b->deadline) {
+        /* Out of time: let the requests in flight complete */
+        b->count = b->issued;
+    }
+
+    while (b->issued < b->count && b->in_flight < b->nrreq) {
+        BenchReq *req;
+
+        if (b->trace && b->replay_timing) {
+            int64_t due = b->t0 + b->trace[b->issued].start;
+
+            if (get_clock() < due) {
+                timer_mod(b->timer, due);
                 return;
             }
         }
-    }
 
-    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, b->offset, b->qiov, 0,
-                                  bench_cb, b);
+        req = b->free_reqs[--b->nfree];
+        req->start = get_clock();
+        if (b->trace) {
+            acb = bench_replay_one(b, req);
         } else {
-            acb = blk_aio_preadv(b->blk, b->offset, b->qiov, 0,
-                                 bench_cb, b);
+            acb = bench_submit_one(b, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
             exit(EXIT_FAILURE);
         }
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
+        b->issued++;
+    }
+}
+
+static void bench_timer_cb(void *opaque)
+{
+    bench_issue(opaque);
+}
+
+static bool bench_done(BenchData *jobs, int nr_jobs)
+{
+    int i;
+
+    for (i = 0; i < nr_jobs; i++) {
+        if (jobs[i].in_flight || jobs[i].in_flush ||
+            jobs[i].issued < jobs[i].count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const double bench_percentiles[] = { 50, 90, 99, 99.9 };
+
+static const char *const bench_stats_names[BENCH_STATS_MAX] = {
+    [BENCH_STATS_READ] = "read",
+    [BENCH_STATS_WRITE] = "write",
+    [BENCH_STATS_OTHER] = "other",
+};
+
+static QDict *bench_stats_to_qdict(const BenchStats *s, double secs)
+{
+    QDict *dict = qdict_new();
+    QDict *pct = qdict_new();
+    int i;
+
+    qdict_put(dict, "ops", qint_from_int(s->ops));
+    qdict_put(dict, "iops", qfloat_from_double(s->ops / secs));
+    qdict_put(dict, "bytes-per-second",
+              qfloat_from_double(s->bytes / secs));
+    if (s->ops) {
+        qdict_put(dict, "latency-min-ns", qint_from_int(s->lat_min));
+        qdict_put(dict, "latency-avg-ns",
+                  qint_from_int(s->lat_total / s->ops));
+        qdict_put(dict, "latency-max-ns", qint_from_int(s->lat_max));
+        for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+            char *key = g_strdup_printf("%g", bench_percentiles[i]);
+            qdict_put(pct, key, qint_from_int(
+                          bench_stats_percentile(s, bench_percentiles[i])));
+            g_free(key);
+        }
+    }
+    qdict_put(dict, "latency-percentiles-ns", pct);
+    return dict;
+}
+
+static void bench_stats_print(const char *name, const BenchStats *s,
+                              double secs)
+{
+    int i;
+
+    if (!s->ops) {
+        return;
     }
+    printf("%s: %" PRIu64 " requests, %.0f IOPS, %.2f MB/s\n", name, s->ops,
+           s->ops / secs, s->bytes / secs / 1000000);
+    printf("  latency (us): min %.1f, avg %.1f, max %.1f\n",
+           s->lat_min / 1000., (double)s->lat_total / s->ops / 1000.,
+           s->lat_max / 1000.);
+    printf("  percentiles (us):");
+    for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+        printf(" %g%%=%.1f", bench_percentiles[i],
+               bench_stats_percentile(s, bench_percentiles[i]) / 1000.);
+    }
+    printf("\n");
 }
 
 static int img_bench(int argc, char **argv)
@@ -3573,7 +4079,7 @@ static int img_bench(int argc, char **argv)
     const char *fmt = NULL, *filename;
     bool quiet = false;
     bool image_opts = false;
-    bool is_write = false;
+    int write_percent = 0;
     int count = 75000;
     int depth = 64;
     int64_t offset = 0;
@@ -3582,13 +4088,24 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    BenchPattern access = BENCH_SEQUENTIAL;
+    double zipf_theta = 1.2;
+    int nr_jobs = 1;
+    int64_t run_time = 0;
+    const char *replay = NULL;
+    bool replay_timing = true;
+    BlkrecordEntry *trace = NULL;
+    size_t trace_len = 0;
+    OutputFormat output_format = OFORMAT_HUMAN;
     int64_t image_size;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BenchData *jobs = NULL;
+    BenchStats total[BENCH_STATS_MAX] = {};
     int flags = 0;
     bool writethrough = false;
-    struct timeval t1, t2;
-    int i;
+    int64_t t1, t2;
+    double secs;
+    int i, j;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -3597,6 +4114,13 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", required_argument, 0, OPTION_RANDOM},
+            {"write-percent", required_argument, 0, OPTION_WRITE_PERCENT},
+            {"jobs", required_argument, 0, OPTION_JOBS},
+            {"time", required_argument, 0, OPTION_TIME},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {"replay", required_argument, 0, OPTION_REPLAY},
+            {"replay-speed", required_argument, 0, OPTION_REPLAY_SPEED},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w", long_options, NULL);
@@ -3690,8 +4214,7 @@ static int img_bench(int argc, char **argv)
             }
             break;
         case 'w':
-            flags |= BDRV_O_RDWR;
-            is_write = true;
+            write_percent = 100;
             break;
         case OPTION_PATTERN:
         {
@@ -3721,6 +4244,85 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_RANDOM:
+            if (!strcmp(optarg, "uniform")) {
+                access = BENCH_UNIFORM;
+            } else if (!strcmp(optarg, "zipf")) {
+                access = BENCH_ZIPF;
+            } else if (!strncmp(optarg, "zipf:", 5)) {
+                char *end;
+                errno = 0;
+                zipf_theta = strtod(optarg + 5, &end);
+                if (errno || *end || !(zipf_theta > 0)) {
+                    error_report("Invalid Zipf exponent specified");
+                    return 1;
+                }
+                access = BENCH_ZIPF;
+            } else {
+                error_report("Invalid random distribution specified "
+                             "(expecting 'uniform' or 'zipf[:theta]')");
+                return 1;
+            }
+            break;
+        case OPTION_WRITE_PERCENT:
+        {
+            unsigned long val;
+
+            if (qemu_strtoul(optarg, NULL, 0, &val) || val > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            write_percent = val;
+            break;
+        }
+        case OPTION_JOBS:
+        {
+            unsigned long val;
+
+            if (qemu_strtoul(optarg, NULL, 0, &val) || val < 1 || val > 1024) {
+                error_report("Invalid number of jobs specified");
+                return 1;
+            }
+            nr_jobs = val;
+            break;
+        }
+        case OPTION_TIME:
+        {
+            unsigned long val;
+
+            if (qemu_strtoul(optarg, NULL, 0, &val) ||
+                val < 1 || val > INT_MAX) {
+                error_report("Invalid run time specified");
+                return 1;
+            }
+            run_time = val;
+            break;
+        }
+        case OPTION_OUTPUT:
+            if (!strcmp(optarg, "json")) {
+                output_format = OFORMAT_JSON;
+            } else if (!strcmp(optarg, "human")) {
+                output_format = OFORMAT_HUMAN;
+            } else {
+                error_report("--output must be used with human or json "
+                             "as argument.");
+                return 1;
+            }
+            break;
+        case OPTION_REPLAY:
+            replay = optarg;
+            break;
+        case OPTION_REPLAY_SPEED:
+            if (!strcmp(optarg, "original")) {
+                replay_timing = true;
+            } else if (!strcmp(optarg, "max")) {
+                replay_timing = false;
+            } else {
+                error_report("--replay-speed must be used with original or "
+                             "max as argument.");
+                return 1;
+            }
+            break;
         }
     }
 
@@ -3729,7 +4331,7 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (!write_percent && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -3739,6 +4341,39 @@ static int img_bench(int argc, char **argv)
         ret = -1;
         goto out;
     }
+    if (replay) {
+        Error *local_err = NULL;
+
+        if (write_percent || access != BENCH_SEQUENTIAL || nr_jobs > 1 ||
+            flush_interval) {
+            error_report("--replay cannot be combined with -w, "
+                         "--write-percent, --random, --jobs or "
+                         "--flush-interval");
+            ret = -1;
+            goto out;
+        }
+        trace = blkrecord_load(replay, &trace_len, &local_err);
+        if (!trace) {
+            error_report_err(local_err);
+            ret = -1;
+            goto out;
+        }
+        /* Size the request buffers for the largest request of the trace */
+        bufsize = BDRV_SECTOR_SIZE;
+        for (i = 0; i < trace_len; i++) {
+            if (trace[i].op != BLKRECORD_OP_READ) {
+                flags |= BDRV_O_RDWR;
+            }
+            bufsize = MAX(bufsize, trace[i].bytes);
+        }
+        bufsize = ROUND_UP(bufsize, 4096);
+    }
+    if (write_percent) {
+        flags |= BDRV_O_RDWR;
+    }
+    if (output_format == OFORMAT_JSON) {
+        quiet = true;
+    }
 
     blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet);
     if (!blk) {
@@ -3751,51 +4386,196 @@ static int img_bench(int argc, char **argv)
         ret = image_size;
         goto out;
     }
+    for (i = 0; i < trace_len; i++) {
+        if (trace[i].offset > image_size ||
+            trace[i].bytes > image_size - trace[i].offset) {
+            error_report("Request at offset %" PRIu64 " of the trace is "
+                         "beyond the end of the image", trace[i].offset);
+            ret = -1;
+            goto out;
+        }
+    }
+    if (access != BENCH_SEQUENTIAL &&
+        (offset >= image_size || image_size - offset < bufsize)) {
+        error_report("Image too small for random requests of %zu bytes "
+                     "from offset %" PRId64, bufsize, offset);
+        ret = -1;
+        goto out;
+    }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    jobs = g_new0(BenchData, nr_jobs);
+    for (i = 0; i < nr_jobs; i++) {
+        BenchData *b = &jobs[i];
+
+        *b = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depth,
+            .count          = replay ? trace_len :
+                              run_time ? INT64_MAX : count,
+            .write_percent  = write_percent,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+            .pattern        = access,
+            .zipf_theta     = zipf_theta,
+            .start_offset   = offset,
+            .nr_blocks      = (image_size - offset) / bufsize,
+            .rand           = g_rand_new_with_seed(i + 1),
+            .trace          = trace,
+            .replay_timing  = replay_timing,
+            .buf            = blk_blockalign(blk, depth * bufsize),
+            .reqs           = g_new0(BenchReq, depth),
+            .free_reqs      = g_new(BenchReq *, depth),
+        };
+        /* Sequential jobs each start in their own part of the image */
+        b->offset = offset;
+        if (i && offset < image_size) {
+            b->offset += QEMU_ALIGN_DOWN((image_size - offset) / nr_jobs * i,
+                                         b->step);
+            b->offset %= image_size;
+        }
+        memset(b->buf, pattern, depth * bufsize);
+        for (j = 0; j < depth; j++) {
+            b->reqs[j].b = b;
+            b->reqs[j].buf = b->buf + j * bufsize;
+            qemu_iovec_init(&b->reqs[j].qiov, 1);
+            qemu_iovec_add(&b->reqs[j].qiov, b->reqs[j].buf, bufsize);
+            b->free_reqs[b->nfree++] = &b->reqs[j];
+        }
+        if (access == BENCH_ZIPF) {
+            b->scatter = 0x9e3779b97f4a7c15ULL % b->nr_blocks;
+            while (b->nr_blocks > 1 &&
+                   (b->scatter == 0 ||
+                    bench_gcd(b->scatter, b->nr_blocks) != 1)) {
+                b->scatter++;
+            }
+            b->scatter = MAX(b->scatter, 1);
+        }
+        if (replay) {
+            b->timer = aio_timer_new(blk_get_aio_context(blk),
+                                     QEMU_CLOCK_REALTIME, SCALE_NS,
+                                     bench_timer_cb, b);
+        }
     }
 
-    data.buf = blk_blockalign(blk, data.nrreq * data.bufsize);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    if (output_format == OFORMAT_HUMAN && replay) {
+        printf("Replaying %zu requests from %s %s, up to %d in parallel\n",
+               trace_len, replay,
+               replay_timing ? "with the original timing" : "at full speed",
+               depth);
+    } else if (output_format == OFORMAT_HUMAN) {
+        static const char *const access_names[] = {
+            [BENCH_SEQUENTIAL] = "sequential",
+            [BENCH_UNIFORM] = "uniform random",
+            [BENCH_ZIPF] = "Zipf random",
+        };
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+        if (run_time) {
+            printf("Sending %s requests for %" PRId64 " seconds",
+                   access_names[access], run_time);
+        } else {
+            printf("Sending %d %s requests", count, access_names[access]);
+        }
+        printf(" (%d%% write), %zu bytes each, %d in parallel",
+               write_percent, bufsize, depth);
+        if (nr_jobs > 1) {
+            printf(" in each of %d jobs", nr_jobs);
+        }
+        printf("\n(starting at offset %" PRId64, offset);
+        if (access == BENCH_SEQUENTIAL) {
+            printf(", step size %d", jobs[0].step);
+        } else if (access == BENCH_ZIPF) {
+            printf(", Zipf exponent %g", zipf_theta);
+        }
+        printf(")\n");
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
     }
 
-    gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    t1 = get_clock();
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i].t0 = t1;
+        if (run_time) {
+            jobs[i].deadline = t1 + run_time * NANOSECONDS_PER_SECOND;
+        }
+        bench_issue(&jobs[i]);
+    }
 
-    while (data.n > 0) {
+    while (!bench_done(jobs, nr_jobs)) {
         main_loop_wait(false);
     }
-    gettimeofday(&t2, NULL);
+    t2 = get_clock();
+    secs = (double)(t2 - t1) / NANOSECONDS_PER_SECOND;
+
+    for (i = 0; i < nr_jobs; i++) {
+        for (j = 0; j < BENCH_STATS_MAX; j++) {
+            bench_stats_merge(&total[j], &jobs[i].stats[j]);
+        }
+    }
+
+    if (output_format == OFORMAT_JSON) {
+        QDict *dict = qdict_new();
+        QList *list = qlist_new();
+        QString *str;
+
+        qdict_put(dict, "seconds", qfloat_from_double(secs));
+        for (j = 0; j < BENCH_STATS_MAX; j++) {
+            qdict_put(dict, bench_stats_names[j],
+                      bench_stats_to_qdict(&total[j], secs));
+        }
+        for (i = 0; nr_jobs > 1 && i < nr_jobs; i++) {
+            QDict *job = qdict_new();
+
+            for (j = 0; j < BENCH_STATS_MAX; j++) {
+                qdict_put(job, bench_stats_names[j],
+                          bench_stats_to_qdict(&jobs[i].stats[j], secs));
+            }
+            qlist_append(list, job);
+        }
+        qdict_put(dict, "jobs", list);
+
+        str = qobject_to_json_pretty(QOBJECT(dict));
+        printf("%s\n", qstring_get_str(str));
+        QDECREF(str);
+        QDECREF(dict);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", secs);
+        for (j = 0; j < BENCH_STATS_MAX; j++) {
+            bench_stats_print(bench_stats_names[j], &total[j], secs);
+        }
+        for (i = 0; nr_jobs > 1 && i < nr_jobs; i++) {
+            uint64_t ops = 0;
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+            for (j = 0; j < BENCH_STATS_MAX; j++) {
+                ops += jobs[i].stats[j].ops;
+            }
+
+            printf("job %d: %" PRIu64 " requests, %.0f IOPS\n", i, ops,
+                   ops / secs);
+        }
+    }
 
 out:
-    qemu_vfree(data.buf);
+    if (jobs) {
+        for (i = 0; i < nr_jobs; i++) {
+            for (j = 0; j < depth; j++) {
+                qemu_iovec_destroy(&jobs[i].reqs[j].qiov);
+            }
+            qemu_vfree(jobs[i].buf);
+            if (jobs[i].timer) {
+                timer_del(jobs[i].timer);
+                timer_free(jobs[i].timer);
+            }
+            g_rand_free(jobs[i].rand);
+            g_free(jobs[i].reqs);
+            g_free(jobs[i].free_reqs);
+        }
+        g_free(jobs);
+    }
+    g_free(trace);
     blk_unref(blk);
 
     if (ret) {
@@ -3804,6 +4584,147 @@ out:
     return 0;
 }
 
+/* Encrypt @buf in 512 byte sectors, as LUKS does, for about a second */
+static double crypto_bench_cipher(QCryptoCipherAlgorithm alg,
+                                  QCryptoCipherMode mode,
+                                  uint8_t *buf, size_t bufsize)
+{
+    QCryptoCipher *cipher;
+    size_t nkey = qcrypto_cipher_get_key_len(alg);
+    size_t niv = qcrypto_cipher_get_iv_len(alg, mode);
+    uint8_t *key, *iv;
+    struct timeval t1, t2;
+    double secs, bytes = 0;
+    size_t i;
+
+    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        nkey *= 2;
+    }
+    key = g_malloc0(nkey);
+    iv = g_malloc0(MAX(niv, 1));
+    cipher = qcrypto_cipher_new(alg, mode, key, nkey, NULL);
+    if (!cipher) {
+        secs = -1;
+        goto out;
+    }
+
+    gettimeofday(&t1, NULL);
+    do {
+        for (i = 0; i + 512 <= bufsize; i += 512) {
+            if (niv) {
+                stq_le_p(iv, bytes / 512);
+                qcrypto_cipher_setiv(cipher, iv, niv, &error_abort);
+            }
+            qcrypto_cipher_encrypt(cipher, buf + i, buf + i, 512,
+                                   &error_abort);
+            bytes += 512;
+        }
+        gettimeofday(&t2, NULL);
+        secs = (t2.tv_sec - t1.tv_sec)
+               + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    } while (secs < 1);
+
+    secs = bytes / secs;
+    qcrypto_cipher_free(cipher);
+
+out:
+    g_free(key);
+    g_free(iv);
+    return secs;
+}
+
+static int img_crypto_bench(int argc, char **argv)
+{
+    static const struct {
+        QCryptoCipherAlgorithm alg;
+        QCryptoCipherMode mode;
+    } ciphers[] = {
+        { QCRYPTO_CIPHER_ALG_AES_128, QCRYPTO_CIPHER_MODE_XTS },
+        { QCRYPTO_CIPHER_ALG_AES_256, QCRYPTO_CIPHER_MODE_XTS },
+        { QCRYPTO_CIPHER_ALG_AES_128, QCRYPTO_CIPHER_MODE_CBC },
+        { QCRYPTO_CIPHER_ALG_AES_256, QCRYPTO_CIPHER_MODE_CBC },
+        { QCRYPTO_CIPHER_ALG_SERPENT_256, QCRYPTO_CIPHER_MODE_XTS },
+        { QCRYPTO_CIPHER_ALG_TWOFISH_256, QCRYPTO_CIPHER_MODE_XTS },
+    };
+    static const uint8_t salt[32];
+    size_t bufsize = 1024 * 1024;
+    uint8_t *buf;
+    int c, i;
+
+    for (;;) {
+        c = getopt(argc, argv, "hs:");
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = qemu_strtosz_suffix(optarg, &end, QEMU_STRTOSZ_DEFSUFFIX_B);
+            if (sval < 512 || sval > INT_MAX || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+
+            bufsize = sval;
+            break;
+        }
+        }
+    }
+
+    if (optind != argc) {
+        error_exit("Expecting no parameters");
+    }
+
+    printf("PBKDF2 iterations per second:\n");
+    for (i = 0; i < QCRYPTO_HASH_ALG__MAX; i++) {
+        uint64_t iters;
+
+        if (!qcrypto_pbkdf2_supports(i)) {
+            continue;
+        }
+        iters = qcrypto_pbkdf2_count_iters(i, (const uint8_t *)"password",
+                                           strlen("password"),
+                                           salt, sizeof(salt), 32, NULL);
+        if (iters == (uint64_t)-1) {
+            continue;
+        }
+        printf("  %-12s %10" PRIu64 "\n", QCryptoHashAlgorithm_lookup[i],
+               iters);
+    }
+
+    buf = qemu_memalign(64, bufsize);
+    memset(buf, 0, bufsize);
+
+    printf("Cipher throughput (MiB/s, 512 byte sectors):\n");
+    for (i = 0; i < ARRAY_SIZE(ciphers); i++) {
+        double speed;
+
+        if (!qcrypto_cipher_supports(ciphers[i].alg)) {
+            continue;
+        }
+        speed = crypto_bench_cipher(ciphers[i].alg, ciphers[i].mode,
+                                    buf, bufsize);
+        if (speed < 0) {
+            continue;
+        }
+        printf("  %-12s %-4s %10.1f\n",
+               QCryptoCipherAlgorithm_lookup[ciphers[i].alg],
+               QCryptoCipherMode_lookup[ciphers[i].mode],
+               speed / (1024 * 1024));
+    }
+
+    qemu_vfree(buf);
+    return 0;
+}
+
 #define C_BS      01
 #define C_COUNT   02
 #define C_IF      04
@@ -250,8 +250,7 @@ static void *show_parts(void *arg)
 static void *nbd_client_thread(void *arg)
 {
     char *device = arg;
-    off_t size;
-    uint16_t nbdflags;
+    NBDExportInfo info = { 0 };
     QIOChannelSocket *sioc;
     int fd;
     int ret;
@@ -266,9 +265,10 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
+    /* The kernel client does not understand structured replies */
+    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL,
                                 NULL, NULL, NULL,
-                                &size, &local_error);
+                                &info, &local_error);
     if (ret < 0) {
         if (local_error) {
             error_report_err(local_error);
@@ -283,7 +283,7 @@ static void *nbd_client_thread(void *arg)
         goto out_socket;
     }
 
-    ret = nbd_init(fd, sioc, nbdflags, size);
+    ret = nbd_init(fd, sioc, info.flags, info.size);
     if (ret < 0) {
         goto out_fd;
     }
@@ -918,6 +918,11 @@ int main(int argc, char **argv)
         }
     }
 
+    if (shared > 1) {
+        /* All connections go through the same BlockBackend, so a flush on
+         * one of them covers the writes done on the others */
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          writethrough, NULL, &local_err);
     if (!exp) {
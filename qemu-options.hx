@@ -36,6 +36,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
+    "                kvm-dirty-ring-size=n entries of the per-vCPU KVM dirty ring (default: 0, off)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
@@ -66,6 +67,12 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Track dirty guest memory with per-vCPU rings of @var{n} entries instead
+of per-slot bitmaps, so that the cost of a dirty log sync depends on the
+number of dirtied pages rather than on the size of guest memory.
+@var{n} must be a power of two; the default of 0 keeps the bitmaps.
+Needs a host kernel with KVM_CAP_DIRTY_LOG_RING.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -119,11 +126,11 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
-    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node][,host-node=node]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node][,host-node=node]\n", QEMU_ARCH_ALL)
 STEXI
-@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
-@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-node=@var{hnode}]
+@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-node=@var{hnode}]
 @findex -numa
 Simulate a multi node NUMA system. If @samp{mem}, @samp{memdev}
 and @samp{cpus} are omitted, resources are split equally. Also, note
@@ -135,6 +142,12 @@ to specify the memory backend for the @samp{memdev} suboption.
 
 @samp{mem} and @samp{memdev} are mutually exclusive.  Furthermore, if one
 node uses @samp{memdev}, all of them have to use it.
+
+@samp{host-node} places the node on host NUMA node @var{hnode}: its memory
+is bound to @var{hnode} before it is preallocated, unless the memory backend
+sets a @samp{policy} of its own, and its VCPU threads are restricted to the
+CPUs of @var{hnode}.  The QMP command @code{query-numa-placement} shows how
+much of each node's memory and how many of its VCPUs are actually local.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -518,7 +531,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -561,7 +574,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike "native", "io_uring" also works without @option{cache.direct=on}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -2275,6 +2288,15 @@ to a file to record all data transmitted via the backend. The @option{logappend}
 option controls whether the log file will be truncated or appended to when
 opened.
 
+The socket, pty, file descriptor based and spice backends also support the
+@option{write-buffer=@var{size}} option.  Output that the backend cannot
+take without blocking is then kept in a buffer of @var{size} bytes and
+written when the peer is ready, so that a slow reader never stalls the
+guest.  @option{write-buffer-policy=drop} (the default) discards new output
+when the buffer is full, @option{write-buffer-policy=overwrite} discards the
+oldest buffered output instead.  The amount of data written, buffered and
+lost is reported by @code{query-stats} under the @code{chardev} provider.
+
 Further options to each backend are described below.
 
 @item -chardev null ,id=@var{id}
@@ -2505,6 +2527,12 @@ stalled requests and force a reestablishment of the session. The timeout
 is specified in seconds. The default is 0 which means no timeout. Libiscsi
 1.15.0 or greater is required for this feature.
 
+With @option{sessions} set to a value greater than 1 (at most 16), QEMU
+logs into the target several times and spreads reads and writes over the
+sessions, so that a single LUN can use more than one TCP connection.  All
+other commands, including SCSI passthrough, use the first session.  Do not
+use this together with SCSI reservations held by the guest.
+
 Example (without authentication):
 @example
 qemu-system-i386 -iscsi initiator-name=iqn.2001-04.com.example:my-initiator \
@@ -2531,7 +2559,7 @@ DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
     "       [,initiator-name=initiator-iqn][,id=target-iqn]\n"
-    "       [,timeout=timeout]\n"
+    "       [,timeout=timeout][,sessions=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -2656,6 +2684,22 @@ which support cookies, otherwise ignored.
 Set the timeout in seconds of the CURL connection. This timeout is the time
 that CURL waits for a response from the remote server to get the size of the
 image to be downloaded. If not set, the default timeout of 5 seconds is used.
+
+@item connections
+The maximum number of range requests in flight at the same time. With HTTP/2
+they are multiplexed over a single connection. It defaults to 8 and can be at
+most 64.
+
+@item readahead-max
+While the guest reads sequentially, the readahead doubles with every request
+to the server, up to this size. It defaults to 4M, or to @option{readahead} if
+that is larger; set it to the same value as @option{readahead} to keep the
+readahead fixed.
+
+@item cache-file
+Keep the data read from the server in this local file, so that reading the
+same blocks again, in this or a later run, does not go to the network. The
+file is sparse and is reused only for the same URL and image size.
 @end table
 
 Note that when passing options to qemu explicitly, @option{driver} is the value
@@ -3529,6 +3573,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:path\n" \
+    "                load the migration stream saved in the given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3547,6 +3593,10 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{path}
+Load the migration stream that was saved to @var{path} with a file: migration
+URI.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -3786,6 +3836,13 @@ The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
 
+When the @option{prealloc} boolean option is set, the whole region is
+faulted in at creation time. The @option{prealloc-threads} option sets
+how many threads do so in parallel; the default of 0 uses one thread per
+host CPU, up to 16. Any @option{host-nodes} policy is applied before
+preallocation, so the pages land on the requested nodes regardless of
+which thread touches them.
+
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
 Creates a random number generator backend which obtains entropy from
@@ -3910,13 +3967,16 @@ The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
 @item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},
-outdev=@var{chardevid}
+outdev=@var{chardevid}[,workers=@var{n}]
 
 Colo-compare gets packet from primary_in@var{chardevid} and secondary_in@var{chardevid}, than compare primary packet with
 secondary packet. If the packets are same, we will output primary
 packet to outdev@var{chardevid}, else we will notify colo-frame
 do checkpoint and send primary packet to outdev@var{chardevid}.
 
+The packets are compared by @var{n} worker threads (default 1); all
+the packets of a connection are compared by the same worker.
+
 we must use it with the help of filter-mirror and filter-redirector.
 
 @example
@@ -4025,6 +4085,32 @@ contents of @code{iv.b64} to the second secret
          data=$SECRET,iv=$(<iv.b64)
 @end example
 
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{factor}][,poll-shrink=@var{factor}][,thread-pool-min=@var{n}][,thread-pool-max=@var{n}][,thread-pool-node=@var{node}][,cpu-affinity=@var{cpus}]
+
+Creates a dedicated event loop thread that devices can be assigned to,
+for example with @option{-device virtio-blk-pci,iothread=@var{id}}.
+
+Before blocking, the thread busy waits for up to @var{poll-max-ns}
+nanoseconds for new requests and completions, which avoids the wakeup
+latency of sleeping.  The polling time adapts to the workload: it is
+multiplied by @var{poll-grow} while events arrive shortly after polling
+stops, and divided by @var{poll-shrink} (or reset to zero, if
+@var{poll-shrink} is 0) when blocking would have taken longer than
+@var{poll-max-ns}.  The default @var{poll-max-ns} is 32768 on Linux
+hosts; 0 disables polling.  A factor of 0 selects the default.
+
+Blocking work such as file I/O with @option{aio=threads} is handed to a
+pool of worker threads.  The pool grows on demand up to
+@var{thread-pool-max} workers (default 64); idle workers exit after a
+while, but @var{thread-pool-min} of them (default 0) are always kept.
+With @var{thread-pool-node}, the workers only run on the CPUs of that
+host NUMA node (Linux only); by default they inherit the CPU affinity of
+the IOThread.
+
+@var{cpu-affinity} binds the thread to a list of host CPUs such as
+@code{2-3} or @code{0,4,8-11} (Linux only).  Otherwise the thread inherits
+the CPU affinity of the thread that created it.
+
 @end table
 
 ETEXI
@@ -27,6 +27,7 @@
 #include "qemu/timer.h"
 #include "sysemu/replay.h"
 #include "sysemu/sysemu.h"
+#include "qmp-commands.h"
 
 #ifdef CONFIG_POSIX
 #include <pthread.h>
@@ -62,12 +63,26 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * used by different AioContexts / threads. Each clock also has
  * a list of the QEMUTimerLists associated with it, in order that
  * reenabling the clock can call all the notifiers.
+ *
+ * The active timers are kept in a binary min-heap ordered by expire time
+ * (and by arming order for equal expire times), so that arming and
+ * deleting a timer are O(log n) and the next deadline is O(1).
  */
 
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    QEMUTimer **active_timers;
+    int nr_active_timers;
+    int active_timers_size;
+    uint64_t next_seq;
+
+    /* Statistics, protected by active_timers_lock */
+    uint64_t rearms;
+    uint64_t expirations;
+    int64_t lateness_total_ns;
+    int64_t lateness_max_ns;
+
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -94,6 +109,92 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+/* Return the timer that expires first, or NULL.  Needs active_timers_lock */
+static QEMUTimer *timerlist_first(QEMUTimerList *timer_list)
+{
+    return timer_list->nr_active_timers ? timer_list->active_timers[0] : NULL;
+}
+
+static bool timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static void timerlist_heap_set(QEMUTimerList *timer_list, int i,
+                               QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timerlist_heap_up(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
+            break;
+        }
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
+    }
+    timerlist_heap_set(timer_list, i, ts);
+}
+
+static void timerlist_heap_down(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer **heap = timer_list->active_timers;
+    QEMUTimer *ts = heap[i];
+    int n = timer_list->nr_active_timers;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && timer_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!timer_before(heap[child], ts)) {
+            break;
+        }
+        timerlist_heap_set(timer_list, i, heap[child]);
+        i = child;
+    }
+    timerlist_heap_set(timer_list, i, ts);
+}
+
+static void timerlist_heap_insert(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    if (timer_list->nr_active_timers == timer_list->active_timers_size) {
+        timer_list->active_timers_size =
+            MAX(16, timer_list->active_timers_size * 2);
+        timer_list->active_timers = g_renew(QEMUTimer *,
+                                            timer_list->active_timers,
+                                            timer_list->active_timers_size);
+    }
+    ts->seq = timer_list->next_seq++;
+    timerlist_heap_set(timer_list, timer_list->nr_active_timers++, ts);
+    timerlist_heap_up(timer_list, ts->heap_index);
+}
+
+static void timerlist_heap_remove(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last;
+
+    assert(timer_list->active_timers[i] == ts);
+    last = timer_list->active_timers[--timer_list->nr_active_timers];
+    if (last != ts) {
+        timerlist_heap_set(timer_list, i, last);
+        timerlist_heap_down(timer_list, i);
+        timerlist_heap_up(timer_list, last->heap_index);
+    }
+    ts->heap_index = -1;
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
@@ -118,6 +219,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -174,7 +276,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return timer_list->nr_active_timers != 0;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -188,11 +290,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nr_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_first(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -223,11 +325,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nr_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_first(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -339,6 +441,7 @@ void timer_init_tl(QEMUTimer *ts,
     ts->opaque = opaque;
     ts->scale = scale;
     ts->expire_time = -1;
+    ts->heap_index = -1;
 }
 
 void timer_deinit(QEMUTimer *ts)
@@ -354,41 +457,21 @@ void timer_free(QEMUTimer *ts)
 
 static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
     ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (ts->heap_index >= 0) {
+        timerlist_heap_remove(timer_list, ts);
     }
 }
 
+/* Returns true if @ts is now the first timer to expire */
 static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
                                 QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
-    for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    timerlist_heap_insert(timer_list, ts);
+    timer_list->rearms++;
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -417,11 +500,25 @@ void timer_del(QEMUTimer *ts)
 void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
 {
     QEMUTimerList *timer_list = ts->timer_list;
+    int64_t old_deadline = INT64_MAX;
     bool rearm;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
+    if (timer_list->nr_active_timers) {
+        old_deadline = timer_list->active_timers[0]->expire_time;
+    }
     timer_del_locked(timer_list, ts);
     rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
+    /*
+     * Moving the first timer later does not need a wakeup: whoever waits
+     * on the list wakes up at the old deadline and computes the new one.
+     * Guests that reprogram a one-shot timer on every tick would otherwise
+     * kick the main loop each time.  With icount nobody waits on
+     * QEMU_CLOCK_VIRTUAL deadlines, and the warp timer must be recomputed
+     * on every change.
+     */
+    rearm = rearm && (ts->expire_time < old_deadline ||
+                      !qemu_clock_use_for_deadline(timer_list->clock->type));
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     if (rearm) {
@@ -482,7 +579,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     void *opaque;
 
     qemu_event_reset(&timer_list->timers_done_ev);
-    if (!timer_list->clock->enabled || !timer_list->active_timers) {
+    if (!timer_list->clock->enabled || !timer_list->nr_active_timers) {
         goto out;
     }
 
@@ -510,16 +607,19 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timerlist_first(timer_list);
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
+        timer_list->expirations++;
+        timer_list->lateness_total_ns += current_time - ts->expire_time;
+        timer_list->lateness_max_ns = MAX(timer_list->lateness_max_ns,
+                                          current_time - ts->expire_time);
+
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
@@ -655,3 +755,39 @@ bool qemu_clock_run_all_timers(void)
 
     return progress;
 }
+
+static const char *const clock_names[QEMU_CLOCK_MAX] = {
+    [QEMU_CLOCK_REALTIME] = "realtime",
+    [QEMU_CLOCK_VIRTUAL] = "virtual",
+    [QEMU_CLOCK_HOST] = "host",
+    [QEMU_CLOCK_VIRTUAL_RT] = "virtual-rt",
+};
+
+/* Caller should hold BQL, which protects the clocks' lists of timerlists */
+TimerListInfoList *qmp_query_timers(Error **errp)
+{
+    TimerListInfoList *head = NULL, **prev = &head;
+    QEMUTimerList *tl;
+    QEMUClockType type;
+
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        QLIST_FOREACH(tl, &qemu_clock_ptr(type)->timerlists, list) {
+            TimerListInfoList *entry = g_new0(TimerListInfoList, 1);
+            TimerListInfo *info = g_new0(TimerListInfo, 1);
+
+            info->clock = g_strdup(clock_names[type]);
+            qemu_mutex_lock(&tl->active_timers_lock);
+            info->active = tl->nr_active_timers;
+            info->rearms = tl->rearms;
+            info->expirations = tl->expirations;
+            info->lateness_total = tl->lateness_total_ns;
+            info->lateness_max = tl->lateness_max_ns;
+            qemu_mutex_unlock(&tl->active_timers_lock);
+
+            entry->value = info;
+            *prev = entry;
+            prev = &entry->next;
+        }
+    }
+    return head;
+}
@@ -63,6 +63,13 @@ struct TypeImpl
     const char *parent;
     TypeImpl *parent_type;
 
+    /*
+     * Filled in by type_initialize: the chain of parents from the root
+     * down to this type, so ancestors[depth] == this type.
+     */
+    int depth;
+    TypeImpl **ancestors;
+
     ObjectClass *class;
 
     int num_interfaces;
@@ -214,6 +221,12 @@ static bool type_is_ancestor(TypeImpl *type, TypeImpl *target_type)
 {
     assert(target_type);
 
+    /* Constant time once both types are initialized */
+    if (type && type->ancestors && target_type->ancestors) {
+        return target_type->depth <= type->depth &&
+               type->ancestors[target_type->depth] == target_type;
+    }
+
     /* Check if target_type is a direct ancestor of type */
     while (type) {
         if (type == target_type) {
@@ -278,6 +291,16 @@ static void type_initialize(TypeImpl *ti)
     parent = type_get_parent(ti);
     if (parent) {
         type_initialize(parent);
+        ti->depth = parent->depth + 1;
+    }
+    ti->ancestors = g_new(TypeImpl *, ti->depth + 1);
+    if (parent) {
+        memcpy(ti->ancestors, parent->ancestors,
+               ti->depth * sizeof(*ti->ancestors));
+    }
+    ti->ancestors[ti->depth] = ti;
+
+    if (parent) {
         GSList *e;
         int i;
 
@@ -1026,22 +1049,21 @@ ObjectProperty *object_property_iter_next(ObjectPropertyIterator *iter)
 ObjectProperty *object_class_property_find(ObjectClass *klass, const char *name,
                                            Error **errp)
 {
+    TypeImpl *type = klass->type;
     ObjectProperty *prop;
-    ObjectClass *parent_klass;
+    int i;
 
-    parent_klass = object_class_get_parent(klass);
-    if (parent_klass) {
-        prop = object_class_property_find(parent_klass, name, NULL);
+    /* Look in the parents first, starting from the root */
+    for (i = 0; i <= type->depth; i++) {
+        prop = g_hash_table_lookup(type->ancestors[i]->class->properties,
+                                   name);
         if (prop) {
             return prop;
         }
     }
 
-    prop = g_hash_table_lookup(klass->properties, name);
-    if (!prop) {
-        error_setg(errp, "Property '.%s' not found", name);
-    }
-    return prop;
+    error_setg(errp, "Property '.%s' not found", name);
+    return NULL;
 }
 
 void object_property_del(Object *obj, const char *name, Error **errp)
@@ -26,10 +26,48 @@ static QemuMutex lock;
 /* File for replay writing */
 FILE *replay_file;
 
+/* The log goes through this buffer rather than through one stdio call,
+   which locks the FILE, per byte.  In record mode it holds buf_pos bytes
+   not yet written; in play mode bytes buf_pos to buf_len are not read yet.
+   Protected by the mutex like the file itself. */
+#define REPLAY_BUF_SIZE (64 * 1024)
+static uint8_t replay_buf[REPLAY_BUF_SIZE];
+static size_t replay_buf_pos;
+static size_t replay_buf_len;
+
+void replay_flush_log(void)
+{
+    if (replay_file && replay_mode == REPLAY_MODE_RECORD && replay_buf_pos) {
+        if (fwrite(replay_buf, 1, replay_buf_pos, replay_file) !=
+            replay_buf_pos) {
+            error_report("replay write error");
+        }
+        replay_buf_pos = 0;
+    }
+}
+
+int64_t replay_log_tell(void)
+{
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        return ftell(replay_file) + replay_buf_pos;
+    }
+    return ftell(replay_file) - (replay_buf_len - replay_buf_pos);
+}
+
+void replay_log_seek(int64_t offset)
+{
+    replay_flush_log();
+    replay_buf_pos = replay_buf_len = 0;
+    fseek(replay_file, offset, SEEK_SET);
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        putc(byte, replay_file);
+        if (replay_buf_pos == REPLAY_BUF_SIZE) {
+            replay_flush_log();
+        }
+        replay_buf[replay_buf_pos++] = byte;
     }
 }
 
@@ -58,19 +96,60 @@ void replay_put_qword(int64_t qword)
     replay_put_dword(qword);
 }
 
+/* Unsigned LEB128: 7 bits per byte, the top bit is set if more follow */
+void replay_put_packed(uint64_t value)
+{
+    while (value >= 0x80) {
+        replay_put_byte(value | 0x80);
+        value >>= 7;
+    }
+    replay_put_byte(value);
+}
+
 void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        fwrite(buf, 1, size, replay_file);
+        if (size > REPLAY_BUF_SIZE - replay_buf_pos) {
+            replay_flush_log();
+        }
+        if (size > REPLAY_BUF_SIZE) {
+            fwrite(buf, 1, size, replay_file);
+        } else {
+            memcpy(replay_buf + replay_buf_pos, buf, size);
+            replay_buf_pos += size;
+        }
     }
 }
 
+/* Read up to @size bytes of the log into @buf, return the number read */
+static size_t replay_read(uint8_t *buf, size_t size)
+{
+    size_t done = MIN(size, replay_buf_len - replay_buf_pos);
+
+    memcpy(buf, replay_buf + replay_buf_pos, done);
+    replay_buf_pos += done;
+    if (done < size) {
+        done += fread(buf + done, 1, size - done, replay_file);
+    }
+    return done;
+}
+
 uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        if (replay_buf_pos == replay_buf_len) {
+            replay_buf_pos = 0;
+            replay_buf_len = fread(replay_buf, 1, REPLAY_BUF_SIZE,
+                                   replay_file);
+        }
+        if (replay_buf_pos < replay_buf_len) {
+            byte = replay_buf[replay_buf_pos++];
+        } else {
+            /* like getc(); replay_check_error() reports the end of file */
+            byte = EOF;
+        }
     }
     return byte;
 }
@@ -108,11 +187,28 @@ int64_t replay_get_qword(void)
     return qword;
 }
 
+uint64_t replay_get_packed(void)
+{
+    uint64_t value = 0;
+    unsigned int shift = 0;
+    uint8_t byte;
+
+    if (replay_file) {
+        do {
+            byte = replay_get_byte();
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while ((byte & 0x80) && shift < 64);
+    }
+
+    return value;
+}
+
 void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (replay_read(buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -123,7 +219,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (replay_read(*buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -132,7 +228,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (replay_buf_pos == replay_buf_len && feof(replay_file)) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
@@ -150,7 +246,7 @@ void replay_fetch_data_kind(void)
         if (!replay_state.has_unread_data) {
             replay_state.data_kind = replay_get_byte();
             if (replay_state.data_kind == EVENT_INSTRUCTION) {
-                replay_state.instructions_count = replay_get_dword();
+                replay_state.instructions_count = replay_get_packed();
             }
             replay_check_error();
             replay_state.has_unread_data = 1;
@@ -197,7 +293,7 @@ void replay_save_instructions(void)
         int diff = (int)(replay_get_current_step() - replay_state.current_step);
         if (diff > 0) {
             replay_put_event(EVENT_INSTRUCTION);
-            replay_put_dword(diff);
+            replay_put_packed(diff);
             replay_state.current_step += diff;
         }
         replay_mutex_unlock();
@@ -83,15 +83,25 @@ void replay_put_event(uint8_t event);
 void replay_put_word(uint16_t word);
 void replay_put_dword(uint32_t dword);
 void replay_put_qword(int64_t qword);
+void replay_put_packed(uint64_t value);
 void replay_put_array(const uint8_t *buf, size_t size);
 
 uint8_t replay_get_byte(void);
 uint16_t replay_get_word(void);
 uint32_t replay_get_dword(void);
 int64_t replay_get_qword(void);
+uint64_t replay_get_packed(void);
 void replay_get_array(uint8_t *buf, size_t *size);
 void replay_get_array_alloc(uint8_t **buf, size_t *size);
 
+/*! Writes the buffered part of the log to the file. */
+void replay_flush_log(void);
+/*! Returns the offset of the next byte to read or write in the log,
+    taking the buffer into account. */
+int64_t replay_log_tell(void);
+/*! Flushes or drops the buffer, and moves to @offset in the log. */
+void replay_log_seek(int64_t offset);
+
 /* Mutex functions for protecting replay log file */
 
 void replay_mutex_init(void);
@@ -21,7 +21,7 @@
 
 /* Current version of the replay mechanism.
    Increase it when file format changes. */
-#define REPLAY_VERSION              0xe02004
+#define REPLAY_VERSION              0xe02005
 /* Size of replay log header */
 #define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
 
@@ -244,7 +244,7 @@ static void replay_enable(const char *fname, int mode)
 
     /* skip file header for RECORD and check it for PLAY */
     if (replay_mode == REPLAY_MODE_RECORD) {
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_log_seek(HEADER_SIZE);
     } else if (replay_mode == REPLAY_MODE_PLAY) {
         unsigned int version = replay_get_dword();
         if (version != REPLAY_VERSION) {
@@ -252,7 +252,7 @@ static void replay_enable(const char *fname, int mode)
             exit(1);
         }
         /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_log_seek(HEADER_SIZE);
         replay_fetch_data_kind();
     }
 
@@ -334,8 +334,9 @@ void replay_finish(void)
             replay_put_event(EVENT_END);
 
             /* write header */
-            fseek(replay_file, 0, SEEK_SET);
+            replay_log_seek(0);
             replay_put_dword(REPLAY_VERSION);
+            replay_flush_log();
         }
 
         fclose(replay_file);
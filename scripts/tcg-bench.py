@@ -0,0 +1,133 @@
+#!/usr/bin/env python
+#
+# Run the TCG micro-benchmarks under one or more QEMU user mode binaries
+#
+# Copyright (C) 2016 QEMU contributors
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: tcg-bench.py [options] BENCH-BINARY QEMU [QEMU...]
+#
+# BENCH-BINARY is tests/tcg/tcg-bench.c built for the guest architecture,
+# each QEMU is a qemu-<arch> binary (for example from builds of two
+# different commits).  For every QEMU the benchmark is run --runs times
+# and the best rate of each kernel is reported, together with the
+# translation statistics that "-d jit" logs at exit.  Timings of the
+# translator itself need a QEMU configured with --enable-profiler.
+
+import json
+import optparse
+import os
+import subprocess
+import sys
+import tempfile
+
+# Translation statistics reported, as "label: log line prefix"
+STATS = [
+    ('TBs', 'TB count'),
+    ('insns/TB', 'avg guest insns/TB'),
+    ('host bytes/insn', 'avg host code/insn'),
+    ('helper calls/TB', 'avg helper calls/TB'),
+    ('JIT cycles/TB', 'cycles/TB'),
+]
+
+
+def parse_stats(log):
+    stats = {}
+    for line in log.splitlines():
+        for label, prefix in STATS:
+            if line.startswith(prefix + ' '):
+                value = line[len(prefix):].split()[0]
+                try:
+                    stats[label] = float(value)
+                except ValueError:
+                    pass
+    return stats
+
+
+def run_once(qemu, bench, scale, kernel):
+    fd, logname = tempfile.mkstemp(prefix='tcg-bench-', suffix='.log')
+    os.close(fd)
+    try:
+        args = [qemu, '-d', 'jit', '-D', logname, bench, str(scale)]
+        if kernel:
+            args.append(kernel)
+        out = subprocess.check_output(args)
+        if not isinstance(out, str):
+            out = out.decode()
+        with open(logname) as f:
+            log = f.read()
+    finally:
+        os.unlink(logname)
+
+    results = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 5:
+            continue
+        name, iters, secs, rate, check = fields
+        results[name] = {'rate': float(rate), 'check': check}
+    return results, parse_stats(log)
+
+
+def run(qemu, bench, opts):
+    best = {}
+    stats = {}
+    for i in range(opts.runs):
+        results, stats = run_once(qemu, bench, opts.scale, opts.kernel)
+        for name, r in results.items():
+            if name in best and best[name]['check'] != r['check']:
+                sys.stderr.write('%s: checksum of %s changed between runs\n'
+                                 % (qemu, name))
+            if name not in best or r['rate'] > best[name]['rate']:
+                best[name] = r
+    return {'kernels': dict((k, v['rate']) for k, v in best.items()),
+            'stats': stats}
+
+
+def print_table(names, data):
+    kernels = sorted(set(k for d in data for k in d['kernels']))
+    width = max([len(l) for l, p in STATS] + [len(k) for k in kernels])
+    hdr = ''.join('%16s' % os.path.basename(n)[-15:] for n in names)
+    print('%-*s %s' % (width, 'Miter/s', hdr))
+    for k in kernels:
+        row = ''
+        for d in data:
+            v = d['kernels'].get(k)
+            row += '%16s' % ('%.2f' % v if v is not None else '-')
+        print('%-*s %s' % (width, k, row))
+    print('')
+    for label, prefix in STATS:
+        row = ''
+        for d in data:
+            v = d['stats'].get(label)
+            row += '%16s' % ('%.2f' % v if v is not None else '-')
+        print('%-*s %s' % (width, label, row))
+
+
+def main():
+    parser = optparse.OptionParser(
+        usage='%prog [options] BENCH-BINARY QEMU [QEMU...]')
+    parser.add_option('-n', '--runs', type='int', default=3,
+                      help='runs for each QEMU binary (default 3)')
+    parser.add_option('-s', '--scale', type='float', default=1.0,
+                      help='scale the number of iterations (default 1.0)')
+    parser.add_option('-k', '--kernel', default=None,
+                      help='only run the named kernel')
+    parser.add_option('--json', action='store_true', default=False,
+                      help='print the results as JSON')
+    opts, args = parser.parse_args()
+    if len(args) < 2:
+        parser.error('need a benchmark binary and at least one QEMU')
+
+    bench, qemus = args[0], args[1:]
+    data = [run(q, bench, opts) for q in qemus]
+    if opts.json:
+        print(json.dumps(dict(zip(qemus, data)), indent=2, sort_keys=True))
+    else:
+        print_table(qemus, data)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -20,11 +20,17 @@ All backends must generate their contents through the 'tracetool.out' routine.
 Backend attributes
 ------------------
 
-========= ====================================================================
-Attribute Description
-========= ====================================================================
-PUBLIC    If exists and is set to 'True', the backend is considered "public".
-========= ====================================================================
+=========================== ==================================================
+Attribute                   Description
+=========================== ==================================================
+PUBLIC                      If exists and is set to 'True', the backend is
+                            considered "public".
+CHECK_TRACE_EVENT_GET_STATE If exists and is set to 'True', the backend only
+                            emits events that are enabled (as returned by
+                            'trace_event_get_state'), so that the check can be
+                            done once by the generic code before the backends
+                            are called.
+=========================== ==================================================
 
 
 Backend functions
@@ -106,6 +112,12 @@ class Wrapper:
             assert exists(backend)
         assert tracetool.format.exists(self._format)
 
+        modules = [tracetool.try_import("tracetool.backend." + backend)[1]
+                   for backend in self._backends]
+        self.check_trace_event_get_state = all(
+            getattr(module, "CHECK_TRACE_EVENT_GET_STATE", False)
+            for module in modules if module is not None)
+
     def _run_function(self, name, *args, **kwargs):
         for backend in self._backends:
             func = tracetool.try_import("tracetool.backend." + backend,
@@ -17,6 +17,7 @@ from tracetool import out
 
 
 PUBLIC = True
+CHECK_TRACE_EVENT_GET_STATE = True
 
 
 def is_string(arg):
@@ -36,7 +37,17 @@ def generate_h_begin(events):
 
 
 def generate_h(event):
-    out('        _simple_%(api)s(%(args)s);',
+    if "vcpu" in event.properties:
+        # already checked on the generic format code
+        cond = "true"
+    else:
+        cond = "trace_event_get_state(%s)" % ("TRACE_" + event.name.upper())
+
+    # Check inline, so that disabled events do not cost a function call
+    out('        if (%(cond)s) {',
+        '            _simple_%(api)s(%(args)s);',
+        '        }',
+        cond=cond,
         api=event.api(),
         args=", ".join(event.args.names()))
 
@@ -69,21 +80,12 @@ def generate_c(event):
         sizestr = '0'
 
     event_id = 'TRACE_' + event.name.upper()
-    if "vcpu" in event.properties:
-        # already checked on the generic format code
-        cond = "true"
-    else:
-        cond = "trace_event_get_state(%s)" % event_id
 
+    # The caller has checked that the event is enabled
     out('',
-        '    if (!%(cond)s) {',
-        '        return;',
-        '    }',
-        '',
         '    if (trace_record_start(&rec, %(event_id)s, %(size_str)s)) {',
         '        return; /* Trace Buffer Full, Event Dropped ! */',
         '    }',
-        cond=cond,
         event_id=event_id,
         size_str=sizestr)
 
@@ -37,6 +37,10 @@ def generate(events, backend):
                    % dict(
                        cpu=trace_cpu,
                        id=e.name.upper())
+        elif backend.check_trace_event_get_state:
+            # A single check for all backends; what the backends check
+            # again right after is folded away by the compiler
+            cond = "trace_event_get_state(TRACE_%s)" % e.name.upper()
         else:
             cond = "true"
 
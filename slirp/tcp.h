@@ -38,8 +38,15 @@ typedef	uint32_t tcp_seq;
 #define      PR_SLOWHZ       2               /* 2 slow timeouts per second (approx) */
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/*
+ * so_rcv holds guest data on its way to the host socket, and its free
+ * space is the window advertised to the guest.  Window scaling is not
+ * negotiated, so anything beyond TCP_MAXWIN would never be advertised.
+ * so_snd holds host data on its way to the guest; it can be larger, so
+ * that a single soread() picks up more data from the host socket.
+ */
+#define TCP_SNDSPACE (128 * 1024)
+#define TCP_RCVSPACE (64 * 1024)
 
 /*
  * TCP header.
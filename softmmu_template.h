@@ -371,9 +371,26 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
             tlb_fill(ENV_GET_CPU(env), page2, MMU_DATA_STORE,
                      mmu_idx, retaddr);
         }
+        tlb_addr2 = env->tlb_table[mmu_idx][index2].addr_write;
+
+        /* If both pages are plain RAM, store the two pieces directly.  */
+        if (likely(!((tlb_addr | tlb_addr2) & ~TARGET_PAGE_MASK))) {
+            uint8_t buf[DATA_SIZE];
+            size_t len1 = page2 - addr;
+
+            for (i = 0; i < DATA_SIZE; ++i) {
+                /* Little-endian extract.  */
+                buf[i] = val >> (i * 8);
+            }
+            haddr = addr + env->tlb_table[mmu_idx][index].addend;
+            memcpy((void *)haddr, buf, len1);
+            haddr = page2 + env->tlb_table[mmu_idx][index2].addend;
+            memcpy((void *)haddr, buf + len1, DATA_SIZE - len1);
+            return;
+        }
 
-        /* XXX: not efficient, but simple.  */
-        /* This loop must go in the forward direction to avoid issues
+        /* MMIO or dirty tracking on one of the pages: go byte by byte.
+           This loop must go in the forward direction to avoid issues
            with self-modifying code in Windows 64-bit.  */
         for (i = 0; i < DATA_SIZE; ++i) {
             /* Little-endian extract.  */
@@ -449,9 +466,26 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
             tlb_fill(ENV_GET_CPU(env), page2, MMU_DATA_STORE,
                      mmu_idx, retaddr);
         }
+        tlb_addr2 = env->tlb_table[mmu_idx][index2].addr_write;
+
+        /* If both pages are plain RAM, store the two pieces directly.  */
+        if (likely(!((tlb_addr | tlb_addr2) & ~TARGET_PAGE_MASK))) {
+            uint8_t buf[DATA_SIZE];
+            size_t len1 = page2 - addr;
+
+            for (i = 0; i < DATA_SIZE; ++i) {
+                /* Big-endian extract.  */
+                buf[i] = val >> (((DATA_SIZE - 1) * 8) - (i * 8));
+            }
+            haddr = addr + env->tlb_table[mmu_idx][index].addend;
+            memcpy((void *)haddr, buf, len1);
+            haddr = page2 + env->tlb_table[mmu_idx][index2].addend;
+            memcpy((void *)haddr, buf + len1, DATA_SIZE - len1);
+            return;
+        }
 
-        /* XXX: not efficient, but simple */
-        /* This loop must go in the forward direction to avoid issues
+        /* MMIO or dirty tracking on one of the pages: go byte by byte.
+           This loop must go in the forward direction to avoid issues
            with self-modifying code.  */
         for (i = 0; i < DATA_SIZE; ++i) {
             /* Big-endian extract.  */
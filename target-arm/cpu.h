@@ -176,6 +176,13 @@ typedef struct CPUARMState {
     uint32_t VF; /* V is the bit 31. All other bits are undefined */
     uint32_t NF; /* N is bit 31. All other bits are undefined.  */
     uint32_t ZF; /* Z set if zero.  */
+    /* A64 code computes NZCV lazily: unless cc_op is CC_OP_FLAGS, the four
+     * fields above are stale and the flags are those of the operation
+     * cc_op on cc_src and cc_src2.  Use arm_cc_sync() before reading them.
+     */
+    uint32_t cc_op;
+    uint64_t cc_src;
+    uint64_t cc_src2;
     uint32_t QF; /* 0 or 1 */
     uint32_t GE; /* cpsr[19:16] */
     uint32_t thumb; /* cpsr[5]. 0 = arm mode, 1 = thumb mode. */
@@ -888,6 +895,27 @@ static inline unsigned int aarch64_pstate_mode(unsigned int el, bool handler)
     return (el << 2) | handler;
 }
 
+/* Values of env->cc_op */
+enum {
+    CC_OP_FLAGS = 0,    /* NF, ZF, CF and VF are valid */
+    CC_OP_ADD32,        /* cc_src + cc_src2, 32 bit */
+    CC_OP_ADD64,        /* cc_src + cc_src2, 64 bit */
+    CC_OP_SUB32,        /* cc_src - cc_src2, 32 bit */
+    CC_OP_SUB64,        /* cc_src - cc_src2, 64 bit */
+    CC_OP_LOGIC32,      /* result in cc_src, C and V clear, 32 bit */
+    CC_OP_LOGIC64,      /* result in cc_src, C and V clear, 64 bit */
+};
+
+void arm_cc_compute(CPUARMState *env);
+
+/* Make env->NF, ZF, CF and VF valid */
+static inline void arm_cc_sync(CPUARMState *env)
+{
+    if (env->cc_op != CC_OP_FLAGS) {
+        arm_cc_compute(env);
+    }
+}
+
 /* Return the current PSTATE value. For the moment we don't support 32<->64 bit
  * interprocessing, so we don't attempt to sync with the cpsr state used by
  * the 32 bit decoder.
@@ -896,6 +924,7 @@ static inline uint32_t pstate_read(CPUARMState *env)
 {
     int ZF;
 
+    arm_cc_sync(env);
     ZF = (env->ZF == 0);
     return (env->NF & 0x80000000) | (ZF << 30)
         | (env->CF << 29) | ((env->VF & 0x80000000) >> 3)
@@ -908,6 +937,7 @@ static inline void pstate_write(CPUARMState *env, uint32_t val)
     env->NF = val;
     env->CF = (val >> 29) & 1;
     env->VF = (val << 3) & 0x80000000;
+    env->cc_op = CC_OP_FLAGS;
     env->daif = val & PSTATE_DAIF;
     env->pstate = val & ~CACHED_PSTATE_BITS;
 }
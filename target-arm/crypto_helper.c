@@ -15,6 +15,7 @@
 #include "exec/exec-all.h"
 #include "exec/helper-proto.h"
 #include "crypto/aes.h"
+#include "qemu/host-crypto.h"
 
 union CRYPTO_STATE {
     uint8_t    bytes[16];
@@ -52,9 +53,21 @@ void HELPER(crypto_aese)(CPUARMState *env, uint32_t rd, uint32_t rm,
     rk.l[0] ^= st.l[0];
     rk.l[1] ^= st.l[1];
 
-    /* combine ShiftRows operation and sbox substitution */
-    for (i = 0; i < 16; i++) {
-        CR_ST_BYTE(st, i) = sbox[decrypt][CR_ST_BYTE(rk, shift[decrypt][i])];
+    if (host_crypto & HOST_CRYPTO_AES) {
+        /* AESENCLAST/AESDECLAST with a zero round key */
+        static const union CRYPTO_STATE zero;
+
+        if (decrypt) {
+            host_aesdeclast(st.bytes, rk.bytes, zero.bytes);
+        } else {
+            host_aesenclast(st.bytes, rk.bytes, zero.bytes);
+        }
+    } else {
+        /* combine ShiftRows operation and sbox substitution */
+        for (i = 0; i < 16; i++) {
+            CR_ST_BYTE(st, i) =
+                sbox[decrypt][CR_ST_BYTE(rk, shift[decrypt][i])];
+        }
     }
 
     env->vfp.regs[rd] = make_float64(st.l[0]);
@@ -205,12 +218,27 @@ void HELPER(crypto_aesmc)(CPUARMState *env, uint32_t rd, uint32_t rm,
 
     assert(decrypt < 2);
 
-    for (i = 0; i < 16; i += 4) {
-        CR_ST_WORD(st, i >> 2) =
-            mc[decrypt][CR_ST_BYTE(st, i)] ^
-            rol32(mc[decrypt][CR_ST_BYTE(st, i + 1)], 8) ^
-            rol32(mc[decrypt][CR_ST_BYTE(st, i + 2)], 16) ^
-            rol32(mc[decrypt][CR_ST_BYTE(st, i + 3)], 24);
+    if (host_crypto & HOST_CRYPTO_AES) {
+        static const union CRYPTO_STATE zero;
+
+        if (decrypt) {
+            host_aesimc(st.bytes, st.bytes);
+        } else {
+            /*
+             * There is no MixColumns on its own; undo the ShiftRows and
+             * SubBytes steps of AESENC beforehand.
+             */
+            host_aesdeclast(st.bytes, st.bytes, zero.bytes);
+            host_aesenc(st.bytes, st.bytes, zero.bytes);
+        }
+    } else {
+        for (i = 0; i < 16; i += 4) {
+            CR_ST_WORD(st, i >> 2) =
+                mc[decrypt][CR_ST_BYTE(st, i)] ^
+                rol32(mc[decrypt][CR_ST_BYTE(st, i + 1)], 8) ^
+                rol32(mc[decrypt][CR_ST_BYTE(st, i + 2)], 16) ^
+                rol32(mc[decrypt][CR_ST_BYTE(st, i + 3)], 24);
+        }
     }
 
     env->vfp.regs[rd] = make_float64(st.l[0]);
@@ -50,6 +50,11 @@ int64_t HELPER(sdiv64)(int64_t num, int64_t den)
     return num / den;
 }
 
+void HELPER(a64_compute_cc)(CPUARMState *env)
+{
+    arm_cc_compute(env);
+}
+
 uint64_t HELPER(clz64)(uint64_t x)
 {
     return clz64(x);
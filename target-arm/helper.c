@@ -5555,9 +5555,61 @@ static int bad_mode_switch(CPUARMState *env, int mode, CPSRWriteType write_type)
     }
 }
 
+/* Materialize NZCV from the operation recorded by A64 code in env->cc_op */
+void arm_cc_compute(CPUARMState *env)
+{
+    uint64_t a = env->cc_src, b = env->cc_src2, r;
+    uint32_t a32 = a, b32 = b, r32;
+
+    switch (env->cc_op) {
+    case CC_OP_FLAGS:
+        return;
+    case CC_OP_ADD32:
+        r32 = a32 + b32;
+        env->NF = env->ZF = r32;
+        env->CF = r32 < a32;
+        env->VF = (r32 ^ a32) & ~(a32 ^ b32);
+        break;
+    case CC_OP_ADD64:
+        r = a + b;
+        env->NF = r >> 32;
+        env->ZF = r != 0;
+        env->CF = r < a;
+        env->VF = ((r ^ a) & ~(a ^ b)) >> 32;
+        break;
+    case CC_OP_SUB32:
+        r32 = a32 - b32;
+        env->NF = env->ZF = r32;
+        env->CF = a32 >= b32;
+        env->VF = (r32 ^ a32) & (a32 ^ b32);
+        break;
+    case CC_OP_SUB64:
+        r = a - b;
+        env->NF = r >> 32;
+        env->ZF = r != 0;
+        env->CF = a >= b;
+        env->VF = ((r ^ a) & (a ^ b)) >> 32;
+        break;
+    case CC_OP_LOGIC32:
+        env->NF = env->ZF = a32;
+        env->CF = env->VF = 0;
+        break;
+    case CC_OP_LOGIC64:
+        env->NF = a >> 32;
+        env->ZF = a != 0;
+        env->CF = env->VF = 0;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    env->cc_op = CC_OP_FLAGS;
+}
+
 uint32_t cpsr_read(CPUARMState *env)
 {
     int ZF;
+
+    arm_cc_sync(env);
     ZF = (env->ZF == 0);
     return env->uncached_cpsr | (env->NF & 0x80000000) | (ZF << 30) |
         (env->CF << 29) | ((env->VF & 0x80000000) >> 3) | (env->QF << 27)
@@ -5576,6 +5628,7 @@ void cpsr_write(CPUARMState *env, uint32_t val, uint32_t mask,
         env->NF = val;
         env->CF = (val >> 29) & 1;
         env->VF = (val << 3) & 0x80000000;
+        env->cc_op = CC_OP_FLAGS;
     }
     if (mask & CPSR_Q)
         env->QF = ((val & CPSR_Q) != 0);
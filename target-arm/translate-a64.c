@@ -42,6 +42,13 @@ static TCGv_i64 cpu_pc;
 /* Load/store exclusive handling */
 static TCGv_i64 cpu_exclusive_high;
 
+/* Lazily evaluated NZCV, see CC_OP_* */
+static TCGv_i32 cpu_cc_op;
+static TCGv_i64 cpu_cc_src, cpu_cc_src2;
+
+/* DisasContext.cc_op when the state left by the previous TB is unknown */
+#define CC_OP_DYNAMIC -1
+
 static const char *regnames[] = {
     "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7",
     "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
@@ -98,6 +105,13 @@ void a64_translate_init(void)
 
     cpu_exclusive_high = tcg_global_mem_new_i64(cpu_env,
         offsetof(CPUARMState, exclusive_high), "exclusive_high");
+
+    cpu_cc_op = tcg_global_mem_new_i32(cpu_env,
+        offsetof(CPUARMState, cc_op), "cc_op");
+    cpu_cc_src = tcg_global_mem_new_i64(cpu_env,
+        offsetof(CPUARMState, cc_src), "cc_src");
+    cpu_cc_src2 = tcg_global_mem_new_i64(cpu_env,
+        offsetof(CPUARMState, cc_src2), "cc_src2");
 }
 
 static inline ARMMMUIdx get_a64_user_mem_index(DisasContext *s)
@@ -176,31 +190,6 @@ void gen_a64_set_pc_im(uint64_t val)
     tcg_gen_movi_i64(cpu_pc, val);
 }
 
-typedef struct DisasCompare64 {
-    TCGCond cond;
-    TCGv_i64 value;
-} DisasCompare64;
-
-static void a64_test_cc(DisasCompare64 *c64, int cc)
-{
-    DisasCompare c32;
-
-    arm_test_cc(&c32, cc);
-
-    /* Sign-extend the 32-bit value so that the GE/LT comparisons work
-       * properly.  The NE/EQ comparisons are also fine with this choice.  */
-    c64->cond = c32.cond;
-    c64->value = tcg_temp_new_i64();
-    tcg_gen_ext_i32_i64(c64->value, c32.value);
-
-    arm_free_cc(&c32);
-}
-
-static void a64_free_cc(DisasCompare64 *c64)
-{
-    tcg_temp_free_i64(c64->value);
-}
-
 static void gen_exception_internal(int excp)
 {
     TCGv_i32 tcg_excp = tcg_const_i32(excp);
@@ -665,6 +654,272 @@ static void gen_sub_CC(int sf, TCGv_i64 dest, TCGv_i64 t0, TCGv_i64 t1)
     }
 }
 
+/*
+ * Lazy NZCV.  The common flag setting instructions (ADDS, SUBS, ANDS and
+ * their aliases CMP, CMN and TST) only record their operands in cc_src and
+ * cc_src2 and the kind of operation in cc_op.  Conditions are evaluated
+ * straight from the operands when the operation is known at translation
+ * time, and everything else that reads the flags first materializes them
+ * into cpu_NF, cpu_ZF, cpu_CF and cpu_VF.  Since all three live in TCG
+ * globals, env is consistent wherever an exception can be raised, and C
+ * code reads the flags through arm_cc_sync().  Helpers that write NZCV
+ * (exception return) end the TB, so s->cc_op does not go stale.
+ */
+static void gen_set_cc_op(DisasContext *s, int op)
+{
+    /* Store it even if unchanged: a helper may have materialized the flags */
+    tcg_gen_movi_i32(cpu_cc_op, op);
+    s->cc_op = op;
+}
+
+/* Make cpu_NF, cpu_ZF, cpu_CF and cpu_VF valid */
+static void gen_compute_cc(DisasContext *s)
+{
+    TCGv_i64 tmp;
+
+    switch (s->cc_op) {
+    case CC_OP_FLAGS:
+        return;
+    case CC_OP_DYNAMIC:
+        gen_helper_a64_compute_cc(cpu_env);
+        break;
+    case CC_OP_ADD32:
+    case CC_OP_ADD64:
+        tmp = tcg_temp_new_i64();
+        gen_add_CC(s->cc_op == CC_OP_ADD64, tmp, cpu_cc_src, cpu_cc_src2);
+        tcg_temp_free_i64(tmp);
+        break;
+    case CC_OP_SUB32:
+    case CC_OP_SUB64:
+        tmp = tcg_temp_new_i64();
+        gen_sub_CC(s->cc_op == CC_OP_SUB64, tmp, cpu_cc_src, cpu_cc_src2);
+        tcg_temp_free_i64(tmp);
+        break;
+    case CC_OP_LOGIC32:
+    case CC_OP_LOGIC64:
+        gen_logic_CC(s->cc_op == CC_OP_LOGIC64, cpu_cc_src);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    gen_set_cc_op(s, CC_OP_FLAGS);
+}
+
+/* dest = T0 + T1; record the operation for NZCV */
+static void gen_add_CC_lazy(DisasContext *s, int sf, TCGv_i64 dest,
+                            TCGv_i64 t0, TCGv_i64 t1)
+{
+    tcg_gen_mov_i64(cpu_cc_src, t0);
+    tcg_gen_mov_i64(cpu_cc_src2, t1);
+    tcg_gen_add_i64(dest, cpu_cc_src, cpu_cc_src2);
+    if (!sf) {
+        tcg_gen_ext32u_i64(dest, dest);
+    }
+    gen_set_cc_op(s, sf ? CC_OP_ADD64 : CC_OP_ADD32);
+}
+
+/* dest = T0 - T1; record the operation for NZCV */
+static void gen_sub_CC_lazy(DisasContext *s, int sf, TCGv_i64 dest,
+                            TCGv_i64 t0, TCGv_i64 t1)
+{
+    tcg_gen_mov_i64(cpu_cc_src, t0);
+    tcg_gen_mov_i64(cpu_cc_src2, t1);
+    tcg_gen_sub_i64(dest, cpu_cc_src, cpu_cc_src2);
+    if (!sf) {
+        tcg_gen_ext32u_i64(dest, dest);
+    }
+    gen_set_cc_op(s, sf ? CC_OP_SUB64 : CC_OP_SUB32);
+}
+
+static void gen_logic_CC_lazy(DisasContext *s, int sf, TCGv_i64 result)
+{
+    tcg_gen_mov_i64(cpu_cc_src, result);
+    gen_set_cc_op(s, sf ? CC_OP_LOGIC64 : CC_OP_LOGIC32);
+}
+
+/* Condition: value <cond> value2 */
+typedef struct DisasCompare64 {
+    TCGCond cond;
+    TCGv_i64 value;
+    TCGv_i64 value2;
+} DisasCompare64;
+
+/*
+ * Evaluate condition @cc from the operands of the last flag setting
+ * operation, if it is known.  Returns false for conditions that need
+ * the V flag of an addition, which are rare enough to go through the
+ * materialized flags.
+ */
+static bool a64_test_cc_lazy(DisasContext *s, DisasCompare64 *c64, int cc)
+{
+    TCGv_i64 a, b;
+    TCGCond cond;
+    bool sf;
+
+    switch (s->cc_op) {
+    case CC_OP_SUB32:
+    case CC_OP_SUB64:
+        sf = s->cc_op == CC_OP_SUB64;
+        switch (cc >> 1) {
+        case 0: /* eq/ne */
+            cond = TCG_COND_EQ;
+            break;
+        case 1: /* cs/cc */
+            cond = TCG_COND_GEU;
+            break;
+        case 2: /* mi/pl, N of the result */
+            cond = TCG_COND_LT;
+            break;
+        case 4: /* hi/ls */
+            cond = TCG_COND_GTU;
+            break;
+        case 5: /* ge/lt */
+            cond = TCG_COND_GE;
+            break;
+        case 6: /* gt/le */
+            cond = TCG_COND_GT;
+            break;
+        default:
+            return false;
+        }
+        a = tcg_temp_new_i64();
+        if (cc >> 1 == 2) {
+            tcg_gen_sub_i64(a, cpu_cc_src, cpu_cc_src2);
+            b = tcg_const_i64(0);
+        } else {
+            b = tcg_temp_new_i64();
+            tcg_gen_mov_i64(a, cpu_cc_src);
+            tcg_gen_mov_i64(b, cpu_cc_src2);
+        }
+        if (!sf) {
+            if (is_unsigned_cond(cond) || cond == TCG_COND_EQ) {
+                tcg_gen_ext32u_i64(a, a);
+                tcg_gen_ext32u_i64(b, b);
+            } else {
+                tcg_gen_ext32s_i64(a, a);
+                tcg_gen_ext32s_i64(b, b);
+            }
+        }
+        break;
+
+    case CC_OP_ADD32:
+    case CC_OP_ADD64:
+        sf = s->cc_op == CC_OP_ADD64;
+        a = tcg_temp_new_i64();
+        switch (cc >> 1) {
+        case 0: /* eq/ne: result == 0 */
+        case 2: /* mi/pl: result < 0 */
+            cond = cc >> 1 ? TCG_COND_LT : TCG_COND_EQ;
+            tcg_gen_add_i64(a, cpu_cc_src, cpu_cc_src2);
+            if (!sf) {
+                tcg_gen_ext32s_i64(a, a);
+            }
+            b = tcg_const_i64(0);
+            break;
+        case 1: /* cs/cc: the sum wrapped around */
+            if (sf) {
+                cond = TCG_COND_LTU;
+                tcg_gen_add_i64(a, cpu_cc_src, cpu_cc_src2);
+                b = tcg_temp_new_i64();
+                tcg_gen_mov_i64(b, cpu_cc_src);
+            } else {
+                cond = TCG_COND_GTU;
+                b = tcg_temp_new_i64();
+                tcg_gen_ext32u_i64(a, cpu_cc_src);
+                tcg_gen_ext32u_i64(b, cpu_cc_src2);
+                tcg_gen_add_i64(a, a, b);
+                tcg_gen_movi_i64(b, UINT32_MAX);
+            }
+            break;
+        default:
+            tcg_temp_free_i64(a);
+            return false;
+        }
+        break;
+
+    case CC_OP_LOGIC32:
+    case CC_OP_LOGIC64:
+        /* C and V are clear */
+        switch (cc >> 1) {
+        case 0: /* eq/ne */
+            cond = TCG_COND_EQ;
+            break;
+        case 1: /* cs/cc */
+        case 3: /* vs/vc */
+        case 4: /* hi/ls */
+            cond = TCG_COND_NEVER;
+            break;
+        case 2: /* mi/pl */
+            cond = TCG_COND_LT;
+            break;
+        case 5: /* ge/lt, N == 0 */
+            cond = TCG_COND_GE;
+            break;
+        case 6: /* gt/le, !Z && N == 0 */
+            cond = TCG_COND_GT;
+            break;
+        default:
+            return false;
+        }
+        a = tcg_temp_new_i64();
+        if (s->cc_op == CC_OP_LOGIC64) {
+            tcg_gen_mov_i64(a, cpu_cc_src);
+        } else {
+            tcg_gen_ext32s_i64(a, cpu_cc_src);
+        }
+        b = tcg_const_i64(0);
+        break;
+
+    default:
+        return false;
+    }
+
+    if (cc & 1) {
+        cond = tcg_invert_cond(cond);
+    }
+    c64->cond = cond;
+    c64->value = a;
+    c64->value2 = b;
+    return true;
+}
+
+static void a64_test_cc(DisasContext *s, DisasCompare64 *c64, int cc)
+{
+    DisasCompare c32;
+
+    if (cc < 0x0e && a64_test_cc_lazy(s, c64, cc)) {
+        return;
+    }
+    if (cc < 0x0e) {
+        gen_compute_cc(s);
+    }
+    arm_test_cc(&c32, cc);
+
+    /* Sign-extend the 32-bit value so that the GE/LT comparisons work
+       * properly.  The NE/EQ comparisons are also fine with this choice.  */
+    c64->cond = c32.cond;
+    c64->value = tcg_temp_new_i64();
+    tcg_gen_ext_i32_i64(c64->value, c32.value);
+    c64->value2 = tcg_const_i64(0);
+
+    arm_free_cc(&c32);
+}
+
+static void a64_free_cc(DisasCompare64 *c64)
+{
+    tcg_temp_free_i64(c64->value);
+    tcg_temp_free_i64(c64->value2);
+}
+
+static void a64_gen_test_cc(DisasContext *s, int cc, TCGLabel *label)
+{
+    DisasCompare64 c;
+
+    a64_test_cc(s, &c, cc);
+    tcg_gen_brcond_i64(c.cond, c.value, c.value2, label);
+    a64_free_cc(&c);
+}
+
 /* dest = T0 + T1 + CF; do not compute flags. */
 static void gen_adc(int sf, TCGv_i64 dest, TCGv_i64 t0, TCGv_i64 t1)
 {
@@ -1242,7 +1497,7 @@ static void disas_cond_b_imm(DisasContext *s, uint32_t insn)
     if (cond < 0x0e) {
         /* genuinely conditional branches */
         TCGLabel *label_match = gen_new_label();
-        arm_gen_test_cc(cond, label_match);
+        a64_gen_test_cc(s, cond, label_match);
         gen_goto_tb(s, 0, s->pc);
         gen_set_label(label_match);
         gen_goto_tb(s, 1, addr);
@@ -1468,9 +1723,11 @@ static void handle_sys(DisasContext *s, uint32_t insn, bool isread,
     case ARM_CP_NZCV:
         tcg_rt = cpu_reg(s, rt);
         if (isread) {
+            gen_compute_cc(s);
             gen_get_nzcv(tcg_rt);
         } else {
             gen_set_nzcv(tcg_rt);
+            gen_set_cc_op(s, CC_OP_FLAGS);
         }
         return;
     case ARM_CP_CURRENTEL:
@@ -1731,7 +1988,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
         return;
     }
 
-    s->is_jmp = DISAS_JUMP;
+    s->is_jmp = DISAS_JR;
 }
 
 /* C3.2 Branches, exception generating and system instructions */
@@ -2897,9 +3154,9 @@ static void disas_add_sub_imm(DisasContext *s, uint32_t insn)
     } else {
         TCGv_i64 tcg_imm = tcg_const_i64(imm);
         if (sub_op) {
-            gen_sub_CC(is_64bit, tcg_result, tcg_rn, tcg_imm);
+            gen_sub_CC_lazy(s, is_64bit, tcg_result, tcg_rn, tcg_imm);
         } else {
-            gen_add_CC(is_64bit, tcg_result, tcg_rn, tcg_imm);
+            gen_add_CC_lazy(s, is_64bit, tcg_result, tcg_rn, tcg_imm);
         }
         tcg_temp_free_i64(tcg_imm);
     }
@@ -3068,7 +3325,7 @@ static void disas_logic_imm(DisasContext *s, uint32_t insn)
     }
 
     if (opc == 3) { /* ANDS */
-        gen_logic_CC(sf, tcg_rd);
+        gen_logic_CC_lazy(s, sf, tcg_rd);
     }
 }
 
@@ -3466,7 +3723,7 @@ static void disas_logic_reg(DisasContext *s, uint32_t insn)
     }
 
     if (opc == 3) {
-        gen_logic_CC(sf, tcg_rd);
+        gen_logic_CC_lazy(s, sf, tcg_rd);
     }
 }
 
@@ -3528,9 +3785,9 @@ static void disas_add_sub_ext_reg(DisasContext *s, uint32_t insn)
         }
     } else {
         if (sub_op) {
-            gen_sub_CC(sf, tcg_result, tcg_rn, tcg_rm);
+            gen_sub_CC_lazy(s, sf, tcg_result, tcg_rn, tcg_rm);
         } else {
-            gen_add_CC(sf, tcg_result, tcg_rn, tcg_rm);
+            gen_add_CC_lazy(s, sf, tcg_result, tcg_rn, tcg_rm);
         }
     }
 
@@ -3592,9 +3849,9 @@ static void disas_add_sub_reg(DisasContext *s, uint32_t insn)
         }
     } else {
         if (sub_op) {
-            gen_sub_CC(sf, tcg_result, tcg_rn, tcg_rm);
+            gen_sub_CC_lazy(s, sf, tcg_result, tcg_rn, tcg_rm);
         } else {
-            gen_add_CC(sf, tcg_result, tcg_rn, tcg_rm);
+            gen_add_CC_lazy(s, sf, tcg_result, tcg_rn, tcg_rm);
         }
     }
 
@@ -3741,8 +3998,10 @@ static void disas_adc_sbc(DisasContext *s, uint32_t insn)
         tcg_y = cpu_reg(s, rm);
     }
 
+    gen_compute_cc(s);
     if (setflags) {
         gen_adc_CC(sf, tcg_rd, tcg_rn, tcg_y);
+        gen_set_cc_op(s, CC_OP_FLAGS);
     } else {
         gen_adc(sf, tcg_rd, tcg_rn, tcg_y);
     }
@@ -3760,7 +4019,7 @@ static void disas_cc(DisasContext *s, uint32_t insn)
     unsigned int sf, op, y, cond, rn, nzcv, is_imm;
     TCGv_i32 tcg_t0, tcg_t1, tcg_t2;
     TCGv_i64 tcg_tmp, tcg_y, tcg_rn;
-    DisasCompare c;
+    DisasCompare64 c;
 
     if (!extract32(insn, 29, 1)) {
         unallocated_encoding(s);
@@ -3780,9 +4039,11 @@ static void disas_cc(DisasContext *s, uint32_t insn)
 
     /* Set T0 = !COND.  */
     tcg_t0 = tcg_temp_new_i32();
-    arm_test_cc(&c, cond);
-    tcg_gen_setcondi_i32(tcg_invert_cond(c.cond), tcg_t0, c.value, 0);
-    arm_free_cc(&c);
+    tcg_tmp = tcg_temp_new_i64();
+    a64_test_cc(s, &c, cond);
+    tcg_gen_setcond_i64(tcg_invert_cond(c.cond), tcg_tmp, c.value, c.value2);
+    tcg_gen_extrl_i64_i32(tcg_t0, tcg_tmp);
+    a64_free_cc(&c);
 
     /* Load the arguments for the new comparison.  */
     if (is_imm) {
@@ -3794,13 +4055,13 @@ static void disas_cc(DisasContext *s, uint32_t insn)
     tcg_rn = cpu_reg(s, rn);
 
     /* Set the flags for the new comparison.  */
-    tcg_tmp = tcg_temp_new_i64();
     if (op) {
         gen_sub_CC(sf, tcg_tmp, tcg_rn, tcg_y);
     } else {
         gen_add_CC(sf, tcg_tmp, tcg_rn, tcg_y);
     }
     tcg_temp_free_i64(tcg_tmp);
+    gen_set_cc_op(s, CC_OP_FLAGS);
 
     /* If COND was false, force the flags to #nzcv.  Compute two masks
      * to help with this: T1 = (COND ? 0 : -1), T2 = (COND ? -1 : 0).
@@ -3862,7 +4123,7 @@ static void disas_cc(DisasContext *s, uint32_t insn)
 static void disas_cond_select(DisasContext *s, uint32_t insn)
 {
     unsigned int sf, else_inv, rm, cond, else_inc, rn, rd;
-    TCGv_i64 tcg_rd, zero;
+    TCGv_i64 tcg_rd;
     DisasCompare64 c;
 
     if (extract32(insn, 29, 1) || extract32(insn, 11, 1)) {
@@ -3880,12 +4141,12 @@ static void disas_cond_select(DisasContext *s, uint32_t insn)
 
     tcg_rd = cpu_reg(s, rd);
 
-    a64_test_cc(&c, cond);
-    zero = tcg_const_i64(0);
+    a64_test_cc(s, &c, cond);
 
     if (rn == 31 && rm == 31 && (else_inc ^ else_inv)) {
         /* CSET & CSETM.  */
-        tcg_gen_setcond_i64(tcg_invert_cond(c.cond), tcg_rd, c.value, zero);
+        tcg_gen_setcond_i64(tcg_invert_cond(c.cond), tcg_rd,
+                            c.value, c.value2);
         if (else_inv) {
             tcg_gen_neg_i64(tcg_rd, tcg_rd);
         }
@@ -3899,10 +4160,10 @@ static void disas_cond_select(DisasContext *s, uint32_t insn)
         } else if (else_inc) {
             tcg_gen_addi_i64(t_false, t_false, 1);
         }
-        tcg_gen_movcond_i64(c.cond, tcg_rd, c.value, zero, t_true, t_false);
+        tcg_gen_movcond_i64(c.cond, tcg_rd, c.value, c.value2,
+                            t_true, t_false);
     }
 
-    tcg_temp_free_i64(zero);
     a64_free_cc(&c);
 
     if (!sf) {
@@ -4311,6 +4572,7 @@ static void handle_fp_compare(DisasContext *s, bool is_double,
     tcg_temp_free_ptr(fpst);
 
     gen_set_nzcv(tcg_flags);
+    gen_set_cc_op(s, CC_OP_FLAGS);
 
     tcg_temp_free_i64(tcg_flags);
 }
@@ -4377,10 +4639,11 @@ static void disas_fp_ccomp(DisasContext *s, uint32_t insn)
     if (cond < 0x0e) { /* not always */
         TCGLabel *label_match = gen_new_label();
         label_continue = gen_new_label();
-        arm_gen_test_cc(cond, label_match);
+        a64_gen_test_cc(s, cond, label_match);
         /* nomatch: */
         tcg_flags = tcg_const_i64(nzcv << 28);
         gen_set_nzcv(tcg_flags);
+        gen_set_cc_op(s, CC_OP_FLAGS);
         tcg_temp_free_i64(tcg_flags);
         tcg_gen_br(label_continue);
         gen_set_label(label_match);
@@ -4402,7 +4665,7 @@ static void disas_fp_ccomp(DisasContext *s, uint32_t insn)
 static void disas_fp_csel(DisasContext *s, uint32_t insn)
 {
     unsigned int mos, type, rm, cond, rn, rd;
-    TCGv_i64 t_true, t_false, t_zero;
+    TCGv_i64 t_true, t_false;
     DisasCompare64 c;
 
     mos = extract32(insn, 29, 3);
@@ -4427,10 +4690,8 @@ static void disas_fp_csel(DisasContext *s, uint32_t insn)
     read_vec_element(s, t_true, rn, 0, type ? MO_64 : MO_32);
     read_vec_element(s, t_false, rm, 0, type ? MO_64 : MO_32);
 
-    a64_test_cc(&c, cond);
-    t_zero = tcg_const_i64(0);
-    tcg_gen_movcond_i64(c.cond, t_true, c.value, t_zero, t_true, t_false);
-    tcg_temp_free_i64(t_zero);
+    a64_test_cc(s, &c, cond);
+    tcg_gen_movcond_i64(c.cond, t_true, c.value, c.value2, t_true, t_false);
     tcg_temp_free_i64(t_false);
     a64_free_cc(&c);
 
@@ -11204,6 +11465,7 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
     dc->pstate_ss = ARM_TBFLAG_PSTATE_SS(tb->flags);
     dc->is_ldex = false;
     dc->ss_same_el = (arm_debug_target_el(env) == dc->current_el);
+    dc->cc_op = CC_OP_DYNAMIC;
 
     init_tmp_a64_array(dc);
 
@@ -11303,7 +11565,7 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
          * (and thus a tb-jump is not possible when singlestepping).
          */
         assert(dc->is_jmp != DISAS_TB_JUMP);
-        if (dc->is_jmp != DISAS_JUMP) {
+        if (dc->is_jmp != DISAS_JUMP && dc->is_jmp != DISAS_JR) {
             gen_a64_set_pc_im(dc->pc);
         }
         if (cs->singlestep_enabled) {
@@ -11324,6 +11586,9 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
             break;
+        case DISAS_JR:
+            tcg_gen_lookup_and_goto_ptr();
+            break;
         case DISAS_TB_JUMP:
         case DISAS_EXC:
         case DISAS_SWI:
@@ -57,6 +57,8 @@ typedef struct DisasContext {
     bool is_ldex;
     /* True if a single-step exception will be taken to the current EL */
     bool ss_same_el;
+    /* A64: the CC_OP_* state of NZCV if known at translation time */
+    int cc_op;
     /* Bottom two bits of XScale c15_cpar coprocessor access control reg */
     int c15_cpar;
     /* TCG op index of the current insn_start.  */
@@ -122,6 +124,10 @@ static inline int default_exception_el(DisasContext *s)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* Indirect branch: only the PC was changed, so the next TB can be looked
+ * up from generated code with tcg_gen_lookup_and_goto_ptr().
+ */
+#define DISAS_JR 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
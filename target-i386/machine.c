@@ -1042,5 +1042,7 @@ VMStateDescription vmstate_x86_cpu = {
 #endif
         &vmstate_mcg_ext_ctl,
         NULL
-    }
+    },
+    /* cpu_pre_save only converts the FPU and segment state of this CPU */
+    .thread_safe_save = true,
 };
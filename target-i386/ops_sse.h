@@ -19,6 +19,7 @@
  */
 
 #include "crypto/aes.h"
+#include "qemu/host-crypto.h"
 
 #if SHIFT == 0
 #define Reg MMXReg
@@ -2193,6 +2194,15 @@ void glue(helper_pclmulqdq, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
     b = s->Q((ctrl & 16) != 0);
     resh = resl = 0;
 
+    if (host_crypto & HOST_CRYPTO_CLMUL) {
+        uint64_t r[2];
+
+        host_clmul64(r, al, b);
+        d->Q(0) = r[0];
+        d->Q(1) = r[1];
+        return;
+    }
+
     while (b) {
         if (b & 1) {
             resl ^= al;
@@ -2213,6 +2223,11 @@ void glue(helper_aesdec, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (host_crypto & HOST_CRYPTO_AES) {
+        host_aesdec(d, &st, &rk);
+        return;
+    }
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Td0[st.B(AES_ishifts[4*i+0])] ^
                                     AES_Td1[st.B(AES_ishifts[4*i+1])] ^
@@ -2227,6 +2242,11 @@ void glue(helper_aesdeclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (host_crypto & HOST_CRYPTO_AES) {
+        host_aesdeclast(d, &st, &rk);
+        return;
+    }
+
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_isbox[st.B(AES_ishifts[i])]);
     }
@@ -2238,6 +2258,11 @@ void glue(helper_aesenc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (host_crypto & HOST_CRYPTO_AES) {
+        host_aesenc(d, &st, &rk);
+        return;
+    }
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Te0[st.B(AES_shifts[4*i+0])] ^
                                     AES_Te1[st.B(AES_shifts[4*i+1])] ^
@@ -2252,6 +2277,11 @@ void glue(helper_aesenclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (host_crypto & HOST_CRYPTO_AES) {
+        host_aesenclast(d, &st, &rk);
+        return;
+    }
+
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_sbox[st.B(AES_shifts[i])]);
     }
@@ -2263,6 +2293,11 @@ void glue(helper_aesimc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     int i;
     Reg tmp = *s;
 
+    if (host_crypto & HOST_CRYPTO_AES) {
+        host_aesimc(d, &tmp);
+        return;
+    }
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = bswap32(AES_imc[tmp.B(4*i+0)][0] ^
                           AES_imc[tmp.B(4*i+1)][1] ^
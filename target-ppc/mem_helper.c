@@ -53,31 +53,6 @@ static inline target_ulong addr_add(CPUPPCState *env, target_ulong addr,
     }
 }
 
-void helper_lmw(CPUPPCState *env, target_ulong addr, uint32_t reg)
-{
-    for (; reg < 32; reg++) {
-        if (needs_byteswap(env)) {
-            env->gpr[reg] = bswap32(cpu_ldl_data_ra(env, addr, GETPC()));
-        } else {
-            env->gpr[reg] = cpu_ldl_data_ra(env, addr, GETPC());
-        }
-        addr = addr_add(env, addr, 4);
-    }
-}
-
-void helper_stmw(CPUPPCState *env, target_ulong addr, uint32_t reg)
-{
-    for (; reg < 32; reg++) {
-        if (needs_byteswap(env)) {
-            cpu_stl_data_ra(env, addr, bswap32((uint32_t)env->gpr[reg]),
-                                                   GETPC());
-        } else {
-            cpu_stl_data_ra(env, addr, (uint32_t)env->gpr[reg], GETPC());
-        }
-        addr = addr_add(env, addr, 4);
-    }
-}
-
 static void do_lsw(CPUPPCState *env, target_ulong addr, uint32_t nb,
                    uint32_t reg, uintptr_t raddr)
 {
@@ -2888,10 +2888,15 @@ GEN_STX(stwbr, st32r, 0x16, 0x14, PPC_INTEGER);
 /***                    Integer load and store multiple                    ***/
 
 /* lmw */
+/* The endianness and the address size are known at translation time, so
+ * load/store multiple are expanded inline rather than left to a helper
+ * that would check the MSR for every word.  Registers already transferred
+ * when an access faults stay modified, as with the helper.
+ */
 static void gen_lmw(DisasContext *ctx)
 {
     TCGv t0;
-    TCGv_i32 t1;
+    int reg;
 
     if (ctx->le_mode) {
         gen_align_no_le(ctx);
@@ -2899,18 +2904,21 @@ static void gen_lmw(DisasContext *ctx)
     }
     gen_set_access_type(ctx, ACCESS_INT);
     t0 = tcg_temp_new();
-    t1 = tcg_const_i32(rD(ctx->opcode));
     gen_addr_imm_index(ctx, t0, 0);
-    gen_helper_lmw(cpu_env, t0, t1);
+    for (reg = rD(ctx->opcode); reg < 32; reg++) {
+        gen_qemu_ld32u(ctx, cpu_gpr[reg], t0);
+        if (reg < 31) {
+            gen_addr_add(ctx, t0, t0, 4);
+        }
+    }
     tcg_temp_free(t0);
-    tcg_temp_free_i32(t1);
 }
 
 /* stmw */
 static void gen_stmw(DisasContext *ctx)
 {
     TCGv t0;
-    TCGv_i32 t1;
+    int reg;
 
     if (ctx->le_mode) {
         gen_align_no_le(ctx);
@@ -2918,11 +2926,14 @@ static void gen_stmw(DisasContext *ctx)
     }
     gen_set_access_type(ctx, ACCESS_INT);
     t0 = tcg_temp_new();
-    t1 = tcg_const_i32(rS(ctx->opcode));
     gen_addr_imm_index(ctx, t0, 0);
-    gen_helper_stmw(cpu_env, t0, t1);
+    for (reg = rS(ctx->opcode); reg < 32; reg++) {
+        gen_qemu_st32(ctx, cpu_gpr[reg], t0);
+        if (reg < 31) {
+            gen_addr_add(ctx, t0, t0, 4);
+        }
+    }
     tcg_temp_free(t0);
-    tcg_temp_free_i32(t1);
 }
 
 /***                    Integer load and store strings                     ***/
@@ -117,6 +117,7 @@ extern bool use_vis3_instructions;
 #define TCG_TARGET_HAS_mulu2_i32        1
 #define TCG_TARGET_HAS_muls2_i32        1
 #define TCG_TARGET_HAS_muluh_i32        0
+#define TCG_TARGET_HAS_goto_ptr         0
 #define TCG_TARGET_HAS_mulsh_i32        0
 
 #define TCG_TARGET_HAS_extrl_i64_i32    1
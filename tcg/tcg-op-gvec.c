@@ -0,0 +1,387 @@
+/*
+ * Generic vector operation expansion
+ *
+ * Copyright (c) 2016 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+/* Replicate the low 8 << vece bits of @c across 64 bits.  */
+static uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    case MO_64:
+        return c;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void check_size(uint32_t oprsz)
+{
+    tcg_debug_assert(oprsz > 0 && oprsz % 8 == 0);
+}
+
+typedef void GVecGen2Fn(TCGv_i64, TCGv_i64);
+typedef void GVecGen2iFn(TCGv_i64, TCGv_i64, int64_t);
+typedef void GVecGen3Fn(TCGv_i64, TCGv_i64, TCGv_i64);
+
+/* Expand OPSZ bytes worth of two-operand operations using i64 elements.  */
+static void expand_2_i64(uint32_t dofs, uint32_t aofs, uint32_t oprsz,
+                         GVecGen2Fn *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        if (fni) {
+            fni(t0, t0);
+        }
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+static void expand_2i_i64(uint32_t dofs, uint32_t aofs, uint32_t oprsz,
+                          int64_t c, GVecGen2iFn *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        fni(t0, t0, c);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+/* Expand OPSZ bytes worth of three-operand operations using i64 elements.  */
+static void expand_3_i64(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                         uint32_t oprsz, GVecGen3Fn *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        tcg_gen_ld_i64(t1, tcg_ctx.tcg_env, bofs + i);
+        fni(t0, t0, t1);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_mov(uint32_t dofs, uint32_t aofs, uint32_t oprsz)
+{
+    check_size(oprsz);
+    if (dofs != aofs) {
+        expand_2_i64(dofs, aofs, oprsz, NULL);
+    }
+}
+
+void tcg_gen_gvec_dup8i(uint32_t dofs, uint32_t oprsz, uint8_t x)
+{
+    TCGv_i64 t0;
+    uint32_t i;
+
+    check_size(oprsz);
+    t0 = tcg_const_i64(dup_const(MO_8, x));
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_and(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    check_size(oprsz);
+    if (aofs == bofs) {
+        tcg_gen_gvec_mov(dofs, aofs, oprsz);
+    } else {
+        expand_3_i64(dofs, aofs, bofs, oprsz, tcg_gen_and_i64);
+    }
+}
+
+void tcg_gen_gvec_or(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz)
+{
+    check_size(oprsz);
+    if (aofs == bofs) {
+        tcg_gen_gvec_mov(dofs, aofs, oprsz);
+    } else {
+        expand_3_i64(dofs, aofs, bofs, oprsz, tcg_gen_or_i64);
+    }
+}
+
+void tcg_gen_gvec_xor(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    check_size(oprsz);
+    if (aofs == bofs) {
+        /* The common "pxor reg, reg" idiom for zeroing a register.  */
+        tcg_gen_gvec_dup8i(dofs, oprsz, 0);
+    } else {
+        expand_3_i64(dofs, aofs, bofs, oprsz, tcg_gen_xor_i64);
+    }
+}
+
+void tcg_gen_gvec_andc(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz)
+{
+    check_size(oprsz);
+    if (aofs == bofs) {
+        tcg_gen_gvec_dup8i(dofs, oprsz, 0);
+    } else {
+        expand_3_i64(dofs, aofs, bofs, oprsz, tcg_gen_andc_i64);
+    }
+}
+
+/* Add the elements of @a and @b, where @m holds the most significant
+ * bit of every element.  The low bits are added with the top bit of
+ * each element cleared, so that no carry crosses into the next element;
+ * the top bits are then fixed up with a carry-less sum.
+ */
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+/* As gen_addv_mask, but setting the top bit of every element of @a so
+ * that no borrow crosses into the next element.
+ */
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+void tcg_gen_vec_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_8, 0x80));
+    gen_addv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_16, 0x8000));
+    gen_addv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    /* Only two elements: add the high halves separately.  */
+    tcg_gen_andi_i64(t1, a, ~0xffffffffull);
+    tcg_gen_add_i64(t2, a, b);
+    tcg_gen_add_i64(t1, t1, b);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+void tcg_gen_vec_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_8, 0x80));
+    gen_subv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_16, 0x8000));
+    gen_subv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+    tcg_gen_sub_i64(t2, a, b);
+    tcg_gen_sub_i64(t1, a, t1);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+static GVecGen3Fn * const gvec_add_fn[4] = {
+    tcg_gen_vec_add8_i64,
+    tcg_gen_vec_add16_i64,
+    tcg_gen_vec_add32_i64,
+    tcg_gen_add_i64,
+};
+
+static GVecGen3Fn * const gvec_sub_fn[4] = {
+    tcg_gen_vec_sub8_i64,
+    tcg_gen_vec_sub16_i64,
+    tcg_gen_vec_sub32_i64,
+    tcg_gen_sub_i64,
+};
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    check_size(oprsz);
+    tcg_debug_assert(vece <= MO_64);
+    expand_3_i64(dofs, aofs, bofs, oprsz, gvec_add_fn[vece]);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    check_size(oprsz);
+    tcg_debug_assert(vece <= MO_64);
+    if (aofs == bofs) {
+        tcg_gen_gvec_dup8i(dofs, oprsz, 0);
+    } else {
+        expand_3_i64(dofs, aofs, bofs, oprsz, gvec_sub_fn[vece]);
+    }
+}
+
+static void gen_shl8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(MO_8, 0xff << c);
+    tcg_gen_shli_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shl16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(MO_16, 0xffff << c);
+    tcg_gen_shli_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shl32i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(MO_32, 0xffffffffu << c);
+    tcg_gen_shli_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shr8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(MO_8, 0xff >> c);
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shr16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(MO_16, 0xffff >> c);
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shr32i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(MO_32, 0xffffffffu >> c);
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shl64i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_shli_i64(d, a, c);
+}
+
+static void gen_shr64i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_shri_i64(d, a, c);
+}
+
+static GVecGen2iFn * const gvec_shli_fn[4] = {
+    gen_shl8i_i64, gen_shl16i_i64, gen_shl32i_i64, gen_shl64i_i64,
+};
+
+static GVecGen2iFn * const gvec_shri_fn[4] = {
+    gen_shr8i_i64, gen_shr16i_i64, gen_shr32i_i64, gen_shr64i_i64,
+};
+
+void tcg_gen_gvec_shli(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       unsigned shift, uint32_t oprsz)
+{
+    check_size(oprsz);
+    tcg_debug_assert(vece <= MO_64);
+    tcg_debug_assert(shift < (8u << vece));
+    if (shift == 0) {
+        tcg_gen_gvec_mov(dofs, aofs, oprsz);
+    } else {
+        expand_2i_i64(dofs, aofs, oprsz, shift, gvec_shli_fn[vece]);
+    }
+}
+
+void tcg_gen_gvec_shri(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       unsigned shift, uint32_t oprsz)
+{
+    check_size(oprsz);
+    tcg_debug_assert(vece <= MO_64);
+    tcg_debug_assert(shift < (8u << vece));
+    if (shift == 0) {
+        tcg_gen_gvec_mov(dofs, aofs, oprsz);
+    } else {
+        expand_2i_i64(dofs, aofs, oprsz, shift, gvec_shri_fn[vece]);
+    }
+}
@@ -770,6 +770,18 @@ static inline void tcg_gen_exit_tb(uintptr_t val)
  */
 void tcg_gen_goto_tb(unsigned idx);
 
+/**
+ * tcg_gen_lookup_and_goto_ptr() - look up the next TB and jump to it
+ *
+ * End the block by looking up the TB for the CPU state currently stored
+ * in env and jumping straight to it if it is already translated, without
+ * returning to the main loop.  Otherwise, or if the backend does not
+ * implement goto_ptr, this is equivalent to tcg_gen_exit_tb(0).
+ * Use it for indirect branches, whose target is not known at translation
+ * time and therefore cannot be chained with goto_tb.
+ */
+void tcg_gen_lookup_and_goto_ptr(void);
+
 #if TARGET_LONG_BITS == 32
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
@@ -379,6 +379,12 @@ void tcg_context_init(TCGContext *s)
     }
 }
 
+/* Returns the size (in bytes) of all translated code.  */
+size_t tcg_code_size(TCGContext *s)
+{
+    return s->code_gen_ptr - s->code_gen_buffer;
+}
+
 void tcg_prologue_init(TCGContext *s)
 {
     size_t prologue_size, total_size;
@@ -2000,8 +2006,34 @@ static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
             return reg;
     }
 
-    /* XXX: do better spill choice */
-    for(i = 0; i < n; i++) {
+    /* Then registers whose value is also in memory, which only need to be
+       dropped and not stored.  */
+    for (i = 0; i < n; i++) {
+        reg = order[i];
+        if (tcg_regset_test_reg(reg_ct, reg)
+            && s->reg_to_temp[reg]->mem_coherent) {
+            tcg_reg_free(s, reg, allocated_regs);
+            return reg;
+        }
+    }
+
+    /* Then globals and local temps: they have to be stored by the end of
+       the basic block anyway, while spilling a normal temp is a pure extra
+       store to the frame.  */
+    for (i = 0; i < n; i++) {
+        reg = order[i];
+        if (tcg_regset_test_reg(reg_ct, reg)) {
+            TCGTemp *ts = s->reg_to_temp[reg];
+
+            if (ts->temp_local || temp_idx(s, ts) < s->nb_globals) {
+                tcg_reg_free(s, reg, allocated_regs);
+                return reg;
+            }
+        }
+    }
+
+    /* Finally spill whatever we can */
+    for (i = 0; i < n; i++) {
         reg = order[i];
         if (tcg_regset_test_reg(reg_ct, reg)) {
             tcg_reg_free(s, reg, allocated_regs);
@@ -2650,6 +2682,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
             tcg_out_label(s, arg_label(args[0]), s->code_ptr);
             break;
         case INDEX_op_call:
+#ifdef CONFIG_PROFILER
+            s->call_count++;
+#endif
             tcg_reg_alloc_call(s, op->callo, op->calli, args, arg_life);
             break;
         default:
@@ -2676,6 +2711,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     }
     tcg_debug_assert(num_insns >= 0);
     s->gen_insn_end_off[num_insns] = tcg_current_code_size(s);
+#ifdef CONFIG_PROFILER
+    s->insn_count += num_insns + 1;
+#endif
 
     /* Generate TB finalization at the end of block */
     if (!tcg_out_tb_finalize(s)) {
@@ -2710,9 +2748,17 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 (double)s->temp_count / tb_div_count, s->temp_count_max);
     cpu_fprintf(f, "avg host code/TB    %0.1f\n",
                 (double)s->code_out_len / tb_div_count);
+    cpu_fprintf(f, "avg guest insns/TB  %0.1f\n",
+                (double)s->insn_count / tb_div_count);
+    cpu_fprintf(f, "avg host code/insn  %0.1f\n",
+                s->insn_count ? (double)s->code_out_len / s->insn_count : 0);
+    cpu_fprintf(f, "avg helper calls/TB %0.2f\n",
+                (double)s->call_count / tb_div_count);
     cpu_fprintf(f, "avg search data/TB  %0.1f\n",
                 (double)s->search_out_len / tb_div_count);
     
+    cpu_fprintf(f, "cycles/TB           %0.1f\n",
+                (double)tot / tb_div_count);
     cpu_fprintf(f, "cycles/op           %0.1f\n", 
                 s->op_count ? (double)tot / s->op_count : 0);
     cpu_fprintf(f, "cycles/in byte      %0.1f\n", 
@@ -70,8 +70,8 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
     { INDEX_op_st16_i32, { R, R } },
     { INDEX_op_st_i32, { R, R } },
 
-    { INDEX_op_add_i32, { R, RI, RI } },
-    { INDEX_op_sub_i32, { R, RI, RI } },
+    { INDEX_op_add_i32, { R, R, RI } },
+    { INDEX_op_sub_i32, { R, R, RI } },
     { INDEX_op_mul_i32, { R, RI, RI } },
 #if TCG_TARGET_HAS_div_i32
     { INDEX_op_div_i32, { R, R, R } },
@@ -82,9 +82,9 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
     { INDEX_op_div2_i32, { R, R, "0", "1", R } },
     { INDEX_op_divu2_i32, { R, R, "0", "1", R } },
 #endif
-    /* TODO: Does R, RI, RI result in faster code than R, R, RI?
-       If both operands are constants, we can optimize. */
-    { INDEX_op_and_i32, { R, RI, RI } },
+    /* The first input of the operations that have tci_<op>i forms is
+       always a register; see tcg-target.opc.h. */
+    { INDEX_op_and_i32, { R, R, RI } },
 #if TCG_TARGET_HAS_andc_i32
     { INDEX_op_andc_i32, { R, RI, RI } },
 #endif
@@ -97,14 +97,14 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
 #if TCG_TARGET_HAS_nor_i32
     { INDEX_op_nor_i32, { R, RI, RI } },
 #endif
-    { INDEX_op_or_i32, { R, RI, RI } },
+    { INDEX_op_or_i32, { R, R, RI } },
 #if TCG_TARGET_HAS_orc_i32
     { INDEX_op_orc_i32, { R, RI, RI } },
 #endif
-    { INDEX_op_xor_i32, { R, RI, RI } },
-    { INDEX_op_shl_i32, { R, RI, RI } },
-    { INDEX_op_shr_i32, { R, RI, RI } },
-    { INDEX_op_sar_i32, { R, RI, RI } },
+    { INDEX_op_xor_i32, { R, R, RI } },
+    { INDEX_op_shl_i32, { R, R, RI } },
+    { INDEX_op_shr_i32, { R, R, RI } },
+    { INDEX_op_sar_i32, { R, R, RI } },
 #if TCG_TARGET_HAS_rot_i32
     { INDEX_op_rotl_i32, { R, RI, RI } },
     { INDEX_op_rotr_i32, { R, RI, RI } },
@@ -150,8 +150,8 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
     { INDEX_op_st32_i64, { R, R } },
     { INDEX_op_st_i64, { R, R } },
 
-    { INDEX_op_add_i64, { R, RI, RI } },
-    { INDEX_op_sub_i64, { R, RI, RI } },
+    { INDEX_op_add_i64, { R, R, RI } },
+    { INDEX_op_sub_i64, { R, R, RI } },
     { INDEX_op_mul_i64, { R, RI, RI } },
 #if TCG_TARGET_HAS_div_i64
     { INDEX_op_div_i64, { R, R, R } },
@@ -162,7 +162,7 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
     { INDEX_op_div2_i64, { R, R, "0", "1", R } },
     { INDEX_op_divu2_i64, { R, R, "0", "1", R } },
 #endif
-    { INDEX_op_and_i64, { R, RI, RI } },
+    { INDEX_op_and_i64, { R, R, RI } },
 #if TCG_TARGET_HAS_andc_i64
     { INDEX_op_andc_i64, { R, RI, RI } },
 #endif
@@ -175,14 +175,14 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
 #if TCG_TARGET_HAS_nor_i64
     { INDEX_op_nor_i64, { R, RI, RI } },
 #endif
-    { INDEX_op_or_i64, { R, RI, RI } },
+    { INDEX_op_or_i64, { R, R, RI } },
 #if TCG_TARGET_HAS_orc_i64
     { INDEX_op_orc_i64, { R, RI, RI } },
 #endif
-    { INDEX_op_xor_i64, { R, RI, RI } },
-    { INDEX_op_shl_i64, { R, RI, RI } },
-    { INDEX_op_shr_i64, { R, RI, RI } },
-    { INDEX_op_sar_i64, { R, RI, RI } },
+    { INDEX_op_xor_i64, { R, R, RI } },
+    { INDEX_op_shl_i64, { R, R, RI } },
+    { INDEX_op_shr_i64, { R, R, RI } },
+    { INDEX_op_sar_i64, { R, R, RI } },
 #if TCG_TARGET_HAS_rot_i64
     { INDEX_op_rotl_i64, { R, RI, RI } },
     { INDEX_op_rotr_i64, { R, RI, RI } },
@@ -462,6 +462,98 @@ static void tcg_out_ri64(TCGContext *s, int const_arg, TCGArg arg)
 }
 #endif
 
+/*
+ * Where the last operation written starts and ends, so that the next one
+ * can turn it into a superinstruction if the two are adjacent.  Labels do
+ * not matter: the second operation is left in place.
+ */
+static uint8_t *tci_prev_op;
+static uint8_t *tci_prev_end;
+
+/* Finish the operation that starts at @op_ptr. */
+static void tci_out_end(TCGContext *s, uint8_t *op_ptr)
+{
+    op_ptr[1] = s->code_ptr - op_ptr;
+    tci_prev_op = op_ptr;
+    tci_prev_end = s->code_ptr;
+}
+
+/*
+ * The operation at @op_ptr is being written; if it comes right after
+ * @first, make that @fused.
+ */
+static void tci_fuse(uint8_t *op_ptr, TCGOpcode first, TCGOpcode fused)
+{
+    if (tci_prev_end == op_ptr && tci_prev_op[0] == first) {
+        tci_prev_op[0] = fused;
+    }
+}
+
+static void tci_fuse_st(uint8_t *op_ptr, TCGOpcode opc)
+{
+    if (opc == INDEX_op_st_i32) {
+        tci_fuse(op_ptr, INDEX_op_movi_i32, INDEX_op_tci_movi_st_i32);
+    }
+#if TCG_TARGET_REG_BITS == 64
+    if (opc == INDEX_op_st_i64) {
+        tci_fuse(op_ptr, INDEX_op_movi_i64, INDEX_op_tci_movi_st_i64);
+        tci_fuse(op_ptr, INDEX_op_movi_i32, INDEX_op_tci_movi32_st_i64);
+    }
+#endif
+}
+
+/* The tci_<op>i forms of the operations that have one */
+static const uint8_t tci_opi[NB_OPS] = {
+    [INDEX_op_add_i32] = INDEX_op_tci_addi_i32,
+    [INDEX_op_sub_i32] = INDEX_op_tci_subi_i32,
+    [INDEX_op_and_i32] = INDEX_op_tci_andi_i32,
+    [INDEX_op_or_i32] = INDEX_op_tci_ori_i32,
+    [INDEX_op_xor_i32] = INDEX_op_tci_xori_i32,
+    [INDEX_op_shl_i32] = INDEX_op_tci_shli_i32,
+    [INDEX_op_shr_i32] = INDEX_op_tci_shri_i32,
+    [INDEX_op_sar_i32] = INDEX_op_tci_sari_i32,
+#if TCG_TARGET_REG_BITS == 64
+    [INDEX_op_add_i64] = INDEX_op_tci_addi_i64,
+    [INDEX_op_sub_i64] = INDEX_op_tci_subi_i64,
+    [INDEX_op_and_i64] = INDEX_op_tci_andi_i64,
+    [INDEX_op_or_i64] = INDEX_op_tci_ori_i64,
+    [INDEX_op_xor_i64] = INDEX_op_tci_xori_i64,
+    [INDEX_op_shl_i64] = INDEX_op_tci_shli_i64,
+    [INDEX_op_shr_i64] = INDEX_op_tci_shri_i64,
+    [INDEX_op_sar_i64] = INDEX_op_tci_sari_i64,
+#endif
+};
+
+/*
+ * Write register inputs @a and @b of the operation at @op_ptr, or switch
+ * it to its tci_<op>i form @opci if @b is a constant.
+ */
+static void tci_out_rri32(TCGContext *s, uint8_t *op_ptr, TCGOpcode opci,
+                          TCGArg a, int const_b, TCGArg b)
+{
+    tcg_out_r(s, a);
+    if (const_b) {
+        op_ptr[0] = opci;
+        tcg_out32(s, b);
+    } else {
+        tcg_out_r(s, b);
+    }
+}
+
+#if TCG_TARGET_REG_BITS == 64
+static void tci_out_rri64(TCGContext *s, uint8_t *op_ptr, TCGOpcode opci,
+                          TCGArg a, int const_b, TCGArg b)
+{
+    tcg_out_r(s, a);
+    if (const_b) {
+        op_ptr[0] = opci;
+        tcg_out64(s, b);
+    } else {
+        tcg_out_r(s, b);
+    }
+}
+#endif
+
 /* Write label. */
 static void tci_out_label(TCGContext *s, TCGLabel *label)
 {
@@ -495,7 +587,7 @@ static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
@@ -509,7 +601,7 @@ static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
 #endif
     tcg_out_r(s, ret);
     tcg_out_r(s, arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_movi(TCGContext *s, TCGType type,
@@ -531,7 +623,7 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static inline void tcg_out_call(TCGContext *s, tcg_insn_unit *arg)
@@ -539,7 +631,7 @@ static inline void tcg_out_call(TCGContext *s, tcg_insn_unit *arg)
     uint8_t *old_code_ptr = s->code_ptr;
     tcg_out_op_t(s, INDEX_op_call);
     tcg_out_ri(s, 1, (uintptr_t)arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
@@ -618,21 +710,26 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         tcg_out_r(s, args[1]);
         tcg_debug_assert(args[2] == (int32_t)args[2]);
         tcg_out32(s, args[2]);
+        tci_fuse_st(old_code_ptr, opc);
         break;
     case INDEX_op_add_i32:
     case INDEX_op_sub_i32:
-    case INDEX_op_mul_i32:
     case INDEX_op_and_i32:
-    case INDEX_op_andc_i32:     /* Optional (TCG_TARGET_HAS_andc_i32). */
-    case INDEX_op_eqv_i32:      /* Optional (TCG_TARGET_HAS_eqv_i32). */
-    case INDEX_op_nand_i32:     /* Optional (TCG_TARGET_HAS_nand_i32). */
-    case INDEX_op_nor_i32:      /* Optional (TCG_TARGET_HAS_nor_i32). */
     case INDEX_op_or_i32:
-    case INDEX_op_orc_i32:      /* Optional (TCG_TARGET_HAS_orc_i32). */
     case INDEX_op_xor_i32:
     case INDEX_op_shl_i32:
     case INDEX_op_shr_i32:
     case INDEX_op_sar_i32:
+        tcg_out_r(s, args[0]);
+        tci_out_rri32(s, old_code_ptr, tci_opi[opc],
+                      args[1], const_args[2], args[2]);
+        break;
+    case INDEX_op_mul_i32:
+    case INDEX_op_andc_i32:     /* Optional (TCG_TARGET_HAS_andc_i32). */
+    case INDEX_op_eqv_i32:      /* Optional (TCG_TARGET_HAS_eqv_i32). */
+    case INDEX_op_nand_i32:     /* Optional (TCG_TARGET_HAS_nand_i32). */
+    case INDEX_op_nor_i32:      /* Optional (TCG_TARGET_HAS_nor_i32). */
+    case INDEX_op_orc_i32:      /* Optional (TCG_TARGET_HAS_orc_i32). */
     case INDEX_op_rotl_i32:     /* Optional (TCG_TARGET_HAS_rot_i32). */
     case INDEX_op_rotr_i32:     /* Optional (TCG_TARGET_HAS_rot_i32). */
         tcg_out_r(s, args[0]);
@@ -652,18 +749,22 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
 #if TCG_TARGET_REG_BITS == 64
     case INDEX_op_add_i64:
     case INDEX_op_sub_i64:
-    case INDEX_op_mul_i64:
     case INDEX_op_and_i64:
-    case INDEX_op_andc_i64:     /* Optional (TCG_TARGET_HAS_andc_i64). */
-    case INDEX_op_eqv_i64:      /* Optional (TCG_TARGET_HAS_eqv_i64). */
-    case INDEX_op_nand_i64:     /* Optional (TCG_TARGET_HAS_nand_i64). */
-    case INDEX_op_nor_i64:      /* Optional (TCG_TARGET_HAS_nor_i64). */
     case INDEX_op_or_i64:
-    case INDEX_op_orc_i64:      /* Optional (TCG_TARGET_HAS_orc_i64). */
     case INDEX_op_xor_i64:
     case INDEX_op_shl_i64:
     case INDEX_op_shr_i64:
     case INDEX_op_sar_i64:
+        tcg_out_r(s, args[0]);
+        tci_out_rri64(s, old_code_ptr, tci_opi[opc],
+                      args[1], const_args[2], args[2]);
+        break;
+    case INDEX_op_mul_i64:
+    case INDEX_op_andc_i64:     /* Optional (TCG_TARGET_HAS_andc_i64). */
+    case INDEX_op_eqv_i64:      /* Optional (TCG_TARGET_HAS_eqv_i64). */
+    case INDEX_op_nand_i64:     /* Optional (TCG_TARGET_HAS_nand_i64). */
+    case INDEX_op_nor_i64:      /* Optional (TCG_TARGET_HAS_nor_i64). */
+    case INDEX_op_orc_i64:      /* Optional (TCG_TARGET_HAS_orc_i64). */
     case INDEX_op_rotl_i64:     /* Optional (TCG_TARGET_HAS_rot_i64). */
     case INDEX_op_rotr_i64:     /* Optional (TCG_TARGET_HAS_rot_i64). */
         tcg_out_r(s, args[0]);
@@ -690,8 +791,8 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         TODO();
         break;
     case INDEX_op_brcond_i64:
-        tcg_out_r(s, args[0]);
-        tcg_out_ri64(s, const_args[1], args[1]);
+        tci_out_rri64(s, old_code_ptr, INDEX_op_tci_brcondi_i64,
+                      args[0], const_args[1], args[1]);
         tcg_out8(s, args[2]);           /* condition */
         tci_out_label(s, arg_label(args[3]));
         break;
@@ -758,8 +859,12 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         break;
 #endif
     case INDEX_op_brcond_i32:
-        tcg_out_r(s, args[0]);
-        tcg_out_ri32(s, const_args[1], args[1]);
+        tci_out_rri32(s, old_code_ptr, INDEX_op_tci_brcondi_i32,
+                      args[0], const_args[1], args[1]);
+        if (const_args[1]) {
+            tci_fuse(old_code_ptr, INDEX_op_ld_i32,
+                     INDEX_op_tci_ld_brcondi_i32);
+        }
         tcg_out8(s, args[2]);           /* condition */
         tci_out_label(s, arg_label(args[3]));
         break;
@@ -811,7 +916,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
     default:
         tcg_abort();
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
@@ -823,6 +928,7 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
         tcg_out_r(s, arg);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
+        tci_fuse_st(old_code_ptr, INDEX_op_st_i32);
     } else {
         tcg_debug_assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
@@ -830,11 +936,12 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
         tcg_out_r(s, arg);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
+        tci_fuse_st(old_code_ptr, INDEX_op_st_i64);
 #else
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static inline bool tcg_out_sti(TCGContext *s, TCGType type, TCGArg val,
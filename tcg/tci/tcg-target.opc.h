@@ -0,0 +1,69 @@
+/*
+ * Tiny Code Generator for QEMU
+ *
+ * Copyright (c) 2016 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Bytecode operations of the interpreter that TCG itself never generates,
+ * included by tcg-opc.h.  The backend writes them in place of ordinary
+ * operations.
+ *
+ * tci_<op>i_* take a register and a constant, where <op> takes two
+ * registers.  The interpreter never has to check their operands for
+ * TCG_CONST.
+ *
+ * The others are superinstructions that replace the first of two adjacent
+ * operations and run both.  The second operation stays in the bytecode,
+ * so that a branch can still go straight to it.
+ */
+
+DEF(tci_addi_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_subi_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_andi_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_ori_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_xori_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_shli_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_shri_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_sari_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_brcondi_i32, 0, 1, 3, TCG_OPF_BB_END | TCG_OPF_NOT_PRESENT)
+
+/* ld_i32 followed by tci_brcondi_i32, as in the exit check of every TB */
+DEF(tci_ld_brcondi_i32, 1, 1, 1, TCG_OPF_NOT_PRESENT)
+/* movi_i32 followed by st_i32, as in stores of the guest PC */
+DEF(tci_movi_st_i32, 1, 0, 1, TCG_OPF_NOT_PRESENT)
+
+#if TCG_TARGET_REG_BITS == 64
+DEF(tci_addi_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_subi_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_andi_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_ori_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_xori_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_shli_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_shri_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_sari_i64, 1, 1, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_brcondi_i64, 0, 1, 3,
+    TCG_OPF_BB_END | TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+
+/* movi_i64 (or movi_i32 for small constants) followed by st_i64 */
+DEF(tci_movi_st_i64, 1, 0, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_movi32_st_i64, 1, 0, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+#endif
@@ -462,790 +462,1170 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
 # define qemu_st_beq(X)  stq_be_p(g2h(taddr), X)
 #endif
 
+/*
+ * The interpreter uses threaded dispatch: every operation ends with its
+ * own indirect jump through the dispatch table to the handler of the next
+ * one, op_<name> for INDEX_op_<name>.  Unlike the single jump of a switch
+ * statement, these jumps let the branch predictor of the host learn which
+ * operation usually follows which.
+ */
+#if defined(CONFIG_DEBUG_TCG) && !defined(NDEBUG)
+# define TCI_START_DEBUG() \
+    do { \
+        op_size = tb_ptr[1]; \
+        old_code_ptr = tb_ptr; \
+    } while (0)
+#else
+# define TCI_START_DEBUG() do { } while (0)
+#endif
+#if defined(GETPC)
+# define TCI_SET_GETPC() (tci_tb_ptr = (uintptr_t)tb_ptr)
+#else
+# define TCI_SET_GETPC() ((void)0)
+#endif
+
+/* Skip the opcode and size entry of the operation at tb_ptr. */
+#define TCI_START() \
+    do { \
+        TCI_START_DEBUG(); \
+        TCI_SET_GETPC(); \
+        tb_ptr += 2; \
+    } while (0)
+
+/* Run the operation at tb_ptr. */
+#define TCI_DISPATCH() \
+    do { \
+        opc = tb_ptr[0]; \
+        tci_assert(opc < NB_OPS); \
+        TCI_START(); \
+        goto *dispatch[opc]; \
+    } while (0)
+
+/* End of an operation that does not branch. */
+#define TCI_NEXT() \
+    do { \
+        tci_assert(tb_ptr == old_code_ptr + op_size); \
+        TCI_DISPATCH(); \
+    } while (0)
+
+/*
+ * End of the first half of a fused operation.  The second half is the
+ * following operation, which is known to be INDEX_op_<name>, so go
+ * there without a trip through the dispatch table.
+ */
+#define TCI_FUSE(name) \
+    do { \
+        tci_assert(tb_ptr == old_code_ptr + op_size); \
+        tci_assert(tb_ptr[0] == INDEX_op_##name); \
+        TCI_START(); \
+        goto op_##name; \
+    } while (0)
+
 /* Interpret pseudo code in tb. */
 uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 {
+    static const void *const dispatch[NB_OPS] = {
+        [0 ... NB_OPS - 1] = &&op_todo,
+        [INDEX_op_call] = &&op_call,
+        [INDEX_op_br] = &&op_br,
+        [INDEX_op_setcond_i32] = &&op_setcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_setcond2_i32] = &&op_setcond2_i32,
+#elif TCG_TARGET_REG_BITS == 64
+        [INDEX_op_setcond_i64] = &&op_setcond_i64,
+#endif
+        [INDEX_op_mov_i32] = &&op_mov_i32,
+        [INDEX_op_movi_i32] = &&op_movi_i32,
+        [INDEX_op_ld8u_i32] = &&op_ld8u_i32,
+        [INDEX_op_ld8s_i32] = &&op_ld8s_i32,
+        [INDEX_op_ld16u_i32] = &&op_ld16u_i32,
+        [INDEX_op_ld16s_i32] = &&op_ld16s_i32,
+        [INDEX_op_ld_i32] = &&op_ld_i32,
+        [INDEX_op_st8_i32] = &&op_st8_i32,
+        [INDEX_op_st16_i32] = &&op_st16_i32,
+        [INDEX_op_st_i32] = &&op_st_i32,
+        [INDEX_op_add_i32] = &&op_add_i32,
+        [INDEX_op_sub_i32] = &&op_sub_i32,
+        [INDEX_op_mul_i32] = &&op_mul_i32,
+#if TCG_TARGET_HAS_div_i32
+        [INDEX_op_div_i32] = &&op_div_i32,
+        [INDEX_op_divu_i32] = &&op_divu_i32,
+        [INDEX_op_rem_i32] = &&op_rem_i32,
+        [INDEX_op_remu_i32] = &&op_remu_i32,
+#elif TCG_TARGET_HAS_div2_i32
+        [INDEX_op_div2_i32] = &&op_div2_i32,
+        [INDEX_op_divu2_i32] = &&op_divu2_i32,
+#endif
+        [INDEX_op_and_i32] = &&op_and_i32,
+        [INDEX_op_or_i32] = &&op_or_i32,
+        [INDEX_op_xor_i32] = &&op_xor_i32,
+        [INDEX_op_shl_i32] = &&op_shl_i32,
+        [INDEX_op_shr_i32] = &&op_shr_i32,
+        [INDEX_op_sar_i32] = &&op_sar_i32,
+#if TCG_TARGET_HAS_rot_i32
+        [INDEX_op_rotl_i32] = &&op_rotl_i32,
+        [INDEX_op_rotr_i32] = &&op_rotr_i32,
+#endif
+#if TCG_TARGET_HAS_deposit_i32
+        [INDEX_op_deposit_i32] = &&op_deposit_i32,
+#endif
+        [INDEX_op_brcond_i32] = &&op_brcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_add2_i32] = &&op_add2_i32,
+        [INDEX_op_sub2_i32] = &&op_sub2_i32,
+        [INDEX_op_brcond2_i32] = &&op_brcond2_i32,
+        [INDEX_op_mulu2_i32] = &&op_mulu2_i32,
+#endif /* TCG_TARGET_REG_BITS == 32 */
+#if TCG_TARGET_HAS_ext8s_i32
+        [INDEX_op_ext8s_i32] = &&op_ext8s_i32,
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        [INDEX_op_ext16s_i32] = &&op_ext16s_i32,
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        [INDEX_op_ext8u_i32] = &&op_ext8u_i32,
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        [INDEX_op_ext16u_i32] = &&op_ext16u_i32,
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        [INDEX_op_bswap16_i32] = &&op_bswap16_i32,
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        [INDEX_op_bswap32_i32] = &&op_bswap32_i32,
+#endif
+#if TCG_TARGET_HAS_not_i32
+        [INDEX_op_not_i32] = &&op_not_i32,
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        [INDEX_op_neg_i32] = &&op_neg_i32,
+#endif
+        [INDEX_op_tci_addi_i32] = &&op_tci_addi_i32,
+        [INDEX_op_tci_subi_i32] = &&op_tci_subi_i32,
+        [INDEX_op_tci_andi_i32] = &&op_tci_andi_i32,
+        [INDEX_op_tci_ori_i32] = &&op_tci_ori_i32,
+        [INDEX_op_tci_xori_i32] = &&op_tci_xori_i32,
+        [INDEX_op_tci_shli_i32] = &&op_tci_shli_i32,
+        [INDEX_op_tci_shri_i32] = &&op_tci_shri_i32,
+        [INDEX_op_tci_sari_i32] = &&op_tci_sari_i32,
+        [INDEX_op_tci_brcondi_i32] = &&op_tci_brcondi_i32,
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_mov_i64] = &&op_mov_i64,
+        [INDEX_op_movi_i64] = &&op_movi_i64,
+        [INDEX_op_ld8u_i64] = &&op_ld8u_i64,
+        [INDEX_op_ld8s_i64] = &&op_ld8s_i64,
+        [INDEX_op_ld16u_i64] = &&op_ld16u_i64,
+        [INDEX_op_ld16s_i64] = &&op_ld16s_i64,
+        [INDEX_op_ld32u_i64] = &&op_ld32u_i64,
+        [INDEX_op_ld32s_i64] = &&op_ld32s_i64,
+        [INDEX_op_ld_i64] = &&op_ld_i64,
+        [INDEX_op_st8_i64] = &&op_st8_i64,
+        [INDEX_op_st16_i64] = &&op_st16_i64,
+        [INDEX_op_st32_i64] = &&op_st32_i64,
+        [INDEX_op_st_i64] = &&op_st_i64,
+        [INDEX_op_add_i64] = &&op_add_i64,
+        [INDEX_op_sub_i64] = &&op_sub_i64,
+        [INDEX_op_mul_i64] = &&op_mul_i64,
+#if TCG_TARGET_HAS_div_i64
+        [INDEX_op_div_i64] = &&op_div_i64,
+        [INDEX_op_divu_i64] = &&op_divu_i64,
+        [INDEX_op_rem_i64] = &&op_rem_i64,
+        [INDEX_op_remu_i64] = &&op_remu_i64,
+#elif TCG_TARGET_HAS_div2_i64
+        [INDEX_op_div2_i64] = &&op_div2_i64,
+        [INDEX_op_divu2_i64] = &&op_divu2_i64,
+#endif
+        [INDEX_op_and_i64] = &&op_and_i64,
+        [INDEX_op_or_i64] = &&op_or_i64,
+        [INDEX_op_xor_i64] = &&op_xor_i64,
+        [INDEX_op_shl_i64] = &&op_shl_i64,
+        [INDEX_op_shr_i64] = &&op_shr_i64,
+        [INDEX_op_sar_i64] = &&op_sar_i64,
+#if TCG_TARGET_HAS_rot_i64
+        [INDEX_op_rotl_i64] = &&op_rotl_i64,
+        [INDEX_op_rotr_i64] = &&op_rotr_i64,
+#endif
+#if TCG_TARGET_HAS_deposit_i64
+        [INDEX_op_deposit_i64] = &&op_deposit_i64,
+#endif
+        [INDEX_op_brcond_i64] = &&op_brcond_i64,
+#if TCG_TARGET_HAS_ext8u_i64
+        [INDEX_op_ext8u_i64] = &&op_ext8u_i64,
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        [INDEX_op_ext8s_i64] = &&op_ext8s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        [INDEX_op_ext16s_i64] = &&op_ext16s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        [INDEX_op_ext16u_i64] = &&op_ext16u_i64,
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        [INDEX_op_ext32s_i64] = &&op_ext32s_i64,
+#endif
+        [INDEX_op_ext_i32_i64] = &&op_ext_i32_i64,
+#if TCG_TARGET_HAS_ext32u_i64
+        [INDEX_op_ext32u_i64] = &&op_ext32u_i64,
+#endif
+        [INDEX_op_extu_i32_i64] = &&op_extu_i32_i64,
+#if TCG_TARGET_HAS_bswap16_i64
+        [INDEX_op_bswap16_i64] = &&op_bswap16_i64,
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        [INDEX_op_bswap32_i64] = &&op_bswap32_i64,
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        [INDEX_op_bswap64_i64] = &&op_bswap64_i64,
+#endif
+#if TCG_TARGET_HAS_not_i64
+        [INDEX_op_not_i64] = &&op_not_i64,
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        [INDEX_op_neg_i64] = &&op_neg_i64,
+#endif
+        [INDEX_op_tci_addi_i64] = &&op_tci_addi_i64,
+        [INDEX_op_tci_subi_i64] = &&op_tci_subi_i64,
+        [INDEX_op_tci_andi_i64] = &&op_tci_andi_i64,
+        [INDEX_op_tci_ori_i64] = &&op_tci_ori_i64,
+        [INDEX_op_tci_xori_i64] = &&op_tci_xori_i64,
+        [INDEX_op_tci_shli_i64] = &&op_tci_shli_i64,
+        [INDEX_op_tci_shri_i64] = &&op_tci_shri_i64,
+        [INDEX_op_tci_sari_i64] = &&op_tci_sari_i64,
+        [INDEX_op_tci_brcondi_i64] = &&op_tci_brcondi_i64,
+        [INDEX_op_tci_movi_st_i64] = &&op_tci_movi_st_i64,
+        [INDEX_op_tci_movi32_st_i64] = &&op_tci_movi32_st_i64,
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        [INDEX_op_tci_ld_brcondi_i32] = &&op_tci_ld_brcondi_i32,
+        [INDEX_op_tci_movi_st_i32] = &&op_tci_movi_st_i32,
+        [INDEX_op_exit_tb] = &&op_exit_tb,
+        [INDEX_op_goto_tb] = &&op_goto_tb,
+        [INDEX_op_qemu_ld_i32] = &&op_qemu_ld_i32,
+        [INDEX_op_qemu_ld_i64] = &&op_qemu_ld_i64,
+        [INDEX_op_qemu_st_i32] = &&op_qemu_st_i32,
+        [INDEX_op_qemu_st_i64] = &&op_qemu_st_i64,
+        [INDEX_op_mb] = &&op_mb,
+    };
     long tcg_temps[CPU_TEMP_BUF_NLONGS];
     uintptr_t sp_value = (uintptr_t)(tcg_temps + CPU_TEMP_BUF_NLONGS);
     uintptr_t ret = 0;
-
-    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
-    tci_reg[TCG_REG_CALL_STACK] = sp_value;
-    tci_assert(tb_ptr);
-
-    for (;;) {
-        TCGOpcode opc = tb_ptr[0];
+    TCGOpcode opc;
 #if defined(CONFIG_DEBUG_TCG) && !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
-#endif
-        tcg_target_ulong t0;
-        tcg_target_ulong t1;
-        tcg_target_ulong t2;
-        tcg_target_ulong label;
-        TCGCond condition;
-        target_ulong taddr;
-        uint8_t tmp8;
-        uint16_t tmp16;
-        uint32_t tmp32;
-        uint64_t tmp64;
+    uint8_t op_size;
+    uint8_t *old_code_ptr;
+#endif
+    tcg_target_ulong t0;
+    tcg_target_ulong t1;
+    tcg_target_ulong t2;
+    tcg_target_ulong label;
+    TCGCond condition;
+    target_ulong taddr;
+    uint8_t tmp8;
+    uint16_t tmp16;
+    uint32_t tmp32;
+    uint64_t tmp64;
 #if TCG_TARGET_REG_BITS == 32
-        uint64_t v64;
+    uint64_t v64;
 #endif
-        TCGMemOpIdx oi;
+    TCGMemOpIdx oi;
 
-#if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
-#endif
+    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
+    tci_reg[TCG_REG_CALL_STACK] = sp_value;
+    tci_assert(tb_ptr);
 
-        /* Skip opcode and size entry. */
-        tb_ptr += 2;
+    TCI_DISPATCH();
 
-        switch (opc) {
-        case INDEX_op_call:
-            t0 = tci_read_ri(&tb_ptr);
+    op_call:
+        t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
-            tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
-                                          tci_read_reg(TCG_REG_R1),
-                                          tci_read_reg(TCG_REG_R2),
-                                          tci_read_reg(TCG_REG_R3),
-                                          tci_read_reg(TCG_REG_R5),
-                                          tci_read_reg(TCG_REG_R6),
-                                          tci_read_reg(TCG_REG_R7),
-                                          tci_read_reg(TCG_REG_R8),
-                                          tci_read_reg(TCG_REG_R9),
-                                          tci_read_reg(TCG_REG_R10));
-            tci_write_reg(TCG_REG_R0, tmp64);
-            tci_write_reg(TCG_REG_R1, tmp64 >> 32);
+        tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
+                                      tci_read_reg(TCG_REG_R1),
+                                      tci_read_reg(TCG_REG_R2),
+                                      tci_read_reg(TCG_REG_R3),
+                                      tci_read_reg(TCG_REG_R5),
+                                      tci_read_reg(TCG_REG_R6),
+                                      tci_read_reg(TCG_REG_R7),
+                                      tci_read_reg(TCG_REG_R8),
+                                      tci_read_reg(TCG_REG_R9),
+                                      tci_read_reg(TCG_REG_R10));
+        tci_write_reg(TCG_REG_R0, tmp64);
+        tci_write_reg(TCG_REG_R1, tmp64 >> 32);
 #else
-            tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
-                                          tci_read_reg(TCG_REG_R1),
-                                          tci_read_reg(TCG_REG_R2),
-                                          tci_read_reg(TCG_REG_R3),
-                                          tci_read_reg(TCG_REG_R5));
-            tci_write_reg(TCG_REG_R0, tmp64);
+        tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
+                                      tci_read_reg(TCG_REG_R1),
+                                      tci_read_reg(TCG_REG_R2),
+                                      tci_read_reg(TCG_REG_R3),
+                                      tci_read_reg(TCG_REG_R5));
+        tci_write_reg(TCG_REG_R0, tmp64);
 #endif
-            break;
-        case INDEX_op_br:
-            label = tci_read_label(&tb_ptr);
-            tci_assert(tb_ptr == old_code_ptr + op_size);
-            tb_ptr = (uint8_t *)label;
-            continue;
-        case INDEX_op_setcond_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
+        TCI_NEXT();
+    op_br:
+        label = tci_read_label(&tb_ptr);
+        tci_assert(tb_ptr == old_code_ptr + op_size);
+        tb_ptr = (uint8_t *)label;
+        TCI_DISPATCH();
+    op_setcond_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        condition = *tb_ptr++;
+        tci_write_reg32(t0, tci_compare32(t1, t2, condition));
+        TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
-            t0 = *tb_ptr++;
-            tmp64 = tci_read_r64(&tb_ptr);
-            v64 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
-            break;
+    op_setcond2_i32:
+        t0 = *tb_ptr++;
+        tmp64 = tci_read_r64(&tb_ptr);
+        v64 = tci_read_ri64(&tb_ptr);
+        condition = *tb_ptr++;
+        tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
+        TCI_NEXT();
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+    op_setcond_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_ri64(&tb_ptr);
+        condition = *tb_ptr++;
+        tci_write_reg64(t0, tci_compare64(t1, t2, condition));
+        TCI_NEXT();
 #endif
-        case INDEX_op_mov_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_i32(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
+    op_mov_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_NEXT();
+    op_movi_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_NEXT();
 
-            /* Load/store operations (32 bit). */
+        /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
-            TODO();
-            break;
-        case INDEX_op_ld16s_i32:
-            TODO();
-            break;
-        case INDEX_op_ld_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
-            t0 = tci_read_r8(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
-            t0 = tci_read_r16(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_assert(t1 != sp_value || (int32_t)t2 < 0);
-            *(uint32_t *)(t1 + t2) = t0;
-            break;
+    op_ld8u_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
+        TCI_NEXT();
+    op_ld8s_i32:
+    op_ld16u_i32:
+        TODO();
+        TCI_NEXT();
+    op_ld16s_i32:
+        TODO();
+        TCI_NEXT();
+    op_ld_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
+        TCI_NEXT();
+    op_st8_i32:
+        t0 = tci_read_r8(&tb_ptr);
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        *(uint8_t *)(t1 + t2) = t0;
+        TCI_NEXT();
+    op_st16_i32:
+        t0 = tci_read_r16(&tb_ptr);
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        *(uint16_t *)(t1 + t2) = t0;
+        TCI_NEXT();
+    op_st_i32:
+        t0 = tci_read_r32(&tb_ptr);
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_assert(t1 != sp_value || (int32_t)t2 < 0);
+        *(uint32_t *)(t1 + t2) = t0;
+        TCI_NEXT();
 
-            /* Arithmetic operations (32 bit). */
+        /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 * t2);
-            break;
+    op_add_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1 + t2);
+        TCI_NEXT();
+    op_sub_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1 - t2);
+        TCI_NEXT();
+    op_mul_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        tci_write_reg32(t0, t1 * t2);
+        TCI_NEXT();
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
-            break;
-        case INDEX_op_divu_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 / t2);
-            break;
-        case INDEX_op_rem_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
-            break;
-        case INDEX_op_remu_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 % t2);
-            break;
+    op_div_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
+        TCI_NEXT();
+    op_divu_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        tci_write_reg32(t0, t1 / t2);
+        TCI_NEXT();
+    op_rem_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
+        TCI_NEXT();
+    op_remu_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        tci_write_reg32(t0, t1 % t2);
+        TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
-            TODO();
-            break;
+    op_div2_i32:
+    op_divu2_i32:
+        TODO();
+        TCI_NEXT();
 #endif
-        case INDEX_op_and_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 ^ t2);
-            break;
+    op_and_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1 & t2);
+        TCI_NEXT();
+    op_or_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1 | t2);
+        TCI_NEXT();
+    op_xor_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1 ^ t2);
+        TCI_NEXT();
 
-            /* Shift/rotate operations (32 bit). */
+        /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 << (t2 & 31));
-            break;
-        case INDEX_op_shr_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 >> (t2 & 31));
-            break;
-        case INDEX_op_sar_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, ((int32_t)t1 >> (t2 & 31)));
-            break;
+    op_shl_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1 << (t2 & 31));
+        TCI_NEXT();
+    op_shr_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, t1 >> (t2 & 31));
+        TCI_NEXT();
+    op_sar_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, ((int32_t)t1 >> (t2 & 31)));
+        TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, rol32(t1, t2 & 31));
-            break;
-        case INDEX_op_rotr_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, ror32(t1, t2 & 31));
-            break;
+    op_rotl_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        tci_write_reg32(t0, rol32(t1, t2 & 31));
+        TCI_NEXT();
+    op_rotr_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri32(&tb_ptr);
+        t2 = tci_read_ri32(&tb_ptr);
+        tci_write_reg32(t0, ror32(t1, t2 & 31));
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i32
-        case INDEX_op_deposit_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            t2 = tci_read_r32(&tb_ptr);
-            tmp16 = *tb_ptr++;
-            tmp8 = *tb_ptr++;
-            tmp32 = (((1 << tmp8) - 1) << tmp16);
-            tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
-            break;
+    op_deposit_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_r32(&tb_ptr);
+        tmp16 = *tb_ptr++;
+        tmp8 = *tb_ptr++;
+        tmp32 = (((1 << tmp8) - 1) << tmp16);
+        tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
+        TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i32:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_ri32(&tb_ptr);
-            condition = *tb_ptr++;
-            label = tci_read_label(&tb_ptr);
-            if (tci_compare32(t0, t1, condition)) {
-                tci_assert(tb_ptr == old_code_ptr + op_size);
-                tb_ptr = (uint8_t *)label;
-                continue;
-            }
-            break;
+    op_brcond_i32:
+        t0 = tci_read_r32(&tb_ptr);
+        t1 = tci_read_r32(&tb_ptr);
+        condition = *tb_ptr++;
+        label = tci_read_label(&tb_ptr);
+        if (tci_compare32(t0, t1, condition)) {
+            tci_assert(tb_ptr == old_code_ptr + op_size);
+            tb_ptr = (uint8_t *)label;
+            TCI_DISPATCH();
+        }
+        TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
-            t0 = *tb_ptr++;
-            t1 = *tb_ptr++;
-            tmp64 = tci_read_r64(&tb_ptr);
-            tmp64 += tci_read_r64(&tb_ptr);
-            tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_sub2_i32:
-            t0 = *tb_ptr++;
-            t1 = *tb_ptr++;
-            tmp64 = tci_read_r64(&tb_ptr);
-            tmp64 -= tci_read_r64(&tb_ptr);
-            tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_brcond2_i32:
-            tmp64 = tci_read_r64(&tb_ptr);
-            v64 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            label = tci_read_label(&tb_ptr);
-            if (tci_compare64(tmp64, v64, condition)) {
-                tci_assert(tb_ptr == old_code_ptr + op_size);
-                tb_ptr = (uint8_t *)label;
-                continue;
-            }
-            break;
-        case INDEX_op_mulu2_i32:
-            t0 = *tb_ptr++;
-            t1 = *tb_ptr++;
-            t2 = tci_read_r32(&tb_ptr);
-            tmp64 = tci_read_r32(&tb_ptr);
-            tci_write_reg64(t1, t0, t2 * tmp64);
-            break;
+    op_add2_i32:
+        t0 = *tb_ptr++;
+        t1 = *tb_ptr++;
+        tmp64 = tci_read_r64(&tb_ptr);
+        tmp64 += tci_read_r64(&tb_ptr);
+        tci_write_reg64(t1, t0, tmp64);
+        TCI_NEXT();
+    op_sub2_i32:
+        t0 = *tb_ptr++;
+        t1 = *tb_ptr++;
+        tmp64 = tci_read_r64(&tb_ptr);
+        tmp64 -= tci_read_r64(&tb_ptr);
+        tci_write_reg64(t1, t0, tmp64);
+        TCI_NEXT();
+    op_brcond2_i32:
+        tmp64 = tci_read_r64(&tb_ptr);
+        v64 = tci_read_ri64(&tb_ptr);
+        condition = *tb_ptr++;
+        label = tci_read_label(&tb_ptr);
+        if (tci_compare64(tmp64, v64, condition)) {
+            tci_assert(tb_ptr == old_code_ptr + op_size);
+            tb_ptr = (uint8_t *)label;
+            TCI_DISPATCH();
+        }
+        TCI_NEXT();
+    op_mulu2_i32:
+        t0 = *tb_ptr++;
+        t1 = *tb_ptr++;
+        t2 = tci_read_r32(&tb_ptr);
+        tmp64 = tci_read_r32(&tb_ptr);
+        tci_write_reg64(t1, t0, t2 * tmp64);
+        TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8s(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
+    op_ext8s_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r8s(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16s(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
+    op_ext16s_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r16s(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
+    op_ext8u_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r8(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
+    op_ext16u_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r16(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg32(t0, bswap16(t1));
-            break;
+    op_bswap16_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r16(&tb_ptr);
+        tci_write_reg32(t0, bswap16(t1));
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, bswap32(t1));
-            break;
+    op_bswap32_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, bswap32(t1));
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, ~t1);
-            break;
+    op_not_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, ~t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, -t1);
-            break;
+    op_neg_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        tci_write_reg32(t0, -t1);
+        TCI_NEXT();
 #endif
+
+        /* Operations with an immediate last input (32 bit). */
+
+    op_tci_addi_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1 + t2);
+        TCI_NEXT();
+    op_tci_subi_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1 - t2);
+        TCI_NEXT();
+    op_tci_andi_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1 & t2);
+        TCI_NEXT();
+    op_tci_ori_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1 | t2);
+        TCI_NEXT();
+    op_tci_xori_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1 ^ t2);
+        TCI_NEXT();
+    op_tci_shli_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1 << (t2 & 31));
+        TCI_NEXT();
+    op_tci_shri_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1 >> (t2 & 31));
+        TCI_NEXT();
+    op_tci_sari_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        t2 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, ((int32_t)t1 >> (t2 & 31)));
+        TCI_NEXT();
+    op_tci_brcondi_i32:
+        t0 = tci_read_r32(&tb_ptr);
+        t1 = tci_read_i32(&tb_ptr);
+        condition = *tb_ptr++;
+        label = tci_read_label(&tb_ptr);
+        if (tci_compare32(t0, t1, condition)) {
+            tci_assert(tb_ptr == old_code_ptr + op_size);
+            tb_ptr = (uint8_t *)label;
+            TCI_DISPATCH();
+        }
+        TCI_NEXT();
+
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_i64(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+    op_mov_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
+    op_movi_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
 
-            /* Load/store operations (64 bit). */
+        /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
-            TODO();
-            break;
-        case INDEX_op_ld32u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld32s_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i64:
-            t0 = tci_read_r8(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i64:
-            t0 = tci_read_r16(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st32_i64:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint32_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i64:
-            t0 = tci_read_r64(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_assert(t1 != sp_value || (int32_t)t2 < 0);
-            *(uint64_t *)(t1 + t2) = t0;
-            break;
+    op_ld8u_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
+        TCI_NEXT();
+    op_ld8s_i64:
+    op_ld16u_i64:
+    op_ld16s_i64:
+        TODO();
+        TCI_NEXT();
+    op_ld32u_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
+        TCI_NEXT();
+    op_ld32s_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
+        TCI_NEXT();
+    op_ld_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
+        TCI_NEXT();
+    op_st8_i64:
+        t0 = tci_read_r8(&tb_ptr);
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        *(uint8_t *)(t1 + t2) = t0;
+        TCI_NEXT();
+    op_st16_i64:
+        t0 = tci_read_r16(&tb_ptr);
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        *(uint16_t *)(t1 + t2) = t0;
+        TCI_NEXT();
+    op_st32_i64:
+        t0 = tci_read_r32(&tb_ptr);
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        *(uint32_t *)(t1 + t2) = t0;
+        TCI_NEXT();
+    op_st_i64:
+        t0 = tci_read_r64(&tb_ptr);
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_assert(t1 != sp_value || (int32_t)t2 < 0);
+        *(uint64_t *)(t1 + t2) = t0;
+        TCI_NEXT();
 
-            /* Arithmetic operations (64 bit). */
+        /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 * t2);
-            break;
+    op_add_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1 + t2);
+        TCI_NEXT();
+    op_sub_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1 - t2);
+        TCI_NEXT();
+    op_mul_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri64(&tb_ptr);
+        t2 = tci_read_ri64(&tb_ptr);
+        tci_write_reg64(t0, t1 * t2);
+        TCI_NEXT();
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
-            TODO();
-            break;
+    op_div_i64:
+    op_divu_i64:
+    op_rem_i64:
+    op_remu_i64:
+        TODO();
+        TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
-            TODO();
-            break;
+    op_div2_i64:
+    op_divu2_i64:
+        TODO();
+        TCI_NEXT();
 #endif
-        case INDEX_op_and_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 ^ t2);
-            break;
+    op_and_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1 & t2);
+        TCI_NEXT();
+    op_or_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1 | t2);
+        TCI_NEXT();
+    op_xor_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1 ^ t2);
+        TCI_NEXT();
 
-            /* Shift/rotate operations (64 bit). */
+        /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 << (t2 & 63));
-            break;
-        case INDEX_op_shr_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 >> (t2 & 63));
-            break;
-        case INDEX_op_sar_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, ((int64_t)t1 >> (t2 & 63)));
-            break;
+    op_shl_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1 << (t2 & 63));
+        TCI_NEXT();
+    op_shr_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, t1 >> (t2 & 63));
+        TCI_NEXT();
+    op_sar_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, ((int64_t)t1 >> (t2 & 63)));
+        TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, rol64(t1, t2 & 63));
-            break;
-        case INDEX_op_rotr_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, ror64(t1, t2 & 63));
-            break;
+    op_rotl_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri64(&tb_ptr);
+        t2 = tci_read_ri64(&tb_ptr);
+        tci_write_reg64(t0, rol64(t1, t2 & 63));
+        TCI_NEXT();
+    op_rotr_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_ri64(&tb_ptr);
+        t2 = tci_read_ri64(&tb_ptr);
+        tci_write_reg64(t0, ror64(t1, t2 & 63));
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i64
-        case INDEX_op_deposit_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            t2 = tci_read_r64(&tb_ptr);
-            tmp16 = *tb_ptr++;
-            tmp8 = *tb_ptr++;
-            tmp64 = (((1ULL << tmp8) - 1) << tmp16);
-            tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
-            break;
+    op_deposit_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_r64(&tb_ptr);
+        tmp16 = *tb_ptr++;
+        tmp8 = *tb_ptr++;
+        tmp64 = (((1ULL << tmp8) - 1) << tmp16);
+        tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
+        TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i64:
-            t0 = tci_read_r64(&tb_ptr);
-            t1 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            label = tci_read_label(&tb_ptr);
-            if (tci_compare64(t0, t1, condition)) {
-                tci_assert(tb_ptr == old_code_ptr + op_size);
-                tb_ptr = (uint8_t *)label;
-                continue;
-            }
-            break;
+    op_brcond_i64:
+        t0 = tci_read_r64(&tb_ptr);
+        t1 = tci_read_r64(&tb_ptr);
+        condition = *tb_ptr++;
+        label = tci_read_label(&tb_ptr);
+        if (tci_compare64(t0, t1, condition)) {
+            tci_assert(tb_ptr == old_code_ptr + op_size);
+            tb_ptr = (uint8_t *)label;
+            TCI_DISPATCH();
+        }
+        TCI_NEXT();
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+    op_ext8u_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r8(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8s(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+    op_ext8s_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r8s(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16s(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+    op_ext16s_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r16s(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+    op_ext16u_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r16(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+    op_ext32s_i64:
 #endif
-        case INDEX_op_ext_i32_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32s(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+    op_ext_i32_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32s(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+    op_ext32u_i64:
 #endif
-        case INDEX_op_extu_i32_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+    op_extu_i32_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_NEXT();
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
-            TODO();
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg64(t0, bswap16(t1));
-            break;
+    op_bswap16_i64:
+        TODO();
+        t0 = *tb_ptr++;
+        t1 = tci_read_r16(&tb_ptr);
+        tci_write_reg64(t0, bswap16(t1));
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg64(t0, bswap32(t1));
-            break;
+    op_bswap32_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r32(&tb_ptr);
+        tci_write_reg64(t0, bswap32(t1));
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, bswap64(t1));
-            break;
+    op_bswap64_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, bswap64(t1));
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, ~t1);
-            break;
+    op_not_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, ~t1);
+        TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, -t1);
-            break;
+    op_neg_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        tci_write_reg64(t0, -t1);
+        TCI_NEXT();
 #endif
+
+        /* Operations with an immediate last input (64 bit). */
+
+    op_tci_addi_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1 + t2);
+        TCI_NEXT();
+    op_tci_subi_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1 - t2);
+        TCI_NEXT();
+    op_tci_andi_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1 & t2);
+        TCI_NEXT();
+    op_tci_ori_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1 | t2);
+        TCI_NEXT();
+    op_tci_xori_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1 ^ t2);
+        TCI_NEXT();
+    op_tci_shli_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1 << (t2 & 63));
+        TCI_NEXT();
+    op_tci_shri_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1 >> (t2 & 63));
+        TCI_NEXT();
+    op_tci_sari_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r64(&tb_ptr);
+        t2 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, ((int64_t)t1 >> (t2 & 63)));
+        TCI_NEXT();
+    op_tci_brcondi_i64:
+        t0 = tci_read_r64(&tb_ptr);
+        t1 = tci_read_i64(&tb_ptr);
+        condition = *tb_ptr++;
+        label = tci_read_label(&tb_ptr);
+        if (tci_compare64(t0, t1, condition)) {
+            tci_assert(tb_ptr == old_code_ptr + op_size);
+            tb_ptr = (uint8_t *)label;
+            TCI_DISPATCH();
+        }
+        TCI_NEXT();
+
+        /* Fused operations (64 bit). */
+
+    op_tci_movi_st_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_i64(&tb_ptr);
+        tci_write_reg64(t0, t1);
+        TCI_FUSE(st_i64);
+    op_tci_movi32_st_i64:
+        t0 = *tb_ptr++;
+        t1 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_FUSE(st_i64);
 #endif /* TCG_TARGET_REG_BITS == 64 */
 
-            /* QEMU specific operations. */
+        /* Fused operations (32 bit). */
+
+    op_tci_ld_brcondi_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_r(&tb_ptr);
+        t2 = tci_read_s32(&tb_ptr);
+        tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
+        TCI_FUSE(tci_brcondi_i32);
+    op_tci_movi_st_i32:
+        t0 = *tb_ptr++;
+        t1 = tci_read_i32(&tb_ptr);
+        tci_write_reg32(t0, t1);
+        TCI_FUSE(st_i32);
 
-        case INDEX_op_exit_tb:
-            ret = *(uint64_t *)tb_ptr;
-            goto exit;
+        /* QEMU specific operations. */
+
+    op_exit_tb:
+        ret = *(uint64_t *)tb_ptr;
+        goto exit;
+    op_goto_tb:
+        /* Jump address is aligned */
+        tb_ptr = QEMU_ALIGN_PTR_UP(tb_ptr, 4);
+        t0 = atomic_read((int32_t *)tb_ptr);
+        tb_ptr += sizeof(int32_t);
+        tci_assert(tb_ptr == old_code_ptr + op_size);
+        tb_ptr += (int32_t)t0;
+        TCI_DISPATCH();
+    op_qemu_ld_i32:
+        t0 = *tb_ptr++;
+        taddr = tci_read_ulong(&tb_ptr);
+        oi = tci_read_i(&tb_ptr);
+        switch (get_memop(oi) & (MO_BSWAP | MO_SSIZE)) {
+        case MO_UB:
+            tmp32 = qemu_ld_ub;
             break;
-        case INDEX_op_goto_tb:
-            /* Jump address is aligned */
-            tb_ptr = QEMU_ALIGN_PTR_UP(tb_ptr, 4);
-            t0 = atomic_read((int32_t *)tb_ptr);
-            tb_ptr += sizeof(int32_t);
-            tci_assert(tb_ptr == old_code_ptr + op_size);
-            tb_ptr += (int32_t)t0;
-            continue;
-        case INDEX_op_qemu_ld_i32:
-            t0 = *tb_ptr++;
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SSIZE)) {
-            case MO_UB:
-                tmp32 = qemu_ld_ub;
-                break;
-            case MO_SB:
-                tmp32 = (int8_t)qemu_ld_ub;
-                break;
-            case MO_LEUW:
-                tmp32 = qemu_ld_leuw;
-                break;
-            case MO_LESW:
-                tmp32 = (int16_t)qemu_ld_leuw;
-                break;
-            case MO_LEUL:
-                tmp32 = qemu_ld_leul;
-                break;
-            case MO_BEUW:
-                tmp32 = qemu_ld_beuw;
-                break;
-            case MO_BESW:
-                tmp32 = (int16_t)qemu_ld_beuw;
-                break;
-            case MO_BEUL:
-                tmp32 = qemu_ld_beul;
-                break;
-            default:
-                tcg_abort();
-            }
-            tci_write_reg(t0, tmp32);
+        case MO_SB:
+            tmp32 = (int8_t)qemu_ld_ub;
+            break;
+        case MO_LEUW:
+            tmp32 = qemu_ld_leuw;
+            break;
+        case MO_LESW:
+            tmp32 = (int16_t)qemu_ld_leuw;
+            break;
+        case MO_LEUL:
+            tmp32 = qemu_ld_leul;
+            break;
+        case MO_BEUW:
+            tmp32 = qemu_ld_beuw;
+            break;
+        case MO_BESW:
+            tmp32 = (int16_t)qemu_ld_beuw;
+            break;
+        case MO_BEUL:
+            tmp32 = qemu_ld_beul;
             break;
-        case INDEX_op_qemu_ld_i64:
-            t0 = *tb_ptr++;
-            if (TCG_TARGET_REG_BITS == 32) {
-                t1 = *tb_ptr++;
-            }
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SSIZE)) {
-            case MO_UB:
-                tmp64 = qemu_ld_ub;
-                break;
-            case MO_SB:
-                tmp64 = (int8_t)qemu_ld_ub;
-                break;
-            case MO_LEUW:
-                tmp64 = qemu_ld_leuw;
-                break;
-            case MO_LESW:
-                tmp64 = (int16_t)qemu_ld_leuw;
-                break;
-            case MO_LEUL:
-                tmp64 = qemu_ld_leul;
-                break;
-            case MO_LESL:
-                tmp64 = (int32_t)qemu_ld_leul;
-                break;
-            case MO_LEQ:
-                tmp64 = qemu_ld_leq;
-                break;
-            case MO_BEUW:
-                tmp64 = qemu_ld_beuw;
-                break;
-            case MO_BESW:
-                tmp64 = (int16_t)qemu_ld_beuw;
-                break;
-            case MO_BEUL:
-                tmp64 = qemu_ld_beul;
-                break;
-            case MO_BESL:
-                tmp64 = (int32_t)qemu_ld_beul;
-                break;
-            case MO_BEQ:
-                tmp64 = qemu_ld_beq;
-                break;
-            default:
-                tcg_abort();
-            }
-            tci_write_reg(t0, tmp64);
-            if (TCG_TARGET_REG_BITS == 32) {
-                tci_write_reg(t1, tmp64 >> 32);
-            }
+        default:
+            tcg_abort();
+        }
+        tci_write_reg(t0, tmp32);
+        TCI_NEXT();
+    op_qemu_ld_i64:
+        t0 = *tb_ptr++;
+        if (TCG_TARGET_REG_BITS == 32) {
+            t1 = *tb_ptr++;
+        }
+        taddr = tci_read_ulong(&tb_ptr);
+        oi = tci_read_i(&tb_ptr);
+        switch (get_memop(oi) & (MO_BSWAP | MO_SSIZE)) {
+        case MO_UB:
+            tmp64 = qemu_ld_ub;
+            break;
+        case MO_SB:
+            tmp64 = (int8_t)qemu_ld_ub;
+            break;
+        case MO_LEUW:
+            tmp64 = qemu_ld_leuw;
+            break;
+        case MO_LESW:
+            tmp64 = (int16_t)qemu_ld_leuw;
+            break;
+        case MO_LEUL:
+            tmp64 = qemu_ld_leul;
             break;
-        case INDEX_op_qemu_st_i32:
-            t0 = tci_read_r(&tb_ptr);
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
-            case MO_UB:
-                qemu_st_b(t0);
-                break;
-            case MO_LEUW:
-                qemu_st_lew(t0);
-                break;
-            case MO_LEUL:
-                qemu_st_lel(t0);
-                break;
-            case MO_BEUW:
-                qemu_st_bew(t0);
-                break;
-            case MO_BEUL:
-                qemu_st_bel(t0);
-                break;
-            default:
-                tcg_abort();
-            }
+        case MO_LESL:
+            tmp64 = (int32_t)qemu_ld_leul;
             break;
-        case INDEX_op_qemu_st_i64:
-            tmp64 = tci_read_r64(&tb_ptr);
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
-            case MO_UB:
-                qemu_st_b(tmp64);
-                break;
-            case MO_LEUW:
-                qemu_st_lew(tmp64);
-                break;
-            case MO_LEUL:
-                qemu_st_lel(tmp64);
-                break;
-            case MO_LEQ:
-                qemu_st_leq(tmp64);
-                break;
-            case MO_BEUW:
-                qemu_st_bew(tmp64);
-                break;
-            case MO_BEUL:
-                qemu_st_bel(tmp64);
-                break;
-            case MO_BEQ:
-                qemu_st_beq(tmp64);
-                break;
-            default:
-                tcg_abort();
-            }
+        case MO_LEQ:
+            tmp64 = qemu_ld_leq;
             break;
-        case INDEX_op_mb:
-            /* Ensure ordering for all kinds */
-            smp_mb();
+        case MO_BEUW:
+            tmp64 = qemu_ld_beuw;
+            break;
+        case MO_BESW:
+            tmp64 = (int16_t)qemu_ld_beuw;
+            break;
+        case MO_BEUL:
+            tmp64 = qemu_ld_beul;
+            break;
+        case MO_BESL:
+            tmp64 = (int32_t)qemu_ld_beul;
+            break;
+        case MO_BEQ:
+            tmp64 = qemu_ld_beq;
             break;
         default:
-            TODO();
+            tcg_abort();
+        }
+        tci_write_reg(t0, tmp64);
+        if (TCG_TARGET_REG_BITS == 32) {
+            tci_write_reg(t1, tmp64 >> 32);
+        }
+        TCI_NEXT();
+    op_qemu_st_i32:
+        t0 = tci_read_r(&tb_ptr);
+        taddr = tci_read_ulong(&tb_ptr);
+        oi = tci_read_i(&tb_ptr);
+        switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+        case MO_UB:
+            qemu_st_b(t0);
+            break;
+        case MO_LEUW:
+            qemu_st_lew(t0);
+            break;
+        case MO_LEUL:
+            qemu_st_lel(t0);
             break;
+        case MO_BEUW:
+            qemu_st_bew(t0);
+            break;
+        case MO_BEUL:
+            qemu_st_bel(t0);
+            break;
+        default:
+            tcg_abort();
         }
-        tci_assert(tb_ptr == old_code_ptr + op_size);
-    }
+        TCI_NEXT();
+    op_qemu_st_i64:
+        tmp64 = tci_read_r64(&tb_ptr);
+        taddr = tci_read_ulong(&tb_ptr);
+        oi = tci_read_i(&tb_ptr);
+        switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+        case MO_UB:
+            qemu_st_b(tmp64);
+            break;
+        case MO_LEUW:
+            qemu_st_lew(tmp64);
+            break;
+        case MO_LEUL:
+            qemu_st_lel(tmp64);
+            break;
+        case MO_LEQ:
+            qemu_st_leq(tmp64);
+            break;
+        case MO_BEUW:
+            qemu_st_bew(tmp64);
+            break;
+        case MO_BEUL:
+            qemu_st_bel(tmp64);
+            break;
+        case MO_BEQ:
+            qemu_st_beq(tmp64);
+            break;
+        default:
+            tcg_abort();
+        }
+        TCI_NEXT();
+    op_mb:
+        /* Ensure ordering for all kinds */
+        smp_mb();
+        TCI_NEXT();
+    op_todo:
+        TODO();
 exit:
     return ret;
 }
@@ -0,0 +1,133 @@
+/*
+ * Throughput of the accelerated kernels, for each implementation
+ * usable on the host
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/crc32c.h"
+#include "qemu/cpuinfo.h"
+#include "qemu/timer.h"
+#include "include/migration/migration.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+
+static double duration = 1.0;
+static size_t buf_size = 64 * 1024;
+static uint8_t *buf1, *buf2, *dst;
+
+static const char commands_string[] =
+    " -d = duration of each measurement, in seconds (default: 1.0)\n"
+    " -s = size of the buffers, in bytes (default: 65536)\n"
+    " -h = show this help message.\n";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+static void run_buffer_is_zero(void)
+{
+    g_assert(buffer_is_zero(buf1, buf_size));
+}
+
+static void run_crc32c(void)
+{
+    crc32c(0xffffffff, buf2, buf_size);
+}
+
+static void run_xbzrle(void)
+{
+    size_t i;
+
+    for (i = 0; i + XBZRLE_PAGE_SIZE <= buf_size; i += XBZRLE_PAGE_SIZE) {
+        xbzrle_encode_buffer(buf1 + i, buf2 + i, XBZRLE_PAGE_SIZE,
+                             dst, XBZRLE_PAGE_SIZE);
+    }
+}
+
+/* Run @fn over and over for @duration seconds and report the throughput */
+static void measure(const char *name, int accel, void (*fn)(void))
+{
+    int64_t start = get_clock();
+    int64_t end = start + duration * NANOSECONDS_PER_SECOND;
+    int64_t now;
+    uint64_t n = 0;
+
+    do {
+        fn();
+        n++;
+        now = get_clock();
+    } while (now < end);
+
+    printf("%-16s accel %d: %10.1f MB/s\n", name, accel,
+           (double)n * buf_size / 1e6 /
+           ((double)(now - start) / NANOSECONDS_PER_SECOND));
+}
+
+int main(int argc, char *argv[])
+{
+    int accel;
+    size_t i;
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:s:h");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 's':
+            buf_size = atol(optarg);
+            break;
+        case 'h':
+        default:
+            usage_complete(argv);
+        }
+    }
+    if (duration <= 0 || buf_size < XBZRLE_PAGE_SIZE) {
+        usage_complete(argv);
+    }
+    buf_size = QEMU_ALIGN_DOWN(buf_size, XBZRLE_PAGE_SIZE);
+
+    buf1 = qemu_memalign(64, buf_size);
+    buf2 = qemu_memalign(64, buf_size);
+    dst = g_malloc(XBZRLE_PAGE_SIZE);
+    memset(buf1, 0, buf_size);
+    /* A few short changed runs in each page, as XBZRLE likes it */
+    for (i = 0; i < buf_size; i++) {
+        buf2[i] = (i % 512) < 8 ? i : 0;
+    }
+
+    printf("host features: %#x\n", cpuinfo_init());
+
+    accel = 0;
+    do {
+        measure("buffer_is_zero", accel++, run_buffer_is_zero);
+    } while (test_buffer_is_zero_next_accel());
+
+    accel = 0;
+    do {
+        measure("crc32c", accel++, run_crc32c);
+    } while (test_crc32c_next_accel());
+
+    accel = 0;
+    do {
+        measure("xbzrle_encode", accel++, run_xbzrle);
+    } while (test_xbzrle_encode_next_accel());
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    g_free(dst);
+    return 0;
+}
@@ -555,8 +555,11 @@ static void ahci_test_hba_spec(AHCIQState *ahci)
     if (BITSET(ahci->cap, AHCI_CAP_CCCS)) {
         ASSERT_BIT_CLEAR(reg, AHCI_CCCCTL_EN);
         ASSERT_BIT_CLEAR(reg, AHCI_CCCCTL_RESERVED);
-        ASSERT_BIT_SET(reg, AHCI_CCCCTL_CC);
-        ASSERT_BIT_SET(reg, AHCI_CCCCTL_TV);
+        /* CC and TV reset to 1h; INT names an IRQ bit no port uses. */
+        g_assert_cmphex((reg & AHCI_CCCCTL_CC) >> ctzl(AHCI_CCCCTL_CC), ==, 1);
+        g_assert_cmphex((reg & AHCI_CCCCTL_TV) >> ctzl(AHCI_CCCCTL_TV), ==, 1);
+        g_assert_cmpuint((reg & AHCI_CCCCTL_INT) >> ctzl(AHCI_CCCCTL_INT),
+                         >=, nports_impl);
     } else {
         g_assert_cmphex(reg, ==, 0);
     }
@@ -1440,6 +1443,46 @@ static void test_ncq_simple(void)
     ahci_shutdown(ahci);
 }
 
+/**
+ * Coalesce the completions of two NCQ commands into one CCC interrupt.
+ */
+static void test_ncq_ccc(void)
+{
+    AHCIQState *ahci;
+    uint64_t ptr;
+    uint32_t reg, ccc_bit;
+    uint8_t port;
+
+    ahci = ahci_boot_and_enable(NULL);
+    g_assert(BITSET(ahci->cap, AHCI_CAP_CCCS));
+
+    port = ahci_port_select(ahci);
+    ahci_port_clear(ahci, port);
+    ptr = ahci_alloc(ahci, 4096);
+    g_assert(ptr);
+
+    /* Two completions per interrupt, and a timeout far in the future. */
+    reg = ahci_rreg(ahci, AHCI_CCCCTL);
+    ccc_bit = 1 << ((reg & AHCI_CCCCTL_INT) >> ctzl(AHCI_CCCCTL_INT));
+    ahci_wreg(ahci, AHCI_CCCPORTS, 1 << port);
+    ahci_wreg(ahci, AHCI_CCCCTL, (2 << ctzl(AHCI_CCCCTL_CC)) |
+              (0xffff << ctzl(AHCI_CCCCTL_TV)));
+    ahci_wreg(ahci, AHCI_CCCCTL, ahci_rreg(ahci, AHCI_CCCCTL) |
+              AHCI_CCCCTL_EN);
+
+    ahci_guest_io(ahci, port, WRITE_FPDMA_QUEUED, ptr, 4096, 0);
+    ASSERT_BIT_CLEAR(ahci_rreg(ahci, AHCI_IS), ccc_bit);
+    ahci_guest_io(ahci, port, READ_FPDMA_QUEUED, ptr, 4096, 0);
+    ASSERT_BIT_SET(ahci_rreg(ahci, AHCI_IS), ccc_bit);
+
+    /* IS.IPS[INT] is write-1-to-clear like the port bits. */
+    ahci_wreg(ahci, AHCI_IS, ccc_bit);
+    ASSERT_BIT_CLEAR(ahci_rreg(ahci, AHCI_IS), ccc_bit);
+
+    ahci_free(ahci, ptr);
+    ahci_shutdown(ahci);
+}
+
 static int prepare_iso(size_t size, unsigned char **buf, char **name)
 {
     char cdrom_path[] = "/tmp/qtest.iso.XXXXXX";
@@ -1812,6 +1855,7 @@ int main(int argc, char **argv)
     qtest_add_func("/ahci/reset", test_reset);
 
     qtest_add_func("/ahci/io/ncq/simple", test_ncq_simple);
+    qtest_add_func("/ahci/io/ncq/ccc", test_ncq_ccc);
     qtest_add_func("/ahci/migrate/ncq/simple", test_migrate_ncq);
     qtest_add_func("/ahci/io/ncq/retry", test_halted_ncq);
     qtest_add_func("/ahci/migrate/ncq/halted", test_migrate_halted_ncq);
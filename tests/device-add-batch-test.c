@@ -0,0 +1,118 @@
+/*
+ * device-add-batch test cases
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+static void assert_device_exists(const char *id, const char *type)
+{
+    QDict *response;
+    char *path = g_strdup_printf("/machine/peripheral/%s", id);
+
+    response = qmp("{'execute': 'qom-get',"
+                   " 'arguments': { 'path': %s, 'property': 'type' } }",
+                   path);
+    g_assert(response);
+    g_assert_cmpstr(qdict_get_try_str(response, "return"), ==, type);
+    QDECREF(response);
+    g_free(path);
+}
+
+static void test_batch(void)
+{
+    QDict *response;
+
+    qtest_start("-drive if=none,id=drive0,file=null-co://,format=raw"
+                " -drive if=none,id=drive1,file=null-co://,format=raw");
+
+    response = qmp("{'execute': 'device-add-batch',"
+                   " 'arguments': { 'devices': ["
+                   "   { 'driver': 'virtio-blk-pci', 'id': 'disk0',"
+                   "     'drive': 'drive0' },"
+                   "   { 'driver': 'virtio-blk-pci', 'id': 'disk1',"
+                   "     'drive': 'drive1' } ] } }");
+    g_assert(response);
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    assert_device_exists("disk0", "virtio-blk-pci");
+    assert_device_exists("disk1", "virtio-blk-pci");
+
+    qtest_end();
+}
+
+static void test_batch_error(void)
+{
+    QDict *response;
+    QDict *error;
+    const char *desc;
+
+    qtest_start("-drive if=none,id=drive0,file=null-co://,format=raw");
+
+    /* The second device fails, the first one stays plugged */
+    response = qmp("{'execute': 'device-add-batch',"
+                   " 'arguments': { 'devices': ["
+                   "   { 'driver': 'virtio-blk-pci', 'id': 'disk0',"
+                   "     'drive': 'drive0' },"
+                   "   { 'driver': 'no-such-device', 'id': 'disk1' } ] } }");
+    g_assert(response);
+    error = qdict_get_qdict(response, "error");
+    g_assert_cmpstr(qdict_get_try_str(error, "class"), ==, "GenericError");
+    desc = qdict_get_try_str(error, "desc");
+    g_assert(g_str_has_prefix(desc, "Device 1: "));
+    QDECREF(response);
+
+    assert_device_exists("disk0", "virtio-blk-pci");
+
+    /* Entries must be objects */
+    response = qmp("{'execute': 'device-add-batch',"
+                   " 'arguments': { 'devices': [ 'virtio-blk-pci' ] } }");
+    g_assert(response);
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+
+    qtest_end();
+}
+
+static void test_batch_memory(void)
+{
+    QDict *response;
+
+    qtest_start("-m 128M,slots=2,maxmem=1G"
+                " -object memory-backend-ram,id=mem0,size=128M"
+                " -object memory-backend-ram,id=mem1,size=128M"
+                " -drive if=none,id=drive0,file=null-co://,format=raw");
+
+    /* Memory devices are mapped one at a time within the batch */
+    response = qmp("{'execute': 'device-add-batch',"
+                   " 'arguments': { 'devices': ["
+                   "   { 'driver': 'pc-dimm', 'id': 'dimm0', 'memdev': 'mem0' },"
+                   "   { 'driver': 'virtio-blk-pci', 'id': 'disk0',"
+                   "     'drive': 'drive0' },"
+                   "   { 'driver': 'pc-dimm', 'id': 'dimm1', 'memdev': 'mem1' }"
+                   " ] } }");
+    g_assert(response);
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    assert_device_exists("dimm0", "pc-dimm");
+    assert_device_exists("disk0", "virtio-blk-pci");
+    assert_device_exists("dimm1", "pc-dimm");
+
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/device-add-batch/batch", test_batch);
+    qtest_add_func("/device-add-batch/error", test_batch_error);
+    qtest_add_func("/device-add-batch/memory", test_batch_memory);
+
+    return g_test_run();
+}
@@ -79,6 +79,7 @@
 #define AHCI_CCCCTL                       (5)
 #define AHCI_CCCCTL_EN                 (0x01)
 #define AHCI_CCCCTL_RESERVED           (0x06)
+#define AHCI_CCCCTL_INT                (0xF8)
 #define AHCI_CCCCTL_CC               (0xFF00)
 #define AHCI_CCCCTL_TV           (0xFFFF0000)
 
@@ -13,20 +13,29 @@
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void nop(void)
 {
+    qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
+                "-device nvme,drive=drv0,serial=foo");
+    qtest_end();
 }
 
-int main(int argc, char **argv)
+static void iothread_namespaces(void)
 {
-    int ret;
+    qtest_start("-object iothread,id=iothread0 "
+                "-drive id=drv0,if=none,file=null-co://,format=raw "
+                "-drive id=drv1,if=none,file=null-co://,format=raw "
+                "-drive id=drv2,if=none,file=null-co://,format=raw "
+                "-device nvme,drive=drv0,serial=foo,id=nvme0,"
+                "iothread=iothread0 "
+                "-device nvme-ns,drive=drv1,bus=nvme0.0 "
+                "-device nvme-ns,drive=drv2,bus=nvme0.0,nsid=3");
+    qtest_end();
+}
 
+int main(int argc, char **argv)
+{
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/nvme/nop", nop);
+    qtest_add_func("/nvme/iothread-namespaces", iothread_namespaces);
 
-    qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
-                "-device nvme,drive=drv0,serial=foo");
-    ret = g_test_run();
-
-    qtest_end();
-
-    return ret;
+    return g_test_run();
 }
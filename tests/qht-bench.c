@@ -9,6 +9,7 @@
 #include "qemu/atomic.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/tb-hash-xx.h"
 
 struct thread_stats {
@@ -20,13 +21,15 @@ struct thread_stats {
     size_t not_rm;
     size_t rz;
     size_t not_rz;
+    uint64_t update_ns;
+    uint64_t max_update_ns;
 };
 
 struct thread_info {
     void (*func)(struct thread_info *);
     struct thread_stats stats;
     uint64_t r;
-    bool write_op; /* writes alternate between insertions and removals */
+    uint64_t w; /* RNG state to choose between insertions and removals */
     bool resize_down;
 } QEMU_ALIGNED(64); /* avoid false sharing among threads */
 
@@ -55,7 +58,10 @@ static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
 
 static double update_rate; /* 0.0 to 1.0 */
+static double insert_rate = 0.5; /* 0.0 to 1.0, fraction of updates */
+static bool measure_latency;
 static uint64_t update_threshold;
+static uint64_t insert_threshold;
 static uint64_t resize_threshold;
 
 static size_t qht_n_elems = DEFAULT_QHT_N_ELEMS;
@@ -80,6 +86,8 @@ static const char commands_string[] =
     " -r = update range of keys (will be rounded up to pow2)\n"
     "\n"
     " -u = update rate (0.0 to 100.0), 50/50 split of insertions/removals\n"
+    " -w = insertion rate (0.0 to 100.0) of updates, the rest are removals\n"
+    " -L = measure the latency of updates\n"
     "\n"
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
@@ -157,9 +165,15 @@ static void do_rw(struct thread_info *info)
             stats->not_rd++;
         }
     } else {
+        int64_t start = 0;
+
+        if (measure_latency) {
+            start = get_clock();
+        }
         p = &keys[info->r & (update_range - 1)];
         hash = h(*p);
-        if (info->write_op) {
+        info->w = xorshift64star(info->w);
+        if (info->w < insert_threshold) {
             bool written = false;
 
             if (qht_lookup(&ht, is_equal, p, hash) == NULL) {
@@ -182,7 +196,12 @@ static void do_rw(struct thread_info *info)
                 stats->not_rm++;
             }
         }
-        info->write_op = !info->write_op;
+        if (measure_latency) {
+            uint64_t ns = get_clock() - start;
+
+            stats->update_ns += ns;
+            stats->max_update_ns = MAX(stats->max_update_ns, ns);
+        }
     }
 }
 
@@ -213,8 +232,7 @@ static void prepare_thread_info(struct thread_info *info, int i)
 {
     /* seed for the RNG; each thread should have a different one */
     info->r = (i + 1) ^ time(NULL);
-    /* the first update will be a write */
-    info->write_op = true;
+    info->w = info->r ^ UINT64_C(0x9e3779b97f4a7c15);
     /* the first resize will be down */
     info->resize_down = true;
 
@@ -264,6 +282,7 @@ static void pr_params(void)
         printf(" # resize threads   %u\n", n_rz_threads);
     }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
+    printf(" insertion rate:    %f%%\n", insert_rate * 100.0);
     printf(" offset:            %ld\n", populate_offset);
     printf(" initial key range: %zu\n", init_range);
     printf(" lookup range:      %lu\n", lookup_range);
@@ -297,6 +316,7 @@ static void htable_init(void)
 
     /* compute thresholds */
     do_threshold(update_rate, &update_threshold);
+    do_threshold(insert_rate, &insert_threshold);
     do_threshold(resize_rate, &resize_threshold);
 
     if (resize_rate) {
@@ -349,12 +369,17 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 
         s->rz += stats->rz;
         s->not_rz += stats->not_rz;
+
+        s->update_ns += stats->update_ns;
+        s->max_update_ns = MAX(s->max_update_ns, stats->max_update_ns);
     }
 }
 
 static void pr_stats(void)
 {
     struct thread_stats s = {};
+    struct qht_stats hst;
+    size_t updates;
     double tx;
 
     add_stats(&s, rw_info, n_rw_threads);
@@ -383,6 +408,18 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    updates = s.in + s.not_in + s.rm + s.not_rm;
+    if (measure_latency && updates) {
+        printf(" Update latency:    %.2f us avg, %.2f us max\n",
+               (double)s.update_ns / updates / 1e3,
+               (double)s.max_update_ns / 1e3);
+    }
+
+    qht_statistics_init(&ht, &hst);
+    printf(" Final size:        %zu entries in %zu head buckets\n",
+           hst.entries, hst.head_buckets);
+    qht_statistics_destroy(&hst);
 }
 
 static void run_test(void)
@@ -412,7 +449,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:r:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:k:K:l:Lhn:N:o:r:Rs:S:u:w:");
         if (c < 0) {
             break;
         }
@@ -442,6 +479,9 @@ static void parse_args(int argc, char *argv[])
         case 'l':
             lookup_range = pow2ceil(atol(optarg));
             break;
+        case 'L':
+            measure_latency = true;
+            break;
         case 'n':
             n_rw_threads = atoi(optarg);
             break;
@@ -472,6 +512,12 @@ static void parse_args(int argc, char *argv[])
                 update_rate = 1.0;
             }
             break;
+        case 'w':
+            insert_rate = atof(optarg) / 100.0;
+            if (insert_rate > 1.0) {
+                insert_rate = 1.0;
+            }
+            break;
         }
     }
 }
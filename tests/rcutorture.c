@@ -158,6 +158,68 @@ static void *rcu_update_perf_test(void *arg)
     return NULL;
 }
 
+static void *rcu_update_expedited_perf_test(void *arg)
+{
+    long long n_updates_local = 0;
+
+    rcu_register_thread();
+
+    *(struct rcu_reader_data **)arg = &rcu_reader;
+    atomic_inc(&nthreadsrunning);
+    while (goflag == GOFLAG_INIT) {
+        g_usleep(1000);
+    }
+    while (goflag == GOFLAG_RUN) {
+        synchronize_rcu_expedited();
+        n_updates_local++;
+    }
+    qemu_mutex_lock(&counts_mutex);
+    n_updates += n_updates_local;
+    qemu_mutex_unlock(&counts_mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * call_rcu() throughput: each "update" queues a callback that frees its
+ * own node.
+ */
+
+static long n_callbacks;
+
+static void rcu_callback_perf_free(struct rcu_head *node)
+{
+    atomic_inc(&n_callbacks);
+    g_free(node);
+}
+
+static void *rcu_call_perf_test(void *arg)
+{
+    long long n_updates_local = 0;
+    int i;
+
+    rcu_register_thread();
+
+    *(struct rcu_reader_data **)arg = &rcu_reader;
+    atomic_inc(&nthreadsrunning);
+    while (goflag == GOFLAG_INIT) {
+        g_usleep(1000);
+    }
+    while (goflag == GOFLAG_RUN) {
+        for (i = 0; i < RCU_READ_RUN; i++) {
+            call_rcu1(g_new(struct rcu_head, 1), rcu_callback_perf_free);
+        }
+        n_updates_local += RCU_READ_RUN;
+    }
+    qemu_mutex_lock(&counts_mutex);
+    n_updates += n_updates_local;
+    qemu_mutex_unlock(&counts_mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
 static void perftestinit(void)
 {
     nthreadsrunning = 0;
@@ -216,6 +278,44 @@ static void uperftest(int nupdaters, int duration)
     perftestrun(i, duration, 0, nupdaters);
 }
 
+static void xperftest(int nupdaters, int duration)
+{
+    int i;
+
+    perftestinit();
+    for (i = 0; i < nupdaters; i++) {
+        create_thread(rcu_update_expedited_perf_test);
+    }
+    perftestrun(i, duration, 0, nupdaters);
+}
+
+static void cperftest(int nupdaters, int duration)
+{
+    int64_t start;
+    int i;
+
+    perftestinit();
+    for (i = 0; i < nupdaters; i++) {
+        create_thread(rcu_call_perf_test);
+    }
+    while (atomic_read(&nthreadsrunning) < nupdaters) {
+        g_usleep(1000);
+    }
+    goflag = GOFLAG_RUN;
+    g_usleep(duration * G_USEC_PER_SEC);
+    goflag = GOFLAG_STOP;
+    wait_all_threads();
+
+    start = g_get_monotonic_time();
+    drain_call_rcu();
+    printf("n_calls: %ld  n_callbacks: %ld  nupdaters: %d duration: %d\n",
+           n_updates, atomic_read(&n_callbacks), nupdaters, duration);
+    printf("ns/call_rcu: %g  drain: %g us\n",
+           duration * 1e9 * nupdaters / n_updates,
+           (double)(g_get_monotonic_time() - start));
+    exit(0);
+}
+
 /*
  * Stress test.
  */
@@ -391,6 +491,39 @@ static void gtest_stress(int nreaders, int duration)
     }
 }
 
+#define RCU_CALL_TEST_N 10000
+
+static void *rcu_call_test(void *arg)
+{
+    int i;
+
+    rcu_register_thread();
+    for (i = 0; i < RCU_CALL_TEST_N; i++) {
+        call_rcu1(g_new(struct rcu_head, 1), rcu_callback_perf_free);
+        if (i == RCU_CALL_TEST_N / 2) {
+            /* callbacks queued both before and after a drain must run */
+            drain_call_rcu();
+        }
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void gtest_call_rcu(void)
+{
+    int i;
+
+    n_callbacks = 0;
+    for (i = 0; i < 4; i++) {
+        create_thread(rcu_call_test);
+    }
+    wait_all_threads();
+
+    /* the threads unregistered, handing their remaining callbacks over */
+    drain_call_rcu();
+    g_assert_cmpint(atomic_read(&n_callbacks), ==, 4 * RCU_CALL_TEST_N);
+}
+
 static void gtest_stress_1_1(void)
 {
     gtest_stress(1, 1);
@@ -417,7 +550,8 @@ static void gtest_stress_10_5(void)
 
 static void usage(int argc, char *argv[])
 {
-    fprintf(stderr, "Usage: %s [nreaders [ perf | stress ] ]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [nreaders [ perf | rperf | uperf | xperf | "
+            "cperf | stress ] [duration] ]\n", argv[0]);
     exit(-1);
 }
 
@@ -429,6 +563,7 @@ int main(int argc, char *argv[])
     qemu_mutex_init(&counts_mutex);
     if (argc >= 2 && argv[1][0] == '-') {
         g_test_init(&argc, &argv, NULL);
+        g_test_add_func("/rcu/torture/call-rcu", gtest_call_rcu);
         if (g_test_quick()) {
             g_test_add_func("/rcu/torture/1reader", gtest_stress_1_1);
             g_test_add_func("/rcu/torture/10readers", gtest_stress_10_1);
@@ -451,6 +586,10 @@ int main(int argc, char *argv[])
         rperftest(nreaders, duration);
     } else if (strcmp(argv[2], "uperf") == 0) {
         uperftest(nreaders, duration);
+    } else if (strcmp(argv[2], "xperf") == 0) {
+        xperftest(nreaders, duration);
+    } else if (strcmp(argv[2], "cperf") == 0) {
+        cperftest(nreaders, duration);
     } else if (strcmp(argv[2], "perf") == 0) {
         perftest(nreaders, duration);
     }
@@ -0,0 +1,183 @@
+/*
+ * TCG micro-benchmarks
+ *
+ * Each kernel stresses a different part of the translator and runs for a
+ * fixed amount of guest work, so that the rates printed can be compared
+ * between QEMU builds.  The program only uses portable C and the C
+ * library, and can be built with any Linux cross compiler.
+ *
+ * Output is one line per kernel:
+ *   <name> <iterations> <seconds> <Miter/s> <checksum>
+ * The checksum must not change between runs; scripts/tcg-bench.py uses
+ * it as a sanity check.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BUF_SIZE (64 * 1024)
+
+static uint8_t buf1[BUF_SIZE], buf2[BUF_SIZE];
+
+/* Straight-line integer arithmetic: long TBs, few memory accesses */
+static uint32_t bench_alu(unsigned long n)
+{
+    uint32_t a = 1, b = 2, c = 3;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        a = a * 1103515245 + 12345;
+        b ^= a >> 7;
+        c += (b << 3) | (a >> 29);
+        a -= c & 0xff;
+    }
+    return a ^ b ^ c;
+}
+
+/* Data dependent branches: short TBs, lots of chaining */
+static uint32_t bench_branch(unsigned long n)
+{
+    uint32_t x = 12345, sum = 0;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        x = x * 1664525 + 1013904223;
+        if (x & 0x100) {
+            sum += x >> 3;
+        } else if (x & 0x200) {
+            sum ^= x;
+        } else {
+            sum -= 7;
+        }
+    }
+    return sum;
+}
+
+/* Loads and stores through the softmmu/user memory fast path */
+static uint32_t bench_memory(unsigned long n)
+{
+    uint32_t sum = 0;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        size_t off = (i * 64) % (BUF_SIZE - 256);
+
+        memcpy(buf2 + off, buf1 + off, 256);
+        sum += buf2[off + (i & 255)];
+        buf1[off] = sum;
+    }
+    return sum;
+}
+
+/* Unaligned accesses within a page */
+static uint32_t bench_unaligned(unsigned long n)
+{
+    uint32_t sum = 0, v;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        size_t off = (i * 13) % (BUF_SIZE - 8);
+
+        memcpy(&v, buf1 + off, sizeof(v));
+        sum += v;
+        memcpy(buf2 + off, &sum, sizeof(sum));
+    }
+    return sum;
+}
+
+/* Indirect calls: exits to the main loop on most targets */
+static uint32_t add1(uint32_t x)
+{
+    return x + 1;
+}
+
+static uint32_t rol1(uint32_t x)
+{
+    return (x << 1) | (x >> 31);
+}
+
+/* Not static, so that the compiler cannot resolve the calls */
+uint32_t (*funcs[2])(uint32_t) = { add1, rol1 };
+
+static uint32_t bench_call(unsigned long n)
+{
+    uint32_t x = 1;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        x = funcs[i & 1](x);
+    }
+    return x;
+}
+
+/* Floating point: exercises the softfloat helpers */
+static uint32_t bench_float(unsigned long n)
+{
+    double x = 1.0, y = 0.5;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        x = x * 1.0000001 + y;
+        y = y / 1.0000003 - 0.25 * y;
+        if (x > 1e6) {
+            x = 1.0;
+        }
+    }
+    return (uint32_t)x ^ (uint32_t)(y * 1e6);
+}
+
+typedef struct Bench {
+    const char *name;
+    uint32_t (*fn)(unsigned long);
+    unsigned long iterations;
+} Bench;
+
+static const Bench benches[] = {
+    { "alu",        bench_alu,       50000000 },
+    { "branch",     bench_branch,    50000000 },
+    { "memory",     bench_memory,     2000000 },
+    { "unaligned",  bench_unaligned, 20000000 },
+    { "call",       bench_call,      20000000 },
+    { "float",      bench_float,     10000000 },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    double scale = argc > 1 ? atof(argv[1]) : 1.0;
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        buf1[i] = i * 7;
+    }
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const Bench *b = &benches[i];
+        unsigned long n = b->iterations * scale;
+        double start, secs;
+        uint32_t check;
+
+        if (argc > 2 && strcmp(argv[2], b->name)) {
+            continue;
+        }
+        start = now();
+        check = b->fn(n);
+        secs = now() - start;
+        printf("%-10s %10lu %8.3f %10.2f %08x\n", b->name, n, secs,
+               secs > 0 ? n / secs / 1e6 : 0, check);
+    }
+    return 0;
+}
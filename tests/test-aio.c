@@ -122,7 +122,7 @@ static void *test_acquire_thread(void *opaque)
 static void set_event_notifier(AioContext *ctx, EventNotifier *notifier,
                                EventNotifierHandler *handler)
 {
-    aio_set_event_notifier(ctx, notifier, false, handler);
+    aio_set_event_notifier(ctx, notifier, false, handler, NULL);
 }
 
 static void dummy_notifier_read(EventNotifier *unused)
@@ -375,6 +375,40 @@ static void test_flush_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+typedef struct {
+    EventNotifier e;
+    int n;
+} PollTestData;
+
+static bool poll_test_cb(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e);
+
+    return ++data->n == 3;
+}
+
+static void test_poll_mode(void)
+{
+    PollTestData data = { .n = 0 };
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, false, dummy_notifier_read,
+                           poll_test_cb);
+    while (aio_poll(ctx, false));
+
+    aio_context_set_poll_params(ctx, 1000000000, 0, 0, &error_abort);
+    ctx->poll_ns = ctx->poll_max_ns;
+
+    /* Nothing is readable, the progress comes from polling only */
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 3);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
 static void test_aio_external_client(void)
 {
     int i, j;
@@ -382,7 +416,7 @@ static void test_aio_external_client(void)
     for (i = 1; i < 3; i++) {
         EventNotifierTestData data = { .n = 0, .active = 10, .auto_set = true };
         event_notifier_init(&data.e, false);
-        aio_set_event_notifier(ctx, &data.e, true, event_ready_cb);
+        aio_set_event_notifier(ctx, &data.e, true, event_ready_cb, NULL);
         event_notifier_set(&data.e);
         for (j = 0; j < i; j++) {
             aio_disable_external(ctx);
@@ -821,6 +855,42 @@ static void test_source_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+/* Runs last: the GSource of ctx keeps reporting the epoll fd afterwards */
+static void test_source_epoll(void)
+{
+    EventNotifierTestData data[3];
+    int i;
+
+    aio_context_enable_epoll_source(ctx);
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    do {} while (g_main_context_iteration(NULL, false));
+
+    event_notifier_set(&data[0].e);
+    event_notifier_set(&data[2].e);
+    g_assert(g_main_context_iteration(NULL, false));
+    g_assert_cmpint(data[0].n, ==, 1);
+    g_assert_cmpint(data[1].n, ==, 0);
+    g_assert_cmpint(data[2].n, ==, 1);
+
+    /* A removed handler is dropped from the epoll set */
+    set_event_notifier(ctx, &data[1].e, NULL);
+    event_notifier_set(&data[1].e);
+    do {} while (g_main_context_iteration(NULL, false));
+    g_assert_cmpint(data[1].n, ==, 0);
+
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    do {} while (g_main_context_iteration(NULL, false));
+
+    test_source_wait_event_notifier();
+    test_source_flush_event_notifier();
+}
 
 /* End of tests.  */
 
@@ -856,6 +926,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll-mode",               test_poll_mode);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -871,5 +944,6 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
     g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
+    g_test_add_func("/aio-gsource/epoll",                   test_source_epoll);
     return g_test_run();
 }
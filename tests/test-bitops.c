@@ -8,6 +8,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/bitops.h"
+#include "qemu/bitmap.h"
 
 typedef struct {
     uint32_t value;
@@ -133,6 +134,48 @@ static void test_half_unshuffle64(void)
     }
 }
 
+static void test_find_next_bit(void)
+{
+    /* Long zero runs take the buffer_is_zero path */
+    const long nbits = 1000 * BITS_PER_LONG + 7;
+    const long bits[] = { 3, BITS_PER_LONG, 130 * BITS_PER_LONG + 1,
+                          200 * BITS_PER_LONG, 999 * BITS_PER_LONG + 63,
+                          nbits - 1 };
+    unsigned long *map = bitmap_new(nbits);
+    unsigned long pos;
+    int i;
+
+    g_assert_cmpint(find_next_bit(map, nbits, 0), ==, nbits);
+    for (i = 0; i < ARRAY_SIZE(bits); i++) {
+        set_bit(bits[i], map);
+    }
+
+    pos = find_next_bit(map, nbits, 0);
+    for (i = 0; i < ARRAY_SIZE(bits); i++) {
+        g_assert_cmpint(pos, ==, bits[i]);
+        pos = find_next_bit(map, nbits, pos + 1);
+    }
+    g_assert_cmpint(pos, ==, nbits);
+    g_assert_cmpint(find_next_bit(map, nbits - 1, 999 * BITS_PER_LONG + 64),
+                    ==, nbits - 1);
+    g_free(map);
+}
+
+static void test_bitmap_count_one(void)
+{
+    const long nbits = 37 * BITS_PER_LONG + 5;
+    unsigned long *map = bitmap_new(nbits + BITS_PER_LONG);
+
+    g_assert_cmpint(bitmap_count_one(map, nbits), ==, 0);
+    bitmap_set(map, 1, 3);
+    g_assert_cmpint(bitmap_count_one(map, 3), ==, 2);
+    bitmap_set(map, 2 * BITS_PER_LONG - 1, 20 * BITS_PER_LONG);
+    bitmap_set(map, nbits - 1, BITS_PER_LONG);
+    g_assert_cmpint(bitmap_count_one(map, nbits), ==,
+                    3 + 20 * BITS_PER_LONG + 1);
+    g_free(map);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -142,5 +185,7 @@ int main(int argc, char **argv)
     g_test_add_func("/bitops/half_shuffle64", test_half_shuffle64);
     g_test_add_func("/bitops/half_unshuffle32", test_half_unshuffle32);
     g_test_add_func("/bitops/half_unshuffle64", test_half_unshuffle64);
+    g_test_add_func("/bitops/find_next_bit", test_find_next_bit);
+    g_test_add_func("/bitops/bitmap_count_one", test_bitmap_count_one);
     return g_test_run();
 }
@@ -137,11 +137,64 @@ static void test_job_ids(void)
     destroy_blk(blk[2]);
 }
 
+static void test_scheduler(void)
+{
+    BlockBackend *blk[2];
+    BlockJob *job[2];
+    BlockJobSchedulerInfo *info;
+    Error *errp = NULL;
+
+    blk[0] = create_blk(NULL);
+    blk[1] = create_blk(NULL);
+    job[0] = do_test_id(blk[0], "job0", true);
+    job[1] = do_test_id(blk[1], "job1", true);
+    g_assert_cmpint(job[0]->priority, ==, BLOCK_JOB_DEFAULT_PRIORITY);
+
+    /* Without a budget jobs are never delayed */
+    g_assert_cmpint(block_job_sched_delay(job[0], 1 << 30), ==, 0);
+
+    block_job_set_priority(job[0], 0, &errp);
+    g_assert_nonnull(errp);
+    error_free(errp);
+    errp = NULL;
+    block_job_set_priority(job[0], BLOCK_JOB_MAX_PRIORITY + 1, &errp);
+    g_assert_nonnull(errp);
+    error_free(errp);
+    block_job_set_priority(job[0], 300, &error_abort);
+
+    /* 1 MB/s is 100 KB per slice, split 3:1 */
+    block_job_sched_configure(1000000, 0, 0);
+    g_assert_cmpint(block_job_sched_delay(job[0], 70000), ==, 0);
+    g_assert_cmpint(block_job_sched_delay(job[0], 10000), >, 0);
+    g_assert_cmpint(block_job_sched_delay(job[1], 20000), ==, 0);
+    g_assert_cmpint(block_job_sched_delay(job[1], 10000), >, 0);
+
+    /* Each call that copies data is one operation, empty calls are free */
+    block_job_sched_configure(0, 8, 0);
+    g_assert_cmpint(block_job_sched_delay(job[1], 512), ==, 0);
+    g_assert_cmpint(block_job_sched_delay(job[1], 0), ==, 0);
+    g_assert_cmpint(block_job_sched_delay(job[1], 512), >, 0);
+
+    info = block_job_sched_query();
+    g_assert_cmpint(info->bandwidth, ==, 0);
+    g_assert_cmpint(info->iops, ==, 8);
+    qapi_free_BlockJobSchedulerInfo(info);
+
+    block_job_sched_configure(0, 0, 0);
+    g_assert_cmpint(block_job_sched_delay(job[1], 1 << 30), ==, 0);
+
+    block_job_unref(job[0]);
+    block_job_unref(job[1]);
+    destroy_blk(blk[0]);
+    destroy_blk(blk[1]);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_abort);
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/blockjob/ids", test_job_ids);
+    g_test_add_func("/blockjob/scheduler", test_scheduler);
     return g_test_run();
 }
@@ -0,0 +1,69 @@
+/*
+ * crc32c unit-tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+
+/* Bit at a time, as in the definition of the CRC */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t length)
+{
+    int k;
+
+    while (length--) {
+        crc ^= *data++;
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void test_crc32c_1(void)
+{
+    static const uint8_t check[] = "123456789";
+    /* Large enough for the three-way path, with unaligned tails */
+    static const size_t large[] = { 767, 768, 769, 1543, 3 * 1024 + 5, 4096 };
+    static uint8_t buf[4096 + 16];
+    size_t off, len;
+    int i;
+
+    g_assert_cmphex(crc32c(0xffffffff, check, 9), ==, 0xe3069283);
+    g_assert_cmphex(crc32c(0xffffffff, check, 0), ==, 0);
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 37 + 11;
+    }
+
+    /* Cover all alignments and the tails of the wide loops */
+    for (off = 0; off < 16; off++) {
+        for (len = 0; len <= 256; len++) {
+            g_assert_cmphex(crc32c(0x12345678, buf + off, len), ==,
+                            crc32c_ref(0x12345678, buf + off, len));
+        }
+        for (i = 0; i < ARRAY_SIZE(large); i++) {
+            g_assert_cmphex(crc32c(0xffffffff, buf + off, large[i]), ==,
+                            crc32c_ref(0xffffffff, buf + off, large[i]));
+        }
+    }
+}
+
+static void test_crc32c(void)
+{
+    do {
+        test_crc32c_1();
+    } while (test_crc32c_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/accel", test_crc32c);
+
+    return g_test_run();
+}
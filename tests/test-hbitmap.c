@@ -634,6 +634,190 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L3 * 2, 3);
+    g_assert_cmpint(hbitmap_serialization_granularity(data->hb), ==, 64 << 3);
+}
+
+/* Serialize the HBitmap in chunks of @chunk bits, deserialize the result
+ * into a fresh HBitmap and check it against the shadow bitmap.
+ */
+static void hbitmap_test_serialize_roundtrip(TestHBitmapData *data,
+                                             uint64_t chunk)
+{
+    HBitmap *old = data->hb;
+    uint64_t buf_size = hbitmap_serialization_size(old, 0, data->size);
+    uint8_t *buf = g_malloc0(buf_size);
+    uint64_t pos, count, off;
+
+    for (pos = 0, off = 0; pos < data->size; pos += count) {
+        count = MIN(chunk, data->size - pos);
+        hbitmap_serialize_part(old, buf + off, pos, count);
+        off += hbitmap_serialization_size(old, pos, count);
+    }
+    g_assert_cmpint(off, ==, buf_size);
+
+    data->hb = hbitmap_alloc(data->size, data->granularity);
+    for (pos = 0, off = 0; pos < data->size; pos += count) {
+        count = MIN(chunk, data->size - pos);
+        hbitmap_deserialize_part(data->hb, buf + off, pos, count);
+        off += hbitmap_serialization_size(data->hb, pos, count);
+    }
+    hbitmap_deserialize_finish(data->hb);
+
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, hbitmap_count(old));
+
+    hbitmap_free(old);
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_whole(TestHBitmapData *data,
+                                         const void *unused)
+{
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L2 + 7, L1 * 3);
+    hbitmap_test_set(data, L3 + 22, 1);
+    hbitmap_test_serialize_roundtrip(data, data->size);
+}
+
+static void test_hbitmap_serialize_parts(TestHBitmapData *data,
+                                         const void *unused)
+{
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, L1 - 1, 2);
+    hbitmap_test_set(data, L2 - 1, L2 + 2);
+    hbitmap_test_set(data, L3, 23);
+    hbitmap_test_serialize_roundtrip(data, L2);
+}
+
+static void test_hbitmap_serialize_ones(TestHBitmapData *data,
+                                        const void *unused)
+{
+    hbitmap_test_init(data, L2 + 23, 0);
+
+    /* The last chunk is partial; bits past the end must not be counted */
+    hbitmap_deserialize_ones(data->hb, 0, data->size);
+    hbitmap_deserialize_zeroes(data->hb, L1, L1);
+    hbitmap_deserialize_finish(data->hb);
+
+    hbitmap_test_set(data, 0, data->size);
+    hbitmap_test_reset(data, L1, L1);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, data->size - L1);
+}
+
+static void test_hbitmap_serialize_compact(TestHBitmapData *data,
+                                           const void *unused)
+{
+    HBitmap *old;
+    uint8_t *buf;
+    size_t size;
+
+    hbitmap_test_init(data, L3 + 23, 0);
+    buf = hbitmap_serialize_compact(data->hb, &size);
+    g_assert_cmpint(size, ==, 0);
+    g_free(buf);
+
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L2 + 7, L1 * 3);
+    hbitmap_test_set(data, L3 + 22, 1);
+    buf = hbitmap_serialize_compact(data->hb, &size);
+    g_assert_cmpint(size, <, hbitmap_serialization_size(data->hb, 0,
+                                                         data->size));
+
+    old = data->hb;
+    data->hb = hbitmap_alloc(data->size, data->granularity);
+    hbitmap_set(data->hb, L2, L2);
+    g_assert_cmpint(hbitmap_deserialize_compact(data->hb, buf, size), ==, 0);
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, hbitmap_count(old));
+
+    /* Truncated data is rejected and leaves the bitmap empty */
+    g_assert_cmpint(hbitmap_deserialize_compact(data->hb, buf, size - 1), ==,
+                    -EINVAL);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 0);
+
+    hbitmap_free(old);
+    g_free(buf);
+}
+
+/* Set a range in @b and in the shadow bitmap, which holds the expected
+ * result of merging @b into data->hb.
+ */
+static void hbitmap_test_set_other(TestHBitmapData *data, HBitmap *b,
+                                   uint64_t first, uint64_t count)
+{
+    hbitmap_set(b, first, count);
+    while (count-- != 0) {
+        size_t pos = first >> LOG_BITS_PER_LONG;
+        int bit = first & (BITS_PER_LONG - 1);
+        first++;
+
+        data->bits[pos] |= 1UL << bit;
+    }
+}
+
+static void test_hbitmap_merge_sparse(TestHBitmapData *data,
+                                      const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    b = hbitmap_alloc(data->size, 0);
+    hbitmap_test_set(data, L2, L1 * 2);
+    hbitmap_test_set_other(data, b, L2 + L1, L1 * 2);
+    hbitmap_test_set_other(data, b, L3 * 2 - 1, 1);
+
+    g_assert(hbitmap_merge(data->hb, b));
+    hbitmap_test_check(data, 0);
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_merge_dense(TestHBitmapData *data,
+                                     const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, L3 + 23, 0);
+    b = hbitmap_alloc(data->size, 0);
+    hbitmap_test_set(data, 0, L2);
+    hbitmap_test_set(data, L3, 23);
+    hbitmap_test_set_other(data, b, L2 / 2, L3 / 2);
+
+    g_assert(hbitmap_merge(data->hb, b));
+    hbitmap_test_check(data, 0);
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_merge_large(TestHBitmapData *data,
+                                     const void *unused)
+{
+    /* Big enough to be split between two threads, if there are CPUs */
+    uint64_t size = (uint64_t)2 << (20 + LOG_BITS_PER_LONG);
+    HBitmap *a = hbitmap_alloc(size, 0);
+    HBitmap *b = hbitmap_alloc(size, 0);
+
+    hbitmap_set(a, 0, L2);
+    hbitmap_set(a, size / 2 - L1, L1 * 2);
+    hbitmap_set(b, L2 / 2, L2);
+    hbitmap_set(b, size / 2, L1 * 4);
+    hbitmap_set(b, size - size / 4, size / 4);
+
+    g_assert(hbitmap_merge(a, b));
+    g_assert_cmpint(hbitmap_count(a), ==,
+                    L2 * 3 / 2 + L1 * 5 + size / 4);
+    g_assert(hbitmap_get(a, size / 2 - 1));
+    g_assert(hbitmap_get(a, size / 2 + L1 * 4 - 1));
+    g_assert(!hbitmap_get(a, size / 2 + L1 * 4));
+    g_assert(hbitmap_get(a, size - 1));
+
+    hbitmap_free(a);
+    hbitmap_free(b);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -683,6 +867,21 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
+    hbitmap_test_add("/hbitmap/serialize/whole",
+                     test_hbitmap_serialize_whole);
+    hbitmap_test_add("/hbitmap/serialize/parts",
+                     test_hbitmap_serialize_parts);
+    hbitmap_test_add("/hbitmap/serialize/ones",
+                     test_hbitmap_serialize_ones);
+    hbitmap_test_add("/hbitmap/serialize/compact",
+                     test_hbitmap_serialize_compact);
+
+    hbitmap_test_add("/hbitmap/merge/sparse", test_hbitmap_merge_sparse);
+    hbitmap_test_add("/hbitmap/merge/dense", test_hbitmap_merge_dense);
+    hbitmap_test_add("/hbitmap/merge/large", test_hbitmap_merge_large);
     g_test_run();
 
     return 0;
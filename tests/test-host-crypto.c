@@ -0,0 +1,148 @@
+/*
+ * Host AES and carry-less multiplication unit-tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-crypto.h"
+#include "crypto/aes.h"
+
+typedef union Block {
+    uint8_t b[16];
+    uint32_t l[4];
+} Block;
+
+/* Table versions, as in the x86 emulation (little-endian hosts only) */
+static void ref_aesenc(Block *d, const Block *st, const Block *rk, bool last)
+{
+    Block r;
+    int i;
+
+    for (i = 0; i < 16 && last; i++) {
+        r.b[i] = rk->b[i] ^ AES_sbox[st->b[AES_shifts[i]]];
+    }
+    for (i = 0; i < 4 && !last; i++) {
+        r.l[i] = rk->l[i] ^ bswap32(AES_Te0[st->b[AES_shifts[4 * i + 0]]] ^
+                                    AES_Te1[st->b[AES_shifts[4 * i + 1]]] ^
+                                    AES_Te2[st->b[AES_shifts[4 * i + 2]]] ^
+                                    AES_Te3[st->b[AES_shifts[4 * i + 3]]]);
+    }
+    *d = r;
+}
+
+static void ref_aesdec(Block *d, const Block *st, const Block *rk, bool last)
+{
+    Block r;
+    int i;
+
+    for (i = 0; i < 16 && last; i++) {
+        r.b[i] = rk->b[i] ^ AES_isbox[st->b[AES_ishifts[i]]];
+    }
+    for (i = 0; i < 4 && !last; i++) {
+        r.l[i] = rk->l[i] ^ bswap32(AES_Td0[st->b[AES_ishifts[4 * i + 0]]] ^
+                                    AES_Td1[st->b[AES_ishifts[4 * i + 1]]] ^
+                                    AES_Td2[st->b[AES_ishifts[4 * i + 2]]] ^
+                                    AES_Td3[st->b[AES_ishifts[4 * i + 3]]]);
+    }
+    *d = r;
+}
+
+static void ref_aesimc(Block *d, const Block *st)
+{
+    Block r;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        r.l[i] = bswap32(AES_imc[st->b[4 * i + 0]][0] ^
+                         AES_imc[st->b[4 * i + 1]][1] ^
+                         AES_imc[st->b[4 * i + 2]][2] ^
+                         AES_imc[st->b[4 * i + 3]][3]);
+    }
+    *d = r;
+}
+
+static void ref_clmul64(uint64_t r[2], uint64_t a, uint64_t b)
+{
+    int i;
+
+    r[0] = r[1] = 0;
+    for (i = 0; i < 64; i++) {
+        if (b & (1ull << i)) {
+            r[0] ^= a << i;
+            r[1] ^= i ? a >> (64 - i) : 0;
+        }
+    }
+}
+
+static void check_block(const Block *a, const Block *b)
+{
+    g_assert(memcmp(a, b, sizeof(*a)) == 0);
+}
+
+static void test_host_crypto_1(void)
+{
+    Block st, rk, d, ref;
+    uint64_t r[2], r_ref[2];
+    uint64_t a, b;
+    int i, j;
+
+    for (i = 0; i < 64; i++) {
+        for (j = 0; j < 16; j++) {
+            st.b[j] = i * 73 + j * 29 + 5;
+            rk.b[j] = i * 31 + j * 151 + 3;
+        }
+
+        if (host_crypto & HOST_CRYPTO_AES) {
+            host_aesenc(&d, &st, &rk);
+            ref_aesenc(&ref, &st, &rk, false);
+            check_block(&d, &ref);
+            host_aesenclast(&d, &st, &rk);
+            ref_aesenc(&ref, &st, &rk, true);
+            check_block(&d, &ref);
+            host_aesdec(&d, &st, &rk);
+            ref_aesdec(&ref, &st, &rk, false);
+            check_block(&d, &ref);
+            host_aesdeclast(&d, &st, &rk);
+            ref_aesdec(&ref, &st, &rk, true);
+            check_block(&d, &ref);
+            host_aesimc(&d, &st);
+            ref_aesimc(&ref, &st);
+            check_block(&d, &ref);
+
+            /* The output may overlap the input */
+            d = st;
+            host_aesenc(&d, &d, &rk);
+            ref_aesenc(&ref, &st, &rk, false);
+            check_block(&d, &ref);
+        }
+
+        if (host_crypto & HOST_CRYPTO_CLMUL) {
+            a = 0x9e3779b97f4a7c15ull * (i + 1);
+            b = 0xc2b2ae3d27d4eb4full * (i + 7);
+            host_clmul64(r, a, b);
+            ref_clmul64(r_ref, a, b);
+            g_assert_cmphex(r[0], ==, r_ref[0]);
+            g_assert_cmphex(r[1], ==, r_ref[1]);
+        }
+    }
+}
+
+static void test_host_crypto(void)
+{
+    do {
+        test_host_crypto_1();
+    } while (test_host_crypto_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/host-crypto/accel", test_host_crypto);
+
+    return g_test_run();
+}
@@ -0,0 +1,106 @@
+/*
+ * I/O latency breakdown tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/io-trace.h"
+
+static void test_stages(void)
+{
+    IOTraceStats stats = {};
+    IOTrace trace, merged;
+    int64_t sum = 0;
+    int i;
+
+    io_trace_start(&trace, get_clock());
+    g_usleep(1000);
+    io_trace_mark(&trace, IO_TRACE_SETUP);
+    g_assert_cmpint(trace.stage_ns[IO_TRACE_SETUP], >=, 1000000);
+
+    /* I/O nested in a metadata read is charged to the metadata */
+    io_trace_enter(&trace);
+    io_trace_mark(&trace, IO_TRACE_BLOCK);
+    g_usleep(1000);
+    io_trace_mark(&trace, IO_TRACE_DEVICE);
+    io_trace_leave(&trace, IO_TRACE_METADATA);
+    g_assert_cmpint(trace.depth, ==, 0);
+    g_assert_cmpint(trace.stage_ns[IO_TRACE_DEVICE], ==, 0);
+    g_assert_cmpint(trace.stage_ns[IO_TRACE_METADATA], >=, 1000000);
+
+    io_trace_mark(&trace, IO_TRACE_DEVICE);
+    io_trace_mark(&trace, IO_TRACE_NOTIFY);
+
+    io_trace_start(&merged, trace.start_ns);
+    io_trace_mark(&merged, IO_TRACE_SETUP);
+    io_trace_inherit(&merged, &trace);
+    g_assert_cmpint(merged.stage_ns[IO_TRACE_METADATA], ==,
+                    trace.stage_ns[IO_TRACE_METADATA]);
+    g_assert_cmpint(merged.mark_ns, ==, trace.mark_ns);
+
+    io_trace_account(&stats, &trace);
+    for (i = 0; i < IO_TRACE_TOTAL; i++) {
+        sum += trace.stage_ns[i];
+    }
+    g_assert_cmpint(trace.stage_ns[IO_TRACE_TOTAL], ==, sum);
+}
+
+static void test_account(void)
+{
+    IOTraceStats stats = { .sample_every = 2 };
+    IOTrace trace;
+
+    io_trace_start(&trace, 1000);
+    trace.stage_ns[IO_TRACE_POP] = 1500;
+    trace.stage_ns[IO_TRACE_DEVICE] = 5 * NANOSECONDS_PER_SECOND;
+    trace.mark_ns = trace.start_ns + 3500;
+
+    g_assert(!io_trace_account(&stats, &trace));
+    g_assert(io_trace_account(&stats, &trace));
+    g_assert(!io_trace_account(&stats, &trace));
+    g_assert_cmpint(stats.requests, ==, 3);
+
+    /* Below 1 us, between 1 and 2 us, and above the last boundary */
+    g_assert_cmpint(stats.bins[IO_TRACE_SETUP][0], ==, 3);
+    g_assert_cmpint(stats.bins[IO_TRACE_POP][1], ==, 3);
+    g_assert_cmpint(stats.bins[IO_TRACE_DEVICE][IO_TRACE_NBINS - 1], ==, 3);
+    g_assert_cmpint(stats.bins[IO_TRACE_TOTAL][2], ==, 3);
+}
+
+static void coroutine_fn check_no_trace(void *opaque)
+{
+    *(IOTrace **)opaque = io_trace_current();
+}
+
+static void test_coroutine(void)
+{
+    IOTrace trace, *seen = &trace;
+    Coroutine *co;
+
+    io_trace_set_current(&trace);
+    g_assert(!io_trace_current());
+
+    io_trace_enable();
+    g_assert(io_trace_current() == &trace);
+
+    /* Coroutines do not inherit the trace implicitly */
+    co = qemu_coroutine_create(check_no_trace, &seen);
+    qemu_coroutine_enter(co);
+    g_assert(!seen);
+
+    io_trace_set_current(NULL);
+    io_trace_disable();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/io-trace/stages", test_stages);
+    g_test_add_func("/io-trace/account", test_account);
+    g_test_add_func("/io-trace/coroutine", test_coroutine);
+    return g_test_run();
+}
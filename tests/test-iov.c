@@ -405,6 +405,79 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_qiov_inline(void)
+{
+    QEMUIOVector qiov;
+    char buf[QEMU_IOVEC_INLINE + 1];
+    int i;
+
+    qemu_iovec_init(&qiov, 1);
+    g_assert(qiov.iov == qiov.local_iov);
+    for (i = 0; i < QEMU_IOVEC_INLINE; i++) {
+        qemu_iovec_add(&qiov, &buf[i], 1);
+    }
+    g_assert(qiov.iov == qiov.local_iov);
+
+    /* Growing past the inline storage keeps the elements */
+    qemu_iovec_add(&qiov, &buf[i], 1);
+    g_assert(qiov.iov != qiov.local_iov);
+    g_assert_cmpint(qiov.niov, ==, QEMU_IOVEC_INLINE + 1);
+    g_assert_cmpint(qiov.size, ==, QEMU_IOVEC_INLINE + 1);
+    for (i = 0; i <= QEMU_IOVEC_INLINE; i++) {
+        g_assert(qiov.iov[i].iov_base == &buf[i]);
+    }
+    qemu_iovec_destroy(&qiov);
+
+    qemu_iovec_init(&qiov, QEMU_IOVEC_INLINE + 1);
+    g_assert(qiov.iov != qiov.local_iov);
+    qemu_iovec_destroy(&qiov);
+}
+
+static void test_qiov_slice(void)
+{
+    QEMUIOVector src, slice;
+    struct iovec *iov;
+    unsigned niov;
+    size_t offset, bytes;
+    unsigned char *copy, *ref;
+
+    iov_random(&iov, &niov);
+    qemu_iovec_init_external(&src, iov, niov);
+    ref = g_malloc(src.size);
+    copy = g_malloc(src.size);
+    for (offset = 0; offset < src.size; offset++) {
+        ref[offset] = offset & 255;
+    }
+    qemu_iovec_from_buf(&src, 0, ref, src.size);
+
+    /* Whole elements are referenced, not copied */
+    qemu_iovec_init_slice(&slice, &src, iov[0].iov_len,
+                          iov[1].iov_len + iov[2].iov_len);
+    g_assert(slice.iov == &iov[1]);
+    g_assert_cmpint(slice.niov, ==, 2);
+    qemu_iovec_destroy(&slice);
+
+    qemu_iovec_init_slice(&slice, &src, 0, 0);
+    g_assert_cmpint(slice.niov, ==, 0);
+    g_assert_cmpint(slice.size, ==, 0);
+    qemu_iovec_destroy(&slice);
+
+    for (offset = 0; offset < src.size; offset++) {
+        for (bytes = 1; bytes <= src.size - offset; bytes++) {
+            qemu_iovec_init_slice(&slice, &src, offset, bytes);
+            g_assert_cmpint(slice.size, ==, bytes);
+            g_assert_cmpint(qemu_iovec_to_buf(&slice, 0, copy, bytes),
+                            ==, bytes);
+            g_assert(!memcmp(copy, ref + offset, bytes));
+            qemu_iovec_destroy(&slice);
+        }
+    }
+
+    g_free(copy);
+    g_free(ref);
+    iov_free(iov, niov);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -413,5 +486,7 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/qiov/inline", test_qiov_inline);
+    g_test_add_func("/basic/qiov/slice", test_qiov_slice);
     return g_test_run();
 }
@@ -0,0 +1,168 @@
+/*
+ * ivshmem ring helper tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "../contrib/ivshmem-server/ivshmem-ring.h"
+
+#define NSLOTS      8
+#define SLOT_SIZE   64
+#define NR_MESSAGES 100000
+
+static void *ring_mem(void)
+{
+    size_t size = ivshmem_ring_size(NSLOTS, SLOT_SIZE);
+
+    return memset(qemu_memalign(64, size), 0, size);
+}
+
+static void test_format(void)
+{
+    size_t size = ivshmem_ring_size(NSLOTS, SLOT_SIZE);
+    void *mem = ring_mem();
+    IvshmemRing prod, cons;
+
+    g_assert_cmpint(ivshmem_ring_attach(&cons, mem, size), ==, -EINVAL);
+    g_assert_cmpint(ivshmem_ring_format(&prod, mem, size, 6, SLOT_SIZE),
+                    ==, -EINVAL);
+    g_assert_cmpint(ivshmem_ring_format(&prod, mem, size, NSLOTS, 8),
+                    ==, -EINVAL);
+    g_assert_cmpint(ivshmem_ring_format(&prod, mem, size - 1, NSLOTS,
+                                        SLOT_SIZE), ==, -EINVAL);
+    g_assert_cmpint(ivshmem_ring_format(&prod, mem, size, NSLOTS, SLOT_SIZE),
+                    ==, 0);
+    g_assert_cmpint(ivshmem_ring_max_len(&prod), ==,
+                    SLOT_SIZE - sizeof(IvshmemRingSlot));
+
+    g_assert_cmpint(ivshmem_ring_attach(&cons, mem, size - 1), ==, -EINVAL);
+    g_assert_cmpint(ivshmem_ring_attach(&cons, mem, size), ==, 0);
+    g_assert_cmpint(cons.nslots, ==, NSLOTS);
+    g_assert_cmpint(cons.slot_size, ==, SLOT_SIZE);
+    qemu_vfree(mem);
+}
+
+static void test_batch(void)
+{
+    size_t size = ivshmem_ring_size(NSLOTS, SLOT_SIZE);
+    void *mem = ring_mem();
+    IvshmemRing prod, cons;
+    const uint32_t *msg;
+    uint32_t *buf, len;
+    uint32_t i;
+
+    ivshmem_ring_format(&prod, mem, size, NSLOTS, SLOT_SIZE);
+    ivshmem_ring_attach(&cons, mem, size);
+
+    /* The consumer goes to sleep on an empty ring */
+    g_assert(!ivshmem_ring_peek(&cons, &len));
+    g_assert(ivshmem_ring_wait_produced(&cons));
+
+    for (i = 0; i < NSLOTS; i++) {
+        buf = ivshmem_ring_reserve(&prod);
+        g_assert(buf);
+        *buf = i;
+        ivshmem_ring_commit(&prod, sizeof(*buf));
+    }
+    g_assert(!ivshmem_ring_reserve(&prod));
+
+    /* Committed messages are invisible until the flush */
+    g_assert(!ivshmem_ring_peek(&cons, &len));
+
+    /* A whole batch needs a single notification */
+    g_assert(ivshmem_ring_flush_produced(&prod));
+    g_assert(!ivshmem_ring_flush_produced(&prod));
+
+    g_assert(ivshmem_ring_wait_consumed(&prod));
+    for (i = 0; i < NSLOTS; i++) {
+        msg = ivshmem_ring_peek(&cons, &len);
+        g_assert(msg);
+        g_assert_cmpint(len, ==, sizeof(*msg));
+        g_assert_cmpint(*msg, ==, i);
+        ivshmem_ring_consume(&cons);
+    }
+    g_assert(!ivshmem_ring_peek(&cons, &len));
+
+    /* Slots are not reused before the consumer hands them back */
+    g_assert(!ivshmem_ring_reserve(&prod));
+    g_assert(ivshmem_ring_flush_consumed(&cons));
+    g_assert(!ivshmem_ring_flush_consumed(&cons));
+    g_assert(ivshmem_ring_reserve(&prod));
+
+    /* Nobody waits, nobody is notified */
+    ivshmem_ring_commit(&prod, 0);
+    g_assert(!ivshmem_ring_flush_produced(&prod));
+    g_assert(!ivshmem_ring_wait_produced(&cons));
+    qemu_vfree(mem);
+}
+
+static void *producer_thread(void *opaque)
+{
+    IvshmemRing *prod = opaque;
+    uint32_t i = 0;
+
+    while (i < NR_MESSAGES) {
+        uint32_t *buf = ivshmem_ring_reserve(prod);
+
+        if (!buf) {
+            ivshmem_ring_flush_produced(prod);
+            g_thread_yield();
+            continue;
+        }
+        *buf = i++;
+        ivshmem_ring_commit(prod, sizeof(*buf));
+        if (!(i & 3)) {
+            ivshmem_ring_flush_produced(prod);
+        }
+    }
+    ivshmem_ring_flush_produced(prod);
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    size_t size = ivshmem_ring_size(NSLOTS, SLOT_SIZE);
+    void *mem = ring_mem();
+    IvshmemRing prod, cons;
+    QemuThread thread;
+    uint32_t i = 0;
+
+    ivshmem_ring_format(&prod, mem, size, NSLOTS, SLOT_SIZE);
+    ivshmem_ring_attach(&cons, mem, size);
+    qemu_thread_create(&thread, "producer", producer_thread, &prod,
+                       QEMU_THREAD_JOINABLE);
+
+    while (i < NR_MESSAGES) {
+        const uint32_t *msg;
+        uint32_t len;
+
+        msg = ivshmem_ring_peek(&cons, &len);
+        if (!msg) {
+            ivshmem_ring_flush_consumed(&cons);
+            g_thread_yield();
+            continue;
+        }
+        g_assert_cmpint(len, ==, sizeof(*msg));
+        g_assert_cmpint(*msg, ==, i);
+        ivshmem_ring_consume(&cons);
+        i++;
+    }
+    ivshmem_ring_flush_consumed(&cons);
+
+    qemu_thread_join(&thread);
+    qemu_vfree(mem);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/ivshmem-ring/format", test_format);
+    g_test_add_func("/ivshmem-ring/batch", test_batch);
+    g_test_add_func("/ivshmem-ring/threads", test_threads);
+    return g_test_run();
+}
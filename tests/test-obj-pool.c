@@ -0,0 +1,102 @@
+/*
+ * Object pool unit tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/obj-pool.h"
+
+#define BATCH 4
+
+/* Objects are recycled once the shared release list has filled up */
+static void test_reuse(void)
+{
+    static ObjPool pool = OBJ_POOL_INITIALIZER(64, BATCH);
+    void *objs[BATCH * 3];
+    void *obj;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(objs); i++) {
+        objs[i] = obj_pool_alloc(&pool, 64);
+        memset(objs[i], i, 64);
+    }
+    for (i = 0; i < ARRAY_SIZE(objs); i++) {
+        obj_pool_free(objs[i]);
+    }
+
+    /* The last frees went to the thread-local cache, LIFO */
+    obj = obj_pool_alloc(&pool, 32);
+    g_assert(obj == objs[ARRAY_SIZE(objs) - 1]);
+    obj_pool_free(obj);
+    obj_pool_free(NULL);
+}
+
+/* Objects larger than the pool size are not recycled */
+static void test_large(void)
+{
+    static ObjPool pool = OBJ_POOL_INITIALIZER(16, BATCH);
+    void *objs[BATCH * 3];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(objs); i++) {
+        objs[i] = obj_pool_alloc(&pool, 4096);
+        memset(objs[i], i, 4096);
+    }
+    for (i = 0; i < ARRAY_SIZE(objs); i++) {
+        obj_pool_free(objs[i]);
+    }
+    g_assert_cmpint(pool.release_size, ==, 0);
+}
+
+static ObjPool thread_pool = OBJ_POOL_INITIALIZER(64, BATCH);
+static void *thread_objs[BATCH * 2];
+
+static void *free_thread(void *opaque)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(thread_objs); i++) {
+        obj_pool_free(thread_objs[i]);
+    }
+    return NULL;
+}
+
+/* Objects freed by another thread come back to the allocating thread */
+static void test_cross_thread(void)
+{
+    QemuThread thread;
+    void *obj;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(thread_objs); i++) {
+        thread_objs[i] = obj_pool_alloc(&thread_pool, 64);
+    }
+    qemu_thread_create(&thread, "free", free_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+    g_assert_cmpint(thread_pool.release_size, ==, ARRAY_SIZE(thread_objs));
+
+    obj = obj_pool_alloc(&thread_pool, 64);
+    for (j = 0; j < ARRAY_SIZE(thread_objs); j++) {
+        if (obj == thread_objs[j]) {
+            break;
+        }
+    }
+    g_assert(j < ARRAY_SIZE(thread_objs));
+    g_assert_cmpint(thread_pool.release_size, ==, 0);
+    obj_pool_free(obj);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/obj-pool/reuse", test_reuse);
+    g_test_add_func("/obj-pool/large", test_large);
+    g_test_add_func("/obj-pool/cross-thread", test_cross_thread);
+    return g_test_run();
+}
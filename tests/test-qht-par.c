@@ -8,13 +8,14 @@
 
 #define TEST_QHT_STRING "tests/qht-bench 1>/dev/null 2>&1 -R -S0.1 -D10000 -N1 "
 
-static void test_qht(int n_threads, int update_rate, int duration)
+static void test_qht(int n_threads, int update_rate, int duration,
+                     const char *extra)
 {
     char *str;
     int rc;
 
-    str = g_strdup_printf(TEST_QHT_STRING "-n %d -u %d -d %d",
-                          n_threads, update_rate, duration);
+    str = g_strdup_printf(TEST_QHT_STRING "-n %d -u %d -d %d %s",
+                          n_threads, update_rate, duration, extra);
     rc = system(str);
     g_free(str);
     g_assert_cmpint(rc, ==, 0);
@@ -22,22 +23,28 @@ static void test_qht(int n_threads, int update_rate, int duration)
 
 static void test_2th0u1s(void)
 {
-    test_qht(2, 0, 1);
+    test_qht(2, 0, 1, "");
 }
 
 static void test_2th20u1s(void)
 {
-    test_qht(2, 20, 1);
+    test_qht(2, 20, 1, "");
 }
 
 static void test_2th0u5s(void)
 {
-    test_qht(2, 0, 5);
+    test_qht(2, 0, 5, "");
 }
 
 static void test_2th20u5s(void)
 {
-    test_qht(2, 20, 5);
+    test_qht(2, 20, 5, "");
+}
+
+/* start small so that auto-resize keeps moving buckets under the writers */
+static void test_2th50u90w1s(void)
+{
+    test_qht(2, 50, 1, "-s 16 -w 90");
 }
 
 int main(int argc, char *argv[])
@@ -47,6 +54,8 @@ int main(int argc, char *argv[])
     if (g_test_quick()) {
         g_test_add_func("/qht/parallel/2threads-0%updates-1s", test_2th0u1s);
         g_test_add_func("/qht/parallel/2threads-20%updates-1s", test_2th20u1s);
+        g_test_add_func("/qht/parallel/2threads-50%updates-90%inserts-1s",
+                        test_2th50u90w1s);
     } else {
         g_test_add_func("/qht/parallel/2threads-0%updates-5s", test_2th0u5s);
         g_test_add_func("/qht/parallel/2threads-20%updates-5s", test_2th20u5s);
@@ -0,0 +1,101 @@
+/*
+ * Shared image read cache unit tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/iov.h"
+#include "block/shared-cache.h"
+
+#define CACHE_SIZE (4 * SHARED_CACHE_CHUNK_SIZE)
+
+static char image_path[] = "/tmp/qtest-shared-cache.XXXXXX";
+static int image_fd;
+
+static bool lookup(SharedCache *c, uint64_t offset, void *buf, size_t bytes)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return shared_cache_lookup(c, offset, &qiov, 0, bytes);
+}
+
+/* Two users of the same image see each other's insertions */
+static void test_shared(void)
+{
+    SharedCache *a, *b;
+    uint8_t *chunk = g_malloc(SHARED_CACHE_CHUNK_SIZE);
+    uint8_t buf[512];
+
+    a = shared_cache_open(image_fd, CACHE_SIZE, &error_abort);
+    b = shared_cache_open(image_fd, CACHE_SIZE, &error_abort);
+
+    g_assert(!lookup(b, SHARED_CACHE_CHUNK_SIZE, buf, sizeof(buf)));
+    memset(chunk, 0xa5, SHARED_CACHE_CHUNK_SIZE);
+    chunk[1024] = 0x5a;
+    shared_cache_insert(a, SHARED_CACHE_CHUNK_SIZE, chunk);
+
+    g_assert(lookup(b, SHARED_CACHE_CHUNK_SIZE + 1024, buf, sizeof(buf)));
+    g_assert_cmpint(buf[0], ==, 0x5a);
+    g_assert_cmpint(buf[1], ==, 0xa5);
+
+    /* Same slot, different chunk */
+    g_assert(!lookup(b, 5 * SHARED_CACHE_CHUNK_SIZE, buf, sizeof(buf)));
+
+    shared_cache_close(a);
+    shared_cache_close(b);
+    g_free(chunk);
+}
+
+/* A modified image does not reuse the old contents */
+static void test_stale(void)
+{
+    SharedCache *c;
+    uint8_t *chunk = g_malloc0(SHARED_CACHE_CHUNK_SIZE);
+    uint8_t buf[512];
+
+    c = shared_cache_open(image_fd, CACHE_SIZE, &error_abort);
+    shared_cache_insert(c, 0, chunk);
+    g_assert(lookup(c, 0, buf, sizeof(buf)));
+    shared_cache_close(c);
+
+    g_assert_cmpint(ftruncate(image_fd, 2 * SHARED_CACHE_CHUNK_SIZE), ==, 0);
+    c = shared_cache_open(image_fd, CACHE_SIZE, &error_abort);
+    g_assert(!lookup(c, 0, buf, sizeof(buf)));
+    shared_cache_close(c);
+    g_free(chunk);
+}
+
+int main(int argc, char **argv)
+{
+    struct stat st;
+    char *segment;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    image_fd = mkstemp(image_path);
+    g_assert(image_fd >= 0);
+    g_assert_cmpint(ftruncate(image_fd, SHARED_CACHE_CHUNK_SIZE), ==, 0);
+
+    g_test_add_func("/shared-cache/shared", test_shared);
+    g_test_add_func("/shared-cache/stale", test_stale);
+    ret = g_test_run();
+
+    /* Remove the segment, too */
+    g_assert(fstat(image_fd, &st) == 0);
+    segment = g_strdup_printf("qemu-shared-cache-%" PRIx64 "-%" PRIx64,
+                              (uint64_t)st.st_dev, (uint64_t)st.st_ino);
+    unlink(g_build_filename("/dev/shm", segment, NULL));
+    unlink(g_build_filename(g_get_tmp_dir(), segment, NULL));
+    g_free(segment);
+
+    close(image_fd);
+    unlink(image_path);
+    return ret;
+}
@@ -0,0 +1,213 @@
+/*
+ * Statistics registry tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/stats.h"
+
+static const uint64_t latency_boundaries[] = { 10, 100 };
+static const uint64_t latency_bins[] = { 5, 3, 1 };
+
+static void disk_stats(StatsCollector *c, void *opaque)
+{
+    static const char *const disks[] = { "disk0", "disk1" };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(disks); i++) {
+        if (!stats_begin_instance(c, disks[i])) {
+            continue;
+        }
+        stats_add_counter(c, "read-ops", 100 + i);
+        stats_add_counter(c, "write-ops", 200 + i);
+        stats_add_gauge(c, "queue-depth", -i);
+        stats_add_histogram(c, "read-latency", 3, latency_boundaries,
+                            latency_bins);
+    }
+}
+
+static void vcpu_stats(StatsCollector *c, void *opaque)
+{
+    int *calls = opaque;
+
+    (*calls)++;
+    /* Statistics added before stats_begin_instance() are dropped */
+    stats_add_counter(c, "ignored", 1);
+    stats_begin_instance(c, "cpu0");
+    stats_add_counter(c, "exits", 42);
+}
+
+static int vcpu_calls;
+
+static strList *str_list(const char *first, ...)
+{
+    strList *head = NULL, **tail = &head;
+    const char *s;
+    va_list ap;
+
+    va_start(ap, first);
+    for (s = first; s; s = va_arg(ap, const char *)) {
+        strList *elem = g_new0(strList, 1);
+
+        elem->value = g_strdup(s);
+        *tail = elem;
+        tail = &elem->next;
+    }
+    va_end(ap);
+    return head;
+}
+
+static int count_stats(StatsResult *r)
+{
+    StatList *l;
+    int n = 0;
+
+    for (l = r->stats; l; l = l->next) {
+        n++;
+    }
+    return n;
+}
+
+static void test_all(void)
+{
+    StatsResultList *res = stats_query(NULL, NULL, NULL);
+    StatsResultList *l = res;
+    Stat *stat;
+
+    g_assert(l);
+    g_assert_cmpstr(l->value->provider, ==, "disk");
+    g_assert_cmpstr(l->value->instance, ==, "disk0");
+    g_assert_cmpint(count_stats(l->value), ==, 4);
+
+    stat = l->value->stats->value;
+    g_assert_cmpstr(stat->name, ==, "read-ops");
+    g_assert_cmpint(stat->type, ==, STAT_TYPE_COUNTER);
+    g_assert_cmpint(stat->u.counter.value, ==, 100);
+
+    l = l->next;
+    g_assert(l);
+    g_assert_cmpstr(l->value->instance, ==, "disk1");
+    stat = l->value->stats->next->next->value;
+    g_assert_cmpstr(stat->name, ==, "queue-depth");
+    g_assert_cmpint(stat->type, ==, STAT_TYPE_GAUGE);
+    g_assert_cmpint(stat->u.gauge.value, ==, -1);
+
+    l = l->next;
+    g_assert(l);
+    g_assert_cmpstr(l->value->provider, ==, "vcpu");
+    g_assert_cmpstr(l->value->instance, ==, "cpu0");
+    g_assert_cmpint(count_stats(l->value), ==, 1);
+    g_assert_cmpstr(l->value->stats->value->name, ==, "exits");
+    g_assert(!l->next);
+
+    qapi_free_StatsResultList(res);
+}
+
+static void test_histogram(void)
+{
+    strList *names = str_list("read-latency", NULL);
+    StatsResultList *res = stats_query(NULL, NULL, names);
+    StatHistogram *h;
+    uint64List *il;
+    int i;
+
+    g_assert(res);
+    g_assert_cmpint(count_stats(res->value), ==, 1);
+    g_assert_cmpint(res->value->stats->value->type, ==, STAT_TYPE_HISTOGRAM);
+    h = &res->value->stats->value->u.histogram;
+
+    for (i = 0, il = h->boundaries; il; i++, il = il->next) {
+        g_assert_cmpint(il->value, ==, latency_boundaries[i]);
+    }
+    g_assert_cmpint(i, ==, ARRAY_SIZE(latency_boundaries));
+    for (i = 0, il = h->bins; il; i++, il = il->next) {
+        g_assert_cmpint(il->value, ==, latency_bins[i]);
+    }
+    g_assert_cmpint(i, ==, ARRAY_SIZE(latency_bins));
+
+    /* disk1, the vcpu has no such statistic */
+    g_assert(res->next);
+    g_assert(!res->next->next);
+
+    qapi_free_StatsResultList(res);
+    qapi_free_strList(names);
+}
+
+static void test_filter_provider(void)
+{
+    strList *providers = str_list("vc*", NULL);
+    StatsResultList *res;
+    int calls = vcpu_calls;
+
+    res = stats_query(providers, NULL, NULL);
+    g_assert(res);
+    g_assert_cmpstr(res->value->provider, ==, "vcpu");
+    g_assert(!res->next);
+    g_assert_cmpint(vcpu_calls, ==, calls + 1);
+    qapi_free_StatsResultList(res);
+    qapi_free_strList(providers);
+
+    /* Filtered out providers are not called at all */
+    providers = str_list("disk", NULL);
+    res = stats_query(providers, NULL, NULL);
+    g_assert_cmpint(vcpu_calls, ==, calls + 1);
+    g_assert(res && res->next && !res->next->next);
+    qapi_free_StatsResultList(res);
+    qapi_free_strList(providers);
+}
+
+static void test_filter_instance(void)
+{
+    strList *instances = str_list("disk1", "cpu?", NULL);
+    StatsResultList *res = stats_query(NULL, instances, NULL);
+
+    g_assert(res);
+    g_assert_cmpstr(res->value->instance, ==, "disk1");
+    g_assert(res->next);
+    g_assert_cmpstr(res->next->value->instance, ==, "cpu0");
+    g_assert(!res->next->next);
+    qapi_free_StatsResultList(res);
+    qapi_free_strList(instances);
+}
+
+static void test_filter_names(void)
+{
+    strList *names = str_list("*-ops", NULL);
+    StatsResultList *res = stats_query(NULL, NULL, names);
+    StatsResultList *l;
+
+    /* The vcpu instance has no matching statistic and is left out */
+    for (l = res; l; l = l->next) {
+        g_assert_cmpstr(l->value->provider, ==, "disk");
+        g_assert_cmpint(count_stats(l->value), ==, 2);
+        g_assert_cmpstr(l->value->stats->value->name, ==, "read-ops");
+        g_assert_cmpstr(l->value->stats->next->value->name, ==, "write-ops");
+    }
+    g_assert(res && res->next && !res->next->next);
+    qapi_free_StatsResultList(res);
+    qapi_free_strList(names);
+
+    names = str_list("nothing", NULL);
+    res = stats_query(NULL, NULL, names);
+    g_assert(!res);
+    qapi_free_strList(names);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    stats_register_provider("disk", disk_stats, NULL);
+    stats_register_provider("vcpu", vcpu_stats, &vcpu_calls);
+
+    g_test_add_func("/stats/all", test_all);
+    g_test_add_func("/stats/histogram", test_histogram);
+    g_test_add_func("/stats/filter/provider", test_filter_provider);
+    g_test_add_func("/stats/filter/instance", test_filter_instance);
+    g_test_add_func("/stats/filter/names", test_filter_names);
+    return g_test_run();
+}
@@ -6,6 +6,7 @@
 #include "qapi/error.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
+#include "qapi-types.h"
 
 static AioContext *ctx;
 static ThreadPool *pool;
@@ -134,6 +135,52 @@ static void test_submit_many(void)
     }
 }
 
+static void test_params(void)
+{
+    WorkerTestData data[10];
+    ThreadPoolInfo *info;
+    Error *err = NULL;
+    uint64_t completed;
+    int i;
+
+    info = thread_pool_get_info(pool);
+    completed = info->completed;
+    qapi_free_ThreadPoolInfo(info);
+
+    aio_context_set_thread_pool_params(ctx, 2, 2, -1, &error_abort);
+    info = thread_pool_get_info(pool);
+    g_assert_cmpint(info->min_threads, ==, 2);
+    g_assert_cmpint(info->max_threads, ==, 2);
+    g_assert_cmpint(info->threads, >=, 2);
+    qapi_free_ThreadPoolInfo(info);
+
+    for (i = 0; i < 10; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, worker_cb, &data[i], done_cb, &data[i]);
+    }
+
+    active = 10;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+
+    info = thread_pool_get_info(pool);
+    g_assert_cmpint(info->completed, ==, completed + 10);
+    g_assert_cmpint(info->queued, ==, 0);
+    g_assert_cmpint(info->max_queued, >=, 1);
+    g_assert_cmpint(info->latency_max_ns, <=, info->latency_total_ns);
+    qapi_free_ThreadPoolInfo(info);
+
+    /* min must not exceed max */
+    aio_context_set_thread_pool_params(ctx, 4, 2, -1, &err);
+    g_assert(err != NULL);
+    error_free(err);
+
+    aio_context_set_thread_pool_params(ctx, 0, THREAD_POOL_MAX_THREADS_DEFAULT,
+                                       -1, &error_abort);
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -240,6 +287,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/params", test_params);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
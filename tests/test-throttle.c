@@ -587,6 +587,33 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_unaccounting(void)
+{
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 150;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 150;
+
+    throttle_init(&ts);
+    throttle_timers_init(&tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_config(&ts, &tt, &cfg);
+
+    /* give back two of three writes */
+    throttle_account(&ts, true, 512);
+    throttle_account(&ts, true, 512);
+    throttle_account(&ts, true, 512);
+    throttle_unaccount(&ts, true, 2 * 512, 2);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 512));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 1));
+
+    /* the buckets never go below zero, e.g. if they leaked meanwhile */
+    throttle_unaccount(&ts, true, 2 * 512, 2);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 0));
+
+    throttle_timers_destroy(&tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -672,6 +699,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/unaccounting",       test_unaccounting);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
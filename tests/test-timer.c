@@ -0,0 +1,87 @@
+/*
+ * QEMU timer list tests
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "sysemu/cpus.h"
+
+static int notified;
+
+static void notify_cb(void *opaque)
+{
+    notified++;
+}
+
+static void timer_cb(void *opaque)
+{
+}
+
+static void test_rearm(void)
+{
+    QEMUTimerList *tl = timerlist_new(QEMU_CLOCK_REALTIME, notify_cb, NULL);
+    QEMUTimer a, b;
+
+    timer_init_tl(&a, tl, SCALE_NS, timer_cb, NULL);
+    timer_init_tl(&b, tl, SCALE_NS, timer_cb, NULL);
+    notified = 0;
+
+    timer_mod_ns(&a, 1000);
+    g_assert_cmpint(notified, ==, 1);
+
+    /* The waiter wakes up at the old deadline anyway */
+    timer_mod_ns(&a, 2000);
+    g_assert_cmpint(notified, ==, 1);
+
+    timer_mod_ns(&a, 500);
+    g_assert_cmpint(notified, ==, 2);
+
+    /* Only changes to the first deadline matter */
+    timer_mod_ns(&b, 3000);
+    g_assert_cmpint(notified, ==, 2);
+    timer_mod_ns(&b, 100);
+    g_assert_cmpint(notified, ==, 3);
+    timer_mod_ns(&b, 800);
+    g_assert_cmpint(notified, ==, 3);
+    g_assert_cmpint(timer_expire_time_ns(&b), ==, 800);
+
+    timer_del(&a);
+    timer_del(&b);
+    timerlist_free(tl);
+}
+
+static void test_rearm_icount(void)
+{
+    QEMUTimerList *tl = timerlist_new(QEMU_CLOCK_VIRTUAL, notify_cb, NULL);
+    QEMUTimer a;
+
+    use_icount = 1;
+    timer_init_tl(&a, tl, SCALE_NS, timer_cb, NULL);
+    notified = 0;
+
+    /* The icount warp is recomputed even when the deadline moves later */
+    timer_mod_ns(&a, 1000);
+    g_assert_cmpint(notified, ==, 1);
+    timer_mod_ns(&a, 2000);
+    g_assert_cmpint(notified, ==, 2);
+    timer_mod_ns(&a, 500);
+    g_assert_cmpint(notified, ==, 3);
+
+    timer_del(&a);
+    timerlist_free(tl);
+    use_icount = 0;
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timer/rearm", test_rearm);
+    g_test_add_func("/timer/rearm-icount", test_rearm_icount);
+    return g_test_run();
+}
@@ -174,6 +174,67 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_CASES 64
+
+/* Every encoder implementation must produce the same bytes as the C one */
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE * ACCEL_CASES);
+    uint8_t *new = g_malloc(PAGE_SIZE * ACCEL_CASES);
+    uint8_t *ref = g_malloc(PAGE_SIZE * ACCEL_CASES);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_CASES];
+    bool first = true;
+    int i, j, len;
+
+    for (i = 0; i < ACCEL_CASES; i++) {
+        uint8_t *o = old + i * PAGE_SIZE;
+        uint8_t *n = new + i * PAGE_SIZE;
+        int changes = g_test_rand_int_range(0, PAGE_SIZE / 8);
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = g_test_rand_int();
+        }
+        memcpy(n, o, PAGE_SIZE);
+        for (j = 0; j < changes; j++) {
+            int pos = g_test_rand_int_range(0, PAGE_SIZE);
+            int run = g_test_rand_int_range(1, 64);
+
+            while (run-- && pos < PAGE_SIZE) {
+                n[pos++] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+
+    do {
+        for (i = 0; i < ACCEL_CASES; i++) {
+            /* odd cases use a short destination to exercise overflow */
+            int dlen = (i & 1) ? PAGE_SIZE / 16 : PAGE_SIZE;
+
+            len = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                       new + i * PAGE_SIZE, PAGE_SIZE,
+                                       out, dlen);
+            if (first) {
+                ref_len[i] = len;
+                if (len > 0) {
+                    memcpy(ref + i * PAGE_SIZE, out, len);
+                }
+            } else {
+                g_assert_cmpint(len, ==, ref_len[i]);
+                if (len > 0) {
+                    g_assert(memcmp(ref + i * PAGE_SIZE, out, len) == 0);
+                }
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(out);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +247,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -22,6 +22,9 @@
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qapi-types.h"
 
 static void do_spawn_thread(ThreadPool *pool);
 
@@ -46,6 +49,9 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* Submission time, for the latency statistics */
+    int64_t submit_ns;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
@@ -59,14 +65,21 @@ struct ThreadPool {
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    uint64_t completed;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int queued;
+    int max_queued;
+    int min_threads;
+    int max_threads;
+    char *affinity;      /* CPU list for new workers, or NULL */
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
@@ -80,25 +93,40 @@ static void *worker_thread(void *opaque)
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
+    if (pool->affinity) {
+        QemuThread self;
+
+        qemu_thread_get_self(&self);
+        qemu_thread_set_affinity(&self, pool->affinity);
+    }
     do_spawn_thread(pool);
 
     while (!pool->stopping) {
         ThreadPoolElement *req;
         int ret;
 
+        /* thread_pool_update_params may have lowered max_threads */
+        if (pool->cur_threads > pool->max_threads) {
+            break;
+        }
+
+        /* Idle workers exit after 10 seconds, down to min_threads */
         do {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+        } while (ret == -1 && !pool->stopping &&
+                 (!QTAILQ_EMPTY(&pool->request_list) ||
+                  pool->cur_threads <= pool->min_threads));
         if (ret == -1 || pool->stopping) {
             break;
         }
 
         req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        pool->queued--;
         req->state = THREAD_ACTIVE;
         qemu_mutex_unlock(&pool->lock);
 
@@ -160,6 +188,15 @@ static void spawn_thread(ThreadPool *pool)
     }
 }
 
+static void thread_pool_account(ThreadPool *pool, ThreadPoolElement *elem)
+{
+    uint64_t latency = get_clock() - elem->submit_ns;
+
+    pool->completed++;
+    pool->latency_total_ns += latency;
+    pool->latency_max_ns = MAX(pool->latency_max_ns, latency);
+}
+
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -174,6 +211,7 @@ restart:
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
+        thread_pool_account(pool, elem);
 
         if (elem->common.cb) {
             /* Read state before ret.  */
@@ -209,6 +247,7 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        pool->queued--;
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
@@ -242,6 +281,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
@@ -252,6 +292,8 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         spawn_thread(pool);
     }
     QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    pool->queued++;
+    pool->max_queued = MAX(pool->max_queued, pool->queued);
     qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
@@ -297,11 +339,83 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
     QTAILQ_INIT(&pool->request_list);
+
+    thread_pool_update_params(pool, ctx);
+}
+
+/* Returns the CPU list of host NUMA node @node, e.g. "0-7,16-23" */
+static char *thread_pool_node_cpus(int node)
+{
+    char *path, *contents = NULL;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_strstrip(contents);
+        if (!*contents) {
+            g_free(contents);
+            contents = NULL;
+        }
+    }
+    g_free(path);
+    return contents;
+}
+
+bool thread_pool_node_valid(int node, Error **errp)
+{
+    char *cpus = thread_pool_node_cpus(node);
+
+    if (!cpus) {
+        error_setg(errp, "Host NUMA node %d not found or has no CPUs", node);
+        return false;
+    }
+    g_free(cpus);
+    return true;
+}
+
+void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
+{
+    qemu_mutex_lock(&pool->lock);
+
+    pool->min_threads = ctx->thread_pool_min;
+    pool->max_threads = ctx->thread_pool_max;
+
+    /* Workers that are already running keep their affinity */
+    g_free(pool->affinity);
+    pool->affinity = NULL;
+    if (ctx->thread_pool_node >= 0) {
+        pool->affinity = thread_pool_node_cpus(ctx->thread_pool_node);
+    }
+
+    /* New workers are created from the AioContext by new_thread_bh */
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+
+    qemu_mutex_unlock(&pool->lock);
+}
+
+ThreadPoolInfo *thread_pool_get_info(ThreadPool *pool)
+{
+    ThreadPoolInfo *info = g_new0(ThreadPoolInfo, 1);
+
+    qemu_mutex_lock(&pool->lock);
+    info->min_threads = pool->min_threads;
+    info->max_threads = pool->max_threads;
+    info->threads = pool->cur_threads;
+    info->idle_threads = pool->idle_threads;
+    info->queued = pool->queued;
+    info->max_queued = pool->max_queued;
+    qemu_mutex_unlock(&pool->lock);
+
+    /* Updated by the AioContext without the lock; good enough for stats */
+    info->completed = pool->completed;
+    info->latency_total_ns = pool->latency_total_ns;
+    info->latency_max_ns = pool->latency_max_ns;
+    return info;
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -339,5 +453,6 @@ void thread_pool_free(ThreadPool *pool)
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
+    g_free(pool->affinity);
     g_free(pool);
 }
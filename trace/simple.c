@@ -12,6 +12,7 @@
 #ifndef _WIN32
 #include <pthread.h>
 #endif
+#include "qemu/atomic.h"
 #include "qemu/timer.h"
 #include "trace.h"
 #include "trace/control.h"
@@ -29,12 +30,11 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Every thread that traces gets its own ring buffer, so that recording an
+ * event takes neither locks nor atomic read-modify-write operations.  Records
+ * are written out by a dedicated thread, which wakes up periodically or when
+ * a buffer is filling up, and merges the buffers in timestamp order.
  */
 static CompatGMutex trace_lock;
 static CompatGCond trace_available_cond;
@@ -42,16 +42,44 @@ static CompatGCond trace_empty_cond;
 
 static bool trace_available;
 static bool trace_writeout_enabled;
+static bool trace_kicked;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_FLUSH_INTERVAL_MS = 100,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+/*
+ * Per-thread trace buffer.  @head is only written by the owning thread and
+ * @tail only by the writeout thread; both run freely and are reduced modulo
+ * TRACE_BUF_LEN when accessing @data.  Buffers are never freed: when a thread
+ * exits, its buffer is handed to the next new thread, together with the
+ * records that have not been written out yet.  On Windows there is no
+ * notification of thread exit, and buffers are not reused.
+ */
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    bool in_use;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int dropped;
+
+    /* Only used by the writeout thread */
+    unsigned int limit;
+    uint64_t total_dropped;
+
+    uint8_t data[TRACE_BUF_LEN];
+} TraceBuffer;
+
+static TraceBuffer *trace_buffers;
+static __thread TraceBuffer *trace_thread_buffer;
+#ifndef _WIN32
+static pthread_key_t trace_buffer_key;
+#endif
+
+/* Events dropped because no buffer could be allocated */
+static unsigned int dropped_events;
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -72,53 +100,26 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
-
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void read_from_buffer(TraceBuffer *b, unsigned int idx,
+                             void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    size_t n;
+
+    idx %= TRACE_BUF_LEN;
+    n = MIN(size, TRACE_BUF_LEN - idx);
+    memcpy(dataptr, b->data + idx, n);
+    memcpy((uint8_t *)dataptr + n, b->data, size - n);
 }
-/**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
- */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
-{
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
-    }
+static unsigned int write_to_buffer(TraceBuffer *b, unsigned int idx,
+                                    const void *dataptr, size_t size)
+{
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t n = MIN(size, TRACE_BUF_LEN - off);
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    memcpy(b->data + off, dataptr, n);
+    memcpy(b->data, (const uint8_t *)dataptr + n, size - n);
+    return idx + size; /* most callers wants to know where to write next */
 }
 
 /**
@@ -141,134 +142,212 @@ static void flush_trace_file(bool wait)
 
 static void wait_for_trace_records_available(void)
 {
+    gint64 deadline = g_get_monotonic_time() + TRACE_FLUSH_INTERVAL_MS * 1000;
+
     g_mutex_lock(&trace_lock);
     while (!(trace_available && trace_writeout_enabled)) {
         g_cond_signal(&trace_empty_cond);
-        g_cond_wait(&trace_available_cond, &trace_lock);
+        if (!trace_writeout_enabled) {
+            g_cond_wait(&trace_available_cond, &trace_lock);
+        } else if (!g_cond_wait_until(&trace_available_cond, &trace_lock,
+                                      deadline) &&
+                   trace_writeout_enabled) {
+            break; /* periodic flush */
+        }
     }
     trace_available = false;
     g_mutex_unlock(&trace_lock);
+
+    atomic_set(&trace_kicked, false);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+/* Returns the number of items written like fwrite(); errors are ignored */
+static size_t write_dropped_record(unsigned int count)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
-    size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
+    dropped.rec.pid = trace_pid;
+    dropped.rec.arguments[0] = count;
+    return fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+}
+
+static size_t write_record(TraceBuffer *b, unsigned int idx, uint32_t len)
+{
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t n = MIN(len, TRACE_BUF_LEN - off);
+    size_t ret;
+
+    ret = fwrite(b->data + off, n, 1, trace_fp);
+    if (ret == 1 && n < len) {
+        ret = fwrite(b->data, len - n, 1, trace_fp);
+    }
+    return ret;
+}
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+/*
+ * Write out the records that are in the buffers now, oldest first.  Records
+ * that come in meanwhile are left for the next round, so that a busy thread
+ * cannot keep the writeout thread here forever.
+ */
+static void writeout_buffers(void)
+{
+    TraceBuffer *b, *next;
+    TraceRecord record;
+    uint64_t next_ts = 0;
+    uint32_t next_len = 0;
+    unsigned int dropped;
+
+    dropped = atomic_xchg(&dropped_events, 0);
+    if (dropped) {
+        write_dropped_record(dropped);
+    }
+
+    for (b = atomic_rcu_read(&trace_buffers); b; b = b->next) {
+        b->limit = atomic_read(&b->head);
+        dropped = atomic_xchg(&b->dropped, 0);
+        if (dropped) {
+            b->total_dropped += dropped;
+            write_dropped_record(dropped);
         }
+    }
+    smp_rmb(); /* read memory barrier before accessing records */
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+    for (;;) {
+        next = NULL;
+        for (b = atomic_rcu_read(&trace_buffers); b; b = b->next) {
+            if (b->tail == b->limit) {
+                continue;
+            }
+            read_from_buffer(b, b->tail, &record, sizeof(record));
+            if (!next || record.timestamp_ns < next_ts) {
+                next = b;
+                next_ts = record.timestamp_ns;
+                next_len = record.length;
+            }
+        }
+        if (!next) {
+            break;
         }
 
+        write_record(next, next->tail, next_len);
+        smp_mb(); /* done with the record before its space is reused */
+        atomic_set(&next->tail, next->tail + next_len);
+    }
+}
+
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+        writeout_buffers();
         fflush(trace_fp);
     }
     return NULL;
 }
 
+#ifndef _WIN32
+static void put_trace_buffer(void *opaque)
+{
+    TraceBuffer *b = opaque;
+
+    /* The thread may still trace from other destructors */
+    trace_thread_buffer = NULL;
+    atomic_mb_set(&b->in_use, false);
+}
+#endif
+
+static TraceBuffer *get_trace_buffer(void)
+{
+    TraceBuffer *b = trace_thread_buffer;
+    TraceBuffer *old;
+
+    if (likely(b)) {
+        return b;
+    }
+
+    /* Take over the buffer of a thread that has exited, if any */
+    for (b = atomic_rcu_read(&trace_buffers); b; b = b->next) {
+        if (!atomic_read(&b->in_use) && !atomic_xchg(&b->in_use, true)) {
+            break;
+        }
+    }
+
+    if (!b) {
+        b = calloc(1, sizeof(*b)); /* don't use g_malloc, can deadlock */
+        if (!b) {
+            return NULL;
+        }
+        b->in_use = true;
+        do {
+            old = atomic_read(&trace_buffers);
+            b->next = old;
+        } while (atomic_cmpxchg(&trace_buffers, old, b) != old);
+    }
+
+    trace_thread_buffer = b;
+#ifndef _WIN32
+    pthread_setspecific(trace_buffer_key, b);
+#endif
+    return b;
+}
+
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceBuffer *b = get_trace_buffer();
+    TraceRecord record;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
 
-    idx = old_idx % TRACE_BUF_LEN;
-
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
-
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
-    return 0;
-}
-
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+    if (!b) {
+        atomic_inc(&dropped_events);
+        return -ENOMEM;
     }
-}
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
+    if (b->head + rec_len - atomic_read(&b->tail) > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        atomic_inc(&b->dropped);
+        return -ENOSPC;
     }
-    return idx; /* most callers wants to know where to write next */
+
+    record.event = event;
+    record.timestamp_ns = get_clock();
+    record.length = rec_len;
+    record.pid = trace_pid;
+
+    rec->tbuf = b;
+    rec->rec_off = write_to_buffer(b, b->head, &record, sizeof(TraceRecord));
+    return 0;
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceBuffer *b = rec->tbuf;
+
+    smp_wmb(); /* write barrier before publishing the record */
+    atomic_set(&b->head, rec->rec_off);
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (rec->rec_off - atomic_read(&b->tail) > TRACE_BUF_FLUSH_THRESHOLD &&
+        !atomic_read(&trace_kicked) && !atomic_xchg(&trace_kicked, true)) {
         flush_trace_file(false);
     }
 }
@@ -336,8 +415,20 @@ void st_set_trace_file(const char *file)
 
 void st_print_trace_file_status(FILE *stream, int (*stream_printf)(FILE *stream, const char *fmt, ...))
 {
+    TraceBuffer *b;
+    uint64_t dropped = atomic_read(&dropped_events);
+    unsigned int nr_buffers = 0;
+
+    for (b = atomic_rcu_read(&trace_buffers); b; b = b->next) {
+        nr_buffers++;
+        /* Racy, but only informational */
+        dropped += b->total_dropped + atomic_read(&b->dropped);
+    }
+
     stream_printf(stream, "Trace file \"%s\" %s.\n",
                   trace_file_name, trace_fp ? "on" : "off");
+    stream_printf(stream, "%u thread buffers, %" PRIu64 " events dropped.\n",
+                  nr_buffers, dropped);
 }
 
 void st_flush_trace_buffer(void)
@@ -375,6 +466,13 @@ bool st_init(void)
 
     trace_pid = getpid();
 
+#ifndef _WIN32
+    if (pthread_key_create(&trace_buffer_key, put_trace_buffer)) {
+        fprintf(stderr, "warning: unable to initialize simple trace backend\n");
+        return false;
+    }
+#endif
+
     thread = trace_thread_create(writeout_thread);
     if (!thread) {
         fprintf(stderr, "warning: unable to initialize simple trace backend\n");
@@ -22,14 +22,15 @@ bool st_init(void);
 void st_flush_trace_buffer(void);
 
 typedef struct {
-    unsigned int tbuf_idx;
+    struct TraceBuffer *tbuf;
     unsigned int rec_off;
 } TraceBufferRecord;
 
 /* Note for hackers: Make sure MAX_TRACE_LEN < sizeof(uint32_t) */
 #define MAX_TRACE_STRLEN 512
 /**
- * Initialize a trace record and claim space for it in the buffer
+ * Initialize a trace record and claim space for it in the buffer of the
+ * calling thread
  *
  * @arglen  number of bytes required for arguments
  */
@@ -55,6 +55,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "exec/log.h"
+#include "qemu/stats.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -76,8 +77,6 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     unsigned long *code_bitmap;
-#else
-    unsigned long flags;
 #endif
 } PageDesc;
 
@@ -329,9 +328,156 @@ void page_size_init(void)
     qemu_host_page_mask = -(intptr_t)qemu_host_page_size;
 }
 
+#ifdef CONFIG_USER_ONLY
+/*
+ * The flags of the guest pages are kept as a set of runs of pages with
+ * the same flags, sorted by address, so that mapping or changing a large
+ * area costs the same as a single page.  Pages outside the runs have no
+ * flags.  Changes are made with the mmap_lock held, but lookups can come
+ * from any thread: pageflags_lock makes them safe.
+ */
+typedef struct PageFlagsNode {
+    target_ulong start;
+    target_ulong last;
+    int flags;
+} PageFlagsNode;
+
+static GTree *pageflags;
+static QemuMutex pageflags_lock;
+
+static gint pageflags_cmp(gconstpointer a, gconstpointer b)
+{
+    const PageFlagsNode *na = a, *nb = b;
+
+    return na->start < nb->start ? -1 : na->start > nb->start;
+}
+
+/* g_tree_search() callback: where is the range @opaque from node @key? */
+static gint pageflags_search(gconstpointer key, gconstpointer opaque)
+{
+    const PageFlagsNode *n = key, *r = opaque;
+
+    if (r->last < n->start) {
+        return -1;
+    }
+    return r->start > n->last;
+}
+
+/* Return a run that overlaps [@start, @last], not necessarily the first */
+static PageFlagsNode *pageflags_find(target_ulong start, target_ulong last)
+{
+    PageFlagsNode r = { .start = start, .last = last };
+
+    return g_tree_search(pageflags, pageflags_search, &r);
+}
+
+static void pageflags_insert(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *n = g_new(PageFlagsNode, 1);
+
+    n->start = start;
+    n->last = last;
+    n->flags = flags;
+    g_tree_insert(pageflags, n, n);
+}
+
+static void pageflags_remove(PageFlagsNode *n)
+{
+    g_tree_remove(pageflags, n);
+    g_free(n);
+}
+
+/* Give the pages in [@start, @last] flags @flags, with pageflags_lock held */
+static void pageflags_set(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *n;
+
+    /* Trim (or split) the runs that overlap the range */
+    while ((n = pageflags_find(start, last))) {
+        target_ulong n_start = n->start, n_last = n->last;
+        int n_flags = n->flags;
+
+        pageflags_remove(n);
+        if (n_start < start) {
+            pageflags_insert(n_start, start - 1, n_flags);
+        }
+        if (n_last > last) {
+            pageflags_insert(last + 1, n_last, n_flags);
+        }
+    }
+    if (!flags) {
+        return;
+    }
+
+    /* Merge with the neighbours if they have the same flags */
+    n = start ? pageflags_find(start - 1, start - 1) : NULL;
+    if (n && n->flags == flags) {
+        start = n->start;
+        pageflags_remove(n);
+    }
+    n = last != (target_ulong)-1 ? pageflags_find(last + 1, last + 1) : NULL;
+    if (n && n->flags == flags) {
+        last = n->last;
+        pageflags_remove(n);
+    }
+    pageflags_insert(start, last, flags);
+}
+
+/*
+ * Add @set and remove @clear from the flags of the pages in [@start, @last]
+ * that have any; return all their new flags ORed together.  Meant for
+ * ranges of a host page or so.
+ */
+static int pageflags_update(target_ulong start, target_ulong last,
+                            int set, int clear)
+{
+    target_ulong addr = start, done;
+    int prot = 0;
+
+    qemu_mutex_lock(&pageflags_lock);
+    do {
+        PageFlagsNode *n = pageflags_find(addr, addr);
+
+        if (n) {
+            int flags = (n->flags | set) & ~clear;
+
+            done = MIN(n->last, last);
+            if (flags != n->flags) {
+                pageflags_set(addr, done, flags);
+            }
+            prot |= flags;
+        } else {
+            done = addr + TARGET_PAGE_SIZE - 1;
+        }
+        addr = done + 1;
+    } while (done < last);
+    qemu_mutex_unlock(&pageflags_lock);
+
+    return prot;
+}
+
+void page_fork_start(void)
+{
+    qemu_mutex_lock(&pageflags_lock);
+}
+
+void page_fork_end(int child)
+{
+    if (child) {
+        qemu_mutex_init(&pageflags_lock);
+    } else {
+        qemu_mutex_unlock(&pageflags_lock);
+    }
+}
+#endif
+
 static void page_init(void)
 {
     page_size_init();
+#ifdef CONFIG_USER_ONLY
+    pageflags = g_tree_new(pageflags_cmp);
+    qemu_mutex_init(&pageflags_lock);
+#endif
 #if defined(CONFIG_BSD) && defined(CONFIG_USER_ONLY)
     {
 #ifdef HAVE_KINFO_GETVMMAP
@@ -742,6 +888,28 @@ static void tb_htable_init(void)
     qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE, mode);
 }
 
+#ifdef CONFIG_SOFTMMU
+static void tcg_stats_provider(StatsCollector *c, void *opaque)
+{
+    if (!stats_begin_instance(c, "translator")) {
+        return;
+    }
+
+    tb_lock();
+    stats_add_counter(c, "translations", tcg_ctx.tb_ctx.tb_gen_count);
+    stats_add_counter(c, "tb-flushes",
+                      atomic_read(&tcg_ctx.tb_ctx.tb_flush_count));
+    stats_add_counter(c, "tb-invalidations",
+                      tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    stats_add_counter(c, "tlb-flushes", atomic_read(&tlb_flush_count));
+    stats_add_gauge(c, "tbs", tcg_ctx.tb_ctx.nb_tbs);
+    stats_add_gauge(c, "max-tbs", tcg_ctx.code_gen_max_blocks);
+    stats_add_gauge(c, "code-size", tcg_code_size(&tcg_ctx));
+    stats_add_gauge(c, "code-buffer-size", tcg_ctx.code_gen_buffer_size);
+    tb_unlock();
+}
+#endif
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -755,6 +923,7 @@ void tcg_exec_init(unsigned long tb_size)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
     tcg_prologue_init(&tcg_ctx);
+    stats_register_provider("tcg", tcg_stats_provider, NULL);
 #endif
 }
 
@@ -776,6 +945,7 @@ static TranslationBlock *tb_alloc(target_ulong pc)
     tb->pc = pc;
     tb->cflags = 0;
     tb->invalid = false;
+    tb->exec_count = 0;
     return tb;
 }
 
@@ -848,11 +1018,10 @@ static void do_tb_flush(CPUState *cpu, void *data)
     }
 
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
+    printf("qemu: flush code_size=%zu nb_tbs=%d avg_tb_size=%zu\n",
+           tcg_code_size(&tcg_ctx),
            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+           tcg_code_size(&tcg_ctx) / tcg_ctx.tb_ctx.nb_tbs : 0);
 #endif
     if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
         > tcg_ctx.code_gen_buffer_size) {
@@ -889,6 +1058,70 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+bool tb_profile_enabled;
+
+/* Start or stop counting TB executions.  Existing translations carry no
+ * counters (or stale ones), so the cache is flushed either way.
+ */
+void tb_profile_set(CPUState *cpu, bool enable)
+{
+    atomic_set(&tb_profile_enabled, enable);
+    tb_flush(cpu);
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TBProfileEntry *ea = a;
+    const TBProfileEntry *eb = b;
+    uint64_t ia = ea->exec_count * ea->icount;
+    uint64_t ib = eb->exec_count * eb->icount;
+
+    /* Hottest first: guest instructions executed, then executions */
+    if (ia != ib) {
+        return ia < ib ? 1 : -1;
+    }
+    if (ea->exec_count != eb->exec_count) {
+        return ea->exec_count < eb->exec_count ? 1 : -1;
+    }
+    return 0;
+}
+
+/* Return in *pentries a newly allocated array describing every profiled
+ * TB that has run at least once, sorted by the number of guest
+ * instructions it executed.  The caller frees it with g_free().
+ */
+size_t tb_profile_snapshot(TBProfileEntry **pentries, uint64_t *total_insns)
+{
+    TBProfileEntry *entries;
+    size_t i, n = 0;
+    uint64_t total = 0;
+
+    tb_lock();
+    entries = g_new(TBProfileEntry, MAX(tcg_ctx.tb_ctx.nb_tbs, 1));
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+        TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+        uint64_t execs = tb->exec_count;
+
+        if (!(tb->cflags & CF_PROFILE) || execs == 0) {
+            continue;
+        }
+        entries[n].pc = tb->pc;
+        entries[n].cs_base = tb->cs_base;
+        entries[n].flags = tb->flags;
+        entries[n].icount = tb->icount;
+        entries[n].size = tb->size;
+        entries[n].exec_count = execs;
+        total += execs * tb->icount;
+        n++;
+    }
+    tb_unlock();
+
+    qsort(entries, n, sizeof(*entries), tb_profile_cmp);
+    *pentries = entries;
+    *total_insns = total;
+    return n;
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void
@@ -1105,25 +1338,14 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     invalidate_page_bitmap(p);
 
 #if defined(CONFIG_USER_ONLY)
-    if (p->flags & PAGE_WRITE) {
-        target_ulong addr;
-        PageDesc *p2;
+    if (page_get_flags(page_addr) & PAGE_WRITE) {
         int prot;
 
         /* force the host page as non writable (writes will have a
            page fault + mprotect overhead) */
         page_addr &= qemu_host_page_mask;
-        prot = 0;
-        for (addr = page_addr; addr < page_addr + qemu_host_page_size;
-            addr += TARGET_PAGE_SIZE) {
-
-            p2 = page_find(addr >> TARGET_PAGE_BITS);
-            if (!p2) {
-                continue;
-            }
-            prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
-          }
+        prot = pageflags_update(page_addr, page_addr + qemu_host_page_size - 1,
+                                0, PAGE_WRITE);
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
 #ifdef DEBUG_TB_INVALIDATE
@@ -1187,6 +1409,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (atomic_read(&tb_profile_enabled)) {
+        cflags |= CF_PROFILE;
+    }
 
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
@@ -1196,6 +1421,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         mmap_unlock();
         cpu_loop_exit(cpu);
     }
+    tcg_ctx.tb_ctx.tb_gen_count++;
 
     gen_code_buf = tcg_ctx.code_gen_ptr;
     tb->tc_ptr = gen_code_buf;
@@ -1735,6 +1961,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
     TranslationBlock *tb;
+    size_t code_size;
     struct qht_stats hst;
 
     target_code_size = 0;
@@ -1760,22 +1987,18 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+    code_size = tcg_code_size(&tcg_ctx);
+    cpu_fprintf(f, "gen code size       %zu/%zu\n",
+                code_size, tcg_ctx.code_gen_buffer_size);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zu bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1821,84 +2044,54 @@ struct walk_memory_regions_data {
     walk_memory_regions_fn fn;
     void *priv;
     target_ulong start;
+    target_ulong last;
     int prot;
+    int rc;
 };
 
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   target_ulong end, int new_prot)
+static int walk_memory_regions_end(struct walk_memory_regions_data *data)
 {
-    if (data->start != -1u) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
-        }
+    if (!data->prot) {
+        return 0;
     }
-
-    data->start = (new_prot ? end : -1u);
-    data->prot = new_prot;
-
-    return 0;
+    return data->fn(data->priv, data->start, data->last + 1, data->prot);
 }
 
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 target_ulong base, int level, void **lp)
+static gboolean walk_memory_regions_1(gpointer key, gpointer value,
+                                      gpointer opaque)
 {
-    target_ulong pa;
-    int i, rc;
-
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
-    }
+    struct walk_memory_regions_data *data = opaque;
+    PageFlagsNode *n = value;
 
-    if (level == 0) {
-        PageDesc *pd = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            int prot = pd[i].flags;
-
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
-        }
-    } else {
-        void **pp = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            pa = base | ((target_ulong)i <<
-                (TARGET_PAGE_BITS + V_L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
-            }
-        }
+    /* Report contiguous runs with the same flags as one region */
+    if (data->prot == n->flags && data->last + 1 == n->start) {
+        data->last = n->last;
+        return false;
     }
 
-    return 0;
+    data->rc = walk_memory_regions_end(data);
+    data->start = n->start;
+    data->last = n->last;
+    data->prot = n->flags;
+    return data->rc != 0;
 }
 
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
     struct walk_memory_regions_data data;
-    uintptr_t i;
 
     data.fn = fn;
     data.priv = priv;
-    data.start = -1u;
+    data.start = 0;
+    data.last = 0;
     data.prot = 0;
+    data.rc = 0;
 
-    for (i = 0; i < V_L1_SIZE; i++) {
-        int rc = walk_memory_regions_1(&data, (target_ulong)i << (V_L1_SHIFT + TARGET_PAGE_BITS),
-                                       V_L1_SHIFT / V_L2_BITS - 1, l1_map + i);
-        if (rc != 0) {
-            return rc;
-        }
-    }
+    qemu_mutex_lock(&pageflags_lock);
+    g_tree_foreach(pageflags, walk_memory_regions_1, &data);
+    qemu_mutex_unlock(&pageflags_lock);
 
-    return walk_memory_regions_end(&data, 0, 0);
+    return data.rc ? data.rc : walk_memory_regions_end(&data);
 }
 
 static int dump_region(void *priv, target_ulong start,
@@ -1925,15 +2118,59 @@ void page_dump(FILE *f)
     walk_memory_regions(f, dump_region);
 }
 
+/* with -d jit, log the translation statistics before exiting */
+void tb_log_stats(void)
+{
+    if (qemu_loglevel_mask(CPU_LOG_JIT)) {
+        qemu_log("TB count            %d\n", tcg_ctx.tb_ctx.nb_tbs);
+        tcg_dump_info(qemu_logfile, fprintf);
+    }
+}
+
+int page_get_flags_range(target_ulong address, target_ulong *start,
+                         target_ulong *last)
+{
+    PageFlagsNode *n;
+    int flags = 0;
+
+    qemu_mutex_lock(&pageflags_lock);
+    n = pageflags_find(address, address);
+    if (n) {
+        *start = n->start;
+        *last = n->last;
+        flags = n->flags;
+    }
+    qemu_mutex_unlock(&pageflags_lock);
+    return flags;
+}
+
 int page_get_flags(target_ulong address)
 {
-    PageDesc *p;
+    target_ulong start, last;
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
-        return 0;
+    return page_get_flags_range(address, &start, &last);
+}
+
+/* Invalidate the translated code in the pages of [@start, @last] */
+static void page_invalidate_range(target_ulong start, target_ulong last)
+{
+    tb_page_addr_t index = start >> TARGET_PAGE_BITS;
+    tb_page_addr_t end = last >> TARGET_PAGE_BITS;
+
+    for (;;) {
+        PageDesc *p = page_find(index);
+
+        if (!p) {
+            /* Skip the whole missing bottom level table */
+            index |= V_L2_SIZE - 1;
+        } else if (p->first_tb) {
+            tb_invalidate_phys_page(index << TARGET_PAGE_BITS, 0);
+        }
+        if (index >= end) {
+            break;
+        }
+        index++;
     }
-    return p->flags;
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -1941,7 +2178,7 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    target_ulong last;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1952,33 +2189,26 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
     assert(start < end);
 
     start = start & TARGET_PAGE_MASK;
-    end = TARGET_PAGE_ALIGN(end);
+    last = TARGET_PAGE_ALIGN(end) - 1;
 
     if (flags & PAGE_WRITE) {
         flags |= PAGE_WRITE_ORG;
-    }
-
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
 
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0);
-        }
-        p->flags = flags;
+        /* Pages with translated code are always write protected: if they
+           become writable, invalidate the code inside.  */
+        page_invalidate_range(start, last);
     }
+
+    qemu_mutex_lock(&pageflags_lock);
+    pageflags_set(start, last, flags);
+    qemu_mutex_unlock(&pageflags_lock);
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
     target_ulong end;
-    target_ulong addr;
+    target_ulong addr, run_start, run_last;
+    int run_flags;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1999,32 +2229,35 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     end = TARGET_PAGE_ALIGN(start + len);
     start = start & TARGET_PAGE_MASK;
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
-            return -1;
-        }
-        if (!(p->flags & PAGE_VALID)) {
+    addr = start;
+    for (;;) {
+        run_flags = page_get_flags_range(addr, &run_start, &run_last);
+        if (!(run_flags & PAGE_VALID)) {
             return -1;
         }
 
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
+        if ((flags & PAGE_READ) && !(run_flags & PAGE_READ)) {
             return -1;
         }
         if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
+            if (!(run_flags & PAGE_WRITE_ORG)) {
                 return -1;
             }
             /* unprotect the page if it was put read-only because it
                contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
+            if (!(run_flags & PAGE_WRITE)) {
                 if (!page_unprotect(addr, 0)) {
                     return -1;
                 }
+                /* The rest of the run may contain code too */
+                run_last = addr + TARGET_PAGE_SIZE - 1;
             }
         }
+
+        if (run_last >= end - 1) {
+            break;
+        }
+        addr = run_last + 1;
     }
     return 0;
 }
@@ -2039,7 +2272,7 @@ int page_unprotect(target_ulong address, uintptr_t pc)
 {
     unsigned int prot;
     bool current_tb_invalidated;
-    PageDesc *p;
+    int flags;
     target_ulong host_start, host_end, addr;
 
     /* Technically this isn't safe inside a signal handler.  However we
@@ -2047,25 +2280,17 @@ int page_unprotect(target_ulong address, uintptr_t pc)
        practice it seems to be ok.  */
     mmap_lock();
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
-        mmap_unlock();
-        return 0;
-    }
+    flags = page_get_flags(address);
 
     /* if the page was really writable, then we change its
        protection back to writable */
-    if ((p->flags & PAGE_WRITE_ORG) && !(p->flags & PAGE_WRITE)) {
+    if ((flags & PAGE_WRITE_ORG) && !(flags & PAGE_WRITE)) {
         host_start = address & qemu_host_page_mask;
         host_end = host_start + qemu_host_page_size;
 
-        prot = 0;
+        prot = pageflags_update(host_start, host_end - 1, PAGE_WRITE, 0);
         current_tb_invalidated = false;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
-            p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
-            prot |= p->flags;
-
             /* and since the content will be modified, we must invalidate
                the corresponding translated code. */
             current_tb_invalidated |= tb_invalidate_phys_page(addr, pc);
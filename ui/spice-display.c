@@ -127,7 +127,10 @@ void qemu_spice_wakeup(SimpleSpiceDisplay *ssd)
 }
 
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
-                                         QXLRect *rect)
+                                         QXLRect *rect,
+                                         pixman_image_t *surface,
+                                         pixman_image_t *mirror,
+                                         struct SimpleSpiceUpdateList *list)
 {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
@@ -168,7 +171,8 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     drawable->u.copy.src_area.right  = bw;
     drawable->u.copy.src_area.bottom = bh;
 
-    QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ssd->unique++);
+    QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE,
+                     atomic_fetch_inc(&ssd->unique));
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags      = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
     image->bitmap.stride     = bw * 4;
@@ -180,10 +184,10 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
 
     dest = pixman_image_create_bits(PIXMAN_LE_x8r8g8b8, bw, bh,
                                     (void *)update->bitmap, bw * 4);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
+    pixman_image_composite(PIXMAN_OP_SRC, surface, NULL, mirror,
                            rect->left, rect->top, 0, 0,
                            rect->left, rect->top, bw, bh);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
+    pixman_image_composite(PIXMAN_OP_SRC, mirror, NULL, dest,
                            rect->left, rect->top, 0, 0,
                            0, 0, bw, bh);
     pixman_image_unref(dest);
@@ -191,71 +195,187 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     cmd->type = QXL_CMD_DRAW;
     cmd->data = (uintptr_t)drawable;
 
-    QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
+    QTAILQ_INSERT_TAIL(list, update, next);
 }
 
-static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
+#define SPICE_UPDATE_BLKSIZE 32
+
+/*
+ * Send the updates for the columns whose dirty run ended above row
+ * @bottom.  Neighbouring columns whose runs started on the same row are
+ * sent as a single update, so that big changes do not turn into one
+ * update per column.
+ */
+static void qemu_spice_flush_columns(SimpleSpiceDisplay *ssd,
+                                     const QXLRect *dirty,
+                                     int *closed_top, int blocks,
+                                     int bottom,
+                                     pixman_image_t *surface,
+                                     pixman_image_t *mirror,
+                                     struct SimpleSpiceUpdateList *list)
+{
+    QXLRect update;
+    int blk, end;
+
+    for (blk = 0; blk < blocks; blk = end) {
+        end = blk + 1;
+        if (closed_top[blk] == -1) {
+            continue;
+        }
+        while (end < blocks && closed_top[end] == closed_top[blk]) {
+            end++;
+        }
+
+        update.top = closed_top[blk];
+        update.bottom = bottom;
+        update.left = dirty->left + blk * SPICE_UPDATE_BLKSIZE;
+        update.right = MIN(dirty->left + end * SPICE_UPDATE_BLKSIZE,
+                           dirty->right);
+        qemu_spice_create_one_update(ssd, &update, surface, mirror, list);
+        memset(closed_top + blk, -1, (end - blk) * sizeof(int));
+    }
+}
+
+static void qemu_spice_create_update(SimpleSpiceDisplay *ssd,
+                                     const QXLRect *dirty,
+                                     pixman_image_t *surface,
+                                     pixman_image_t *mirror_image,
+                                     struct SimpleSpiceUpdateList *list)
 {
-    static const int blksize = 32;
-    int blocks = DIV_ROUND_UP(surface_width(ssd->ds), blksize);
-    int dirty_top[blocks];
+    int blocks = DIV_ROUND_UP(dirty->right - dirty->left,
+                              SPICE_UPDATE_BLKSIZE);
+    int dirty_top[blocks], closed_top[blocks];
     int y, yoff1, yoff2, x, xoff, blk, bw;
-    int bpp = surface_bytes_per_pixel(ssd->ds);
+    int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(surface)) / 8;
+    int stride1 = pixman_image_get_stride(surface);
+    int stride2 = pixman_image_get_stride(mirror_image);
+    size_t row = (dirty->right - dirty->left) * bpp;
     uint8_t *guest, *mirror;
+    bool closed;
 
-    if (qemu_spice_rect_is_empty(&ssd->dirty)) {
-        return;
-    };
+    memset(dirty_top, -1, sizeof(dirty_top));
+    memset(closed_top, -1, sizeof(closed_top));
 
-    for (blk = 0; blk < blocks; blk++) {
-        dirty_top[blk] = -1;
-    }
+    guest = (void *)pixman_image_get_data(surface);
+    mirror = (void *)pixman_image_get_data(mirror_image);
+    for (y = dirty->top; y < dirty->bottom; y++) {
+        yoff1 = y * stride1 + dirty->left * bpp;
+        yoff2 = y * stride2 + dirty->left * bpp;
+        closed = false;
 
-    guest = surface_data(ssd->ds);
-    mirror = (void *)pixman_image_get_data(ssd->mirror);
-    for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
-        yoff1 = y * surface_stride(ssd->ds);
-        yoff2 = y * pixman_image_get_stride(ssd->mirror);
-        for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
-            xoff = x * bpp;
-            blk = x / blksize;
-            bw = MIN(blksize, ssd->dirty.right - x);
-            if (memcmp(guest + yoff1 + xoff,
-                       mirror + yoff2 + xoff,
-                       bw * bpp) == 0) {
+        /* One long compare is cheaper for the rows that did not change */
+        if (memcmp(guest + yoff1, mirror + yoff2, row) == 0) {
+            for (blk = 0; blk < blocks; blk++) {
                 if (dirty_top[blk] != -1) {
-                    QXLRect update = {
-                        .top    = dirty_top[blk],
-                        .bottom = y,
-                        .left   = x,
-                        .right  = x + bw,
-                    };
-                    qemu_spice_create_one_update(ssd, &update);
+                    closed_top[blk] = dirty_top[blk];
                     dirty_top[blk] = -1;
+                    closed = true;
                 }
-            } else {
-                if (dirty_top[blk] == -1) {
-                    dirty_top[blk] = y;
+            }
+        } else {
+            for (blk = 0; blk < blocks; blk++) {
+                x = blk * SPICE_UPDATE_BLKSIZE;
+                xoff = x * bpp;
+                bw = MIN(SPICE_UPDATE_BLKSIZE, dirty->right - dirty->left - x);
+                if (memcmp(guest + yoff1 + xoff,
+                           mirror + yoff2 + xoff,
+                           bw * bpp) == 0) {
+                    if (dirty_top[blk] != -1) {
+                        closed_top[blk] = dirty_top[blk];
+                        dirty_top[blk] = -1;
+                        closed = true;
+                    }
+                } else {
+                    if (dirty_top[blk] == -1) {
+                        dirty_top[blk] = y;
+                    }
                 }
             }
         }
+
+        if (closed) {
+            qemu_spice_flush_columns(ssd, dirty, closed_top, blocks, y,
+                                     surface, mirror_image, list);
+        }
     }
 
-    for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
-        blk = x / blksize;
-        bw = MIN(blksize, ssd->dirty.right - x);
-        if (dirty_top[blk] != -1) {
-            QXLRect update = {
-                .top    = dirty_top[blk],
-                .bottom = ssd->dirty.bottom,
-                .left   = x,
-                .right  = x + bw,
-            };
-            qemu_spice_create_one_update(ssd, &update);
-            dirty_top[blk] = -1;
+    qemu_spice_flush_columns(ssd, dirty, dirty_top, blocks, dirty->bottom,
+                             surface, mirror_image, list);
+}
+
+static void *qemu_spice_update_thread(void *opaque)
+{
+    SimpleSpiceDisplay *ssd = opaque;
+    struct SimpleSpiceUpdateList list;
+    SimpleSpiceUpdate *update;
+
+    qemu_mutex_lock(&ssd->lock);
+    for (;;) {
+        while (!ssd->update_busy) {
+            qemu_cond_wait(&ssd->update_cond, &ssd->lock);
         }
+        qemu_mutex_unlock(&ssd->lock);
+
+        QTAILQ_INIT(&list);
+        qemu_spice_create_update(ssd, &ssd->update_rect,
+                                 ssd->update_surface, ssd->update_mirror,
+                                 &list);
+
+        qemu_mutex_lock(&ssd->lock);
+        while ((update = QTAILQ_FIRST(&list)) != NULL) {
+            QTAILQ_REMOVE(&list, update, next);
+            QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
+        }
+        ssd->update_busy = false;
+        qemu_cond_broadcast(&ssd->update_cond);
+        qemu_mutex_unlock(&ssd->lock);
+
+        qemu_spice_wakeup(ssd);
+        qemu_mutex_lock(&ssd->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Drop the references taken for the last job of the update thread.
+ * This is done here rather than in the thread because pixman
+ * reference counts are not atomic.
+ */
+static void qemu_spice_update_finish_locked(SimpleSpiceDisplay *ssd)
+{
+    if (!ssd->update_busy && ssd->update_surface) {
+        pixman_image_unref(ssd->update_surface);
+        pixman_image_unref(ssd->update_mirror);
+        ssd->update_surface = NULL;
+        ssd->update_mirror = NULL;
     }
+}
 
+static void qemu_spice_update_wait(SimpleSpiceDisplay *ssd)
+{
+    qemu_mutex_lock(&ssd->lock);
+    while (ssd->update_busy) {
+        qemu_cond_wait(&ssd->update_cond, &ssd->lock);
+    }
+    qemu_spice_update_finish_locked(ssd);
+    qemu_mutex_unlock(&ssd->lock);
+}
+
+static void qemu_spice_update_start_locked(SimpleSpiceDisplay *ssd)
+{
+    if (!ssd->update_thread_started) {
+        qemu_thread_create(&ssd->update_thread, "spice_display",
+                           qemu_spice_update_thread, ssd,
+                           QEMU_THREAD_DETACHED);
+        ssd->update_thread_started = true;
+    }
+
+    ssd->update_rect = ssd->dirty;
+    ssd->update_surface = pixman_image_ref(ssd->surface);
+    ssd->update_mirror = pixman_image_ref(ssd->mirror);
+    ssd->update_busy = true;
+    qemu_cond_broadcast(&ssd->update_cond);
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
 }
 
@@ -281,7 +401,7 @@ qemu_spice_create_cursor_update(SimpleSpiceDisplay *ssd,
         ccmd->u.set.position.y = ssd->ptr_y + ssd->hot_y;
         ccmd->u.set.visible    = true;
         ccmd->u.set.shape      = (uintptr_t)cursor;
-        cursor->header.unique     = ssd->unique++;
+        cursor->header.unique     = atomic_fetch_inc(&ssd->unique);
         cursor->header.type       = SPICE_CURSOR_TYPE_ALPHA;
         cursor->header.width      = c->width;
         cursor->header.height     = c->height;
@@ -373,6 +493,7 @@ void qemu_spice_destroy_host_primary(SimpleSpiceDisplay *ssd)
 void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd)
 {
     qemu_mutex_init(&ssd->lock);
+    qemu_cond_init(&ssd->update_cond);
     QTAILQ_INIT(&ssd->updates);
     ssd->mouse_x = -1;
     ssd->mouse_y = -1;
@@ -407,6 +528,9 @@ void qemu_spice_display_switch(SimpleSpiceDisplay *ssd,
     SimpleSpiceUpdate *update;
     bool need_destroy;
 
+    /* The update thread must be done with the old surface and mirror */
+    qemu_spice_update_wait(ssd);
+
     if (surface && ssd->surface &&
         surface_width(surface) == pixman_image_get_width(ssd->surface) &&
         surface_height(surface) == pixman_image_get_height(ssd->surface) &&
@@ -497,10 +621,16 @@ void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd)
     dprint(3, "%s/%d:\n", __func__, ssd->qxl.id);
     graphic_hw_update(ssd->dcl.con);
 
+    /*
+     * Diffing and copying a big surface takes long, so it is done by the
+     * update thread, which wakes up the spice server itself.  Changes
+     * made in the meantime pile up in ssd->dirty for the next job.
+     */
     qemu_mutex_lock(&ssd->lock);
-    if (QTAILQ_EMPTY(&ssd->updates) && ssd->ds) {
-        qemu_spice_create_update(ssd);
-        ssd->notify++;
+    qemu_spice_update_finish_locked(ssd);
+    if (QTAILQ_EMPTY(&ssd->updates) && ssd->ds && !ssd->update_busy &&
+        !qemu_spice_rect_is_empty(&ssd->dirty)) {
+        qemu_spice_update_start_locked(ssd);
     }
     qemu_mutex_unlock(&ssd->lock);
 
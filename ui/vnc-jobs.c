@@ -44,28 +44,39 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay lock in
+ * shared mode: several workers can encode from the same server surface at
+ * once, while vnc_refresh() (which uses trylock()) is kept out.  The output
+ * lock is not held because the thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
  */
 
+/*
+ * There is a single global queue, served by a pool of worker threads.  The
+ * jobs of one client are run one at a time and in order, because most
+ * encoders keep state (e.g. zlib streams) across updates; different clients
+ * are encoded in parallel.  The only exception are the parts of an update
+ * that vnc_job_push() split for a stateless encoding: they carry the same
+ * update number and may run concurrently with each other.
+ */
+#define VNC_WORKER_THREADS_MAX 8
+
+/* Only split updates with at least this many rectangles per part */
+#define VNC_JOB_SPLIT_MIN_RECTS 4
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
+    QemuThread threads[VNC_WORKER_THREADS_MAX];
+    int nr_threads;
+    int running;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
-/*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
- */
 static VncJobQueue *queue;
 
 static void vnc_lock_queue(VncJobQueue *queue)
@@ -104,13 +115,68 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+/* Raw and hextile output for a rectangle does not depend on earlier ones */
+static bool vnc_encoding_is_stateless(int encoding)
+{
+    return encoding == VNC_ENCODING_RAW || encoding == VNC_ENCODING_HEXTILE;
+}
+
+/*
+ * Split the rectangles of @job into up to one part per worker thread and
+ * queue them, each as a FramebufferUpdate message of its own.  The
+ * rectangles of an update do not overlap, so the client may receive the
+ * parts in any order.
+ */
+static void vnc_job_push_split_locked(VncJob *job, int n_rects)
+{
+    int n_parts = MIN(queue->nr_threads, n_rects / VNC_JOB_SPLIT_MIN_RECTS);
+    VncJob *parts[VNC_WORKER_THREADS_MAX];
+    VncRectEntry *entry, *tmp;
+    int i = 0;
+
+    parts[0] = job;
+    for (i = 1; i < n_parts; i++) {
+        parts[i] = g_new0(VncJob, 1);
+        parts[i]->vs = job->vs;
+        QLIST_INIT(&parts[i]->rectangles);
+    }
+
+    i = 0;
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        if (i) {
+            QLIST_REMOVE(entry, next);
+            QLIST_INSERT_HEAD(&parts[i]->rectangles, entry, next);
+        }
+        i = (i + 1) % n_parts;
+    }
+
+    for (i = 0; i < n_parts; i++) {
+        parts[i]->update = job->update;
+        parts[i]->parallel = true;
+        QTAILQ_INSERT_TAIL(&queue->jobs, parts[i], next);
+    }
+}
+
 void vnc_job_push(VncJob *job)
 {
+    VncRectEntry *entry;
+    int n_rects = 0;
+
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
         g_free(job);
     } else {
-        QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        job->update = ++job->vs->jobs_pushed;
+        QLIST_FOREACH(entry, &job->rectangles, next) {
+            n_rects++;
+        }
+        if (queue->nr_threads > 1 &&
+            n_rects >= 2 * VNC_JOB_SPLIT_MIN_RECTS &&
+            vnc_encoding_is_stateless(job->vs->vnc_encoding)) {
+            vnc_job_push_split_locked(job, n_rects);
+        } else {
+            QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        }
         qemu_cond_broadcast(&queue->cond);
     }
     vnc_unlock_queue(queue);
@@ -120,6 +186,9 @@ static bool vnc_has_job_locked(VncState *vs)
 {
     VncJob *job;
 
+    if (vs ? vs->jobs_running : queue->running) {
+        return true;
+    }
     QTAILQ_FOREACH(job, &queue->jobs, next) {
         if (job->vs == vs || !vs) {
             return true;
@@ -128,6 +197,30 @@ static bool vnc_has_job_locked(VncState *vs)
     return false;
 }
 
+/*
+ * Take the first job whose client has nothing running, or that is another
+ * part of the update the client is running.  Because the queue is in push
+ * order, this never overtakes an earlier job of the same client.
+ */
+static VncJob *vnc_queue_pop_locked(VncJobQueue *queue)
+{
+    VncJob *job;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        VncState *vs = job->vs;
+
+        if (!vs->jobs_running ||
+            (job->parallel && job->update == vs->jobs_running_update)) {
+            QTAILQ_REMOVE(&queue->jobs, job, next);
+            vs->jobs_running++;
+            vs->jobs_running_update = job->update;
+            queue->running++;
+            return job;
+        }
+    }
+    return NULL;
+}
+
 bool vnc_has_job(VncState *vs)
 {
     bool ret;
@@ -153,6 +246,19 @@ void vnc_jobs_clear(VncState *vs)
 
 void vnc_jobs_join(VncState *vs)
 {
+    VncDisplay *vd = vs->vd;
+
+    /*
+     * Do not let the jobs wait for a refresh that cannot run until we
+     * return; vnc_refresh() will simply try again later.
+     */
+    qemu_mutex_lock(&vd->mutex);
+    if (vd->refresh_waiting) {
+        vd->refresh_waiting = false;
+        qemu_cond_broadcast(&vd->encoders_cond);
+    }
+    qemu_mutex_unlock(&vd->mutex);
+
     vnc_lock_queue(queue);
     while (vnc_has_job_locked(vs)) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
@@ -187,8 +293,10 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncJob *job, VncState *local)
 {
+    VncState *orig = job->vs;
+
     buffer_init(&local->output, "vnc-worker-output");
     local->sioc = NULL; /* Don't do any network work on this thread */
     local->ioc = NULL; /* Don't do any network work on this thread */
@@ -197,6 +305,7 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->features = orig->features;
     local->vd = orig->vd;
     local->lossy_rect = orig->lossy_rect;
+    local->video_quality = orig->video_quality;
     local->write_pixels = orig->write_pixels;
     local->client_pf = orig->client_pf;
     local->client_be = orig->client_be;
@@ -204,10 +313,25 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
+
+    /*
+     * The parts of a split update run in parallel, so they must not touch
+     * any encoder state.  Raw is always allowed, in case the client just
+     * switched to another encoding.
+     */
+    if (job->parallel && !vnc_encoding_is_stateless(local->vnc_encoding)) {
+        local->vnc_encoding = VNC_ENCODING_RAW;
+    }
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncJob *job, VncState *local)
 {
+    VncState *orig = job->vs;
+
+    if (job->parallel) {
+        /* Stateless encodings have nothing to copy back */
+        return;
+    }
     orig->tight = local->tight;
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
@@ -224,11 +348,9 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && !(job = vnc_queue_pop_locked(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
     vnc_unlock_queue(queue);
 
     if (queue->exit) {
@@ -251,7 +373,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job, &vs);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -260,14 +382,14 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->ioc == NULL) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* Copy persistent encoding data */
-            vnc_async_encoding_end(job->vs, &vs);
+            vnc_async_encoding_end(job, &vs);
             goto disconnected;
         }
 
@@ -279,7 +401,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -289,21 +411,29 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     if (job->vs->ioc != NULL) {
         buffer_move(&job->vs->jobs_buffer, &vs.output);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job, &vs);
 
-	qemu_bh_schedule(job->vs->bh);
+        qemu_bh_schedule(job->vs->bh);
     }  else {
         buffer_reset(&vs.output);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job, &vs);
     }
     vnc_unlock_output(job->vs);
 
 disconnected:
+    /* Free the rectangles that were not sent */
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    buffer_free(&vs.output);
+
     vnc_lock_queue(queue);
-    QTAILQ_REMOVE(&queue->jobs, job, next);
-    vnc_unlock_queue(queue);
+    job->vs->jobs_running--;
+    queue->running--;
+    /* Wakes up vnc_jobs_join() and workers waiting for this client */
     qemu_cond_broadcast(&queue->cond);
+    vnc_unlock_queue(queue);
     g_free(job);
     return 0;
 }
@@ -329,14 +459,32 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
+    bool last;
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(queue)) {
+        /* nothing */
+    }
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    vnc_lock_queue(queue);
+    last = !--queue->nr_threads;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
+static int vnc_worker_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return MAX(1, MIN(cpus, VNC_WORKER_THREADS_MAX));
+#else
+    return 1;
+#endif
+}
+
 static bool vnc_worker_thread_running(void)
 {
     return queue; /* Check global queue */
@@ -345,12 +493,21 @@ static bool vnc_worker_thread_running(void)
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i, n;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    n = vnc_worker_threads();
+    /* Count the threads first, a thread may exit as soon as it starts */
+    q->nr_threads = n;
+    for (i = 0; i < n; i++) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "vnc_worker/%d", i);
+        qemu_thread_create(&q->threads[i], name, vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
     queue = q; /* Set global queue */
 }
@@ -42,18 +42,61 @@ void vnc_jobs_consume_buffer(VncState *vs);
 void vnc_start_worker_thread(void);
 
 /* Locks */
+
+/*
+ * The display lock is taken for exclusive access to the server surface.
+ * Worker threads that are encoding hold it in shared mode instead: they
+ * only count themselves in vd->encoders under vd->mutex.  An exclusive
+ * user that finds encoders sets vd->refresh_waiting, which keeps new
+ * encoders out until it gets the lock.
+ */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -EBUSY;
+    }
+    if (vd->encoders) {
+        vd->refresh_waiting = true;
+        qemu_mutex_unlock(&vd->mutex);
+        return -EBUSY;
+    }
+    return 0;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
 {
     qemu_mutex_lock(&vd->mutex);
+    while (vd->encoders) {
+        vd->refresh_waiting = true;
+        qemu_cond_wait(&vd->encoders_cond, &vd->mutex);
+    }
 }
 
 static inline void vnc_unlock_display(VncDisplay *vd)
 {
+    if (vd->refresh_waiting) {
+        vd->refresh_waiting = false;
+        qemu_cond_broadcast(&vd->encoders_cond);
+    }
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    while (vd->refresh_waiting) {
+        qemu_cond_wait(&vd->encoders_cond, &vd->mutex);
+    }
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    if (!--vd->encoders && vd->refresh_waiting) {
+        qemu_cond_broadcast(&vd->encoders_cond);
+    }
     qemu_mutex_unlock(&vd->mutex);
 }
 
@@ -55,6 +55,10 @@ static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 #include "vnc_keysym.h"
 #include "crypto/cipher.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static QTAILQ_HEAD(, VncDisplay) vnc_displays =
     QTAILQ_HEAD_INITIALIZER(vnc_displays);
 
@@ -1033,6 +1037,34 @@ static int find_and_clear_dirty_height(VncState *vs,
     return h;
 }
 
+/* Number of dropped or sent updates before changing the video quality */
+#define VNC_VIDEO_QUALITY_DROP_UPDATES  4
+#define VNC_VIDEO_QUALITY_RAISE_UPDATES 30
+
+static void vnc_video_quality_update(VncState *vs, bool congested)
+{
+    if (vs->vd->non_adaptive || vs->tight.quality == (uint8_t)-1) {
+        return;
+    }
+    if (congested) {
+        vs->video_updates = MIN(vs->video_updates, 0) - 1;
+        if (vs->video_updates <= -VNC_VIDEO_QUALITY_DROP_UPDATES) {
+            vs->video_updates = 0;
+            if (vs->video_quality > 0) {
+                vs->video_quality--;
+            }
+        }
+    } else {
+        vs->video_updates = MAX(vs->video_updates, 0) + 1;
+        if (vs->video_updates >= VNC_VIDEO_QUALITY_RAISE_UPDATES) {
+            vs->video_updates = 0;
+            if (vs->video_quality < vs->tight.quality) {
+                vs->video_quality++;
+            }
+        }
+    }
+}
+
 static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
 {
     if (vs->disconnecting) {
@@ -1048,13 +1080,17 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         int height, width;
         int n = 0;
 
-        if (vs->output.offset && !vs->audio_cap && !vs->force_update)
+        if (vs->output.offset && !vs->audio_cap && !vs->force_update) {
             /* kernel send buffers are full -> drop frames to throttle */
+            vnc_video_quality_update(vs, true);
             return 0;
+        }
 
         if (!vs->has_dirty && !vs->audio_cap && !vs->force_update)
             return 0;
 
+        vnc_video_quality_update(vs, false);
+
         /*
          * Send screen updates to the vnc client using the server
          * surface and server dirty map.  guest surface updates
@@ -2100,6 +2136,8 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
             break;
         }
     }
+    vs->video_quality = vs->tight.quality;
+    vs->video_updates = 0;
     vnc_desktop_resize(vs);
     check_pointer_type_change(&vs->mouse_mode_notifier, NULL);
     vnc_led_state_change(vs);
@@ -2841,6 +2879,33 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Copy @len bytes of a cell line from the guest surface at @src to the
+ * server surface at @dst, and return whether they differed.  This is a
+ * single pass: bytes are only copied from the first difference on.
+ */
+static bool vnc_update_cell(uint8_t *dst, const uint8_t *src, int len)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, d)) != 0xFFFF) {
+            memcpy(dst + i, src + i, len - i);
+            return true;
+        }
+    }
+#endif
+    if (memcmp(dst + i, src + i, len - i) == 0) {
+        return false;
+    }
+    memcpy(dst + i, src + i, len - i);
+    return true;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2883,7 +2948,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
+        int x, x2, x_end;
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -2905,28 +2970,36 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         }
         guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
-            if ((x + 1) * cmp_bytes > line_bytes) {
-                _cmp_bytes = line_bytes - x * cmp_bytes;
-            }
-            assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
-                continue;
-            }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
-            if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
-            }
-            QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+        /* Walk the runs of dirty cells in this line */
+        x_end = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+        while (x < x_end) {
+            x2 = find_next_zero_bit(vd->guest.dirty[y], x_end, x);
+            bitmap_clear(vd->guest.dirty[y], x, x2 - x);
+
+            for (; x < x2;
+                 x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+                int _cmp_bytes = cmp_bytes;
+                if ((x + 1) * cmp_bytes > line_bytes) {
+                    _cmp_bytes = line_bytes - x * cmp_bytes;
+                }
+                assert(_cmp_bytes >= 0);
+                if (!vnc_update_cell(server_ptr, guest_ptr, _cmp_bytes)) {
+                    continue;
+                }
+                if (!vd->non_adaptive) {
+                    vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
+                                     y, &tv);
+                }
+                QTAILQ_FOREACH(vs, &vd->clients, next) {
+                    set_bit(x, vs->dirty[y]);
+                }
+                has_dirty++;
             }
-            has_dirty++;
+
+            x2 = find_next_bit(vd->guest.dirty[y], x_end, x);
+            guest_ptr += (x2 - x) * cmp_bytes;
+            server_ptr += (x2 - x) * cmp_bytes;
+            x = x2;
         }
 
         y++;
@@ -3160,6 +3233,7 @@ void vnc_display_init(const char *id)
     vs->connections_limit = 32;
 
     qemu_mutex_init(&vs->mutex);
+    qemu_cond_init(&vs->encoders_cond);
     vnc_start_worker_thread();
 
     vs->dcl.ops = &dcl_ops;
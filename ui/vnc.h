@@ -157,6 +157,10 @@ struct VncDisplay
     int lock_key_sync;
     int key_delay_ms;
     QemuMutex mutex;
+    /* Shared users of the lock, see vnc_lock_display_shared */
+    QemuCond encoders_cond;
+    int encoders;
+    bool refresh_waiting;
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -248,6 +252,10 @@ struct VncJob
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
+
+    /* Parts of a split update have the same number and can run together */
+    uint64_t update;
+    bool parallel;
 };
 
 struct VncState
@@ -265,6 +273,14 @@ struct VncState
     int need_update;
     int force_update;
     int has_dirty;
+
+    /*
+     * Tight JPEG quality level used for frequently updated (video)
+     * regions; lowered when updates have to be dropped because the
+     * client cannot keep up, raised again while they go through.
+     */
+    uint8_t video_quality;
+    int video_updates;
     uint32_t features;
     int absolute;
     int last_x;
@@ -314,6 +330,11 @@ struct VncState
     QEMUBH *bh;
     Buffer jobs_buffer;
 
+    /* Protected by the job queue lock */
+    uint64_t jobs_pushed;
+    int jobs_running;
+    uint64_t jobs_running_update;
+
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
      */
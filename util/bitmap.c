@@ -56,6 +56,30 @@ int slow_bitmap_empty(const unsigned long *bitmap, long bits)
     return 1;
 }
 
+long slow_bitmap_count_one(const unsigned long *bitmap, long bits)
+{
+    long k, lim = bits / BITS_PER_LONG;
+    long c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+
+    /* Independent sums let the compiler keep several popcounts (or a
+     * vector popcount) in flight.
+     */
+    for (k = 0; k + 4 <= lim; k += 4) {
+        c0 += ctpopl(bitmap[k]);
+        c1 += ctpopl(bitmap[k + 1]);
+        c2 += ctpopl(bitmap[k + 2]);
+        c3 += ctpopl(bitmap[k + 3]);
+    }
+    for (; k < lim; ++k) {
+        c0 += ctpopl(bitmap[k]);
+    }
+    if (bits % BITS_PER_LONG) {
+        c0 += ctpopl(bitmap[k] & BITMAP_LAST_WORD_MASK(bits));
+    }
+
+    return c0 + c1 + c2 + c3;
+}
+
 int slow_bitmap_full(const unsigned long *bitmap, long bits)
 {
     long k, lim = bits/BITS_PER_LONG;
@@ -13,9 +13,17 @@
 
 #include "qemu/osdep.h"
 #include "qemu/bitops.h"
+#include "qemu/cutils.h"
 
 #define BITOP_WORD(nr)		((nr) / BITS_PER_LONG)
 
+/*
+ * Sparse bitmaps (e.g. dirty bitmaps of large disks) can have megabytes
+ * of zeroes between set bits.  Runs of this many zero words are skipped
+ * with buffer_is_zero, which is vectorized.
+ */
+#define FIND_BIT_SKIP_WORDS 64
+
 /*
  * Find the next set bit in a memory region.
  */
@@ -43,6 +51,16 @@ unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
         size -= BITS_PER_LONG;
         result += BITS_PER_LONG;
     }
+    /* Check the first words by hand, so that dense bitmaps do not pay for
+     * the call; once buffer_is_zero fails, the loops below find the bit.
+     */
+    while (size >= FIND_BIT_SKIP_WORDS * BITS_PER_LONG &&
+           !(p[0] | p[1] | p[2] | p[3]) &&
+           buffer_is_zero(p, FIND_BIT_SKIP_WORDS * sizeof(unsigned long))) {
+        p += FIND_BIT_SKIP_WORDS;
+        result += FIND_BIT_SKIP_WORDS * BITS_PER_LONG;
+        size -= FIND_BIT_SKIP_WORDS * BITS_PER_LONG;
+    }
     while (size >= 4*BITS_PER_LONG) {
         unsigned long d1, d2, d3;
         tmp = *p;
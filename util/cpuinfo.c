@@ -0,0 +1,115 @@
+/*
+ * Host CPU features
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cpuinfo.h"
+
+#ifdef CONFIG_CPUID_H
+#include <cpuid.h>
+
+/* Older versions of cpuid.h lack these */
+#ifndef bit_AES
+#define bit_AES         (1 << 25)
+#endif
+#ifndef bit_PCLMUL
+#define bit_PCLMUL      (1 << 1)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2        (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F     (1 << 16)
+#endif
+#ifndef bit_AVX512BW
+#define bit_AVX512BW    (1 << 30)
+#endif
+#endif
+
+unsigned cpuinfo;
+
+#ifdef CONFIG_CPUID_H
+static unsigned cpuinfo_x86(void)
+{
+    unsigned max = __get_cpuid_max(0, NULL);
+    unsigned a, b, c, d;
+    unsigned info = 0;
+
+    if (max < 1) {
+        return 0;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (d & bit_SSE2) {
+        info |= CPUINFO_SSE2;
+    }
+    if (c & bit_SSE4_1) {
+        info |= CPUINFO_SSE4_1;
+    }
+    if (c & bit_SSE4_2) {
+        info |= CPUINFO_SSE4_2;
+    }
+    if (c & bit_PCLMUL) {
+        info |= CPUINFO_PCLMUL;
+    }
+    if (c & bit_AES) {
+        info |= CPUINFO_AES;
+    }
+
+    /* We must check that AVX is not just available, but usable.  */
+    if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+        unsigned bv;
+
+        __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+        __cpuid_count(7, 0, a, b, c, d);
+        if ((bv & 6) == 6 && (b & bit_AVX2)) {
+            info |= CPUINFO_AVX2;
+        }
+        /* AVX-512 also needs the opmask and ZMM state */
+        if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+            info |= CPUINFO_AVX512F;
+            if (b & bit_AVX512BW) {
+                info |= CPUINFO_AVX512BW;
+            }
+        }
+    }
+    return info;
+}
+#endif
+
+unsigned cpuinfo_init(void)
+{
+    unsigned info = cpuinfo;
+
+    if (info) {
+        return info;
+    }
+
+    info = CPUINFO_ALWAYS;
+#ifdef CONFIG_CPUID_H
+    info |= cpuinfo_x86();
+#endif
+#ifdef __aarch64__
+    /* Advanced SIMD is mandatory in AArch64 */
+    info |= CPUINFO_NEON;
+#endif
+#ifdef __ARM_FEATURE_CRC32
+    info |= CPUINFO_CRC32;
+#endif
+#ifdef __ARM_FEATURE_CRYPTO
+    info |= CPUINFO_AES | CPUINFO_PMULL;
+#endif
+
+    cpuinfo = info;
+    return info;
+}
+
+static void __attribute__((constructor)) cpuinfo_constructor(void)
+{
+    cpuinfo_init();
+}
@@ -28,6 +28,8 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/crc32c.h"
+#include "qemu/bswap.h"
+#include "qemu/cpuinfo.h"
 
 /*
  * This is the CRC-32C table
@@ -106,11 +108,201 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_int(uint32_t crc, const uint8_t *data,
+                           unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+/*
+ * The CRC32C instructions of SSE4.2 and ARMv8 compute the same reflected
+ * update as the table, without the final inversion.
+ */
+#if defined(CONFIG_AVX2_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#include <nmmintrin.h>
+
+#define CRC32C_HW_FEATURE CPUINFO_SSE4_2
+
+static inline uint32_t crc32c_u8(uint32_t crc, uint8_t val)
+{
+    return _mm_crc32_u8(crc, val);
+}
+
+static inline uint32_t crc32c_u64(uint32_t crc, uint64_t val)
+{
+#ifdef __x86_64__
+    return _mm_crc32_u64(crc, val);
+#else
+    return _mm_crc32_u32(_mm_crc32_u32(crc, val), val >> 32);
+#endif
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+#define CRC32C_HW_FEATURE CPUINFO_CRC32
+
+static inline uint32_t crc32c_u8(uint32_t crc, uint8_t val)
+{
+    return __crc32cb(crc, val);
+}
+
+static inline uint32_t crc32c_u64(uint32_t crc, uint64_t val)
+{
+    return __crc32cd(crc, val);
+}
+#endif
+
+#ifdef CRC32C_HW_FEATURE
+/*
+ * The CRC instructions have a latency of several cycles but can start one
+ * per cycle, so large buffers are split in three blocks whose CRCs are
+ * computed in parallel.  By linearity, the CRC of A followed by B is the
+ * CRC of A shifted over |B| zero bytes, xor the CRC of B computed from
+ * zero.  crc32c_shift() applies that shift for CRC32C_BLOCK bytes with
+ * four table lookups.
+ */
+#define CRC32C_BLOCK 256
+
+static uint32_t crc32c_shift_table[4][256];
+
+static uint32_t crc32c_shift(uint32_t crc)
+{
+    return crc32c_shift_table[0][crc & 0xff] ^
+           crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xff] ^
+           crc32c_shift_table[3][crc >> 24];
+}
+
+static uint32_t crc32c_hw_serial(uint32_t crc, const uint8_t *data,
+                                 unsigned int length)
+{
+    while (length && ((uintptr_t)data & 7)) {
+        crc = crc32c_u8(crc, *data++);
+        length--;
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        crc = crc32c_u64(crc, ldq_le_p(data));
+    }
+    while (length--) {
+        crc = crc32c_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data,
+                          unsigned int length)
+{
+    const uint8_t *end;
+    uint32_t crc1, crc2;
+
+    for (; length >= 3 * CRC32C_BLOCK; length -= 3 * CRC32C_BLOCK) {
+        crc1 = crc2 = 0;
+        for (end = data + CRC32C_BLOCK; data < end; data += 8) {
+            crc = crc32c_u64(crc, ldq_le_p(data));
+            crc1 = crc32c_u64(crc1, ldq_le_p(data + CRC32C_BLOCK));
+            crc2 = crc32c_u64(crc2, ldq_le_p(data + 2 * CRC32C_BLOCK));
+        }
+        crc = crc32c_shift(crc32c_shift(crc) ^ crc1) ^ crc2;
+        data += 2 * CRC32C_BLOCK;
+    }
+    return crc32c_hw_serial(crc, data, length);
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT)
+#pragma GCC pop_options
+#endif
+
+#ifdef CRC32C_HW_FEATURE
+#define CACHE_HW      1
+
+static unsigned cpuid_cache;
+static uint32_t (*crc32c_accel)(uint32_t, const uint8_t *, unsigned int) =
+    crc32c_int;
+
+static void init_accel(unsigned cache)
+{
+    crc32c_accel = (cache & CACHE_HW) ? crc32c_hw : crc32c_int;
+}
+
+static void crc32c_init_shift_table(void)
+{
+    static const uint8_t zeroes[CRC32C_BLOCK];
+    uint32_t basis[32];
+    uint32_t val;
+    int i, j, k;
+
+    /* The shift is linear, so it is enough to know it for each bit */
+    for (i = 0; i < 32; i++) {
+        basis[i] = crc32c_hw_serial(1u << i, zeroes, CRC32C_BLOCK);
+    }
+    for (k = 0; k < 4; k++) {
+        for (j = 0; j < 256; j++) {
+            val = 0;
+            for (i = 0; i < 8; i++) {
+                if (j & (1 << i)) {
+                    val ^= basis[8 * k + i];
+                }
+            }
+            crc32c_shift_table[k][j] = val;
+        }
+    }
+}
+
+/* Check the accelerated version against the table, including the
+ * three-way path, before trusting it.
+ */
+static bool crc32c_hw_self_test(void)
+{
+    uint8_t buf[4 * CRC32C_BLOCK + 7];
+    int i;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 37 + 11;
+    }
+    return crc32c_hw(0xffffffff, buf + 1, sizeof(buf) - 1) ==
+           crc32c_int(0xffffffff, buf + 1, sizeof(buf) - 1);
+}
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    cpuid_cache = 0;
+    if (cpuinfo_init() & CRC32C_HW_FEATURE) {
+        crc32c_init_shift_table();
+        if (crc32c_hw_self_test()) {
+            cpuid_cache = CACHE_HW;
+        }
+    }
+    init_accel(cpuid_cache);
+}
+
+bool test_crc32c_next_accel(void)
+{
+    /* If no bits set, we just tested crc32c_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+#else
+#define crc32c_accel  crc32c_int
+bool test_crc32c_next_accel(void)
+{
+    return false;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_accel(crc, data, length) ^ 0xffffffff;
 }
 
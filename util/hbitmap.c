@@ -11,7 +11,10 @@
 
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
+#include "qemu/bitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
+#include "qemu/thread.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -92,6 +95,29 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/* Words counted per bitmap_count_one call; small enough to stay in cache
+ * between merging a block and counting it.
+ */
+#define HBITMAP_COUNT_BLOCK_WORDS  4096
+
+/* hbitmap_merge splits the last level in ranges of at least this many
+ * words, each merged by its own thread.
+ */
+#define HBITMAP_MERGE_THREAD_WORDS (1 << 20)
+#define HBITMAP_MERGE_MAX_THREADS  8
+
+static uint64_t hb_count_words(const unsigned long *words, uint64_t n)
+{
+    uint64_t count = 0;
+    uint64_t i, len;
+
+    for (i = 0; i < n; i += len) {
+        len = MIN(n - i, HBITMAP_COUNT_BLOCK_WORDS);
+        count += bitmap_count_one(words + i, len * BITS_PER_LONG);
+    }
+    return count;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -378,6 +404,280 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Require at least 64 bit granularity to be safe on both 64 bit and 32 bit
+     * hosts. */
+    return UINT64_C(64) << hb->granularity;
+}
+
+/* Start should be aligned to serialization granularity, chunk size should be
+ * aligned to serialization granularity too, except for last chunk.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, uint64_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last >> hb->granularity) != hb->size - 1) {
+        assert((count & (gran - 1)) == 0);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur;
+
+    if (!count) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        unsigned long el =
+            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+
+        memcpy(buf, &el, sizeof(el));
+        buf += sizeof(el);
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        memcpy(cur, buf, sizeof(*cur));
+
+        if (BITS_PER_LONG == 32) {
+            le32_to_cpus((uint32_t *)cur);
+        } else {
+            le64_to_cpus((uint64_t *)cur);
+        }
+
+        buf += sizeof(unsigned long);
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *first;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, 0, el_count * sizeof(unsigned long));
+}
+
+void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *first;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, 0xff, el_count * sizeof(unsigned long));
+}
+
+void hbitmap_deserialize_finish(HBitmap *bitmap)
+{
+    int64_t i, size, prev_size;
+    int lev;
+
+    /* Serialized data may have tail bits set beyond the end of the bitmap;
+     * drop them so that they are neither counted nor iterated over. */
+    if (bitmap->size & (BITS_PER_LONG - 1)) {
+        bitmap->levels[HBITMAP_LEVELS - 1][bitmap->size >> BITS_PER_LEVEL] &=
+            (1UL << (bitmap->size & (BITS_PER_LONG - 1))) - 1;
+    }
+
+    /* restore levels starting from penultimate to zero level, assuming
+     * that the last level is ok */
+    size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
+        prev_size = size;
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
+
+        for (i = 0; i < prev_size; ++i) {
+            if (bitmap->levels[lev + 1][i]) {
+                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+
+    bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    bitmap->count = hb_count_words(bitmap->levels[HBITMAP_LEVELS - 1],
+                                   bitmap->sizes[HBITMAP_LEVELS - 1]);
+}
+
+/* The compact format is a sequence of records, each made of a start and
+ * a length, counted in 64-bit elements of the hbitmap_serialize_part
+ * format (as little endian 64-bit integers), followed by the elements
+ * themselves.  Elements not covered by any record are zero.
+ */
+typedef struct HBitmapCompactRun {
+    uint64_t start;
+    uint64_t count;
+} HBitmapCompactRun;
+
+/* Zero elements between two runs that are cheaper to store than to start
+ * a new record for.
+ */
+#define HBITMAP_COMPACT_MAX_GAP 2
+
+static uint64_t hb_compact_elements(const HBitmap *hb)
+{
+    return DIV_ROUND_UP(hb->size, 64);
+}
+
+/* Convert @run to the range that hbitmap_(de)serialize_part expect */
+static void hb_compact_run_part(const HBitmap *hb, const HBitmapCompactRun *run,
+                                uint64_t *start, uint64_t *count)
+{
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+    uint64_t end = hb->size << hb->granularity;
+
+    *start = run->start * gran;
+    *count = MIN(run->count * gran, end - *start);
+}
+
+uint8_t *hbitmap_serialize_compact(const HBitmap *hb, size_t *size)
+{
+    GArray *runs = g_array_new(false, false, sizeof(HBitmapCompactRun));
+    HBitmapCompactRun *run = NULL;
+    HBitmapIter hbi;
+    unsigned long cur;
+    uint8_t *buf, *p;
+    size_t pos;
+    uint64_t el, start, count;
+    guint i;
+
+    if (hb->count) {
+        /* Only the nonzero words of the last level are visited */
+        hbitmap_iter_init(&hbi, hb, 0);
+        while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != (size_t)-1) {
+            el = (uint64_t)pos * BITS_PER_LONG / 64;
+            if (run &&
+                el <= run->start + run->count + HBITMAP_COMPACT_MAX_GAP) {
+                run->count = el - run->start + 1;
+            } else {
+                HBitmapCompactRun new_run = { .start = el, .count = 1 };
+                g_array_append_val(runs, new_run);
+                run = &g_array_index(runs, HBitmapCompactRun, runs->len - 1);
+            }
+        }
+    }
+
+    *size = 0;
+    for (i = 0; i < runs->len; i++) {
+        run = &g_array_index(runs, HBitmapCompactRun, i);
+        *size += 2 * sizeof(uint64_t) + run->count * sizeof(uint64_t);
+    }
+
+    /* Zero-filled, because a run that ends with the bitmap may be shorter
+     * than a whole number of elements on 32-bit hosts.
+     */
+    buf = p = g_malloc0(MAX(*size, 1));
+    for (i = 0; i < runs->len; i++) {
+        run = &g_array_index(runs, HBitmapCompactRun, i);
+        stq_le_p(p, run->start);
+        stq_le_p(p + 8, run->count);
+        p += 2 * sizeof(uint64_t);
+
+        hb_compact_run_part(hb, run, &start, &count);
+        hbitmap_serialize_part(hb, p, start, count);
+        p += run->count * sizeof(uint64_t);
+    }
+
+    g_array_free(runs, true);
+    return buf;
+}
+
+int hbitmap_deserialize_compact(HBitmap *hb, uint8_t *buf, size_t size)
+{
+    uint64_t nr_elements = hb_compact_elements(hb);
+    uint64_t next = 0;
+    uint64_t start, count;
+    HBitmapCompactRun run;
+    size_t off = 0;
+
+    if (hb->size) {
+        hbitmap_deserialize_zeroes(hb, 0, hb->size << hb->granularity);
+    }
+    while (off < size) {
+        /* The buffer comes from outside, check everything */
+        if (size - off < 2 * sizeof(uint64_t)) {
+            goto fail;
+        }
+        run.start = ldq_le_p(buf + off);
+        run.count = ldq_le_p(buf + off + 8);
+        off += 2 * sizeof(uint64_t);
+
+        if (run.start < next || run.start >= nr_elements || !run.count ||
+            run.count > nr_elements - run.start ||
+            run.count > (size - off) / sizeof(uint64_t)) {
+            goto fail;
+        }
+
+        hb_compact_run_part(hb, &run, &start, &count);
+        hbitmap_deserialize_part(hb, buf + off, start, count);
+        off += run.count * sizeof(uint64_t);
+        next = run.start + run.count;
+    }
+
+    hbitmap_deserialize_finish(hb);
+    return 0;
+
+fail:
+    hbitmap_reset_all(hb);
+    return -EINVAL;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -461,6 +761,72 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
 }
 
 
+typedef struct HBitmapMergeRange {
+    unsigned long *dst;
+    const unsigned long *src;
+    uint64_t words;
+    uint64_t count;
+} HBitmapMergeRange;
+
+static void *hb_merge_range(void *opaque)
+{
+    HBitmapMergeRange *r = opaque;
+    uint64_t i, j, len;
+
+    r->count = 0;
+    for (i = 0; i < r->words; i += len) {
+        len = MIN(r->words - i, HBITMAP_COUNT_BLOCK_WORDS);
+        for (j = i; j < i + len; j++) {
+            r->dst[j] |= r->src[j];
+        }
+        r->count += hb_count_words(r->dst + i, len);
+    }
+    return NULL;
+}
+
+static int hb_host_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    return MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+#else
+    return 1;
+#endif
+}
+
+/* Merge the last level of @b into @a, and return the new count of @a */
+static uint64_t hb_merge_last_level(HBitmap *a, const HBitmap *b)
+{
+    HBitmapMergeRange ranges[HBITMAP_MERGE_MAX_THREADS];
+    QemuThread threads[HBITMAP_MERGE_MAX_THREADS];
+    uint64_t words = a->sizes[HBITMAP_LEVELS - 1];
+    uint64_t per_thread, count;
+    int nthreads, i;
+
+    nthreads = MIN(words / HBITMAP_MERGE_THREAD_WORDS,
+                   MIN(HBITMAP_MERGE_MAX_THREADS, hb_host_cpus()));
+    nthreads = MAX(nthreads, 1);
+    per_thread = DIV_ROUND_UP(words, nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+        ranges[i].dst = a->levels[HBITMAP_LEVELS - 1] + i * per_thread;
+        ranges[i].src = b->levels[HBITMAP_LEVELS - 1] + i * per_thread;
+        ranges[i].words = MIN(per_thread, words - i * per_thread);
+        if (i > 0) {
+            qemu_thread_create(&threads[i], "hbitmap-merge", hb_merge_range,
+                               &ranges[i], QEMU_THREAD_JOINABLE);
+        }
+    }
+
+    /* The first range is ours */
+    hb_merge_range(&ranges[0]);
+    count = ranges[0].count;
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+        count += ranges[i].count;
+    }
+    return count;
+}
+
 /**
  * Given HBitmaps A and B, let A := A (BITOR) B.
  * Bitmap B will not be modified.
@@ -470,6 +836,9 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
+    HBitmapIter hbi;
+    unsigned long cur, old;
+    size_t pos;
     int i;
     uint64_t j;
 
@@ -481,15 +850,24 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
-     */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    /* The upper levels are small compared to the last one, OR them */
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             a->levels[i][j] |= b->levels[i][j];
         }
     }
 
+    if (b->count < b->sizes[HBITMAP_LEVELS - 1] / 16) {
+        /* Sparse: only visit the nonzero words of B */
+        hbitmap_iter_init(&hbi, b, 0);
+        while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != (size_t)-1) {
+            old = a->levels[HBITMAP_LEVELS - 1][pos];
+            a->levels[HBITMAP_LEVELS - 1][pos] = old | cur;
+            a->count += ctpopl(cur & ~old);
+        }
+    } else {
+        a->count = hb_merge_last_level(a, b);
+    }
+
     return true;
 }
@@ -0,0 +1,177 @@
+/*
+ * Host AES and carry-less multiplication instructions
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cpuinfo.h"
+#include "qemu/host-crypto.h"
+
+#if defined(HOST_CRYPTO_OPT) && defined(CONFIG_AVX2_OPT)
+#pragma GCC push_options
+#pragma GCC target("aes,pclmul")
+#include <wmmintrin.h>
+
+#define HOST_CRYPTO_AES_FEATURE     CPUINFO_AES
+#define HOST_CRYPTO_CLMUL_FEATURE   CPUINFO_PCLMUL
+
+void host_aesenc(void *d, const void *st, const void *rk)
+{
+    _mm_storeu_si128(d, _mm_aesenc_si128(_mm_loadu_si128(st),
+                                         _mm_loadu_si128(rk)));
+}
+
+void host_aesenclast(void *d, const void *st, const void *rk)
+{
+    _mm_storeu_si128(d, _mm_aesenclast_si128(_mm_loadu_si128(st),
+                                             _mm_loadu_si128(rk)));
+}
+
+void host_aesdec(void *d, const void *st, const void *rk)
+{
+    _mm_storeu_si128(d, _mm_aesdec_si128(_mm_loadu_si128(st),
+                                         _mm_loadu_si128(rk)));
+}
+
+void host_aesdeclast(void *d, const void *st, const void *rk)
+{
+    _mm_storeu_si128(d, _mm_aesdeclast_si128(_mm_loadu_si128(st),
+                                             _mm_loadu_si128(rk)));
+}
+
+void host_aesimc(void *d, const void *st)
+{
+    _mm_storeu_si128(d, _mm_aesimc_si128(_mm_loadu_si128(st)));
+}
+
+void host_clmul64(uint64_t r[2], uint64_t a, uint64_t b)
+{
+    __m128i x = _mm_set_epi64x(0, a);
+    __m128i y = _mm_set_epi64x(0, b);
+
+    _mm_storeu_si128((__m128i *)r, _mm_clmulepi64_si128(x, y, 0));
+}
+
+#pragma GCC pop_options
+#elif defined(HOST_CRYPTO_OPT)
+#include <arm_neon.h>
+
+#define HOST_CRYPTO_AES_FEATURE     CPUINFO_AES
+#define HOST_CRYPTO_CLMUL_FEATURE   CPUINFO_PMULL
+
+/*
+ * AESE and AESD add the round key before the substitution, while the
+ * x86 instructions add it at the end; use a zero key and add it later.
+ */
+void host_aesenc(void *d, const void *st, const void *rk)
+{
+    uint8x16_t x = vaeseq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    vst1q_u8(d, veorq_u8(vaesmcq_u8(x), vld1q_u8(rk)));
+}
+
+void host_aesenclast(void *d, const void *st, const void *rk)
+{
+    uint8x16_t x = vaeseq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    vst1q_u8(d, veorq_u8(x, vld1q_u8(rk)));
+}
+
+void host_aesdec(void *d, const void *st, const void *rk)
+{
+    uint8x16_t x = vaesdq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    vst1q_u8(d, veorq_u8(vaesimcq_u8(x), vld1q_u8(rk)));
+}
+
+void host_aesdeclast(void *d, const void *st, const void *rk)
+{
+    uint8x16_t x = vaesdq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    vst1q_u8(d, veorq_u8(x, vld1q_u8(rk)));
+}
+
+void host_aesimc(void *d, const void *st)
+{
+    vst1q_u8(d, vaesimcq_u8(vld1q_u8(st)));
+}
+
+void host_clmul64(uint64_t r[2], uint64_t a, uint64_t b)
+{
+    poly128_t x = vmull_p64((poly64_t)a, (poly64_t)b);
+
+    memcpy(r, &x, 16);
+}
+#endif
+
+#ifdef HOST_CRYPTO_OPT
+unsigned host_crypto;
+static unsigned cpuid_cache;
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned info = cpuinfo_init();
+
+    cpuid_cache = 0;
+    if (info & HOST_CRYPTO_AES_FEATURE) {
+        cpuid_cache |= HOST_CRYPTO_AES;
+    }
+    if (info & HOST_CRYPTO_CLMUL_FEATURE) {
+        cpuid_cache |= HOST_CRYPTO_CLMUL;
+    }
+    host_crypto = cpuid_cache;
+}
+
+bool test_host_crypto_next_accel(void)
+{
+    /* If no bits set, we just tested the fallbacks, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    host_crypto = cpuid_cache;
+    return true;
+}
+#else
+/* Only referenced from code that the callers' host_crypto check removes */
+void host_aesenc(void *d, const void *st, const void *rk)
+{
+    g_assert_not_reached();
+}
+
+void host_aesenclast(void *d, const void *st, const void *rk)
+{
+    g_assert_not_reached();
+}
+
+void host_aesdec(void *d, const void *st, const void *rk)
+{
+    g_assert_not_reached();
+}
+
+void host_aesdeclast(void *d, const void *st, const void *rk)
+{
+    g_assert_not_reached();
+}
+
+void host_aesimc(void *d, const void *st)
+{
+    g_assert_not_reached();
+}
+
+void host_clmul64(uint64_t r[2], uint64_t a, uint64_t b)
+{
+    g_assert_not_reached();
+}
+
+bool test_host_crypto_next_accel(void)
+{
+    return false;
+}
+#endif
@@ -269,9 +269,14 @@ unsigned iov_copy(struct iovec *dst_iov, unsigned int dst_iov_cnt,
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
 {
-    qiov->iov = g_new(struct iovec, alloc_hint);
+    if (alloc_hint <= QEMU_IOVEC_INLINE) {
+        qiov->iov = qiov->local_iov;
+        qiov->nalloc = QEMU_IOVEC_INLINE;
+    } else {
+        qiov->iov = g_new(struct iovec, alloc_hint);
+        qiov->nalloc = alloc_hint;
+    }
     qiov->niov = 0;
-    qiov->nalloc = alloc_hint;
     qiov->size = 0;
 }
 
@@ -293,7 +298,13 @@ void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
 
     if (qiov->niov == qiov->nalloc) {
         qiov->nalloc = 2 * qiov->nalloc + 1;
-        qiov->iov = g_renew(struct iovec, qiov->iov, qiov->nalloc);
+        if (qiov->iov == qiov->local_iov) {
+            qiov->iov = g_new(struct iovec, qiov->nalloc);
+            memcpy(qiov->iov, qiov->local_iov,
+                   qiov->niov * sizeof(struct iovec));
+        } else {
+            qiov->iov = g_renew(struct iovec, qiov->iov, qiov->nalloc);
+        }
     }
     qiov->iov[qiov->niov].iov_base = base;
     qiov->iov[qiov->niov].iov_len = len;
@@ -301,6 +312,51 @@ void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
     ++qiov->niov;
 }
 
+/*
+ * Initializes qiov as a view of `bytes' bytes of src, starting
+ * `offset' bytes into it.  No memory is allocated if the range only
+ * covers whole elements of src, because the slice then points to the
+ * array of src, or if it spans at most QEMU_IOVEC_INLINE elements.
+ * Only vector pointers are processed, not the actual data buffers.
+ *
+ * The slice must not be modified, and src must not be changed or
+ * destroyed while the slice is used.  The slice is released with
+ * qemu_iovec_destroy().
+ */
+void qemu_iovec_init_slice(QEMUIOVector *qiov, QEMUIOVector *src,
+                           size_t offset, size_t bytes)
+{
+    int first, last;
+    size_t end;
+
+    assert(offset <= src->size && bytes <= src->size - offset);
+
+    if (!bytes) {
+        qemu_iovec_init(qiov, 0);
+        return;
+    }
+
+    for (first = 0; offset >= src->iov[first].iov_len; first++) {
+        offset -= src->iov[first].iov_len;
+    }
+    end = offset + bytes;
+    for (last = first; end > src->iov[last].iov_len; last++) {
+        end -= src->iov[last].iov_len;
+    }
+
+    if (offset == 0 && end == src->iov[last].iov_len) {
+        qiov->iov = &src->iov[first];
+        qiov->niov = last - first + 1;
+        qiov->nalloc = -1;
+        qiov->size = bytes;
+        return;
+    }
+
+    qemu_iovec_init(qiov, last - first + 1);
+    qemu_iovec_concat_iov(qiov, &src->iov[first], last - first + 1,
+                          offset, bytes);
+}
+
 /*
  * Concatenates (partial) iovecs from src_iov to the end of dst.
  * It starts copying after skipping `soffset' bytes at the
@@ -376,10 +432,11 @@ bool qemu_iovec_is_zero(QEMUIOVector *qiov)
 
 void qemu_iovec_destroy(QEMUIOVector *qiov)
 {
-    assert(qiov->nalloc != -1);
-
-    qemu_iovec_reset(qiov);
-    g_free(qiov->iov);
+    if (qiov->nalloc != -1 && qiov->iov != qiov->local_iov) {
+        g_free(qiov->iov);
+    }
+    qiov->niov = 0;
+    qiov->size = 0;
     qiov->nalloc = 0;
     qiov->iov = NULL;
 }
@@ -269,6 +269,9 @@ const QEMULogItem qemu_log_items[] = {
       "non-existent register)" },
     { CPU_LOG_PAGE, "page",
       "dump pages at beginning of user mode emulation" },
+    { CPU_LOG_JIT, "jit",
+      "show translation statistics at the end of user mode emulation\n"
+      "(most of them need --enable-profiler)" },
     { CPU_LOG_TB_NOCHAIN, "nochain",
       "do not chain compiled TBs so that \"exec\" and \"cpu\" show\n"
       "complete traces" },
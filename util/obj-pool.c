@@ -0,0 +1,138 @@
+/*
+ * Pools of fixed-size objects
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/notify.h"
+#include "qemu/thread.h"
+#include "qemu/obj-pool.h"
+
+/* Pools beyond this number still work, but without per-thread caching */
+#define OBJ_POOL_MAX 16
+
+struct ObjPoolHeader {
+    ObjPool *pool;                      /* NULL if not allocated from a pool */
+    QSLIST_ENTRY(ObjPoolHeader) next;
+};
+
+/* Keep the objects as aligned as g_malloc would */
+#define OBJ_POOL_HDR_SIZE ROUND_UP(sizeof(ObjPoolHeader), 16)
+
+typedef struct ObjPoolCache {
+    QSLIST_HEAD(, ObjPoolHeader) alloc;
+    unsigned int size;
+} ObjPoolCache;
+
+static int obj_pool_next_id;
+static __thread ObjPoolCache obj_pool_cache[OBJ_POOL_MAX];
+static __thread Notifier obj_pool_cleanup_notifier;
+
+static void obj_pool_cleanup(Notifier *n, void *value)
+{
+    ObjPoolHeader *hdr, *tmp;
+    int i;
+
+    for (i = 0; i < OBJ_POOL_MAX; i++) {
+        QSLIST_FOREACH_SAFE(hdr, &obj_pool_cache[i].alloc, next, tmp) {
+            g_free(hdr);
+        }
+        QSLIST_INIT(&obj_pool_cache[i].alloc);
+        obj_pool_cache[i].size = 0;
+    }
+}
+
+static void obj_pool_register_cleanup(void)
+{
+    if (!obj_pool_cleanup_notifier.notify) {
+        obj_pool_cleanup_notifier.notify = obj_pool_cleanup;
+        qemu_thread_atexit_add(&obj_pool_cleanup_notifier);
+    }
+}
+
+/* Return the calling thread's free list for @pool, or NULL if it has none */
+static ObjPoolCache *obj_pool_get_cache(ObjPool *pool)
+{
+    int id = atomic_read(&pool->id);
+
+    if (!id) {
+        /* Ids start at 1 so that 0 means "not assigned yet".  A thread that
+         * loses the race throws its id away, which is harmless.
+         */
+        int new_id = atomic_fetch_inc(&obj_pool_next_id) + 1;
+        id = atomic_cmpxchg(&pool->id, 0, new_id) ?: new_id;
+    }
+    return id <= OBJ_POOL_MAX ? &obj_pool_cache[id - 1] : NULL;
+}
+
+void *obj_pool_alloc(ObjPool *pool, size_t size)
+{
+    ObjPoolHeader *hdr = NULL;
+    ObjPoolCache *cache;
+
+    if (size > pool->size) {
+        hdr = g_malloc(OBJ_POOL_HDR_SIZE + size);
+        hdr->pool = NULL;
+        return (char *)hdr + OBJ_POOL_HDR_SIZE;
+    }
+
+    cache = obj_pool_get_cache(pool);
+    if (cache) {
+        hdr = QSLIST_FIRST(&cache->alloc);
+        if (!hdr && atomic_read(&pool->release_size) > pool->batch) {
+            /* Slow path; a good place to register the destructor, too.  As
+             * in the coroutine pool, release_size is only a heuristic.
+             */
+            obj_pool_register_cleanup();
+            cache->size = atomic_xchg(&pool->release_size, 0);
+            QSLIST_MOVE_ATOMIC(&cache->alloc, &pool->release);
+            hdr = QSLIST_FIRST(&cache->alloc);
+        }
+        if (hdr) {
+            QSLIST_REMOVE_HEAD(&cache->alloc, next);
+            cache->size--;
+        }
+    }
+
+    if (!hdr) {
+        hdr = g_malloc(OBJ_POOL_HDR_SIZE + pool->size);
+    }
+    hdr->pool = pool;
+    return (char *)hdr + OBJ_POOL_HDR_SIZE;
+}
+
+void obj_pool_free(void *obj)
+{
+    ObjPoolHeader *hdr;
+    ObjPoolCache *cache;
+    ObjPool *pool;
+
+    if (!obj) {
+        return;
+    }
+
+    hdr = (ObjPoolHeader *)((char *)obj - OBJ_POOL_HDR_SIZE);
+    pool = hdr->pool;
+    if (pool) {
+        if (atomic_read(&pool->release_size) < pool->batch * 2) {
+            QSLIST_INSERT_HEAD_ATOMIC(&pool->release, hdr, next);
+            atomic_inc(&pool->release_size);
+            return;
+        }
+        cache = obj_pool_get_cache(pool);
+        if (cache && cache->size < pool->batch) {
+            obj_pool_register_cleanup();
+            QSLIST_INSERT_HEAD(&cache->alloc, hdr, next);
+            cache->size++;
+            return;
+        }
+    }
+
+    g_free(hdr);
+}
@@ -39,6 +39,7 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -316,18 +317,118 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+#define MAX_MEM_PREALLOC_THREAD_COUNT 16
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    bool populate;
+    QemuThread pgthread;
+    sigjmp_buf env;
+} MemsetThread;
+
+static MemsetThread *memset_thread;
+static int memset_num_threads;
+static bool memset_thread_failed;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    int i;
+
+    if (memset_thread) {
+        for (i = 0; i < memset_num_threads; i++) {
+            if (qemu_thread_is_self(&memset_thread[i].pgthread)) {
+                siglongjmp(memset_thread[i].env, 1);
+            }
+        }
+    }
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *memset_args = arg;
+    char *addr = memset_args->addr;
+    sigset_t set, oldset;
+    size_t i;
+
+    /* unblock SIGBUS */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    if (sigsetjmp(memset_args->env, 1)) {
+        memset_thread_failed = true;
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < memset_args->numpages; i++) {
+            if (memset_args->populate) {
+                /* Write fault without racing with other writers */
+                atomic_fetch_add((unsigned char *)addr, 0);
+            } else {
+                memset(addr, 0, 1);
+            }
+            addr += memset_args->hpagesize;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return NULL;
+}
+
+static int get_memset_num_threads(size_t numpages, int max_threads)
+{
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = 1;
+
+    if (max_threads > 0) {
+        ret = max_threads;
+    } else if (host_procs > 0) {
+        ret = MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT);
+    }
+    /* every thread gets at least one page */
+    return MAX(1, MIN(ret, numpages));
+}
+
+/* Returns true if touching some page failed */
+static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
+                            int max_threads, bool populate)
+{
+    size_t numpages_per_thread;
+    char *addr = area;
+    int i;
+
+    memset_thread_failed = false;
+    memset_num_threads = get_memset_num_threads(numpages, max_threads);
+    memset_thread = g_new0(MemsetThread, memset_num_threads);
+    numpages_per_thread = numpages / memset_num_threads;
+    for (i = 0; i < memset_num_threads; i++) {
+        memset_thread[i].addr = addr;
+        memset_thread[i].numpages = (i == memset_num_threads - 1) ?
+                                    numpages : numpages_per_thread;
+        memset_thread[i].hpagesize = hpagesize;
+        memset_thread[i].populate = populate;
+        qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
+                           do_touch_pages, &memset_thread[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += numpages_per_thread * hpagesize;
+        numpages -= numpages_per_thread;
+    }
+    for (i = 0; i < memset_num_threads; i++) {
+        qemu_thread_join(&memset_thread[i].pgthread);
+    }
+    g_free(memset_thread);
+    memset_thread = NULL;
+
+    return memset_thread_failed;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+static void mem_touch(int fd, char *area, size_t memory, int max_threads,
+                      bool populate, Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -340,23 +441,10 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         return;
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-    if (sigsetjmp(sigjump, 1)) {
+    /* touch pages simultaneously */
+    if (touch_all_pages(area, hpagesize, numpages, max_threads, populate)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
-            "pages available to allocate guest RAM\n");
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
+            "pages available to allocate guest RAM");
     }
 
     ret = sigaction(SIGBUS, &oldact, NULL);
@@ -365,7 +453,18 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         perror("os_mem_prealloc: failed to reinstall signal handler");
         exit(1);
     }
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
+{
+    mem_touch(fd, area, memory, max_threads, false, errp);
+}
+
+void os_mem_populate(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
+{
+    mem_touch(fd, area, memory, max_threads, true, errp);
 }
 
 
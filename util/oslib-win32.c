@@ -37,6 +37,7 @@
 #include "trace.h"
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
+#include "qemu/atomic.h"
 
 /* this must come after including "trace.h" */
 #include <shlobj.h>
@@ -539,7 +540,8 @@ int getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
 {
     int i;
     size_t pagesize = getpagesize();
@@ -550,6 +552,18 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
     }
 }
 
+void os_mem_populate(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
+{
+    int i;
+    size_t pagesize = getpagesize();
+
+    memory = (memory + pagesize - 1) & -pagesize;
+    for (i = 0; i < memory / pagesize; i++) {
+        atomic_fetch_add((unsigned char *)area + pagesize * i, 0);
+    }
+}
+
 
 /* XXX: put correct support for win32 */
 int qemu_read_password(char *buf, int buf_size)
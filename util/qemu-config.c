@@ -167,6 +167,10 @@ static QemuOptsList machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        },{
+            .name = "kvm-dirty-ring-size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "entries of the per-vCPU KVM dirty ring",
         },{
             .name = "kernel",
             .type = QEMU_OPT_STRING,
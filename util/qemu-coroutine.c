@@ -22,6 +22,7 @@
 
 enum {
     POOL_BATCH_SIZE = 64,
+    POOL_MAX_SIZE = 1024,
 };
 
 /** Free list to speed up creation */
@@ -29,6 +30,10 @@ static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int release_pool_size;
 static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(pool);
 static __thread unsigned int alloc_pool_size;
+/* Grows by one on every miss, so that it follows the thread's demand */
+static __thread unsigned int alloc_pool_max = POOL_BATCH_SIZE;
+static __thread uint64_t alloc_pool_hits;
+static __thread uint64_t alloc_pool_misses;
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
 static void coroutine_pool_cleanup(Notifier *n, void *value)
@@ -42,6 +47,14 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
     }
 }
 
+static void coroutine_pool_register_cleanup(void)
+{
+    if (!coroutine_pool_cleanup_notifier.notify) {
+        coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+    }
+}
+
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 {
     Coroutine *co = NULL;
@@ -51,10 +64,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         if (!co) {
             if (release_pool_size > POOL_BATCH_SIZE) {
                 /* Slow path; a good place to register the destructor, too.  */
-                if (!coroutine_pool_cleanup_notifier.notify) {
-                    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
-                }
+                coroutine_pool_register_cleanup();
 
                 /* This is not exact; there could be a little skew between
                  * release_pool_size and the actual size of release_pool.  But
@@ -68,6 +78,14 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         if (co) {
             QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
             alloc_pool_size--;
+            alloc_pool_hits++;
+        } else {
+            alloc_pool_misses++;
+            if (alloc_pool_max < POOL_MAX_SIZE) {
+                alloc_pool_max++;
+            }
+            trace_qemu_coroutine_pool_miss(alloc_pool_max, alloc_pool_hits,
+                                           alloc_pool_misses);
         }
     }
 
@@ -77,6 +95,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 
     co->entry = entry;
     co->entry_arg = opaque;
+    co->io_trace = NULL;
     QSIMPLEQ_INIT(&co->co_queue_wakeup);
     return co;
 }
@@ -86,16 +105,20 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
+        /* Keep the thread's own pool filled first, so that busy threads do
+         * not go through the shared release_pool on every request.
+         */
+        if (alloc_pool_size < alloc_pool_max) {
+            coroutine_pool_register_cleanup();
+            QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
+            alloc_pool_size++;
+            return;
+        }
         if (release_pool_size < POOL_BATCH_SIZE * 2) {
             QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
             atomic_inc(&release_pool_size);
             return;
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
-            QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
-            alloc_pool_size++;
-            return;
-        }
     }
 
     qemu_coroutine_delete(co);
@@ -151,3 +174,13 @@ bool qemu_coroutine_entered(Coroutine *co)
 {
     return co->caller;
 }
+
+IOTrace *qemu_coroutine_get_io_trace(Coroutine *co)
+{
+    return co->io_trace;
+}
+
+void qemu_coroutine_set_io_trace(Coroutine *co, IOTrace *trace)
+{
+    co->io_trace = trace;
+}
@@ -18,6 +18,7 @@
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/cutils.h"
 
 static bool name_threads;
 
@@ -491,6 +492,52 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+#ifdef CONFIG_LINUX
+static bool qemu_parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+    unsigned long first, last;
+
+    CPU_ZERO(set);
+    while (*p) {
+        if (qemu_strtoul(p, &p, 10, &first)) {
+            return false;
+        }
+        last = first;
+        if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last)) {
+            return false;
+        }
+        if (first > last || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return false;
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+int qemu_thread_set_affinity(QemuThread *thread, const char *cpus)
+{
+    cpu_set_t set;
+
+    if (!qemu_parse_cpu_list(cpus, &set)) {
+        return -EINVAL;
+    }
+    return -pthread_setaffinity_np(thread->thread, sizeof(set), &set);
+}
+#else
+int qemu_thread_set_affinity(QemuThread *thread, const char *cpus)
+{
+    return -ENOTSUP;
+}
+#endif
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
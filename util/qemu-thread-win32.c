@@ -476,3 +476,8 @@ bool qemu_thread_is_self(QemuThread *thread)
 {
     return GetCurrentThreadId() == thread->tid;
 }
+
+int qemu_thread_set_affinity(QemuThread *thread, const char *cpus)
+{
+    return -ENOTSUP;
+}
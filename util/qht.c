@@ -22,8 +22,8 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold. Resizing is done concurrently with readers and
+ *   writers; only writes to the bucket being moved wait for the move.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,14 +43,19 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Resizing is incremental. A resize allocates a new map and points
+ * map->new_map to it; head buckets are then moved in order, a batch at a
+ * time, by whichever writer gets ht->lock first (auto-resize), or all at
+ * once by qht_resize().  Moving a bucket takes only that bucket's lock (plus,
+ * briefly, the locks of the new buckets the entries go to) and bumps
+ * map->n_moved inside the bucket's seqlock write section.  When all buckets
+ * have been moved, ht->map is set to the new map, and the old map is freed
+ * once no RCU readers can see it anymore.
  *
- * Writers check for concurrent resizes by comparing ht->map before and after
- * acquiring their bucket lock. If they don't match, a resize has occured
- * while the bucket spinlock was being acquired.
+ * Readers and writers hash into ht->map as usual; if the bucket index is
+ * below map->n_moved, the bucket has moved and they follow map->new_map.
+ * A bucket of a map that is no longer ht->map has always been moved, so this
+ * is also how writers detect that they raced with the end of a resize.
  *
  * Related Work:
  * - Idea of cacheline-sized buckets with full hashes taken from:
@@ -119,6 +124,11 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @new_map: map that buckets are being moved to during a resize, or NULL.
+ *           Set before @n_moved first changes, and constant afterwards.
+ * @n_moved: number of head buckets, from the start of @buckets, that have
+ *           been moved to @new_map. Only grows, under ht->lock and the
+ *           bucket's lock and seqlock.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -128,13 +138,16 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    struct qht_map *new_map;
+    size_t n_moved;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
-static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
-                                bool reset);
+/* number of head buckets moved by each step of an incremental resize */
+#define QHT_RESIZE_BATCH 64
+
 static void qht_grow_maybe(struct qht *ht);
 
 #ifdef QHT_DEBUG
@@ -201,6 +214,15 @@ struct qht_bucket *qht_map_to_bucket(struct qht_map *map, uint32_t hash)
     return &map->buckets[hash & (map->n_buckets - 1)];
 }
 
+/*
+ * Whether the head bucket for @hash has been moved to map->new_map. Once
+ * true, it stays true for the lifetime of @map.
+ */
+static inline bool qht_map_bucket_moved(struct qht_map *map, uint32_t hash)
+{
+    return (hash & (map->n_buckets - 1)) < atomic_read(&map->n_moved);
+}
+
 /* acquire all bucket locks from a map */
 static void qht_map_lock_buckets(struct qht_map *map)
 {
@@ -224,51 +246,35 @@ static void qht_map_unlock_buckets(struct qht_map *map)
     }
 }
 
-/*
- * Call with at least a bucket lock held.
- * @map should be the value read before acquiring the lock (or locks).
- */
-static inline bool qht_map_is_stale__locked(struct qht *ht, struct qht_map *map)
-{
-    return map != ht->map;
-}
+static void qht_resize_finish__locked(struct qht *ht);
 
 /*
- * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
+ * Grab all bucket locks of ht->map, after completing any ongoing resize so
+ * that all entries are in that map. @pmap is set to the locked map.
  *
  * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
  *
  * Note: callers cannot have ht->lock held.
  */
 static inline
-void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
+void qht_map_lock_buckets__no_resize(struct qht *ht, struct qht_map **pmap)
 {
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
-    }
-    qht_map_unlock_buckets(map);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
+    /* no resize can start without ht->lock, nor move a locked bucket */
     qemu_mutex_lock(&ht->lock);
+    qht_resize_finish__locked(ht);
     map = ht->map;
     qht_map_lock_buckets(map);
     qemu_mutex_unlock(&ht->lock);
     *pmap = map;
-    return;
 }
 
 /*
- * Get a head bucket and lock it, making sure its parent map is not stale.
- * @pmap is filled with a pointer to the bucket's parent map.
+ * Get a head bucket and lock it, following it to the new map if it has been
+ * moved by a resize. @pmap is filled with a pointer to the bucket's parent map.
  *
  * Unlock with qemu_spin_unlock(&b->lock).
- *
- * Note: callers cannot have ht->lock held.
  */
 static inline
 struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
@@ -281,18 +287,12 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
     b = qht_map_to_bucket(map, hash);
 
     qemu_spin_lock(&b->lock);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return b;
+    while (unlikely(qht_map_bucket_moved(map, hash))) {
+        qemu_spin_unlock(&b->lock);
+        map = atomic_rcu_read(&map->new_map);
+        b = qht_map_to_bucket(map, hash);
+        qemu_spin_lock(&b->lock);
     }
-    qemu_spin_unlock(&b->lock);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qemu_mutex_lock(&ht->lock);
-    map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qemu_spin_lock(&b->lock);
-    qemu_mutex_unlock(&ht->lock);
     *pmap = map;
     return b;
 }
@@ -333,6 +333,8 @@ static struct qht_map *qht_map_create(size_t n_buckets)
 
     map = g_malloc(sizeof(*map));
     map->n_buckets = n_buckets;
+    map->new_map = NULL;
+    map->n_moved = 0;
 
     map->n_added_buckets = 0;
     map->n_added_buckets_threshold = n_buckets /
@@ -365,6 +367,9 @@ void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->map->new_map) {
+        qht_map_destroy(ht->map->new_map);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -404,38 +409,37 @@ void qht_reset(struct qht *ht)
 {
     struct qht_map *map;
 
-    qht_map_lock_buckets__no_stale(ht, &map);
+    qht_map_lock_buckets__no_resize(ht, &map);
     qht_map_reset__all_locked(map);
     qht_map_unlock_buckets(map);
 }
 
-static inline void qht_do_resize(struct qht *ht, struct qht_map *new)
-{
-    qht_do_resize_reset(ht, new, false);
-}
-
-static inline void qht_do_resize_and_reset(struct qht *ht, struct qht_map *new)
-{
-    qht_do_resize_reset(ht, new, true);
-}
+static void qht_resize_start__locked(struct qht *ht, size_t n_buckets);
 
 bool qht_reset_size(struct qht *ht, size_t n_elems)
 {
-    struct qht_map *new = NULL;
     struct qht_map *map;
     size_t n_buckets;
+    bool resize;
 
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qemu_mutex_lock(&ht->lock);
+    qht_resize_finish__locked(ht);
     map = ht->map;
-    if (n_buckets != map->n_buckets) {
-        new = qht_map_create(n_buckets);
+    qht_map_lock_buckets(map);
+    qht_map_reset__all_locked(map);
+    qht_map_unlock_buckets(map);
+
+    /* moving the (mostly) empty buckets is cheap */
+    resize = n_buckets != map->n_buckets;
+    if (resize) {
+        qht_resize_start__locked(ht, n_buckets);
+        qht_resize_finish__locked(ht);
     }
-    qht_do_resize_and_reset(ht, new);
     qemu_mutex_unlock(&ht->lock);
 
-    return !!new;
+    return resize;
 }
 
 static inline
@@ -466,17 +470,25 @@ void *qht_do_lookup(struct qht_bucket *head, qht_lookup_func_t func,
 }
 
 static __attribute__((noinline))
-void *qht_lookup__slowpath(struct qht_bucket *b, qht_lookup_func_t func,
+void *qht_lookup__slowpath(struct qht_map *map, qht_lookup_func_t func,
                            const void *userp, uint32_t hash)
 {
+    struct qht_bucket *b;
     unsigned int version;
     void *ret;
 
-    do {
+    for (;;) {
+        b = qht_map_to_bucket(map, hash);
         version = seqlock_read_begin(&b->sequence);
+        if (qht_map_bucket_moved(map, hash)) {
+            map = atomic_rcu_read(&map->new_map);
+            continue;
+        }
         ret = qht_do_lookup(b, func, userp, hash);
-    } while (seqlock_read_retry(&b->sequence, version));
-    return ret;
+        if (!seqlock_read_retry(&b->sequence, version)) {
+            return ret;
+        }
+    }
 }
 
 void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
@@ -491,6 +503,10 @@ void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
+    /* only true while a resize is moving buckets */
+    if (unlikely(qht_map_bucket_moved(map, hash))) {
+        return qht_lookup__slowpath(map, func, userp, hash);
+    }
     ret = qht_do_lookup(b, func, userp, hash);
     if (likely(!seqlock_read_retry(&b->sequence, version))) {
         return ret;
@@ -499,7 +515,7 @@ void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
      * Removing the do/while from the fastpath gives a 4% perf. increase when
      * running a 100%-lookup microbenchmark.
      */
-    return qht_lookup__slowpath(b, func, userp, hash);
+    return qht_lookup__slowpath(map, func, userp, hash);
 }
 
 /* call with head->lock held */
@@ -548,27 +564,116 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
     return true;
 }
 
+/*
+ * Move head bucket @i of @map, which must be ht->map, to map->new_map.
+ * Call with ht->lock held.
+ */
+static void qht_bucket_move__htlocked(struct qht *ht, struct qht_map *map,
+                                      size_t i)
+{
+    struct qht_bucket *head = &map->buckets[i];
+    struct qht_bucket *b = head;
+    struct qht_map *new = map->new_map;
+    int j;
+
+    qemu_spin_lock(&head->lock);
+    seqlock_write_begin(&head->sequence);
+    do {
+        for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+            struct qht_bucket *nb;
+
+            if (b->pointers[j] == NULL) {
+                goto done;
+            }
+            /*
+             * Writers that see the new bucket do not hold any lock of the
+             * old map, so locking in this order cannot deadlock.
+             */
+            nb = qht_map_to_bucket(new, b->hashes[j]);
+            qemu_spin_lock(&nb->lock);
+            qht_insert__locked(ht, new, nb, b->pointers[j], b->hashes[j],
+                               NULL);
+            qemu_spin_unlock(&nb->lock);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    /* the entries stay in the old bucket; nobody will look there anymore */
+    atomic_set(&map->n_moved, i + 1);
+    seqlock_write_end(&head->sequence);
+    qemu_spin_unlock(&head->lock);
+}
+
+/* Call with ht->lock held and no resize in progress. */
+static void qht_resize_start__locked(struct qht *ht, size_t n_buckets)
+{
+    struct qht_map *map = ht->map;
+
+    g_assert(map->new_map == NULL);
+    g_assert_cmpuint(n_buckets, !=, map->n_buckets);
+    atomic_rcu_set(&map->new_map, qht_map_create(n_buckets));
+}
+
+/*
+ * Move up to @n head buckets of an ongoing resize, and switch ht->map to the
+ * new map once they are all moved.
+ * Call with ht->lock held.
+ */
+static void qht_resize_step__locked(struct qht *ht, size_t n)
+{
+    struct qht_map *map = ht->map;
+    size_t i;
+
+    if (map->new_map == NULL) {
+        return;
+    }
+    for (i = 0; i < n && map->n_moved < map->n_buckets; i++) {
+        qht_bucket_move__htlocked(ht, map, map->n_moved);
+    }
+    if (map->n_moved < map->n_buckets) {
+        return;
+    }
+
+    atomic_rcu_set(&ht->map, map->new_map);
+    call_rcu(map, qht_map_destroy, rcu);
+}
+
+static void qht_resize_finish__locked(struct qht *ht)
+{
+    qht_resize_step__locked(ht, SIZE_MAX);
+}
+
 static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
 {
     struct qht_map *map;
 
     /*
-     * If the lock is taken it probably means there's an ongoing resize,
-     * so bail out.
+     * If the lock is taken it probably means someone else is moving buckets,
+     * so bail out; we will help with a later write.
      */
     if (qemu_mutex_trylock(&ht->lock)) {
         return;
     }
     map = ht->map;
     /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
-        struct qht_map *new = qht_map_create(map->n_buckets * 2);
-
-        qht_do_resize(ht, new);
+    if (map->new_map == NULL && qht_map_needs_resize(map)) {
+        qht_resize_start__locked(ht, map->n_buckets * 2);
     }
+    qht_resize_step__locked(ht, QHT_RESIZE_BATCH);
     qemu_mutex_unlock(&ht->lock);
 }
 
+/* Called after a write; helps moving buckets if a resize is in progress. */
+static inline void qht_write_done(struct qht *ht, bool needs_resize)
+{
+    struct qht_map *map = atomic_rcu_read(&ht->map);
+
+    if (unlikely(atomic_read(&map->new_map)) ||
+        (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE)) {
+        qht_grow_maybe(ht);
+    }
+}
+
 bool qht_insert(struct qht *ht, void *p, uint32_t hash)
 {
     struct qht_bucket *b;
@@ -584,9 +689,7 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash)
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
 
-    if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
-        qht_grow_maybe(ht);
-    }
+    qht_write_done(ht, needs_resize);
     return ret;
 }
 
@@ -689,6 +792,8 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
     ret = qht_remove__locked(map, b, p, hash);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
+
+    qht_write_done(ht, false);
     return ret;
 }
 
@@ -723,62 +828,22 @@ void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
 {
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
+    qht_map_lock_buckets__no_resize(ht, &map);
     /* Note: ht here is merely for carrying ht->mode; ht->map won't be read */
     qht_map_iter__all_locked(ht, map, func, userp);
     qht_map_unlock_buckets(map);
 }
 
-static void qht_map_copy(struct qht *ht, void *p, uint32_t hash, void *userp)
-{
-    struct qht_map *new = userp;
-    struct qht_bucket *b = qht_map_to_bucket(new, hash);
-
-    /* no need to acquire b->lock because no thread has seen this map yet */
-    qht_insert__locked(ht, new, b, p, hash, NULL);
-}
-
-/*
- * Atomically perform a resize and/or reset.
- * Call with ht->lock held.
- */
-static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
-{
-    struct qht_map *old;
-
-    old = ht->map;
-    qht_map_lock_buckets(old);
-
-    if (reset) {
-        qht_map_reset__all_locked(old);
-    }
-
-    if (new == NULL) {
-        qht_map_unlock_buckets(old);
-        return;
-    }
-
-    g_assert_cmpuint(new->n_buckets, !=, old->n_buckets);
-    qht_map_iter__all_locked(ht, old, qht_map_copy, new);
-    qht_map_debug__all_locked(new);
-
-    atomic_rcu_set(&ht->map, new);
-    qht_map_unlock_buckets(old);
-    call_rcu(old, qht_map_destroy, rcu);
-}
-
 bool qht_resize(struct qht *ht, size_t n_elems)
 {
     size_t n_buckets = qht_elems_to_buckets(n_elems);
     size_t ret = false;
 
     qemu_mutex_lock(&ht->lock);
+    qht_resize_finish__locked(ht);
     if (n_buckets != ht->map->n_buckets) {
-        struct qht_map *new;
-
-        new = qht_map_create(n_buckets);
-        qht_do_resize(ht, new);
+        qht_resize_start__locked(ht, n_buckets);
+        qht_resize_finish__locked(ht);
         ret = true;
     }
     qemu_mutex_unlock(&ht->lock);
@@ -803,6 +868,11 @@ void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
         stats->head_buckets = 0;
         return;
     }
+
+    /* look at a single map; ht->lock also keeps it from being freed */
+    qemu_mutex_lock(&ht->lock);
+    qht_resize_finish__locked(ht);
+    map = ht->map;
     stats->head_buckets = map->n_buckets;
 
     for (i = 0; i < map->n_buckets; i++) {
@@ -840,6 +910,7 @@ void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
             qdist_inc(&stats->occupancy, 0);
         }
     }
+    qemu_mutex_unlock(&ht->lock);
 }
 
 void qht_statistics_destroy(struct qht_stats *stats)
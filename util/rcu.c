@@ -67,11 +67,18 @@ __thread struct rcu_reader_data rcu_reader;
 typedef QLIST_HEAD(, rcu_reader_data) ThreadList;
 static ThreadList registry = QLIST_HEAD_INITIALIZER(registry);
 
+/* Number of times an expedited grace period polls the readers before it
+ * goes to sleep.  Most read-side critical sections are short, so this
+ * usually avoids the futex round trip to the last reader.
+ */
+#define RCU_EXPEDITED_SPINS     1000
+
 /* Wait for previous parity/grace period to be empty of readers.  */
-static void wait_for_readers(void)
+static void wait_for_readers(bool expedited)
 {
     ThreadList qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
     struct rcu_reader_data *index, *tmp;
+    int spins = 0;
 
     for (;;) {
         /* We want to be notified of changes made to rcu_gp_ongoing
@@ -129,7 +136,11 @@ static void wait_for_readers(void)
          * rcu_registry_lock is released.
          */
         qemu_mutex_unlock(&rcu_registry_lock);
-        qemu_event_wait(&rcu_gp_event);
+        if (expedited && spins++ < RCU_EXPEDITED_SPINS) {
+            cpu_relax();
+        } else {
+            qemu_event_wait(&rcu_gp_event);
+        }
         qemu_mutex_lock(&rcu_registry_lock);
     }
 
@@ -137,7 +148,7 @@ static void wait_for_readers(void)
     QLIST_SWAP(&registry, &qsreaders, node);
 }
 
-void synchronize_rcu(void)
+static void synchronize_rcu_common(bool expedited)
 {
     qemu_mutex_lock(&rcu_sync_lock);
     qemu_mutex_lock(&rcu_registry_lock);
@@ -153,124 +164,144 @@ void synchronize_rcu(void)
              * Switch parity: 0 -> 1, 1 -> 0.
              */
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
-            wait_for_readers();
+            wait_for_readers(expedited);
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
         } else {
             /* Increment current grace period.  */
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
         }
 
-        wait_for_readers();
+        wait_for_readers(expedited);
     }
 
     qemu_mutex_unlock(&rcu_registry_lock);
     qemu_mutex_unlock(&rcu_sync_lock);
 }
 
+void synchronize_rcu(void)
+{
+    synchronize_rcu_common(false);
+}
+
+void synchronize_rcu_expedited(void)
+{
+    synchronize_rcu_common(true);
+}
+
 
 #define RCU_CALL_MIN_SIZE        30
 
-/* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
- * from liburcu.  Note that head is only used by the consumer.
+/* Callbacks are pushed on a per-thread LIFO list, rcu_reader.cbs, which the
+ * call_rcu thread steals as a whole; a thread thus never touches a cache
+ * line written by other threads when it queues a callback.  Threads that
+ * are not registered use rcu_global_cbs instead.  rcu_call_count counts the
+ * callbacks queued and not yet stolen; it is incremented before the push,
+ * so that it never underestimates the length of the lists.
  */
-static struct rcu_head dummy;
-static struct rcu_head *head = &dummy, **tail = &dummy.next;
+static struct rcu_head *rcu_global_cbs;
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
 
-static void enqueue(struct rcu_head *node)
+/* Requests from drain_call_rcu() to skip the batching delay */
+static int rcu_call_expedited;
+static QemuSemaphore rcu_call_expedite_sem;
+
+static void rcu_cbs_push(struct rcu_head **list, struct rcu_head *first,
+                         struct rcu_head *last)
 {
-    struct rcu_head **old_tail;
+    struct rcu_head *old;
 
-    node->next = NULL;
-    old_tail = atomic_xchg(&tail, &node->next);
-    atomic_mb_set(old_tail, node);
+    do {
+        old = atomic_read(list);
+        last->next = old;
+    } while (atomic_cmpxchg(list, old, first) != old);
 }
 
-static struct rcu_head *try_dequeue(void)
+/* Steal @list and append its callbacks, oldest first, to @tail.  */
+static int rcu_cbs_steal(struct rcu_head **list, struct rcu_head ***tail)
 {
-    struct rcu_head *node, *next;
+    struct rcu_head *node, *next, *fifo = NULL, *last;
+    int n = 0;
 
-retry:
-    /* Test for an empty list, which we do not expect.  Note that for
-     * the consumer head and tail are always consistent.  The head
-     * is consistent because only the consumer reads/writes it.
-     * The tail, because it is the first step in the enqueuing.
-     * It is only the next pointers that might be inconsistent.
-     */
-    if (head == &dummy && atomic_mb_read(&tail) == &dummy.next) {
-        abort();
+    node = atomic_xchg(list, NULL);
+    if (!node) {
+        return 0;
     }
 
-    /* If the head node has NULL in its next pointer, the value is
-     * wrong and we need to wait until its enqueuer finishes the update.
-     */
-    node = head;
-    next = atomic_mb_read(&head->next);
-    if (!next) {
-        return NULL;
-    }
+    last = node;
+    do {
+        next = node->next;
+        node->next = fifo;
+        fifo = node;
+        node = next;
+        n++;
+    } while (node);
+
+    **tail = fifo;
+    *tail = &last->next;
+    return n;
+}
 
-    /* Since we are the sole consumer, and we excluded the empty case
-     * above, the queue will always have at least two nodes: the
-     * dummy node, and the one being removed.  So we do not need to update
-     * the tail pointer.
-     */
-    head = next;
+static struct rcu_head *rcu_steal_callbacks(int *n)
+{
+    struct rcu_reader_data *index;
+    struct rcu_head *head = NULL, **tail = &head;
 
-    /* If we dequeued the dummy node, add it back at the end and retry.  */
-    if (node == &dummy) {
-        enqueue(node);
-        goto retry;
+    *n = 0;
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_FOREACH(index, &registry, node) {
+        *n += rcu_cbs_steal(&index->cbs, &tail);
     }
-
-    return node;
+    qemu_mutex_unlock(&rcu_registry_lock);
+    *n += rcu_cbs_steal(&rcu_global_cbs, &tail);
+    return head;
 }
 
 static void *call_rcu_thread(void *opaque)
 {
-    struct rcu_head *node;
+    struct rcu_head *node, *next;
 
     rcu_register_thread();
 
     for (;;) {
         int tries = 0;
         int n = atomic_read(&rcu_call_count);
+        bool expedited;
 
-        /* Heuristically wait for a decent number of callbacks to pile up.
-         * Fetch rcu_call_count now, we only must process elements that were
-         * added before synchronize_rcu() starts.
+        /* Heuristically wait for a decent number of callbacks to pile up,
+         * unless drain_call_rcu() is waiting.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
-            g_usleep(10000);
+        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5 &&
+                          !atomic_read(&rcu_call_expedited))) {
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
                 n = atomic_read(&rcu_call_count);
                 if (n == 0) {
                     qemu_event_wait(&rcu_call_ready_event);
                 }
+            } else {
+                qemu_sem_timedwait(&rcu_call_expedite_sem, 10);
             }
             n = atomic_read(&rcu_call_count);
         }
 
+        /* Only callbacks that were queued before synchronize_rcu() starts
+         * can be run after it; the whole batch shares one grace period.
+         */
+        node = rcu_steal_callbacks(&n);
         atomic_sub(&rcu_call_count, n);
-        synchronize_rcu();
-        qemu_mutex_lock_iothread();
-        while (n > 0) {
-            node = try_dequeue();
-            while (!node) {
-                qemu_mutex_unlock_iothread();
-                qemu_event_reset(&rcu_call_ready_event);
-                node = try_dequeue();
-                if (!node) {
-                    qemu_event_wait(&rcu_call_ready_event);
-                    node = try_dequeue();
-                }
-                qemu_mutex_lock_iothread();
-            }
+        expedited = atomic_read(&rcu_call_expedited);
+        if (expedited) {
+            synchronize_rcu_expedited();
+        } else {
+            synchronize_rcu();
+        }
 
-            n--;
+        qemu_mutex_lock_iothread();
+        while (node) {
+            next = node->next;
             node->func(node);
+            node = next;
         }
         qemu_mutex_unlock_iothread();
     }
@@ -280,23 +311,74 @@ static void *call_rcu_thread(void *opaque)
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
     node->func = func;
-    enqueue(node);
     atomic_inc(&rcu_call_count);
+    if (rcu_reader.registered) {
+        rcu_cbs_push(&rcu_reader.cbs, node, node);
+    } else {
+        rcu_cbs_push(&rcu_global_cbs, node, node);
+    }
     qemu_event_set(&rcu_call_ready_event);
 }
 
+struct rcu_drain {
+    struct rcu_head rcu;
+    QemuEvent drain_complete_event;
+    bool requeued;
+};
+
+static void drain_rcu_callback(struct rcu_head *node)
+{
+    struct rcu_drain *drain = container_of(node, struct rcu_drain, rcu);
+
+    /* Callbacks queued by other threads before drain_call_rcu() may have
+     * missed the batch that stole ours, but not the next one.
+     */
+    if (!drain->requeued) {
+        drain->requeued = true;
+        call_rcu1(&drain->rcu, drain_rcu_callback);
+        return;
+    }
+    qemu_event_set(&drain->drain_complete_event);
+}
+
+void drain_call_rcu(void)
+{
+    struct rcu_drain drain = { .requeued = false };
+
+    qemu_event_init(&drain.drain_complete_event, false);
+    atomic_inc(&rcu_call_expedited);
+    call_rcu1(&drain.rcu, drain_rcu_callback);
+    qemu_sem_post(&rcu_call_expedite_sem);
+    qemu_event_wait(&drain.drain_complete_event);
+    atomic_dec(&rcu_call_expedited);
+    qemu_event_destroy(&drain.drain_complete_event);
+}
+
 void rcu_register_thread(void)
 {
     assert(rcu_reader.ctr == 0);
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
+    rcu_reader.registered = true;
     qemu_mutex_unlock(&rcu_registry_lock);
 }
 
 void rcu_unregister_thread(void)
 {
+    struct rcu_head *first, *last;
+
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_REMOVE(&rcu_reader, node);
+    rcu_reader.registered = false;
+
+    /* The call_rcu thread cannot see our list anymore, hand it over */
+    first = atomic_xchg(&rcu_reader.cbs, NULL);
+    if (first) {
+        for (last = first; last->next; last = last->next) {
+            /* nothing */
+        }
+        rcu_cbs_push(&rcu_global_cbs, first, last);
+    }
     qemu_mutex_unlock(&rcu_registry_lock);
 }
 
@@ -309,6 +391,7 @@ static void rcu_init_complete(void)
     qemu_event_init(&rcu_gp_event, true);
 
     qemu_event_init(&rcu_call_ready_event, false);
+    qemu_sem_init(&rcu_call_expedite_sem, 0);
 
     /* The caller is assumed to have iothread lock, so the call_rcu thread
      * must have been quiescent even after forking, just recreate it.
@@ -335,6 +418,20 @@ static void rcu_init_unlock(void)
 
 void rcu_after_fork(void)
 {
+    struct rcu_reader_data *index;
+    struct rcu_head *head = NULL, **tail = &head;
+
+    /* The other threads are gone, but their callbacks must still run */
+    QLIST_FOREACH(index, &registry, node) {
+        if (index != &rcu_reader) {
+            rcu_cbs_steal(&index->cbs, &tail);
+        }
+    }
+    if (head) {
+        rcu_cbs_push(&rcu_global_cbs, head,
+                     container_of(tail, struct rcu_head, next));
+    }
+
     memset(&registry, 0, sizeof(registry));
     rcu_init_complete();
 }
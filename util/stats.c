@@ -0,0 +1,217 @@
+/*
+ * Statistics registry for query-stats
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/queue.h"
+#include "qemu/stats.h"
+#include "qmp-commands.h"
+
+typedef struct StatsProvider {
+    char *name;
+    StatsProviderFunc *fn;
+    void *opaque;
+    QTAILQ_ENTRY(StatsProvider) next;
+} StatsProvider;
+
+static QTAILQ_HEAD(, StatsProvider) stats_providers =
+    QTAILQ_HEAD_INITIALIZER(stats_providers);
+
+struct StatsCollector {
+    /* Compiled filters, NULL to match everything */
+    GPtrArray *instances;
+    GPtrArray *names;
+
+    const char *provider;
+    /* The current instance, NULL if it is filtered out */
+    char *instance;
+    /* Created when the first statistic of the instance is added */
+    StatsResult *result;
+    StatList **stats_tail;
+    StatsResultList **tail;
+};
+
+void stats_register_provider(const char *name, StatsProviderFunc *fn,
+                             void *opaque)
+{
+    StatsProvider *p = g_new0(StatsProvider, 1);
+
+    p->name = g_strdup(name);
+    p->fn = fn;
+    p->opaque = opaque;
+    QTAILQ_INSERT_TAIL(&stats_providers, p, next);
+}
+
+static GPtrArray *stats_filter_new(strList *list)
+{
+    GPtrArray *filter;
+
+    if (!list) {
+        return NULL;
+    }
+    filter = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)g_pattern_spec_free);
+    for (; list; list = list->next) {
+        g_ptr_array_add(filter, g_pattern_spec_new(list->value));
+    }
+    return filter;
+}
+
+static void stats_filter_free(GPtrArray *filter)
+{
+    if (filter) {
+        g_ptr_array_free(filter, true);
+    }
+}
+
+static bool stats_filter_match(GPtrArray *filter, const char *str)
+{
+    guint i;
+
+    if (!filter) {
+        return true;
+    }
+    for (i = 0; i < filter->len; i++) {
+        if (g_pattern_match_string(g_ptr_array_index(filter, i), str)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool stats_begin_instance(StatsCollector *c, const char *instance)
+{
+    g_free(c->instance);
+    c->instance = NULL;
+    c->result = NULL;
+    if (stats_filter_match(c->instances, instance)) {
+        c->instance = g_strdup(instance);
+    }
+    return c->instance != NULL;
+}
+
+bool stats_wanted(StatsCollector *c, const char *name)
+{
+    return c->instance && stats_filter_match(c->names, name);
+}
+
+static Stat *stats_add(StatsCollector *c, const char *name, StatType type)
+{
+    StatList *elem;
+    Stat *stat;
+
+    if (!stats_wanted(c, name)) {
+        return NULL;
+    }
+
+    if (!c->result) {
+        StatsResultList *entry = g_new0(StatsResultList, 1);
+
+        c->result = g_new0(StatsResult, 1);
+        c->result->provider = g_strdup(c->provider);
+        c->result->instance = g_strdup(c->instance);
+        c->stats_tail = &c->result->stats;
+        entry->value = c->result;
+        *c->tail = entry;
+        c->tail = &entry->next;
+    }
+
+    stat = g_new0(Stat, 1);
+    stat->name = g_strdup(name);
+    stat->type = type;
+    elem = g_new0(StatList, 1);
+    elem->value = stat;
+    *c->stats_tail = elem;
+    c->stats_tail = &elem->next;
+    return stat;
+}
+
+void stats_add_counter(StatsCollector *c, const char *name, uint64_t value)
+{
+    Stat *stat = stats_add(c, name, STAT_TYPE_COUNTER);
+
+    if (stat) {
+        stat->u.counter.value = value;
+    }
+}
+
+void stats_add_gauge(StatsCollector *c, const char *name, int64_t value)
+{
+    Stat *stat = stats_add(c, name, STAT_TYPE_GAUGE);
+
+    if (stat) {
+        stat->u.gauge.value = value;
+    }
+}
+
+static uint64List *stats_uint64_list(const uint64_t *values, int n)
+{
+    uint64List *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64List *elem = g_new0(uint64List, 1);
+
+        elem->value = values[i];
+        *tail = elem;
+        tail = &elem->next;
+    }
+    return head;
+}
+
+void stats_add_histogram(StatsCollector *c, const char *name, int nbins,
+                         const uint64_t *boundaries, const uint64_t *bins)
+{
+    Stat *stat = stats_add(c, name, STAT_TYPE_HISTOGRAM);
+
+    if (stat) {
+        stat->u.histogram.boundaries = stats_uint64_list(boundaries,
+                                                         nbins - 1);
+        stat->u.histogram.bins = stats_uint64_list(bins, nbins);
+    }
+}
+
+StatsResultList *stats_query(strList *providers, strList *instances,
+                             strList *names)
+{
+    StatsResultList *head = NULL;
+    StatsCollector c = {
+        .instances = stats_filter_new(instances),
+        .names = stats_filter_new(names),
+        .tail = &head,
+    };
+    GPtrArray *provider_filter = stats_filter_new(providers);
+    StatsProvider *p;
+
+    QTAILQ_FOREACH(p, &stats_providers, next) {
+        if (!stats_filter_match(provider_filter, p->name)) {
+            continue;
+        }
+        c.provider = p->name;
+        p->fn(&c, p->opaque);
+        g_free(c.instance);
+        c.instance = NULL;
+        c.result = NULL;
+    }
+
+    stats_filter_free(provider_filter);
+    stats_filter_free(c.instances);
+    stats_filter_free(c.names);
+    return head;
+}
+
+StatsResultList *qmp_query_stats(bool has_providers, strList *providers,
+                                 bool has_instances, strList *instances,
+                                 bool has_names, strList *names,
+                                 Error **errp)
+{
+    return stats_query(has_providers ? providers : NULL,
+                       has_instances ? instances : NULL,
+                       has_names ? names : NULL);
+}
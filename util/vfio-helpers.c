@@ -0,0 +1,503 @@
+/*
+ * VFIO utility
+ *
+ * Copyright (C) 2016 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <linux/vfio.h>
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
+#include "qemu/vfio-helpers.h"
+#include "standard-headers/linux/pci_regs.h"
+#include "trace.h"
+
+#define QEMU_VFIO_IOVA_MIN 0x10000ULL
+/* VFIO does not report the IOVA width of the IOMMU; 39 bits are safe */
+#define QEMU_VFIO_IOVA_MAX (1ULL << 39)
+
+typedef struct {
+    uint8_t *host;
+    size_t size;
+    uint64_t iova;
+} IOVAMapping;
+
+struct QEMUVFIOState {
+    QemuMutex lock;
+
+    int container;
+    int group;
+    int device;
+    struct vfio_region_info config_region_info, bar_region_info[6];
+
+    /* Fixed mappings, sorted by host address.  Their IOVAs are allocated
+     * upwards from low_water_mark and never reused.
+     */
+    IOVAMapping *mappings;
+    int nr_mappings;
+    uint64_t low_water_mark;
+
+    /* Temporary mappings are allocated downwards from high_water_mark */
+    uint64_t high_water_mark;
+};
+
+static char *sysfs_find_group_file(const char *device, Error **errp)
+{
+    char *sysfs_link;
+    char *sysfs_group;
+    char *p;
+    char *path = NULL;
+
+    sysfs_link = g_strdup_printf("/sys/bus/pci/devices/%s/iommu_group",
+                                 device);
+    sysfs_group = g_malloc0(PATH_MAX);
+    if (readlink(sysfs_link, sysfs_group, PATH_MAX - 1) == -1) {
+        error_setg_errno(errp, errno, "Failed to find iommu group sysfs path");
+        goto out;
+    }
+    p = strrchr(sysfs_group, '/');
+    if (!p) {
+        error_setg(errp, "Failed to find iommu group number");
+        goto out;
+    }
+
+    path = g_strdup_printf("/dev/vfio/%s", p + 1);
+out:
+    g_free(sysfs_link);
+    g_free(sysfs_group);
+    return path;
+}
+
+static inline void assert_bar_index_valid(QEMUVFIOState *s, int index)
+{
+    assert(index >= 0 && index < ARRAY_SIZE(s->bar_region_info));
+}
+
+static int qemu_vfio_pci_init_bar(QEMUVFIOState *s, int index, Error **errp)
+{
+    int ret;
+
+    assert_bar_index_valid(s, index);
+    s->bar_region_info[index] = (struct vfio_region_info) {
+        .index = VFIO_PCI_BAR0_REGION_INDEX + index,
+        .argsz = sizeof(struct vfio_region_info),
+    };
+    if (ioctl(s->device, VFIO_DEVICE_GET_REGION_INFO,
+              &s->bar_region_info[index])) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to get BAR region info");
+        return ret;
+    }
+
+    return 0;
+}
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size,
+                            Error **errp)
+{
+    void *p;
+
+    assert_bar_index_valid(s, index);
+    assert(QEMU_IS_ALIGNED(offset, getpagesize()));
+    p = mmap(NULL, MIN(size, s->bar_region_info[index].size - offset),
+             PROT_READ | PROT_WRITE, MAP_SHARED,
+             s->device, s->bar_region_info[index].offset + offset);
+    if (p == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Failed to map BAR region");
+        p = NULL;
+    }
+    return p;
+}
+
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size)
+{
+    if (bar) {
+        munmap(bar, MIN(size, s->bar_region_info[index].size - offset));
+    }
+}
+
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    int ret;
+    struct vfio_irq_set *irq_set;
+    size_t irq_set_size;
+    struct vfio_irq_info irq_info = {
+        .argsz = sizeof(irq_info),
+        .index = irq_type,
+    };
+
+    if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to get device interrupt info");
+        return ret;
+    }
+    if (!(irq_info.flags & VFIO_IRQ_INFO_EVENTFD)) {
+        error_setg(errp, "Device interrupt doesn't support eventfd");
+        return -EINVAL;
+    }
+
+    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set = g_malloc0(irq_set_size);
+    *irq_set = (struct vfio_irq_set) {
+        .argsz = irq_set_size,
+        .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
+        .index = irq_info.index,
+        .start = 0,
+        .count = 1,
+    };
+    *(int *)&irq_set->data = event_notifier_get_fd(e);
+
+    ret = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
+    if (ret) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to setup device interrupt");
+    }
+    g_free(irq_set);
+    return ret;
+}
+
+static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,
+                                     int size, int ofs)
+{
+    int ret;
+
+    do {
+        ret = pread(s->device, buf, size, s->config_region_info.offset + ofs);
+    } while (ret == -1 && errno == EINTR);
+    return ret == size ? 0 : -errno;
+}
+
+static int qemu_vfio_pci_write_config(QEMUVFIOState *s, void *buf,
+                                      int size, int ofs)
+{
+    int ret;
+
+    do {
+        ret = pwrite(s->device, buf, size, s->config_region_info.offset + ofs);
+    } while (ret == -1 && errno == EINTR);
+    return ret == size ? 0 : -errno;
+}
+
+static int qemu_vfio_init_pci(QEMUVFIOState *s, const char *device,
+                              Error **errp)
+{
+    int ret;
+    int i;
+    uint16_t pci_cmd;
+    struct vfio_group_status group_status = { .argsz = sizeof(group_status) };
+    struct vfio_iommu_type1_info iommu_info = { .argsz = sizeof(iommu_info) };
+    struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
+    char *group_file;
+
+    s->device = -1;
+
+    /* Every device gets its own container, and thus its own IOVA space */
+    s->container = open("/dev/vfio/vfio", O_RDWR);
+    if (s->container == -1) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to open /dev/vfio/vfio");
+        return ret;
+    }
+    if (ioctl(s->container, VFIO_GET_API_VERSION) != VFIO_API_VERSION) {
+        error_setg(errp, "Invalid VFIO version");
+        ret = -EINVAL;
+        goto fail_container;
+    }
+    if (!ioctl(s->container, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
+        error_setg(errp, "VFIO type1 IOMMU is not supported");
+        ret = -EINVAL;
+        goto fail_container;
+    }
+
+    group_file = sysfs_find_group_file(device, errp);
+    if (!group_file) {
+        ret = -EINVAL;
+        goto fail_container;
+    }
+    s->group = open(group_file, O_RDWR);
+    if (s->group == -1) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to open VFIO group file %s",
+                         group_file);
+        g_free(group_file);
+        goto fail_container;
+    }
+    g_free(group_file);
+
+    if (ioctl(s->group, VFIO_GROUP_GET_STATUS, &group_status)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to get VFIO group status");
+        goto fail;
+    }
+    if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+        error_setg(errp, "VFIO group is not viable; are all devices in the "
+                   "IOMMU group bound to vfio-pci?");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (ioctl(s->group, VFIO_GROUP_SET_CONTAINER, &s->container)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to add group to VFIO container");
+        goto fail;
+    }
+    if (ioctl(s->container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to set VFIO IOMMU type");
+        goto fail;
+    }
+    if (ioctl(s->container, VFIO_IOMMU_GET_INFO, &iommu_info)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to get IOMMU info");
+        goto fail;
+    }
+
+    s->device = ioctl(s->group, VFIO_GROUP_GET_DEVICE_FD, device);
+    if (s->device < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to get device fd");
+        goto fail;
+    }
+    if (ioctl(s->device, VFIO_DEVICE_GET_INFO, &device_info)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to get device info");
+        goto fail;
+    }
+    if (device_info.num_regions < VFIO_PCI_CONFIG_REGION_INDEX) {
+        error_setg(errp, "Invalid device regions");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->config_region_info = (struct vfio_region_info) {
+        .index = VFIO_PCI_CONFIG_REGION_INDEX,
+        .argsz = sizeof(struct vfio_region_info),
+    };
+    if (ioctl(s->device, VFIO_DEVICE_GET_REGION_INFO,
+              &s->config_region_info)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to get config region info");
+        goto fail;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(s->bar_region_info); i++) {
+        ret = qemu_vfio_pci_init_bar(s, i, errp);
+        if (ret) {
+            goto fail;
+        }
+    }
+
+    ret = qemu_vfio_pci_read_config(s, &pci_cmd, sizeof(pci_cmd),
+                                    PCI_COMMAND);
+    if (!ret) {
+        pci_cmd |= cpu_to_le16(PCI_COMMAND_MASTER);
+        ret = qemu_vfio_pci_write_config(s, &pci_cmd, sizeof(pci_cmd),
+                                         PCI_COMMAND);
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret, "Failed to enable bus mastering");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (s->device >= 0) {
+        close(s->device);
+    }
+    close(s->group);
+fail_container:
+    close(s->container);
+    return ret;
+}
+
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
+{
+    QEMUVFIOState *s = g_new0(QEMUVFIOState, 1);
+
+    if (qemu_vfio_init_pci(s, device, errp)) {
+        g_free(s);
+        return NULL;
+    }
+    qemu_mutex_init(&s->lock);
+    s->low_water_mark = QEMU_VFIO_IOVA_MIN;
+    s->high_water_mark = QEMU_VFIO_IOVA_MAX;
+    return s;
+}
+
+/* Return the index of the last fixed mapping starting at or below @host,
+ * or -1 if there is none.
+ */
+static int qemu_vfio_find_index(QEMUVFIOState *s, uint8_t *host)
+{
+    int lo = 0, hi = s->nr_mappings;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (s->mappings[mid].host <= host) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, uint8_t *host,
+                                           int *index)
+{
+    int i = qemu_vfio_find_index(s, host);
+
+    *index = i;
+    if (i >= 0 && host < s->mappings[i].host + s->mappings[i].size) {
+        return &s->mappings[i];
+    }
+    return NULL;
+}
+
+static int qemu_vfio_do_mapping(QEMUVFIOState *s, void *host, size_t size,
+                                uint64_t iova)
+{
+    struct vfio_iommu_type1_dma_map dma_map = {
+        .argsz = sizeof(dma_map),
+        .flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+        .vaddr = (uintptr_t)host,
+        .iova = iova,
+        .size = size,
+    };
+
+    trace_qemu_vfio_do_mapping(s, host, size, iova);
+    if (ioctl(s->container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+        int ret = -errno;
+        error_report("VFIO_IOMMU_MAP_DMA failed: %s", strerror(-ret));
+        return ret;
+    }
+    return 0;
+}
+
+static void qemu_vfio_undo_mapping(QEMUVFIOState *s, uint64_t iova,
+                                   uint64_t size)
+{
+    struct vfio_iommu_type1_dma_unmap unmap = {
+        .argsz = sizeof(unmap),
+        .flags = 0,
+        .iova = iova,
+        .size = size,
+    };
+
+    if (size && ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
+        error_report("VFIO_IOMMU_UNMAP_DMA failed: %s", strerror(errno));
+    }
+}
+
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova)
+{
+    uint8_t *p = host;
+    IOVAMapping *mapping;
+    uint64_t iova0 = 0;
+    int index;
+    int ret = 0;
+
+    assert(QEMU_PTR_IS_ALIGNED(host, getpagesize()));
+    assert(QEMU_IS_ALIGNED(size, getpagesize()));
+
+    qemu_mutex_lock(&s->lock);
+    mapping = qemu_vfio_find_mapping(s, p, &index);
+    if (mapping && p + size <= mapping->host + mapping->size) {
+        iova0 = mapping->iova + (p - mapping->host);
+    } else if (s->high_water_mark - s->low_water_mark < size) {
+        ret = -ENOMEM;
+    } else if (temporary) {
+        iova0 = s->high_water_mark - size;
+        ret = qemu_vfio_do_mapping(s, host, size, iova0);
+        if (!ret) {
+            s->high_water_mark = iova0;
+        }
+    } else {
+        iova0 = s->low_water_mark;
+        ret = qemu_vfio_do_mapping(s, host, size, iova0);
+        if (!ret) {
+            index++;
+            s->mappings = g_renew(IOVAMapping, s->mappings,
+                                  s->nr_mappings + 1);
+            memmove(&s->mappings[index + 1], &s->mappings[index],
+                    (s->nr_mappings - index) * sizeof(IOVAMapping));
+            s->mappings[index] = (IOVAMapping) {
+                .host = p,
+                .size = size,
+                .iova = iova0,
+            };
+            s->nr_mappings++;
+            s->low_water_mark += size;
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    if (!ret && iova) {
+        *iova = iova0;
+    }
+    return ret;
+}
+
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
+{
+    IOVAMapping *mapping;
+    int index;
+
+    if (!host) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    mapping = qemu_vfio_find_mapping(s, host, &index);
+    if (!mapping || mapping->host != host) {
+        error_report("Cannot find VFIO mapping for %p", host);
+    } else {
+        qemu_vfio_undo_mapping(s, mapping->iova, mapping->size);
+        memmove(&s->mappings[index], &s->mappings[index + 1],
+                (s->nr_mappings - index - 1) * sizeof(IOVAMapping));
+        s->nr_mappings--;
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
+{
+    qemu_mutex_lock(&s->lock);
+    trace_qemu_vfio_dma_reset_temporary(s, s->high_water_mark);
+    qemu_vfio_undo_mapping(s, s->high_water_mark,
+                           QEMU_VFIO_IOVA_MAX - s->high_water_mark);
+    s->high_water_mark = QEMU_VFIO_IOVA_MAX;
+    qemu_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void qemu_vfio_close(QEMUVFIOState *s)
+{
+    int i;
+
+    if (!s) {
+        return;
+    }
+    for (i = 0; i < s->nr_mappings; i++) {
+        qemu_vfio_undo_mapping(s, s->mappings[i].iova, s->mappings[i].size);
+    }
+    qemu_vfio_undo_mapping(s, s->high_water_mark,
+                           QEMU_VFIO_IOVA_MAX - s->high_water_mark);
+    g_free(s->mappings);
+    close(s->device);
+    close(s->group);
+    close(s->container);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s);
+}
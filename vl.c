@@ -539,6 +539,11 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "timeout",
             .type = QEMU_OPT_NUMBER,
             .help = "Request timeout in seconds (default 0 = no timeout)",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions used for reads and writes "
+                    "(default 1)",
         },
         { /* end of list */ }
     },
@@ -746,6 +751,64 @@ StatusInfo *qmp_query_status(Error **errp)
     return info;
 }
 
+/*
+ * Startup profile for query-startup-profile.  Each step of main() ends
+ * where the next one begins; the steps for single -device options are
+ * recorded inside the "devices" step.
+ */
+typedef struct StartupStep {
+    char *name;
+    int64_t start;
+    int64_t duration;
+} StartupStep;
+
+static int64_t startup_time;
+static int64_t startup_step_start;
+static GArray *startup_steps;
+
+static void startup_profile_add(const char *name, int64_t start, int64_t end)
+{
+    StartupStep step = {
+        .name = g_strdup(name),
+        .start = start - startup_time,
+        .duration = end - start,
+    };
+
+    if (!startup_steps) {
+        startup_steps = g_array_new(false, false, sizeof(StartupStep));
+    }
+    g_array_append_val(startup_steps, step);
+}
+
+/* End the current step of startup, calling it @name */
+static void startup_profile_mark(const char *name)
+{
+    int64_t now = get_clock();
+
+    startup_profile_add(name, startup_step_start, now);
+    startup_step_start = now;
+}
+
+StartupPhaseList *qmp_query_startup_profile(Error **errp)
+{
+    StartupPhaseList *head = NULL, **tail = &head;
+    guint i;
+
+    for (i = 0; startup_steps && i < startup_steps->len; i++) {
+        StartupStep *step = &g_array_index(startup_steps, StartupStep, i);
+        StartupPhaseList *entry = g_new0(StartupPhaseList, 1);
+
+        entry->value = g_new0(StartupPhase, 1);
+        entry->value->name = g_strdup(step->name);
+        entry->value->start_ns = step->start;
+        entry->value->duration_ns = step->duration;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 static bool qemu_vmstop_requested(RunState *r)
 {
     qemu_mutex_lock(&vmstop_lock);
@@ -2355,12 +2418,22 @@ static int device_init_func(void *opaque, QemuOpts *opts, Error **errp)
 {
     Error *err = NULL;
     DeviceState *dev;
+    int64_t start = get_clock();
+    const char *id;
+    char *name;
 
     dev = qdev_device_add(opts, &err);
     if (!dev) {
         error_report_err(err);
         return -1;
     }
+
+    id = qemu_opts_id(opts);
+    name = g_strdup_printf("device:%s",
+                           id ? id : qemu_opt_get(opts, "driver"));
+    startup_profile_add(name, start, get_clock());
+    g_free(name);
+
     object_unref(OBJECT(dev));
     return 0;
 }
@@ -3024,6 +3097,8 @@ int main(int argc, char **argv, char **envp)
     Error *err = NULL;
     bool list_data_dirs = false;
 
+    startup_time = startup_step_start = get_clock();
+
     qemu_init_cpu_list();
     qemu_init_cpu_loop();
     qemu_mutex_lock_iothread();
@@ -4058,6 +4133,7 @@ int main(int argc, char **argv, char **envp)
         error_report_err(main_loop_err);
         exit(1);
     }
+    startup_profile_mark("parse-options");
 
     if (qemu_opts_foreach(qemu_find_opts("sandbox"),
                           parse_sandbox, NULL, NULL)) {
@@ -4338,7 +4414,9 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    startup_profile_mark("backends");
     configure_accelerator(current_machine);
+    startup_profile_mark("accelerator");
 
     if (qtest_chrdev) {
         qtest_init(qtest_chrdev, qtest_log, &error_fatal);
@@ -4472,6 +4550,7 @@ int main(int argc, char **argv, char **envp)
                   CDROM_OPTS);
     default_drive(default_floppy, snapshot, IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, IF_SD, 0, SD_OPTS);
+    startup_profile_mark("drives");
 
     parse_numa_opts(machine_class);
 
@@ -4538,6 +4617,7 @@ int main(int argc, char **argv, char **envp)
     cpu_synchronize_all_post_init();
 
     numa_post_machine_init();
+    startup_profile_mark("machine-init");
 
     if (qemu_opts_foreach(qemu_find_opts("fw_cfg"),
                           parse_fw_cfg, fw_cfg_find(), NULL) != 0) {
@@ -4560,6 +4640,7 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     rom_reset_order_override();
+    startup_profile_mark("devices");
 
     /* Did we create any drives that we failed to create a device for? */
     drive_check_orphaned();
@@ -4620,6 +4701,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     qdev_machine_creation_done();
+    startup_profile_mark("frontends");
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
@@ -4630,6 +4712,7 @@ int main(int argc, char **argv, char **envp)
         error_report("rom check and register reset failed");
         exit(1);
     }
+    startup_profile_mark("machine-done");
 
     replay_start();
 
@@ -4644,6 +4727,7 @@ int main(int argc, char **argv, char **envp)
             autostart = 0;
         }
     }
+    startup_profile_mark("reset");
 
     qdev_prop_check_globals();
     if (vmstate_dump_file) {
@@ -4662,6 +4746,7 @@ int main(int argc, char **argv, char **envp)
     } else if (autostart) {
         vm_start();
     }
+    startup_profile_mark("start");
 
     os_setup_post();
 
@@ -19,6 +19,7 @@
 #include <xen/hvm/params.h>
 
 #include "sysemu/xen-mapcache.h"
+#include "qemu/stats.h"
 #include "trace.h"
 
 
@@ -52,7 +53,7 @@ typedef struct MapCacheEntry {
     hwaddr paddr_index;
     uint8_t *vaddr_base;
     unsigned long *valid_mapping;
-    uint8_t lock;
+    unsigned int lock;
     hwaddr size;
     struct MapCacheEntry *next;
 } MapCacheEntry;
@@ -61,13 +62,16 @@ typedef struct MapCacheRev {
     uint8_t *vaddr_req;
     hwaddr paddr_index;
     hwaddr size;
-    QTAILQ_ENTRY(MapCacheRev) next;
+    unsigned int count;         /* Number of locks taken on vaddr_req */
 } MapCacheRev;
 
 typedef struct MapCache {
     MapCacheEntry *entry;
     unsigned long nr_buckets;
-    QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
+    /* MapCacheRev indexed by vaddr_req; with one in-flight DMA mapping per
+     * request, a list is too slow to search for each unmap.
+     */
+    GHashTable *locked_entries;
 
     /* For most cases (>99.9%), the page address is the same. */
     MapCacheEntry *last_entry;
@@ -77,6 +81,12 @@ typedef struct MapCache {
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     QemuMutex lock;
     void *opaque;
+
+    /* Statistics, for query-stats */
+    uint64_t lookups;
+    uint64_t remaps;
+    uint64_t chained;
+    uint64_t nr_locked;
 } MapCache;
 
 static MapCache *mapcache;
@@ -91,6 +101,19 @@ static inline void mapcache_unlock(void)
     qemu_mutex_unlock(&mapcache->lock);
 }
 
+static void xen_map_cache_stats(StatsCollector *c, void *opaque)
+{
+    if (!stats_begin_instance(c, "mapcache")) {
+        return;
+    }
+    mapcache_lock();
+    stats_add_counter(c, "lookups", mapcache->lookups);
+    stats_add_counter(c, "remaps", mapcache->remaps);
+    stats_add_counter(c, "chained-entries", mapcache->chained);
+    stats_add_gauge(c, "locked-mappings", mapcache->nr_locked);
+    mapcache_unlock();
+}
+
 static inline int test_bits(int nr, int size, const unsigned long *addr)
 {
     unsigned long res = find_next_zero_bit(addr, size + nr, nr);
@@ -111,7 +134,9 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     mapcache->opaque = opaque;
     qemu_mutex_init(&mapcache->lock);
 
-    QTAILQ_INIT(&mapcache->locked_entries);
+    mapcache->locked_entries = g_hash_table_new_full(g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL, g_free);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -145,6 +170,7 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     DPRINTF("%s, nr_buckets = %lx size %lu\n", __func__,
             mapcache->nr_buckets, size);
     mapcache->entry = g_malloc0(size);
+    stats_register_provider("xen-mapcache", xen_map_cache_stats, NULL);
 }
 
 static void xen_remap_bucket(MapCacheEntry *entry,
@@ -158,6 +184,7 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     hwaddr nb_pfn = size >> XC_PAGE_SHIFT;
 
     trace_xen_remap_bucket(address_index);
+    mapcache->remaps++;
 
     pfns = g_malloc0(nb_pfn * sizeof (xen_pfn_t));
     err = g_malloc0(nb_pfn * sizeof (int));
@@ -214,6 +241,7 @@ tryagain:
     address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
 
     trace_xen_map_cache(phys_addr);
+    mapcache->lookups++;
 
     /* test_bit_size is always a multiple of XC_PAGE_SIZE */
     if (size) {
@@ -248,8 +276,13 @@ tryagain:
 
     entry = &mapcache->entry[address_index % mapcache->nr_buckets];
 
+    /*
+     * An entry mapping more than needed will do, so that the large
+     * mappings of a multi-bucket DMA can be reused by the smaller ones
+     * that follow it.
+     */
     while (entry && entry->lock && entry->vaddr_base &&
-            (entry->paddr_index != address_index || entry->size != cache_size ||
+            (entry->paddr_index != address_index || entry->size < cache_size ||
              !test_bits(address_offset >> XC_PAGE_SHIFT,
                  test_bit_size >> XC_PAGE_SHIFT,
                  entry->valid_mapping))) {
@@ -259,10 +292,11 @@ tryagain:
     if (!entry) {
         entry = g_malloc0(sizeof (MapCacheEntry));
         pentry->next = entry;
+        mapcache->chained++;
         xen_remap_bucket(entry, cache_size, address_index);
     } else if (!entry->lock) {
         if (!entry->vaddr_base || entry->paddr_index != address_index ||
-                entry->size != cache_size ||
+                entry->size < cache_size ||
                 !test_bits(address_offset >> XC_PAGE_SHIFT,
                     test_bit_size >> XC_PAGE_SHIFT,
                     entry->valid_mapping)) {
@@ -285,12 +319,23 @@ tryagain:
 
     mapcache->last_entry = entry;
     if (lock) {
-        MapCacheRev *reventry = g_malloc0(sizeof(MapCacheRev));
+        uint8_t *vaddr_req = entry->vaddr_base + address_offset;
+        MapCacheRev *reventry = g_hash_table_lookup(mapcache->locked_entries,
+                                                    vaddr_req);
+
         entry->lock++;
-        reventry->vaddr_req = mapcache->last_entry->vaddr_base + address_offset;
-        reventry->paddr_index = mapcache->last_entry->paddr_index;
-        reventry->size = entry->size;
-        QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
+        mapcache->nr_locked++;
+        if (reventry) {
+            /* vaddr_req identifies the entry, so it is the same one */
+            reventry->count++;
+        } else {
+            reventry = g_new0(MapCacheRev, 1);
+            reventry->vaddr_req = vaddr_req;
+            reventry->paddr_index = entry->paddr_index;
+            reventry->size = entry->size;
+            reventry->count = 1;
+            g_hash_table_insert(mapcache->locked_entries, vaddr_req, reventry);
+        }
     }
 
     trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
@@ -315,26 +360,16 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     hwaddr paddr_index;
     hwaddr size;
     ram_addr_t raddr;
-    int found = 0;
 
     mapcache_lock();
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        if (reventry->vaddr_req == ptr) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+    reventry = g_hash_table_lookup(mapcache->locked_entries, ptr);
+    if (!reventry) {
         fprintf(stderr, "%s, could not find %p\n", __func__, ptr);
-        QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-            DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index,
-                    reventry->vaddr_req);
-        }
         abort();
         return 0;
     }
+    paddr_index = reventry->paddr_index;
+    size = reventry->size;
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
     while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
@@ -357,25 +392,18 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
-    int found = 0;
-
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        if (reventry->vaddr_req == buffer) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+
+    reventry = g_hash_table_lookup(mapcache->locked_entries, buffer);
+    if (!reventry) {
         DPRINTF("%s, could not find %p\n", __func__, buffer);
-        QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-            DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index, reventry->vaddr_req);
-        }
         return;
     }
-    QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
-    g_free(reventry);
+    paddr_index = reventry->paddr_index;
+    size = reventry->size;
+    mapcache->nr_locked--;
+    if (--reventry->count == 0) {
+        g_hash_table_remove(mapcache->locked_entries, buffer);
+    }
 
     if (mapcache->last_entry != NULL &&
         mapcache->last_entry->paddr_index == paddr_index) {
@@ -415,18 +443,24 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
 void xen_invalidate_map_cache(void)
 {
     unsigned long i;
+#ifdef MAPCACHE_DEBUG
+    GHashTableIter iter;
     MapCacheRev *reventry;
+#endif
 
     /* Flush pending AIO before destroying the mapcache */
     bdrv_drain_all();
 
     mapcache_lock();
 
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
+#ifdef MAPCACHE_DEBUG
+    g_hash_table_iter_init(&iter, mapcache->locked_entries);
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&reventry)) {
         DPRINTF("There should be no locked mappings at this time, "
                 "but "TARGET_FMT_plx" -> %p is present\n",
                 reventry->paddr_index, reventry->vaddr_req);
     }
+#endif
 
     for (i = 0; i < mapcache->nr_buckets; i++) {
         MapCacheEntry *entry = &mapcache->entry[i];